@@ -44,7 +44,9 @@
 #include "libusbi.h"
 #include "hotplug.h"
 
-#if defined(OS_LINUX)
+#if defined(OS_MOCK)
+const struct usbi_os_backend * const usbi_backend = &mock_backend;
+#elif defined(OS_LINUX)
 const struct usbi_os_backend * const usbi_backend = &linux_usbfs_backend;
 #elif defined(OS_SOLARIS)
 const struct usbi_os_backend * const usbi_backend = &solaris_backend;
@@ -70,6 +72,8 @@ static const struct libusb_version libusb_version_internal =
 	  LIBUSB_RC, "http://libusb.info" };
 static int default_context_refcnt = 0;
 static usbi_mutex_static_t default_context_lock = USBI_MUTEX_INITIALIZER;
+/* set by libusb_set_device_discovery(), protected by default_context_lock */
+static int no_device_discovery = 0;
 static struct timeval timestamp_origin = { 0, 0 };
 
 usbi_mutex_static_t active_contexts_lock = USBI_MUTEX_INITIALIZER;
@@ -611,18 +615,54 @@ static struct discovered_devs *discovered_devs_alloc(void)
 	if (ret) {
 		ret->len = 0;
 		ret->capacity = DISCOVERED_DEVICES_SIZE_STEP;
+		ret->filter = NULL;
 	}
 	return ret;
 }
 
+static int device_matches_filter(struct libusb_device *dev,
+	const struct libusb_device_filter *filter)
+{
+	struct libusb_device_descriptor *desc = &dev->device_descriptor;
+	uint8_t port_numbers[8];
+	int r;
+
+	if (filter->vendor_id != LIBUSB_DEVICE_FILTER_ANY &&
+			filter->vendor_id != desc->idVendor)
+		return 0;
+	if (filter->product_id != LIBUSB_DEVICE_FILTER_ANY &&
+			filter->product_id != desc->idProduct)
+		return 0;
+	if (filter->dev_class != LIBUSB_DEVICE_FILTER_ANY &&
+			filter->dev_class != desc->bDeviceClass)
+		return 0;
+	if (filter->bus_number != LIBUSB_DEVICE_FILTER_ANY &&
+			filter->bus_number != dev->bus_number)
+		return 0;
+	if (filter->port_numbers_len > 0) {
+		if (filter->port_numbers_len > (int)sizeof(port_numbers))
+			return 0;
+		r = libusb_get_port_numbers(dev, port_numbers,
+			sizeof(port_numbers));
+		if (r != filter->port_numbers_len ||
+				memcmp(port_numbers, filter->port_numbers, r))
+			return 0;
+	}
+	return 1;
+}
+
 /* append a device to the discovered devices collection. may realloc itself,
- * returning new discdevs. returns NULL on realloc failure. */
+ * returning new discdevs. returns NULL on realloc failure. devices that
+ * don't match the filter of the collection are silently left out. */
 struct discovered_devs *discovered_devs_append(
 	struct discovered_devs *discdevs, struct libusb_device *dev)
 {
 	size_t len = discdevs->len;
 	size_t capacity;
 
+	if (discdevs->filter && !device_matches_filter(dev, discdevs->filter))
+		return discdevs;
+
 	/* if there is space, just append the device */
 	if (len < discdevs->capacity) {
 		discdevs->devices[len] = libusb_ref_device(dev);
@@ -654,6 +694,97 @@ static void discovered_devs_free(struct discovered_devs *discdevs)
 	free(discdevs);
 }
 
+/* An immutable, NULL-terminated list of devices that is shared between all
+ * the callers of libusb_get_device_snapshot() for as long as the devices of
+ * the context stay the same. The list holds a reference to each device. The
+ * context keeps a reference to its most recent snapshot. refcnt is protected
+ * by the usb_devs_lock of the context. */
+struct usbi_device_snapshot {
+	struct libusb_context *ctx;
+	int refcnt;
+	unsigned int generation;
+	ssize_t len;
+	/* followed by len + 1 device pointers */
+};
+
+#define DEVICE_SNAPSHOT_DEVICES(snapshot) \
+	((struct libusb_device **)((snapshot) + 1))
+#define DEVICES_TO_DEVICE_SNAPSHOT(devices) \
+	((struct usbi_device_snapshot *)(devices) - 1)
+
+static struct usbi_device_snapshot *device_snapshot_alloc(
+	struct libusb_context *ctx, struct discovered_devs *discdevs)
+{
+	struct usbi_device_snapshot *snapshot;
+	struct libusb_device **devices;
+	size_t i;
+
+	snapshot = malloc(sizeof(*snapshot) +
+		(discdevs->len + 1) * sizeof(struct libusb_device *));
+	if (!snapshot)
+		return NULL;
+
+	snapshot->ctx = ctx;
+	snapshot->refcnt = 1;
+	snapshot->generation = 0;
+	snapshot->len = discdevs->len;
+	devices = DEVICE_SNAPSHOT_DEVICES(snapshot);
+	for (i = 0; i < discdevs->len; i++)
+		devices[i] = libusb_ref_device(discdevs->devices[i]);
+	devices[discdevs->len] = NULL;
+	return snapshot;
+}
+
+static void device_snapshot_unref(struct usbi_device_snapshot *snapshot)
+{
+	struct libusb_context *ctx;
+	struct libusb_device **devices;
+	int refcnt;
+
+	if (!snapshot)
+		return;
+
+	ctx = snapshot->ctx;
+	usbi_mutex_lock(&ctx->usb_devs_lock);
+	refcnt = --snapshot->refcnt;
+	usbi_mutex_unlock(&ctx->usb_devs_lock);
+	if (refcnt > 0)
+		return;
+
+	for (devices = DEVICE_SNAPSHOT_DEVICES(snapshot); *devices; devices++)
+		libusb_unref_device(*devices);
+	free(snapshot);
+}
+
+/* Note that the devices of the context changed. Must be called with the
+ * usb_devs_lock held. Returns the snapshot the context no longer holds on
+ * to, for the caller to unref once it has dropped the lock.
+ *
+ * Without hotplug support the devices of a snapshot are only detached once
+ * the snapshot itself is gone, and libusb_get_device_snapshot() compares the
+ * snapshot against each scan of the bus, so there's nothing to do. */
+static struct usbi_device_snapshot *usb_devs_changed(
+	struct libusb_context *ctx)
+{
+	struct usbi_device_snapshot *snapshot = ctx->device_snapshot;
+
+	if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG))
+		return NULL;
+
+	ctx->usb_devs_generation++;
+	ctx->device_snapshot = NULL;
+	return snapshot;
+}
+
+/* the bucket of usb_devs_by_session holding the devices with this session
+ * ID */
+static struct list_head *devs_for_session(struct libusb_context *ctx,
+	unsigned long session_id)
+{
+	return &ctx->usb_devs_by_session[usbi_session_bucket(session_id,
+		USBI_SESSION_BUCKETS)];
+}
+
 /* Allocate a new device with a specific session ID. The returned device has
  * a reference count of 1. */
 struct libusb_device *usbi_alloc_device(struct libusb_context *ctx,
@@ -687,12 +818,16 @@ struct libusb_device *usbi_alloc_device(struct libusb_context *ctx,
 void usbi_connect_device(struct libusb_device *dev)
 {
 	struct libusb_context *ctx = DEVICE_CTX(dev);
+	struct usbi_device_snapshot *snapshot;
 
 	dev->attached = 1;
 
 	usbi_mutex_lock(&dev->ctx->usb_devs_lock);
 	list_add(&dev->list, &dev->ctx->usb_devs);
+	list_add(&dev->session_list, devs_for_session(ctx, dev->session_data));
+	snapshot = usb_devs_changed(ctx);
 	usbi_mutex_unlock(&dev->ctx->usb_devs_lock);
+	device_snapshot_unref(snapshot);
 
 	/* Signal that an event has occurred for this device if we support hotplug AND
 	 * the hotplug message list is ready. This prevents an event from getting raised
@@ -705,14 +840,20 @@ void usbi_connect_device(struct libusb_device *dev)
 void usbi_disconnect_device(struct libusb_device *dev)
 {
 	struct libusb_context *ctx = DEVICE_CTX(dev);
+	struct usbi_device_snapshot *snapshot;
 
 	usbi_mutex_lock(&dev->lock);
 	dev->attached = 0;
 	usbi_mutex_unlock(&dev->lock);
+	usbi_device_free_string_cache(dev);
+	usbi_device_free_config_cache(dev);
 
 	usbi_mutex_lock(&ctx->usb_devs_lock);
 	list_del(&dev->list);
+	list_del(&dev->session_list);
+	snapshot = usb_devs_changed(ctx);
 	usbi_mutex_unlock(&ctx->usb_devs_lock);
+	device_snapshot_unref(snapshot);
 
 	/* Signal that an event has occurred for this device if we support hotplug AND
 	 * the hotplug message list is ready. This prevents an event from getting raised
@@ -756,7 +897,8 @@ struct libusb_device *usbi_get_device_by_session_id(struct libusb_context *ctx,
 	struct libusb_device *ret = NULL;
 
 	usbi_mutex_lock(&ctx->usb_devs_lock);
-	list_for_each_entry(dev, &ctx->usb_devs, list, struct libusb_device)
+	list_for_each_entry(dev, devs_for_session(ctx, session_id), session_list,
+			struct libusb_device)
 		if (dev->session_data == session_id) {
 			ret = libusb_ref_device(dev);
 			break;
@@ -766,40 +908,22 @@ struct libusb_device *usbi_get_device_by_session_id(struct libusb_context *ctx,
 	return ret;
 }
 
-/** @ingroup dev
- * Returns a list of USB devices currently attached to the system. This is
- * your entry point into finding a USB device to operate.
- *
- * You are expected to unreference all the devices when you are done with
- * them, and then free the list with libusb_free_device_list(). Note that
- * libusb_free_device_list() can unref all the devices for you. Be careful
- * not to unreference a device you are about to open until after you have
- * opened it.
- *
- * This return value of this function indicates the number of devices in
- * the resultant list. The list is actually one element larger, as it is
- * NULL-terminated.
- *
- * \param ctx the context to operate on, or NULL for the default context
- * \param list output location for a list of devices. Must be later freed with
- * libusb_free_device_list().
- * \returns the number of devices in the outputted list, or any
- * \ref libusb_error according to errors encountered by the backend.
- */
-ssize_t API_EXPORTED libusb_get_device_list(libusb_context *ctx,
-	libusb_device ***list)
+static ssize_t get_device_list(struct libusb_context *ctx,
+	const struct libusb_device_filter *filter, libusb_device ***list)
 {
 	struct discovered_devs *discdevs = discovered_devs_alloc();
 	struct libusb_device **ret;
 	int r = 0;
 	ssize_t i, len;
-	USBI_GET_CONTEXT(ctx);
-	usbi_dbg("");
 
 	if (!discdevs)
 		return LIBUSB_ERROR_NO_MEM;
+	discdevs->filter = filter;
 
-	if (libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+	if (ctx->no_device_discovery) {
+		/* the devices of the system are unknown, and wrapped devices
+		 * are not listed */
+	} else if (libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
 		/* backend provides hotplug support */
 		struct libusb_device *dev;
 
@@ -842,10 +966,72 @@ ssize_t API_EXPORTED libusb_get_device_list(libusb_context *ctx,
 	*list = ret;
 
 out:
-	discovered_devs_free(discdevs);
+	if (discdevs)
+		discovered_devs_free(discdevs);
 	return len;
 }
 
+/** \ingroup dev
+ * Returns a list of USB devices currently attached to the system. This is
+ * your entry point into finding a USB device to operate.
+ *
+ * You are expected to unreference all the devices when you are done with
+ * them, and then free the list with libusb_free_device_list(). Note that
+ * libusb_free_device_list() can unref all the devices for you. Be careful
+ * not to unreference a device you are about to open until after you have
+ * opened it.
+ *
+ * This return value of this function indicates the number of devices in
+ * the resultant list. The list is actually one element larger, as it is
+ * NULL-terminated.
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \param list output location for a list of devices. Must be later freed with
+ * libusb_free_device_list().
+ * \returns the number of devices in the outputted list, or any
+ * \ref libusb_error according to errors encountered by the backend.
+ */
+ssize_t API_EXPORTED libusb_get_device_list(libusb_context *ctx,
+	libusb_device ***list)
+{
+	USBI_GET_CONTEXT(ctx);
+	usbi_dbg("");
+
+	return get_device_list(ctx, NULL, list);
+}
+
+/** \ingroup dev
+ * Returns a list of the USB devices currently attached to the system that
+ * match a filter. This works like libusb_get_device_list(), and the list
+ * must be freed the same way, but devices that don't match the filter are
+ * left out as they are discovered. No reference is taken to them and they
+ * don't take up space in the list, so this is cheaper than fetching the
+ * full list and then checking the descriptor of each device.
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \param filter the criteria the devices must match
+ * \param list output location for a list of devices. Must be later freed with
+ * libusb_free_device_list().
+ * \returns the number of devices in the outputted list, or any
+ * \ref libusb_error according to errors encountered by the backend.
+ * \returns LIBUSB_ERROR_INVALID_PARAM if the filter is missing or its port
+ * numbers are invalid
+ */
+ssize_t API_EXPORTED libusb_get_device_list_filtered(libusb_context *ctx,
+	const struct libusb_device_filter *filter, libusb_device ***list)
+{
+	USBI_GET_CONTEXT(ctx);
+	usbi_dbg("");
+
+	if (!filter || filter->port_numbers_len < 0 ||
+			(filter->port_numbers_len > 0 && !filter->port_numbers))
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	return get_device_list(ctx, filter, list);
+}
+
 /** \ingroup dev
  * Frees a list of devices previously discovered using
  * libusb_get_device_list(). If the unref_devices parameter is set, the
@@ -869,6 +1055,154 @@ void API_EXPORTED libusb_free_device_list(libusb_device **list,
 	free(list);
 }
 
+/* whether a snapshot lists exactly the devices that were just discovered */
+static int device_snapshot_matches(struct usbi_device_snapshot *snapshot,
+	struct discovered_devs *discdevs)
+{
+	struct libusb_device **devices = DEVICE_SNAPSHOT_DEVICES(snapshot);
+	size_t i;
+
+	if ((size_t) snapshot->len != discdevs->len)
+		return 0;
+	for (i = 0; i < discdevs->len; i++)
+		if (devices[i] != discdevs->devices[i])
+			return 0;
+	return 1;
+}
+
+/** \ingroup dev
+ * Returns a snapshot of the USB devices currently attached to the system.
+ * This works like libusb_get_device_list(), but the list is shared: as long
+ * as no device has been attached or detached since the previous call, the
+ * same list is returned again, without allocating anything or touching the
+ * reference counts of the devices. This makes polling for changes cheap.
+ *
+ * The list is NULL-terminated and must not be modified. It holds a reference
+ * to each of its devices, so they stay valid until the list is freed with
+ * libusb_free_device_snapshot(). Take a reference with libusb_ref_device()
+ * on any device you want to keep using beyond that. All snapshots must be
+ * freed before the context is exited.
+ *
+ * On platforms without hotplug support, libusb cannot tell whether anything
+ * changed without scanning the bus, so every call scans it. The previous
+ * list is still returned if the scan found the same devices.
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \param list output location for the list of devices. Must be later freed
+ * with libusb_free_device_snapshot().
+ * \param generation optional output location for the generation of the
+ * list. Two lists of a context have the same generation exactly if they are
+ * the same list, so this can be compared against the generation of an
+ * earlier list to find out whether anything changed. May be NULL.
+ * \returns the number of devices in the outputted list, or any
+ * \ref libusb_error according to errors encountered by the backend.
+ */
+ssize_t API_EXPORTED libusb_get_device_snapshot(libusb_context *ctx,
+	libusb_device ***list, unsigned int *generation)
+{
+	struct discovered_devs *discdevs = NULL;
+	struct usbi_device_snapshot *snapshot, *old_snapshot = NULL;
+	unsigned int discovered_generation = 0;
+	int hotplug, r = 0;
+	USBI_GET_CONTEXT(ctx);
+	usbi_dbg("");
+
+	/* without device discovery, the list of devices of the context stays
+	 * empty, as if it were maintained by hotplug */
+	hotplug = ctx->no_device_discovery ||
+		libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG);
+	if (hotplug) {
+		struct libusb_device *dev;
+
+		if (usbi_backend->hotplug_poll && !ctx->no_device_discovery)
+			usbi_backend->hotplug_poll();
+
+		usbi_mutex_lock(&ctx->usb_devs_lock);
+		snapshot = ctx->device_snapshot;
+		if (snapshot) {
+			/* nothing changed since the snapshot was taken */
+			snapshot->refcnt++;
+			usbi_mutex_unlock(&ctx->usb_devs_lock);
+			goto out;
+		}
+		discovered_generation = ctx->usb_devs_generation;
+		discdevs = discovered_devs_alloc();
+		list_for_each_entry(dev, &ctx->usb_devs, list, struct libusb_device) {
+			if (!discdevs)
+				break;
+			discdevs = discovered_devs_append(discdevs, dev);
+		}
+		usbi_mutex_unlock(&ctx->usb_devs_lock);
+		if (!discdevs)
+			return LIBUSB_ERROR_NO_MEM;
+	} else {
+		discdevs = discovered_devs_alloc();
+		if (!discdevs)
+			return LIBUSB_ERROR_NO_MEM;
+		r = usbi_backend->get_device_list(ctx, &discdevs);
+		if (r < 0) {
+			discovered_devs_free(discdevs);
+			return r;
+		}
+	}
+
+	usbi_mutex_lock(&ctx->usb_devs_lock);
+	snapshot = ctx->device_snapshot;
+	if (snapshot && (hotplug || device_snapshot_matches(snapshot, discdevs))) {
+		/* another caller got there first, or the scan found nothing new */
+		snapshot->refcnt++;
+	} else {
+		snapshot = device_snapshot_alloc(ctx, discdevs);
+		if (!snapshot) {
+			r = LIBUSB_ERROR_NO_MEM;
+		} else if (!hotplug) {
+			old_snapshot = ctx->device_snapshot;
+			snapshot->generation = ++ctx->usb_devs_generation;
+			snapshot->refcnt++;
+			ctx->device_snapshot = snapshot;
+		} else {
+			snapshot->generation = discovered_generation;
+			/* only remember the snapshot if no device came or went while
+			 * it was being taken */
+			if (discovered_generation == ctx->usb_devs_generation) {
+				snapshot->refcnt++;
+				ctx->device_snapshot = snapshot;
+			}
+		}
+	}
+	usbi_mutex_unlock(&ctx->usb_devs_lock);
+
+	device_snapshot_unref(old_snapshot);
+	discovered_devs_free(discdevs);
+	if (r < 0)
+		return r;
+
+out:
+	*list = DEVICE_SNAPSHOT_DEVICES(snapshot);
+	if (generation)
+		*generation = snapshot->generation;
+	return snapshot->len;
+}
+
+/** \ingroup dev
+ * Frees a list of devices obtained from libusb_get_device_snapshot(). This
+ * also drops the references the list holds to its devices once no other
+ * caller uses the list any more.
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ *
+ * \param list the list to free, or NULL
+ */
+void API_EXPORTED libusb_free_device_snapshot(libusb_device **list)
+{
+	if (!list)
+		return;
+
+	device_snapshot_unref(DEVICES_TO_DEVICE_SNAPSHOT(list));
+}
+
 /** \ingroup dev
  * Get the number of the bus that a device is connected to.
  * \param dev a device
@@ -981,31 +1315,6 @@ int API_EXPORTED libusb_get_device_speed(libusb_device *dev)
 	return dev->speed;
 }
 
-static const struct libusb_endpoint_descriptor *find_endpoint(
-	struct libusb_config_descriptor *config, unsigned char endpoint)
-{
-	int iface_idx;
-	for (iface_idx = 0; iface_idx < config->bNumInterfaces; iface_idx++) {
-		const struct libusb_interface *iface = &config->interface[iface_idx];
-		int altsetting_idx;
-
-		for (altsetting_idx = 0; altsetting_idx < iface->num_altsetting;
-				altsetting_idx++) {
-			const struct libusb_interface_descriptor *altsetting
-				= &iface->altsetting[altsetting_idx];
-			int ep_idx;
-
-			for (ep_idx = 0; ep_idx < altsetting->bNumEndpoints; ep_idx++) {
-				const struct libusb_endpoint_descriptor *ep =
-					&altsetting->endpoint[ep_idx];
-				if (ep->bEndpointAddress == endpoint)
-					return ep;
-			}
-		}
-	}
-	return NULL;
-}
-
 /** \ingroup dev
  * Convenience function to retrieve the wMaxPacketSize value for a particular
  * endpoint in the active device configuration.
@@ -1016,6 +1325,12 @@ static const struct libusb_endpoint_descriptor *find_endpoint(
  * its contents. If you're dealing with isochronous transfers, you probably
  * want libusb_get_max_iso_packet_size() instead.
  *
+ * The endpoints of the active configuration are looked up in a table that is
+ * built on first use and kept on the device until the configuration is
+ * changed with libusb_set_configuration() or the device is reset, so this
+ * function is cheap enough to call for every transfer. A configuration
+ * change made by another process is not noticed until then.
+ *
  * \param dev a device
  * \param endpoint address of the endpoint in question
  * \returns the wMaxPacketSize value
@@ -1025,28 +1340,14 @@ static const struct libusb_endpoint_descriptor *find_endpoint(
 int API_EXPORTED libusb_get_max_packet_size(libusb_device *dev,
 	unsigned char endpoint)
 {
-	struct libusb_config_descriptor *config;
-	const struct libusb_endpoint_descriptor *ep;
+	struct usbi_endpoint_info info;
 	int r;
 
-	r = libusb_get_active_config_descriptor(dev, &config);
-	if (r < 0) {
-		usbi_err(DEVICE_CTX(dev),
-			"could not retrieve active config descriptor");
-		return LIBUSB_ERROR_OTHER;
-	}
-
-	ep = find_endpoint(config, endpoint);
-	if (!ep) {
-		r = LIBUSB_ERROR_NOT_FOUND;
-		goto out;
-	}
-
-	r = ep->wMaxPacketSize;
+	r = usbi_device_get_endpoint_info(dev, endpoint, &info);
+	if (r < 0)
+		return r;
 
-out:
-	libusb_free_config_descriptor(config);
-	return r;
+	return info.max_packet;
 }
 
 /** \ingroup dev
@@ -1078,35 +1379,18 @@ out:
 int API_EXPORTED libusb_get_max_iso_packet_size(libusb_device *dev,
 	unsigned char endpoint)
 {
-	struct libusb_config_descriptor *config;
-	const struct libusb_endpoint_descriptor *ep;
-	enum libusb_transfer_type ep_type;
-	uint16_t val;
+	struct usbi_endpoint_info info;
 	int r;
 
-	r = libusb_get_active_config_descriptor(dev, &config);
-	if (r < 0) {
-		usbi_err(DEVICE_CTX(dev),
-			"could not retrieve active config descriptor");
-		return LIBUSB_ERROR_OTHER;
-	}
-
-	ep = find_endpoint(config, endpoint);
-	if (!ep) {
-		r = LIBUSB_ERROR_NOT_FOUND;
-		goto out;
-	}
-
-	val = ep->wMaxPacketSize;
-	ep_type = (enum libusb_transfer_type) (ep->bmAttributes & 0x3);
+	r = usbi_device_get_endpoint_info(dev, endpoint, &info);
+	if (r < 0)
+		return r;
 
-	r = val & 0x07ff;
-	if (ep_type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS
-			|| ep_type == LIBUSB_TRANSFER_TYPE_INTERRUPT)
-		r *= (1 + ((val >> 11) & 3));
+	r = info.max_packet & 0x07ff;
+	if (info.type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS
+			|| info.type == LIBUSB_TRANSFER_TYPE_INTERRUPT)
+		r *= (1 + ((info.max_packet >> 11) & 3));
 
-out:
-	libusb_free_config_descriptor(config);
 	return r;
 }
 
@@ -1118,9 +1402,13 @@ out:
 DEFAULT_VISIBILITY
 libusb_device * LIBUSB_CALL libusb_ref_device(libusb_device *dev)
 {
+#if defined(USBI_REF_LOCKED)
 	usbi_mutex_lock(&dev->lock);
 	dev->refcnt++;
 	usbi_mutex_unlock(&dev->lock);
+#else
+	usbi_ref_inc(&dev->refcnt);
+#endif
 	return dev;
 }
 
@@ -1136,9 +1424,13 @@ void API_EXPORTED libusb_unref_device(libusb_device *dev)
 	if (!dev)
 		return;
 
+#if defined(USBI_REF_LOCKED)
 	usbi_mutex_lock(&dev->lock);
 	refcnt = --dev->refcnt;
 	usbi_mutex_unlock(&dev->lock);
+#else
+	refcnt = usbi_ref_dec(&dev->refcnt);
+#endif
 
 	if (refcnt == 0) {
 		usbi_dbg("destroy device %d.%d", dev->bus_number, dev->device_address);
@@ -1153,6 +1445,8 @@ void API_EXPORTED libusb_unref_device(libusb_device *dev)
 			usbi_disconnect_device(dev);
 		}
 
+		usbi_device_free_config_cache(dev);
+		usbi_device_free_string_cache(dev);
 		usbi_mutex_destroy(&dev->lock);
 		free(dev);
 	}
@@ -1164,17 +1458,14 @@ void API_EXPORTED libusb_unref_device(libusb_device *dev)
  */
 int usbi_signal_event(struct libusb_context *ctx)
 {
-	unsigned char dummy = 1;
-	ssize_t r;
+	int r;
 
 	/* write some data on event pipe to interrupt event handlers */
-	r = usbi_write(ctx->event_pipe[1], &dummy, sizeof(dummy));
-	if (r != sizeof(dummy)) {
+	r = usbi_write_event_pipe(ctx->event_pipe);
+	if (r < 0)
 		usbi_warn(ctx, "internal signalling write failed");
-		return LIBUSB_ERROR_IO;
-	}
 
-	return 0;
+	return r;
 }
 
 /*
@@ -1183,17 +1474,14 @@ int usbi_signal_event(struct libusb_context *ctx)
  */
 int usbi_clear_event(struct libusb_context *ctx)
 {
-	unsigned char dummy;
-	ssize_t r;
+	int r;
 
 	/* read some data on event pipe to clear it */
-	r = usbi_read(ctx->event_pipe[0], &dummy, sizeof(dummy));
-	if (r != sizeof(dummy)) {
+	r = usbi_read_event_pipe(ctx->event_pipe);
+	if (r < 0)
 		usbi_warn(ctx, "internal signalling read failed");
-		return LIBUSB_ERROR_IO;
-	}
 
-	return 0;
+	return r;
 }
 
 /*
@@ -1214,6 +1502,75 @@ void usbi_fd_notification(struct libusb_context *ctx)
 	usbi_mutex_unlock(&ctx->event_data_lock);
 }
 
+/* allocate a handle and set up its core state. the handle points to dev
+ * without taking a reference */
+static int alloc_handle(struct libusb_device *dev,
+	struct libusb_device_handle **handle)
+{
+	struct libusb_device_handle *_handle;
+	size_t priv_size = usbi_backend->device_handle_priv_size;
+	int r;
+
+	_handle = malloc(sizeof(*_handle) + priv_size);
+	if (!_handle)
+		return LIBUSB_ERROR_NO_MEM;
+
+	r = usbi_mutex_init(&_handle->lock, NULL);
+	if (r) {
+		free(_handle);
+		return LIBUSB_ERROR_OTHER;
+	}
+
+	r = usbi_io_handle_init(_handle);
+	if (r < 0) {
+		usbi_mutex_destroy(&_handle->lock);
+		free(_handle);
+		return r;
+	}
+
+	r = usbi_sync_handle_init(_handle);
+	if (r < 0) {
+		usbi_io_handle_exit(_handle);
+		usbi_mutex_destroy(&_handle->lock);
+		free(_handle);
+		return r;
+	}
+
+	_handle->dev = dev;
+	_handle->auto_detach_kernel_driver = 0;
+	_handle->claimed_interfaces = 0;
+	memset(&_handle->os_priv, 0, priv_size);
+	*handle = _handle;
+	return 0;
+}
+
+static void free_handle(struct libusb_device_handle *handle)
+{
+	usbi_sync_handle_exit(handle);
+	usbi_io_handle_exit(handle);
+	usbi_mutex_destroy(&handle->lock);
+	free(handle);
+}
+
+/* make a handle that the backend has opened visible to the context */
+static void add_open_handle(struct libusb_context *ctx,
+	struct libusb_device_handle *handle)
+{
+	usbi_mutex_lock(&ctx->open_devs_lock);
+	list_add(&handle->list, &ctx->open_devs);
+	usbi_mutex_unlock(&ctx->open_devs_lock);
+
+	if (usbi_backend->caps & USBI_CAP_HAS_POLLABLE_DEVICE_FD) {
+		/* At this point, we want to interrupt any existing event handlers so
+		 * that they realise the addition of the new device's poll fd. One
+		 * example when this is desirable is if the user is running a separate
+		 * dedicated libusb events handling thread, which is running with a long
+		 * or infinite timeout. We want to interrupt that iteration of the loop,
+		 * so that it picks up the new fd, and then continues. */
+		usbi_fd_notification(ctx);
+	}
+}
+
 /** \ingroup dev
  * Open a device and obtain a device handle. A handle allows you to perform
  * I/O on the device in question.
@@ -1222,69 +1579,107 @@ void usbi_fd_notification(struct libusb_context *ctx)
  * available to you through libusb_get_device(). This reference is removed
  * during libusb_close().
  *
- * This is a non-blocking function; no requests are sent over the bus.
+ * This is a non-blocking function; no requests are sent over the bus.
+ *
+ * \param dev the device to open
+ * \param handle output location for the returned device handle pointer. Only
+ * populated when the return code is 0.
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_NO_MEM on memory allocation failure
+ * \returns LIBUSB_ERROR_ACCESS if the user has insufficient permissions
+ * \returns LIBUSB_ERROR_NO_DEVICE if the device has been disconnected
+ * \returns another LIBUSB_ERROR code on other failure
+ */
+int API_EXPORTED libusb_open(libusb_device *dev,
+	libusb_device_handle **handle)
+{
+	struct libusb_context *ctx = DEVICE_CTX(dev);
+	struct libusb_device_handle *_handle;
+	int r;
+	usbi_dbg("open %d.%d", dev->bus_number, dev->device_address);
+
+	if (!dev->attached) {
+		return LIBUSB_ERROR_NO_DEVICE;
+	}
+
+	r = alloc_handle(dev, &_handle);
+	if (r < 0)
+		return r;
+	libusb_ref_device(dev);
+
+	r = usbi_backend->open(_handle);
+	if (r < 0) {
+		usbi_dbg("open %d.%d returns %d", dev->bus_number, dev->device_address, r);
+		free_handle(_handle);
+		libusb_unref_device(dev);
+		return r;
+	}
+
+	add_open_handle(ctx, _handle);
+	*handle = _handle;
+	return 0;
+}
+
+/** \ingroup dev
+ * Obtain a device handle from a handle of the operating system that the
+ * application already has open, without enumerating the devices of the
+ * system. This is meant for platforms where an application is handed an
+ * open device but cannot list the devices itself, such as Android, where
+ * the file descriptor of the device comes from the UsbManager Java API, or
+ * sandboxed processes without access to sysfs.
+ *
+ * On Linux, sys_dev is the file descriptor of an open usbfs device node.
+ * The device descriptor, the configuration descriptors and the active
+ * configuration are read through it. The file descriptor is not closed by
+ * libusb_close(), it remains owned by the application and must stay open
+ * until the handle is closed.
+ *
+ * The device of the returned handle is available through
+ * libusb_get_device(). It does not appear in the device lists of the
+ * context, and no hotplug events are generated for it. Its parent and port
+ * numbers may be unknown.
  *
- * \param dev the device to open
+ * Combine this with libusb_set_device_discovery() to also skip the scan of
+ * the devices of the system in libusb_init().
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \param sys_dev the platform-specific handle of the device
  * \param handle output location for the returned device handle pointer. Only
  * populated when the return code is 0.
  * \returns 0 on success
  * \returns LIBUSB_ERROR_NO_MEM on memory allocation failure
  * \returns LIBUSB_ERROR_ACCESS if the user has insufficient permissions
- * \returns LIBUSB_ERROR_NO_DEVICE if the device has been disconnected
+ * \returns LIBUSB_ERROR_NO_DEVICE if sys_dev does not refer to a device
+ * \returns LIBUSB_ERROR_NOT_SUPPORTED if the platform does not support it
  * \returns another LIBUSB_ERROR code on other failure
  */
-int API_EXPORTED libusb_open(libusb_device *dev,
+int API_EXPORTED libusb_wrap_sys_device(libusb_context *ctx, intptr_t sys_dev,
 	libusb_device_handle **handle)
 {
-	struct libusb_context *ctx = DEVICE_CTX(dev);
 	struct libusb_device_handle *_handle;
-	size_t priv_size = usbi_backend->device_handle_priv_size;
 	int r;
-	usbi_dbg("open %d.%d", dev->bus_number, dev->device_address);
-
-	if (!dev->attached) {
-		return LIBUSB_ERROR_NO_DEVICE;
-	}
 
-	_handle = malloc(sizeof(*_handle) + priv_size);
-	if (!_handle)
-		return LIBUSB_ERROR_NO_MEM;
+	USBI_GET_CONTEXT(ctx);
+	usbi_dbg("wrap %ld", (long)sys_dev);
 
-	r = usbi_mutex_init(&_handle->lock, NULL);
-	if (r) {
-		free(_handle);
-		return LIBUSB_ERROR_OTHER;
-	}
+	if (!usbi_backend->wrap_sys_device)
+		return LIBUSB_ERROR_NOT_SUPPORTED;
 
-	_handle->dev = libusb_ref_device(dev);
-	_handle->auto_detach_kernel_driver = 0;
-	_handle->claimed_interfaces = 0;
-	memset(&_handle->os_priv, 0, priv_size);
+	r = alloc_handle(NULL, &_handle);
+	if (r < 0)
+		return r;
 
-	r = usbi_backend->open(_handle);
+	r = usbi_backend->wrap_sys_device(ctx, _handle, sys_dev);
 	if (r < 0) {
-		usbi_dbg("open %d.%d returns %d", dev->bus_number, dev->device_address, r);
-		libusb_unref_device(dev);
-		usbi_mutex_destroy(&_handle->lock);
-		free(_handle);
+		usbi_dbg("wrap %ld returns %d", (long)sys_dev, r);
+		free_handle(_handle);
 		return r;
 	}
 
-	usbi_mutex_lock(&ctx->open_devs_lock);
-	list_add(&_handle->list, &ctx->open_devs);
-	usbi_mutex_unlock(&ctx->open_devs_lock);
+	add_open_handle(ctx, _handle);
 	*handle = _handle;
-
-	if (usbi_backend->caps & USBI_CAP_HAS_POLLABLE_DEVICE_FD) {
-		/* At this point, we want to interrupt any existing event handlers so
-		 * that they realise the addition of the new device's poll fd. One
-		 * example when this is desirable is if the user is running a separate
-		 * dedicated libusb events handling thread, which is running with a long
-		 * or infinite timeout. We want to interrupt that iteration of the loop,
-		 * so that it picks up the new fd, and then continues. */
-		usbi_fd_notification(ctx);
-	}
-
 	return 0;
 }
 
@@ -1340,25 +1735,30 @@ out:
 	return handle;
 }
 
+/* a libusb_close() call waiting for the event handler to close the handle */
+struct usbi_close_request {
+	struct list_head list;
+	struct libusb_device_handle *dev_handle;
+	int done;
+};
+
+/* closes a device handle. the caller holds the events lock, so that nobody
+ * polls the fds of the handle while they are removed */
 static void do_close(struct libusb_context *ctx,
 	struct libusb_device_handle *dev_handle)
 {
 	struct usbi_transfer *itransfer;
 	struct usbi_transfer *tmp;
-
-	libusb_lock_events(ctx);
+	struct libusb_device *dev;
 
 	/* remove any transfers in flight that are for this device */
-	usbi_mutex_lock(&ctx->flying_transfers_lock);
+	usbi_mutex_lock(&dev_handle->flying_transfers_lock);
 
 	/* safe iteration because transfers may be being deleted */
-	list_for_each_entry_safe(itransfer, tmp, &ctx->flying_transfers, list, struct usbi_transfer) {
+	list_for_each_entry_safe(itransfer, tmp, &dev_handle->flying_transfers, list, struct usbi_transfer) {
 		struct libusb_transfer *transfer =
 			USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
 
-		if (transfer->dev_handle != dev_handle)
-			continue;
-
 		if (!(itransfer->flags & USBI_TRANSFER_DEVICE_DISAPPEARED)) {
 			usbi_err(ctx, "Device handle closed while transfer was still being processed, but the device is still connected as far as we know");
 
@@ -1373,7 +1773,7 @@ static void do_close(struct libusb_context *ctx,
 		 * (or that such accesses will be easily caught and identified as a crash)
 		 */
 		usbi_mutex_lock(&itransfer->lock);
-		list_del(&itransfer->list);
+		usbi_remove_from_flying_list(itransfer);
 		transfer->dev_handle = NULL;
 		usbi_mutex_unlock(&itransfer->lock);
 
@@ -1384,18 +1784,55 @@ static void do_close(struct libusb_context *ctx,
 		usbi_dbg("Removed transfer %p from the in-flight list because device handle %p closed",
 			 transfer, dev_handle);
 	}
-	usbi_mutex_unlock(&ctx->flying_transfers_lock);
-
-	libusb_unlock_events(ctx);
+	usbi_mutex_unlock(&dev_handle->flying_transfers_lock);
 
 	usbi_mutex_lock(&ctx->open_devs_lock);
+	usbi_io_handle_retire_stats(dev_handle);
+	ctx->handles_closed++;
+	if (dev_handle->busy_poll)
+		usbi_flags_store(&ctx->busy_poll_handles,
+			ctx->busy_poll_handles - 1);
 	list_del(&dev_handle->list);
 	usbi_mutex_unlock(&ctx->open_devs_lock);
 
 	usbi_backend->close(dev_handle);
-	libusb_unref_device(dev_handle->dev);
-	usbi_mutex_destroy(&dev_handle->lock);
-	free(dev_handle);
+	/* the handle may hold the last reference to the device, which its
+	 * teardown still needs */
+	dev = dev_handle->dev;
+	free_handle(dev_handle);
+	libusb_unref_device(dev);
+}
+
+/* closes the handles queued by libusb_close(), with the events lock held */
+void usbi_handle_close_queue(struct libusb_context *ctx)
+{
+	struct usbi_close_request *request;
+
+	for (;;) {
+		usbi_mutex_lock(&ctx->event_data_lock);
+		if (list_empty(&ctx->close_queue)) {
+			/* clear the event pipe if there are no further pending
+			 * events */
+			if (!usbi_pending_events(ctx))
+				usbi_clear_event(ctx);
+			usbi_mutex_unlock(&ctx->event_data_lock);
+			return;
+		}
+		request = list_first_entry(&ctx->close_queue,
+			struct usbi_close_request, list);
+		list_del(&request->list);
+		usbi_mutex_unlock(&ctx->event_data_lock);
+
+		usbi_dbg("closing queued handle %p", request->dev_handle);
+		do_close(ctx, request->dev_handle);
+
+		/* the request lives on the stack of libusb_close(), which may
+		 * return as soon as the lock is dropped */
+		usbi_mutex_lock(&ctx->event_waiters_lock);
+		request->done = 1;
+		usbi_cond_broadcast(&ctx->event_waiters_cond);
+		usbi_mutex_unlock(&ctx->event_waiters_lock);
+	}
 }
 
 /** \ingroup dev
@@ -1407,11 +1844,17 @@ static void do_close(struct libusb_context *ctx,
  *
  * This is a non-blocking function; no requests are sent over the bus.
  *
+ * If another thread is handling events, the handle is closed by that thread,
+ * in between handling the events of the other devices, and this function
+ * waits for it to do so. Closing a device thus never stops the event
+ * handling of the other devices of the context.
+ *
  * \param dev_handle the handle to close
  */
 void API_EXPORTED libusb_close(libusb_device_handle *dev_handle)
 {
 	struct libusb_context *ctx;
+	struct usbi_close_request request;
 	int pending_events;
 
 	if (!dev_handle)
@@ -1420,38 +1863,51 @@ void API_EXPORTED libusb_close(libusb_device_handle *dev_handle)
 
 	ctx = HANDLE_CTX(dev_handle);
 
-	/* Similarly to libusb_open(), we want to interrupt all event handlers
-	 * at this point. More importantly, we want to perform the actual close of
-	 * the device while holding the event handling lock (preventing any other
-	 * thread from doing event handling) because we will be removing a file
-	 * descriptor from the polling loop. */
+	/* hand the events of the device back to the context */
+	if (dev_handle->event_domain &&
+			libusb_set_event_domain(dev_handle, NULL) < 0)
+		usbi_warn(ctx, "failed to move handle %p out of its event domain",
+			dev_handle);
+
+	/* The actual close of the device is done while holding the event
+	 * handling lock, because we will be removing a file descriptor from
+	 * the polling loop. Without an event handler, take the lock and close
+	 * the device right here. This also covers closing a device from within
+	 * an event handler, as the lock is recursive. */
+	if (libusb_try_lock_events(ctx) == 0) {
+		do_close(ctx, dev_handle);
+		libusb_unlock_events(ctx);
+		return;
+	}
 
-	/* Record that we are closing a device.
+	/* Otherwise queue the handle for the event handler, rather than making
+	 * it give up the events lock.
 	 * Only signal an event if there are no prior pending events. */
+	request.dev_handle = dev_handle;
+	request.done = 0;
 	usbi_mutex_lock(&ctx->event_data_lock);
 	pending_events = usbi_pending_events(ctx);
-	ctx->device_close++;
+	list_add_tail(&request.list, &ctx->close_queue);
 	if (!pending_events)
 		usbi_signal_event(ctx);
 	usbi_mutex_unlock(&ctx->event_data_lock);
 
-	/* take event handling lock */
-	libusb_lock_events(ctx);
-
-	/* Close the device */
-	do_close(ctx, dev_handle);
-
-	/* We're done with closing this device.
-	 * Clear the event pipe if there are no further pending events. */
-	usbi_mutex_lock(&ctx->event_data_lock);
-	ctx->device_close--;
-	pending_events = usbi_pending_events(ctx);
-	if (!pending_events)
-		usbi_clear_event(ctx);
-	usbi_mutex_unlock(&ctx->event_data_lock);
-
-	/* Release event handling lock and wake up event waiters */
-	libusb_unlock_events(ctx);
+	/* wait for the event handler to close the handle, or close it here
+	 * should the event handler stop before getting to it */
+	libusb_lock_event_waiters(ctx);
+	while (!request.done) {
+		if (libusb_event_handler_active(ctx)) {
+			libusb_wait_for_event(ctx, NULL);
+			continue;
+		}
+		libusb_unlock_event_waiters(ctx);
+		if (libusb_try_lock_events(ctx) == 0) {
+			usbi_handle_close_queue(ctx);
+			libusb_unlock_events(ctx);
+		}
+		libusb_lock_event_waiters(ctx);
+	}
+	libusb_unlock_event_waiters(ctx);
 }
 
 /** \ingroup dev
@@ -1568,8 +2024,13 @@ int API_EXPORTED libusb_get_configuration(libusb_device_handle *dev,
 int API_EXPORTED libusb_set_configuration(libusb_device_handle *dev,
 	int configuration)
 {
+	int r;
+
 	usbi_dbg("configuration %d", configuration);
-	return usbi_backend->set_configuration(dev, configuration);
+	r = usbi_backend->set_configuration(dev, configuration);
+	if (r == 0)
+		usbi_device_invalidate_active_config(dev->dev);
+	return r;
 }
 
 /** \ingroup dev
@@ -1760,11 +2221,18 @@ int API_EXPORTED libusb_clear_halt(libusb_device_handle *dev,
  */
 int API_EXPORTED libusb_reset_device(libusb_device_handle *dev)
 {
+	int r;
+
 	usbi_dbg("");
 	if (!dev->dev->attached)
 		return LIBUSB_ERROR_NO_DEVICE;
 
-	return usbi_backend->reset_device(dev);
+	r = usbi_backend->reset_device(dev);
+	/* the device may come back in a different configuration. invalidating
+	 * after the reset keeps a lookup made meanwhile from caching the old
+	 * one */
+	usbi_device_invalidate_active_config(dev->dev);
+	return r;
 }
 
 /** \ingroup asyncio
@@ -1830,6 +2298,144 @@ int API_EXPORTED libusb_free_streams(libusb_device_handle *dev,
 		return LIBUSB_ERROR_NOT_SUPPORTED;
 }
 
+/** \ingroup asyncio
+ * Allocate a buffer for transfers to or from the given device. Where the
+ * platform supports it (e.g. Linux usbfs on kernels that allow mapping the
+ * device node), the memory is suitable for DMA by the host controller, so
+ * that transfers using it avoid copying the data between user space and the
+ * kernel. Elsewhere, or if such memory cannot be allocated, an ordinary heap
+ * buffer is returned, so the function can be used unconditionally.
+ *
+ * The buffer must be released with libusb_dev_mem_free() using the same
+ * device handle and length, before the device handle is closed. Device
+ * memory still allocated when the handle is closed is released then, and
+ * must no longer be used.
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ *
+ * \param dev a device handle
+ * \param length size of the buffer
+ * \returns a pointer to the newly allocated memory, or NULL on failure
+ */
+DEFAULT_VISIBILITY
+unsigned char * LIBUSB_CALL libusb_dev_mem_alloc(libusb_device_handle *dev,
+	size_t length)
+{
+	unsigned char *buffer = NULL;
+
+	if (!dev->dev->attached)
+		return NULL;
+
+	if (usbi_backend->dev_mem_alloc)
+		buffer = usbi_backend->dev_mem_alloc(dev, length);
+	if (!buffer)
+		buffer = malloc(length);
+	return buffer;
+}
+
+/** \ingroup asyncio
+ * Free a buffer allocated with libusb_dev_mem_alloc().
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ *
+ * \param dev the device handle the buffer was allocated for
+ * \param buffer the buffer to free
+ * \param length the length the buffer was allocated with
+ * \returns LIBUSB_SUCCESS, or a LIBUSB_ERROR code on failure
+ */
+int API_EXPORTED libusb_dev_mem_free(libusb_device_handle *dev,
+	unsigned char *buffer, size_t length)
+{
+	int r = LIBUSB_ERROR_NOT_FOUND;
+
+	if (!buffer)
+		return LIBUSB_SUCCESS;
+
+	if (usbi_backend->dev_mem_free)
+		r = usbi_backend->dev_mem_free(dev, buffer, length);
+	if (r == LIBUSB_ERROR_NOT_FOUND) {
+		free(buffer);
+		r = LIBUSB_SUCCESS;
+	}
+	return r;
+}
+
+/** \ingroup dev
+ * Set a performance policy on an endpoint. The interface the endpoint belongs
+ * to must have been claimed, and the policy only lasts until that interface
+ * is released. See \ref libusb_endpoint_policy for the available policies.
+ *
+ * Policies are tuned in the OS driver and are not available on every
+ * platform; currently only the WinUSB and libusbK drivers on Windows
+ * support them.
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ *
+ * \param dev a device handle
+ * \param endpoint the address of the endpoint
+ * \param policy the policy to set
+ * \param value the new value of the policy
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_NOT_FOUND if the endpoint does not belong to a
+ * claimed interface
+ * \returns LIBUSB_ERROR_NOT_SUPPORTED if the policy is not supported on this
+ * platform or by the driver of the interface
+ * \returns LIBUSB_ERROR_INVALID_PARAM if the policy is read only
+ * \returns LIBUSB_ERROR_NO_DEVICE if the device has been disconnected
+ * \returns another LIBUSB_ERROR code on other failure
+ */
+int API_EXPORTED libusb_set_endpoint_policy(libusb_device_handle *dev,
+	unsigned char endpoint, enum libusb_endpoint_policy policy,
+	unsigned int value)
+{
+	usbi_dbg("endpoint %x policy %d value %u", endpoint, policy, value);
+	if (!dev->dev->attached)
+		return LIBUSB_ERROR_NO_DEVICE;
+
+	if (policy == LIBUSB_ENDPOINT_POLICY_MAX_TRANSFER_SIZE)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	if (usbi_backend->set_endpoint_policy)
+		return usbi_backend->set_endpoint_policy(dev, endpoint, policy,
+			value);
+	else
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+}
+
+/** \ingroup dev
+ * Read the current value of a performance policy of an endpoint. The
+ * interface the endpoint belongs to must have been claimed.
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ *
+ * \param dev a device handle
+ * \param endpoint the address of the endpoint
+ * \param policy the policy to query
+ * \param value output location for the value of the policy. Only populated
+ * if the return code is 0.
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_NOT_FOUND if the endpoint does not belong to a
+ * claimed interface
+ * \returns LIBUSB_ERROR_NOT_SUPPORTED if the policy is not supported on this
+ * platform or by the driver of the interface
+ * \returns LIBUSB_ERROR_NO_DEVICE if the device has been disconnected
+ * \returns another LIBUSB_ERROR code on other failure
+ */
+int API_EXPORTED libusb_get_endpoint_policy(libusb_device_handle *dev,
+	unsigned char endpoint, enum libusb_endpoint_policy policy,
+	unsigned int *value)
+{
+	usbi_dbg("endpoint %x policy %d", endpoint, policy);
+	if (!dev->dev->attached)
+		return LIBUSB_ERROR_NO_DEVICE;
+
+	if (usbi_backend->get_endpoint_policy)
+		return usbi_backend->get_endpoint_policy(dev, endpoint, policy,
+			value);
+	else
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+}
+
 /** \ingroup dev
  * Determine if a kernel driver is active on an interface. If a kernel driver
  * is active, you cannot claim the interface, and libusb will be unable to
@@ -1994,6 +2600,301 @@ void API_EXPORTED libusb_set_debug(libusb_context *ctx, int level)
 		ctx->debug = level;
 }
 
+#if defined(USBI_HAVE_ATOMICS) && defined(ENABLE_LOGGING)
+#define USBI_LOG_RING	1
+
+/* The log ring is an array of fixed size slots indexed by a free running line
+ * counter. Each slot carries a sequence number: 2n+1 while line n is being
+ * written into it, and 2n+2 once line n is complete. Writers claim a line
+ * number with one atomic increment and never take a lock; readers check the
+ * sequence number before and after copying a slot and skip any line that
+ * was overwritten in the meantime. */
+struct usbi_log_slot {
+	uint64_t seq;
+	char line[USBI_MAX_LOG_LEN];
+};
+
+struct usbi_log_ring {
+	uint64_t head;
+	uint64_t tail;
+	uint64_t mask;
+	/* serializes readers, writers never take it */
+	usbi_mutex_t read_lock;
+	struct usbi_log_slot slots[1];
+};
+
+#define USBI_LOG_RING_MAX_LINES	65536
+
+static void log_ring_put(struct usbi_log_ring *ring, const char *str)
+{
+	uint64_t line = __atomic_fetch_add(&ring->head, 1, __ATOMIC_RELAXED);
+	struct usbi_log_slot *slot = &ring->slots[line & ring->mask];
+	uint64_t seq = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+	size_t len;
+
+	for (;;) {
+		/* a writer from a later lap already owns the slot. this line was
+		 * overtaken before it could be stored, drop it */
+		if (seq >= 2 * line + 1)
+			return;
+		/* a writer from an earlier lap is still copying its line */
+		if (seq & 1) {
+			seq = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+			continue;
+		}
+		if (__atomic_compare_exchange_n(&slot->seq, &seq, 2 * line + 1, 0,
+				__ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			break;
+	}
+
+	len = strlen(str);
+	if (len >= sizeof(slot->line))
+		len = sizeof(slot->line) - 1;
+	memcpy(slot->line, str, len);
+	slot->line[len] = '\0';
+	__atomic_store_n(&slot->seq, 2 * line + 2, __ATOMIC_RELEASE);
+}
+#endif
+
+/** \ingroup lib
+ * Send log messages to an in-memory ring buffer instead of stderr or the
+ * system log.
+ *
+ * Formatting a message and writing it out through stdio serializes every
+ * thread that logs, which makes enabling debug output on a busy system
+ * change the timing of the very problem being investigated. Once a ring is
+ * set, each message is instead copied into the next free line of the ring
+ * without taking any lock, and the application retrieves the messages with
+ * libusb_read_log_ring() whenever it suits it. When the ring is full, the
+ * oldest lines are overwritten.
+ *
+ * The ring is only used for messages that pass the log level set with
+ * libusb_set_debug() or the LIBUSB_DEBUG environment variable. It can be
+ * set once per context and is freed by libusb_exit().
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \param lines the number of messages the ring holds. This is rounded up to
+ * a power of two.
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_INVALID_PARAM if lines is 0 or too large
+ * \returns LIBUSB_ERROR_BUSY if the context already has a ring
+ * \returns LIBUSB_ERROR_NO_MEM on memory allocation failure
+ * \returns LIBUSB_ERROR_NOT_SUPPORTED if the library was built without
+ * atomic operations, or without logging
+ * \see libusb_read_log_ring()
+ */
+int API_EXPORTED libusb_set_log_ring(libusb_context *ctx, unsigned int lines)
+{
+#ifdef USBI_LOG_RING
+	struct usbi_log_ring *ring, *expected = NULL;
+	unsigned int size = 1;
+
+	USBI_GET_CONTEXT(ctx);
+	if (lines == 0 || lines > USBI_LOG_RING_MAX_LINES)
+		return LIBUSB_ERROR_INVALID_PARAM;
+	while (size < lines)
+		size <<= 1;
+
+	ring = calloc(1, sizeof(*ring) + (size - 1) * sizeof(ring->slots[0]));
+	if (!ring)
+		return LIBUSB_ERROR_NO_MEM;
+	ring->mask = size - 1;
+	usbi_mutex_init(&ring->read_lock, NULL);
+
+	if (!__atomic_compare_exchange_n(&ctx->log_ring, &expected, ring, 0,
+			__ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+		usbi_mutex_destroy(&ring->read_lock);
+		free(ring);
+		return LIBUSB_ERROR_BUSY;
+	}
+	usbi_dbg("logging to a ring of %u lines", size);
+	return 0;
+#else
+	UNUSED(ctx);
+	UNUSED(lines);
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+#endif
+}
+
+/** \ingroup lib
+ * Retrieve messages from the log ring set with libusb_set_log_ring().
+ *
+ * Messages are copied to the buffer oldest first, as whole lines each ending
+ * in a newline, and the buffer is NUL terminated. Messages that were
+ * overwritten before they could be read are skipped. Each message is
+ * returned only once. Concurrent calls on the same context are serialized.
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \param buffer output buffer for the messages
+ * \param length size of the buffer. No single message exceeds 1024 bytes
+ * including the terminating NUL.
+ * \returns the number of bytes written to the buffer, excluding the
+ * terminating NUL. 0 means no new messages.
+ * \returns LIBUSB_ERROR_INVALID_PARAM if buffer is NULL or length is not
+ * positive
+ * \returns LIBUSB_ERROR_OVERFLOW if the next message does not fit in the
+ * buffer
+ * \returns LIBUSB_ERROR_NOT_FOUND if the context has no log ring
+ * \returns LIBUSB_ERROR_NOT_SUPPORTED if log rings are not supported
+ * \see libusb_set_log_ring()
+ */
+int API_EXPORTED libusb_read_log_ring(libusb_context *ctx, char *buffer,
+	int length)
+{
+#ifdef USBI_LOG_RING
+	struct usbi_log_ring *ring;
+	uint64_t head, tail;
+	size_t avail, offset = 0;
+	int r = 0;
+
+	USBI_GET_CONTEXT(ctx);
+	if (!buffer || length <= 0)
+		return LIBUSB_ERROR_INVALID_PARAM;
+	ring = __atomic_load_n(&ctx->log_ring, __ATOMIC_ACQUIRE);
+	if (!ring)
+		return LIBUSB_ERROR_NOT_FOUND;
+
+	usbi_mutex_lock(&ring->read_lock);
+	head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	tail = ring->tail;
+	/* everything older than one lap has been overwritten */
+	if (head - tail > ring->mask + 1)
+		tail = head - (ring->mask + 1);
+
+	for (; tail < head; tail++) {
+		struct usbi_log_slot *slot = &ring->slots[tail & ring->mask];
+		uint64_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		char *nul;
+
+		/* still being written, pick it up next time */
+		if (seq < 2 * tail + 2)
+			break;
+		/* overwritten by a later line */
+		if (seq > 2 * tail + 2)
+			continue;
+
+		avail = (size_t)length - 1 - offset;
+		if (avail > sizeof(slot->line))
+			avail = sizeof(slot->line);
+		memcpy(buffer + offset, slot->line, avail);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq)
+			continue;
+
+		nul = memchr(buffer + offset, '\0', avail);
+		if (!nul) {
+			/* doesn't fit, leave it for the next call */
+			if (offset == 0)
+				r = LIBUSB_ERROR_OVERFLOW;
+			break;
+		}
+		offset = nul - buffer;
+	}
+	ring->tail = tail;
+	usbi_mutex_unlock(&ring->read_lock);
+
+	buffer[offset] = '\0';
+	return r < 0 ? r : (int)offset;
+#else
+	UNUSED(ctx);
+	UNUSED(buffer);
+	UNUSED(length);
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+#endif
+}
+
+/** \ingroup lib
+ * Set the CPUs, the scheduling and the names of the threads that libusb
+ * runs internally, such as the hotplug monitor, the event threads of some
+ * backends and the threads that help enumerate devices. This keeps them on
+ * the NUMA node of the USB controller, for example, or gives them a real
+ * time policy for isochronous capture.
+ *
+ * Most internal threads serve all contexts at once, so the options apply to
+ * every internal thread of the process, whichever context they are set
+ * through. They take effect on the threads already running and on those
+ * started later, and last until they are set again. They do not apply to
+ * the threads of the application, including those that handle events.
+ *
+ * Real time policies and some CPU sets need privileges. Newly started
+ * threads that cannot be given the options run with the defaults, and a
+ * warning is logged. The CPUs are not set on Haiku and Windows CE, nor the
+ * names on Windows, and Haiku and Windows map the policies to thread
+ * priorities.
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \param options the options to set
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_INVALID_PARAM if the options are not valid, or a
+ * running thread could not be given them
+ * \returns LIBUSB_ERROR_ACCESS if a running thread could not be given the
+ * options for lack of privileges
+ * \returns LIBUSB_ERROR_NO_MEM on memory allocation failure
+ */
+int API_EXPORTED libusb_set_thread_options(libusb_context *ctx,
+	const struct libusb_thread_options *options)
+{
+	int i, r;
+
+	USBI_GET_CONTEXT(ctx);
+	if (!options || options->num_cpus < 0 ||
+			(options->num_cpus && !options->cpus))
+		return LIBUSB_ERROR_INVALID_PARAM;
+	for (i = 0; i < options->num_cpus; i++)
+		if (options->cpus[i] < 0)
+			return LIBUSB_ERROR_INVALID_PARAM;
+	switch (options->sched_policy) {
+	case LIBUSB_THREAD_SCHED_DEFAULT:
+	case LIBUSB_THREAD_SCHED_FIFO:
+	case LIBUSB_THREAD_SCHED_RR:
+		break;
+	default:
+		return LIBUSB_ERROR_INVALID_PARAM;
+	}
+	if (options->name_prefix && (!*options->name_prefix ||
+			strlen(options->name_prefix) > 7))
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	usbi_dbg("%d cpus, policy %d priority %d", options->num_cpus,
+		options->sched_policy, options->sched_priority);
+	r = usbi_set_thread_options(options);
+	if (r < 0)
+		usbi_warn(ctx, "some threads could not be given the options (%d)", r);
+	return r;
+}
+
+/** \ingroup lib
+ * Choose whether the contexts initialized from now on discover the devices
+ * of the system. Discovery is on by default: libusb_init() scans for the
+ * devices that are connected, and on platforms with hotplug support, starts
+ * watching for devices being connected and disconnected.
+ *
+ * With discovery off, libusb_init() does neither, which makes it faster and
+ * lets it succeed where the platform denies access to the device list, as
+ * in sandboxes or on Android. Devices are then only known once they have
+ * been opened with libusb_wrap_sys_device(), and libusb_get_device_list()
+ * returns an empty list.
+ *
+ * Contexts that are already initialized keep the setting they were
+ * initialized with.
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ *
+ * \param enable 0 to turn device discovery off, 1 to turn it back on
+ */
+void API_EXPORTED libusb_set_device_discovery(int enable)
+{
+	usbi_mutex_static_lock(&default_context_lock);
+	no_device_discovery = !enable;
+	usbi_mutex_static_unlock(&default_context_lock);
+}
+
 /** \ingroup lib
  * Initialize libusb. This function must be called before calling any other
  * libusb function.
@@ -2014,6 +2915,7 @@ int API_EXPORTED libusb_init(libusb_context **context)
 	struct libusb_context *ctx;
 	static int first_init = 1;
 	int r = 0;
+	int i;
 
 	usbi_mutex_static_lock(&default_context_lock);
 
@@ -2021,6 +2923,8 @@ int API_EXPORTED libusb_init(libusb_context **context)
 		usbi_gettimeofday(&timestamp_origin, NULL);
 	}
 
+	usbi_descriptor_read_env();
+
 	if (!context && usbi_default_context) {
 		usbi_dbg("reusing default context");
 		default_context_refcnt++;
@@ -2044,6 +2948,8 @@ int API_EXPORTED libusb_init(libusb_context **context)
 			ctx->debug_fixed = 1;
 	}
 
+	ctx->no_device_discovery = no_device_discovery;
+
 	/* default context should be initialized before calling usbi_dbg */
 	if (!usbi_default_context) {
 		usbi_default_context = ctx;
@@ -2060,6 +2966,12 @@ int API_EXPORTED libusb_init(libusb_context **context)
 	list_init(&ctx->usb_devs);
 	list_init(&ctx->open_devs);
 	list_init(&ctx->hotplug_cbs);
+	list_init(&ctx->hotplug_cbs_any);
+	list_init(&ctx->hotplug_batch_cbs);
+	for (i = 0; i < USBI_HOTPLUG_CB_BUCKETS; i++)
+		list_init(&ctx->hotplug_cbs_by_id[i]);
+	for (i = 0; i < USBI_SESSION_BUCKETS; i++)
+		list_init(&ctx->usb_devs_by_session[i]);
 
 	usbi_mutex_static_lock(&active_contexts_lock);
 	if (first_init) {
@@ -2088,7 +3000,7 @@ int API_EXPORTED libusb_init(libusb_context **context)
 
 err_backend_exit:
 	if (usbi_backend->exit)
-		usbi_backend->exit();
+		usbi_backend->exit(ctx);
 err_free_ctx:
 	if (ctx == usbi_default_context) {
 		usbi_default_context = NULL;
@@ -2102,6 +3014,7 @@ err_free_ctx:
 	usbi_mutex_lock(&ctx->usb_devs_lock);
 	list_for_each_entry_safe(dev, next, &ctx->usb_devs, list, struct libusb_device) {
 		list_del(&dev->list);
+		list_del(&dev->session_list);
 		libusb_unref_device(dev);
 	}
 	usbi_mutex_unlock(&ctx->usb_devs_lock);
@@ -2124,6 +3037,7 @@ err_unlock:
 void API_EXPORTED libusb_exit(struct libusb_context *ctx)
 {
 	struct libusb_device *dev, *next;
+	struct usbi_device_snapshot *snapshot;
 	struct timeval tv = { 0, 0 };
 
 	usbi_dbg("");
@@ -2147,6 +3061,13 @@ void API_EXPORTED libusb_exit(struct libusb_context *ctx)
 	list_del (&ctx->list);
 	usbi_mutex_static_unlock(&active_contexts_lock);
 
+	/* drop the reference the context holds to its latest snapshot */
+	usbi_mutex_lock(&ctx->usb_devs_lock);
+	snapshot = ctx->device_snapshot;
+	ctx->device_snapshot = NULL;
+	usbi_mutex_unlock(&ctx->usb_devs_lock);
+	device_snapshot_unref(snapshot);
+
 	if (libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
 		usbi_hotplug_deregister_all(ctx);
 
@@ -2165,6 +3086,7 @@ void API_EXPORTED libusb_exit(struct libusb_context *ctx)
 		usbi_mutex_lock(&ctx->usb_devs_lock);
 		list_for_each_entry_safe(dev, next, &ctx->usb_devs, list, struct libusb_device) {
 			list_del(&dev->list);
+			list_del(&dev->session_list);
 			libusb_unref_device(dev);
 		}
 		usbi_mutex_unlock(&ctx->usb_devs_lock);
@@ -2179,11 +3101,17 @@ void API_EXPORTED libusb_exit(struct libusb_context *ctx)
 
 	usbi_io_exit(ctx);
 	if (usbi_backend->exit)
-		usbi_backend->exit();
+		usbi_backend->exit(ctx);
 
 	usbi_mutex_destroy(&ctx->open_devs_lock);
 	usbi_mutex_destroy(&ctx->usb_devs_lock);
 	usbi_mutex_destroy(&ctx->hotplug_cbs_lock);
+#ifdef USBI_LOG_RING
+	if (ctx->log_ring) {
+		usbi_mutex_destroy(&ctx->log_ring->read_lock);
+		free(ctx->log_ring);
+	}
+#endif
 	free(ctx);
 }
 
@@ -2262,9 +3190,35 @@ int usbi_gettimeofday(struct timeval *tp, void *tzp)
 }
 #endif
 
+/* the LIBUSB_DEBUG level for messages logged without any context */
+int usbi_get_env_log_level(void)
+{
+	static int env_level = -1;
+	int level = env_level;
+
+	if (level < 0) {
+		char *dbg = getenv("LIBUSB_DEBUG");
+
+		level = dbg ? atoi(dbg) : 0;
+		if (level < 0)
+			level = 0;
+		env_level = level;
+	}
+	return level;
+}
+
 static void usbi_log_str(struct libusb_context *ctx,
 	enum libusb_log_level level, const char * str)
 {
+#ifdef USBI_LOG_RING
+	struct usbi_log_ring *ring = ctx ?
+		__atomic_load_n(&ctx->log_ring, __ATOMIC_ACQUIRE) : NULL;
+
+	if (ring) {
+		log_ring_put(ring, str);
+		return;
+	}
+#endif
 #if defined(USE_SYSTEM_LOGGING_FACILITY)
 #if defined(OS_WINDOWS) || defined(OS_WINCE)
 	/* Windows CE only supports the Unicode version of OutputDebugString. */
@@ -2311,18 +3265,12 @@ void usbi_log_v(struct libusb_context *ctx, enum libusb_log_level level,
 
 #ifdef ENABLE_DEBUG_LOGGING
 	global_debug = 1;
-	UNUSED(ctx);
+	USBI_GET_CONTEXT(ctx);
 #else
-	int ctx_level = 0;
+	int ctx_level;
 
 	USBI_GET_CONTEXT(ctx);
-	if (ctx) {
-		ctx_level = ctx->debug;
-	} else {
-		char *dbg = getenv("LIBUSB_DEBUG");
-		if (dbg)
-			ctx_level = atoi(dbg);
-	}
+	ctx_level = ctx ? ctx->debug : usbi_get_env_log_level();
 	global_debug = (ctx_level == LIBUSB_LOG_LEVEL_DEBUG);
 	if (!ctx_level)
 		return;
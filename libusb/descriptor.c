@@ -92,18 +92,133 @@ int usbi_parse_descriptor(const unsigned char *source, const char *descriptor,
 	return (int) (sp - source);
 }
 
-static void clear_endpoint(struct libusb_endpoint_descriptor *endpoint)
+/* Fixed layout decoders for the descriptors parsed at enumeration. These
+ * do the same as usbi_parse_descriptor() with the matching format string,
+ * without interpreting it for every descriptor. The caller has checked
+ * that the buffer holds the whole descriptor. */
+static inline uint16_t desc_get_w(const unsigned char *p, int host_endian)
 {
-	if (endpoint->extra)
-		free((unsigned char *) endpoint->extra);
+	uint16_t w;
+
+	if (host_endian) {
+		memcpy(&w, p, 2);
+		return w;
+	}
+	return (uint16_t)((p[1] << 8) | p[0]);
+}
+
+static inline uint32_t desc_get_d(const unsigned char *p, int host_endian)
+{
+	uint32_t d;
+
+	if (host_endian) {
+		memcpy(&d, p, 4);
+		return d;
+	}
+	return ((uint32_t)p[3] << 24) | ((uint32_t)p[2] << 16) |
+		((uint32_t)p[1] << 8) | p[0];
+}
+
+/* "bb" */
+static inline void decode_header(const unsigned char *p,
+	struct usb_descriptor_header *header)
+{
+	header->bLength = p[0];
+	header->bDescriptorType = p[1];
+}
+
+/* "bbbbwb", or "bbbbwbbb" with audio set */
+static inline void decode_endpoint(const unsigned char *p,
+	struct libusb_endpoint_descriptor *endpoint, int audio, int host_endian)
+{
+	endpoint->bLength = p[0];
+	endpoint->bDescriptorType = p[1];
+	endpoint->bEndpointAddress = p[2];
+	endpoint->bmAttributes = p[3];
+	endpoint->wMaxPacketSize = desc_get_w(p + 4, host_endian);
+	endpoint->bInterval = p[6];
+	if (audio) {
+		endpoint->bRefresh = p[7];
+		endpoint->bSynchAddress = p[8];
+	}
+}
+
+/* "bbbbbbbbb" */
+static inline void decode_interface(const unsigned char *p,
+	struct libusb_interface_descriptor *desc)
+{
+	desc->bLength = p[0];
+	desc->bDescriptorType = p[1];
+	desc->bInterfaceNumber = p[2];
+	desc->bAlternateSetting = p[3];
+	desc->bNumEndpoints = p[4];
+	desc->bInterfaceClass = p[5];
+	desc->bInterfaceSubClass = p[6];
+	desc->bInterfaceProtocol = p[7];
+	desc->iInterface = p[8];
+}
+
+/* "bbwbbbbb" */
+static inline void decode_config(const unsigned char *p,
+	struct libusb_config_descriptor *config, int host_endian)
+{
+	config->bLength = p[0];
+	config->bDescriptorType = p[1];
+	config->wTotalLength = desc_get_w(p + 2, host_endian);
+	config->bNumInterfaces = p[4];
+	config->bConfigurationValue = p[5];
+	config->iConfiguration = p[6];
+	config->bmAttributes = p[7];
+	config->MaxPower = p[8];
+}
+
+/* "bbwb" */
+static inline void decode_bos(const unsigned char *p,
+	struct libusb_bos_descriptor *bos, int host_endian)
+{
+	bos->bLength = p[0];
+	bos->bDescriptorType = p[1];
+	bos->wTotalLength = desc_get_w(p + 2, host_endian);
+	bos->bNumDeviceCaps = p[4];
+}
+
+/* "bbb" */
+static inline void decode_dev_cap(const unsigned char *p,
+	struct libusb_bos_dev_capability_descriptor *dev_cap)
+{
+	dev_cap->bLength = p[0];
+	dev_cap->bDescriptorType = p[1];
+	dev_cap->bDevCapabilityType = p[2];
+}
+
+/* A parsed configuration descriptor lives in a single allocation, laid out
+ * as the config descriptor followed by the arrays of interfaces,
+ * altsettings and endpoints, followed by the extra descriptor bytes. The
+ * parser takes its memory from the regions of this arena in order, so the
+ * altsettings of an interface and the endpoints of an altsetting always
+ * end up contiguous. */
+struct config_arena {
+	struct libusb_interface *interfaces;
+	struct libusb_interface_descriptor *altsettings;
+	struct libusb_endpoint_descriptor *endpoints;
+	unsigned char *extra;
+};
+
+static unsigned char *arena_copy_extra(struct config_arena *arena,
+	const unsigned char *begin, int len)
+{
+	unsigned char *extra = arena->extra;
+
+	memcpy(extra, begin, len);
+	arena->extra += len;
+	return extra;
 }
 
 static int parse_endpoint(struct libusb_context *ctx,
-	struct libusb_endpoint_descriptor *endpoint, unsigned char *buffer,
-	int size, int host_endian)
+	struct libusb_endpoint_descriptor *endpoint, struct config_arena *arena,
+	unsigned char *buffer, int size, int host_endian)
 {
 	struct usb_descriptor_header header;
-	unsigned char *extra;
 	unsigned char *begin;
 	int parsed = 0;
 	int len;
@@ -114,7 +229,7 @@ static int parse_endpoint(struct libusb_context *ctx,
 		return LIBUSB_ERROR_IO;
 	}
 
-	usbi_parse_descriptor(buffer, "bb", &header, 0);
+	decode_header(buffer, &header);
 	if (header.bDescriptorType != LIBUSB_DT_ENDPOINT) {
 		usbi_err(ctx, "unexpected descriptor %x (expected %x)",
 			header.bDescriptorType, LIBUSB_DT_ENDPOINT);
@@ -126,9 +241,9 @@ static int parse_endpoint(struct libusb_context *ctx,
 		return parsed;
 	}
 	if (header.bLength >= ENDPOINT_AUDIO_DESC_LENGTH)
-		usbi_parse_descriptor(buffer, "bbbbwbbb", endpoint, host_endian);
+		decode_endpoint(buffer, endpoint, 1, host_endian);
 	else if (header.bLength >= ENDPOINT_DESC_LENGTH)
-		usbi_parse_descriptor(buffer, "bbbbwb", endpoint, host_endian);
+		decode_endpoint(buffer, endpoint, 0, host_endian);
 	else {
 		usbi_err(ctx, "invalid endpoint bLength (%d)", header.bLength);
 		return LIBUSB_ERROR_IO;
@@ -142,7 +257,7 @@ static int parse_endpoint(struct libusb_context *ctx,
 	/*  descriptors */
 	begin = buffer;
 	while (size >= DESC_HEADER_LENGTH) {
-		usbi_parse_descriptor(buffer, "bb", &header, 0);
+		decode_header(buffer, &header);
 		if (header.bLength < DESC_HEADER_LENGTH) {
 			usbi_err(ctx, "invalid extra ep desc len (%d)",
 				 header.bLength);
@@ -175,96 +290,53 @@ static int parse_endpoint(struct libusb_context *ctx,
 		return parsed;
 	}
 
-	extra = malloc(len);
-	endpoint->extra = extra;
-	if (!extra) {
-		endpoint->extra_length = 0;
-		return LIBUSB_ERROR_NO_MEM;
-	}
-
-	memcpy(extra, begin, len);
+	endpoint->extra = arena_copy_extra(arena, begin, len);
 	endpoint->extra_length = len;
 
 	return parsed;
 }
 
-static void clear_interface(struct libusb_interface *usb_interface)
-{
-	int i;
-	int j;
-
-	if (usb_interface->altsetting) {
-		for (i = 0; i < usb_interface->num_altsetting; i++) {
-			struct libusb_interface_descriptor *ifp =
-				(struct libusb_interface_descriptor *)
-				usb_interface->altsetting + i;
-			if (ifp->extra)
-				free((void *) ifp->extra);
-			if (ifp->endpoint) {
-				for (j = 0; j < ifp->bNumEndpoints; j++)
-					clear_endpoint((struct libusb_endpoint_descriptor *)
-						ifp->endpoint + j);
-				free((void *) ifp->endpoint);
-			}
-		}
-		free((void *) usb_interface->altsetting);
-		usb_interface->altsetting = NULL;
-	}
-
-}
-
 static int parse_interface(libusb_context *ctx,
-	struct libusb_interface *usb_interface, unsigned char *buffer, int size,
-	int host_endian)
+	struct libusb_interface *usb_interface, struct config_arena *arena,
+	unsigned char *buffer, int size, int host_endian)
 {
 	int i;
 	int len;
 	int r;
 	int parsed = 0;
 	int interface_number = -1;
-	size_t tmp;
 	struct usb_descriptor_header header;
+	struct libusb_interface_descriptor desc;
 	struct libusb_interface_descriptor *ifp;
 	unsigned char *begin;
 
+	usb_interface->altsetting = arena->altsettings;
 	usb_interface->num_altsetting = 0;
 
 	while (size >= INTERFACE_DESC_LENGTH) {
-		struct libusb_interface_descriptor *altsetting =
-			(struct libusb_interface_descriptor *) usb_interface->altsetting;
-		altsetting = usbi_reallocf(altsetting,
-			sizeof(struct libusb_interface_descriptor) *
-			(usb_interface->num_altsetting + 1));
-		if (!altsetting) {
-			r = LIBUSB_ERROR_NO_MEM;
-			goto err;
-		}
-		usb_interface->altsetting = altsetting;
-
-		ifp = altsetting + usb_interface->num_altsetting;
-		usbi_parse_descriptor(buffer, "bbbbbbbbb", ifp, 0);
-		if (ifp->bDescriptorType != LIBUSB_DT_INTERFACE) {
+		decode_interface(buffer, &desc);
+		if (desc.bDescriptorType != LIBUSB_DT_INTERFACE) {
 			usbi_err(ctx, "unexpected descriptor %x (expected %x)",
-				 ifp->bDescriptorType, LIBUSB_DT_INTERFACE);
+				 desc.bDescriptorType, LIBUSB_DT_INTERFACE);
 			return parsed;
 		}
-		if (ifp->bLength < INTERFACE_DESC_LENGTH) {
+		if (desc.bLength < INTERFACE_DESC_LENGTH) {
 			usbi_err(ctx, "invalid interface bLength (%d)",
-				 ifp->bLength);
-			r = LIBUSB_ERROR_IO;
-			goto err;
+				 desc.bLength);
+			return LIBUSB_ERROR_IO;
 		}
-		if (ifp->bLength > size) {
+		if (desc.bLength > size) {
 			usbi_warn(ctx, "short intf descriptor read %d/%d",
-				 size, ifp->bLength);
+				 size, desc.bLength);
 			return parsed;
 		}
-		if (ifp->bNumEndpoints > USB_MAXENDPOINTS) {
-			usbi_err(ctx, "too many endpoints (%d)", ifp->bNumEndpoints);
-			r = LIBUSB_ERROR_IO;
-			goto err;
+		if (desc.bNumEndpoints > USB_MAXENDPOINTS) {
+			usbi_err(ctx, "too many endpoints (%d)", desc.bNumEndpoints);
+			return LIBUSB_ERROR_IO;
 		}
 
+		ifp = arena->altsettings++;
+		*ifp = desc;
 		usb_interface->num_altsetting++;
 		ifp->extra = NULL;
 		ifp->extra_length = 0;
@@ -282,13 +354,12 @@ static int parse_interface(libusb_context *ctx,
 
 		/* Skip over any interface, class or vendor descriptors */
 		while (size >= DESC_HEADER_LENGTH) {
-			usbi_parse_descriptor(buffer, "bb", &header, 0);
+			decode_header(buffer, &header);
 			if (header.bLength < DESC_HEADER_LENGTH) {
 				usbi_err(ctx,
 					 "invalid extra intf desc len (%d)",
 					 header.bLength);
-				r = LIBUSB_ERROR_IO;
-				goto err;
+				return LIBUSB_ERROR_IO;
 			} else if (header.bLength > size) {
 				usbi_warn(ctx,
 					  "short extra intf desc read %d/%d",
@@ -312,31 +383,21 @@ static int parse_interface(libusb_context *ctx,
 		/*  drivers to later parse */
 		len = (int)(buffer - begin);
 		if (len) {
-			ifp->extra = malloc(len);
-			if (!ifp->extra) {
-				r = LIBUSB_ERROR_NO_MEM;
-				goto err;
-			}
-			memcpy((unsigned char *) ifp->extra, begin, len);
+			ifp->extra = arena_copy_extra(arena, begin, len);
 			ifp->extra_length = len;
 		}
 
 		if (ifp->bNumEndpoints > 0) {
-			struct libusb_endpoint_descriptor *endpoint;
-			tmp = ifp->bNumEndpoints * sizeof(struct libusb_endpoint_descriptor);
-			endpoint = malloc(tmp);
-			ifp->endpoint = endpoint;
-			if (!endpoint) {
-				r = LIBUSB_ERROR_NO_MEM;
-				goto err;
-			}
+			struct libusb_endpoint_descriptor *endpoint = arena->endpoints;
 
-			memset(endpoint, 0, tmp);
+			ifp->endpoint = endpoint;
+			arena->endpoints += ifp->bNumEndpoints;
+			memset(endpoint, 0, ifp->bNumEndpoints * sizeof(*endpoint));
 			for (i = 0; i < ifp->bNumEndpoints; i++) {
-				r = parse_endpoint(ctx, endpoint + i, buffer, size,
-					host_endian);
+				r = parse_endpoint(ctx, endpoint + i, arena, buffer,
+					size, host_endian);
 				if (r < 0)
-					goto err;
+					return r;
 				if (r == 0) {
 					ifp->bNumEndpoints = (uint8_t)i;
 					break;;
@@ -348,40 +409,23 @@ static int parse_interface(libusb_context *ctx,
 			}
 		}
 
-		/* We check to see if it's an alternate to this one */
-		ifp = (struct libusb_interface_descriptor *) buffer;
+		/* We check to see if it's an alternate to this one. Look at the
+		 * raw bytes, the buffer has no alignment guarantees */
 		if (size < LIBUSB_DT_INTERFACE_SIZE ||
-				ifp->bDescriptorType != LIBUSB_DT_INTERFACE ||
-				ifp->bInterfaceNumber != interface_number)
+				buffer[1] != LIBUSB_DT_INTERFACE ||
+				buffer[2] != interface_number)
 			return parsed;
 	}
 
 	return parsed;
-err:
-	clear_interface(usb_interface);
-	return r;
-}
-
-static void clear_configuration(struct libusb_config_descriptor *config)
-{
-	if (config->interface) {
-		int i;
-		for (i = 0; i < config->bNumInterfaces; i++)
-			clear_interface((struct libusb_interface *)
-				config->interface + i);
-		free((void *) config->interface);
-	}
-	if (config->extra)
-		free((void *) config->extra);
 }
 
 static int parse_configuration(struct libusb_context *ctx,
-	struct libusb_config_descriptor *config, unsigned char *buffer,
-	int size, int host_endian)
+	struct libusb_config_descriptor *config, struct config_arena *arena,
+	unsigned char *buffer, int size, int host_endian)
 {
 	int i;
 	int r;
-	size_t tmp;
 	struct usb_descriptor_header header;
 	struct libusb_interface *usb_interface;
 
@@ -391,7 +435,7 @@ static int parse_configuration(struct libusb_context *ctx,
 		return LIBUSB_ERROR_IO;
 	}
 
-	usbi_parse_descriptor(buffer, "bbwbbbbb", config, host_endian);
+	decode_config(buffer, config, host_endian);
 	if (config->bDescriptorType != LIBUSB_DT_CONFIG) {
 		usbi_err(ctx, "unexpected descriptor %x (expected %x)",
 			 config->bDescriptorType, LIBUSB_DT_CONFIG);
@@ -411,13 +455,11 @@ static int parse_configuration(struct libusb_context *ctx,
 		return LIBUSB_ERROR_IO;
 	}
 
-	tmp = config->bNumInterfaces * sizeof(struct libusb_interface);
-	usb_interface = malloc(tmp);
+	usb_interface = arena->interfaces;
+	arena->interfaces += config->bNumInterfaces;
 	config->interface = usb_interface;
-	if (!config->interface)
-		return LIBUSB_ERROR_NO_MEM;
-
-	memset(usb_interface, 0, tmp);
+	memset(usb_interface, 0,
+		config->bNumInterfaces * sizeof(struct libusb_interface));
 	buffer += config->bLength;
 	size -= config->bLength;
 
@@ -432,14 +474,13 @@ static int parse_configuration(struct libusb_context *ctx,
 		/*  Specific descriptors */
 		begin = buffer;
 		while (size >= DESC_HEADER_LENGTH) {
-			usbi_parse_descriptor(buffer, "bb", &header, 0);
+			decode_header(buffer, &header);
 
 			if (header.bLength < DESC_HEADER_LENGTH) {
 				usbi_err(ctx,
 					 "invalid extra config desc len (%d)",
 					 header.bLength);
-				r = LIBUSB_ERROR_IO;
-				goto err;
+				return LIBUSB_ERROR_IO;
 			} else if (header.bLength > size) {
 				usbi_warn(ctx,
 					  "short extra config desc read %d/%d",
@@ -464,22 +505,17 @@ static int parse_configuration(struct libusb_context *ctx,
 		/*  drivers to later parse */
 		len = (int)(buffer - begin);
 		if (len) {
-			/* FIXME: We should realloc and append here */
+			/* FIXME: We should append here */
 			if (!config->extra_length) {
-				config->extra = malloc(len);
-				if (!config->extra) {
-					r = LIBUSB_ERROR_NO_MEM;
-					goto err;
-				}
-
-				memcpy((unsigned char *) config->extra, begin, len);
+				config->extra = arena_copy_extra(arena, begin, len);
 				config->extra_length = len;
 			}
 		}
 
-		r = parse_interface(ctx, usb_interface + i, buffer, size, host_endian);
+		r = parse_interface(ctx, usb_interface + i, arena, buffer, size,
+			host_endian);
 		if (r < 0)
-			goto err;
+			return r;
 		if (r == 0) {
 			config->bNumInterfaces = (uint8_t)i;
 			break;
@@ -490,35 +526,367 @@ static int parse_configuration(struct libusb_context *ctx,
 	}
 
 	return size;
+}
 
-err:
-	clear_configuration(config);
-	return r;
+/* A parsed configuration descriptor keeps the whole tree below it in the
+ * same allocation, which is size bytes long */
+struct usbi_config_descriptor {
+	size_t size;
+	struct libusb_config_descriptor desc;
+};
+
+#define CONFIG_TO_USBI_CONFIG(config) \
+	((struct usbi_config_descriptor *)((unsigned char *)(config) - \
+		offsetof(struct usbi_config_descriptor, desc)))
+
+/* Work out how much memory parsing the configuration descriptor in buf may
+ * take at most. Every interface descriptor in the buffer is counted as an
+ * altsetting, with room for all the endpoints it announces, and all the
+ * bytes following the config descriptor could end up as extra data. */
+static size_t config_arena_size(unsigned char *buf, int size,
+	size_t *interfaces_offset, size_t *altsettings_offset,
+	size_t *endpoints_offset, size_t *extra_offset)
+{
+	struct usb_descriptor_header header;
+	int num_interfaces = 0;
+	int num_altsettings = 0;
+	int num_endpoints = 0;
+	int total_size = size;
+
+	if (size >= LIBUSB_DT_CONFIG_SIZE)
+		num_interfaces = MIN(buf[4], USB_MAXINTERFACES);
+
+	while (size >= DESC_HEADER_LENGTH) {
+		decode_header(buf, &header);
+		if (header.bLength < DESC_HEADER_LENGTH || header.bLength > size)
+			break;
+		if (header.bDescriptorType == LIBUSB_DT_INTERFACE &&
+				size >= INTERFACE_DESC_LENGTH) {
+			num_altsettings++;
+			num_endpoints += MIN(buf[4], USB_MAXENDPOINTS);
+		}
+		buf += header.bLength;
+		size -= header.bLength;
+	}
+
+	*interfaces_offset = sizeof(struct usbi_config_descriptor);
+	*altsettings_offset = *interfaces_offset +
+		num_interfaces * sizeof(struct libusb_interface);
+	*endpoints_offset = *altsettings_offset +
+		num_altsettings * sizeof(struct libusb_interface_descriptor);
+	*extra_offset = *endpoints_offset +
+		num_endpoints * sizeof(struct libusb_endpoint_descriptor);
+	return *extra_offset + total_size;
 }
 
 static int raw_desc_to_config(struct libusb_context *ctx,
 	unsigned char *buf, int size, int host_endian,
 	struct libusb_config_descriptor **config)
 {
-	struct libusb_config_descriptor *_config = malloc(sizeof(*_config));
+	size_t interfaces_offset, altsettings_offset, endpoints_offset;
+	size_t extra_offset;
+	size_t arena_size = config_arena_size(buf, size, &interfaces_offset,
+		&altsettings_offset, &endpoints_offset, &extra_offset);
+	unsigned char *mem = malloc(arena_size);
+	struct usbi_config_descriptor *_config;
+	struct config_arena arena;
 	int r;
-	
-	if (!_config)
+
+	if (!mem)
 		return LIBUSB_ERROR_NO_MEM;
 
-	r = parse_configuration(ctx, _config, buf, size, host_endian);
+	_config = (struct usbi_config_descriptor *) mem;
+	_config->size = arena_size;
+	arena.interfaces = (struct libusb_interface *)(mem + interfaces_offset);
+	arena.altsettings =
+		(struct libusb_interface_descriptor *)(mem + altsettings_offset);
+	arena.endpoints =
+		(struct libusb_endpoint_descriptor *)(mem + endpoints_offset);
+	arena.extra = mem + extra_offset;
+
+	r = parse_configuration(ctx, &_config->desc, &arena, buf, size,
+		host_endian);
 	if (r < 0) {
 		usbi_err(ctx, "parse_configuration failed with error %d", r);
-		free(_config);
+		free(mem);
 		return r;
 	} else if (r > 0) {
 		usbi_warn(ctx, "still %d bytes of descriptor data left", r);
 	}
-	
-	*config = _config;
+
+	*config = &_config->desc;
 	return LIBUSB_SUCCESS;
 }
 
+/* whether LIBUSB_CACHE_CONFIG and LIBUSB_CACHE_STRINGS are set to something
+ * other than 0, as read by usbi_descriptor_read_env() */
+static int config_cache = 0;
+static int string_cache = 0;
+
+static int config_cache_enabled(void)
+{
+	return config_cache;
+}
+
+static int env_enabled(const char *name)
+{
+	const char *env = getenv(name);
+
+	return env && *env && strcmp(env, "0");
+}
+
+/* Read the settings of the descriptor caches from the environment. Called
+ * by libusb_init() with default_context_lock held. Only the first call reads
+ * them, before any device exists, so that they never change while the
+ * caches are in use and can be read without a lock. */
+void usbi_descriptor_read_env(void)
+{
+	static int env_read = 0;
+
+	if (env_read)
+		return;
+	env_read = 1;
+	config_cache = env_enabled("LIBUSB_CACHE_CONFIG");
+	string_cache = env_enabled("LIBUSB_CACHE_STRINGS");
+}
+
+/* rebase a pointer into the allocation of a config descriptor at from onto
+ * a copy of it at to */
+#define CONFIG_REBASE(ptr, from, to) \
+	((ptr) ? (void *)((to) + ((const unsigned char *)(ptr) - (from))) : NULL)
+
+/* copy a parsed config descriptor, so that every caller gets a tree of its
+ * own which it may modify and free */
+static int copy_config(const struct libusb_config_descriptor *config,
+	struct libusb_config_descriptor **copy)
+{
+	const unsigned char *from =
+		(const unsigned char *) CONFIG_TO_USBI_CONFIG(config);
+	size_t size = CONFIG_TO_USBI_CONFIG(config)->size;
+	unsigned char *to = malloc(size);
+	struct libusb_config_descriptor *desc;
+	int i, j, k;
+
+	if (!to)
+		return LIBUSB_ERROR_NO_MEM;
+
+	memcpy(to, from, size);
+	desc = &((struct usbi_config_descriptor *) to)->desc;
+	desc->interface = CONFIG_REBASE(desc->interface, from, to);
+	desc->extra = CONFIG_REBASE(desc->extra, from, to);
+	for (i = 0; desc->interface && i < desc->bNumInterfaces; i++) {
+		struct libusb_interface *iface =
+			(struct libusb_interface *) &desc->interface[i];
+
+		iface->altsetting = CONFIG_REBASE(iface->altsetting, from, to);
+		for (j = 0; iface->altsetting && j < iface->num_altsetting; j++) {
+			struct libusb_interface_descriptor *altsetting =
+				(struct libusb_interface_descriptor *) &iface->altsetting[j];
+
+			altsetting->extra = CONFIG_REBASE(altsetting->extra, from, to);
+			altsetting->endpoint =
+				CONFIG_REBASE(altsetting->endpoint, from, to);
+			for (k = 0; altsetting->endpoint &&
+					k < altsetting->bNumEndpoints; k++) {
+				struct libusb_endpoint_descriptor *ep =
+					(struct libusb_endpoint_descriptor *) &altsetting->endpoint[k];
+
+				ep->extra = CONFIG_REBASE(ep->extra, from, to);
+			}
+		}
+	}
+
+	*copy = desc;
+	return LIBUSB_SUCCESS;
+}
+
+/* put a copy of a freshly parsed config descriptor into the cache of the
+ * device, by index or as the active one if config_index is -1, unless
+ * another thread got there first. without memory for the copy or the
+ * cache, the descriptor is just not cached */
+static void cache_config(struct libusb_device *dev, int config_index,
+	const struct libusb_config_descriptor *config)
+{
+	struct libusb_config_descriptor **slot = NULL;
+	struct libusb_config_descriptor *copy;
+
+	if (copy_config(config, &copy) < 0)
+		return;
+
+	usbi_mutex_lock(&dev->lock);
+	if (config_index < 0)
+		slot = &dev->active_config_desc;
+	else if (dev->config_descs)
+		slot = &dev->config_descs[config_index];
+	if (slot && !*slot) {
+		*slot = copy;
+		copy = NULL;
+	}
+	usbi_mutex_unlock(&dev->lock);
+
+	libusb_free_config_descriptor(copy);
+}
+
+/* must be called with dev->lock held */
+static struct libusb_config_descriptor *drop_active_config(
+	struct libusb_device *dev)
+{
+	struct libusb_config_descriptor *config = dev->active_config_desc;
+
+	dev->active_config_desc = NULL;
+	dev->endpoints_valid = 0;
+	dev->config_generation++;
+	return config;
+}
+
+/* Drop the cached descriptor of the active configuration and the endpoint
+ * table built from it, for when the device may have switched to another
+ * configuration. */
+void usbi_device_invalidate_active_config(struct libusb_device *dev)
+{
+	struct libusb_config_descriptor *config;
+
+	usbi_mutex_lock(&dev->lock);
+	config = drop_active_config(dev);
+	usbi_mutex_unlock(&dev->lock);
+
+	libusb_free_config_descriptor(config);
+}
+
+/* Drop all cached config descriptors of a device, for when it is
+ * disconnected or freed. */
+void usbi_device_free_config_cache(struct libusb_device *dev)
+{
+	struct libusb_config_descriptor **configs;
+	struct libusb_config_descriptor *config;
+	int i;
+
+	usbi_mutex_lock(&dev->lock);
+	configs = dev->config_descs;
+	dev->config_descs = NULL;
+	config = drop_active_config(dev);
+	usbi_mutex_unlock(&dev->lock);
+
+	if (configs) {
+		for (i = 0; i < dev->num_configurations; i++)
+			libusb_free_config_descriptor(configs[i]);
+		free(configs);
+	}
+	libusb_free_config_descriptor(config);
+}
+
+static void fill_endpoint_info(const struct libusb_endpoint_descriptor *ep,
+	struct usbi_endpoint_info *info)
+{
+	const unsigned char *buffer = ep->extra;
+	int size = ep->extra_length;
+
+	info->present = 1;
+	info->type = ep->bmAttributes & 0x3;
+	info->interval = ep->bInterval;
+	info->max_packet = ep->wMaxPacketSize;
+	if (info->type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS
+			|| info->type == LIBUSB_TRANSFER_TYPE_INTERRUPT)
+		info->mult = (ep->wMaxPacketSize >> 11) & 3;
+
+	/* a SuperSpeed companion descriptor follows among the extra ones */
+	while (size >= DESC_HEADER_LENGTH) {
+		if (buffer[0] < 2 || buffer[0] > size)
+			return;
+		if (buffer[1] == LIBUSB_DT_SS_ENDPOINT_COMPANION &&
+				buffer[0] >= LIBUSB_DT_SS_ENDPOINT_COMPANION_SIZE) {
+			info->max_burst = buffer[2];
+			if (info->type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS)
+				info->mult = buffer[3] & 0x3;
+			return;
+		}
+		size -= buffer[0];
+		buffer += buffer[0];
+	}
+}
+
+/* fill an endpoint table from a configuration. an address used in several
+ * interfaces or alternate settings takes the first descriptor found, as a
+ * walk of the configuration would */
+static void fill_endpoint_table(const struct libusb_config_descriptor *config,
+	struct usbi_endpoint_info *table)
+{
+	int i, j, k;
+
+	memset(table, 0, USBI_ENDPOINT_SLOTS * sizeof(*table));
+	for (i = 0; i < config->bNumInterfaces; i++) {
+		const struct libusb_interface *iface = &config->interface[i];
+
+		for (j = 0; j < iface->num_altsetting; j++) {
+			const struct libusb_interface_descriptor *altsetting =
+				&iface->altsetting[j];
+
+			for (k = 0; k < altsetting->bNumEndpoints; k++) {
+				const struct libusb_endpoint_descriptor *ep =
+					&altsetting->endpoint[k];
+				struct usbi_endpoint_info *info;
+
+				if (ep->bEndpointAddress & 0x70)
+					continue;
+				info = &table[USBI_ENDPOINT_SLOT(ep->bEndpointAddress)];
+				if (!info->present)
+					fill_endpoint_info(ep, info);
+			}
+		}
+	}
+}
+
+/* Look up an endpoint of the active configuration. The table is built on
+ * first use, whether or not LIBUSB_CACHE_CONFIG is set, and kept until the
+ * active configuration is invalidated by libusb_set_configuration() or
+ * libusb_reset_device(), so that later lookups neither read the descriptor
+ * nor allocate.
+ * Returns LIBUSB_ERROR_NOT_FOUND if the endpoint does not exist and
+ * LIBUSB_ERROR_OTHER if the active configuration cannot be read. */
+int usbi_device_get_endpoint_info(struct libusb_device *dev,
+	unsigned char endpoint, struct usbi_endpoint_info *info)
+{
+	struct usbi_endpoint_info table[USBI_ENDPOINT_SLOTS];
+	struct libusb_config_descriptor *config;
+	int slot = USBI_ENDPOINT_SLOT(endpoint);
+	unsigned int generation;
+	int r;
+
+	if (endpoint & 0x70)
+		return LIBUSB_ERROR_NOT_FOUND;
+
+	usbi_mutex_lock(&dev->lock);
+	if (dev->endpoints_valid) {
+		*info = dev->endpoints[slot];
+		usbi_mutex_unlock(&dev->lock);
+		return info->present ? LIBUSB_SUCCESS : LIBUSB_ERROR_NOT_FOUND;
+	}
+	generation = dev->config_generation;
+	usbi_mutex_unlock(&dev->lock);
+
+	r = libusb_get_active_config_descriptor(dev, &config);
+	if (r < 0) {
+		usbi_err(DEVICE_CTX(dev),
+			"could not retrieve active config descriptor");
+		return LIBUSB_ERROR_OTHER;
+	}
+
+	fill_endpoint_table(config, table);
+	*info = table[slot];
+
+	/* only keep the table if the configuration was not invalidated
+	 * meanwhile */
+	usbi_mutex_lock(&dev->lock);
+	if (dev->config_generation == generation) {
+		memcpy(dev->endpoints, table, sizeof(table));
+		dev->endpoints_valid = 1;
+	}
+	usbi_mutex_unlock(&dev->lock);
+
+	libusb_free_config_descriptor(config);
+	return info->present ? LIBUSB_SUCCESS : LIBUSB_ERROR_NOT_FOUND;
+}
+
 int usbi_device_cache_descriptor(libusb_device *dev)
 {
 	int r, host_endian = 0;
@@ -564,6 +932,13 @@ int API_EXPORTED libusb_get_device_descriptor(libusb_device *dev,
  * This is a non-blocking function which does not involve any requests being
  * sent to the device.
  *
+ * If the LIBUSB_CACHE_CONFIG environment variable is set to a value other
+ * than 0, the descriptor is parsed once and kept on the device for as long as
+ * the operating system reports the same configuration, and until
+ * libusb_set_configuration() or libusb_reset_device() is called or the device
+ * is disconnected. Every call still returns a copy of its own. The variable
+ * is read by the first call to libusb_init().
+ *
  * \param dev a device
  * \param config output location for the USB configuration descriptor. Only
  * valid if 0 was returned. Must be freed with libusb_free_config_descriptor()
@@ -592,7 +967,26 @@ int API_EXPORTED libusb_get_active_config_descriptor(libusb_device *dev,
 		return LIBUSB_ERROR_IO;
 	}
 
-	usbi_parse_descriptor(tmp, "bbw", &_config, host_endian);
+	_config.wTotalLength = desc_get_w(tmp + 2, host_endian);
+	if (config_cache_enabled()) {
+		struct libusb_config_descriptor *stale = NULL;
+
+		/* the header tells whether the configuration changed behind
+		 * the back of libusb since the descriptor was cached */
+		usbi_mutex_lock(&dev->lock);
+		if (dev->active_config_desc &&
+				dev->active_config_desc->bConfigurationValue == tmp[5] &&
+				dev->active_config_desc->wTotalLength == _config.wTotalLength) {
+			r = copy_config(dev->active_config_desc, config);
+			usbi_mutex_unlock(&dev->lock);
+			return r;
+		}
+		if (dev->active_config_desc)
+			stale = drop_active_config(dev);
+		usbi_mutex_unlock(&dev->lock);
+		libusb_free_config_descriptor(stale);
+	}
+
 	buf = malloc(_config.wTotalLength);
 	if (!buf)
 		return LIBUSB_ERROR_NO_MEM;
@@ -601,6 +995,8 @@ int API_EXPORTED libusb_get_active_config_descriptor(libusb_device *dev,
 		_config.wTotalLength, &host_endian);
 	if (r >= 0)
 		r = raw_desc_to_config(dev->ctx, buf, r, host_endian, config);
+	if (r == LIBUSB_SUCCESS && config_cache_enabled())
+		cache_config(dev, -1, *config);
 
 	free(buf);
 	return r;
@@ -611,6 +1007,12 @@ int API_EXPORTED libusb_get_active_config_descriptor(libusb_device *dev,
  * This is a non-blocking function which does not involve any requests being
  * sent to the device.
  *
+ * If the LIBUSB_CACHE_CONFIG environment variable is set to a value other
+ * than 0, the descriptor is parsed once and kept on the device until it is
+ * disconnected, so repeated calls neither ask the operating system nor parse
+ * again. Every call still returns a copy of its own. The variable is read by
+ * the first call to libusb_init().
+ *
  * \param dev a device
  * \param config_index the index of the configuration you wish to retrieve
  * \param config output location for the USB configuration descriptor. Only
@@ -635,6 +1037,19 @@ int API_EXPORTED libusb_get_config_descriptor(libusb_device *dev,
 	if (config_index >= dev->num_configurations)
 		return LIBUSB_ERROR_NOT_FOUND;
 
+	if (config_cache_enabled()) {
+		usbi_mutex_lock(&dev->lock);
+		if (dev->config_descs && dev->config_descs[config_index]) {
+			r = copy_config(dev->config_descs[config_index], config);
+			usbi_mutex_unlock(&dev->lock);
+			return r;
+		}
+		if (!dev->config_descs)
+			dev->config_descs = calloc(dev->num_configurations,
+				sizeof(*dev->config_descs));
+		usbi_mutex_unlock(&dev->lock);
+	}
+
 	r = usbi_backend->get_config_descriptor(dev, config_index, tmp,
 		LIBUSB_DT_CONFIG_SIZE, &host_endian);
 	if (r < 0)
@@ -645,7 +1060,7 @@ int API_EXPORTED libusb_get_config_descriptor(libusb_device *dev,
 		return LIBUSB_ERROR_IO;
 	}
 
-	usbi_parse_descriptor(tmp, "bbw", &_config, host_endian);
+	_config.wTotalLength = desc_get_w(tmp + 2, host_endian);
 	buf = malloc(_config.wTotalLength);
 	if (!buf)
 		return LIBUSB_ERROR_NO_MEM;
@@ -654,6 +1069,8 @@ int API_EXPORTED libusb_get_config_descriptor(libusb_device *dev,
 		_config.wTotalLength, &host_endian);
 	if (r >= 0)
 		r = raw_desc_to_config(dev->ctx, buf, r, host_endian, config);
+	if (r == LIBUSB_SUCCESS && config_cache_enabled())
+		cache_config(dev, config_index, *config);
 
 	free(buf);
 	return r;
@@ -712,6 +1129,17 @@ int API_EXPORTED libusb_get_config_descriptor_by_value(libusb_device *dev,
 	int r, idx, host_endian;
 	unsigned char *buf = NULL;
 
+	usbi_mutex_lock(&dev->lock);
+	for (idx = 0; dev->config_descs && idx < dev->num_configurations; idx++) {
+		struct libusb_config_descriptor *cached = dev->config_descs[idx];
+		if (cached && cached->bConfigurationValue == bConfigurationValue) {
+			r = copy_config(cached, config);
+			usbi_mutex_unlock(&dev->lock);
+			return r;
+		}
+	}
+	usbi_mutex_unlock(&dev->lock);
+
 	if (usbi_backend->get_config_descriptor_by_value) {
 		r = usbi_backend->get_config_descriptor_by_value(dev,
 			bConfigurationValue, &buf, &host_endian);
@@ -743,8 +1171,9 @@ void API_EXPORTED libusb_free_config_descriptor(
 	if (!config)
 		return;
 
-	clear_configuration(config);
-	free(config);
+	/* the whole descriptor tree lives in one allocation, see
+	 * raw_desc_to_config() */
+	free(CONFIG_TO_USBI_CONFIG(config));
 }
 
 /** \ingroup desc
@@ -772,7 +1201,7 @@ int API_EXPORTED libusb_get_ss_endpoint_companion_descriptor(
 	*ep_comp = NULL;
 
 	while (size >= DESC_HEADER_LENGTH) {
-		usbi_parse_descriptor(buffer, "bb", &header, 0);
+		decode_header(buffer, &header);
 		if (header.bLength < 2 || header.bLength > size) {
 			usbi_err(ctx, "invalid descriptor length %d",
 				 header.bLength);
@@ -791,7 +1220,11 @@ int API_EXPORTED libusb_get_ss_endpoint_companion_descriptor(
 		*ep_comp = malloc(sizeof(**ep_comp));
 		if (*ep_comp == NULL)
 			return LIBUSB_ERROR_NO_MEM;
-		usbi_parse_descriptor(buffer, "bbbbw", *ep_comp, 0);
+		(*ep_comp)->bLength = buffer[0];
+		(*ep_comp)->bDescriptorType = buffer[1];
+		(*ep_comp)->bMaxBurst = buffer[2];
+		(*ep_comp)->bmAttributes = buffer[3];
+		(*ep_comp)->wBytesPerInterval = desc_get_w(buffer + 4, 0);
 		return LIBUSB_SUCCESS;
 	}
 	return LIBUSB_ERROR_NOT_FOUND;
@@ -825,7 +1258,7 @@ static int parse_bos(struct libusb_context *ctx,
 		return LIBUSB_ERROR_IO;
 	}
 
-	usbi_parse_descriptor(buffer, "bbwb", &bos_header, host_endian);
+	decode_bos(buffer, &bos_header, host_endian);
 	if (bos_header.bDescriptorType != LIBUSB_DT_BOS) {
 		usbi_err(ctx, "unexpected descriptor %x (expected %x)",
 			 bos_header.bDescriptorType, LIBUSB_DT_BOS);
@@ -846,7 +1279,7 @@ static int parse_bos(struct libusb_context *ctx,
 	if (!_bos)
 		return LIBUSB_ERROR_NO_MEM;
 
-	usbi_parse_descriptor(buffer, "bbwb", _bos, host_endian);
+	decode_bos(buffer, _bos, host_endian);
 	buffer += bos_header.bLength;
 	size -= bos_header.bLength;
 
@@ -857,7 +1290,7 @@ static int parse_bos(struct libusb_context *ctx,
 				  size, LIBUSB_DT_DEVICE_CAPABILITY_SIZE);
 			break;
 		}
-		usbi_parse_descriptor(buffer, "bbb", &dev_cap, host_endian);
+		decode_dev_cap(buffer, &dev_cap);
 		if (dev_cap.bDescriptorType != LIBUSB_DT_DEVICE_CAPABILITY) {
 			usbi_warn(ctx, "unexpected descriptor %x (expected %x)",
 				  dev_cap.bDescriptorType, LIBUSB_DT_DEVICE_CAPABILITY);
@@ -890,6 +1323,20 @@ static int parse_bos(struct libusb_context *ctx,
 	return LIBUSB_SUCCESS;
 }
 
+/* Parse raw descriptor data that didn't come from a device, for the
+ * descriptor benchmark in tests/. The data is in bus-endian format. */
+int usbi_parse_raw_config_descriptor(struct libusb_context *ctx,
+	unsigned char *buf, int size, struct libusb_config_descriptor **config)
+{
+	return raw_desc_to_config(ctx, buf, size, 0, config);
+}
+
+int usbi_parse_raw_bos_descriptor(struct libusb_context *ctx,
+	unsigned char *buf, int size, struct libusb_bos_descriptor **bos)
+{
+	return parse_bos(ctx, bos, buf, size, 0);
+}
+
 /** \ingroup desc
  * Get a Binary Object Store (BOS) descriptor
  * This is a BLOCKING function, which will send requests to the device.
@@ -925,7 +1372,7 @@ int API_EXPORTED libusb_get_bos_descriptor(libusb_device_handle *handle,
 		return LIBUSB_ERROR_IO;
 	}
 
-	usbi_parse_descriptor(bos_header, "bbwb", &_bos, host_endian);
+	decode_bos(bos_header, &_bos, host_endian);
 	usbi_dbg("found BOS descriptor: size %d bytes, %d capabilities",
 		 _bos.wTotalLength, _bos.bNumDeviceCaps);
 	bos_data = calloc(_bos.wTotalLength, 1);
@@ -999,8 +1446,11 @@ int API_EXPORTED libusb_get_usb_2_0_extension_descriptor(
 	if (!_usb_2_0_extension)
 		return LIBUSB_ERROR_NO_MEM;
 
-	usbi_parse_descriptor((unsigned char *)dev_cap, "bbbd",
-			      _usb_2_0_extension, host_endian);
+	_usb_2_0_extension->bLength = dev_cap->bLength;
+	_usb_2_0_extension->bDescriptorType = dev_cap->bDescriptorType;
+	_usb_2_0_extension->bDevCapabilityType = dev_cap->bDevCapabilityType;
+	_usb_2_0_extension->bmAttributes =
+		desc_get_d(dev_cap->dev_capability_data, host_endian);
 
 	*usb_2_0_extension = _usb_2_0_extension;
 	return LIBUSB_SUCCESS;
@@ -1135,12 +1585,180 @@ void API_EXPORTED libusb_free_container_id_descriptor(
 	free(container_id);
 }
 
+/* a string descriptor kept on its device. langid 0, which no language has,
+ * stands for the language the device lists first; index 0 with langid 0 is
+ * the list of languages itself */
+struct usbi_cached_string {
+	struct usbi_cached_string *next;
+	uint16_t langid;
+	uint8_t desc_index;
+	unsigned char desc
+#if defined(__STDC_VERSION__) && (__STDC_VERSION__ >= 199901L)
+	[] /* valid C99 code */
+#else
+	[0] /* non-standard, but usually working code */
+#endif
+	;
+};
+
+static int string_cache_enabled(void)
+{
+	return string_cache;
+}
+
+/* copy a cached string descriptor to buffer, which holds 255 bytes. returns
+ * its length or LIBUSB_ERROR_NOT_FOUND */
+static int get_cached_string(struct libusb_device *dev, uint8_t desc_index,
+	uint16_t langid, unsigned char *buffer)
+{
+	struct usbi_cached_string *cached;
+	int r = LIBUSB_ERROR_NOT_FOUND;
+
+	usbi_mutex_lock(&dev->lock);
+	for (cached = dev->strings; cached; cached = cached->next) {
+		if (cached->desc_index == desc_index && cached->langid == langid) {
+			r = cached->desc[0];
+			memcpy(buffer, cached->desc, r);
+			break;
+		}
+	}
+	usbi_mutex_unlock(&dev->lock);
+	return r;
+}
+
+/* keep a copy of a validated string descriptor. failing to is harmless, the
+ * next caller reads it again */
+static void cache_string(struct libusb_device *dev, uint8_t desc_index,
+	uint16_t langid, const unsigned char *desc)
+{
+	struct usbi_cached_string *cached;
+
+	usbi_mutex_lock(&dev->lock);
+	for (cached = dev->strings; cached; cached = cached->next) {
+		if (cached->desc_index == desc_index && cached->langid == langid)
+			break;
+	}
+	if (!cached) {
+		cached = malloc(sizeof(*cached) + desc[0]);
+		if (cached) {
+			cached->langid = langid;
+			cached->desc_index = desc_index;
+			memcpy(cached->desc, desc, desc[0]);
+			cached->next = dev->strings;
+			dev->strings = cached;
+		}
+	}
+	usbi_mutex_unlock(&dev->lock);
+}
+
+/* Drop the string descriptors of a device, for when it is disconnected or
+ * freed. */
+void usbi_device_free_string_cache(struct libusb_device *dev)
+{
+	struct usbi_cached_string *cached, *next;
+
+	usbi_mutex_lock(&dev->lock);
+	cached = dev->strings;
+	dev->strings = NULL;
+	usbi_mutex_unlock(&dev->lock);
+
+	for (; cached; cached = next) {
+		next = cached->next;
+		free(cached);
+	}
+}
+
+/* build a string descriptor from a UTF-8 string. malformed sequences become
+ * U+FFFD, and the string is cut to the 126 UTF-16 code units that fit.
+ * returns the length of the descriptor */
+static int utf8_to_string_descriptor(const char *str, unsigned char *buffer)
+{
+	const unsigned char *s = (const unsigned char *) str;
+	int di = 2;
+
+	while (*s) {
+		uint32_t c = *s;
+		int i, n;
+
+		if (c < 0x80) {
+			n = 1;
+		} else if ((c & 0xe0) == 0xc0) {
+			n = 2;
+			c &= 0x1f;
+		} else if ((c & 0xf0) == 0xe0) {
+			n = 3;
+			c &= 0x0f;
+		} else if ((c & 0xf8) == 0xf0) {
+			n = 4;
+			c &= 0x07;
+		} else {
+			n = 0;
+		}
+		for (i = 1; i < n; i++) {
+			if ((s[i] & 0xc0) != 0x80)
+				break;
+			c = (c << 6) | (s[i] & 0x3f);
+		}
+		if (n == 0 || i < n || c > 0x10ffff) {
+			c = 0xfffd;
+			n = i > 1 ? i : 1;
+		}
+		s += n;
+
+		if (c >= 0x10000) {
+			if (di + 4 > 254)
+				break;
+			c -= 0x10000;
+			buffer[di++] = (0xd800 | (c >> 10)) & 0xff;
+			buffer[di++] = (0xd800 | (c >> 10)) >> 8;
+			buffer[di++] = (0xdc00 | (c & 0x3ff)) & 0xff;
+			buffer[di++] = (0xdc00 | (c & 0x3ff)) >> 8;
+		} else {
+			if (di + 2 > 254)
+				break;
+			buffer[di++] = c & 0xff;
+			buffer[di++] = c >> 8;
+		}
+	}
+
+	buffer[0] = (unsigned char) di;
+	buffer[1] = LIBUSB_DT_STRING;
+	return di;
+}
+
+/* a string the operating system already read from the device, in its first
+ * language, as a string descriptor in buffer. returns its length or a
+ * LIBUSB_ERROR code */
+static int get_os_string(struct libusb_device *dev, uint8_t desc_index,
+	unsigned char *buffer)
+{
+	char str[512];
+	int r;
+
+	if (!usbi_backend->get_device_string)
+		return LIBUSB_ERROR_NOT_FOUND;
+
+	r = usbi_backend->get_device_string(dev, desc_index, str, sizeof(str));
+	if (r < 0)
+		return r;
+
+	return utf8_to_string_descriptor(str, buffer);
+}
+
 /** \ingroup desc
  * Retrieve a string descriptor in C style ASCII.
  *
  * Wrapper around libusb_get_string_descriptor(). Uses the first language
  * supported by the device.
  *
+ * If the LIBUSB_CACHE_STRINGS environment variable is set to a value other
+ * than 0, the language list and the strings are kept on the libusb_device
+ * once read, until the device is disconnected, so that matching devices by
+ * their strings does not cost control transfers each time. Where the
+ * operating system already holds the manufacturer, product and serial number
+ * strings (Linux sysfs), those are then read from there without any bus
+ * traffic at all. The variable is read by the first call to libusb_init().
+ *
  * \param dev a device handle
  * \param desc_index the index of the descriptor to retrieve
  * \param data output buffer for ASCII string descriptor
@@ -1151,6 +1769,7 @@ int API_EXPORTED libusb_get_string_descriptor_ascii(libusb_device_handle *dev,
 	uint8_t desc_index, unsigned char *data, int length)
 {
 	unsigned char tbuf[255]; /* Some devices choke on size > 255 */
+	int cache = string_cache_enabled();
 	int r, si, di;
 	uint16_t langid;
 
@@ -1166,12 +1785,31 @@ int API_EXPORTED libusb_get_string_descriptor_ascii(libusb_device_handle *dev,
 	if (desc_index == 0)
 		return LIBUSB_ERROR_INVALID_PARAM;
 
-	r = libusb_get_string_descriptor(dev, 0, 0, tbuf, sizeof(tbuf));
-	if (r < 0)
-		return r;
+	if (cache) {
+		r = get_cached_string(dev->dev, desc_index, 0, tbuf);
+		if (r < 0) {
+			r = get_os_string(dev->dev, desc_index, tbuf);
+			if (r >= 0)
+				cache_string(dev->dev, desc_index, 0, tbuf);
+		}
+		if (r >= 0)
+			goto convert;
+	}
 
-	if (r < 4)
-		return LIBUSB_ERROR_IO;
+	r = cache ? get_cached_string(dev->dev, 0, 0, tbuf) :
+		LIBUSB_ERROR_NOT_FOUND;
+	if (r < 0) {
+		r = libusb_get_string_descriptor(dev, 0, 0, tbuf, sizeof(tbuf));
+		if (r < 0)
+			return r;
+
+		if (r < 4)
+			return LIBUSB_ERROR_IO;
+
+		if (cache && tbuf[1] == LIBUSB_DT_STRING && tbuf[0] >= 4 &&
+				tbuf[0] <= r)
+			cache_string(dev->dev, 0, 0, tbuf);
+	}
 
 	langid = tbuf[2] | (tbuf[3] << 8);
 
@@ -1186,6 +1824,10 @@ int API_EXPORTED libusb_get_string_descriptor_ascii(libusb_device_handle *dev,
 	if (tbuf[0] > r)
 		return LIBUSB_ERROR_IO;
 
+	if (cache && tbuf[0] >= 2)
+		cache_string(dev->dev, desc_index, 0, tbuf);
+
+convert:
 	for (di = 0, si = 2; si < tbuf[0]; si += 2) {
 		if (di >= (length - 1))
 			break;
@@ -67,6 +67,11 @@
  *
  * Callbacks for a particular context are automatically deregistered by libusb_exit().
  *
+ * Since version 1.0.20, a callback registered with
+ * \ref libusb_hotplug_register_batch_callback() is instead called once with
+ * all matching events that are pending when the event handler gets to them,
+ * which suits applications that see many devices come and go at once.
+ *
  * As of 1.0.16 there are two supported hotplug events:
  *  - LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED: A device has arrived and is ready to use
  *  - LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT: A device has left and is no longer available
@@ -147,16 +152,10 @@ int main (void) {
 \endcode
  */
 
-static int usbi_hotplug_match_cb (struct libusb_context *ctx,
-	struct libusb_device *dev, libusb_hotplug_event event,
-	struct libusb_hotplug_callback *hotplug_cb)
+/* whether the event on the device is one the callback asked for */
+static int usbi_hotplug_cb_matches (struct libusb_hotplug_callback *hotplug_cb,
+	struct libusb_device *dev, libusb_hotplug_event event)
 {
-	/* Handle lazy deregistration of callback */
-	if (hotplug_cb->needs_free) {
-		/* Free callback */
-		return 1;
-	}
-
 	if (!(hotplug_cb->events & event)) {
 		return 0;
 	}
@@ -176,26 +175,98 @@ static int usbi_hotplug_match_cb (struct libusb_context *ctx,
 		return 0;
 	}
 
+	return 1;
+}
+
+static int usbi_hotplug_match_cb (struct libusb_context *ctx,
+	struct libusb_device *dev, libusb_hotplug_event event,
+	struct libusb_hotplug_callback *hotplug_cb)
+{
+	/* Handle lazy deregistration of callback */
+	if (hotplug_cb->needs_free) {
+		/* Free callback */
+		return 1;
+	}
+
+	if (!usbi_hotplug_cb_matches (hotplug_cb, dev, event)) {
+		return 0;
+	}
+
 	return hotplug_cb->cb (ctx, dev, event, hotplug_cb->user_data);
 }
 
+/* the index list of callbacks that may match a device with these IDs */
+static struct list_head *hotplug_cbs_for_ids(struct libusb_context *ctx,
+	int vendor_id, int product_id)
+{
+	uint32_t hash;
+
+	if (LIBUSB_HOTPLUG_MATCH_ANY == vendor_id ||
+	    LIBUSB_HOTPLUG_MATCH_ANY == product_id) {
+		return &ctx->hotplug_cbs_any;
+	}
+
+	hash = ((uint32_t) vendor_id << 16 | (uint32_t) product_id) * 2654435761u;
+	return &ctx->hotplug_cbs_by_id[(hash >> 16) & (USBI_HOTPLUG_CB_BUCKETS - 1)];
+}
+
+static void usbi_hotplug_free_cb (struct libusb_hotplug_callback *hotplug_cb)
+{
+	list_del(&hotplug_cb->list);
+	list_del(&hotplug_cb->index_list);
+	free(hotplug_cb);
+}
+
 void usbi_hotplug_match(struct libusb_context *ctx, struct libusb_device *dev,
 	libusb_hotplug_event event)
 {
 	struct libusb_hotplug_callback *hotplug_cb, *next;
+	struct list_head *any, *by_id, *any_pos, *by_id_pos;
 	int ret;
 
 	usbi_mutex_lock(&ctx->hotplug_cbs_lock);
 
-	list_for_each_entry_safe(hotplug_cb, next, &ctx->hotplug_cbs, list, struct libusb_hotplug_callback) {
+	if (!dev) {
+		/* no device to match, just free deregistered callbacks */
+		list_for_each_entry_safe(hotplug_cb, next, &ctx->hotplug_cbs, list, struct libusb_hotplug_callback) {
+			if (hotplug_cb->needs_free)
+				usbi_hotplug_free_cb(hotplug_cb);
+		}
+		usbi_mutex_unlock(&ctx->hotplug_cbs_lock);
+		return;
+	}
+
+	/* only the callbacks that don't care about the IDs and those in the
+	 * bucket of the device can match. walk both lists at once in the order
+	 * of ctx->hotplug_cbs, that is by descending handle */
+	any = &ctx->hotplug_cbs_any;
+	by_id = hotplug_cbs_for_ids(ctx, dev->device_descriptor.idVendor,
+				    dev->device_descriptor.idProduct);
+	any_pos = any->next;
+	by_id_pos = by_id->next;
+
+	while (any_pos != any || by_id_pos != by_id) {
+		struct libusb_hotplug_callback *any_cb = NULL, *by_id_cb = NULL;
+
+		if (any_pos != any)
+			any_cb = list_entry(any_pos, struct libusb_hotplug_callback, index_list);
+		if (by_id_pos != by_id)
+			by_id_cb = list_entry(by_id_pos, struct libusb_hotplug_callback, index_list);
+
+		if (!by_id_cb || (any_cb && any_cb->handle > by_id_cb->handle)) {
+			hotplug_cb = any_cb;
+			any_pos = any_pos->next;
+		} else {
+			hotplug_cb = by_id_cb;
+			by_id_pos = by_id_pos->next;
+		}
+
 		usbi_mutex_unlock(&ctx->hotplug_cbs_lock);
 		ret = usbi_hotplug_match_cb (ctx, dev, event, hotplug_cb);
 		usbi_mutex_lock(&ctx->hotplug_cbs_lock);
 
-		if (ret) {
-			list_del(&hotplug_cb->list);
-			free(hotplug_cb);
-		}
+		if (ret)
+			usbi_hotplug_free_cb(hotplug_cb);
 	}
 
 	usbi_mutex_unlock(&ctx->hotplug_cbs_lock);
@@ -203,6 +274,83 @@ void usbi_hotplug_match(struct libusb_context *ctx, struct libusb_device *dev,
 	/* the backend is expected to call the callback for each active transfer */
 }
 
+/* calls each batch callback once, with the events of the messages that match
+ * it */
+static void usbi_hotplug_match_batch(struct libusb_context *ctx,
+	struct list_head *messages, int num_messages)
+{
+	struct libusb_hotplug_callback *hotplug_cb, *next;
+	struct libusb_hotplug_batch_entry *entries;
+	libusb_hotplug_message *message;
+	int num_entries, ret;
+
+	entries = malloc(num_messages * sizeof(*entries));
+	if (!entries) {
+		usbi_err(ctx, "error allocating hotplug batch");
+		return;
+	}
+
+	usbi_mutex_lock(&ctx->hotplug_cbs_lock);
+
+	list_for_each_entry_safe(hotplug_cb, next, &ctx->hotplug_batch_cbs, index_list, struct libusb_hotplug_callback) {
+		if (hotplug_cb->needs_free) {
+			usbi_hotplug_free_cb(hotplug_cb);
+			continue;
+		}
+
+		num_entries = 0;
+		list_for_each_entry(message, messages, list, libusb_hotplug_message) {
+			if (message->device &&
+			    usbi_hotplug_cb_matches(hotplug_cb, message->device, message->event)) {
+				entries[num_entries].device = message->device;
+				entries[num_entries].event = message->event;
+				num_entries++;
+			}
+		}
+		if (!num_entries)
+			continue;
+
+		usbi_mutex_unlock(&ctx->hotplug_cbs_lock);
+		ret = hotplug_cb->batch_cb (ctx, entries, num_entries, hotplug_cb->user_data);
+		usbi_mutex_lock(&ctx->hotplug_cbs_lock);
+
+		if (ret)
+			usbi_hotplug_free_cb(hotplug_cb);
+	}
+
+	usbi_mutex_unlock(&ctx->hotplug_cbs_lock);
+	free(entries);
+}
+
+/* delivers the hotplug messages taken from ctx->hotplug_msgs by the event
+ * handler, and frees them */
+void usbi_hotplug_process(struct libusb_context *ctx, struct list_head *messages)
+{
+	libusb_hotplug_message *message, *next;
+	int num_messages = 0;
+	int have_batch_cbs;
+
+	/* the callbacks taking one event at a time get them in order */
+	list_for_each_entry(message, messages, list, libusb_hotplug_message) {
+		usbi_hotplug_match(ctx, message->device, message->event);
+		num_messages++;
+	}
+
+	usbi_mutex_lock(&ctx->hotplug_cbs_lock);
+	have_batch_cbs = !list_empty(&ctx->hotplug_batch_cbs);
+	usbi_mutex_unlock(&ctx->hotplug_cbs_lock);
+	if (have_batch_cbs)
+		usbi_hotplug_match_batch(ctx, messages, num_messages);
+
+	list_for_each_entry_safe(message, next, messages, list, libusb_hotplug_message) {
+		/* the device left, dereference the device */
+		if (LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT == message->event)
+			libusb_unref_device(message->device);
+
+		free(message);
+	}
+}
+
 void usbi_hotplug_notification(struct libusb_context *ctx, struct libusb_device *dev,
 	libusb_hotplug_event event)
 {
@@ -227,10 +375,43 @@ void usbi_hotplug_notification(struct libusb_context *ctx, struct libusb_device
 	usbi_mutex_unlock(&ctx->event_data_lock);
 }
 
-int API_EXPORTED libusb_hotplug_register_callback(libusb_context *ctx,
+/* calls a new batch callback once with the matching devices of the list */
+static void usbi_hotplug_enumerate_batch(struct libusb_context *ctx,
+	struct libusb_device **devs, int len,
+	struct libusb_hotplug_callback *hotplug_cb)
+{
+	struct libusb_hotplug_batch_entry *entries;
+	int i, num_entries = 0;
+
+	if (len == 0) {
+		return;
+	}
+
+	entries = malloc(len * sizeof(*entries));
+	if (!entries) {
+		usbi_err(ctx, "error allocating hotplug batch");
+		return;
+	}
+
+	for (i = 0; i < len; i++) {
+		if (usbi_hotplug_cb_matches(hotplug_cb, devs[i],
+					    LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED)) {
+			entries[num_entries].device = devs[i];
+			entries[num_entries].event = LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED;
+			num_entries++;
+		}
+	}
+
+	if (num_entries)
+		hotplug_cb->batch_cb(ctx, entries, num_entries, hotplug_cb->user_data);
+	free(entries);
+}
+
+static int usbi_hotplug_register(libusb_context *ctx,
 	libusb_hotplug_event events, libusb_hotplug_flag flags,
 	int vendor_id, int product_id, int dev_class,
-	libusb_hotplug_callback_fn cb_fn, void *user_data,
+	libusb_hotplug_callback_fn cb_fn,
+	libusb_hotplug_batch_callback_fn batch_cb_fn, void *user_data,
 	libusb_hotplug_callback_handle *handle)
 {
 	libusb_hotplug_callback *new_callback;
@@ -245,7 +426,7 @@ int API_EXPORTED libusb_hotplug_register_callback(libusb_context *ctx,
 	if ((LIBUSB_HOTPLUG_MATCH_ANY != vendor_id && (~0xffff & vendor_id)) ||
 	    (LIBUSB_HOTPLUG_MATCH_ANY != product_id && (~0xffff & product_id)) ||
 	    (LIBUSB_HOTPLUG_MATCH_ANY != dev_class && (~0xff & dev_class)) ||
-	    !cb_fn) {
+	    (!cb_fn && !batch_cb_fn)) {
 		return LIBUSB_ERROR_INVALID_PARAM;
 	}
 
@@ -263,6 +444,7 @@ int API_EXPORTED libusb_hotplug_register_callback(libusb_context *ctx,
 	new_callback->flags = flags;
 	new_callback->events = events;
 	new_callback->cb = cb_fn;
+	new_callback->batch_cb = batch_cb_fn;
 	new_callback->user_data = user_data;
 	new_callback->needs_free = 0;
 
@@ -273,6 +455,11 @@ int API_EXPORTED libusb_hotplug_register_callback(libusb_context *ctx,
 	new_callback->handle = handle_id++;
 
 	list_add(&new_callback->list, &ctx->hotplug_cbs);
+	if (batch_cb_fn)
+		list_add(&new_callback->index_list, &ctx->hotplug_batch_cbs);
+	else
+		list_add(&new_callback->index_list,
+			 hotplug_cbs_for_ids(ctx, vendor_id, product_id));
 
 	usbi_mutex_unlock(&ctx->hotplug_cbs_lock);
 
@@ -288,10 +475,14 @@ int API_EXPORTED libusb_hotplug_register_callback(libusb_context *ctx,
 			return len;
 		}
 
-		for (i = 0; i < len; i++) {
-			usbi_hotplug_match_cb(ctx, devs[i],
-					LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED,
-					new_callback);
+		if (batch_cb_fn) {
+			usbi_hotplug_enumerate_batch(ctx, devs, len, new_callback);
+		} else {
+			for (i = 0; i < len; i++) {
+				usbi_hotplug_match_cb(ctx, devs[i],
+						LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED,
+						new_callback);
+			}
 		}
 
 		libusb_free_device_list(devs, 1);
@@ -305,6 +496,34 @@ int API_EXPORTED libusb_hotplug_register_callback(libusb_context *ctx,
 	return LIBUSB_SUCCESS;
 }
 
+int API_EXPORTED libusb_hotplug_register_callback(libusb_context *ctx,
+	libusb_hotplug_event events, libusb_hotplug_flag flags,
+	int vendor_id, int product_id, int dev_class,
+	libusb_hotplug_callback_fn cb_fn, void *user_data,
+	libusb_hotplug_callback_handle *handle)
+{
+	if (!cb_fn) {
+		return LIBUSB_ERROR_INVALID_PARAM;
+	}
+
+	return usbi_hotplug_register(ctx, events, flags, vendor_id, product_id,
+				     dev_class, cb_fn, NULL, user_data, handle);
+}
+
+int API_EXPORTED libusb_hotplug_register_batch_callback(libusb_context *ctx,
+	libusb_hotplug_event events, libusb_hotplug_flag flags,
+	int vendor_id, int product_id, int dev_class,
+	libusb_hotplug_batch_callback_fn cb_fn, void *user_data,
+	libusb_hotplug_callback_handle *handle)
+{
+	if (!cb_fn) {
+		return LIBUSB_ERROR_INVALID_PARAM;
+	}
+
+	return usbi_hotplug_register(ctx, events, flags, vendor_id, product_id,
+				     dev_class, NULL, cb_fn, user_data, handle);
+}
+
 void API_EXPORTED libusb_hotplug_deregister_callback (struct libusb_context *ctx,
 	libusb_hotplug_callback_handle handle)
 {
@@ -336,8 +555,7 @@ void usbi_hotplug_deregister_all(struct libusb_context *ctx) {
 	usbi_mutex_lock(&ctx->hotplug_cbs_lock);
 	list_for_each_entry_safe(hotplug_cb, next, &ctx->hotplug_cbs, list,
 				 struct libusb_hotplug_callback) {
-		list_del(&hotplug_cb->list);
-		free(hotplug_cb);
+		usbi_hotplug_free_cb(hotplug_cb);
 	}
 
 	usbi_mutex_unlock(&ctx->hotplug_cbs_lock);
@@ -53,6 +53,11 @@ struct libusb_hotplug_callback {
 	/** Callback function to invoke for matching event/device */
 	libusb_hotplug_callback_fn cb;
 
+	/** Callback function to invoke with all matching events at once, for
+	 * callbacks registered with libusb_hotplug_register_batch_callback().
+	 * cb is NULL for these. */
+	libusb_hotplug_batch_callback_fn batch_cb;
+
 	/** Handle for this callback (used to match on deregister) */
 	libusb_hotplug_callback_handle handle;
 
@@ -64,6 +69,10 @@ struct libusb_hotplug_callback {
 
 	/** List this callback is registered in (ctx->hotplug_cbs) */
 	struct list_head list;
+
+	/** Index list this callback is in (ctx->hotplug_cbs_any, one of
+	 * ctx->hotplug_cbs_by_id or ctx->hotplug_batch_cbs) */
+	struct list_head index_list;
 };
 
 typedef struct libusb_hotplug_callback libusb_hotplug_callback;
@@ -86,5 +95,6 @@ void usbi_hotplug_match(struct libusb_context *ctx, struct libusb_device *dev,
 			libusb_hotplug_event event);
 void usbi_hotplug_notification(struct libusb_context *ctx, struct libusb_device *dev,
 			libusb_hotplug_event event);
+void usbi_hotplug_process(struct libusb_context *ctx, struct list_head *messages);
 
 #endif
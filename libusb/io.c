@@ -36,6 +36,13 @@
 #ifdef USBI_TIMERFD_AVAILABLE
 #include <sys/timerfd.h>
 #endif
+#ifdef USBI_EVENTFD_AVAILABLE
+#include <sys/eventfd.h>
+#endif
+#ifdef USBI_EPOLL_AVAILABLE
+#include <unistd.h>
+#include <sys/epoll.h>
+#endif
 
 #include "libusbi.h"
 #include "hotplug.h"
@@ -331,6 +338,10 @@ if (r == 0 && actual_length == sizeof(data)) {
  * be invoked, and the callback function should check the transfer status to
  * determine that it was cancelled.
  *
+ * To tear down a queue of transfers, libusb_cancel_endpoint_transfers() and
+ * libusb_cancel_all_transfers() cancel everything in flight on an endpoint
+ * or on a device handle in one go.
+ *
  * Freeing the transfer after it has been cancelled but before cancellation
  * has completed will result in undefined behaviour.
  *
@@ -503,6 +514,61 @@ if (r == 0 && actual_length == sizeof(data)) {
  *   "LIBUSB_TRANSFER_FREE_TRANSFER" causes libusb to automatically free the
  *   transfer after the transfer callback returns.
  *
+ * \section asyncpool Transfer pools
+ *
+ * Applications that stream data continuously through one endpoint tend to
+ * allocate, submit and free the same kind of transfer over and over again.
+ * libusb_alloc_transfer_pool() preallocates a number of transfers, together
+ * with their data buffers, for a given endpoint, transfer type, length and
+ * number of isochronous packets. Transfers are taken from the pool with
+ * libusb_transfer_pool_get() and handed back with libusb_transfer_pool_put().
+ * Since the shape of a pooled transfer never changes, backends may also keep
+ * their per-submission data attached to it, so that resubmitting a pooled
+ * transfer from its callback does not need any heap allocation.
+ *
+ * \section asyncisostream Isochronous streams
+ *
+ * Capturing from an isochronous endpoint usually means keeping a ring of
+ * transfers in flight and resubmitting each one from its callback. If the
+ * application is slow to handle events, bus frames go unscheduled and data
+ * is lost. libusb_alloc_iso_stream() sets up such a ring of transfers for an
+ * IN endpoint that libusb resubmits itself from the event handler, before
+ * the application sees any data. The received packets, with their lengths
+ * and status, are placed in a ring buffer that the application drains at its
+ * own pace from another thread with libusb_iso_stream_read() and
+ * libusb_iso_stream_release(), without taking any lock.
+ *
+ * \section asyncbulkstream Bulk streams
+ *
+ * Getting the most out of a bulk endpoint takes several transfers in flight,
+ * so that the host controller always has the next one queued. A bulk stream,
+ * allocated with libusb_alloc_bulk_stream(), does this bookkeeping: it keeps
+ * a number of transfers in flight, resubmits them from the event handler and
+ * grows or shrinks that number depending on how promptly completions are
+ * handled. The data is passed to or taken from a callback, or exchanged with
+ * libusb_bulk_stream_get() and libusb_bulk_stream_put().
+ *
+ * \section asyncstreamsched Stream scheduling
+ *
+ * A USB 3.0 bulk endpoint with streams, set up with libusb_alloc_streams(),
+ * carries many independent transfers at once, one set per stream id, as
+ * storage devices do to keep several commands outstanding. A stream
+ * scheduler, allocated with libusb_alloc_stream_scheduler(), keeps a queue
+ * of transfers for each stream and submits them as the limits on transfers
+ * in flight allow: streams of a higher priority first, and streams of the
+ * same priority in turn. libusb_stream_scheduler_alloc_id() hands out the
+ * stream ids of the endpoint.
+ *
+ * \section asynccompq Completion queues
+ *
+ * Transfer callbacks run in the thread that handles events, and no other
+ * events are handled while a callback runs. Applications with expensive
+ * completion processing can instead attach their transfers to a completion
+ * queue, allocated with libusb_alloc_completion_queue(). Completed transfers
+ * are then added to the queue, and any number of worker threads take them
+ * from it with libusb_completion_queue_wait(), while the event handling
+ * thread carries on with the events of all devices.
+ *
  * \section asyncevent Event handling
  *
  * An asynchronous model requires that libusb perform work at various
@@ -1031,7 +1097,7 @@ printf("completed!\n");
  *    restarts, picking up the new descriptor.
  * -# libusb_close() will remove a file descriptor from the poll set. There
  *    are all kinds of race conditions that could arise here, so it is
- *    important that nobody is doing event handling at this time.
+ *    important that nobody is polling that descriptor at this time.
  *
  * libusb handles these issues internally, so application developers do not
  * have to stop their event handlers while opening/closing devices. Here's how
@@ -1039,50 +1105,33 @@ printf("completed!\n");
  *
  * -# During initialization, libusb opens an internal pipe, and it adds the read
  *    end of this pipe to the set of file descriptors to be polled.
- * -# During libusb_close(), libusb writes some dummy data on this event pipe.
- *    This immediately interrupts the event handler. libusb also records
- *    internally that it is trying to interrupt event handlers for this
- *    high-priority event.
- * -# At this point, some of the functions described above start behaving
- *    differently:
- *   - libusb_event_handling_ok() starts returning 1, indicating that it is NOT
- *     OK for event handling to continue.
- *   - libusb_try_lock_events() starts returning 1, indicating that another
- *     thread holds the event handling lock, even if the lock is uncontended.
- *   - libusb_event_handler_active() starts returning 1, indicating that
- *     another thread is doing event handling, even if that is not true.
- * -# The above changes in behaviour result in the event handler stopping and
- *    giving up the events lock very quickly, giving the high-priority
- *    libusb_close() operation a "free ride" to acquire the events lock. All
- *    threads that are competing to do event handling become event waiters.
- * -# With the events lock held inside libusb_close(), libusb can safely remove
- *    a file descriptor from the poll set, in the safety of knowledge that
- *    nobody is polling those descriptors or trying to access the poll set.
- * -# After obtaining the events lock, the close operation completes very
- *    quickly (usually a matter of milliseconds) and then immediately releases
- *    the events lock.
- * -# At the same time, the behaviour of libusb_event_handling_ok() and friends
- *    reverts to the original, documented behaviour.
- * -# The release of the events lock causes the threads that are waiting for
- *    events to be woken up and to start competing to become event handlers
- *    again. One of them will succeed; it will then re-obtain the list of poll
- *    descriptors, and USB I/O will then continue as normal.
- *
- * libusb_open() is similar, and is actually a more simplistic case. Upon a
- * call to libusb_open():
+ * -# If no thread holds the events lock, libusb_close() takes it and closes
+ *    the device right away, in the safety of knowledge that nobody is polling
+ *    its descriptors.
+ * -# Otherwise libusb_close() queues the handle for the event handler, writes
+ *    some dummy data on the event pipe and becomes an event waiter. This
+ *    interrupts the event handler, which handles any events that are already
+ *    pending on the other devices, closes all queued handles, and returns.
+ *    The next round of event handling re-obtains the list of poll
+ *    descriptors, without the ones of the closed devices.
+ * -# The closed handles are then handed back as if they were completed
+ *    transfers: their libusb_close() calls are woken up and return. Should
+ *    the event handler give up the events lock before it got to the queue,
+ *    libusb_close() takes the events lock and closes the queued handles
+ *    itself.
+ *
+ * Closing a device therefore never makes the event handler give up the
+ * events lock, and a burst of closes costs the other devices a single
+ * interruption of their event handling.
+ *
+ * libusb_open() is a more simplistic case. Upon a call to libusb_open():
  *
  * -# The device is opened and a file descriptor is added to the poll set.
  * -# libusb sends some dummy data on the event pipe, and records that it
- *    is trying to modify the poll descriptor set.
- * -# The event handler is interrupted, and the same behaviour change as for
- *    libusb_close() takes effect, causing all event handling threads to become
- *    event waiters.
- * -# The libusb_open() implementation takes its free ride to the events lock.
- * -# Happy that it has successfully paused the events handler, libusb_open()
- *    releases the events lock.
- * -# The event waiter threads are all woken up and compete to become event
- *    handlers again. The one that succeeds will obtain the list of poll
- *    descriptors again, which will include the addition of the new device.
+ *    has modified the poll descriptor set.
+ * -# The event handler is interrupted and returns. The next round of event
+ *    handling obtains the list of poll descriptors again, which will include
+ *    the addition of the new device.
  *
  * \subsection concl Closing remarks
  *
@@ -1111,24 +1160,130 @@ printf("completed!\n");
  * consideration that your event handling thread must apply is the one related
  * to libusb_event_handling_ok(): you must call this before every poll(), and
  * give up the events lock if instructed.
+ *
+ * \section eventdomains Handling events of several devices in parallel
+ *
+ * Everything above funnels the events of all devices of a context through
+ * the single thread that holds the events lock. Applications that drive many
+ * independent devices can instead partition the device handles of a context
+ * into event domains, each with its own events lock and set of descriptors:
+ *
+\code
+struct libusb_event_domain *domain = libusb_alloc_event_domain(ctx);
+libusb_set_event_domain(dev_handle, domain);
+
+// in the thread dedicated to this device
+while (!stop)
+	libusb_handle_domain_events_timeout_completed(domain, NULL, NULL);
+\endcode
+ *
+ * The events of a handle in a domain, its transfer completions and timeouts,
+ * are then only handled by libusb_handle_domain_events_timeout_completed(),
+ * and the events of different domains can be handled concurrently. The
+ * hotplug events and the handles that are not in a domain remain with the
+ * context, which still needs its own event handling. The synchronous I/O
+ * functions know about domains and wait on the domain of their device
+ * handle.
+ *
+ * The descriptors of the handles in a domain are not returned by
+ * libusb_get_pollfds() and the pollfd notifiers treat moving a handle into a
+ * domain as a removal of its descriptor.
+ *
+ * Event domains are only supported on platforms where each device handle has
+ * a pollable descriptor of its own, currently Linux.
  */
 
+/* The internal event pipes of contexts and event domains are eventfds where
+ * the kernel has them: a single descriptor holding a counter, so that both
+ * ends of the "pipe" are the same descriptor and no pipe buffer is needed.
+ * Elsewhere they are real pipes. Either way one read clears one write, which
+ * for an eventfd is what EFD_SEMAPHORE does. */
+int usbi_create_event_pipe(int event_pipe[2])
+{
+#ifdef USBI_EVENTFD_AVAILABLE
+	int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC | EFD_SEMAPHORE);
+
+	if (fd >= 0) {
+		event_pipe[0] = event_pipe[1] = fd;
+		return 0;
+	}
+	usbi_dbg("eventfd not available (code %d error %d)", fd, errno);
+#endif
+	return usbi_pipe(event_pipe);
+}
+
+void usbi_close_event_pipe(int event_pipe[2])
+{
+	usbi_close(event_pipe[0]);
+	if (event_pipe[1] != event_pipe[0])
+		usbi_close(event_pipe[1]);
+}
+
+int usbi_write_event_pipe(int event_pipe[2])
+{
+	unsigned char dummy = 1;
+
+#ifdef USBI_EVENTFD_AVAILABLE
+	if (event_pipe[1] == event_pipe[0]) {
+		uint64_t one = 1;
+
+		if (write(event_pipe[1], &one, sizeof(one)) != sizeof(one))
+			return LIBUSB_ERROR_IO;
+		return 0;
+	}
+#endif
+	if (usbi_write(event_pipe[1], &dummy, sizeof(dummy)) != sizeof(dummy))
+		return LIBUSB_ERROR_IO;
+	return 0;
+}
+
+int usbi_read_event_pipe(int event_pipe[2])
+{
+	unsigned char dummy;
+
+#ifdef USBI_EVENTFD_AVAILABLE
+	if (event_pipe[1] == event_pipe[0]) {
+		uint64_t one;
+
+		if (read(event_pipe[0], &one, sizeof(one)) != sizeof(one))
+			return LIBUSB_ERROR_IO;
+		return 0;
+	}
+#endif
+	if (usbi_read(event_pipe[0], &dummy, sizeof(dummy)) != sizeof(dummy))
+		return LIBUSB_ERROR_IO;
+	return 0;
+}
+
 int usbi_io_init(struct libusb_context *ctx)
 {
 	int r;
 
-	usbi_mutex_init(&ctx->flying_transfers_lock, NULL);
+	usbi_mutex_init(&ctx->timeouts_lock, NULL);
 	usbi_mutex_init(&ctx->pollfds_lock, NULL);
 	usbi_mutex_init_recursive(&ctx->events_lock, NULL);
 	usbi_mutex_init(&ctx->event_data_lock, NULL);
 	usbi_mutex_init(&ctx->event_waiters_lock, NULL);
 	usbi_cond_init(&ctx->event_waiters_cond, NULL);
-	list_init(&ctx->flying_transfers);
 	list_init(&ctx->ipollfds);
 	list_init(&ctx->hotplug_msgs);
+	list_init(&ctx->close_queue);
+
+#ifdef USBI_EPOLL_AVAILABLE
+	/* the epoll fd must exist before any fd is added to the poll set */
+	ctx->epoll_events = NULL;
+	ctx->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (ctx->epoll_fd >= 0) {
+		usbi_dbg("using epoll for event handling");
+		ctx->epoll_pollfd.fd = ctx->epoll_fd;
+		ctx->epoll_pollfd.events = POLLIN;
+	} else {
+		usbi_dbg("epoll not available (code %d error %d)", ctx->epoll_fd, errno);
+		ctx->epoll_fd = -1;
+	}
+#endif
 
-	/* FIXME should use an eventfd on kernels that support it */
-	r = usbi_pipe(ctx->event_pipe);
+	r = usbi_create_event_pipe(ctx->event_pipe);
 	if (r < 0) {
 		r = LIBUSB_ERROR_OTHER;
 		goto err;
@@ -1160,10 +1315,13 @@ err_close_timerfd:
 	usbi_remove_pollfd(ctx, ctx->event_pipe[0]);
 #endif
 err_close_pipe:
-	usbi_close(ctx->event_pipe[0]);
-	usbi_close(ctx->event_pipe[1]);
+	usbi_close_event_pipe(ctx->event_pipe);
 err:
-	usbi_mutex_destroy(&ctx->flying_transfers_lock);
+#ifdef USBI_EPOLL_AVAILABLE
+	if (usbi_using_epoll(ctx))
+		close(ctx->epoll_fd);
+#endif
+	usbi_mutex_destroy(&ctx->timeouts_lock);
 	usbi_mutex_destroy(&ctx->pollfds_lock);
 	usbi_mutex_destroy(&ctx->events_lock);
 	usbi_mutex_destroy(&ctx->event_data_lock);
@@ -1174,16 +1332,27 @@ err:
 
 void usbi_io_exit(struct libusb_context *ctx)
 {
+	if (ctx->closed_stats.reap_wakeups)
+		usbi_dbg("reaped %lu completions in %lu wakeups (largest batch %lu)",
+			(unsigned long)ctx->closed_stats.reaped,
+			(unsigned long)ctx->closed_stats.reap_wakeups,
+			(unsigned long)ctx->closed_stats.reap_batch_max);
+
 	usbi_remove_pollfd(ctx, ctx->event_pipe[0]);
-	usbi_close(ctx->event_pipe[0]);
-	usbi_close(ctx->event_pipe[1]);
+	usbi_close_event_pipe(ctx->event_pipe);
 #ifdef USBI_TIMERFD_AVAILABLE
 	if (usbi_using_timerfd(ctx)) {
 		usbi_remove_pollfd(ctx, ctx->timerfd);
 		close(ctx->timerfd);
 	}
 #endif
-	usbi_mutex_destroy(&ctx->flying_transfers_lock);
+#ifdef USBI_EPOLL_AVAILABLE
+	if (usbi_using_epoll(ctx)) {
+		close(ctx->epoll_fd);
+		free(ctx->epoll_events);
+	}
+#endif
+	usbi_mutex_destroy(&ctx->timeouts_lock);
 	usbi_mutex_destroy(&ctx->pollfds_lock);
 	usbi_mutex_destroy(&ctx->events_lock);
 	usbi_mutex_destroy(&ctx->event_data_lock);
@@ -1191,6 +1360,63 @@ void usbi_io_exit(struct libusb_context *ctx)
 	usbi_cond_destroy(&ctx->event_waiters_cond);
 	if (ctx->pollfds)
 		free(ctx->pollfds);
+	free(ctx->timeout_heap.nodes);
+}
+
+/* monotonic time in microseconds for the transfer statistics */
+static uint64_t stats_now(void)
+{
+	struct timespec ts;
+
+	if (usbi_backend->clock_gettime(USBI_CLOCK_MONOTONIC, &ts) < 0)
+		return 0;
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int stats_latency_bucket(uint64_t us)
+{
+	int bucket = 0;
+
+	while (us && bucket < LIBUSB_STATS_LATENCY_BUCKETS - 1) {
+		us >>= 1;
+		bucket++;
+	}
+	return bucket;
+}
+
+static void stats_accumulate(struct libusb_stats *sum,
+	struct libusb_stats *stats)
+{
+	int i;
+
+	sum->transfers_submitted += usbi_stats_get(&stats->transfers_submitted);
+	sum->transfers_completed += usbi_stats_get(&stats->transfers_completed);
+	sum->transfers_cancelled += usbi_stats_get(&stats->transfers_cancelled);
+	sum->transfers_timed_out += usbi_stats_get(&stats->transfers_timed_out);
+	sum->transfers_failed += usbi_stats_get(&stats->transfers_failed);
+	sum->bytes_transferred += usbi_stats_get(&stats->bytes_transferred);
+	sum->requests_submitted += usbi_stats_get(&stats->requests_submitted);
+	sum->reap_wakeups += usbi_stats_get(&stats->reap_wakeups);
+	sum->reaped += usbi_stats_get(&stats->reaped);
+	if (usbi_stats_get(&stats->reap_batch_max) > sum->reap_batch_max)
+		sum->reap_batch_max = usbi_stats_get(&stats->reap_batch_max);
+	sum->callback_time_us += usbi_stats_get(&stats->callback_time_us);
+	for (i = 0; i < LIBUSB_STATS_LATENCY_BUCKETS; i++)
+		sum->latency_us[i] += usbi_stats_get(&stats->latency_us[i]);
+}
+
+/* add up the statistics of all endpoints of a handle */
+static void stats_handle(struct libusb_stats *sum,
+	struct libusb_device_handle *handle)
+{
+	int i;
+
+	for (i = 0; i < USBI_MAX_ENDPOINT_STATS; i++)
+		stats_accumulate(sum, &handle->endpoint_stats[i]);
+	sum->reap_wakeups += usbi_stats_get(&handle->reap_wakeups);
+	sum->reaped += usbi_stats_get(&handle->reaped);
+	if (usbi_stats_get(&handle->reap_batch_max) > sum->reap_batch_max)
+		sum->reap_batch_max = usbi_stats_get(&handle->reap_batch_max);
 }
 
 static int calculate_timeout(struct usbi_transfer *transfer)
@@ -1222,71 +1448,6 @@ static int calculate_timeout(struct usbi_transfer *transfer)
 	return 0;
 }
 
-/* add a transfer to the (timeout-sorted) active transfers list.
- * Callers of this function must hold the flying_transfers_lock.
- * This function *always* adds the transfer to the flying_transfers list,
- * it will return non 0 if it fails to update the timer, but even then the
- * transfer is added to the flying_transfers list. */
-static int add_to_flying_list(struct usbi_transfer *transfer)
-{
-	struct usbi_transfer *cur;
-	struct timeval *timeout = &transfer->timeout;
-	struct libusb_context *ctx = ITRANSFER_CTX(transfer);
-	int r = 0;
-	int first = 1;
-
-	/* if we have no other flying transfers, start the list with this one */
-	if (list_empty(&ctx->flying_transfers)) {
-		list_add(&transfer->list, &ctx->flying_transfers);
-		goto out;
-	}
-
-	/* if we have infinite timeout, append to end of list */
-	if (!timerisset(timeout)) {
-		list_add_tail(&transfer->list, &ctx->flying_transfers);
-		/* first is irrelevant in this case */
-		goto out;
-	}
-
-	/* otherwise, find appropriate place in list */
-	list_for_each_entry(cur, &ctx->flying_transfers, list, struct usbi_transfer) {
-		/* find first timeout that occurs after the transfer in question */
-		struct timeval *cur_tv = &cur->timeout;
-
-		if (!timerisset(cur_tv) || (cur_tv->tv_sec > timeout->tv_sec) ||
-				(cur_tv->tv_sec == timeout->tv_sec &&
-					cur_tv->tv_usec > timeout->tv_usec)) {
-			list_add_tail(&transfer->list, &cur->list);
-			goto out;
-		}
-		first = 0;
-	}
-	/* first is 0 at this stage (list not empty) */
-
-	/* otherwise we need to be inserted at the end */
-	list_add_tail(&transfer->list, &ctx->flying_transfers);
-out:
-#ifdef USBI_TIMERFD_AVAILABLE
-	if (first && usbi_using_timerfd(ctx) && timerisset(timeout)) {
-		/* if this transfer has the lowest timeout of all active transfers,
-		 * rearm the timerfd with this transfer's timeout */
-		const struct itimerspec it = { {0, 0},
-			{ timeout->tv_sec, timeout->tv_usec * 1000 } };
-		usbi_dbg("arm timerfd for timeout in %dms (first in line)",
-			USBI_TRANSFER_TO_LIBUSB_TRANSFER(transfer)->timeout);
-		r = timerfd_settime(ctx->timerfd, TFD_TIMER_ABSTIME, &it, NULL);
-		if (r < 0) {
-			usbi_warn(ctx, "failed to arm first timerfd (errno %d)", errno);
-			r = LIBUSB_ERROR_OTHER;
-		}
-	}
-#else
-	UNUSED(first);
-#endif
-
-	return r;
-}
-
 /** \ingroup asyncio
  * Allocate a libusb transfer with a specified number of isochronous packet
  * descriptors. The returned transfer is pre-initialized for you. When the new
@@ -1352,201 +1513,2802 @@ void API_EXPORTED libusb_free_transfer(struct libusb_transfer *transfer)
 	if (!transfer)
 		return;
 
-	if (transfer->flags & LIBUSB_TRANSFER_FREE_BUFFER && transfer->buffer)
+	itransfer = LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
+	if (itransfer->pool) {
+		libusb_transfer_pool_put(transfer);
+		return;
+	}
+
+	if (transfer->flags & LIBUSB_TRANSFER_FREE_BUFFER && transfer->buffer &&
+	    !USBI_TRANSFER_IS_IOV(itransfer))
 		free(transfer->buffer);
 
-	itransfer = LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
+	if (usbi_backend->free_transfer_priv)
+		usbi_backend->free_transfer_priv(itransfer);
 	usbi_mutex_destroy(&itransfer->lock);
 	free(itransfer);
 }
 
-#ifdef USBI_TIMERFD_AVAILABLE
-static int disarm_timerfd(struct libusb_context *ctx)
+/* cancels a transfer, with the lock of the transfer held */
+static int cancel_transfer_locked(struct usbi_transfer *itransfer)
 {
-	const struct itimerspec disarm_timer = { { 0, 0 }, { 0, 0 } };
-	int r;
+	int r = usbi_backend->cancel_transfer(itransfer);
 
-	usbi_dbg("");
-	r = timerfd_settime(ctx->timerfd, 0, &disarm_timer, NULL);
-	if (r < 0)
-		return LIBUSB_ERROR_OTHER;
-	else
-		return 0;
+	if (r < 0) {
+		if (r != LIBUSB_ERROR_NOT_FOUND &&
+		    r != LIBUSB_ERROR_NO_DEVICE)
+			usbi_err(ITRANSFER_CTX(itransfer),
+				"cancel transfer failed error %d", r);
+		else
+			usbi_dbg("cancel transfer failed error %d", r);
+
+		if (r == LIBUSB_ERROR_NO_DEVICE)
+			itransfer->flags |= USBI_TRANSFER_DEVICE_DISAPPEARED;
+	}
+
+	itransfer->flags |= USBI_TRANSFER_CANCELLING;
+	return r;
 }
 
-/* iterates through the flying transfers, and rearms the timerfd based on the
- * next upcoming timeout.
- * must be called with flying_list locked.
- * returns 0 if there was no timeout to arm, 1 if the next timeout was armed,
- * or a LIBUSB_ERROR code on failure.
- */
-static int arm_timerfd_for_next_timeout(struct libusb_context *ctx)
+/* cancels the transfers in flight on the handle for the endpoint, or for all
+ * endpoints if endpoint is negative, and of the pool and the stream
+ * scheduler, if not NULL. transfers
+ * whose cancellation has already been requested are skipped. returns the
+ * number of transfers cancelled, or the first error if none was. */
+static int cancel_handle_transfers(struct libusb_device_handle *handle,
+	int endpoint, struct libusb_transfer_pool *pool,
+	struct libusb_stream_scheduler *sched)
 {
-	struct usbi_transfer *transfer;
+	struct usbi_transfer *itransfer;
+	int count = 0;
+	int error = 0;
+	int r;
 
-	list_for_each_entry(transfer, &ctx->flying_transfers, list, struct usbi_transfer) {
-		struct timeval *cur_tv = &transfer->timeout;
+	/* the newest transfers are cancelled first, so that the device does
+	 * not move on to a transfer that is about to be cancelled when an
+	 * older one goes away */
+	usbi_mutex_lock(&handle->flying_transfers_lock);
+	list_for_each_entry_reverse(itransfer, &handle->flying_transfers, list,
+			struct usbi_transfer) {
+		struct libusb_transfer *transfer =
+			USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
 
-		/* if we've reached transfers of infinite timeout, then we have no
-		 * arming to do */
-		if (!timerisset(cur_tv))
-			goto disarm;
+		if (endpoint >= 0 && transfer->endpoint != endpoint)
+			continue;
+		if (pool && itransfer->pool != pool)
+			continue;
+		if (sched && itransfer->stream_sched != sched)
+			continue;
 
-		/* act on first transfer that is not already cancelled */
-		if (!(transfer->flags & USBI_TRANSFER_TIMED_OUT)) {
-			int r;
-			const struct itimerspec it = { {0, 0},
-				{ cur_tv->tv_sec, cur_tv->tv_usec * 1000 } };
-			usbi_dbg("next timeout originally %dms", USBI_TRANSFER_TO_LIBUSB_TRANSFER(transfer)->timeout);
-			r = timerfd_settime(ctx->timerfd, TFD_TIMER_ABSTIME, &it, NULL);
-			if (r < 0)
-				return LIBUSB_ERROR_OTHER;
-			return 1;
+		usbi_mutex_lock(&itransfer->lock);
+		if (itransfer->flags & USBI_TRANSFER_CANCELLING) {
+			usbi_mutex_unlock(&itransfer->lock);
+			continue;
 		}
+		r = cancel_transfer_locked(itransfer);
+		usbi_mutex_unlock(&itransfer->lock);
+
+		if (r == 0)
+			count++;
+		else if (!error)
+			error = r;
 	}
+	usbi_mutex_unlock(&handle->flying_transfers_lock);
 
-disarm:
-	return disarm_timerfd(ctx);
+	usbi_dbg("cancelled %d transfers", count);
+	return count > 0 ? count : error;
 }
-#else
-static int arm_timerfd_for_next_timeout(struct libusb_context *ctx)
+
+struct libusb_transfer_pool {
+	/* protects the free list */
+	usbi_mutex_t lock;
+
+	/* the shape shared by all transfers of the pool */
+	struct libusb_device_handle *dev_handle;
+	unsigned char endpoint;
+	unsigned char type;
+	int length;
+	int iso_packets;
+
+	/* all transfers, the data buffers backing them and a stack of the
+	 * transfers that are currently not in use */
+	int num_transfers;
+	struct libusb_transfer **transfers;
+	unsigned char *buffers;
+	int num_free;
+	struct libusb_transfer **free_transfers;
+};
+
+/* restore the fields of a pooled transfer to the shape of its pool */
+static void reset_pooled_transfer(struct libusb_transfer_pool *pool,
+	struct libusb_transfer *transfer)
 {
-	(void)ctx;
-	return 0;
+	transfer->dev_handle = pool->dev_handle;
+	transfer->flags = 0;
+	transfer->endpoint = pool->endpoint;
+	transfer->type = pool->type;
+	transfer->timeout = 0;
+	transfer->status = LIBUSB_TRANSFER_COMPLETED;
+	transfer->length = pool->length;
+	transfer->actual_length = 0;
+	transfer->callback = NULL;
+	transfer->user_data = NULL;
+	transfer->buffer = LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer)->pool_buffer;
+	transfer->num_iso_packets = pool->iso_packets;
+	if (pool->iso_packets)
+		libusb_set_iso_packet_lengths(transfer,
+			pool->length / pool->iso_packets);
 }
-#endif
 
 /** \ingroup asyncio
- * Submit a transfer. This function will fire off the USB transfer and then
- * return immediately.
- *
- * \param transfer the transfer to submit
- * \returns 0 on success
- * \returns LIBUSB_ERROR_NO_DEVICE if the device has been disconnected
- * \returns LIBUSB_ERROR_BUSY if the transfer has already been submitted.
- * \returns LIBUSB_ERROR_NOT_SUPPORTED if the transfer flags are not supported
- * by the operating system.
- * \returns another LIBUSB_ERROR code on other failure
+ * Allocate a pool of transfers for repeated use on one endpoint. Every
+ * transfer in the pool is allocated up front with the given type, length
+ * and number of isochronous packets, and comes with its own data buffer of
+ * length bytes. For control transfers, length includes the setup packet.
+ * For isochronous transfers the buffer is split evenly between the packets.
+ *
+ * Take transfers from the pool with libusb_transfer_pool_get(), set the
+ * callback, user data and timeout as usual, and submit them. A transfer can
+ * be resubmitted any number of times; hand it back with
+ * libusb_transfer_pool_put() once it is no longer needed. The buffer, length
+ * and endpoint may be changed between submissions but are restored when the
+ * transfer is taken from the pool again.
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ *
+ * \param dev_handle handle of the device the transfers will be submitted to
+ * \param endpoint address of the endpoint
+ * \param type the \ref libusb_transfer_type "type" of the transfers
+ * \param length size of the data buffer of each transfer
+ * \param iso_packets number of isochronous packets per transfer, or 0 for
+ * non-isochronous transfers
+ * \param num_transfers number of transfers in the pool
+ * \returns a newly allocated pool, or NULL on error
  */
-int API_EXPORTED libusb_submit_transfer(struct libusb_transfer *transfer)
+DEFAULT_VISIBILITY
+struct libusb_transfer_pool * LIBUSB_CALL libusb_alloc_transfer_pool(
+	libusb_device_handle *dev_handle, unsigned char endpoint,
+	unsigned char type, int length, int iso_packets, int num_transfers)
 {
-	struct libusb_context *ctx = TRANSFER_CTX(transfer);
-	struct usbi_transfer *itransfer =
-		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
-	int r;
-	int updated_fds;
+	struct libusb_transfer_pool *pool;
+	int i;
 
-	usbi_mutex_lock(&ctx->flying_transfers_lock);
-	usbi_mutex_lock(&itransfer->lock);
-	itransfer->transferred = 0;
-	itransfer->flags = 0;
-	r = calculate_timeout(itransfer);
-	if (r < 0) {
-		r = LIBUSB_ERROR_OTHER;
-		goto out;
-	}
+	if (!dev_handle || length < 0 || iso_packets < 0 || num_transfers <= 0)
+		return NULL;
+	if ((type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS) != (iso_packets > 0))
+		return NULL;
+	if (type == LIBUSB_TRANSFER_TYPE_CONTROL &&
+	    length < LIBUSB_CONTROL_SETUP_SIZE)
+		return NULL;
+
+	pool = calloc(1, sizeof(*pool));
+	if (!pool)
+		return NULL;
+
+	pool->dev_handle = dev_handle;
+	pool->endpoint = endpoint;
+	pool->type = type;
+	pool->length = length;
+	pool->iso_packets = iso_packets;
+	pool->transfers = calloc(num_transfers, sizeof(*pool->transfers));
+	pool->free_transfers = calloc(num_transfers,
+		sizeof(*pool->free_transfers));
+	pool->buffers = malloc(num_transfers * (size_t)(length ? length : 1));
+	if (!pool->transfers || !pool->free_transfers || !pool->buffers)
+		goto err;
 
-	r = add_to_flying_list(itransfer);
-	if (r == LIBUSB_SUCCESS) {
-		r = usbi_backend->submit_transfer(itransfer);
+	for (i = 0; i < num_transfers; i++) {
+		struct libusb_transfer *transfer = libusb_alloc_transfer(iso_packets);
+		struct usbi_transfer *itransfer;
+
+		if (!transfer)
+			goto err;
+		itransfer = LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
+		itransfer->pool = pool;
+		itransfer->pool_buffer = pool->buffers + (i * (size_t)length);
+		itransfer->in_pool = 1;
+		reset_pooled_transfer(pool, transfer);
+		pool->transfers[i] = transfer;
+		pool->free_transfers[i] = transfer;
+		pool->num_transfers++;
 	}
-	if (r != LIBUSB_SUCCESS) {
-		list_del(&itransfer->list);
-		arm_timerfd_for_next_timeout(ctx);
-	} else {
-		/* keep a reference to this device */
-		libusb_ref_device(transfer->dev_handle->dev);
+	pool->num_free = num_transfers;
+
+	usbi_mutex_init(&pool->lock, NULL);
+	usbi_dbg("allocated pool of %d transfers for endpoint %02x",
+		num_transfers, endpoint);
+	return pool;
+
+err:
+	for (i = 0; i < pool->num_transfers; i++) {
+		LIBUSB_TRANSFER_TO_USBI_TRANSFER(pool->transfers[i])->pool = NULL;
+		libusb_free_transfer(pool->transfers[i]);
 	}
-out:
-	updated_fds = (itransfer->flags & USBI_TRANSFER_UPDATED_FDS);
-	usbi_mutex_unlock(&itransfer->lock);
-	usbi_mutex_unlock(&ctx->flying_transfers_lock);
-	if (updated_fds)
-		usbi_fd_notification(ctx);
-	return r;
+	free(pool->buffers);
+	free(pool->free_transfers);
+	free(pool->transfers);
+	free(pool);
+	return NULL;
 }
 
 /** \ingroup asyncio
- * Asynchronously cancel a previously submitted transfer.
- * This function returns immediately, but this does not indicate cancellation
- * is complete. Your callback function will be invoked at some later time
- * with a transfer status of
- * \ref libusb_transfer_status::LIBUSB_TRANSFER_CANCELLED
- * "LIBUSB_TRANSFER_CANCELLED."
+ * Free a transfer pool along with all of its transfers and their buffers.
+ * All transfers must have been returned to the pool; it is not legal to free
+ * a pool while any of its transfers is still in flight.
  *
- * \param transfer the transfer to cancel
- * \returns 0 on success
- * \returns LIBUSB_ERROR_NOT_FOUND if the transfer is already complete or
- * cancelled.
- * \returns a LIBUSB_ERROR code on failure
+ * It is legal to call this function with a NULL pool. In this case, the
+ * function will simply return safely.
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ *
+ * \param pool the pool to free
  */
-int API_EXPORTED libusb_cancel_transfer(struct libusb_transfer *transfer)
+void API_EXPORTED libusb_free_transfer_pool(struct libusb_transfer_pool *pool)
 {
-	struct usbi_transfer *itransfer =
-		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
-	int r;
-
-	usbi_dbg("");
-	usbi_mutex_lock(&itransfer->lock);
-	r = usbi_backend->cancel_transfer(itransfer);
-	if (r < 0) {
-		if (r != LIBUSB_ERROR_NOT_FOUND &&
-		    r != LIBUSB_ERROR_NO_DEVICE)
-			usbi_err(TRANSFER_CTX(transfer),
-				"cancel transfer failed error %d", r);
-		else
-			usbi_dbg("cancel transfer failed error %d", r);
+	int i;
 
-		if (r == LIBUSB_ERROR_NO_DEVICE)
-			itransfer->flags |= USBI_TRANSFER_DEVICE_DISAPPEARED;
-	}
+	if (!pool)
+		return;
 
-	itransfer->flags |= USBI_TRANSFER_CANCELLING;
+	if (pool->num_free != pool->num_transfers)
+		usbi_warn(HANDLE_CTX(pool->dev_handle),
+			"freeing pool with %d transfers still in use",
+			pool->num_transfers - pool->num_free);
 
-	usbi_mutex_unlock(&itransfer->lock);
-	return r;
+	for (i = 0; i < pool->num_transfers; i++) {
+		LIBUSB_TRANSFER_TO_USBI_TRANSFER(pool->transfers[i])->pool = NULL;
+		libusb_free_transfer(pool->transfers[i]);
+	}
+	usbi_mutex_destroy(&pool->lock);
+	free(pool->buffers);
+	free(pool->free_transfers);
+	free(pool->transfers);
+	free(pool);
 }
 
 /** \ingroup asyncio
- * Set a transfers bulk stream id. Note users are advised to use
- * libusb_fill_bulk_stream_transfer() instead of calling this function
- * directly.
+ * Take an unused transfer from a pool. The transfer is initialized with the
+ * device handle, endpoint, type, length, buffer and isochronous packet
+ * lengths of the pool; its callback, user data and timeout are cleared.
  *
- * Since version 1.0.19, \ref LIBUSB_API_VERSION >= 0x01000103
+ * This function does not allocate memory.
  *
- * \param transfer the transfer to set the stream id for
- * \param stream_id the stream id to set
- * \see libusb_alloc_streams()
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ *
+ * \param pool the pool to take a transfer from
+ * \returns a transfer, or NULL if all transfers of the pool are in use
  */
-void API_EXPORTED libusb_transfer_set_stream_id(
-	struct libusb_transfer *transfer, uint32_t stream_id)
+DEFAULT_VISIBILITY
+struct libusb_transfer * LIBUSB_CALL libusb_transfer_pool_get(
+	struct libusb_transfer_pool *pool)
 {
-	struct usbi_transfer *itransfer =
-		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
+	struct libusb_transfer *transfer = NULL;
 
-	itransfer->stream_id = stream_id;
+	usbi_mutex_lock(&pool->lock);
+	if (pool->num_free) {
+		transfer = pool->free_transfers[--pool->num_free];
+		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer)->in_pool = 0;
+	}
+	usbi_mutex_unlock(&pool->lock);
+
+	if (transfer)
+		reset_pooled_transfer(pool, transfer);
+
+	return transfer;
 }
 
 /** \ingroup asyncio
- * Get a transfers bulk stream id.
+ * Hand a transfer back to the pool it was taken from. The transfer must not
+ * be in flight. A transfer that is already back in its pool is left alone,
+ * with a warning. Calling libusb_free_transfer() on a pooled transfer, or
+ * setting \ref libusb_transfer_flags::LIBUSB_TRANSFER_FREE_TRANSFER
+ * "LIBUSB_TRANSFER_FREE_TRANSFER" on it, has the same effect.
  *
- * Since version 1.0.19, \ref LIBUSB_API_VERSION >= 0x01000103
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
  *
- * \param transfer the transfer to get the stream id for
- * \returns the stream id for the transfer
+ * \param transfer a transfer obtained from libusb_transfer_pool_get()
  */
-uint32_t API_EXPORTED libusb_transfer_get_stream_id(
-	struct libusb_transfer *transfer)
+void API_EXPORTED libusb_transfer_pool_put(struct libusb_transfer *transfer)
 {
-	struct usbi_transfer *itransfer =
-		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
+	struct usbi_transfer *itransfer;
+	struct libusb_transfer_pool *pool;
 
-	return itransfer->stream_id;
+	if (!transfer)
+		return;
+
+	itransfer = LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
+	pool = itransfer->pool;
+	if (!pool) {
+		usbi_err(TRANSFER_CTX(transfer), "transfer does not belong to a pool");
+		return;
+	}
+
+	usbi_mutex_lock(&pool->lock);
+	if (itransfer->in_pool) {
+		usbi_mutex_unlock(&pool->lock);
+		usbi_warn(HANDLE_CTX(pool->dev_handle),
+			"transfer %p is already back in its pool", transfer);
+		return;
+	}
+	itransfer->in_pool = 1;
+	pool->free_transfers[pool->num_free++] = transfer;
+	usbi_mutex_unlock(&pool->lock);
 }
 
-/* Handle completion of a transfer (completion might be an error condition).
- * This will invoke the user-supplied callback function, which may end up
- * freeing the transfer. Therefore you cannot use the transfer structure
+#if defined(USBI_HAVE_ATOMICS)
+#define USBI_ISO_STREAM	1
+#endif
+
+struct libusb_iso_stream {
+	struct libusb_context *ctx;
+	struct libusb_transfer_pool *pool;
+	struct libusb_transfer **transfers;
+	int num_transfers;
+	int packet_size;
+
+	/* ring of ring_packets slots of packet_size bytes. head is only
+	 * written by the event handler and tail only by the reader; both
+	 * count packets from the start of the stream and never wrap */
+	unsigned char *ring;
+	int own_ring;
+	int ring_packets;
+	unsigned int *lengths;
+	enum libusb_transfer_status *status;
+	uint64_t head;
+	uint64_t tail;
+	uint64_t dropped;
+
+	/* protects running and num_active, and orders resubmissions in the
+	 * callback against the cancellations in libusb_iso_stream_stop() */
+	usbi_mutex_t lock;
+	int running;
+	int num_active;
+	int idle;
+	int error;
+};
+
+#ifdef USBI_ISO_STREAM
+/* copy the packets of a completed transfer into the ring, dropping those
+ * that do not fit */
+static void iso_stream_put(struct libusb_iso_stream *stream,
+	struct libusb_transfer *transfer)
+{
+	uint64_t head = stream->head;
+	uint64_t tail = __atomic_load_n(&stream->tail, __ATOMIC_ACQUIRE);
+	int i;
+
+	for (i = 0; i < transfer->num_iso_packets; i++) {
+		struct libusb_iso_packet_descriptor *pkt = &transfer->iso_packet_desc[i];
+		int slot;
+
+		if (head - tail >= (uint64_t)stream->ring_packets) {
+			usbi_stats_add(&stream->dropped,
+				transfer->num_iso_packets - i);
+			break;
+		}
+		slot = (int)(head % stream->ring_packets);
+		memcpy(stream->ring + slot * (size_t)stream->packet_size,
+			transfer->buffer + i * (size_t)stream->packet_size,
+			pkt->actual_length);
+		stream->lengths[slot] = pkt->actual_length;
+		stream->status[slot] = pkt->status;
+		head++;
+	}
+	__atomic_store_n(&stream->head, head, __ATOMIC_RELEASE);
+}
+
+static void LIBUSB_CALL iso_stream_cb(struct libusb_transfer *transfer)
+{
+	struct libusb_iso_stream *stream = transfer->user_data;
+	int r = 0;
+
+	if (transfer->status == LIBUSB_TRANSFER_COMPLETED)
+		iso_stream_put(stream, transfer);
+
+	usbi_mutex_lock(&stream->lock);
+	if (stream->running && transfer->status == LIBUSB_TRANSFER_COMPLETED) {
+		r = libusb_submit_transfer(transfer);
+		if (r == 0) {
+			usbi_mutex_unlock(&stream->lock);
+			return;
+		}
+		usbi_err(stream->ctx, "resubmitting iso stream transfer failed (%d)",
+			r);
+	} else if (transfer->status == LIBUSB_TRANSFER_NO_DEVICE) {
+		r = LIBUSB_ERROR_NO_DEVICE;
+	} else if (transfer->status != LIBUSB_TRANSFER_CANCELLED &&
+			transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+		r = LIBUSB_ERROR_IO;
+	}
+
+	/* one failed transfer stops the whole stream, rather than leaving it
+	 * to run with gaps */
+	if (r < 0) {
+		if (!stream->error)
+			stream->error = r;
+		stream->running = 0;
+	}
+	if (--stream->num_active == 0) {
+		stream->running = 0;
+		stream->idle = 1;
+		usbi_dbg("iso stream is idle");
+	}
+	usbi_mutex_unlock(&stream->lock);
+}
+#endif
+
+/** \ingroup asyncio
+ * Allocate a stream that continuously receives data from an isochronous IN
+ * endpoint. The stream owns num_transfers transfers of packets_per_transfer
+ * packets each. Once started with libusb_iso_stream_start(), the event
+ * handler resubmits every transfer as soon as it completes and copies its
+ * packets into a ring of ring_packets packets, from which the application
+ * takes them with libusb_iso_stream_read(). The bus therefore stays scheduled
+ * however late the application gets around to reading. Packets that arrive
+ * while the ring is full are dropped and counted, see
+ * libusb_iso_stream_get_dropped().
+ *
+ * The ring is a single producer, single consumer queue that needs no lock;
+ * all of libusb_iso_stream_read(), libusb_iso_stream_release() and
+ * libusb_iso_stream_get_dropped() may be called from one thread other than
+ * the one handling events.
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ *
+ * \param dev_handle handle of the device to stream from
+ * \param endpoint address of an isochronous IN endpoint
+ * \param packet_size maximum size of a packet. Use
+ * libusb_get_max_iso_packet_size() for the endpoint.
+ * \param packets_per_transfer number of packets in each transfer
+ * \param num_transfers number of transfers kept in flight
+ * \param ring_packets number of packets the ring holds
+ * \param ring_buffer storage for the ring, of ring_packets * packet_size
+ * bytes, which must remain valid until the stream is freed. If NULL, the
+ * ring is allocated along with the stream.
+ * \returns a newly allocated stream, or NULL on error or if the library was
+ * built without atomic operations
+ */
+DEFAULT_VISIBILITY
+struct libusb_iso_stream * LIBUSB_CALL libusb_alloc_iso_stream(
+	libusb_device_handle *dev_handle, unsigned char endpoint,
+	int packet_size, int packets_per_transfer, int num_transfers,
+	int ring_packets, unsigned char *ring_buffer)
+{
+#ifdef USBI_ISO_STREAM
+	struct libusb_iso_stream *stream;
+	int i;
+
+	if (!dev_handle || !(endpoint & LIBUSB_ENDPOINT_IN) || packet_size <= 0 ||
+	    packets_per_transfer <= 0 || num_transfers <= 0 || ring_packets <= 0)
+		return NULL;
+
+	stream = calloc(1, sizeof(*stream));
+	if (!stream)
+		return NULL;
+
+	stream->ctx = HANDLE_CTX(dev_handle);
+	stream->packet_size = packet_size;
+	stream->ring_packets = ring_packets;
+	stream->lengths = calloc(ring_packets, sizeof(*stream->lengths));
+	stream->status = calloc(ring_packets, sizeof(*stream->status));
+	stream->transfers = calloc(num_transfers, sizeof(*stream->transfers));
+	if (ring_buffer) {
+		stream->ring = ring_buffer;
+	} else {
+		stream->ring = malloc(ring_packets * (size_t)packet_size);
+		stream->own_ring = 1;
+	}
+	stream->pool = libusb_alloc_transfer_pool(dev_handle, endpoint,
+		LIBUSB_TRANSFER_TYPE_ISOCHRONOUS, packet_size * packets_per_transfer,
+		packets_per_transfer, num_transfers);
+	if (!stream->lengths || !stream->status || !stream->transfers ||
+	    !stream->ring || !stream->pool)
+		goto err;
+
+	for (i = 0; i < num_transfers; i++) {
+		struct libusb_transfer *transfer = libusb_transfer_pool_get(stream->pool);
+
+		transfer->callback = iso_stream_cb;
+		transfer->user_data = stream;
+		stream->transfers[i] = transfer;
+	}
+	stream->num_transfers = num_transfers;
+	stream->idle = 1;
+	usbi_mutex_init(&stream->lock, NULL);
+
+	usbi_dbg("allocated iso stream of %d x %d packets for endpoint %02x",
+		num_transfers, packets_per_transfer, endpoint);
+	return stream;
+
+err:
+	libusb_free_transfer_pool(stream->pool);
+	if (stream->own_ring)
+		free(stream->ring);
+	free(stream->transfers);
+	free(stream->status);
+	free(stream->lengths);
+	free(stream);
+	return NULL;
+#else
+	UNUSED(dev_handle);
+	UNUSED(endpoint);
+	UNUSED(packet_size);
+	UNUSED(packets_per_transfer);
+	UNUSED(num_transfers);
+	UNUSED(ring_packets);
+	UNUSED(ring_buffer);
+	return NULL;
+#endif
+}
+
+/** \ingroup asyncio
+ * Free an isochronous stream, stopping it first if it is running. Packets
+ * still in the ring are discarded.
+ *
+ * It is legal to call this function with a NULL stream. In this case, the
+ * function will simply return safely.
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ *
+ * \param stream the stream to free
+ */
+void API_EXPORTED libusb_free_iso_stream(struct libusb_iso_stream *stream)
+{
+	int i;
+
+	if (!stream)
+		return;
+
+	libusb_iso_stream_stop(stream);
+	for (i = 0; i < stream->num_transfers; i++)
+		libusb_transfer_pool_put(stream->transfers[i]);
+	libusb_free_transfer_pool(stream->pool);
+	usbi_mutex_destroy(&stream->lock);
+	if (stream->own_ring)
+		free(stream->ring);
+	free(stream->transfers);
+	free(stream->status);
+	free(stream->lengths);
+	free(stream);
+}
+
+/** \ingroup asyncio
+ * Start an isochronous stream by submitting all of its transfers. From then
+ * on, the transfers are resubmitted by the event handler until
+ * libusb_iso_stream_stop() is called or a transfer fails.
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ *
+ * \param stream the stream to start
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_BUSY if the stream is already running, or is still
+ * winding down after an error
+ * \returns another LIBUSB_ERROR code if submitting a transfer failed
+ */
+int API_EXPORTED libusb_iso_stream_start(struct libusb_iso_stream *stream)
+{
+	int i, r = 0;
+
+	usbi_mutex_lock(&stream->lock);
+	if (!stream->idle) {
+		usbi_mutex_unlock(&stream->lock);
+		return LIBUSB_ERROR_BUSY;
+	}
+	stream->running = 1;
+	stream->idle = 0;
+	stream->error = 0;
+	for (i = 0; i < stream->num_transfers; i++) {
+		r = libusb_submit_transfer(stream->transfers[i]);
+		if (r < 0)
+			break;
+		stream->num_active++;
+	}
+	if (stream->num_active == 0) {
+		stream->running = 0;
+		stream->idle = 1;
+	}
+	usbi_mutex_unlock(&stream->lock);
+
+	if (r < 0) {
+		usbi_err(stream->ctx, "starting iso stream failed (%d)", r);
+		libusb_iso_stream_stop(stream);
+	}
+	return r;
+}
+
+/** \ingroup asyncio
+ * Stop an isochronous stream. The transfers in flight are cancelled, and
+ * this function handles events until all of them have been retired. Packets
+ * already in the ring stay available to libusb_iso_stream_read(). Stopping a
+ * stream that is not running has no effect.
+ *
+ * This function must not be called from a transfer callback.
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ *
+ * \param stream the stream to stop
+ * \returns 0 on success
+ * \returns a LIBUSB_ERROR code if handling events failed
+ */
+int API_EXPORTED libusb_iso_stream_stop(struct libusb_iso_stream *stream)
+{
+	struct libusb_event_domain *domain = stream->pool->dev_handle->event_domain;
+	int r = 0;
+
+	usbi_mutex_lock(&stream->lock);
+	stream->running = 0;
+	if (!stream->idle)
+		cancel_handle_transfers(stream->pool->dev_handle, -1,
+			stream->pool, NULL);
+	usbi_mutex_unlock(&stream->lock);
+
+	/* the transfers of a handle in an event domain are only reaped by the
+	 * events of that domain */
+	while (!stream->idle) {
+		if (domain)
+			r = libusb_handle_domain_events_timeout_completed(domain,
+				NULL, &stream->idle);
+		else
+			r = libusb_handle_events_completed(stream->ctx,
+				&stream->idle);
+		if (r == LIBUSB_ERROR_INTERRUPTED)
+			continue;
+		if (r < 0)
+			break;
+	}
+	return r;
+}
+
+/** \ingroup asyncio
+ * Look at the packets received by an isochronous stream, oldest first. The
+ * packets stay in the ring, and their data stays valid, until they are
+ * handed back with libusb_iso_stream_release(). Calling this function again
+ * without releasing returns the same packets.
+ *
+ * This function never blocks and does not handle events.
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ *
+ * \param stream the stream to read from
+ * \param packets output array for the packets
+ * \param max_packets number of entries in the packets array
+ * \returns the number of packets stored in the array, 0 if there are none
+ * \returns LIBUSB_ERROR_NO_DEVICE if there are no packets left and the stream
+ * stopped because the device was disconnected
+ * \returns LIBUSB_ERROR_IO if there are no packets left and the stream
+ * stopped because a transfer failed
+ */
+int API_EXPORTED libusb_iso_stream_read(struct libusb_iso_stream *stream,
+	struct libusb_iso_stream_packet *packets, int max_packets)
+{
+#ifdef USBI_ISO_STREAM
+	uint64_t tail = stream->tail;
+	uint64_t head = __atomic_load_n(&stream->head, __ATOMIC_ACQUIRE);
+	int i, n;
+
+	if (head == tail) {
+		usbi_mutex_lock(&stream->lock);
+		n = stream->idle ? stream->error : 0;
+		usbi_mutex_unlock(&stream->lock);
+		return n;
+	}
+
+	n = head - tail < (uint64_t)max_packets ? (int)(head - tail) : max_packets;
+	for (i = 0; i < n; i++) {
+		int slot = (int)((tail + i) % stream->ring_packets);
+
+		packets[i].data = stream->ring + slot * (size_t)stream->packet_size;
+		packets[i].length = stream->lengths[slot];
+		packets[i].status = stream->status[slot];
+	}
+	return n;
+#else
+	UNUSED(stream);
+	UNUSED(packets);
+	UNUSED(max_packets);
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+#endif
+}
+
+/** \ingroup asyncio
+ * Hand the oldest packets returned by libusb_iso_stream_read() back to the
+ * ring, so that their slots can be filled again.
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ *
+ * \param stream the stream the packets were read from
+ * \param num_packets the number of packets to release. This must not exceed
+ * the number last returned by libusb_iso_stream_read().
+ */
+void API_EXPORTED libusb_iso_stream_release(struct libusb_iso_stream *stream,
+	int num_packets)
+{
+#ifdef USBI_ISO_STREAM
+	uint64_t head = __atomic_load_n(&stream->head, __ATOMIC_ACQUIRE);
+	uint64_t tail = stream->tail;
+
+	if (num_packets <= 0)
+		return;
+	if ((uint64_t)num_packets > head - tail)
+		num_packets = (int)(head - tail);
+	__atomic_store_n(&stream->tail, tail + num_packets, __ATOMIC_RELEASE);
+#else
+	UNUSED(stream);
+	UNUSED(num_packets);
+#endif
+}
+
+/** \ingroup asyncio
+ * Get the number of packets an isochronous stream dropped because the ring
+ * was full when they arrived.
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ *
+ * \param stream the stream to query
+ * \returns the number of packets dropped since the stream was allocated
+ */
+uint64_t API_EXPORTED libusb_iso_stream_get_dropped(
+	struct libusb_iso_stream *stream)
+{
+	return usbi_stats_get(&stream->dropped);
+}
+
+/* the states a transfer of a bulk stream goes through */
+enum bulk_stream_slot {
+	/* not in use, to be submitted when the depth allows */
+	BULK_STREAM_SPARE,
+	/* submitted */
+	BULK_STREAM_FLYING,
+	/* queued for or held by the application, in pull mode, or being
+	 * filled by the callback of an OUT stream in push mode */
+	BULK_STREAM_READY,
+};
+
+struct libusb_bulk_stream {
+	struct libusb_context *ctx;
+	struct libusb_transfer_pool *pool;
+	struct libusb_transfer **transfers;
+	enum bulk_stream_slot *slots;
+	int num_transfers;
+	int length;
+	int is_out;
+	libusb_bulk_stream_cb_fn callback;
+	void *user_data;
+
+	/* protects everything below */
+	usbi_mutex_t lock;
+	int running;
+	int num_active;
+	int idle;
+	int error;
+
+	/* current and permitted number of transfers in flight */
+	int depth;
+	int min_depth;
+	int max_depth;
+
+	/* completion timing in microseconds: the time of the last completion,
+	 * the average time between completions, the length of the current run
+	 * of completions handled in one go and the longest run over the last
+	 * window_len completions */
+	uint64_t last_completion;
+	uint64_t avg_gap;
+	int burst;
+	int max_burst;
+	int window_len;
+
+	/* FIFO of the indexes of transfers waiting for the application, in
+	 * pull mode, and the number of transfers queued there or taken */
+	int *ready;
+	int ready_head;
+	int num_ready;
+	int num_held;
+};
+
+/* number of completions over which the depth is reconsidered, per
+ * transfer of depth */
+#define BULK_STREAM_WINDOW	8
+
+/* must be called with the stream lock held */
+static int bulk_stream_submit(struct libusb_bulk_stream *stream, int i,
+	int length)
+{
+	struct libusb_transfer *transfer = stream->transfers[i];
+	int r;
+
+	transfer->length = length;
+	r = libusb_submit_transfer(transfer);
+	if (r < 0) {
+		usbi_err(stream->ctx, "submitting bulk stream transfer failed (%d)",
+			r);
+		stream->slots[i] = BULK_STREAM_SPARE;
+		if (!stream->error)
+			stream->error = r;
+		stream->running = 0;
+		return r;
+	}
+	stream->slots[i] = BULK_STREAM_FLYING;
+	stream->num_active++;
+	stream->idle = 0;
+	return 0;
+}
+
+/* put transfer i on the FIFO for the application, in pull mode. must be
+ * called with the stream lock held */
+static void bulk_stream_ready(struct libusb_bulk_stream *stream, int i)
+{
+	stream->slots[i] = BULK_STREAM_READY;
+	stream->ready[(stream->ready_head + stream->num_ready++) %
+		stream->num_transfers] = i;
+	stream->num_held++;
+}
+
+/* bring spare transfers into use until the depth is reached: submit them,
+ * or for an OUT stream first have them filled. in push mode the callback
+ * fills them, with the lock dropped around it, while in pull mode they are
+ * handed to the application, counting against the depth until they are
+ * sent. must be called with the stream lock held */
+static void bulk_stream_fill(struct libusb_bulk_stream *stream)
+{
+	int i, length;
+
+	for (i = 0; i < stream->num_transfers; i++) {
+		int busy = stream->num_active;
+
+		if (stream->is_out && !stream->callback)
+			busy += stream->num_held;
+		if (!stream->running || busy >= stream->depth)
+			break;
+		if (stream->slots[i] != BULK_STREAM_SPARE)
+			continue;
+
+		length = stream->length;
+		if (stream->is_out && !stream->callback) {
+			bulk_stream_ready(stream, i);
+			continue;
+		}
+		if (stream->is_out) {
+			stream->slots[i] = BULK_STREAM_READY;
+			usbi_mutex_unlock(&stream->lock);
+			length = stream->callback(stream->transfers[i]->buffer,
+				stream->length, stream->user_data);
+			usbi_mutex_lock(&stream->lock);
+			if (length < 0 || length > stream->length ||
+			    !stream->running) {
+				stream->slots[i] = BULK_STREAM_SPARE;
+				stream->running = 0;
+				break;
+			}
+		}
+		bulk_stream_submit(stream, i, length);
+	}
+	if (stream->num_active == 0)
+		stream->idle = 1;
+}
+
+/* adjust the depth after a completion. completions that follow each
+ * other much faster than on average were reaped in one go, because the
+ * event handler got to them late. if it found as many completed transfers
+ * as the depth, the endpoint ran out of work in the meantime, so twice as
+ * many transfers are kept in flight. when no run over a whole window came
+ * close to the depth, the depth is reduced by one. must be called with the
+ * stream lock held */
+static void bulk_stream_adapt(struct libusb_bulk_stream *stream)
+{
+	uint64_t now = stats_now();
+	uint64_t gap = now - stream->last_completion;
+
+	stream->last_completion = now;
+	if (stream->avg_gap && gap < stream->avg_gap / 4)
+		stream->burst++;
+	else
+		stream->burst = 1;
+	stream->avg_gap = stream->avg_gap ?
+		stream->avg_gap - stream->avg_gap / 8 + gap / 8 : gap;
+	if (stream->burst > stream->max_burst)
+		stream->max_burst = stream->burst;
+
+	if (stream->burst >= stream->depth && stream->depth < stream->max_depth) {
+		stream->depth = MIN(stream->depth * 2, stream->max_depth);
+		usbi_dbg("bulk stream ran dry, depth %d", stream->depth);
+		stream->window_len = 0;
+		stream->max_burst = 0;
+		return;
+	}
+
+	if (++stream->window_len < BULK_STREAM_WINDOW * stream->depth)
+		return;
+	if (stream->max_burst <= stream->depth / 4 &&
+	    stream->depth > stream->min_depth) {
+		stream->depth--;
+		usbi_dbg("bulk stream depth %d", stream->depth);
+	}
+	stream->window_len = 0;
+	stream->max_burst = 0;
+}
+
+static void LIBUSB_CALL bulk_stream_cb(struct libusb_transfer *transfer)
+{
+	struct libusb_bulk_stream *stream = transfer->user_data;
+	int i = (int)((transfer->buffer - stream->pool->buffers) / stream->length);
+	int completed = transfer->status == LIBUSB_TRANSFER_COMPLETED;
+	int r = 0;
+
+	/* in push mode, hand the data of an IN transfer to the application.
+	 * OUT buffers are refilled when they are resubmitted */
+	if (completed && stream->callback && !stream->is_out)
+		r = stream->callback(transfer->buffer, transfer->actual_length,
+			stream->user_data);
+
+	usbi_mutex_lock(&stream->lock);
+	stream->num_active--;
+	stream->slots[i] = BULK_STREAM_SPARE;
+
+	if (!completed && transfer->status != LIBUSB_TRANSFER_CANCELLED) {
+		if (!stream->error)
+			stream->error = transfer->status == LIBUSB_TRANSFER_NO_DEVICE ?
+				LIBUSB_ERROR_NO_DEVICE : LIBUSB_ERROR_IO;
+		stream->running = 0;
+	} else if (r < 0) {
+		stream->running = 0;
+	}
+
+	if (completed && !stream->callback && !stream->is_out)
+		bulk_stream_ready(stream, i);
+	if (completed && stream->running) {
+		bulk_stream_adapt(stream);
+		bulk_stream_fill(stream);
+	}
+	if (stream->num_active == 0)
+		stream->idle = 1;
+	usbi_mutex_unlock(&stream->lock);
+}
+
+/** \ingroup asyncio
+ * Allocate a stream that keeps a bulk endpoint busy by having several
+ * transfers in flight at all times. The stream resubmits every transfer
+ * from the event handler as soon as it has completed, and moves the data
+ * in one of two ways:
+ *
+ * - with a callback, in push mode, the callback is called from the event
+ *   handler for every completed IN transfer with the data received, or for
+ *   every OUT transfer about to be submitted with a buffer to fill. It
+ *   returns 0 (IN) or the number of bytes to send (OUT) to carry on, or a
+ *   negative value to stop the stream.
+ * - without a callback, in pull mode, the application takes completed IN
+ *   buffers, or empty OUT buffers, with libusb_bulk_stream_get() and hands
+ *   them back for submission with libusb_bulk_stream_put().
+ *
+ * The stream starts with min_depth transfers in flight, and adapts the
+ * depth to how promptly completions are handled. Whenever the event handler
+ * finds all transfers in flight completed at once, so that the endpoint
+ * probably sat idle, the depth is doubled, up to max_depth. When a good part
+ * of the depth was never drained for a while, the depth slowly decreases
+ * again, down to min_depth. Use libusb_bulk_stream_get_depth() to see the
+ * current value.
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ *
+ * \param dev_handle handle of the device to stream to or from
+ * \param endpoint address of a bulk endpoint
+ * \param length size of the buffer of each transfer
+ * \param min_depth smallest number of transfers kept in flight
+ * \param max_depth largest number of transfers kept in flight, and the
+ * number of transfers allocated
+ * \param callback callback function for push mode, or NULL for pull mode
+ * \param user_data user data to pass to the callback function
+ * \returns a newly allocated stream, or NULL on error
+ */
+DEFAULT_VISIBILITY
+struct libusb_bulk_stream * LIBUSB_CALL libusb_alloc_bulk_stream(
+	libusb_device_handle *dev_handle, unsigned char endpoint, int length,
+	int min_depth, int max_depth, libusb_bulk_stream_cb_fn callback,
+	void *user_data)
+{
+	struct libusb_bulk_stream *stream;
+	int i;
+
+	if (!dev_handle || length <= 0 || min_depth <= 0 ||
+	    max_depth < min_depth)
+		return NULL;
+
+	stream = calloc(1, sizeof(*stream));
+	if (!stream)
+		return NULL;
+
+	stream->ctx = HANDLE_CTX(dev_handle);
+	stream->length = length;
+	stream->is_out = (endpoint & LIBUSB_ENDPOINT_DIR_MASK) ==
+		LIBUSB_ENDPOINT_OUT;
+	stream->callback = callback;
+	stream->user_data = user_data;
+	stream->min_depth = min_depth;
+	stream->max_depth = max_depth;
+	stream->transfers = calloc(max_depth, sizeof(*stream->transfers));
+	stream->slots = calloc(max_depth, sizeof(*stream->slots));
+	stream->ready = calloc(max_depth, sizeof(*stream->ready));
+	stream->pool = libusb_alloc_transfer_pool(dev_handle, endpoint,
+		LIBUSB_TRANSFER_TYPE_BULK, length, 0, max_depth);
+	if (!stream->transfers || !stream->slots || !stream->ready ||
+	    !stream->pool) {
+		libusb_free_transfer_pool(stream->pool);
+		free(stream->ready);
+		free(stream->slots);
+		free(stream->transfers);
+		free(stream);
+		return NULL;
+	}
+
+	for (i = 0; i < max_depth; i++) {
+		struct libusb_transfer *transfer =
+			libusb_transfer_pool_get(stream->pool);
+		int index = (int)((transfer->buffer - stream->pool->buffers) / length);
+
+		transfer->callback = bulk_stream_cb;
+		transfer->user_data = stream;
+		stream->transfers[index] = transfer;
+	}
+	stream->num_transfers = max_depth;
+	stream->depth = min_depth;
+	stream->idle = 1;
+	usbi_mutex_init(&stream->lock, NULL);
+
+	usbi_dbg("allocated bulk stream of %d-%d transfers for endpoint %02x",
+		min_depth, max_depth, endpoint);
+	return stream;
+}
+
+/** \ingroup asyncio
+ * Free a bulk stream, stopping it first if it is running. Buffers held by
+ * the application in pull mode become invalid.
+ *
+ * It is legal to call this function with a NULL stream. In this case, the
+ * function will simply return safely.
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ *
+ * \param stream the stream to free
+ */
+void API_EXPORTED libusb_free_bulk_stream(struct libusb_bulk_stream *stream)
+{
+	int i;
+
+	if (!stream)
+		return;
+
+	libusb_bulk_stream_stop(stream);
+	for (i = 0; i < stream->num_transfers; i++)
+		libusb_transfer_pool_put(stream->transfers[i]);
+	libusb_free_transfer_pool(stream->pool);
+	usbi_mutex_destroy(&stream->lock);
+	free(stream->ready);
+	free(stream->slots);
+	free(stream->transfers);
+	free(stream);
+}
+
+/** \ingroup asyncio
+ * Make the transfers of a bulk stream use a USB 3.0 bulk stream, as
+ * allocated with libusb_alloc_streams(). Must be called while the stream is
+ * not running.
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ *
+ * \param stream the bulk stream
+ * \param stream_id the USB 3.0 stream id, or 0 for plain bulk transfers
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_BUSY if the stream is running
+ */
+int API_EXPORTED libusb_bulk_stream_set_stream_id(
+	struct libusb_bulk_stream *stream, uint32_t stream_id)
+{
+	int i;
+
+	usbi_mutex_lock(&stream->lock);
+	if (stream->running || !stream->idle) {
+		usbi_mutex_unlock(&stream->lock);
+		return LIBUSB_ERROR_BUSY;
+	}
+	for (i = 0; i < stream->num_transfers; i++) {
+		stream->transfers[i]->type = stream_id ?
+			LIBUSB_TRANSFER_TYPE_BULK_STREAM : LIBUSB_TRANSFER_TYPE_BULK;
+		libusb_transfer_set_stream_id(stream->transfers[i], stream_id);
+	}
+	usbi_mutex_unlock(&stream->lock);
+	return 0;
+}
+
+/** \ingroup asyncio
+ * Start a bulk stream. IN transfers are submitted right away. For an OUT
+ * stream, the callback is asked to fill the buffers first in push mode,
+ * while in pull mode the empty buffers are made available to
+ * libusb_bulk_stream_get().
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ *
+ * \param stream the stream to start
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_BUSY if the stream is already running, or is still
+ * winding down
+ * \returns another LIBUSB_ERROR code if submitting a transfer failed
+ */
+int API_EXPORTED libusb_bulk_stream_start(struct libusb_bulk_stream *stream)
+{
+	int r;
+
+	usbi_mutex_lock(&stream->lock);
+	if (stream->running || !stream->idle) {
+		usbi_mutex_unlock(&stream->lock);
+		return LIBUSB_ERROR_BUSY;
+	}
+	stream->running = 1;
+	stream->error = 0;
+	stream->last_completion = stats_now();
+	stream->avg_gap = 0;
+	stream->burst = 0;
+	stream->max_burst = 0;
+	stream->window_len = 0;
+	bulk_stream_fill(stream);
+	r = stream->error;
+	usbi_mutex_unlock(&stream->lock);
+
+	if (r < 0)
+		libusb_bulk_stream_stop(stream);
+	return r;
+}
+
+/** \ingroup asyncio
+ * Stop a bulk stream. The transfers in flight are cancelled, and this
+ * function handles events until all of them have been retired. In pull
+ * mode, completed buffers not yet taken stay available to
+ * libusb_bulk_stream_get().
+ *
+ * This function must not be called from a transfer callback or from the
+ * callback of the stream.
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ *
+ * \param stream the stream to stop
+ * \returns 0 on success
+ * \returns the LIBUSB_ERROR code of the failure that had already stopped
+ * the stream, or of handling events
+ */
+int API_EXPORTED libusb_bulk_stream_stop(struct libusb_bulk_stream *stream)
+{
+	struct libusb_event_domain *domain = stream->pool->dev_handle->event_domain;
+	int r = 0;
+
+	usbi_mutex_lock(&stream->lock);
+	stream->running = 0;
+	cancel_handle_transfers(stream->pool->dev_handle, -1, stream->pool,
+		NULL);
+	usbi_mutex_unlock(&stream->lock);
+
+	/* the transfers of a handle in an event domain are only reaped by the
+	 * events of that domain */
+	while (!stream->idle) {
+		if (domain)
+			r = libusb_handle_domain_events_timeout_completed(domain,
+				NULL, &stream->idle);
+		else
+			r = libusb_handle_events_completed(stream->ctx,
+				&stream->idle);
+		if (r == LIBUSB_ERROR_INTERRUPTED)
+			continue;
+		if (r < 0)
+			return r;
+	}
+
+	usbi_mutex_lock(&stream->lock);
+	r = stream->error;
+	usbi_mutex_unlock(&stream->lock);
+	return r;
+}
+
+/** \ingroup asyncio
+ * Take a buffer from a bulk stream in pull mode: the oldest completed
+ * transfer of an IN stream, or an empty buffer of an OUT stream. The buffer
+ * belongs to the application until it is handed back with
+ * libusb_bulk_stream_put(). This function never blocks.
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ *
+ * \param stream the stream
+ * \param buffer output location for the buffer
+ * \param length output location for the number of bytes received, or the
+ * size of the buffer for an OUT stream
+ * \returns 1 if a buffer was returned, 0 if there is none at the moment
+ * \returns LIBUSB_ERROR_NOT_SUPPORTED if the stream is in push mode
+ * \returns LIBUSB_ERROR_NO_DEVICE or LIBUSB_ERROR_IO if there is no buffer
+ * left and the stream stopped because of a failure
+ */
+int API_EXPORTED libusb_bulk_stream_get(struct libusb_bulk_stream *stream,
+	unsigned char **buffer, int *length)
+{
+	struct libusb_transfer *transfer;
+	int r;
+
+	if (stream->callback)
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+
+	usbi_mutex_lock(&stream->lock);
+	if (stream->num_ready == 0) {
+		r = stream->idle && !stream->running ? stream->error : 0;
+		usbi_mutex_unlock(&stream->lock);
+		return r;
+	}
+	transfer = stream->transfers[stream->ready[stream->ready_head]];
+	stream->ready_head = (stream->ready_head + 1) % stream->num_transfers;
+	stream->num_ready--;
+	usbi_mutex_unlock(&stream->lock);
+
+	*buffer = transfer->buffer;
+	*length = stream->is_out ? stream->length : transfer->actual_length;
+	return 1;
+}
+
+/** \ingroup asyncio
+ * Hand a buffer taken with libusb_bulk_stream_get() back to the stream. The
+ * buffer of an OUT stream is submitted right away, so data is sent in the
+ * order it is handed back. The buffer of an IN stream is resubmitted if the
+ * stream is below its depth, and kept for later otherwise.
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ *
+ * \param stream the stream
+ * \param buffer the buffer returned by libusb_bulk_stream_get()
+ * \param length number of bytes to send, for an OUT stream. Ignored for an
+ * IN stream.
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_INVALID_PARAM if the buffer was not taken from the
+ * stream or length is out of range
+ * \returns LIBUSB_ERROR_INTERRUPTED if the OUT stream has been stopped. The
+ * buffer is taken back without being sent.
+ * \returns another LIBUSB_ERROR code if submitting the transfer failed
+ */
+int API_EXPORTED libusb_bulk_stream_put(struct libusb_bulk_stream *stream,
+	unsigned char *buffer, int length)
+{
+	ptrdiff_t offset = buffer - stream->pool->buffers;
+	int i, r = 0;
+
+	if (stream->callback || offset < 0 || offset % stream->length ||
+	    offset / stream->length >= stream->num_transfers)
+		return LIBUSB_ERROR_INVALID_PARAM;
+	if (stream->is_out && (length < 0 || length > stream->length))
+		return LIBUSB_ERROR_INVALID_PARAM;
+	i = (int)(offset / stream->length);
+
+	usbi_mutex_lock(&stream->lock);
+	if (stream->slots[i] != BULK_STREAM_READY) {
+		usbi_mutex_unlock(&stream->lock);
+		return LIBUSB_ERROR_INVALID_PARAM;
+	}
+	stream->num_held--;
+	if (stream->running &&
+	    (stream->is_out || stream->num_active < stream->depth)) {
+		r = bulk_stream_submit(stream, i,
+			stream->is_out ? length : stream->length);
+	} else {
+		stream->slots[i] = BULK_STREAM_SPARE;
+		if (stream->is_out)
+			r = LIBUSB_ERROR_INTERRUPTED;
+	}
+	usbi_mutex_unlock(&stream->lock);
+	return r;
+}
+
+/** \ingroup asyncio
+ * Get the number of transfers a bulk stream currently aims to keep in
+ * flight.
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ *
+ * \param stream the stream
+ * \returns the current depth
+ */
+int API_EXPORTED libusb_bulk_stream_get_depth(struct libusb_bulk_stream *stream)
+{
+	int depth;
+
+	usbi_mutex_lock(&stream->lock);
+	depth = stream->depth;
+	usbi_mutex_unlock(&stream->lock);
+	return depth;
+}
+
+/* round a deadline up to the timeout granularity of the context, so that
+ * deadlines close to each other share the same timer expiry.
+ * must be called with timeouts_lock locked. */
+static void round_timeout(struct libusb_context *ctx, const struct timeval *tv,
+	struct timeval *rounded)
+{
+	uint64_t usec, granularity = ctx->timeout_granularity;
+
+	*rounded = *tv;
+	if (granularity <= 1)
+		return;
+
+	usec = (uint64_t)tv->tv_sec * 1000000 + (uint64_t)tv->tv_usec;
+	usec = (usec + granularity - 1) / granularity * granularity;
+	rounded->tv_sec = (long)(usec / 1000000);
+	rounded->tv_usec = (long)(usec % 1000000);
+}
+
+#ifdef USBI_TIMERFD_AVAILABLE
+static int disarm_timerfd(struct libusb_context *ctx)
+{
+	const struct itimerspec disarm_timer = { { 0, 0 }, { 0, 0 } };
+	int r;
+
+	if (ctx->timerfd_armed == 0)
+		return 0;
+
+	usbi_dbg("");
+	r = timerfd_settime(ctx->timerfd, 0, &disarm_timer, NULL);
+	if (r < 0) {
+		ctx->timerfd_armed = -1;
+		return LIBUSB_ERROR_OTHER;
+	}
+	ctx->timerfd_armed = 0;
+	return 0;
+}
+
+/* rearms the timerfd based on the next upcoming timeout, which belongs to the
+ * device handle at the top of the context's timeout heap. the deadline is
+ * rounded to the timeout granularity, and the timerfd is left alone if it is
+ * already armed for the resulting deadline.
+ * with a granularity set, a timerfd armed for an earlier deadline is left
+ * alone as well, and it is not disarmed when no timeouts remain. should it
+ * then expire with nothing to time out, handle_timerfd_trigger() merely
+ * rearms it, which is one wakeup against the syscalls saved on every
+ * completion.
+ * must be called with timeouts_lock locked.
+ * returns 0 if there was no timeout to arm, 1 if the next timeout was armed,
+ * or a LIBUSB_ERROR code on failure.
+ */
+static int arm_timerfd_for_next_timeout(struct libusb_context *ctx)
+{
+	struct timeval deadline;
+	struct itimerspec it = { {0, 0}, {0, 0} };
+	int r;
+
+	/* no transfer with a pending timeout, so we have no arming to do */
+	if (ctx->timeout_heap.len == 0) {
+		if (ctx->timeout_granularity && ctx->timerfd_armed == 1)
+			return 0;
+		goto disarm;
+	}
+
+	round_timeout(ctx, ctx->timeout_heap.nodes[0]->timeout, &deadline);
+	if (ctx->timerfd_armed == 1 &&
+			(timercmp(&deadline, &ctx->timerfd_deadline, ==) ||
+			 (ctx->timeout_granularity &&
+			  timercmp(&ctx->timerfd_deadline, &deadline, <))))
+		return 1;
+
+	it.it_value.tv_sec = deadline.tv_sec;
+	it.it_value.tv_nsec = deadline.tv_usec * 1000;
+	usbi_dbg("next timeout at %ld.%06lds", (long)deadline.tv_sec, (long)deadline.tv_usec);
+	r = timerfd_settime(ctx->timerfd, TFD_TIMER_ABSTIME, &it, NULL);
+	if (r < 0) {
+		ctx->timerfd_armed = -1;
+		return LIBUSB_ERROR_OTHER;
+	}
+	ctx->timerfd_armed = 1;
+	ctx->timerfd_deadline = deadline;
+	return 1;
+
+disarm:
+	return disarm_timerfd(ctx);
+}
+#else
+static int arm_timerfd_for_next_timeout(struct libusb_context *ctx)
+{
+	(void)ctx;
+	return 0;
+}
+#endif
+
+#define TIMEOUT_NODE_TO_TRANSFER(node) \
+	((struct usbi_transfer *)((uintptr_t)(node) - \
+		(uintptr_t)offsetof(struct usbi_transfer, timeout_node)))
+#define TIMEOUT_NODE_TO_HANDLE(node) \
+	((struct libusb_device_handle *)((uintptr_t)(node) - \
+		(uintptr_t)offsetof(struct libusb_device_handle, timeout_node)))
+
+/* returns non 0 if timeout a expires strictly before timeout b */
+static int timeout_before(const struct timeval *a, const struct timeval *b)
+{
+	return (a->tv_sec < b->tv_sec) ||
+		(a->tv_sec == b->tv_sec && a->tv_usec < b->tv_usec);
+}
+
+static void timeout_heap_set(struct usbi_timeout_heap *heap, unsigned int idx,
+	struct usbi_timeout_node *node)
+{
+	heap->nodes[idx] = node;
+	node->index = (int)idx;
+}
+
+static void timeout_heap_sift_up(struct usbi_timeout_heap *heap,
+	unsigned int idx)
+{
+	struct usbi_timeout_node *node = heap->nodes[idx];
+
+	while (idx > 0) {
+		unsigned int parent = (idx - 1) / 2;
+
+		if (!timeout_before(node->timeout, heap->nodes[parent]->timeout))
+			break;
+		timeout_heap_set(heap, idx, heap->nodes[parent]);
+		idx = parent;
+	}
+	timeout_heap_set(heap, idx, node);
+}
+
+static void timeout_heap_sift_down(struct usbi_timeout_heap *heap,
+	unsigned int idx)
+{
+	struct usbi_timeout_node *node = heap->nodes[idx];
+
+	while (2 * idx + 1 < heap->len) {
+		unsigned int child = 2 * idx + 1;
+
+		if (child + 1 < heap->len &&
+				timeout_before(heap->nodes[child + 1]->timeout,
+					heap->nodes[child]->timeout))
+			child++;
+		if (!timeout_before(heap->nodes[child]->timeout, node->timeout))
+			break;
+		timeout_heap_set(heap, idx, heap->nodes[child]);
+		idx = child;
+	}
+	timeout_heap_set(heap, idx, node);
+}
+
+/* restore the heap order after the timeout of the node at idx changed */
+static void timeout_heap_fix(struct usbi_timeout_heap *heap, unsigned int idx)
+{
+	if (idx > 0 && timeout_before(heap->nodes[idx]->timeout,
+			heap->nodes[(idx - 1) / 2]->timeout))
+		timeout_heap_sift_up(heap, idx);
+	else
+		timeout_heap_sift_down(heap, idx);
+}
+
+static int timeout_heap_insert(struct usbi_timeout_heap *heap,
+	struct usbi_timeout_node *node)
+{
+	if (heap->len == heap->size) {
+		unsigned int new_size = heap->size ? 2 * heap->size : 16;
+		struct usbi_timeout_node **new_nodes = realloc(heap->nodes,
+			new_size * sizeof(*new_nodes));
+
+		if (!new_nodes)
+			return LIBUSB_ERROR_NO_MEM;
+		heap->nodes = new_nodes;
+		heap->size = new_size;
+	}
+
+	heap->nodes[heap->len] = node;
+	timeout_heap_sift_up(heap, heap->len++);
+	return 0;
+}
+
+/* remove a node from the heap, if it is in there.
+ * Returns 1 if the node was at the top of the heap, 0 otherwise. */
+static int timeout_heap_remove(struct usbi_timeout_heap *heap,
+	struct usbi_timeout_node *node)
+{
+	unsigned int idx;
+
+	if (node->index < 0)
+		return 0;
+
+	idx = (unsigned int)node->index;
+	node->index = -1;
+	if (idx != --heap->len) {
+		timeout_heap_set(heap, idx, heap->nodes[heap->len]);
+		timeout_heap_fix(heap, idx);
+	}
+	return idx == 0;
+}
+
+struct libusb_event_domain {
+	struct libusb_context *ctx;
+
+	/* ensures that only one thread is handling the events of this domain at
+	 * any one time, and whether such a thread is active. the flag is
+	 * protected by the event_waiters_lock of the context, which is also used
+	 * to wait for the active handler. */
+	usbi_mutex_t events_lock;
+	int event_handler_active;
+
+	/* written to by threads that need the event handler to give up the
+	 * events lock, e.g. to change the handles of the domain */
+	int event_pipe[2];
+
+	/* the device handles in the domain, protected by events_lock */
+	struct libusb_device_handle **handles;
+	unsigned int handles_cnt;
+	unsigned int handles_size;
+
+	/* poll fds of the domain, with the event pipe at index 0. the count and
+	 * modified flag are protected by the pollfds_lock of the context, the
+	 * array itself by events_lock. */
+	struct pollfd *pollfds;
+	POLL_NFDS_TYPE pollfds_cnt;
+	unsigned int pollfds_modified;
+
+	/* the handles of the domain with transfers that can time out, by their
+	 * earliest timeout. they are kept out of the heap of the context, so
+	 * that only the event handler of the domain handles their timeouts.
+	 * protected by timeouts_lock */
+	struct usbi_timeout_heap timeout_heap;
+	usbi_mutex_t timeouts_lock;
+};
+
+/* move the node of a device handle within a heap of handles after the
+ * earliest timeout of the handle changed, inserting or removing it as
+ * needed. must be called with the lock of the heap held. returns 1 if the
+ * top of the heap may have changed, 0 if not, or a LIBUSB_ERROR code */
+static int place_handle_node(struct usbi_timeout_heap *heap,
+	struct libusb_device_handle *handle)
+{
+	struct usbi_timeout_node *node = &handle->timeout_node;
+	int was_first = (node->index == 0);
+	int r = 0;
+
+	if (handle->timeout_heap.len == 0) {
+		timeout_heap_remove(heap, node);
+	} else {
+		handle->next_timeout = *handle->timeout_heap.nodes[0]->timeout;
+		if (node->index >= 0)
+			timeout_heap_fix(heap, (unsigned int)node->index);
+		else
+			r = timeout_heap_insert(heap, node);
+	}
+	if (r < 0)
+		return r;
+	return was_first || node->index == 0;
+}
+
+/* propagate a change of the earliest timeout on a device handle to the
+ * timeout heap of its event domain, or else of its context, and rearm the
+ * timerfd if the next timeout of the context changed as a result.
+ * Callers of this function must hold the handle's flying_transfers_lock. */
+static int update_handle_timeout(struct libusb_device_handle *handle)
+{
+	struct libusb_context *ctx = HANDLE_CTX(handle);
+	struct libusb_event_domain *domain = handle->event_domain;
+	int r;
+
+	if (domain) {
+		usbi_mutex_lock(&domain->timeouts_lock);
+		r = place_handle_node(&domain->timeout_heap, handle);
+		usbi_mutex_unlock(&domain->timeouts_lock);
+		return r < 0 ? r : 0;
+	}
+
+	usbi_mutex_lock(&ctx->timeouts_lock);
+	r = place_handle_node(&ctx->timeout_heap, handle);
+	if (r > 0 && usbi_using_timerfd(ctx) &&
+			arm_timerfd_for_next_timeout(ctx) < 0)
+		usbi_warn(ctx, "failed to arm timerfd (errno %d)", errno);
+	usbi_mutex_unlock(&ctx->timeouts_lock);
+	return r < 0 ? r : 0;
+}
+
+/* take a device handle out of the timeout heap of its event domain, or else
+ * of its context.
+ * Callers of this function must hold the handle's flying_transfers_lock,
+ * unless the handle can no longer be submitted to. */
+static void remove_handle_node(struct libusb_device_handle *handle)
+{
+	struct libusb_context *ctx = HANDLE_CTX(handle);
+	struct libusb_event_domain *domain = handle->event_domain;
+
+	if (domain) {
+		usbi_mutex_lock(&domain->timeouts_lock);
+		timeout_heap_remove(&domain->timeout_heap, &handle->timeout_node);
+		usbi_mutex_unlock(&domain->timeouts_lock);
+		return;
+	}
+
+	usbi_mutex_lock(&ctx->timeouts_lock);
+	if (timeout_heap_remove(&ctx->timeout_heap, &handle->timeout_node) &&
+			usbi_using_timerfd(ctx))
+		arm_timerfd_for_next_timeout(ctx);
+	usbi_mutex_unlock(&ctx->timeouts_lock);
+}
+
+/* add a transfer to the active transfers list of its device handle, and to
+ * the handle's timeout heap if it has a finite timeout.
+ * Callers of this function must hold the handle's flying_transfers_lock.
+ * This function *always* adds the transfer to the flying_transfers list,
+ * it will return a LIBUSB_ERROR code if it fails to update the timeout heap,
+ * but even then the transfer is added to the flying_transfers list.
+ * Returns 1 if the transfer now has the earliest timeout of its handle, in
+ * which case the caller has to call update_handle_timeout() once it is done
+ * adding transfers, or 0 otherwise. */
+static int add_to_flying_list(struct usbi_transfer *transfer)
+{
+	struct libusb_device_handle *handle =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(transfer)->dev_handle;
+	int r;
+
+	list_add_tail(&transfer->list, &handle->flying_transfers);
+	transfer->timeout_node.timeout = &transfer->timeout;
+	transfer->timeout_node.index = -1;
+
+	/* transfers with infinite timeout never enter the heap */
+	if (!timerisset(&transfer->timeout))
+		return 0;
+
+	r = timeout_heap_insert(&handle->timeout_heap, &transfer->timeout_node);
+	if (r < 0)
+		return r;
+	return transfer->timeout_node.index == 0;
+}
+
+/* remove a transfer from the active transfers list and the timeout heap of
+ * its device handle, without propagating the change to the context.
+ * Callers of this function must hold the handle's flying_transfers_lock.
+ * Returns 1 if the transfer had the earliest timeout of its handle, in which
+ * case the caller has to call update_handle_timeout(), or 0 otherwise. */
+static int del_from_flying_list(struct usbi_transfer *transfer)
+{
+	struct libusb_device_handle *handle =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(transfer)->dev_handle;
+
+	list_del(&transfer->list);
+	return timeout_heap_remove(&handle->timeout_heap, &transfer->timeout_node);
+}
+
+/* remove a transfer from the active transfers list and the timeout heap of
+ * its device handle.
+ * Callers of this function must hold the handle's flying_transfers_lock. */
+int usbi_remove_from_flying_list(struct usbi_transfer *transfer)
+{
+	if (del_from_flying_list(transfer))
+		return update_handle_timeout(
+			USBI_TRANSFER_TO_LIBUSB_TRANSFER(transfer)->dev_handle);
+	return 0;
+}
+
+/* set up the in-flight transfer tracking of a newly opened device handle */
+int usbi_io_handle_init(struct libusb_device_handle *handle)
+{
+	int r;
+
+	r = usbi_mutex_init(&handle->flying_transfers_lock, NULL);
+	if (r)
+		return LIBUSB_ERROR_OTHER;
+	list_init(&handle->flying_transfers);
+	handle->timeout_heap.nodes = NULL;
+	handle->timeout_heap.len = 0;
+	handle->timeout_heap.size = 0;
+	handle->timeout_node.timeout = &handle->next_timeout;
+	handle->timeout_node.index = -1;
+	handle->event_domain = NULL;
+	handle->busy_poll = 0;
+	memset(handle->endpoint_stats, 0, sizeof(handle->endpoint_stats));
+	handle->reap_wakeups = 0;
+	handle->reaped = 0;
+	handle->reap_batch_max = 0;
+	return 0;
+}
+
+/* fold the statistics of a device handle that is being closed into those of
+ * its context. Called with open_devs_lock held, right before the handle is
+ * taken off the list of open devices, so libusb_get_stats() never counts it
+ * twice or not at all. */
+void usbi_io_handle_retire_stats(struct libusb_device_handle *handle)
+{
+	struct libusb_context *ctx = HANDLE_CTX(handle);
+	struct libusb_stats sum;
+
+	memset(&sum, 0, sizeof(sum));
+	stats_handle(&sum, handle);
+	stats_accumulate(&ctx->closed_stats, &sum);
+}
+
+/* drop the in-flight transfer tracking of a device handle that is being
+ * closed. The handle must not have any transfers in flight any more. */
+void usbi_io_handle_exit(struct libusb_device_handle *handle)
+{
+	/* a handle that libusb_wrap_sys_device() failed to open has no device,
+	 * and was never in a heap */
+	if (handle->dev)
+		remove_handle_node(handle);
+
+	/* handle_timeouts() may have picked this handle from the heap just
+	 * before we removed it; wait for it to let go */
+	usbi_mutex_lock(&handle->flying_transfers_lock);
+	usbi_mutex_unlock(&handle->flying_transfers_lock);
+
+	free(handle->timeout_heap.nodes);
+	usbi_mutex_destroy(&handle->flying_transfers_lock);
+}
+
+/* determine whether a thread may block in the kernel on a synchronous
+ * transfer of a device handle without holding up anything else the event
+ * loop would do in the meantime. this is the case if the handle has no
+ * transfers in flight, the context has no pending events, and the other
+ * handles served by the same events either have no transfers in flight or
+ * are looked after by an active event handler. returns 1 if so, 0 if not. */
+int usbi_io_handle_idle(struct libusb_device_handle *dev_handle)
+{
+	struct libusb_context *ctx = HANDLE_CTX(dev_handle);
+	struct libusb_event_domain *domain = dev_handle->event_domain;
+	struct libusb_device_handle *handle;
+	int r;
+
+	usbi_mutex_lock(&dev_handle->flying_transfers_lock);
+	r = list_empty(&dev_handle->flying_transfers);
+	usbi_mutex_unlock(&dev_handle->flying_transfers_lock);
+	if (!r)
+		return 0;
+
+	usbi_mutex_lock(&ctx->event_data_lock);
+	r = !usbi_pending_events(ctx);
+	usbi_mutex_unlock(&ctx->event_data_lock);
+	if (!r)
+		return 0;
+
+	if (domain) {
+		usbi_mutex_lock(&ctx->event_waiters_lock);
+		r = domain->event_handler_active;
+		usbi_mutex_unlock(&ctx->event_waiters_lock);
+	} else {
+		r = libusb_event_handler_active(ctx);
+	}
+	if (r)
+		return 1;
+
+	r = 1;
+	usbi_mutex_lock(&ctx->open_devs_lock);
+	list_for_each_entry(handle, &ctx->open_devs, list,
+			struct libusb_device_handle) {
+		if (handle == dev_handle || handle->event_domain != domain)
+			continue;
+		usbi_mutex_lock(&handle->flying_transfers_lock);
+		r = list_empty(&handle->flying_transfers);
+		usbi_mutex_unlock(&handle->flying_transfers_lock);
+		if (!r)
+			break;
+	}
+	usbi_mutex_unlock(&ctx->open_devs_lock);
+	return r;
+}
+
+/* vectored transfers must be bulk or interrupt transfers, and the backend
+ * has to be able to submit them */
+static int check_iov(struct usbi_transfer *itransfer)
+{
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	int i;
+
+	if (!USBI_TRANSFER_IS_IOV(itransfer))
+		return 0;
+
+	switch (transfer->type) {
+	case LIBUSB_TRANSFER_TYPE_BULK:
+	case LIBUSB_TRANSFER_TYPE_BULK_STREAM:
+	case LIBUSB_TRANSFER_TYPE_INTERRUPT:
+		break;
+	default:
+		return LIBUSB_ERROR_INVALID_PARAM;
+	}
+	/* the buffer field points at the fragment array, which is not
+	 * libusb's to free */
+	if (itransfer->num_iov <= 0 ||
+	    (transfer->flags & LIBUSB_TRANSFER_FREE_BUFFER))
+		return LIBUSB_ERROR_INVALID_PARAM;
+	for (i = 0; i < itransfer->num_iov; i++)
+		if (itransfer->iov[i].length < 0)
+			return LIBUSB_ERROR_INVALID_PARAM;
+	if (!(usbi_backend->caps & USBI_CAP_SUPPORTS_BULK_IOV))
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+	return 0;
+}
+
+/** \ingroup asyncio
+ * Submit a transfer. This function will fire off the USB transfer and then
+ * return immediately.
+ *
+ * \param transfer the transfer to submit
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_NO_DEVICE if the device has been disconnected
+ * \returns LIBUSB_ERROR_BUSY if the transfer has already been submitted.
+ * \returns LIBUSB_ERROR_NOT_SUPPORTED if the transfer flags are not supported
+ * by the operating system, or if the transfer is vectored and the operating
+ * system does not support that.
+ * \returns another LIBUSB_ERROR code on other failure
+ */
+int API_EXPORTED libusb_submit_transfer(struct libusb_transfer *transfer)
+{
+	int r = libusb_submit_transfers(&transfer, 1);
+
+	return r < 0 ? r : 0;
+}
+
+/** \ingroup asyncio
+ * Submit several transfers for the same device handle at once. This is
+ * equivalent to calling libusb_submit_transfer() on each of them in turn,
+ * but takes the locks involved only once and updates the timeout
+ * bookkeeping of the context at most once, which makes priming a deep queue
+ * of transfers considerably cheaper.
+ *
+ * The transfers are submitted in array order. If submitting one of them
+ * fails, the transfers before it stay submitted and the ones after it are
+ * left alone.
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ *
+ * \param transfers array of transfers to submit
+ * \param num_transfers number of transfers in the array
+ * \returns the number of transfers submitted, which is less than
+ * num_transfers if submitting transfers[returned value] failed
+ * \returns LIBUSB_ERROR_INVALID_PARAM if the transfers do not all belong to
+ * the same device handle
+ * \returns the LIBUSB_ERROR code libusb_submit_transfer() would return for
+ * the first transfer, if it could not be submitted
+ * \returns LIBUSB_ERROR_NO_MEM if the timeouts of the device handle could
+ * not be updated after a transfer was taken back
+ */
+int API_EXPORTED libusb_submit_transfers(struct libusb_transfer **transfers,
+	int num_transfers)
+{
+	struct libusb_device_handle *handle;
+	struct libusb_context *ctx;
+	uint64_t now;
+	int timeout_moved = 0;
+	int updated_fds = 0;
+	int r = 0;
+	int tr = 0;
+	int i;
+
+	if (num_transfers <= 0)
+		return num_transfers == 0 ? 0 : LIBUSB_ERROR_INVALID_PARAM;
+
+	handle = transfers[0]->dev_handle;
+	ctx = HANDLE_CTX(handle);
+	for (i = 1; i < num_transfers; i++)
+		if (transfers[i]->dev_handle != handle)
+			return LIBUSB_ERROR_INVALID_PARAM;
+
+	now = stats_now();
+	usbi_mutex_lock(&handle->flying_transfers_lock);
+	for (i = 0; i < num_transfers; i++) {
+		struct usbi_transfer *itransfer =
+			LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfers[i]);
+
+		usbi_mutex_lock(&itransfer->lock);
+		itransfer->transferred = 0;
+		itransfer->flags = 0;
+		r = check_iov(itransfer);
+		if (r < 0) {
+			usbi_mutex_unlock(&itransfer->lock);
+			break;
+		}
+		r = calculate_timeout(itransfer);
+		if (r < 0) {
+			r = LIBUSB_ERROR_OTHER;
+			usbi_mutex_unlock(&itransfer->lock);
+			break;
+		}
+
+		r = add_to_flying_list(itransfer);
+		/* the context has to know about a new earliest timeout of the
+		 * handle before the transfer is handed to the backend, so that
+		 * failing to record it fails the submission. this is usually
+		 * only the case for the first transfer of the batch */
+		if (r > 0)
+			r = update_handle_timeout(handle);
+		itransfer->submit_time = now;
+		if (r >= 0) {
+			usbi_trace4(transfer__submit, transfers[i],
+				transfers[i]->endpoint, transfers[i]->length,
+				transfers[i]->type);
+			r = usbi_backend->submit_transfer(itransfer);
+		}
+		if (r != LIBUSB_SUCCESS) {
+			if (del_from_flying_list(itransfer))
+				timeout_moved = 1;
+		} else {
+			/* the OS enforces this transfer's timeout, so it has no
+			 * business in the timeout heap */
+			if ((itransfer->flags & USBI_TRANSFER_OS_HANDLES_TIMEOUT) &&
+					timeout_heap_remove(&handle->timeout_heap,
+						&itransfer->timeout_node))
+				timeout_moved = 1;
+			/* keep a reference to this device */
+			libusb_ref_device(handle->dev);
+			usbi_stats_add(&usbi_endpoint_stats(handle,
+				transfers[i]->endpoint)->transfers_submitted, 1);
+		}
+		updated_fds |= (itransfer->flags & USBI_TRANSFER_UPDATED_FDS);
+		usbi_mutex_unlock(&itransfer->lock);
+		if (r != LIBUSB_SUCCESS)
+			break;
+	}
+
+	/* let the context know about the timeouts removed from the handle,
+	 * rearming the timerfd at most once for the whole batch */
+	if (timeout_moved)
+		tr = update_handle_timeout(handle);
+	usbi_mutex_unlock(&handle->flying_transfers_lock);
+	if (updated_fds)
+		usbi_fd_notification(ctx);
+	if (tr < 0)
+		return tr;
+	return i > 0 ? i : r;
+}
+
+/** \ingroup asyncio
+ * Asynchronously cancel a previously submitted transfer.
+ * This function returns immediately, but this does not indicate cancellation
+ * is complete. Your callback function will be invoked at some later time
+ * with a transfer status of
+ * \ref libusb_transfer_status::LIBUSB_TRANSFER_CANCELLED
+ * "LIBUSB_TRANSFER_CANCELLED."
+ *
+ * \param transfer the transfer to cancel
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_NOT_FOUND if the transfer is already complete or
+ * cancelled.
+ * \returns a LIBUSB_ERROR code on failure
+ */
+int API_EXPORTED libusb_cancel_transfer(struct libusb_transfer *transfer)
+{
+	struct usbi_transfer *itransfer =
+		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
+	int r;
+
+	usbi_dbg("");
+	usbi_mutex_lock(&itransfer->lock);
+	r = cancel_transfer_locked(itransfer);
+	usbi_mutex_unlock(&itransfer->lock);
+	return r;
+}
+
+/** \ingroup asyncio
+ * Asynchronously cancel all transfers in flight on an endpoint. This is
+ * equivalent to calling libusb_cancel_transfer() on each of them, but walks
+ * the transfers of the device handle only once. The newest transfers are
+ * cancelled first, which keeps the device from moving on to a transfer that
+ * is about to be cancelled.
+ *
+ * As with libusb_cancel_transfer(), the callbacks of the transfers will be
+ * invoked at some later time with a transfer status of
+ * \ref libusb_transfer_status::LIBUSB_TRANSFER_CANCELLED
+ * "LIBUSB_TRANSFER_CANCELLED" (or the status the transfer completed with, if
+ * it completed before it could be cancelled). Transfers whose cancellation
+ * is already in progress are left alone.
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ *
+ * \param dev_handle a handle for the device
+ * \param endpoint the address of the endpoint
+ * \returns the number of transfers that were cancelled, which is 0 if there
+ * were no transfers in flight that were not already being cancelled
+ * \returns a LIBUSB_ERROR code if none of the transfers could be cancelled
+ * \see libusb_cancel_all_transfers()
+ */
+int API_EXPORTED libusb_cancel_endpoint_transfers(
+	libusb_device_handle *dev_handle, unsigned char endpoint)
+{
+	usbi_dbg("endpoint 0x%02x", endpoint);
+	return cancel_handle_transfers(dev_handle, endpoint, NULL, NULL);
+}
+
+/** \ingroup asyncio
+ * Asynchronously cancel all transfers in flight on a device handle, for all
+ * endpoints. This behaves like libusb_cancel_endpoint_transfers() does for
+ * every endpoint of the device.
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ *
+ * \param dev_handle a handle for the device
+ * \returns the number of transfers that were cancelled, which is 0 if there
+ * were no transfers in flight that were not already being cancelled
+ * \returns a LIBUSB_ERROR code if none of the transfers could be cancelled
+ */
+int API_EXPORTED libusb_cancel_all_transfers(libusb_device_handle *dev_handle)
+{
+	usbi_dbg("");
+	return cancel_handle_transfers(dev_handle, -1, NULL, NULL);
+}
+
+/** \ingroup asyncio
+ * Set a transfers bulk stream id. Note users are advised to use
+ * libusb_fill_bulk_stream_transfer() instead of calling this function
+ * directly.
+ *
+ * Since version 1.0.19, \ref LIBUSB_API_VERSION >= 0x01000103
+ *
+ * \param transfer the transfer to set the stream id for
+ * \param stream_id the stream id to set
+ * \see libusb_alloc_streams()
+ */
+void API_EXPORTED libusb_transfer_set_stream_id(
+	struct libusb_transfer *transfer, uint32_t stream_id)
+{
+	struct usbi_transfer *itransfer =
+		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
+
+	itransfer->stream_id = stream_id;
+}
+
+/** \ingroup asyncio
+ * Get a transfers bulk stream id.
+ *
+ * Since version 1.0.19, \ref LIBUSB_API_VERSION >= 0x01000103
+ *
+ * \param transfer the transfer to get the stream id for
+ * \returns the stream id for the transfer
+ */
+uint32_t API_EXPORTED libusb_transfer_get_stream_id(
+	struct libusb_transfer *transfer)
+{
+	struct usbi_transfer *itransfer =
+		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
+
+	return itransfer->stream_id;
+}
+
+/** \ingroup asyncio
+ * Make a bulk or interrupt transfer vectored, taking its data from the given
+ * fragments instead of one contiguous buffer. This sets the
+ * \ref libusb_transfer::buffer "buffer" and
+ * \ref libusb_transfer::length "length" fields of the transfer. Note users
+ * are advised to use libusb_fill_bulk_transfer_iov() instead of calling this
+ * function directly.
+ *
+ * The transfer stays vectored until its buffer field is changed. libusb
+ * never frees the fragments or the array, and a vectored transfer with the
+ * \ref libusb_transfer_flags::LIBUSB_TRANSFER_FREE_BUFFER
+ * "LIBUSB_TRANSFER_FREE_BUFFER" flag set fails to submit with
+ * LIBUSB_ERROR_INVALID_PARAM.
+ *
+ * On Linux, vectored IN transfers that need more than one URB are only
+ * supported by kernels with bulk continuation, and fail to submit with
+ * LIBUSB_ERROR_NOT_SUPPORTED otherwise.
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ *
+ * \param transfer the transfer to set the fragments for
+ * \param iov array of data fragments
+ * \param num_iov number of fragments in the array
+ */
+void API_EXPORTED libusb_transfer_set_iov(struct libusb_transfer *transfer,
+	struct libusb_iovec *iov, int num_iov)
+{
+	struct usbi_transfer *itransfer =
+		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
+	int i;
+
+	itransfer->iov = iov;
+	itransfer->num_iov = num_iov;
+	transfer->buffer = (unsigned char *)iov;
+	transfer->length = 0;
+	for (i = 0; i < num_iov; i++)
+		transfer->length += iov[i].length;
+}
+
+struct libusb_completion_queue {
+	struct libusb_context *ctx;
+
+	/* protects everything below */
+	usbi_mutex_t lock;
+	usbi_cond_t cond;
+
+	/* the completed transfers, oldest first */
+	struct list_head transfers;
+
+	/* the threads in libusb_completion_queue_wait(), so that completions
+	 * only signal the condition when somebody waits for it */
+	int num_waiters;
+
+	/* calls to libusb_completion_queue_interrupt() not yet consumed by a
+	 * waiter */
+	int interrupts;
+};
+
+/** \ingroup asyncio
+ * Allocate a completion queue. Transfers that are attached to the queue with
+ * libusb_transfer_set_completion_queue() are added to it when they complete,
+ * instead of having their callback invoked by the event handler. Any number
+ * of threads can then take them from the queue with
+ * libusb_completion_queue_wait(), so that a slow completion handler no
+ * longer holds up the handling of events for all devices.
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \returns a newly allocated completion queue, or NULL on error
+ */
+DEFAULT_VISIBILITY
+struct libusb_completion_queue * LIBUSB_CALL libusb_alloc_completion_queue(
+	libusb_context *ctx)
+{
+	struct libusb_completion_queue *queue;
+
+	USBI_GET_CONTEXT(ctx);
+	queue = calloc(1, sizeof(*queue));
+	if (!queue)
+		return NULL;
+
+	queue->ctx = ctx;
+	list_init(&queue->transfers);
+	if (usbi_mutex_init(&queue->lock, NULL)) {
+		free(queue);
+		return NULL;
+	}
+	if (usbi_cond_init(&queue->cond, NULL)) {
+		usbi_mutex_destroy(&queue->lock);
+		free(queue);
+		return NULL;
+	}
+	return queue;
+}
+
+/** \ingroup asyncio
+ * Free a completion queue. No transfer attached to the queue may be in
+ * flight, and no thread may be waiting on it. Transfers still in the queue
+ * are left alone; it is up to the application to free them.
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ *
+ * \param queue the queue to free. If NULL, no action is taken.
+ */
+void API_EXPORTED libusb_free_completion_queue(
+	struct libusb_completion_queue *queue)
+{
+	if (!queue)
+		return;
+
+	if (!list_empty(&queue->transfers))
+		usbi_warn(queue->ctx, "freeing completion queue %p with transfers "
+			"still in it", queue);
+	usbi_cond_destroy(&queue->cond);
+	usbi_mutex_destroy(&queue->lock);
+	free(queue);
+}
+
+/** \ingroup asyncio
+ * Deliver the completion of a transfer to a completion queue instead of
+ * invoking its callback. This takes effect from the next completion of the
+ * transfer on, and lasts until the queue is changed again; a NULL queue
+ * restores the callback. The \ref libusb_transfer::callback "callback"
+ * field is ignored while a queue is set, and so is the
+ * \ref libusb_transfer_flags::LIBUSB_TRANSFER_FREE_TRANSFER
+ * "LIBUSB_TRANSFER_FREE_TRANSFER" flag, as the transfer is still in the
+ * queue after its completion.
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ *
+ * \param transfer the transfer to set the completion queue for
+ * \param queue the completion queue, or NULL
+ */
+void API_EXPORTED libusb_transfer_set_completion_queue(
+	struct libusb_transfer *transfer, struct libusb_completion_queue *queue)
+{
+	struct usbi_transfer *itransfer =
+		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
+
+	itransfer->completion_queue = queue;
+}
+
+/** \ingroup asyncio
+ * Take the oldest completed transfer from a completion queue, waiting for
+ * one if the queue is empty. The transfer is handed over as it would have
+ * been to its callback: its status and actual length are filled in, and it
+ * belongs to the application again, which may resubmit or free it.
+ *
+ * This function does not handle events. Some other thread has to do so,
+ * for example with libusb_handle_events(), for transfers to complete.
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ *
+ * \param queue the completion queue
+ * \param transfer output location for the completed transfer
+ * \param tv the maximum time to wait, an all zero timeval struct to return
+ * immediately, or NULL to wait without a time limit
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_TIMEOUT if no transfer completed in time
+ * \returns LIBUSB_ERROR_INTERRUPTED if the wait was ended by
+ * libusb_completion_queue_interrupt()
+ * \returns another LIBUSB_ERROR code on other failure
+ */
+int API_EXPORTED libusb_completion_queue_wait(
+	struct libusb_completion_queue *queue,
+	struct libusb_transfer **transfer, struct timeval *tv)
+{
+	struct usbi_transfer *itransfer;
+	struct timespec timeout;
+	int r = 0;
+
+	if (tv && timerisset(tv)) {
+		r = usbi_backend->clock_gettime(USBI_CLOCK_REALTIME, &timeout);
+		if (r < 0) {
+			usbi_err(queue->ctx, "failed to read realtime clock, error %d",
+				errno);
+			return LIBUSB_ERROR_OTHER;
+		}
+		timeout.tv_sec += tv->tv_sec;
+		timeout.tv_nsec += tv->tv_usec * 1000;
+		while (timeout.tv_nsec >= 1000000000) {
+			timeout.tv_nsec -= 1000000000;
+			timeout.tv_sec++;
+		}
+	}
+
+	usbi_mutex_lock(&queue->lock);
+	while (list_empty(&queue->transfers) && !queue->interrupts) {
+		if (tv && (!timerisset(tv) || r == ETIMEDOUT)) {
+			usbi_mutex_unlock(&queue->lock);
+			return LIBUSB_ERROR_TIMEOUT;
+		}
+		queue->num_waiters++;
+		if (tv)
+			r = usbi_cond_timedwait(&queue->cond, &queue->lock, &timeout);
+		else
+			usbi_cond_wait(&queue->cond, &queue->lock);
+		queue->num_waiters--;
+	}
+
+	if (list_empty(&queue->transfers)) {
+		queue->interrupts--;
+		usbi_mutex_unlock(&queue->lock);
+		return LIBUSB_ERROR_INTERRUPTED;
+	}
+	itransfer = list_first_entry(&queue->transfers, struct usbi_transfer,
+		list);
+	list_del(&itransfer->list);
+	usbi_mutex_unlock(&queue->lock);
+
+	*transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	return 0;
+}
+
+/** \ingroup asyncio
+ * Make one call to libusb_completion_queue_wait() return
+ * LIBUSB_ERROR_INTERRUPTED once the queue is empty: one that is waiting, or
+ * the next one. To stop several threads taking transfers from the queue,
+ * call this function once for each of them.
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ *
+ * \param queue the completion queue
+ */
+void API_EXPORTED libusb_completion_queue_interrupt(
+	struct libusb_completion_queue *queue)
+{
+	usbi_mutex_lock(&queue->lock);
+	queue->interrupts++;
+	if (queue->num_waiters)
+		usbi_cond_broadcast(&queue->cond);
+	usbi_mutex_unlock(&queue->lock);
+}
+
+/* hands a completed transfer to its completion queue */
+static void completion_queue_add(struct libusb_completion_queue *queue,
+	struct usbi_transfer *itransfer)
+{
+	usbi_mutex_lock(&queue->lock);
+	list_add_tail(&itransfer->list, &queue->transfers);
+	if (queue->num_waiters)
+		usbi_cond_signal(&queue->cond);
+	usbi_mutex_unlock(&queue->lock);
+}
+
+/* the state of one stream of a stream scheduler */
+struct stream_sched_stream {
+	/* the transfers waiting to be submitted on this stream, oldest first */
+	struct list_head queue;
+	/* links the stream into the ready list of the scheduler while it has
+	 * queued transfers and room for another one in flight */
+	struct list_head ready_list;
+	int ready;
+	int priority;
+	int in_flight;
+	int allocated;
+};
+
+struct libusb_stream_scheduler {
+	struct libusb_context *ctx;
+	struct libusb_device_handle *dev_handle;
+	unsigned char endpoint;
+	uint32_t num_streams;
+	int max_in_flight;
+	int max_per_stream;
+
+	/* protects everything below */
+	usbi_mutex_t lock;
+
+	/* indexed by stream id - 1 */
+	struct stream_sched_stream *streams;
+
+	/* the streams that a transfer can be submitted on next. the stream
+	 * served last goes to the back, to rotate between streams of the
+	 * same priority */
+	struct list_head ready;
+
+	int in_flight;
+	int num_queued;
+	uint32_t next_id;
+};
+
+/* must be called with the scheduler lock held */
+static void stream_sched_update_ready(struct libusb_stream_scheduler *sched,
+	struct stream_sched_stream *stream)
+{
+	int ready = !list_empty(&stream->queue) &&
+		stream->in_flight < sched->max_per_stream;
+
+	if (ready && !stream->ready)
+		list_add_tail(&stream->ready_list, &sched->ready);
+	else if (!ready && stream->ready)
+		list_del(&stream->ready_list);
+	stream->ready = ready;
+}
+
+/* hand a transfer that never made it onto the bus back to the application,
+ * with the given status, the way the event handler hands back completed
+ * transfers. must be called without the scheduler lock held */
+static void stream_sched_complete(struct usbi_transfer *itransfer,
+	enum libusb_transfer_status status)
+{
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+
+	transfer->status = status;
+	transfer->actual_length = 0;
+	if (itransfer->completion_queue) {
+		completion_queue_add(itransfer->completion_queue, itransfer);
+	} else {
+		uint8_t flags = transfer->flags;
+
+		if (transfer->callback)
+			transfer->callback(transfer);
+		if (flags & LIBUSB_TRANSFER_FREE_TRANSFER)
+			libusb_free_transfer(transfer);
+	}
+}
+
+/* submit queued transfers while the limits allow, highest priority stream
+ * first. transfers that fail to submit are moved to the failed list, with
+ * their status set. afterwards either the limit on transfers in flight is
+ * reached or no stream is ready. must be called with the scheduler lock
+ * held */
+static void stream_sched_dispatch(struct libusb_stream_scheduler *sched,
+	struct list_head *failed)
+{
+	struct stream_sched_stream *stream, *best;
+	struct usbi_transfer *itransfer;
+	int r;
+
+	while (sched->in_flight < sched->max_in_flight &&
+			!list_empty(&sched->ready)) {
+		best = NULL;
+		list_for_each_entry(stream, &sched->ready, ready_list,
+				struct stream_sched_stream) {
+			if (!best || stream->priority > best->priority)
+				best = stream;
+		}
+
+		itransfer = list_first_entry(&best->queue, struct usbi_transfer,
+			list);
+		list_del(&itransfer->list);
+		sched->num_queued--;
+
+		/* counted before submission, as the transfer may complete in
+		 * another thread before libusb_submit_transfer() returns */
+		best->in_flight++;
+		sched->in_flight++;
+		list_del(&best->ready_list);
+		best->ready = 0;
+		stream_sched_update_ready(sched, best);
+
+		r = libusb_submit_transfer(
+			USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer));
+		if (r < 0) {
+			usbi_dbg("stream %u transfer failed to submit (%d)",
+				itransfer->stream_id, r);
+			best->in_flight--;
+			sched->in_flight--;
+			stream_sched_update_ready(sched, best);
+			itransfer->stream_sched = NULL;
+			USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer)->status =
+				r == LIBUSB_ERROR_NO_DEVICE ?
+				LIBUSB_TRANSFER_NO_DEVICE : LIBUSB_TRANSFER_ERROR;
+			list_add_tail(&itransfer->list, failed);
+		}
+	}
+}
+
+static void stream_sched_fail_transfers(struct list_head *failed)
+{
+	struct usbi_transfer *itransfer, *tmp;
+
+	list_for_each_entry_safe(itransfer, tmp, failed, list,
+			struct usbi_transfer) {
+		list_del(&itransfer->list);
+		stream_sched_complete(itransfer,
+			USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer)->status);
+	}
+}
+
+/* called by the event handler when a transfer submitted by a scheduler
+ * completes, before the application sees it. the transfer leaves the
+ * scheduler, and its stream can take the next queued transfer. */
+static void stream_sched_completed(struct usbi_transfer *itransfer)
+{
+	struct libusb_stream_scheduler *sched = itransfer->stream_sched;
+	struct stream_sched_stream *stream;
+	struct list_head failed;
+
+	list_init(&failed);
+	itransfer->stream_sched = NULL;
+
+	usbi_mutex_lock(&sched->lock);
+	stream = &sched->streams[itransfer->stream_id - 1];
+	stream->in_flight--;
+	sched->in_flight--;
+	stream_sched_update_ready(sched, stream);
+	stream_sched_dispatch(sched, &failed);
+	usbi_mutex_unlock(&sched->lock);
+
+	stream_sched_fail_transfers(&failed);
+}
+
+/** \ingroup asyncio
+ * Allocate a stream scheduler for an endpoint that uses USB 3.0 bulk
+ * streams. The scheduler keeps a queue of transfers for each stream, and
+ * submits them as the limits on transfers in flight allow: streams of a
+ * higher priority first, and streams of the same priority in turn. The
+ * streams must have been allocated for the endpoint with
+ * libusb_alloc_streams(); they are numbered from 1 to num_streams.
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ *
+ * \param dev_handle a device handle
+ * \param endpoint the bulk endpoint the streams belong to
+ * \param num_streams the number of streams, as returned by
+ * libusb_alloc_streams()
+ * \param max_in_flight the maximum number of transfers in flight on the
+ * endpoint, over all streams
+ * \param max_per_stream the maximum number of transfers in flight on one
+ * stream
+ * \returns a newly allocated stream scheduler, or NULL on error
+ */
+DEFAULT_VISIBILITY
+struct libusb_stream_scheduler * LIBUSB_CALL libusb_alloc_stream_scheduler(
+	libusb_device_handle *dev_handle, unsigned char endpoint,
+	uint32_t num_streams, int max_in_flight, int max_per_stream)
+{
+	struct libusb_stream_scheduler *sched;
+	uint32_t i;
+
+	if (num_streams == 0 || max_in_flight <= 0 || max_per_stream <= 0)
+		return NULL;
+
+	sched = calloc(1, sizeof(*sched));
+	if (!sched)
+		return NULL;
+	sched->streams = calloc(num_streams, sizeof(*sched->streams));
+	if (!sched->streams) {
+		free(sched);
+		return NULL;
+	}
+	if (usbi_mutex_init(&sched->lock, NULL)) {
+		free(sched->streams);
+		free(sched);
+		return NULL;
+	}
+
+	sched->ctx = HANDLE_CTX(dev_handle);
+	sched->dev_handle = dev_handle;
+	sched->endpoint = endpoint;
+	sched->num_streams = num_streams;
+	sched->max_in_flight = max_in_flight;
+	sched->max_per_stream = max_per_stream;
+	list_init(&sched->ready);
+	for (i = 0; i < num_streams; i++)
+		list_init(&sched->streams[i].queue);
+
+	usbi_dbg("scheduler %p for %u streams on endpoint %02x", sched,
+		num_streams, endpoint);
+	return sched;
+}
+
+/** \ingroup asyncio
+ * Free a stream scheduler. No transfer may be queued on it or in flight;
+ * see libusb_stream_scheduler_cancel().
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ *
+ * \param sched the scheduler to free. If NULL, no action is taken.
+ */
+void API_EXPORTED libusb_free_stream_scheduler(
+	struct libusb_stream_scheduler *sched)
+{
+	if (!sched)
+		return;
+
+	usbi_mutex_lock(&sched->lock);
+	if (sched->in_flight || sched->num_queued)
+		usbi_warn(sched->ctx, "freeing stream scheduler %p with %d "
+			"transfers in flight and %d queued", sched,
+			sched->in_flight, sched->num_queued);
+	usbi_mutex_unlock(&sched->lock);
+	usbi_mutex_destroy(&sched->lock);
+	free(sched->streams);
+	free(sched);
+}
+
+/** \ingroup asyncio
+ * Reserve a stream of a scheduler, for example for one command of a
+ * storage protocol that matches commands and data by stream. Streams are
+ * handed out in turn, so that a recently released stream is the last to be
+ * reused.
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ *
+ * \param sched the scheduler
+ * \returns the stream id, from 1 to the number of streams
+ * \returns LIBUSB_ERROR_BUSY if all streams are reserved
+ */
+int API_EXPORTED libusb_stream_scheduler_alloc_id(
+	struct libusb_stream_scheduler *sched)
+{
+	uint32_t i, id;
+	int r = LIBUSB_ERROR_BUSY;
+
+	usbi_mutex_lock(&sched->lock);
+	for (i = 0; i < sched->num_streams; i++) {
+		id = (sched->next_id + i) % sched->num_streams;
+		if (!sched->streams[id].allocated) {
+			sched->streams[id].allocated = 1;
+			sched->next_id = (id + 1) % sched->num_streams;
+			r = (int)id + 1;
+			break;
+		}
+	}
+	usbi_mutex_unlock(&sched->lock);
+	return r;
+}
+
+/** \ingroup asyncio
+ * Release a stream reserved with libusb_stream_scheduler_alloc_id().
+ * Transfers already queued on the stream are still submitted.
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ *
+ * \param sched the scheduler
+ * \param stream_id the stream to release
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_INVALID_PARAM if the stream was not reserved
+ */
+int API_EXPORTED libusb_stream_scheduler_free_id(
+	struct libusb_stream_scheduler *sched, uint32_t stream_id)
+{
+	int r = LIBUSB_ERROR_INVALID_PARAM;
+
+	if (stream_id == 0 || stream_id > sched->num_streams)
+		return r;
+
+	usbi_mutex_lock(&sched->lock);
+	if (sched->streams[stream_id - 1].allocated) {
+		sched->streams[stream_id - 1].allocated = 0;
+		r = 0;
+	}
+	usbi_mutex_unlock(&sched->lock);
+	return r;
+}
+
+/** \ingroup asyncio
+ * Set the priority of a stream. Whenever there is room for another transfer
+ * in flight, it is taken from the stream with the highest priority that has
+ * transfers queued. All streams start with priority 0.
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ *
+ * \param sched the scheduler
+ * \param stream_id the stream
+ * \param priority the new priority; larger numbers are served first
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_INVALID_PARAM if the stream id is out of range
+ */
+int API_EXPORTED libusb_stream_scheduler_set_priority(
+	struct libusb_stream_scheduler *sched, uint32_t stream_id, int priority)
+{
+	if (stream_id == 0 || stream_id > sched->num_streams)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	usbi_mutex_lock(&sched->lock);
+	sched->streams[stream_id - 1].priority = priority;
+	usbi_mutex_unlock(&sched->lock);
+	return 0;
+}
+
+/** \ingroup asyncio
+ * Queue a transfer on a stream of a scheduler. The transfer must be a bulk
+ * stream transfer for the endpoint of the scheduler, as filled in by
+ * libusb_fill_bulk_stream_transfer().
+ * It is submitted right away if the limits on transfers in flight allow,
+ * and otherwise once enough transfers of the scheduler have completed.
+ *
+ * The transfer completes as usual, through its callback or its completion
+ * queue. A transfer that fails to submit after it was queued completes with
+ * status \ref libusb_transfer_status::LIBUSB_TRANSFER_ERROR
+ * "LIBUSB_TRANSFER_ERROR", or
+ * \ref libusb_transfer_status::LIBUSB_TRANSFER_NO_DEVICE
+ * "LIBUSB_TRANSFER_NO_DEVICE" if the device has gone away.
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ *
+ * \param sched the scheduler
+ * \param transfer the transfer to queue
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_INVALID_PARAM if the transfer does not belong to the
+ * scheduler
+ * \returns another LIBUSB_ERROR code if the transfer was submitted right away
+ * and that failed, as for libusb_submit_transfer()
+ */
+int API_EXPORTED libusb_stream_scheduler_submit(
+	struct libusb_stream_scheduler *sched, struct libusb_transfer *transfer)
+{
+	struct usbi_transfer *itransfer =
+		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
+	struct stream_sched_stream *stream;
+	int r = 0;
+
+	if (transfer->dev_handle != sched->dev_handle ||
+			transfer->endpoint != sched->endpoint ||
+			transfer->type != LIBUSB_TRANSFER_TYPE_BULK_STREAM ||
+			itransfer->stream_id == 0 ||
+			itransfer->stream_id > sched->num_streams)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	usbi_mutex_lock(&sched->lock);
+	stream = &sched->streams[itransfer->stream_id - 1];
+	itransfer->stream_sched = sched;
+	if (sched->in_flight < sched->max_in_flight &&
+			stream->in_flight < sched->max_per_stream) {
+		/* with room in flight no stream is ready, so nothing is
+		 * waiting in front of this transfer */
+		stream->in_flight++;
+		sched->in_flight++;
+		r = libusb_submit_transfer(transfer);
+		if (r < 0) {
+			stream->in_flight--;
+			sched->in_flight--;
+			itransfer->stream_sched = NULL;
+		}
+	} else {
+		list_add_tail(&itransfer->list, &stream->queue);
+		sched->num_queued++;
+		stream_sched_update_ready(sched, stream);
+	}
+	usbi_mutex_unlock(&sched->lock);
+
+	return r;
+}
+
+/** \ingroup asyncio
+ * Cancel all transfers of a scheduler. Queued transfers are taken off
+ * their queues and complete with status
+ * \ref libusb_transfer_status::LIBUSB_TRANSFER_CANCELLED
+ * "LIBUSB_TRANSFER_CANCELLED" before this function returns, in the calling
+ * thread. Transfers in flight are cancelled as with libusb_cancel_transfer(),
+ * and complete later through the event handler.
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ *
+ * \param sched the scheduler
+ * \returns the number of transfers cancelled, queued or in flight
+ * \returns a LIBUSB_ERROR code if there were transfers in flight and none
+ * of them could be cancelled
+ */
+int API_EXPORTED libusb_stream_scheduler_cancel(
+	struct libusb_stream_scheduler *sched)
+{
+	struct usbi_transfer *itransfer, *tmp;
+	struct list_head cancelled;
+	uint32_t i;
+	int count = 0, r;
+
+	list_init(&cancelled);
+	usbi_mutex_lock(&sched->lock);
+	for (i = 0; i < sched->num_streams; i++) {
+		struct stream_sched_stream *stream = &sched->streams[i];
+
+		list_for_each_entry_safe(itransfer, tmp, &stream->queue, list,
+				struct usbi_transfer) {
+			list_del(&itransfer->list);
+			itransfer->stream_sched = NULL;
+			list_add_tail(&itransfer->list, &cancelled);
+			count++;
+		}
+		stream_sched_update_ready(sched, stream);
+	}
+	sched->num_queued = 0;
+	usbi_mutex_unlock(&sched->lock);
+
+	list_for_each_entry_safe(itransfer, tmp, &cancelled, list,
+			struct usbi_transfer) {
+		list_del(&itransfer->list);
+		stream_sched_complete(itransfer, LIBUSB_TRANSFER_CANCELLED);
+	}
+
+	r = cancel_handle_transfers(sched->dev_handle, sched->endpoint, NULL,
+		sched);
+	if (r < 0 && count == 0)
+		return r;
+	return count + (r > 0 ? r : 0);
+}
+
+/** \ingroup asyncio
+ * Retrieve transfer statistics. These are collected all the time, at the
+ * cost of a few relaxed atomic additions and two clock reads per transfer.
+ *
+ * With a NULL dev_handle the statistics of the whole context are returned,
+ * including those of device handles that have already been closed. With a
+ * device handle and an endpoint of -1 the statistics of that handle are
+ * returned, and with an endpoint address those of that endpoint only.
+ * Control transfers are counted on endpoint 0. Synchronous transfers that
+ * the backend performs directly, without going through the asynchronous
+ * interface, are not counted.
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ *
+ * \param ctx the context to operate on, or NULL for the default context.
+ * Ignored if dev_handle is given.
+ * \param dev_handle a device handle, or NULL
+ * \param endpoint an endpoint address of the device handle, or -1
+ * \param stats output location for the statistics
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_INVALID_PARAM if an endpoint is given without a
+ * device handle
+ */
+int API_EXPORTED libusb_get_stats(libusb_context *ctx,
+	libusb_device_handle *dev_handle, int endpoint,
+	struct libusb_stats *stats)
+{
+	struct libusb_device_handle *handle;
+
+	if (!stats || (!dev_handle && endpoint != -1))
+		return LIBUSB_ERROR_INVALID_PARAM;
+	if (endpoint < -1 || endpoint > 0xff)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	memset(stats, 0, sizeof(*stats));
+	if (dev_handle) {
+		if (endpoint == -1)
+			stats_handle(stats, dev_handle);
+		else
+			stats_accumulate(stats, usbi_endpoint_stats(dev_handle,
+				(unsigned char)endpoint));
+		return 0;
+	}
+
+	USBI_GET_CONTEXT(ctx);
+	usbi_mutex_lock(&ctx->open_devs_lock);
+	stats_accumulate(stats, &ctx->closed_stats);
+	list_for_each_entry(handle, &ctx->open_devs, list, struct libusb_device_handle)
+		stats_handle(stats, handle);
+	usbi_mutex_unlock(&ctx->open_devs_lock);
+	return 0;
+}
+
+/* Handle completion of a transfer (completion might be an error condition).
+ * This will invoke the user-supplied callback function, which may end up
+ * freeing the transfer. Therefore you cannot use the transfer structure
  * after calling this function, and you should free all backend-specific
  * data before calling it.
  * Do not call this function with the usbi_transfer lock held. User-specified
@@ -1559,19 +4321,19 @@ int usbi_handle_transfer_completion(struct usbi_transfer *itransfer,
 		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
 	struct libusb_context *ctx = TRANSFER_CTX(transfer);
 	struct libusb_device_handle *handle = transfer->dev_handle;
+	struct libusb_completion_queue *queue;
+	struct libusb_device *dev;
+	struct libusb_stats *stats;
+	uint64_t now;
+	unsigned char endpoint;
 	uint8_t flags;
 	int r = 0;
 
-	/* FIXME: could be more intelligent with the timerfd here. we don't need
-	 * to disarm the timerfd if there was no timer running, and we only need
-	 * to rearm the timerfd if the transfer that expired was the one with
-	 * the shortest timeout. */
-
-	usbi_mutex_lock(&ctx->flying_transfers_lock);
-	list_del(&itransfer->list);
-	if (usbi_using_timerfd(ctx))
-		r = arm_timerfd_for_next_timeout(ctx);
-	usbi_mutex_unlock(&ctx->flying_transfers_lock);
+	/* the timerfd only gets rearmed if this transfer was the one with the
+	 * shortest pending timeout */
+	usbi_mutex_lock(&handle->flying_transfers_lock);
+	r = usbi_remove_from_flying_list(itransfer);
+	usbi_mutex_unlock(&handle->flying_transfers_lock);
 	if (usbi_using_timerfd(ctx) && (r < 0))
 		return r;
 
@@ -1586,17 +4348,68 @@ int usbi_handle_transfer_completion(struct usbi_transfer *itransfer,
 		}
 	}
 
+	stats = usbi_endpoint_stats(handle, transfer->endpoint);
+	switch (status) {
+	case LIBUSB_TRANSFER_COMPLETED:
+		usbi_stats_add(&stats->transfers_completed, 1);
+		usbi_stats_add(&stats->bytes_transferred,
+			(uint64_t)itransfer->transferred);
+		break;
+	case LIBUSB_TRANSFER_CANCELLED:
+		usbi_stats_add(&stats->transfers_cancelled, 1);
+		break;
+	case LIBUSB_TRANSFER_TIMED_OUT:
+		usbi_stats_add(&stats->transfers_timed_out, 1);
+		break;
+	default:
+		usbi_stats_add(&stats->transfers_failed, 1);
+		break;
+	}
+	now = stats_now();
+	usbi_stats_add(&stats->latency_us[stats_latency_bucket(
+		now - itransfer->submit_time)], 1);
+
 	flags = transfer->flags;
+	endpoint = transfer->endpoint;
+	queue = itransfer->completion_queue;
+	dev = handle->dev;
 	transfer->status = status;
 	transfer->actual_length = itransfer->transferred;
-	usbi_dbg("transfer %p has callback %p", transfer, transfer->callback);
-	if (transfer->callback)
-		transfer->callback(transfer);
-	/* transfer might have been freed by the above call, do not use from
-	 * this point. */
-	if (flags & LIBUSB_TRANSFER_FREE_TRANSFER)
+	if (itransfer->stream_sched)
+		stream_sched_completed(itransfer);
+	usbi_trace4(transfer__complete, transfer, endpoint,
+		transfer->actual_length, status);
+	if (queue) {
+		usbi_dbg("transfer %p goes to completion queue %p", transfer, queue);
+		completion_queue_add(queue, itransfer);
+	} else {
+		usbi_dbg("transfer %p has callback %p", transfer,
+			transfer->callback);
+		if (transfer->callback) {
+			unsigned long handles_closed = ctx->handles_closed;
+
+			transfer->callback(transfer);
+			/* the callback may have closed the handle, and with it
+			 * freed stats. its statistics were then folded into
+			 * those of the context, so the time is added there */
+			if (ctx->handles_closed == handles_closed) {
+				usbi_stats_add(&stats->callback_time_us,
+					stats_now() - now);
+			} else {
+				uint64_t elapsed = stats_now() - now;
+
+				usbi_mutex_lock(&ctx->open_devs_lock);
+				ctx->closed_stats.callback_time_us += elapsed;
+				usbi_mutex_unlock(&ctx->open_devs_lock);
+			}
+		}
+		usbi_trace3(callback__return, transfer, endpoint, status);
+	}
+	/* transfer might have been freed by the above call, or by the thread
+	 * that took it from the queue, do not use from this point. */
+	if ((flags & LIBUSB_TRANSFER_FREE_TRANSFER) && !queue)
 		libusb_free_transfer(transfer);
-	libusb_unref_device(handle->dev);
+	libusb_unref_device(dev);
 	return 0;
 }
 
@@ -1640,19 +4453,8 @@ int usbi_handle_transfer_cancellation(struct usbi_transfer *transfer)
 int API_EXPORTED libusb_try_lock_events(libusb_context *ctx)
 {
 	int r;
-	unsigned int ru;
 	USBI_GET_CONTEXT(ctx);
 
-	/* is someone else waiting to close a device? if so, don't let this thread
-	 * start event handling */
-	usbi_mutex_lock(&ctx->event_data_lock);
-	ru = ctx->device_close;
-	usbi_mutex_unlock(&ctx->event_data_lock);
-	if (ru) {
-		usbi_dbg("someone else is closing a device");
-		return 1;
-	}
-
 	r = usbi_mutex_trylock(&ctx->events_lock);
 	if (r)
 		return 1;
@@ -1701,8 +4503,7 @@ void API_EXPORTED libusb_unlock_events(libusb_context *ctx)
 	usbi_mutex_unlock(&ctx->events_lock);
 
 	/* FIXME: perhaps we should be a bit more efficient by not broadcasting
-	 * the availability of the events lock when we are modifying pollfds
-	 * (check ctx->device_close)? */
+	 * the availability of the events lock when nobody is waiting? */
 	usbi_mutex_lock(&ctx->event_waiters_lock);
 	usbi_cond_broadcast(&ctx->event_waiters_cond);
 	usbi_mutex_unlock(&ctx->event_waiters_lock);
@@ -1713,7 +4514,9 @@ void API_EXPORTED libusb_unlock_events(libusb_context *ctx)
  *
  * Sometimes, libusb needs to temporarily pause all event handlers, and this
  * is the function you should use before polling file descriptors to see if
- * this is the case.
+ * this is the case. Since version 1.0.20, closing a device no longer does,
+ * and this function always returns 1, but that may change again in the
+ * future.
  *
  * If this function instructs your thread to give up the events lock, you
  * should just continue the usual logic that is documented in \ref mtasync.
@@ -1731,19 +4534,10 @@ void API_EXPORTED libusb_unlock_events(libusb_context *ctx)
  */
 int API_EXPORTED libusb_event_handling_ok(libusb_context *ctx)
 {
-	unsigned int r;
-	USBI_GET_CONTEXT(ctx);
-
-	/* is someone else waiting to close a device? if so, don't let this thread
-	 * continue event handling */
-	usbi_mutex_lock(&ctx->event_data_lock);
-	r = ctx->device_close;
-	usbi_mutex_unlock(&ctx->event_data_lock);
-	if (r) {
-		usbi_dbg("someone else is closing a device");
-		return 0;
-	}
+	UNUSED(ctx);
 
+	/* device handles being closed are handed to the event handler, see
+	 * libusb_close(), so nothing pauses event handling any more */
 	return 1;
 }
 
@@ -1759,19 +4553,7 @@ int API_EXPORTED libusb_event_handling_ok(libusb_context *ctx)
  */
 int API_EXPORTED libusb_event_handler_active(libusb_context *ctx)
 {
-	unsigned int r;
 	USBI_GET_CONTEXT(ctx);
-
-	/* is someone else waiting to close a device? if so, don't let this thread
-	 * start event handling -- indicate that event handling is happening */
-	usbi_mutex_lock(&ctx->event_data_lock);
-	r = ctx->device_close;
-	usbi_mutex_unlock(&ctx->event_data_lock);
-	if (r) {
-		usbi_dbg("someone else is closing a device");
-		return 1;
-	}
-
 	return ctx->event_handler_active;
 }
 
@@ -1878,14 +4660,65 @@ static void handle_timeout(struct usbi_transfer *itransfer)
 			"async cancel failed %d errno=%d", r, errno);
 }
 
-static int handle_timeouts_locked(struct libusb_context *ctx)
+/* pop the expired transfers off the timeout heap of a device handle and
+ * handle them. a transfer only ever times out once, so it is not put back.
+ * must be called with the handle's flying_transfers_lock held. */
+static int handle_timeouts_for_handle(struct libusb_device_handle *handle,
+	const struct timeval *systime)
+{
+	struct usbi_timeout_node *node;
+
+	while (handle->timeout_heap.len > 0) {
+		node = handle->timeout_heap.nodes[0];
+		if (timeout_before(systime, node->timeout))
+			break;
+
+		timeout_heap_remove(&handle->timeout_heap, node);
+		handle_timeout(TIMEOUT_NODE_TO_TRANSFER(node));
+	}
+	return update_handle_timeout(handle);
+}
+
+/* lock the first device handle found in a heap of handles with an expired
+ * timeout, skipping those whose lock is busy. the handle lock is normally
+ * taken before the lock of the heap, so it can only be tried here. holding
+ * the handle lock once the heap lock is let go keeps the handle from being
+ * closed under our feet, see usbi_io_handle_exit(). must be called with the
+ * lock of the heap held. returns NULL if there is no such handle. */
+static struct libusb_device_handle *lock_expired_handle(
+	struct usbi_timeout_heap *heap, const struct timeval *systime)
+{
+	struct usbi_timeout_node *node;
+	struct libusb_device_handle *handle;
+	unsigned int i;
+
+	for (i = 0; i < heap->len; i++) {
+		node = heap->nodes[i];
+		if (timeout_before(systime, node->timeout))
+			continue;
+
+		handle = TIMEOUT_NODE_TO_HANDLE(node);
+		if (usbi_mutex_trylock(&handle->flying_transfers_lock) == 0)
+			return handle;
+	}
+	return NULL;
+}
+
+/* handle the expired timeouts of all device handles. a handle whose lock is
+ * busy is left for the next pass instead of being waited for; its timeout
+ * stays expired, so the timer fires again right away. */
+static int handle_timeouts(struct libusb_context *ctx)
 {
 	int r;
 	struct timespec systime_ts;
 	struct timeval systime;
-	struct usbi_transfer *transfer;
+	struct libusb_device_handle *handle;
+	USBI_GET_CONTEXT(ctx);
 
-	if (list_empty(&ctx->flying_transfers))
+	usbi_mutex_lock(&ctx->timeouts_lock);
+	r = (ctx->timeout_heap.len == 0);
+	usbi_mutex_unlock(&ctx->timeouts_lock);
+	if (r)
 		return 0;
 
 	/* get current time */
@@ -1895,39 +4728,20 @@ static int handle_timeouts_locked(struct libusb_context *ctx)
 
 	TIMESPEC_TO_TIMEVAL(&systime, &systime_ts);
 
-	/* iterate through flying transfers list, finding all transfers that
-	 * have expired timeouts */
-	list_for_each_entry(transfer, &ctx->flying_transfers, list, struct usbi_transfer) {
-		struct timeval *cur_tv = &transfer->timeout;
-
-		/* if we've reached transfers of infinite timeout, we're all done */
-		if (!timerisset(cur_tv))
-			return 0;
-
-		/* ignore timeouts we've already handled */
-		if (transfer->flags & (USBI_TRANSFER_TIMED_OUT | USBI_TRANSFER_OS_HANDLES_TIMEOUT))
-			continue;
-
-		/* if transfer has non-expired timeout, nothing more to do */
-		if ((cur_tv->tv_sec > systime.tv_sec) ||
-				(cur_tv->tv_sec == systime.tv_sec &&
-					cur_tv->tv_usec > systime.tv_usec))
+	/* every handle handled leaves the heap with no expired timeout, so
+	 * this ends after as many rounds as there are handles */
+	while (1) {
+		usbi_mutex_lock(&ctx->timeouts_lock);
+		handle = lock_expired_handle(&ctx->timeout_heap, &systime);
+		usbi_mutex_unlock(&ctx->timeouts_lock);
+		if (!handle)
 			return 0;
 
-		/* otherwise, we've got an expired timeout to handle */
-		handle_timeout(transfer);
+		r = handle_timeouts_for_handle(handle, &systime);
+		usbi_mutex_unlock(&handle->flying_transfers_lock);
+		if (r < 0)
+			return r;
 	}
-	return 0;
-}
-
-static int handle_timeouts(struct libusb_context *ctx)
-{
-	int r;
-	USBI_GET_CONTEXT(ctx);
-	usbi_mutex_lock(&ctx->flying_transfers_lock);
-	r = handle_timeouts_locked(ctx);
-	usbi_mutex_unlock(&ctx->flying_transfers_lock);
-	return r;
 }
 
 #ifdef USBI_TIMERFD_AVAILABLE
@@ -1935,22 +4749,135 @@ static int handle_timerfd_trigger(struct libusb_context *ctx)
 {
 	int r;
 
-	usbi_mutex_lock(&ctx->flying_transfers_lock);
-
 	/* process the timeout that just happened */
-	r = handle_timeouts_locked(ctx);
+	r = handle_timeouts(ctx);
 	if (r < 0)
-		goto out;
+		return r;
 
-	/* arm for next timeout*/
+	/* arm for next timeout. the expiry is still pending on the timerfd
+	 * and only rearming or disarming it clears that */
+	usbi_mutex_lock(&ctx->timeouts_lock);
+	ctx->timerfd_armed = -1;
 	r = arm_timerfd_for_next_timeout(ctx);
+	usbi_mutex_unlock(&ctx->timeouts_lock);
+	return r;
+}
+#endif
 
-out:
-	usbi_mutex_unlock(&ctx->flying_transfers_lock);
+#ifdef USBI_EPOLL_AVAILABLE
+/* wait on the epoll instance and translate the ready events into the layout
+ * handle_events() expects from poll(): the internal fds keep the first
+ * internal_nfds slots of fds (with revents cleared if they are not ready),
+ * followed by the ready backend fds only, so that the backend never has to
+ * scan fds that have nothing to report. on success nfds is updated to the
+ * number of valid entries and the number of ready fds is returned. */
+static int epoll_wait_fds(struct libusb_context *ctx, struct pollfd *fds,
+	POLL_NFDS_TYPE *nfds, POLL_NFDS_TYPE internal_nfds, int timeout_ms)
+{
+	struct epoll_event *events = ctx->epoll_events;
+	POLL_NFDS_TYPE n = internal_nfds;
+	int r, i;
+
+	r = epoll_wait(ctx->epoll_fd, events, (int)*nfds, timeout_ms);
+	if (r <= 0)
+		return r;
+
+	fds[0].revents = 0;
+	if (internal_nfds > 1)
+		fds[1].revents = 0;
+
+	/* the epoll event bits match the poll ones on Linux */
+	for (i = 0; i < r; i++) {
+		int fd = events[i].data.fd;
+		short revents = (short)events[i].events;
+
+		if (fd == fds[0].fd) {
+			fds[0].revents = revents;
+		} else if (internal_nfds > 1 && fd == fds[1].fd) {
+			fds[1].revents = revents;
+		} else {
+			fds[n].fd = fd;
+			fds[n].revents = revents;
+			n++;
+		}
+	}
+
+	*nfds = n;
 	return r;
 }
 #endif
 
+/* the most handles spun on at once, any others are left to poll() */
+#define BUSY_POLL_MAX_HANDLES	16
+
+/* spin on the busy polled handles of an event domain, or of the context if
+ * domain is NULL, for up to the largest of their budgets but no longer than
+ * tv. the time spent spinning is taken off tv, so that the poll that follows
+ * does not block for longer than the caller asked for overall. returns 1 if
+ * transfers completed, 0 if the budget ran out first, or a LIBUSB_ERROR
+ * code. */
+static int busy_poll(struct libusb_context *ctx,
+	struct libusb_event_domain *domain, struct timeval *tv)
+{
+	struct libusb_device_handle *handles[BUSY_POLL_MAX_HANDLES];
+	struct libusb_device_handle *handle;
+	struct timespec start, now;
+	struct timeval spent;
+	int64_t budget = 0, elapsed;
+	int num_handles = 0, completed = 0;
+	int i, r;
+
+	if (!usbi_backend->busy_poll || !usbi_flags_load(&ctx->busy_poll_handles))
+		return 0;
+
+	/* the handles cannot be closed while we hold the events lock */
+	usbi_mutex_lock(&ctx->open_devs_lock);
+	list_for_each_entry(handle, &ctx->open_devs, list,
+			struct libusb_device_handle) {
+		if (!handle->busy_poll || handle->event_domain != domain)
+			continue;
+		if (handle->busy_poll > budget)
+			budget = handle->busy_poll;
+		handles[num_handles++] = handle;
+		if (num_handles == BUSY_POLL_MAX_HANDLES)
+			break;
+	}
+	usbi_mutex_unlock(&ctx->open_devs_lock);
+
+	if ((int64_t)tv->tv_sec * 1000000 + tv->tv_usec < budget)
+		budget = (int64_t)tv->tv_sec * 1000000 + tv->tv_usec;
+	if (num_handles == 0 || budget <= 0)
+		return 0;
+
+	r = usbi_backend->clock_gettime(USBI_CLOCK_MONOTONIC, &start);
+	if (r < 0)
+		return r;
+
+	do {
+		for (i = 0; i < num_handles; i++) {
+			r = usbi_backend->busy_poll(handles[i]);
+			if (r < 0)
+				return r;
+			completed += r;
+		}
+
+		r = usbi_backend->clock_gettime(USBI_CLOCK_MONOTONIC, &now);
+		if (r < 0)
+			return r;
+		elapsed = (int64_t)(now.tv_sec - start.tv_sec) * 1000000 +
+			(now.tv_nsec - start.tv_nsec) / 1000;
+	} while (!completed && elapsed < budget);
+
+	spent.tv_sec = (long)(elapsed / 1000000);
+	spent.tv_usec = (long)(elapsed % 1000000);
+	if (timercmp(&spent, tv, <))
+		timersub(tv, &spent, tv);
+	else
+		timerclear(tv);
+
+	return completed ? 1 : 0;
+}
+
 /* do the actual event handling. assumes that no other thread is concurrently
  * doing the same thing. */
 static int handle_events(struct libusb_context *ctx, struct timeval *tv)
@@ -1959,10 +4886,14 @@ static int handle_events(struct libusb_context *ctx, struct timeval *tv)
 	struct usbi_pollfd *ipollfd;
 	POLL_NFDS_TYPE nfds = 0;
 	POLL_NFDS_TYPE internal_nfds;
+#ifdef USBI_EPOLL_AVAILABLE
+	POLL_NFDS_TYPE max_nfds;
+#endif
 	struct pollfd *fds = NULL;
 	int i = -1;
 	int timeout_ms;
 	int special_event;
+	int close_queued = 0;
 
 	/* there are certain fds that libusb uses internally, currently:
 	 *
@@ -1999,8 +4930,24 @@ static int handle_events(struct libusb_context *ctx, struct timeval *tv)
 			return LIBUSB_ERROR_NO_MEM;
 		}
 
+#ifdef USBI_EPOLL_AVAILABLE
+		if (usbi_using_epoll(ctx)) {
+			free(ctx->epoll_events);
+			ctx->epoll_events = calloc(ctx->pollfds_cnt,
+				sizeof(*ctx->epoll_events));
+			if (!ctx->epoll_events) {
+				free(ctx->pollfds);
+				ctx->pollfds = NULL;
+				usbi_mutex_unlock(&ctx->pollfds_lock);
+				return LIBUSB_ERROR_NO_MEM;
+			}
+		}
+#endif
+
 		list_for_each_entry(ipollfd, &ctx->ipollfds, list, struct usbi_pollfd) {
 			struct libusb_pollfd *pollfd = &ipollfd->pollfd;
+			if (ipollfd->domain)
+				continue;
 			i++;
 			ctx->pollfds[i].fd = pollfd->fd;
 			ctx->pollfds[i].events = pollfd->events;
@@ -2012,6 +4959,17 @@ static int handle_events(struct libusb_context *ctx, struct timeval *tv)
 	fds = ctx->pollfds;
 	nfds = ctx->pollfds_cnt;
 	usbi_mutex_unlock(&ctx->pollfds_lock);
+#ifdef USBI_EPOLL_AVAILABLE
+	max_nfds = nfds;
+#endif
+
+	/* completions on busy polled handles are picked up without waiting
+	 * for a wakeup. if there were any, the other fds and the timeouts
+	 * are still served, without waiting either. otherwise the poll only
+	 * waits for what is left of tv */
+	r = busy_poll(ctx, NULL, tv);
+	if (r < 0)
+		return r;
 
 	timeout_ms = (int)(tv->tv_sec * 1000) + (tv->tv_usec / 1000);
 
@@ -2019,10 +4977,23 @@ static int handle_events(struct libusb_context *ctx, struct timeval *tv)
 	if (tv->tv_usec % 1000)
 		timeout_ms++;
 
+	if (r > 0)
+		timeout_ms = 0;
+
 redo_poll:
-	usbi_dbg("poll() %d fds with timeout in %dms", nfds, timeout_ms);
-	r = usbi_poll(fds, nfds, timeout_ms);
-	usbi_dbg("poll() returned %d", r);
+#ifdef USBI_EPOLL_AVAILABLE
+	if (usbi_using_epoll(ctx)) {
+		nfds = max_nfds;
+		usbi_dbg("epoll_wait() %d fds with timeout in %dms", nfds, timeout_ms);
+		r = epoll_wait_fds(ctx, fds, &nfds, internal_nfds, timeout_ms);
+		usbi_dbg("epoll_wait() returned %d", r);
+	} else
+#endif
+	{
+		usbi_dbg("poll() %d fds with timeout in %dms", nfds, timeout_ms);
+		r = usbi_poll(fds, nfds, timeout_ms);
+		usbi_dbg("poll() returned %d", r);
+	}
 	if (r == 0)
 		return handle_timeouts(ctx);
 	else if (r == -1 && errno == EINTR)
@@ -2036,7 +5007,7 @@ redo_poll:
 
 	/* fds[0] is always the event pipe */
 	if (fds[0].revents) {
-		libusb_hotplug_message *message = NULL;
+		struct list_head hotplug_msgs;
 
 		usbi_dbg("caught a fish on the event pipe");
 
@@ -2049,34 +5020,35 @@ redo_poll:
 			ctx->fd_notify = 0;
 		}
 
-		/* check if someone is closing a device */
-		if (ctx->device_close)
+		/* check if someone is closing a device. the handles are closed
+		 * after the events of the other devices have been handled */
+		if (!list_empty(&ctx->close_queue)) {
 			usbi_dbg("someone is closing a device");
+			close_queued = 1;
+		}
+
+		/* take all pending hotplug messages, so that a burst of them is
+		 * delivered in one go */
+		list_init(&hotplug_msgs);
+		while (!list_empty(&ctx->hotplug_msgs)) {
+			libusb_hotplug_message *message = list_first_entry(
+				&ctx->hotplug_msgs, libusb_hotplug_message, list);
 
-		/* check for any pending hotplug messages */
-		if (!list_empty(&ctx->hotplug_msgs)) {
 			usbi_dbg("hotplug message received");
 			special_event = 1;
-			message = list_first_entry(&ctx->hotplug_msgs, libusb_hotplug_message, list);
 			list_del(&message->list);
+			list_add_tail(&message->list, &hotplug_msgs);
 		}
 
 		/* if no further pending events, clear the event pipe */
 		if (!usbi_pending_events(ctx))
 			usbi_clear_event(ctx);
 
-		usbi_mutex_unlock(&ctx->event_data_lock);
-
-		/* process the hotplug message, if any */
-		if (message) {
-			usbi_hotplug_match(ctx, message->device, message->event);
-
-			/* the device left, dereference the device */
-			if (LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT == message->event)
-				libusb_unref_device(message->device);
+		usbi_mutex_unlock(&ctx->event_data_lock);
 
-			free(message);
-		}
+		/* process the hotplug messages, if any */
+		if (!list_empty(&hotplug_msgs))
+			usbi_hotplug_process(ctx, &hotplug_msgs);
 
 		if (0 == --r)
 			goto handled;
@@ -2107,6 +5079,13 @@ redo_poll:
 		usbi_err(ctx, "backend handle_events failed with error %d", r);
 
 handled:
+	/* closing the handles invalidates the poll fds, which are only rebuilt
+	 * on the next call */
+	if (close_queued) {
+		usbi_handle_close_queue(ctx);
+		return r;
+	}
+
 	if (r == 0 && special_event) {
 		timeout_ms = 0;
 		goto redo_poll;
@@ -2321,6 +5300,465 @@ int API_EXPORTED libusb_handle_events_locked(libusb_context *ctx,
 	return handle_events(ctx, &poll_timeout);
 }
 
+/* move the poll fd of a device handle between the poll set of its context
+ * (domain NULL) and the poll set of an event domain */
+static void move_pollfd(struct libusb_context *ctx, int fd,
+	struct libusb_event_domain *domain)
+{
+	struct usbi_pollfd *ipollfd;
+	struct libusb_event_domain *old_domain = NULL;
+	int found = 0;
+	short events = 0;
+
+	usbi_mutex_lock(&ctx->pollfds_lock);
+	list_for_each_entry(ipollfd, &ctx->ipollfds, list, struct usbi_pollfd)
+		if (ipollfd->pollfd.fd == fd) {
+			found = 1;
+			break;
+		}
+
+	/* the fd may already be gone if the device was disconnected */
+	if (!found || ipollfd->domain == domain) {
+		usbi_mutex_unlock(&ctx->pollfds_lock);
+		return;
+	}
+
+	old_domain = ipollfd->domain;
+	events = ipollfd->pollfd.events;
+	if (old_domain) {
+		old_domain->pollfds_cnt--;
+		old_domain->pollfds_modified = 1;
+	} else {
+#ifdef USBI_EPOLL_AVAILABLE
+		if (usbi_using_epoll(ctx))
+			epoll_ctl(ctx->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+#endif
+		ctx->pollfds_cnt--;
+		ctx->pollfds_modified = 1;
+	}
+
+	if (domain) {
+		domain->pollfds_cnt++;
+		domain->pollfds_modified = 1;
+	} else {
+#ifdef USBI_EPOLL_AVAILABLE
+		if (usbi_using_epoll(ctx)) {
+			struct epoll_event event;
+
+			memset(&event, 0, sizeof(event));
+			event.events = (uint32_t)events;
+			event.data.fd = fd;
+			/* moving back must not fail, the handle may be closing */
+			if (epoll_ctl(ctx->epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0)
+				usbi_err(ctx, "failed to add fd %d to epoll set (errno %d)",
+					fd, errno);
+		}
+#endif
+		ctx->pollfds_cnt++;
+		ctx->pollfds_modified = 1;
+	}
+	ipollfd->domain = domain;
+	usbi_mutex_unlock(&ctx->pollfds_lock);
+
+	/* as far as applications are concerned, the fd of a handle in an event
+	 * domain is not one of libusb's event sources any more */
+	if (!usbi_using_epoll(ctx)) {
+		if (!old_domain && ctx->fd_removed_cb)
+			ctx->fd_removed_cb(fd, ctx->fd_cb_user_data);
+		else if (!domain && ctx->fd_added_cb)
+			ctx->fd_added_cb(fd, events, ctx->fd_cb_user_data);
+	}
+}
+
+/* take the events lock of a domain, interrupting its event handler */
+static void lock_domain_events(struct libusb_event_domain *domain)
+{
+	if (usbi_write_event_pipe(domain->event_pipe) < 0)
+		usbi_warn(domain->ctx, "failed to interrupt domain event handler");
+	usbi_mutex_lock(&domain->events_lock);
+	if (usbi_read_event_pipe(domain->event_pipe) < 0)
+		usbi_warn(domain->ctx, "failed to clear domain event pipe");
+}
+
+static int add_domain_handle(struct libusb_event_domain *domain,
+	struct libusb_device_handle *dev_handle)
+{
+	if (domain->handles_cnt == domain->handles_size) {
+		unsigned int new_size = domain->handles_size ?
+			2 * domain->handles_size : 4;
+		struct libusb_device_handle **new_handles = realloc(domain->handles,
+			new_size * sizeof(*new_handles));
+
+		if (!new_handles)
+			return LIBUSB_ERROR_NO_MEM;
+		domain->handles = new_handles;
+		domain->handles_size = new_size;
+	}
+	domain->handles[domain->handles_cnt++] = dev_handle;
+	return 0;
+}
+
+static void remove_domain_handle(struct libusb_event_domain *domain,
+	struct libusb_device_handle *dev_handle)
+{
+	unsigned int i;
+
+	for (i = 0; i < domain->handles_cnt; i++)
+		if (domain->handles[i] == dev_handle) {
+			domain->handles[i] = domain->handles[--domain->handles_cnt];
+			return;
+		}
+}
+
+/** \ingroup poll
+ * Allocate an event domain. Device handles can be moved into the domain with
+ * libusb_set_event_domain(), after which their events are no longer handled
+ * by the event handling functions of the context, but by
+ * libusb_handle_domain_events_timeout_completed() on the domain. Events of
+ * different domains can be handled concurrently from different threads.
+ *
+ * The domain should be freed with libusb_free_event_domain() before the
+ * context is destroyed.
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \returns a newly allocated event domain, or NULL on error
+ * \see \ref eventdomains
+ */
+DEFAULT_VISIBILITY
+struct libusb_event_domain * LIBUSB_CALL libusb_alloc_event_domain(
+	libusb_context *ctx)
+{
+	struct libusb_event_domain *domain;
+	USBI_GET_CONTEXT(ctx);
+
+	domain = calloc(1, sizeof(*domain));
+	if (!domain)
+		return NULL;
+
+	domain->ctx = ctx;
+	domain->pollfds_modified = 1;
+	if (usbi_mutex_init(&domain->events_lock, NULL)) {
+		free(domain);
+		return NULL;
+	}
+	if (usbi_mutex_init(&domain->timeouts_lock, NULL)) {
+		usbi_mutex_destroy(&domain->events_lock);
+		free(domain);
+		return NULL;
+	}
+	if (usbi_create_event_pipe(domain->event_pipe) < 0) {
+		usbi_mutex_destroy(&domain->timeouts_lock);
+		usbi_mutex_destroy(&domain->events_lock);
+		free(domain);
+		return NULL;
+	}
+	return domain;
+}
+
+/** \ingroup poll
+ * Free an event domain. Any device handles left in the domain are moved back
+ * to the context it was allocated for. No thread may be handling the events
+ * of the domain any more.
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ *
+ * \param domain the domain to free. If NULL then this function will do
+ * nothing.
+ */
+void API_EXPORTED libusb_free_event_domain(struct libusb_event_domain *domain)
+{
+	if (!domain)
+		return;
+
+	while (domain->handles_cnt) {
+		struct libusb_device_handle *dev_handle = domain->handles[0];
+
+		if (libusb_set_event_domain(dev_handle, NULL) < 0) {
+			usbi_warn(domain->ctx, "failed to move handle %p out of event domain",
+				dev_handle);
+			remove_domain_handle(domain, dev_handle);
+			dev_handle->event_domain = NULL;
+		}
+	}
+
+	usbi_close_event_pipe(domain->event_pipe);
+	usbi_mutex_destroy(&domain->timeouts_lock);
+	usbi_mutex_destroy(&domain->events_lock);
+	free(domain->timeout_heap.nodes);
+	free(domain->handles);
+	free(domain->pollfds);
+	free(domain);
+}
+
+/** \ingroup poll
+ * Move a device handle into an event domain, or back to its context.
+ *
+ * This interrupts the event handlers of the context and of the domains
+ * involved, and waits for them to let go of the handle. Do not call it from
+ * within the event handler of one of the domains involved.
+ *
+ * Closing a device handle moves it back to its context automatically.
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ *
+ * \param dev_handle a device handle
+ * \param domain the domain to move the handle into, which must belong to the
+ * context of the handle, or NULL to move it back to the context
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_INVALID_PARAM if the domain belongs to another context
+ * \returns LIBUSB_ERROR_NOT_SUPPORTED if the platform cannot handle the
+ * events of a device handle separately
+ * \returns another LIBUSB_ERROR code on other failure
+ * \see \ref eventdomains
+ */
+int API_EXPORTED libusb_set_event_domain(libusb_device_handle *dev_handle,
+	struct libusb_event_domain *domain)
+{
+	struct libusb_context *ctx = HANDLE_CTX(dev_handle);
+	struct libusb_event_domain *old_domain = dev_handle->event_domain;
+	struct libusb_pollfd pollfd;
+	int r;
+
+	if (domain && domain->ctx != ctx)
+		return LIBUSB_ERROR_INVALID_PARAM;
+	if (old_domain == domain)
+		return 0;
+	if (!usbi_backend->get_pollfd)
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+
+	r = usbi_backend->get_pollfd(dev_handle, &pollfd);
+	if (r < 0)
+		return r;
+
+	/* stop everybody who may currently be handling events for this handle,
+	 * and prevent the handle from moving twice at the same time. the events
+	 * lock of the context is always taken first, then the ones of the
+	 * domains in address order. */
+	usbi_fd_notification(ctx);
+	libusb_lock_events(ctx);
+	if (old_domain && (!domain || (uintptr_t)old_domain < (uintptr_t)domain))
+		lock_domain_events(old_domain);
+	if (domain)
+		lock_domain_events(domain);
+	if (old_domain && domain && (uintptr_t)old_domain > (uintptr_t)domain)
+		lock_domain_events(old_domain);
+
+	if (domain) {
+		r = add_domain_handle(domain, dev_handle);
+		if (r < 0)
+			goto out;
+	}
+
+	move_pollfd(ctx, pollfd.fd, domain);
+	if (old_domain)
+		remove_domain_handle(old_domain, dev_handle);
+
+	/* the timeouts of the handle go with it */
+	usbi_mutex_lock(&dev_handle->flying_transfers_lock);
+	remove_handle_node(dev_handle);
+	dev_handle->event_domain = domain;
+	if (update_handle_timeout(dev_handle) < 0)
+		usbi_warn(ctx, "failed to move the timeouts of handle %p",
+			dev_handle);
+	usbi_mutex_unlock(&dev_handle->flying_transfers_lock);
+	usbi_dbg("handle %p moved to event domain %p", dev_handle, domain);
+
+out:
+	if (domain)
+		usbi_mutex_unlock(&domain->events_lock);
+	if (old_domain)
+		usbi_mutex_unlock(&old_domain->events_lock);
+	libusb_unlock_events(ctx);
+	return r;
+}
+
+/* do the actual event handling for a domain, with its events lock held */
+static int handle_domain_events(struct libusb_event_domain *domain,
+	struct timeval *tv)
+{
+	struct libusb_context *ctx = domain->ctx;
+	struct timespec systime_ts;
+	struct timeval systime;
+	struct timeval next_timeout;
+	struct timeval poll_timeout = *tv;
+	struct usbi_pollfd *ipollfd;
+	struct pollfd *fds;
+	POLL_NFDS_TYPE nfds;
+	int timeout_ms;
+	int r;
+
+	usbi_mutex_lock(&ctx->pollfds_lock);
+	if (domain->pollfds_modified) {
+		POLL_NFDS_TYPE n = 1;
+
+		free(domain->pollfds);
+		domain->pollfds = calloc(domain->pollfds_cnt + 1,
+			sizeof(*domain->pollfds));
+		if (!domain->pollfds) {
+			usbi_mutex_unlock(&ctx->pollfds_lock);
+			return LIBUSB_ERROR_NO_MEM;
+		}
+
+		domain->pollfds[0].fd = domain->event_pipe[0];
+		domain->pollfds[0].events = POLLIN;
+		list_for_each_entry(ipollfd, &ctx->ipollfds, list, struct usbi_pollfd) {
+			if (ipollfd->domain != domain)
+				continue;
+			domain->pollfds[n].fd = ipollfd->pollfd.fd;
+			domain->pollfds[n].events = ipollfd->pollfd.events;
+			n++;
+		}
+		domain->pollfds_modified = 0;
+	}
+	fds = domain->pollfds;
+	nfds = domain->pollfds_cnt + 1;
+	usbi_mutex_unlock(&ctx->pollfds_lock);
+
+	r = usbi_backend->clock_gettime(USBI_CLOCK_MONOTONIC, &systime_ts);
+	if (r < 0)
+		return r;
+	TIMESPEC_TO_TIMEVAL(&systime, &systime_ts);
+
+	/* wake up in time for the next timeout of the handles in the domain */
+	usbi_mutex_lock(&domain->timeouts_lock);
+	if (domain->timeout_heap.len > 0) {
+		const struct timeval *cur_tv = domain->timeout_heap.nodes[0]->timeout;
+
+		if (!timercmp(&systime, cur_tv, <)) {
+			timerclear(&poll_timeout);
+		} else {
+			timersub(cur_tv, &systime, &next_timeout);
+			if (timercmp(&next_timeout, &poll_timeout, <))
+				poll_timeout = next_timeout;
+		}
+	}
+	usbi_mutex_unlock(&domain->timeouts_lock);
+
+	r = busy_poll(ctx, domain, &poll_timeout);
+	if (r < 0)
+		return r;
+
+	timeout_ms = (int)(poll_timeout.tv_sec * 1000) + (poll_timeout.tv_usec / 1000);
+
+	/* round up to next millisecond */
+	if (poll_timeout.tv_usec % 1000)
+		timeout_ms++;
+
+	if (r > 0)
+		timeout_ms = 0;
+
+	usbi_dbg("poll() %d domain fds with timeout in %dms", nfds, timeout_ms);
+	r = usbi_poll(fds, nfds, timeout_ms);
+	usbi_dbg("poll() returned %d", r);
+	if (r == -1 && errno == EINTR)
+		return LIBUSB_ERROR_INTERRUPTED;
+	else if (r < 0) {
+		usbi_err(ctx, "poll failed %d err=%d\n", r, errno);
+		return LIBUSB_ERROR_IO;
+	}
+
+	/* somebody wants the events lock, let them have it */
+	if (fds[0].revents) {
+		usbi_dbg("domain event handler interrupted");
+		return 0;
+	}
+
+	if (r > 0) {
+		r = usbi_backend->handle_events(ctx, fds + 1, nfds - 1, r);
+		if (r) {
+			usbi_err(ctx, "backend handle_events failed with error %d", r);
+			return r;
+		}
+	}
+
+	r = usbi_backend->clock_gettime(USBI_CLOCK_MONOTONIC, &systime_ts);
+	if (r < 0)
+		return r;
+	TIMESPEC_TO_TIMEVAL(&systime, &systime_ts);
+
+	/* as in handle_timeouts(), but on the heap of the domain */
+	while (1) {
+		struct libusb_device_handle *handle;
+
+		usbi_mutex_lock(&domain->timeouts_lock);
+		handle = lock_expired_handle(&domain->timeout_heap, &systime);
+		usbi_mutex_unlock(&domain->timeouts_lock);
+		if (!handle)
+			return 0;
+
+		r = handle_timeouts_for_handle(handle, &systime);
+		usbi_mutex_unlock(&handle->flying_transfers_lock);
+		if (r < 0)
+			return r;
+	}
+}
+
+/** \ingroup poll
+ * Handle any pending events of the device handles in an event domain.
+ *
+ * This works like libusb_handle_events_timeout_completed(), except that only
+ * the events of the handles in the domain are handled, and that the events
+ * of different domains can be handled concurrently. The event handling
+ * functions of the context take care of hotplug events and of all device
+ * handles that are not in a domain.
+ *
+ * If another thread is already handling the events of this domain, this
+ * function waits for it to handle an event instead.
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ *
+ * \param domain the event domain to handle events for
+ * \param tv the maximum time to block waiting for events, or an all zero
+ * timeval struct for non-blocking mode. NULL blocks for up to 60 seconds.
+ * \param completed pointer to completion integer to check, or NULL
+ * \returns 0 on success, or a LIBUSB_ERROR code on failure
+ * \see \ref eventdomains
+ */
+int API_EXPORTED libusb_handle_domain_events_timeout_completed(
+	struct libusb_event_domain *domain, struct timeval *tv, int *completed)
+{
+	struct libusb_context *ctx = domain->ctx;
+	struct timeval default_tv = { 60, 0 };
+	int r = 0;
+
+	if (!tv)
+		tv = &default_tv;
+
+retry:
+	if (usbi_mutex_trylock(&domain->events_lock) == 0) {
+		usbi_mutex_lock(&ctx->event_waiters_lock);
+		domain->event_handler_active = 1;
+		usbi_mutex_unlock(&ctx->event_waiters_lock);
+
+		if (completed == NULL || !*completed)
+			r = handle_domain_events(domain, tv);
+
+		/* wake up threads waiting for this domain, see
+		 * libusb_unlock_events() */
+		usbi_mutex_lock(&ctx->event_waiters_lock);
+		domain->event_handler_active = 0;
+		usbi_mutex_unlock(&domain->events_lock);
+		usbi_cond_broadcast(&ctx->event_waiters_cond);
+		usbi_mutex_unlock(&ctx->event_waiters_lock);
+		return r;
+	}
+
+	/* another thread is handling the events of this domain */
+	libusb_lock_event_waiters(ctx);
+	if (completed && *completed)
+		goto already_done;
+	if (!domain->event_handler_active) {
+		libusb_unlock_event_waiters(ctx);
+		goto retry;
+	}
+	r = libusb_wait_for_event(ctx, tv);
+already_done:
+	libusb_unlock_event_waiters(ctx);
+	return r < 0 ? r : 0;
+}
+
 /** \ingroup poll
  * Determines whether your application must apply special timing considerations
  * when monitoring libusb's file descriptors.
@@ -2391,44 +5829,25 @@ int API_EXPORTED libusb_pollfds_handle_timeouts(libusb_context *ctx)
 int API_EXPORTED libusb_get_next_timeout(libusb_context *ctx,
 	struct timeval *tv)
 {
-	struct usbi_transfer *transfer;
 	struct timespec cur_ts;
 	struct timeval cur_tv;
-	struct timeval *next_timeout;
+	struct timeval next_timeout;
 	int r;
-	int found = 0;
 
 	USBI_GET_CONTEXT(ctx);
 	if (usbi_using_timerfd(ctx))
 		return 0;
 
-	usbi_mutex_lock(&ctx->flying_transfers_lock);
-	if (list_empty(&ctx->flying_transfers)) {
-		usbi_mutex_unlock(&ctx->flying_transfers_lock);
-		usbi_dbg("no URBs, no timeout!");
-		return 0;
-	}
-
-	/* find next transfer which hasn't already been processed as timed out */
-	list_for_each_entry(transfer, &ctx->flying_transfers, list, struct usbi_transfer) {
-		if (transfer->flags & (USBI_TRANSFER_TIMED_OUT | USBI_TRANSFER_OS_HANDLES_TIMEOUT))
-			continue;
-
-		/* no timeout for this transfer? */
-		if (!timerisset(&transfer->timeout))
-			continue;
-
-		found = 1;
-		break;
-	}
-	usbi_mutex_unlock(&ctx->flying_transfers_lock);
-
-	if (!found) {
+	/* the next transfer to time out, if any, belongs to the handle at the
+	 * top of the heap */
+	usbi_mutex_lock(&ctx->timeouts_lock);
+	if (ctx->timeout_heap.len == 0) {
+		usbi_mutex_unlock(&ctx->timeouts_lock);
 		usbi_dbg("no URB with timeout or all handled by OS; no timeout!");
 		return 0;
 	}
-
-	next_timeout = &transfer->timeout;
+	round_timeout(ctx, ctx->timeout_heap.nodes[0]->timeout, &next_timeout);
+	usbi_mutex_unlock(&ctx->timeouts_lock);
 
 	r = usbi_backend->clock_gettime(USBI_CLOCK_MONOTONIC, &cur_ts);
 	if (r < 0) {
@@ -2437,17 +5856,104 @@ int API_EXPORTED libusb_get_next_timeout(libusb_context *ctx,
 	}
 	TIMESPEC_TO_TIMEVAL(&cur_tv, &cur_ts);
 
-	if (!timercmp(&cur_tv, next_timeout, <)) {
+	if (!timercmp(&cur_tv, &next_timeout, <)) {
 		usbi_dbg("first timeout already expired");
 		timerclear(tv);
 	} else {
-		timersub(next_timeout, &cur_tv, tv);
+		timersub(&next_timeout, &cur_tv, tv);
 		usbi_dbg("next timeout in %d.%06ds", tv->tv_sec, tv->tv_usec);
 	}
 
 	return 1;
 }
 
+/** \ingroup poll
+ * Set the granularity of transfer timeouts. The deadline of the next
+ * transfer to time out is rounded up to a multiple of granularity
+ * milliseconds on the monotonic clock before libusb arms its timer for it, or
+ * reports it through libusb_get_next_timeout(). Transfers whose deadlines
+ * fall into the same interval then share one timer expiry, so that the timer
+ * needs to be rearmed only when the earliest interval changes rather than on
+ * nearly every submission and completion.
+ *
+ * Timeouts are never reported early: a transfer times out up to granularity
+ * milliseconds after its timeout, but not before. The default of 0 keeps
+ * timeouts exact.
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \param granularity the granularity in milliseconds, e.g. 1, 5 or 10, at
+ * most 1000, or 0 for exact timeouts
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_INVALID_PARAM if granularity is out of range
+ */
+int API_EXPORTED libusb_set_timeout_granularity(libusb_context *ctx,
+	unsigned int granularity)
+{
+	USBI_GET_CONTEXT(ctx);
+	if (granularity > 1000)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	usbi_dbg("granularity %ums", granularity);
+	usbi_mutex_lock(&ctx->timeouts_lock);
+	ctx->timeout_granularity = granularity * 1000;
+#ifdef USBI_TIMERFD_AVAILABLE
+	if (usbi_using_timerfd(ctx)) {
+		/* rearm from scratch for the new rounding */
+		ctx->timerfd_armed = -1;
+		if (arm_timerfd_for_next_timeout(ctx) < 0)
+			usbi_warn(ctx, "failed to arm timerfd (errno %d)", errno);
+	}
+#endif
+	usbi_mutex_unlock(&ctx->timeouts_lock);
+	return 0;
+}
+
+/** \ingroup poll
+ * Make the event handler busy poll a device handle. Before blocking in
+ * poll(), the thread handling events of the handle then spins for up to
+ * budget microseconds reaping completed transfers of the handle directly,
+ * much like busy polling of network sockets. A transfer that completes
+ * meanwhile is handed back without the latency of a wakeup from poll() and
+ * the scheduler, at the cost of a CPU kept busy for the budget.
+ *
+ * This is meant for latency critical transfers on a few handles, ideally
+ * in an event domain of their own (see libusb_alloc_event_domain()) with its
+ * own event handling thread; other events of the context are only noticed
+ * once the budget runs out. The spin never outlasts the timeout given to the
+ * event handling function, and all transfers of the handle are reaped, not
+ * only those of particular endpoints.
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ *
+ * \param dev_handle a device handle
+ * \param budget the time to spin in microseconds, at most 1000000, or 0 to
+ * turn busy polling off
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_INVALID_PARAM if budget is out of range
+ * \returns LIBUSB_ERROR_NOT_SUPPORTED if the platform cannot busy poll
+ */
+int API_EXPORTED libusb_set_busy_poll(libusb_device_handle *dev_handle,
+	unsigned int budget)
+{
+	struct libusb_context *ctx = HANDLE_CTX(dev_handle);
+
+	if (!usbi_backend->busy_poll)
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+	if (budget > 1000000)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	usbi_dbg("budget %uus", budget);
+	usbi_mutex_lock(&ctx->open_devs_lock);
+	if (!dev_handle->busy_poll != !budget)
+		usbi_flags_store(&ctx->busy_poll_handles,
+			ctx->busy_poll_handles + (budget ? 1 : -1));
+	dev_handle->busy_poll = budget;
+	usbi_mutex_unlock(&ctx->open_devs_lock);
+	return 0;
+}
+
 /** \ingroup poll
  * Register notification functions for file descriptor additions/removals.
  * These functions will be invoked for every new or removed file descriptor
@@ -2491,13 +5997,31 @@ int usbi_add_pollfd(struct libusb_context *ctx, int fd, short events)
 	usbi_dbg("add fd %d events %d", fd, events);
 	ipollfd->pollfd.fd = fd;
 	ipollfd->pollfd.events = events;
+	ipollfd->domain = NULL;
 	usbi_mutex_lock(&ctx->pollfds_lock);
+#ifdef USBI_EPOLL_AVAILABLE
+	if (usbi_using_epoll(ctx)) {
+		struct epoll_event event;
+
+		memset(&event, 0, sizeof(event));
+		event.events = (uint32_t)events;
+		event.data.fd = fd;
+		if (epoll_ctl(ctx->epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+			usbi_err(ctx, "failed to add fd %d to epoll set (errno %d)",
+				fd, errno);
+			usbi_mutex_unlock(&ctx->pollfds_lock);
+			free(ipollfd);
+			return LIBUSB_ERROR_OTHER;
+		}
+	}
+#endif
 	list_add_tail(&ipollfd->list, &ctx->ipollfds);
 	ctx->pollfds_cnt++;
 	ctx->pollfds_modified = 1;
 	usbi_mutex_unlock(&ctx->pollfds_lock);
 
-	if (ctx->fd_added_cb)
+	/* applications only ever see the epoll fd, which never changes */
+	if (ctx->fd_added_cb && !usbi_using_epoll(ctx))
 		ctx->fd_added_cb(fd, events, ctx->fd_cb_user_data);
 	return 0;
 }
@@ -2506,6 +6030,7 @@ int usbi_add_pollfd(struct libusb_context *ctx, int fd, short events)
 void usbi_remove_pollfd(struct libusb_context *ctx, int fd)
 {
 	struct usbi_pollfd *ipollfd;
+	struct libusb_event_domain *domain;
 	int found = 0;
 
 	usbi_dbg("remove fd %d", fd);
@@ -2523,11 +6048,25 @@ void usbi_remove_pollfd(struct libusb_context *ctx, int fd)
 	}
 
 	list_del(&ipollfd->list);
+
+	/* fds of handles in an event domain are only known to the domain */
+	domain = ipollfd->domain;
+	free(ipollfd);
+	if (domain) {
+		domain->pollfds_cnt--;
+		domain->pollfds_modified = 1;
+		usbi_mutex_unlock(&ctx->pollfds_lock);
+		return;
+	}
+
+#ifdef USBI_EPOLL_AVAILABLE
+	if (usbi_using_epoll(ctx))
+		epoll_ctl(ctx->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+#endif
 	ctx->pollfds_cnt--;
 	ctx->pollfds_modified = 1;
 	usbi_mutex_unlock(&ctx->pollfds_lock);
-	free(ipollfd);
-	if (ctx->fd_removed_cb)
+	if (ctx->fd_removed_cb && !usbi_using_epoll(ctx))
 		ctx->fd_removed_cb(fd, ctx->fd_cb_user_data);
 }
 
@@ -2541,6 +6080,10 @@ void usbi_remove_pollfd(struct libusb_context *ctx, int fd)
  * As file descriptors are a Unix-specific concept, this function is not
  * available on Windows and will always return NULL.
  *
+ * On Linux builds using epoll for event handling, the list contains a single
+ * epoll file descriptor that becomes readable whenever any of libusb's
+ * internal event sources is ready.
+ *
  * \param ctx the context to operate on, or NULL for the default context
  * \returns a NULL-terminated list of libusb_pollfd structures
  * \returns NULL on error
@@ -2556,6 +6099,15 @@ const struct libusb_pollfd ** LIBUSB_CALL libusb_get_pollfds(
 	size_t i = 0;
 	USBI_GET_CONTEXT(ctx);
 
+#ifdef USBI_EPOLL_AVAILABLE
+	if (usbi_using_epoll(ctx)) {
+		ret = calloc(2, sizeof(struct libusb_pollfd *));
+		if (ret)
+			ret[0] = &ctx->epoll_pollfd;
+		return (const struct libusb_pollfd **) ret;
+	}
+#endif
+
 	usbi_mutex_lock(&ctx->pollfds_lock);
 
 	ret = calloc(ctx->pollfds_cnt + 1, sizeof(struct libusb_pollfd *));
@@ -2563,7 +6115,8 @@ const struct libusb_pollfd ** LIBUSB_CALL libusb_get_pollfds(
 		goto out;
 
 	list_for_each_entry(ipollfd, &ctx->ipollfds, list, struct usbi_pollfd)
-		ret[i++] = (struct libusb_pollfd *) ipollfd;
+		if (!ipollfd->domain)
+			ret[i++] = (struct libusb_pollfd *) ipollfd;
 	ret[ctx->pollfds_cnt] = NULL;
 
 out:
@@ -2578,11 +6131,11 @@ out:
 
 /* Backends may call this from handle_events to report disconnection of a
  * device. This function ensures transfers get cancelled appropriately.
- * Callers of this function must hold the events_lock.
+ * Callers of this function must hold the events_lock, or the events lock of
+ * the event domain the handle is in.
  */
 void usbi_handle_disconnect(struct libusb_device_handle *handle)
 {
-	struct usbi_transfer *cur;
 	struct usbi_transfer *to_cancel;
 
 	usbi_dbg("device %d.%d",
@@ -2612,14 +6165,12 @@ void usbi_handle_disconnect(struct libusb_device_handle *handle)
 	 */
 
 	while (1) {
-		usbi_mutex_lock(&HANDLE_CTX(handle)->flying_transfers_lock);
+		usbi_mutex_lock(&handle->flying_transfers_lock);
 		to_cancel = NULL;
-		list_for_each_entry(cur, &HANDLE_CTX(handle)->flying_transfers, list, struct usbi_transfer)
-			if (USBI_TRANSFER_TO_LIBUSB_TRANSFER(cur)->dev_handle == handle) {
-				to_cancel = cur;
-				break;
-			}
-		usbi_mutex_unlock(&HANDLE_CTX(handle)->flying_transfers_lock);
+		if (!list_empty(&handle->flying_transfers))
+			to_cancel = list_first_entry(&handle->flying_transfers,
+				struct usbi_transfer, list);
+		usbi_mutex_unlock(&handle->flying_transfers_lock);
 
 		if (!to_cancel)
 			break;
@@ -46,6 +46,7 @@
 typedef unsigned __int8   uint8_t;
 typedef unsigned __int16  uint16_t;
 typedef unsigned __int32  uint32_t;
+typedef unsigned __int64  uint64_t;
 #else
 #include <stdint.h>
 #endif
@@ -144,7 +145,7 @@ typedef unsigned __int32  uint32_t;
  * Internally, LIBUSB_API_VERSION is defined as follows:
  * (libusb major << 24) | (libusb minor << 16) | (16 bit incremental)
  */
-#define LIBUSB_API_VERSION 0x01000103
+#define LIBUSB_API_VERSION 0x01000104
 
 /* The following is kept for compatibility, but will be deprecated in the future */
 #define LIBUSBX_API_VERSION LIBUSB_API_VERSION
@@ -971,6 +972,68 @@ typedef struct libusb_device libusb_device;
  */
 typedef struct libusb_device_handle libusb_device_handle;
 
+/** \ingroup dev
+ * Wildcard value for the integer fields of \ref libusb_device_filter.
+ */
+#define LIBUSB_DEVICE_FILTER_ANY -1
+
+/** \ingroup dev
+ * Criteria for libusb_get_device_list_filtered(). A device matches the
+ * filter if it matches all of the fields that are not wildcards.
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ */
+struct libusb_device_filter {
+	/** Vendor ID to match, or \ref LIBUSB_DEVICE_FILTER_ANY */
+	int vendor_id;
+
+	/** Product ID to match, or \ref LIBUSB_DEVICE_FILTER_ANY */
+	int product_id;
+
+	/** Device class (bDeviceClass) to match, or
+	 * \ref LIBUSB_DEVICE_FILTER_ANY */
+	int dev_class;
+
+	/** Bus number to match, or \ref LIBUSB_DEVICE_FILTER_ANY */
+	int bus_number;
+
+	/** Port numbers from the root hub down to the device, as returned by
+	 * libusb_get_port_numbers(). Only devices at exactly this position in
+	 * the topology match. Ignored if port_numbers_len is 0. */
+	const uint8_t *port_numbers;
+
+	/** Number of elements in port_numbers */
+	int port_numbers_len;
+};
+
+/** \ingroup dev
+ * Per-endpoint performance policies, for use with
+ * libusb_set_endpoint_policy() and libusb_get_endpoint_policy(). Which
+ * policies are available depends on the platform and on the driver bound to
+ * the interface the endpoint belongs to; currently only the WinUSB and
+ * libusbK drivers on Windows support them.
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ */
+enum libusb_endpoint_policy {
+	/** Bypass the driver's internal request queue and pass transfers
+	 * straight to the host controller (boolean). This greatly improves the
+	 * throughput of bulk and interrupt IN endpoints that always have
+	 * several transfers in flight, but every transfer length must then be
+	 * a multiple of the endpoint's maximum packet size and must not exceed
+	 * \ref LIBUSB_ENDPOINT_POLICY_MAX_TRANSFER_SIZE. */
+	LIBUSB_ENDPOINT_POLICY_RAW_IO = 0,
+
+	/** Discard any data left over from a short IN packet once a transfer
+	 * has been filled, rather than returning it in the next transfer
+	 * (boolean). */
+	LIBUSB_ENDPOINT_POLICY_AUTO_FLUSH = 1,
+
+	/** The largest transfer, in bytes, that the driver hands to the host
+	 * controller in a single request. Read only. */
+	LIBUSB_ENDPOINT_POLICY_MAX_TRANSFER_SIZE = 2,
+};
+
 /** \ingroup dev
  * Speed codes. Indicates the speed at which the device is operating.
  */
@@ -1172,6 +1235,52 @@ enum libusb_transfer_flags {
 	 * Available since libusb-1.0.9.
 	 */
 	LIBUSB_TRANSFER_ADD_ZERO_PACKET = 1 << 3,
+
+	/** Submit isochronous transfers through the platform's low latency
+	 * path, if it has one. On Darwin this uses IOKit's low latency
+	 * isochronous API, with data and frame list buffers that are allocated
+	 * on first submission and reused while the transfer is resubmitted on
+	 * the same interface.
+	 *
+	 * This flag only affects isochronous transfers. It is currently only
+	 * acted upon on Darwin and is ignored on other systems.
+	 *
+	 * Available since libusb-1.0.20.
+	 */
+	LIBUSB_TRANSFER_LOW_LATENCY = 1 << 4,
+
+	/** Invoke the transfer callback directly from the thread on which the
+	 * platform reports the completion, rather than from the thread
+	 * handling libusb events. This saves a round trip through the event
+	 * loop, at the cost of the callback running concurrently with
+	 * libusb_handle_events() and with the rest of the application. The
+	 * callback must not close the device handle. A thread waiting in
+	 * libusb_handle_events_completed() is still woken up after the
+	 * callback has run.
+	 *
+	 * This flag is currently only acted upon on Darwin, where callbacks
+	 * then run on the CFRunLoop thread that services the device. It is
+	 * ignored on other systems.
+	 *
+	 * Available since libusb-1.0.20.
+	 */
+	LIBUSB_TRANSFER_DIRECT_COMPLETION = 1 << 5,
+
+	/** The first byte of the transfer buffer is reserved for the HID
+	 * report ID, and the length of the transfer includes it. On output
+	 * the application stores the report ID there, or 0 if the device does
+	 * not use report IDs. On input the report ID is returned there and
+	 * is counted in the actual length. This lets the platform read or
+	 * write the report directly in the transfer buffer instead of going
+	 * through a staging buffer.
+	 *
+	 * This flag only affects interrupt transfers to HID devices. It is
+	 * currently only acted upon on Windows, for devices handled by the
+	 * HID driver, and is ignored on other systems.
+	 *
+	 * Available since libusb-1.0.20.
+	 */
+	LIBUSB_TRANSFER_HID_REPORT_ID = 1 << 6,
 };
 
 /** \ingroup asyncio
@@ -1187,6 +1296,20 @@ struct libusb_iso_packet_descriptor {
 	enum libusb_transfer_status status;
 };
 
+/** \ingroup asyncio
+ * A fragment of the data of a vectored bulk or interrupt transfer, see
+ * libusb_fill_bulk_transfer_iov().
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ */
+struct libusb_iovec {
+	/** Start of the fragment */
+	unsigned char *buffer;
+
+	/** Length of the fragment in bytes */
+	int length;
+};
+
 struct libusb_transfer;
 
 /** \ingroup asyncio
@@ -1264,6 +1387,85 @@ struct libusb_transfer {
 	;
 };
 
+/** \ingroup asyncio
+ * Structure representing a pool of preallocated transfers for one endpoint.
+ * This is an opaque type; see libusb_alloc_transfer_pool().
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ */
+struct libusb_transfer_pool;
+
+/** \ingroup asyncio
+ * Structure representing a continuous isochronous stream from one endpoint.
+ * This is an opaque type; see libusb_alloc_iso_stream().
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ */
+struct libusb_iso_stream;
+
+/** \ingroup asyncio
+ * A packet received by an isochronous stream, as returned by
+ * libusb_iso_stream_read().
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ */
+struct libusb_iso_stream_packet {
+	/** The packet data, valid until the packet is released with
+	 * libusb_iso_stream_release() */
+	unsigned char *data;
+
+	/** Amount of data that was received */
+	unsigned int length;
+
+	/** Status code for the packet */
+	enum libusb_transfer_status status;
+};
+
+/** \ingroup asyncio
+ * Structure representing a bulk stream, a set of transfers kept in flight
+ * on one bulk endpoint. This is an opaque type; see
+ * libusb_alloc_bulk_stream(). Not to be confused with the USB 3.0 bulk
+ * streams of libusb_alloc_streams().
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ */
+struct libusb_bulk_stream;
+
+/** \ingroup asyncio
+ * Bulk stream callback function type, for streams in push mode. Called
+ * from the event handler with the data of a completed IN transfer, or with
+ * an OUT buffer to fill.
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ *
+ * \param buffer the transfer buffer
+ * \param length the number of bytes received for an IN stream, or the
+ * size of the buffer for an OUT stream
+ * \param user_data the user data passed to libusb_alloc_bulk_stream()
+ * \returns 0 for an IN stream, or the number of bytes to send for an OUT
+ * stream, to carry on. A negative value stops the stream.
+ */
+typedef int (LIBUSB_CALL *libusb_bulk_stream_cb_fn)(unsigned char *buffer,
+	int length, void *user_data);
+
+/** \ingroup asyncio
+ * Structure representing a completion queue, to which completed transfers
+ * are delivered instead of invoking their callbacks. This is an opaque type;
+ * see libusb_alloc_completion_queue().
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ */
+struct libusb_completion_queue;
+
+/** \ingroup asyncio
+ * Structure representing a stream scheduler, which queues and submits the
+ * transfers of the USB 3.0 bulk streams of an endpoint. This is an opaque
+ * type; see libusb_alloc_stream_scheduler().
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ */
+struct libusb_stream_scheduler;
+
 /** \ingroup misc
  * Capabilities supported by an instance of libusb on the current running
  * platform. Test if the loaded library supports a given capability by calling
@@ -1302,9 +1504,58 @@ enum libusb_log_level {
 	LIBUSB_LOG_LEVEL_DEBUG,
 };
 
+/** \ingroup lib
+ * Scheduling policies for the internal threads of libusb, see
+ * \ref libusb_thread_options.
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ */
+enum libusb_thread_sched_policy {
+	/** The normal time sharing policy of the system */
+	LIBUSB_THREAD_SCHED_DEFAULT = 0,
+
+	/** Real time, first in first out (SCHED_FIFO) */
+	LIBUSB_THREAD_SCHED_FIFO = 1,
+
+	/** Real time, round robin (SCHED_RR) */
+	LIBUSB_THREAD_SCHED_RR = 2,
+};
+
+/** \ingroup lib
+ * Placement and scheduling of the internal threads of libusb, see
+ * libusb_set_thread_options().
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ */
+struct libusb_thread_options {
+	/** The CPUs the threads may run on, numbered from 0 */
+	const int *cpus;
+
+	/** Number of entries in cpus. 0 leaves the CPUs of the threads
+	 * alone. */
+	int num_cpus;
+
+	/** The scheduling policy, see \ref libusb_thread_sched_policy */
+	int sched_policy;
+
+	/** The priority within a real time policy; ignored otherwise */
+	int sched_priority;
+
+	/** Prefix of the thread names, at most 7 characters, or NULL for
+	 * "libusb". The threads are named after it and their role, for
+	 * example "libusb-hotplug". */
+	const char *name_prefix;
+};
+
 int LIBUSB_CALL libusb_init(libusb_context **ctx);
 void LIBUSB_CALL libusb_exit(libusb_context *ctx);
 void LIBUSB_CALL libusb_set_debug(libusb_context *ctx, int level);
+int LIBUSB_CALL libusb_set_log_ring(libusb_context *ctx, unsigned int lines);
+int LIBUSB_CALL libusb_read_log_ring(libusb_context *ctx, char *buffer,
+	int length);
+int LIBUSB_CALL libusb_set_thread_options(libusb_context *ctx,
+	const struct libusb_thread_options *options);
+void LIBUSB_CALL libusb_set_device_discovery(int enable);
 const struct libusb_version * LIBUSB_CALL libusb_get_version(void);
 int LIBUSB_CALL libusb_has_capability(uint32_t capability);
 const char * LIBUSB_CALL libusb_error_name(int errcode);
@@ -1315,6 +1566,11 @@ ssize_t LIBUSB_CALL libusb_get_device_list(libusb_context *ctx,
 	libusb_device ***list);
 void LIBUSB_CALL libusb_free_device_list(libusb_device **list,
 	int unref_devices);
+ssize_t LIBUSB_CALL libusb_get_device_list_filtered(libusb_context *ctx,
+	const struct libusb_device_filter *filter, libusb_device ***list);
+ssize_t LIBUSB_CALL libusb_get_device_snapshot(libusb_context *ctx,
+	libusb_device ***list, unsigned int *generation);
+void LIBUSB_CALL libusb_free_device_snapshot(libusb_device **list);
 libusb_device * LIBUSB_CALL libusb_ref_device(libusb_device *dev);
 void LIBUSB_CALL libusb_unref_device(libusb_device *dev);
 
@@ -1370,6 +1626,8 @@ int LIBUSB_CALL libusb_get_max_iso_packet_size(libusb_device *dev,
 	unsigned char endpoint);
 
 int LIBUSB_CALL libusb_open(libusb_device *dev, libusb_device_handle **handle);
+int LIBUSB_CALL libusb_wrap_sys_device(libusb_context *ctx, intptr_t sys_dev,
+	libusb_device_handle **handle);
 void LIBUSB_CALL libusb_close(libusb_device_handle *dev_handle);
 libusb_device * LIBUSB_CALL libusb_get_device(libusb_device_handle *dev_handle);
 
@@ -1394,6 +1652,18 @@ int LIBUSB_CALL libusb_alloc_streams(libusb_device_handle *dev,
 int LIBUSB_CALL libusb_free_streams(libusb_device_handle *dev,
 	unsigned char *endpoints, int num_endpoints);
 
+unsigned char * LIBUSB_CALL libusb_dev_mem_alloc(libusb_device_handle *dev,
+	size_t length);
+int LIBUSB_CALL libusb_dev_mem_free(libusb_device_handle *dev,
+	unsigned char *buffer, size_t length);
+
+int LIBUSB_CALL libusb_set_endpoint_policy(libusb_device_handle *dev,
+	unsigned char endpoint, enum libusb_endpoint_policy policy,
+	unsigned int value);
+int LIBUSB_CALL libusb_get_endpoint_policy(libusb_device_handle *dev,
+	unsigned char endpoint, enum libusb_endpoint_policy policy,
+	unsigned int *value);
+
 int LIBUSB_CALL libusb_kernel_driver_active(libusb_device_handle *dev,
 	int interface_number);
 int LIBUSB_CALL libusb_detach_kernel_driver(libusb_device_handle *dev,
@@ -1478,12 +1748,146 @@ static inline void libusb_fill_control_setup(unsigned char *buffer,
 
 struct libusb_transfer * LIBUSB_CALL libusb_alloc_transfer(int iso_packets);
 int LIBUSB_CALL libusb_submit_transfer(struct libusb_transfer *transfer);
+int LIBUSB_CALL libusb_submit_transfers(struct libusb_transfer **transfers,
+	int num_transfers);
 int LIBUSB_CALL libusb_cancel_transfer(struct libusb_transfer *transfer);
+int LIBUSB_CALL libusb_cancel_endpoint_transfers(
+	libusb_device_handle *dev_handle, unsigned char endpoint);
+int LIBUSB_CALL libusb_cancel_all_transfers(libusb_device_handle *dev_handle);
 void LIBUSB_CALL libusb_free_transfer(struct libusb_transfer *transfer);
 void LIBUSB_CALL libusb_transfer_set_stream_id(
 	struct libusb_transfer *transfer, uint32_t stream_id);
 uint32_t LIBUSB_CALL libusb_transfer_get_stream_id(
 	struct libusb_transfer *transfer);
+void LIBUSB_CALL libusb_transfer_set_iov(struct libusb_transfer *transfer,
+	struct libusb_iovec *iov, int num_iov);
+struct libusb_transfer_pool * LIBUSB_CALL libusb_alloc_transfer_pool(
+	libusb_device_handle *dev_handle, unsigned char endpoint,
+	unsigned char type, int length, int iso_packets, int num_transfers);
+void LIBUSB_CALL libusb_free_transfer_pool(struct libusb_transfer_pool *pool);
+struct libusb_transfer * LIBUSB_CALL libusb_transfer_pool_get(
+	struct libusb_transfer_pool *pool);
+void LIBUSB_CALL libusb_transfer_pool_put(struct libusb_transfer *transfer);
+struct libusb_iso_stream * LIBUSB_CALL libusb_alloc_iso_stream(
+	libusb_device_handle *dev_handle, unsigned char endpoint,
+	int packet_size, int packets_per_transfer, int num_transfers,
+	int ring_packets, unsigned char *ring_buffer);
+void LIBUSB_CALL libusb_free_iso_stream(struct libusb_iso_stream *stream);
+int LIBUSB_CALL libusb_iso_stream_start(struct libusb_iso_stream *stream);
+int LIBUSB_CALL libusb_iso_stream_stop(struct libusb_iso_stream *stream);
+int LIBUSB_CALL libusb_iso_stream_read(struct libusb_iso_stream *stream,
+	struct libusb_iso_stream_packet *packets, int max_packets);
+void LIBUSB_CALL libusb_iso_stream_release(struct libusb_iso_stream *stream,
+	int num_packets);
+uint64_t LIBUSB_CALL libusb_iso_stream_get_dropped(
+	struct libusb_iso_stream *stream);
+struct libusb_bulk_stream * LIBUSB_CALL libusb_alloc_bulk_stream(
+	libusb_device_handle *dev_handle, unsigned char endpoint, int length,
+	int min_depth, int max_depth, libusb_bulk_stream_cb_fn callback,
+	void *user_data);
+void LIBUSB_CALL libusb_free_bulk_stream(struct libusb_bulk_stream *stream);
+int LIBUSB_CALL libusb_bulk_stream_set_stream_id(
+	struct libusb_bulk_stream *stream, uint32_t stream_id);
+int LIBUSB_CALL libusb_bulk_stream_start(struct libusb_bulk_stream *stream);
+int LIBUSB_CALL libusb_bulk_stream_stop(struct libusb_bulk_stream *stream);
+int LIBUSB_CALL libusb_bulk_stream_get(struct libusb_bulk_stream *stream,
+	unsigned char **buffer, int *length);
+int LIBUSB_CALL libusb_bulk_stream_put(struct libusb_bulk_stream *stream,
+	unsigned char *buffer, int length);
+int LIBUSB_CALL libusb_bulk_stream_get_depth(struct libusb_bulk_stream *stream);
+struct libusb_completion_queue * LIBUSB_CALL libusb_alloc_completion_queue(
+	libusb_context *ctx);
+void LIBUSB_CALL libusb_free_completion_queue(
+	struct libusb_completion_queue *queue);
+void LIBUSB_CALL libusb_transfer_set_completion_queue(
+	struct libusb_transfer *transfer, struct libusb_completion_queue *queue);
+int LIBUSB_CALL libusb_completion_queue_wait(
+	struct libusb_completion_queue *queue,
+	struct libusb_transfer **transfer, struct timeval *tv);
+void LIBUSB_CALL libusb_completion_queue_interrupt(
+	struct libusb_completion_queue *queue);
+struct libusb_stream_scheduler * LIBUSB_CALL libusb_alloc_stream_scheduler(
+	libusb_device_handle *dev_handle, unsigned char endpoint,
+	uint32_t num_streams, int max_in_flight, int max_per_stream);
+void LIBUSB_CALL libusb_free_stream_scheduler(
+	struct libusb_stream_scheduler *sched);
+int LIBUSB_CALL libusb_stream_scheduler_alloc_id(
+	struct libusb_stream_scheduler *sched);
+int LIBUSB_CALL libusb_stream_scheduler_free_id(
+	struct libusb_stream_scheduler *sched, uint32_t stream_id);
+int LIBUSB_CALL libusb_stream_scheduler_set_priority(
+	struct libusb_stream_scheduler *sched, uint32_t stream_id, int priority);
+int LIBUSB_CALL libusb_stream_scheduler_submit(
+	struct libusb_stream_scheduler *sched, struct libusb_transfer *transfer);
+int LIBUSB_CALL libusb_stream_scheduler_cancel(
+	struct libusb_stream_scheduler *sched);
+
+/** \ingroup asyncio
+ * Number of buckets in the latency histogram of \ref libusb_stats.
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ */
+#define LIBUSB_STATS_LATENCY_BUCKETS	24
+
+/** \ingroup asyncio
+ * Transfer statistics of a context, a device handle or an endpoint, as
+ * returned by libusb_get_stats(). All counters start at zero and only ever
+ * grow. They are updated without synchronising with each other, so a
+ * snapshot taken while transfers are in flight may be slightly inconsistent.
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ */
+struct libusb_stats {
+	/** Number of transfers submitted */
+	uint64_t transfers_submitted;
+
+	/** Number of transfers that completed successfully */
+	uint64_t transfers_completed;
+
+	/** Number of transfers that were cancelled */
+	uint64_t transfers_cancelled;
+
+	/** Number of transfers that timed out */
+	uint64_t transfers_timed_out;
+
+	/** Number of transfers that completed with any other status */
+	uint64_t transfers_failed;
+
+	/** Number of data bytes moved by transfers that completed successfully */
+	uint64_t bytes_transferred;
+
+	/** Number of requests the backend issued to the operating system for
+	 * the submitted transfers (URBs on Linux). Divide by
+	 * \ref libusb_stats::transfers_submitted "transfers_submitted" for the
+	 * average per transfer. Zero if the backend does not report it. */
+	uint64_t requests_submitted;
+
+	/** Number of event handler wakeups that reaped completions, for backends
+	 * that reap in batches. Not kept per endpoint. */
+	uint64_t reap_wakeups;
+
+	/** Number of completions reaped in those wakeups. Divide by
+	 * \ref libusb_stats::reap_wakeups "reap_wakeups" for the average batch
+	 * size. Not kept per endpoint. */
+	uint64_t reaped;
+
+	/** Largest number of completions reaped in a single wakeup. Not kept
+	 * per endpoint. */
+	uint64_t reap_batch_max;
+
+	/** Total time spent in transfer callbacks, in microseconds */
+	uint64_t callback_time_us;
+
+	/** Histogram of the time from submission to completion. Bucket 0 counts
+	 * transfers that took less than 1 microsecond, bucket i those that took
+	 * at least 2^(i-1) and less than 2^i microseconds. The last bucket also
+	 * counts everything slower. */
+	uint64_t latency_us[LIBUSB_STATS_LATENCY_BUCKETS];
+};
+
+int LIBUSB_CALL libusb_get_stats(libusb_context *ctx,
+	libusb_device_handle *dev_handle, int endpoint,
+	struct libusb_stats *stats);
 
 /** \ingroup asyncio
  * Helper function to populate the required \ref libusb_transfer fields
@@ -1559,6 +1963,44 @@ static inline void libusb_fill_bulk_transfer(struct libusb_transfer *transfer,
 	transfer->callback = callback;
 }
 
+/** \ingroup asyncio
+ * Helper function to populate the required \ref libusb_transfer fields
+ * for a vectored bulk transfer, whose data is spread over several
+ * fragments instead of one contiguous buffer.
+ *
+ * The fragments are transferred in array order, as if they were one buffer,
+ * without libusb copying them together. Each fragment other than the last one
+ * should be a multiple of the maximum packet size of the endpoint, otherwise
+ * the device sees a short packet, which ends the transfer early. The iovec
+ * array and the fragments must stay valid until the transfer has completed.
+ * The \ref libusb_transfer::buffer "buffer" field of the transfer points to
+ * the iovec array, and \ref libusb_transfer::length "length" is the total
+ * length of the fragments.
+ *
+ * Vectored transfers are not supported on all platforms; on the others
+ * libusb_submit_transfer() returns LIBUSB_ERROR_NOT_SUPPORTED.
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ *
+ * \param transfer the transfer to populate
+ * \param dev_handle handle of the device that will handle the transfer
+ * \param endpoint address of the endpoint where this transfer will be sent
+ * \param iov array of data fragments
+ * \param num_iov number of fragments in the array
+ * \param callback callback function to be invoked on transfer completion
+ * \param user_data user data to pass to callback function
+ * \param timeout timeout for the transfer in milliseconds
+ */
+static inline void libusb_fill_bulk_transfer_iov(
+	struct libusb_transfer *transfer, libusb_device_handle *dev_handle,
+	unsigned char endpoint, struct libusb_iovec *iov, int num_iov,
+	libusb_transfer_cb_fn callback, void *user_data, unsigned int timeout)
+{
+	libusb_fill_bulk_transfer(transfer, dev_handle, endpoint, NULL, 0,
+				  callback, user_data, timeout);
+	libusb_transfer_set_iov(transfer, iov, num_iov);
+}
+
 /** \ingroup asyncio
  * Helper function to populate the required \ref libusb_transfer fields
  * for a bulk transfer using bulk streams.
@@ -1743,6 +2185,41 @@ int LIBUSB_CALL libusb_control_transfer(libusb_device_handle *dev_handle,
 	uint8_t request_type, uint8_t bRequest, uint16_t wValue, uint16_t wIndex,
 	unsigned char *data, uint16_t wLength, unsigned int timeout);
 
+/** \ingroup syncio
+ * One control request of a batch, see libusb_control_transfer_batch(). The
+ * setup fields are as for libusb_control_transfer().
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ */
+struct libusb_control_request {
+	/** Request type field for the setup packet */
+	uint8_t bmRequestType;
+
+	/** Request field for the setup packet */
+	uint8_t bRequest;
+
+	/** Value field for the setup packet, in host-endian byte order */
+	uint16_t wValue;
+
+	/** Index field for the setup packet, in host-endian byte order */
+	uint16_t wIndex;
+
+	/** Length field for the setup packet, in host-endian byte order */
+	uint16_t wLength;
+
+	/** Data buffer of at least wLength bytes, for input or output
+	 * depending on bmRequestType */
+	unsigned char *data;
+
+	/** Output: the number of bytes transferred, or a LIBUSB_ERROR code if
+	 * the request failed */
+	int result;
+};
+
+int LIBUSB_CALL libusb_control_transfer_batch(libusb_device_handle *dev_handle,
+	struct libusb_control_request *requests, int num_requests, int depth,
+	unsigned int timeout);
+
 int LIBUSB_CALL libusb_bulk_transfer(libusb_device_handle *dev_handle,
 	unsigned char endpoint, unsigned char *data, int length,
 	int *actual_length, unsigned int timeout);
@@ -1818,6 +2295,27 @@ int LIBUSB_CALL libusb_handle_events_locked(libusb_context *ctx,
 int LIBUSB_CALL libusb_pollfds_handle_timeouts(libusb_context *ctx);
 int LIBUSB_CALL libusb_get_next_timeout(libusb_context *ctx,
 	struct timeval *tv);
+int LIBUSB_CALL libusb_set_timeout_granularity(libusb_context *ctx,
+	unsigned int granularity);
+int LIBUSB_CALL libusb_set_busy_poll(libusb_device_handle *dev_handle,
+	unsigned int budget);
+
+/** \ingroup poll
+ * Structure representing an event domain, a group of device handles whose
+ * events are handled separately from the rest of their context. This is an
+ * opaque type; see libusb_alloc_event_domain().
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ */
+struct libusb_event_domain;
+
+struct libusb_event_domain * LIBUSB_CALL libusb_alloc_event_domain(
+	libusb_context *ctx);
+void LIBUSB_CALL libusb_free_event_domain(struct libusb_event_domain *domain);
+int LIBUSB_CALL libusb_set_event_domain(libusb_device_handle *dev_handle,
+	struct libusb_event_domain *domain);
+int LIBUSB_CALL libusb_handle_domain_events_timeout_completed(
+	struct libusb_event_domain *domain, struct timeval *tv, int *completed);
 
 /** \ingroup poll
  * File descriptor for polling
@@ -1976,6 +2474,77 @@ int LIBUSB_CALL libusb_hotplug_register_callback(libusb_context *ctx,
 						void *user_data,
 						libusb_hotplug_callback_handle *handle);
 
+/** \ingroup hotplug
+ * A hotplug event, as passed to a \ref libusb_hotplug_batch_callback_fn.
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ */
+struct libusb_hotplug_batch_entry {
+	/** libusb_device this event occurred on. The device is only valid
+	 * during the callback, unless the callback takes a reference to it. */
+	libusb_device *device;
+
+	/** event that occurred */
+	libusb_hotplug_event event;
+};
+
+/** \ingroup hotplug
+ * Batch hotplug callback function type. Like a
+ * \ref libusb_hotplug_callback_fn, but called once with all matching events
+ * that were pending when the event handler got to them, in the order they
+ * occurred. See libusb_hotplug_register_batch_callback().
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ *
+ * \param ctx            context of this notification
+ * \param entries        the events and the devices they occurred on
+ * \param num_entries    number of events, at least 1
+ * \param user_data      user data provided when this callback was registered
+ * \returns bool whether this callback is finished processing events.
+ *                       returning 1 will cause this callback to be deregistered
+ */
+typedef int (LIBUSB_CALL *libusb_hotplug_batch_callback_fn)(
+						libusb_context *ctx,
+						const struct libusb_hotplug_batch_entry *entries,
+						int num_entries,
+						void *user_data);
+
+/** \ingroup hotplug
+ * Register a batch hotplug callback function
+ *
+ * This is the same as libusb_hotplug_register_callback(), except that the
+ * callback gets all matching events that are pending in one call, rather
+ * than one call per event. When a hub full of devices powers on, the events
+ * of many devices arrive at once, and the application can then handle them
+ * together. With \ref LIBUSB_HOTPLUG_ENUMERATE, the devices already plugged
+ * in are passed in a single call, too.
+ *
+ * The handle returned is deregistered with
+ * libusb_hotplug_deregister_callback().
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ *
+ * \param[in] ctx context to register this callback with
+ * \param[in] events bitwise or of events that will trigger this callback. See \ref
+ *            libusb_hotplug_event
+ * \param[in] flags hotplug callback flags. See \ref libusb_hotplug_flag
+ * \param[in] vendor_id the vendor id to match or \ref LIBUSB_HOTPLUG_MATCH_ANY
+ * \param[in] product_id the product id to match or \ref LIBUSB_HOTPLUG_MATCH_ANY
+ * \param[in] dev_class the device class to match or \ref LIBUSB_HOTPLUG_MATCH_ANY
+ * \param[in] cb_fn the function to be invoked with the matching events
+ * \param[in] user_data user data to pass to the callback function
+ * \param[out] handle pointer to store the handle of the allocated callback (can be NULL)
+ * \returns LIBUSB_SUCCESS on success LIBUSB_ERROR code on failure
+ */
+int LIBUSB_CALL libusb_hotplug_register_batch_callback(libusb_context *ctx,
+						libusb_hotplug_event events,
+						libusb_hotplug_flag flags,
+						int vendor_id, int product_id,
+						int dev_class,
+						libusb_hotplug_batch_callback_fn cb_fn,
+						void *user_data,
+						libusb_hotplug_callback_handle *handle);
+
 /** \ingroup hotplug
  * Deregisters a hotplug callback.
  *
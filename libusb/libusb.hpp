@@ -0,0 +1,647 @@
+/*
+ * Public libusb C++ header file
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef LIBUSB_HPP
+#define LIBUSB_HPP
+
+#include "libusb.h"
+
+#if !defined(__cplusplus) || (__cplusplus < 201103L && \
+	(!defined(_MSC_VER) || _MSC_VER < 1800))
+#error "libusb.hpp needs a C++11 compiler"
+#endif
+
+/**
+ * \defgroup cpp C++ interface
+ * A header-only layer over the C API for C++11 and later, in namespace
+ * libusb. It adds no state of its own: every object holds exactly the
+ * pointer that the C API hands out, and every member function is an inline
+ * call of the C function it is named after, so it costs nothing over using
+ * the C API directly.
+ *
+ * The owning types libusb::context, libusb::device,
+ * libusb::device_handle, libusb::device_list, libusb::transfer,
+ * libusb::transfer_pool and libusb::completion_queue can be moved but not
+ * copied, and release what they own when they are destroyed. get()
+ * returns the C pointer, for the parts of the API that have no wrapper,
+ * and release() gives up the ownership of it.
+ *
+ * Errors are reported as in the C API: functions return a
+ * \ref libusb_error code, and the allocating functions return an empty
+ * object, which converts to false. No exceptions are thrown.
+ *
+ * Transfers are typed at compile time: libusb::bulk_transfer,
+ * libusb::interrupt_transfer, libusb::control_transfer and
+ * libusb::iso_transfer<N>, whose N isochronous packet descriptors are laid
+ * out in the same allocation as the transfer and can be walked as an
+ * array. Completion callbacks are bound to a member function or to a
+ * function object through a static trampoline, with the object passed as
+ * the user data of the transfer, so binding allocates nothing. The bound
+ * object must outlive the transfer, and callbacks must not throw.
+ *
+ * As in C, a transfer must not be destroyed while it is in flight, and
+ * transfers taken from a libusb::transfer_pool must be destroyed before
+ * the pool.
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ */
+
+namespace libusb {
+
+namespace detail {
+
+/* move-only owner of a pointer that is released with Free */
+template <typename T, void (LIBUSB_CALL *Free)(T *)>
+class owner {
+public:
+	owner() noexcept : ptr_(nullptr) {}
+	explicit owner(T *ptr) noexcept : ptr_(ptr) {}
+	owner(owner &&other) noexcept : ptr_(other.release()) {}
+	owner &operator=(owner &&other) noexcept
+	{
+		reset(other.release());
+		return *this;
+	}
+	owner(const owner &) = delete;
+	owner &operator=(const owner &) = delete;
+	~owner() { reset(); }
+
+	/** \ingroup cpp
+	 * Returns the C pointer, which stays owned by this object. */
+	T *get() const noexcept { return ptr_; }
+
+	/** \ingroup cpp
+	 * Gives up the ownership of the C pointer and returns it. */
+	T *release() noexcept
+	{
+		T *ptr = ptr_;
+		ptr_ = nullptr;
+		return ptr;
+	}
+
+	/** \ingroup cpp
+	 * Releases the owned pointer, if any, and takes ownership of ptr. */
+	void reset(T *ptr = nullptr) noexcept
+	{
+		T *old = ptr_;
+		ptr_ = ptr;
+		if (old)
+			Free(old);
+	}
+
+	explicit operator bool() const noexcept { return ptr_ != nullptr; }
+
+private:
+	T *ptr_;
+};
+
+template <typename F>
+void LIBUSB_CALL call_function_object(struct libusb_transfer *transfer)
+{
+	(*static_cast<F *>(transfer->user_data))(transfer);
+}
+
+template <typename T, void (T::*Method)(struct libusb_transfer *)>
+void LIBUSB_CALL call_member(struct libusb_transfer *transfer)
+{
+	(static_cast<T *>(transfer->user_data)->*Method)(transfer);
+}
+
+} /* namespace detail */
+
+/** \ingroup cpp
+ * Owner of a libusb_context, exited on destruction. */
+class context : public detail::owner<libusb_context, libusb_exit> {
+public:
+	context() noexcept {}
+	/** Takes ownership of an initialized context */
+	explicit context(libusb_context *ctx) noexcept : owner(ctx) {}
+
+	/** Initializes a new context with libusb_init(), replacing the one
+	 * owned before. \returns 0 on success, or a LIBUSB_ERROR code */
+	int init() noexcept
+	{
+		libusb_context *ctx;
+		int r = libusb_init(&ctx);
+
+		if (r == 0)
+			reset(ctx);
+		return r;
+	}
+
+	int handle_events() noexcept
+	{
+		return libusb_handle_events(get());
+	}
+
+	int handle_events(struct timeval &tv) noexcept
+	{
+		return libusb_handle_events_timeout_completed(get(), &tv, nullptr);
+	}
+
+	int handle_events_completed(int &completed) noexcept
+	{
+		return libusb_handle_events_completed(get(), &completed);
+	}
+};
+
+/** \ingroup cpp
+ * Owner of a reference to a libusb_device. */
+class device : public detail::owner<libusb_device, libusb_unref_device> {
+public:
+	device() noexcept {}
+	/** Takes ownership of a reference to dev */
+	explicit device(libusb_device *dev) noexcept : owner(dev) {}
+
+	/** Takes a new reference to dev with libusb_ref_device() */
+	static device ref(libusb_device *dev) noexcept
+	{
+		return device(dev ? libusb_ref_device(dev) : nullptr);
+	}
+
+	int get_descriptor(struct libusb_device_descriptor &desc) const noexcept
+	{
+		return libusb_get_device_descriptor(get(), &desc);
+	}
+
+	uint8_t bus_number() const noexcept
+	{
+		return libusb_get_bus_number(get());
+	}
+
+	uint8_t address() const noexcept
+	{
+		return libusb_get_device_address(get());
+	}
+
+	int speed() const noexcept
+	{
+		return libusb_get_device_speed(get());
+	}
+};
+
+/** \ingroup cpp
+ * The list of the devices of a context, released with
+ * libusb_free_device_list() on destruction, along with the references to
+ * its devices. Iterates over libusb_device pointers. */
+class device_list {
+public:
+	device_list() noexcept : list_(nullptr), len_(0) {}
+	device_list(device_list &&other) noexcept
+		: list_(other.list_), len_(other.len_)
+	{
+		other.list_ = nullptr;
+		other.len_ = 0;
+	}
+	device_list &operator=(device_list &&other) noexcept
+	{
+		if (this != &other) {
+			reset();
+			list_ = other.list_;
+			len_ = other.len_;
+			other.list_ = nullptr;
+			other.len_ = 0;
+		}
+		return *this;
+	}
+	device_list(const device_list &) = delete;
+	device_list &operator=(const device_list &) = delete;
+	~device_list() { reset(); }
+
+	/** Fills the list with libusb_get_device_list(), replacing the
+	 * devices listed before. \returns the number of devices, or a
+	 * LIBUSB_ERROR code */
+	ssize_t fetch(libusb_context *ctx) noexcept
+	{
+		libusb_device **list;
+		ssize_t r = libusb_get_device_list(ctx, &list);
+
+		if (r >= 0) {
+			reset();
+			list_ = list;
+			len_ = (size_t)r;
+		}
+		return r;
+	}
+
+	void reset() noexcept
+	{
+		if (list_)
+			libusb_free_device_list(list_, 1);
+		list_ = nullptr;
+		len_ = 0;
+	}
+
+	libusb_device *const *begin() const noexcept { return list_; }
+	libusb_device *const *end() const noexcept { return list_ + len_; }
+	size_t size() const noexcept { return len_; }
+	libusb_device *operator[](size_t i) const noexcept { return list_[i]; }
+
+private:
+	libusb_device **list_;
+	size_t len_;
+};
+
+/** \ingroup cpp
+ * Owner of an open libusb_device_handle, closed on destruction. */
+class device_handle : public detail::owner<libusb_device_handle, libusb_close> {
+public:
+	device_handle() noexcept {}
+	/** Takes ownership of an open handle */
+	explicit device_handle(libusb_device_handle *handle) noexcept
+		: owner(handle) {}
+
+	/** Opens dev with libusb_open(), replacing the handle owned before.
+	 * \returns 0 on success, or a LIBUSB_ERROR code */
+	int open(libusb_device *dev) noexcept
+	{
+		libusb_device_handle *handle;
+		int r = libusb_open(dev, &handle);
+
+		if (r == 0)
+			reset(handle);
+		return r;
+	}
+
+	/** Opens a handle of the operating system with
+	 * libusb_wrap_sys_device(), replacing the handle owned before.
+	 * \returns 0 on success, or a LIBUSB_ERROR code */
+	int wrap(libusb_context *ctx, intptr_t sys_dev) noexcept
+	{
+		libusb_device_handle *handle;
+		int r = libusb_wrap_sys_device(ctx, sys_dev, &handle);
+
+		if (r == 0)
+			reset(handle);
+		return r;
+	}
+
+	/** The device of the handle, which stays referenced by the handle */
+	libusb_device *device() const noexcept
+	{
+		return libusb_get_device(get());
+	}
+
+	int claim_interface(int interface_number) noexcept
+	{
+		return libusb_claim_interface(get(), interface_number);
+	}
+
+	int release_interface(int interface_number) noexcept
+	{
+		return libusb_release_interface(get(), interface_number);
+	}
+
+	int set_configuration(int configuration) noexcept
+	{
+		return libusb_set_configuration(get(), configuration);
+	}
+
+	int set_interface_alt_setting(int interface_number,
+		int alternate_setting) noexcept
+	{
+		return libusb_set_interface_alt_setting(get(), interface_number,
+			alternate_setting);
+	}
+
+	int clear_halt(unsigned char endpoint) noexcept
+	{
+		return libusb_clear_halt(get(), endpoint);
+	}
+
+	int control_transfer(uint8_t request_type, uint8_t bRequest,
+		uint16_t wValue, uint16_t wIndex, unsigned char *data,
+		uint16_t wLength, unsigned int timeout) noexcept
+	{
+		return libusb_control_transfer(get(), request_type, bRequest,
+			wValue, wIndex, data, wLength, timeout);
+	}
+
+	int bulk_transfer(unsigned char endpoint, unsigned char *data,
+		int length, int &transferred, unsigned int timeout) noexcept
+	{
+		return libusb_bulk_transfer(get(), endpoint, data, length,
+			&transferred, timeout);
+	}
+
+	int interrupt_transfer(unsigned char endpoint, unsigned char *data,
+		int length, int &transferred, unsigned int timeout) noexcept
+	{
+		return libusb_interrupt_transfer(get(), endpoint, data, length,
+			&transferred, timeout);
+	}
+};
+
+/** \ingroup cpp
+ * Owner of a libusb_completion_queue, freed on destruction. */
+class completion_queue
+	: public detail::owner<struct libusb_completion_queue,
+		libusb_free_completion_queue> {
+public:
+	completion_queue() noexcept {}
+	/** Takes ownership of a queue */
+	explicit completion_queue(struct libusb_completion_queue *queue) noexcept
+		: owner(queue) {}
+
+	/** Allocates a queue with libusb_alloc_completion_queue(). The
+	 * result is empty if the allocation failed. */
+	static completion_queue alloc(libusb_context *ctx) noexcept
+	{
+		return completion_queue(libusb_alloc_completion_queue(ctx));
+	}
+
+	/** Waits for a completed transfer, see
+	 * libusb_completion_queue_wait(). The transfer is still owned by the
+	 * object it was submitted through; compare with its get(). */
+	int wait(struct libusb_transfer *&transfer,
+		struct timeval *tv = nullptr) noexcept
+	{
+		return libusb_completion_queue_wait(get(), &transfer, tv);
+	}
+
+	void interrupt() noexcept
+	{
+		libusb_completion_queue_interrupt(get());
+	}
+};
+
+namespace detail {
+
+/* the members common to all transfer types */
+template <int IsoPackets>
+class transfer_base : public owner<struct libusb_transfer, libusb_free_transfer> {
+public:
+	int submit() noexcept { return libusb_submit_transfer(get()); }
+	int cancel() noexcept { return libusb_cancel_transfer(get()); }
+
+	enum libusb_transfer_status status() const noexcept
+	{
+		return get()->status;
+	}
+
+	int actual_length() const noexcept { return get()->actual_length; }
+	int length() const noexcept { return get()->length; }
+	unsigned char *buffer() const noexcept { return get()->buffer; }
+	unsigned char endpoint() const noexcept { return get()->endpoint; }
+
+	void set_flags(uint8_t flags) noexcept { get()->flags = flags; }
+	void set_timeout(unsigned int timeout) noexcept
+	{
+		get()->timeout = timeout;
+	}
+
+	/** \ingroup cpp
+	 * Calls method on object when the transfer completes. object is
+	 * stored as the user data of the transfer. */
+	template <typename T, void (T::*Method)(struct libusb_transfer *)>
+	void on_complete(T *object) noexcept
+	{
+		get()->callback = &call_member<T, Method>;
+		get()->user_data = object;
+	}
+
+	/** \ingroup cpp
+	 * Calls the function object, such as a lambda, when the transfer
+	 * completes. function is stored as the user data of the transfer. */
+	template <typename F>
+	void on_complete(F *function) noexcept
+	{
+		get()->callback = &call_function_object<F>;
+		get()->user_data = function;
+	}
+
+	/** \ingroup cpp
+	 * Sets a plain C callback and its user data. */
+	void on_complete(libusb_transfer_cb_fn callback, void *user_data) noexcept
+	{
+		get()->callback = callback;
+		get()->user_data = user_data;
+	}
+
+	/** \ingroup cpp
+	 * Delivers the transfer to queue once it completes, instead of
+	 * calling its callback. */
+	void set_completion_queue(completion_queue &queue) noexcept
+	{
+		libusb_transfer_set_completion_queue(get(), queue.get());
+	}
+
+protected:
+	transfer_base() noexcept {}
+	explicit transfer_base(struct libusb_transfer *transfer) noexcept
+		: owner(transfer) {}
+
+	static struct libusb_transfer *alloc_transfer() noexcept
+	{
+		return libusb_alloc_transfer(IsoPackets);
+	}
+};
+
+} /* namespace detail */
+
+/** \ingroup cpp
+ * A transfer of the given \ref libusb_transfer_type "type", with IsoPackets
+ * isochronous packets. Only the specializations below exist: use the
+ * bulk_transfer, interrupt_transfer, control_transfer and iso_transfer
+ * names.
+ */
+template <unsigned char Type, int IsoPackets = 0>
+class transfer;
+
+template <>
+class transfer<LIBUSB_TRANSFER_TYPE_BULK, 0> : public detail::transfer_base<0> {
+public:
+	transfer() noexcept {}
+	/** Takes ownership of a bulk transfer */
+	explicit transfer(struct libusb_transfer *t) noexcept : transfer_base(t) {}
+
+	/** The result is empty if the allocation failed */
+	static transfer alloc() noexcept { return transfer(alloc_transfer()); }
+
+	/** Fills the transfer with libusb_fill_bulk_transfer(), keeping its
+	 * callback and user data */
+	void fill(libusb_device_handle *handle, unsigned char endpoint,
+		unsigned char *buffer, int length, unsigned int timeout = 0) noexcept
+	{
+		libusb_fill_bulk_transfer(get(), handle, endpoint, buffer, length,
+			get()->callback, get()->user_data, timeout);
+	}
+};
+
+template <>
+class transfer<LIBUSB_TRANSFER_TYPE_INTERRUPT, 0>
+	: public detail::transfer_base<0> {
+public:
+	transfer() noexcept {}
+	/** Takes ownership of an interrupt transfer */
+	explicit transfer(struct libusb_transfer *t) noexcept : transfer_base(t) {}
+
+	/** The result is empty if the allocation failed */
+	static transfer alloc() noexcept { return transfer(alloc_transfer()); }
+
+	/** Fills the transfer with libusb_fill_interrupt_transfer(), keeping
+	 * its callback and user data */
+	void fill(libusb_device_handle *handle, unsigned char endpoint,
+		unsigned char *buffer, int length, unsigned int timeout = 0) noexcept
+	{
+		libusb_fill_interrupt_transfer(get(), handle, endpoint, buffer,
+			length, get()->callback, get()->user_data, timeout);
+	}
+};
+
+template <>
+class transfer<LIBUSB_TRANSFER_TYPE_CONTROL, 0>
+	: public detail::transfer_base<0> {
+public:
+	transfer() noexcept {}
+	/** Takes ownership of a control transfer */
+	explicit transfer(struct libusb_transfer *t) noexcept : transfer_base(t) {}
+
+	/** The result is empty if the allocation failed */
+	static transfer alloc() noexcept { return transfer(alloc_transfer()); }
+
+	/** Fills the transfer with libusb_fill_control_transfer(), keeping
+	 * its callback and user data. buffer starts with the setup packet,
+	 * see fill_setup(). */
+	void fill(libusb_device_handle *handle, unsigned char *buffer,
+		unsigned int timeout = 0) noexcept
+	{
+		libusb_fill_control_transfer(get(), handle, buffer,
+			get()->callback, get()->user_data, timeout);
+	}
+
+	/** Writes a setup packet with libusb_fill_control_setup() */
+	static void fill_setup(unsigned char *buffer, uint8_t bmRequestType,
+		uint8_t bRequest, uint16_t wValue, uint16_t wIndex,
+		uint16_t wLength) noexcept
+	{
+		libusb_fill_control_setup(buffer, bmRequestType, bRequest, wValue,
+			wIndex, wLength);
+	}
+
+	/** The data that follows the setup packet */
+	unsigned char *data() const noexcept
+	{
+		return libusb_control_transfer_get_data(get());
+	}
+};
+
+template <int IsoPackets>
+class transfer<LIBUSB_TRANSFER_TYPE_ISOCHRONOUS, IsoPackets>
+	: public detail::transfer_base<IsoPackets> {
+	static_assert(IsoPackets > 0,
+		"isochronous transfers need at least one packet");
+	typedef detail::transfer_base<IsoPackets> base;
+
+public:
+	typedef struct libusb_iso_packet_descriptor packets_type[IsoPackets];
+
+	static const int num_packets = IsoPackets;
+
+	transfer() noexcept {}
+	/** Takes ownership of an isochronous transfer with IsoPackets
+	 * packets */
+	explicit transfer(struct libusb_transfer *t) noexcept : base(t) {}
+
+	/** The result is empty if the allocation failed */
+	static transfer alloc() noexcept
+	{
+		return transfer(base::alloc_transfer());
+	}
+
+	/** Fills the transfer with libusb_fill_iso_transfer() for all
+	 * IsoPackets packets, keeping its callback and user data. Set the
+	 * packet lengths with set_packet_lengths() or through packets(). */
+	void fill(libusb_device_handle *handle, unsigned char endpoint,
+		unsigned char *buffer, int length, unsigned int timeout = 0) noexcept
+	{
+		libusb_fill_iso_transfer(this->get(), handle, endpoint, buffer,
+			length, IsoPackets, this->get()->callback,
+			this->get()->user_data, timeout);
+	}
+
+	void set_packet_lengths(unsigned int length) noexcept
+	{
+		libusb_set_iso_packet_lengths(this->get(), length);
+	}
+
+	/** The packet descriptors, as an array of IsoPackets elements */
+	packets_type &packets() const noexcept
+	{
+		return *reinterpret_cast<packets_type *>(
+			this->get()->iso_packet_desc);
+	}
+
+	/** The data of packet i, assuming all packets have the same length */
+	unsigned char *packet_buffer(unsigned int i) const noexcept
+	{
+		return libusb_get_iso_packet_buffer_simple(this->get(), i);
+	}
+};
+
+/** \ingroup cpp */
+typedef transfer<LIBUSB_TRANSFER_TYPE_BULK> bulk_transfer;
+/** \ingroup cpp */
+typedef transfer<LIBUSB_TRANSFER_TYPE_INTERRUPT> interrupt_transfer;
+/** \ingroup cpp */
+typedef transfer<LIBUSB_TRANSFER_TYPE_CONTROL> control_transfer;
+/** \ingroup cpp
+ * An isochronous transfer of N packets */
+template <int N>
+using iso_transfer = transfer<LIBUSB_TRANSFER_TYPE_ISOCHRONOUS, N>;
+
+/** \ingroup cpp
+ * Owner of a libusb_transfer_pool, freed on destruction, whose transfers
+ * are of the given type. */
+template <unsigned char Type, int IsoPackets = 0>
+class transfer_pool
+	: public detail::owner<struct libusb_transfer_pool,
+		libusb_free_transfer_pool> {
+	typedef detail::owner<struct libusb_transfer_pool,
+		libusb_free_transfer_pool> base;
+
+public:
+	typedef transfer<Type, IsoPackets> transfer_type;
+
+	transfer_pool() noexcept {}
+	/** Takes ownership of a pool of transfers of Type with IsoPackets
+	 * packets */
+	explicit transfer_pool(struct libusb_transfer_pool *pool) noexcept
+		: base(pool) {}
+
+	/** Allocates a pool with libusb_alloc_transfer_pool(). The result is
+	 * empty if the allocation failed. */
+	static transfer_pool alloc(libusb_device_handle *handle,
+		unsigned char endpoint, int length, int num_transfers) noexcept
+	{
+		return transfer_pool(libusb_alloc_transfer_pool(handle, endpoint,
+			Type, length, IsoPackets, num_transfers));
+	}
+
+	/** Takes a transfer from the pool with libusb_transfer_pool_get().
+	 * It goes back to the pool when it is destroyed. The result is empty
+	 * if all transfers are in use. */
+	transfer_type take() noexcept
+	{
+		return transfer_type(libusb_transfer_pool_get(this->get()));
+	}
+};
+
+} /* namespace libusb */
+
+#endif
@@ -62,6 +62,7 @@ extern "C" {
 #define USBI_CAP_HAS_HID_ACCESS					0x00010000
 #define USBI_CAP_SUPPORTS_DETACH_KERNEL_DRIVER	0x00020000
 #define USBI_CAP_HAS_POLLABLE_DEVICE_FD		0x00040000
+#define USBI_CAP_SUPPORTS_BULK_IOV		0x00080000
 
 /* Maximum number of bytes in a log line */
 #define USBI_MAX_LOG_LEN	1024
@@ -107,6 +108,11 @@ struct list_head {
 		 &pos->member != (head);								\
 		 pos = n, n = list_entry(n->member.next, type, member))
 
+#define list_for_each_entry_reverse(pos, head, member, type)	\
+	for (pos = list_entry((head)->prev, type, member);			\
+		 &pos->member != (head);								\
+		 pos = list_entry(pos->member.prev, type, member))
+
 #define list_empty(entry) ((entry)->next == (entry))
 
 static inline void list_init(struct list_head *entry)
@@ -179,7 +185,12 @@ void usbi_log_v(struct libusb_context *ctx, enum libusb_log_level level,
 #if !defined(_MSC_VER) || _MSC_VER >= 1400
 
 #ifdef ENABLE_LOGGING
-#define _usbi_log(ctx, level, ...) usbi_log(ctx, level, __FUNCTION__, __VA_ARGS__)
+/* the level is checked before the arguments are evaluated, see
+ * usbi_log_enabled() */
+#define _usbi_log(ctx, level, ...) do { \
+	if (usbi_log_enabled(ctx, level)) \
+		usbi_log(ctx, level, __FUNCTION__, __VA_ARGS__); \
+	} while(0)
 #define usbi_dbg(...) _usbi_log(NULL, LIBUSB_LOG_LEVEL_DEBUG, __VA_ARGS__)
 #else
 #define _usbi_log(ctx, level, ...) do { (void)(ctx); } while(0)
@@ -219,6 +230,35 @@ static inline void usbi_dbg(const char *format, ...)
 
 #endif /* !defined(_MSC_VER) || _MSC_VER >= 1400 */
 
+/* Static tracepoints on the transfer lifecycle, for bpftrace, perf or
+ * SystemTap. They are single no-op instructions plus an ELF note unless a
+ * tracer attaches, and expand to nothing when USDT support is not built in.
+ * All probes belong to the "libusb" provider:
+ *
+ *   transfer__submit(transfer, endpoint, length, type)
+ *       libusb_submit_transfer(), before handing the transfer to the backend
+ *   backend__submit(transfer, endpoint, length, num_requests)
+ *       the backend has issued the transfer to the OS
+ *   reap(handle, num_reaped)
+ *       the backend has reaped a batch of completions for a handle
+ *   transfer__complete(transfer, endpoint, actual_length, status)
+ *       a transfer completed, before its callback runs
+ *   callback__return(transfer, endpoint, status)
+ *       the callback of a transfer returned. the transfer may be freed, so
+ *       its pointer is only good for matching earlier probes; endpoint and
+ *       status are copies taken before the callback ran
+ */
+#ifdef USBI_USDT_AVAILABLE
+#include <sys/sdt.h>
+#define usbi_trace2(name, a, b) STAP_PROBE2(libusb, name, a, b)
+#define usbi_trace3(name, a, b, c) STAP_PROBE3(libusb, name, a, b, c)
+#define usbi_trace4(name, a, b, c, d) STAP_PROBE4(libusb, name, a, b, c, d)
+#else
+#define usbi_trace2(name, a, b) do { (void)(a); (void)(b); } while(0)
+#define usbi_trace3(name, a, b, c) do { (void)(a); (void)(b); (void)(c); } while(0)
+#define usbi_trace4(name, a, b, c, d) do { (void)(a); (void)(b); (void)(c); (void)(d); } while(0)
+#endif
+
 #define USBI_GET_CONTEXT(ctx) if (!(ctx)) (ctx) = usbi_default_context
 #define DEVICE_CTX(dev) ((dev)->ctx)
 #define HANDLE_CTX(handle) (DEVICE_CTX((handle)->dev))
@@ -238,36 +278,117 @@ static inline void usbi_dbg(const char *format, ...)
 #include <os/threads_windows.h>
 #endif
 
+/* applies the options to all internal threads, current and future. returns
+ * a LIBUSB_ERROR code if some running thread could not be given them */
+int usbi_set_thread_options(const struct libusb_thread_options *options);
+
 extern struct libusb_context *usbi_default_context;
 
 /* Forward declaration for use in context (fully defined inside poll abstraction) */
 struct pollfd;
 
+struct usbi_device_snapshot;
+struct usbi_log_ring;
+
+/* A binary min-heap of timeouts. Each tracked object embeds a node pointing
+ * at its expiration time, and the node with the earliest expiration is
+ * always nodes[0]. */
+struct usbi_timeout_node {
+	const struct timeval *timeout;
+	/* position in the heap, or -1 if not in a heap */
+	int index;
+};
+
+struct usbi_timeout_heap {
+	struct usbi_timeout_node **nodes;
+	unsigned int len;
+	unsigned int size;
+};
+
+/* number of hash buckets for hotplug callbacks with a vendor and product ID.
+ * must be a power of 2 */
+#define USBI_HOTPLUG_CB_BUCKETS 64
+
+/* number of hash buckets for the devices of a context by session ID. must be
+ * a power of 2 */
+#define USBI_SESSION_BUCKETS 256
+
+/* the hash bucket of a session ID, out of a power of 2 number of buckets.
+ * also used by backends that index their own per-device state by session */
+static inline unsigned int usbi_session_bucket(uint64_t session_id,
+	unsigned int buckets)
+{
+	uint32_t hash = (uint32_t)(session_id ^ (session_id >> 32)) * 2654435761u;
+
+	return (hash >> 16) & (buckets - 1);
+}
+
 struct libusb_context {
 	int debug;
 	int debug_fixed;
 
+	/* the backend leaves the devices of the system alone and only knows
+	 * those wrapped by libusb_wrap_sys_device(). see
+	 * libusb_set_device_discovery() */
+	int no_device_discovery;
+
+	/* in-memory log sink, see libusb_set_log_ring(). set once, freed in
+	 * libusb_exit() */
+	struct usbi_log_ring *log_ring;
+
 	/* internal event pipe, used for signalling occurrence of an internal event. */
 	int event_pipe[2];
 
 	struct list_head usb_devs;
 	usbi_mutex_t usb_devs_lock;
 
+	/* the same devices, hashed by session ID with usbi_session_bucket() for
+	 * usbi_get_device_by_session_id(). protected by usb_devs_lock */
+	struct list_head usb_devs_by_session[USBI_SESSION_BUCKETS];
+
+	/* Bumped whenever a device is attached to or detached from usb_devs,
+	 * and the latest list handed out by libusb_get_device_snapshot() while
+	 * it is still current. Both are protected by usb_devs_lock. */
+	unsigned int usb_devs_generation;
+	struct usbi_device_snapshot *device_snapshot;
+
 	/* A list of open handles. Backends are free to traverse this if required.
 	 */
 	struct list_head open_devs;
 	usbi_mutex_t open_devs_lock;
 
+	/* number of open handles with busy polling enabled, see
+	 * libusb_set_busy_poll(). changed under open_devs_lock with
+	 * usbi_flags_store(), the event handler reads it without the lock */
+	unsigned int busy_poll_handles;
+
 	/* A list of registered hotplug callbacks */
 	struct list_head hotplug_cbs;
 	usbi_mutex_t hotplug_cbs_lock;
 
-	/* this is a list of in-flight transfer handles, sorted by timeout
-	 * expiration. URBs to timeout the soonest are placed at the beginning of
-	 * the list, URBs that will time out later are placed after, and urbs with
-	 * infinite timeout are always placed at the very end. */
-	struct list_head flying_transfers;
-	usbi_mutex_t flying_transfers_lock;
+	/* The same callbacks, indexed for matching against devices. Callbacks
+	 * for a specific vendor and product ID are hashed into hotplug_cbs_by_id,
+	 * all the others are kept in hotplug_cbs_any. Each of these lists is
+	 * ordered like hotplug_cbs. Protected by hotplug_cbs_lock. */
+	struct list_head hotplug_cbs_any;
+	struct list_head hotplug_cbs_by_id[USBI_HOTPLUG_CB_BUCKETS];
+
+	/* the batch callbacks, which take part in none of the above index
+	 * lists. Ordered like hotplug_cbs. Protected by hotplug_cbs_lock. */
+	struct list_head hotplug_batch_cbs;
+
+	/* in-flight transfers are tracked per device handle, so that submissions
+	 * and completions on unrelated devices do not contend on a single lock.
+	 * this is a min-heap of the device handles that have transfers with a
+	 * pending timeout, ordered by the earliest such timeout on each handle,
+	 * so that the handle with the transfer to time out the soonest is always
+	 * at the top. timeouts_lock protects the heap and the timerfd. */
+	struct usbi_timeout_heap timeout_heap;
+	usbi_mutex_t timeouts_lock;
+
+	/* deadlines are rounded up to a multiple of this many microseconds
+	 * when arming the timer, see libusb_set_timeout_granularity() */
+	unsigned int timeout_granularity;
 
 	/* list and count of poll fds and an array of poll fd structures that is
 	 * (re)allocated as necessary prior to polling, and a flag to indicate
@@ -278,6 +399,16 @@ struct libusb_context {
 	unsigned int pollfds_modified;
 	usbi_mutex_t pollfds_lock;
 
+#ifdef USBI_EPOLL_AVAILABLE
+	/* epoll instance watching every fd on the ipollfds list, if supported by
+	 * OS. when in use, this is the only fd exposed to applications through
+	 * libusb_get_pollfds() and epoll_events is (re)allocated alongside
+	 * pollfds to receive the ready events. */
+	int epoll_fd;
+	struct libusb_pollfd epoll_pollfd;
+	struct epoll_event *epoll_events;
+#endif
+
 	/* user callbacks for pollfd changes */
 	libusb_pollfd_added_cb fd_added_cb;
 	libusb_pollfd_removed_cb fd_removed_cb;
@@ -292,9 +423,9 @@ struct libusb_context {
 	/* A lock to protect internal context event data. */
 	usbi_mutex_t event_data_lock;
 
-	/* A counter that is set when we want to interrupt and prevent event handling,
-	 * in order to safely close a device. Protected by event_data_lock. */
-	unsigned int device_close;
+	/* A list of handles that libusb_close() left for the event handler to
+	 * close, as struct usbi_close_request. Protected by event_data_lock. */
+	struct list_head close_queue;
 
 	/* A flag that is set when we want to interrupt event handling, in order to
 	 * pick up a new fd for polling. Protected by event_data_lock. */
@@ -308,18 +439,54 @@ struct libusb_context {
 	usbi_mutex_t event_waiters_lock;
 	usbi_cond_t event_waiters_cond;
 
+	/* transfer statistics of the device handles that have been closed, see
+	 * libusb_get_stats(). protected by open_devs_lock. */
+	struct libusb_stats closed_stats;
+
+	/* bumped whenever a device handle is closed, under open_devs_lock.
+	 * handles are closed with the events lock held, so the event handler
+	 * can read this to tell whether a callback closed one */
+	unsigned long handles_closed;
+
 #ifdef USBI_TIMERFD_AVAILABLE
 	/* used for timeout handling, if supported by OS.
-	 * this timerfd is maintained to trigger on the next pending timeout */
+	 * this timerfd is maintained to trigger on the next pending timeout.
+	 * timerfd_armed is 1 while it is known to be armed for
+	 * timerfd_deadline, 0 while known to be disarmed and -1 when unknown,
+	 * so that rearming it for the same deadline is skipped. protected by
+	 * timeouts_lock */
 	int timerfd;
+	int timerfd_armed;
+	struct timeval timerfd_deadline;
 #endif
 
 	struct list_head list;
 };
 
+int usbi_get_env_log_level(void);
+
+/* whether a message of the given level is logged. this is inlined into every
+ * logging call site, so a disabled message costs a load and a compare and
+ * its arguments are never evaluated. messages without a context use the
+ * level of the default context, or LIBUSB_DEBUG if there is none. */
+static inline int usbi_log_enabled(struct libusb_context *ctx,
+	enum libusb_log_level level)
+{
+#ifdef ENABLE_DEBUG_LOGGING
+	UNUSED(ctx);
+	UNUSED(level);
+	return 1;
+#else
+	if (!ctx)
+		ctx = usbi_default_context;
+	return (ctx ? ctx->debug : usbi_get_env_log_level()) >= (int)level;
+#endif
+}
+
 /* Update the following macro if new event sources are added */
 #define usbi_pending_events(ctx) \
-	((ctx)->device_close || (ctx)->fd_notify || !list_empty(&(ctx)->hotplug_msgs))
+	(!list_empty(&(ctx)->close_queue) || (ctx)->fd_notify || \
+	 !list_empty(&(ctx)->hotplug_msgs))
 
 #ifdef USBI_TIMERFD_AVAILABLE
 #define usbi_using_timerfd(ctx) ((ctx)->timerfd >= 0)
@@ -327,12 +494,53 @@ struct libusb_context {
 #define usbi_using_timerfd(ctx) (0)
 #endif
 
+#ifdef USBI_EPOLL_AVAILABLE
+#define usbi_using_epoll(ctx) ((ctx)->epoll_fd >= 0)
+#else
+#define usbi_using_epoll(ctx) (0)
+#endif
+
+/* what the active configuration says about one endpoint, for the lookups
+ * that would otherwise walk the config descriptor. see descriptor.c */
+struct usbi_endpoint_info {
+	uint8_t present;
+	uint8_t type;		/* enum libusb_transfer_type */
+	uint8_t interval;	/* bInterval */
+	uint8_t mult;		/* transactions per (micro)frame - 1 */
+	uint8_t max_burst;	/* SuperSpeed companion bMaxBurst, or 0 */
+	uint16_t max_packet;	/* wMaxPacketSize, as in the descriptor */
+};
+
+/* slot of an endpoint address in the table: numbers 0-15, OUT then IN */
+#define USBI_ENDPOINT_SLOTS	32
+#define USBI_ENDPOINT_SLOT(ep)	(((ep) & 0x0f) | (((ep) & 0x80) >> 3))
+
+struct usbi_cached_string;
+
 struct libusb_device {
-	/* lock protects refcnt, everything else is finalized at initialization
-	 * time */
+	/* lock protects the config descriptor cache, the endpoint table and
+	 * the string cache, everything else is finalized at initialization
+	 * time. refcnt is updated with usbi_ref_inc() and usbi_ref_dec(), or
+	 * under lock if there are no atomics */
 	usbi_mutex_t lock;
 	int refcnt;
 
+	/* parsed config descriptors, by index and for the active configuration,
+	 * if LIBUSB_CACHE_CONFIG is set. callers get copies. see descriptor.c */
+	struct libusb_config_descriptor **config_descs;
+	struct libusb_config_descriptor *active_config_desc;
+
+	/* the endpoints of the active configuration by USBI_ENDPOINT_SLOT(),
+	 * valid while endpoints_valid is set, with or without the config cache.
+	 * config_generation is bumped whenever the active configuration is
+	 * invalidated */
+	struct usbi_endpoint_info endpoints[USBI_ENDPOINT_SLOTS];
+	int endpoints_valid;
+	unsigned int config_generation;
+
+	/* string descriptors read so far, if LIBUSB_CACHE_STRINGS is set */
+	struct usbi_cached_string *strings;
+
 	struct libusb_context *ctx;
 
 	uint8_t bus_number;
@@ -343,6 +551,8 @@ struct libusb_device {
 	enum libusb_speed speed;
 
 	struct list_head list;
+	/* entry in the usb_devs_by_session bucket of the context */
+	struct list_head session_list;
 	unsigned long session_data;
 
 	struct libusb_device_descriptor device_descriptor;
@@ -353,15 +563,59 @@ struct libusb_device {
 	[] /* valid C99 code */
 #else
 	[0] /* non-standard, but usually working code */
+#endif
+#if defined(__GNUC__)
+	/* backends keep pointers and locks in here */
+	__attribute__ ((aligned (8)))
 #endif
 	;
 };
 
+/* endpoint statistics are indexed by direction and endpoint number */
+#define USBI_MAX_ENDPOINT_STATS	32
+
 struct libusb_device_handle {
 	/* lock protects claimed_interfaces */
 	usbi_mutex_t lock;
 	unsigned long claimed_interfaces;
 
+	/* a list of the transfers in flight on this handle, in no particular
+	 * order. transfers with a finite timeout that libusb has to enforce are
+	 * also kept in timeout_heap, so that the transfer to time out the
+	 * soonest is always at the top. flying_transfers_lock protects both. */
+	struct list_head flying_transfers;
+	struct usbi_timeout_heap timeout_heap;
+	usbi_mutex_t flying_transfers_lock;
+
+	/* the expiration of the transfer at the top of timeout_heap, and the
+	 * node of this handle in the context's timeout heap. protected by the
+	 * context's timeouts_lock. */
+	struct timeval next_timeout;
+	struct usbi_timeout_node timeout_node;
+
+	/* the event domain handling the events of this handle, or NULL if they
+	 * are handled by the context */
+	struct libusb_event_domain *event_domain;
+
+	/* microseconds the event handler spins reaping this handle before it
+	 * blocks, 0 if busy polling is off. changed under the context's
+	 * open_devs_lock */
+	unsigned int busy_poll;
+
+	/* idle transfers kept for reuse by the synchronous API, see sync.c.
+	 * protected by sync_cache_lock. */
+	struct usbi_sync_transfer *sync_cache;
+	int sync_cache_len;
+	usbi_mutex_t sync_cache_lock;
+
+	/* transfer statistics, see libusb_get_stats(). kept per endpoint and
+	 * indexed by usbi_endpoint_stats(), with the reap counters that only
+	 * exist per handle. updated with usbi_stats_add() and friends. */
+	struct libusb_stats endpoint_stats[USBI_MAX_ENDPOINT_STATS];
+	uint64_t reap_wakeups;
+	uint64_t reaped;
+	uint64_t reap_batch_max;
+
 	struct list_head list;
 	struct libusb_device *dev;
 	int auto_detach_kernel_driver;
@@ -370,6 +624,10 @@ struct libusb_device_handle {
 	[] /* valid C99 code */
 #else
 	[0] /* non-standard, but usually working code */
+#endif
+#if defined(__GNUC__)
+	/* backends keep pointers and locks in here */
+	__attribute__ ((aligned (8)))
 #endif
 	;
 };
@@ -396,10 +654,36 @@ struct usbi_transfer {
 	int num_iso_packets;
 	struct list_head list;
 	struct timeval timeout;
+	struct usbi_timeout_node timeout_node;
 	int transferred;
 	uint32_t stream_id;
 	uint8_t flags;
 
+	/* monotonic time of submission in microseconds, for the statistics */
+	uint64_t submit_time;
+
+	/* the pool this transfer belongs to, if any, and the data buffer the
+	 * pool assigned to it. in_pool is set while the transfer sits on the
+	 * free list of its pool, under the lock of the pool */
+	struct libusb_transfer_pool *pool;
+	unsigned char *pool_buffer;
+	int in_pool;
+
+	/* the fragments of a vectored transfer, see libusb_transfer_set_iov().
+	 * only valid while the buffer of the transfer points to them. */
+	struct libusb_iovec *iov;
+	int num_iov;
+
+	/* the queue the transfer is delivered to when it completes, instead
+	 * of invoking its callback, see libusb_transfer_set_completion_queue().
+	 * while queued, the transfer is linked into it through list. */
+	struct libusb_completion_queue *completion_queue;
+
+	/* the stream scheduler that the transfer was queued on, until it
+	 * completes, see libusb_stream_scheduler_submit(). while queued, the
+	 * transfer is linked into the queue of its stream through list. */
+	struct libusb_stream_scheduler *stream_sched;
+
 	/* this lock is held during libusb_submit_transfer() and
 	 * libusb_cancel_transfer() (allowing the OS backend to prevent duplicate
 	 * cancellation, submission-during-cancellation, etc). the OS backend
@@ -434,6 +718,11 @@ enum usbi_transfer_flags {
 	((struct usbi_transfer *)(((unsigned char *)(transfer)) \
 		- sizeof(struct usbi_transfer)))
 
+/* whether the transfer takes its data from itransfer->iov */
+#define USBI_TRANSFER_IS_IOV(itransfer) \
+	((itransfer)->iov && (unsigned char *)(itransfer)->iov == \
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer)->buffer)
+
 static inline void *usbi_transfer_get_os_priv(struct usbi_transfer *transfer)
 {
 	return ((unsigned char *)transfer) + sizeof(struct usbi_transfer)
@@ -442,6 +731,121 @@ static inline void *usbi_transfer_get_os_priv(struct usbi_transfer *transfer)
 			* sizeof(struct libusb_iso_packet_descriptor));
 }
 
+/* statistics counters are updated with relaxed atomics, nothing is ordered
+ * against them. if the compiler offers no atomics they are plain adds and
+ * may lose the odd update under contention. */
+#if defined(__ATOMIC_RELAXED)
+#define USBI_HAVE_ATOMICS	1
+#define usbi_stats_add(p, v)	((void)__atomic_fetch_add((p), (v), __ATOMIC_RELAXED))
+#define usbi_stats_get(p)	__atomic_load_n((p), __ATOMIC_RELAXED)
+#define usbi_stats_set(p, v)	__atomic_store_n((p), (v), __ATOMIC_RELAXED)
+#elif defined(__GNUC__)
+#define usbi_stats_add(p, v)	((void)__sync_fetch_and_add((p), (v)))
+#define usbi_stats_get(p)	__sync_fetch_and_add((p), 0)
+#define usbi_stats_set(p, v)	((void)(*(volatile uint64_t *)(p) = (v)))
+#elif defined(_WIN32)
+#define usbi_stats_add(p, v)	((void)InterlockedExchangeAdd64((volatile LONGLONG *)(p), (LONGLONG)(v)))
+#define usbi_stats_get(p)	((uint64_t)InterlockedExchangeAdd64((volatile LONGLONG *)(p), 0))
+#define usbi_stats_set(p, v)	((void)InterlockedExchange64((volatile LONGLONG *)(p), (LONGLONG)(v)))
+#else
+#define usbi_stats_add(p, v)	((void)(*(p) += (v)))
+#define usbi_stats_get(p)	(*(p))
+#define usbi_stats_set(p, v)	((void)(*(p) = (v)))
+#endif
+
+/* raise a maximum to v. concurrent updaters retry until the stored value is
+ * at least their own, so that no maximum is lost */
+static inline void usbi_stats_max(uint64_t *p, uint64_t v)
+{
+#if defined(__ATOMIC_RELAXED)
+	uint64_t cur = __atomic_load_n(p, __ATOMIC_RELAXED);
+
+	while (v > cur && !__atomic_compare_exchange_n(p, &cur, v, 1,
+			__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+#elif defined(__GNUC__)
+	uint64_t cur = *(volatile uint64_t *)p, prev;
+
+	while (v > cur && (prev = __sync_val_compare_and_swap(p, cur, v)) != cur)
+		cur = prev;
+#elif defined(_WIN32)
+	LONGLONG cur = InterlockedExchangeAdd64((volatile LONGLONG *)p, 0), prev;
+
+	while ((LONGLONG)v > cur && (prev = InterlockedCompareExchange64(
+			(volatile LONGLONG *)p, (LONGLONG)v, cur)) != cur)
+		cur = prev;
+#else
+	if (v > *p)
+		*p = v;
+#endif
+}
+
+/* flags read without a lock are published with release and read with acquire
+ * semantics, so that a reader seeing a flag also sees the state behind it */
+#if defined(__ATOMIC_RELAXED)
+#define usbi_flags_load(p)	__atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define usbi_flags_store(p, v)	__atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#elif defined(__GNUC__)
+#define usbi_flags_load(p)	__sync_fetch_and_add((p), 0)
+#define usbi_flags_store(p, v)	((void)__sync_lock_test_and_set((p), (v)))
+#elif defined(_WIN32)
+#define usbi_flags_load(p)	((unsigned int)InterlockedCompareExchange((volatile LONG *)(p), 0, 0))
+#define usbi_flags_store(p, v)	((void)InterlockedExchange((volatile LONG *)(p), (LONG)(v)))
+#else
+#define usbi_flags_load(p)	(*(volatile unsigned int *)(p))
+#define usbi_flags_store(p, v)	((void)(*(volatile unsigned int *)(p) = (v)))
+#endif
+
+/* reference counts are taken with a relaxed increment, as the caller
+ * already holds a reference, and dropped with an acquire and release
+ * decrement, so that the thread dropping the last reference sees everything
+ * the others did to the object before it goes away. usbi_ref_dec() returns
+ * the new count. if the compiler offers no atomics, USBI_REF_LOCKED is
+ * defined and the counts are updated under a lock instead. */
+#if defined(__ATOMIC_RELAXED)
+#define usbi_ref_inc(p)		((void)__atomic_fetch_add((p), 1, __ATOMIC_RELAXED))
+#define usbi_ref_dec(p)		__atomic_sub_fetch((p), 1, __ATOMIC_ACQ_REL)
+#elif defined(__GNUC__)
+#define usbi_ref_inc(p)		((void)__sync_fetch_and_add((p), 1))
+#define usbi_ref_dec(p)		__sync_sub_and_fetch((p), 1)
+#elif defined(_WIN32)
+#define usbi_ref_inc(p)		((void)InterlockedIncrement((volatile LONG *)(p)))
+#define usbi_ref_dec(p)		((int)InterlockedDecrement((volatile LONG *)(p)))
+#else
+#define USBI_REF_LOCKED		1
+#endif
+
+static inline struct libusb_stats *usbi_endpoint_stats(
+	struct libusb_device_handle *handle, unsigned char endpoint)
+{
+	return &handle->endpoint_stats[(endpoint & LIBUSB_ENDPOINT_ADDRESS_MASK)
+		| ((endpoint & LIBUSB_ENDPOINT_IN) ? 0x10 : 0)];
+}
+
+/* called by backends from submit_transfer() with the number of requests
+ * (e.g. URBs) they issued for a transfer */
+static inline void usbi_stats_requests(struct usbi_transfer *itransfer,
+	int num_requests)
+{
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+
+	usbi_stats_add(&usbi_endpoint_stats(transfer->dev_handle,
+		transfer->endpoint)->requests_submitted, (uint64_t)num_requests);
+}
+
+/* called by backends that reap completions in batches, once per wakeup that
+ * reaped any. event handlers of several threads may reap the same handle,
+ * when it is busy polled or moved between event domains, so nothing is
+ * updated with a plain store */
+static inline void usbi_stats_reap(struct libusb_device_handle *handle,
+	unsigned int num_reaped)
+{
+	usbi_stats_add(&handle->reap_wakeups, 1);
+	usbi_stats_add(&handle->reaped, (uint64_t)num_reaped);
+	usbi_stats_max(&handle->reap_batch_max, (uint64_t)num_reaped);
+}
+
 /* bus structures */
 
 /* All standard descriptors have these 2 fields in common */
@@ -454,6 +858,12 @@ struct usb_descriptor_header {
 
 int usbi_io_init(struct libusb_context *ctx);
 void usbi_io_exit(struct libusb_context *ctx);
+int usbi_io_handle_init(struct libusb_device_handle *handle);
+void usbi_io_handle_exit(struct libusb_device_handle *handle);
+int usbi_io_handle_idle(struct libusb_device_handle *dev_handle);
+void usbi_io_handle_retire_stats(struct libusb_device_handle *handle);
+int usbi_sync_handle_init(struct libusb_device_handle *handle);
+void usbi_sync_handle_exit(struct libusb_device_handle *handle);
 
 struct libusb_device *usbi_alloc_device(struct libusb_context *ctx,
 	unsigned long session_id);
@@ -465,10 +875,21 @@ void usbi_handle_disconnect(struct libusb_device_handle *handle);
 int usbi_handle_transfer_completion(struct usbi_transfer *itransfer,
 	enum libusb_transfer_status status);
 int usbi_handle_transfer_cancellation(struct usbi_transfer *transfer);
+int usbi_remove_from_flying_list(struct usbi_transfer *transfer);
 
 int usbi_parse_descriptor(const unsigned char *source, const char *descriptor,
 	void *dest, int host_endian);
+int usbi_parse_raw_config_descriptor(struct libusb_context *ctx,
+	unsigned char *buf, int size, struct libusb_config_descriptor **config);
+int usbi_parse_raw_bos_descriptor(struct libusb_context *ctx,
+	unsigned char *buf, int size, struct libusb_bos_descriptor **bos);
 int usbi_device_cache_descriptor(libusb_device *dev);
+void usbi_descriptor_read_env(void);
+void usbi_device_invalidate_active_config(struct libusb_device *dev);
+void usbi_device_free_config_cache(struct libusb_device *dev);
+int usbi_device_get_endpoint_info(struct libusb_device *dev,
+	unsigned char endpoint, struct usbi_endpoint_info *info);
+void usbi_device_free_string_cache(struct libusb_device *dev);
 int usbi_get_config_index_by_value(struct libusb_device *dev,
 	uint8_t bConfigurationValue, int *idx);
 
@@ -477,6 +898,10 @@ void usbi_disconnect_device (struct libusb_device *dev);
 
 int usbi_signal_event(struct libusb_context *ctx);
 int usbi_clear_event(struct libusb_context *ctx);
+int usbi_create_event_pipe(int event_pipe[2]);
+void usbi_close_event_pipe(int event_pipe[2]);
+int usbi_write_event_pipe(int event_pipe[2]);
+int usbi_read_event_pipe(int event_pipe[2]);
 
 /* Internal abstraction for poll (needs struct usbi_transfer on Windows) */
 #if defined(OS_WINDOWS)
@@ -504,11 +929,15 @@ struct usbi_pollfd {
 	struct libusb_pollfd pollfd;
 
 	struct list_head list;
+
+	/* the event domain polling this fd instead of the context, if any */
+	struct libusb_event_domain *domain;
 };
 
 int usbi_add_pollfd(struct libusb_context *ctx, int fd, short events);
 void usbi_remove_pollfd(struct libusb_context *ctx, int fd);
 void usbi_fd_notification(struct libusb_context *ctx);
+void usbi_handle_close_queue(struct libusb_context *ctx);
 
 /* device discovery */
 
@@ -520,6 +949,9 @@ void usbi_fd_notification(struct libusb_context *ctx);
 struct discovered_devs {
 	size_t len;
 	size_t capacity;
+	/* if set, discovered_devs_append() leaves out the devices that don't
+	 * match it */
+	const struct libusb_device_filter *filter;
 	struct libusb_device *devices
 #if defined(__STDC_VERSION__) && (__STDC_VERSION__ >= 199901L)
 	[] /* valid C99 code */
@@ -557,9 +989,10 @@ struct usbi_os_backend {
 	/* Deinitialization. Optional. This function should destroy anything
 	 * that was set up by init.
 	 *
-	 * This function is called when the user deinitializes the library.
+	 * This function is called when the user deinitializes the library,
+	 * once for each context that init was called for.
 	 */
-	void (*exit)(void);
+	void (*exit)(struct libusb_context *ctx);
 
 	/* Enumerate all the USB devices on the system, returning them in a list
 	 * of discovered devices.
@@ -659,6 +1092,26 @@ struct usbi_os_backend {
 	 */
 	int (*open)(struct libusb_device_handle *handle);
 
+	/* Open a handle from a handle of the OS that the application already
+	 * has, such as a usbfs file descriptor, without the device having been
+	 * enumerated. Optional.
+	 *
+	 * Your backend should create a device for it with usbi_alloc_device(),
+	 * read its descriptors through sys_dev, store the device in
+	 * handle->dev, taking over the reference from the allocation, and set
+	 * up the handle as open() would. The device is not added to the list
+	 * of devices of the context.
+	 *
+	 * This function is called from libusb_wrap_sys_device().
+	 *
+	 * Return:
+	 * - 0 on success
+	 * - LIBUSB_ERROR_NO_DEVICE if sys_dev does not refer to a device
+	 * - another LIBUSB_ERROR code on other failure
+	 */
+	int (*wrap_sys_device)(struct libusb_context *ctx,
+		struct libusb_device_handle *handle, intptr_t sys_dev);
+
 	/* Close a device such that the handle cannot be used again. Your backend
 	 * should destroy any resources that were allocated in the open path.
 	 * This may also be a good place to call usbi_remove_pollfd() to inform
@@ -757,6 +1210,23 @@ struct usbi_os_backend {
 		uint8_t bConfigurationValue, unsigned char **buffer,
 		int *host_endian);
 
+	/* Get a string of a device that the operating system read when the
+	 * device was enumerated, without any I/O. Optional.
+	 *
+	 * desc_index is the index of the string descriptor, the backend will
+	 * usually only know those referenced by the device descriptor. The
+	 * string is in the language the device lists first, UTF-8 encoded and
+	 * written NUL terminated to buffer.
+	 *
+	 * Only used when string descriptors are cached, see
+	 * libusb_get_string_descriptor_ascii().
+	 *
+	 * Return the length of the string on success, LIBUSB_ERROR_NOT_FOUND if
+	 * the string is not known, or another LIBUSB_ERROR code on failure.
+	 */
+	int (*get_device_string)(struct libusb_device *device,
+		uint8_t desc_index, char *buffer, size_t len);
+
 	/* Get the bConfigurationValue for the active configuration for a device.
 	 * Optional. This should only be implemented if you can retrieve it from
 	 * cache (don't generate I/O).
@@ -886,6 +1356,51 @@ struct usbi_os_backend {
 	int (*free_streams)(struct libusb_device_handle *handle,
 		unsigned char *endpoints, int num_endpoints);
 
+	/* Allocate memory for transfers to or from the given device that the
+	 * OS can use for DMA without copying. Optional.
+	 *
+	 * Return a buffer of at least len bytes, or NULL if no such memory could
+	 * be allocated, in which case the library falls back to ordinary heap
+	 * memory.
+	 */
+	unsigned char *(*dev_mem_alloc)(struct libusb_device_handle *handle,
+		size_t len);
+
+	/* Free memory allocated by dev_mem_alloc. Optional, but must be provided
+	 * along with dev_mem_alloc.
+	 *
+	 * Return:
+	 * - 0 on success
+	 * - LIBUSB_ERROR_NOT_FOUND if the buffer was not allocated by
+	 *   dev_mem_alloc, in which case the library will free() it
+	 * - another LIBUSB_ERROR code on other failure
+	 */
+	int (*dev_mem_free)(struct libusb_device_handle *handle,
+		unsigned char *buffer, size_t len);
+
+	/* Set a performance policy on an endpoint of a claimed interface.
+	 * Optional.
+	 *
+	 * Return:
+	 * - 0 on success
+	 * - LIBUSB_ERROR_NOT_FOUND if the endpoint does not belong to a claimed
+	 *   interface
+	 * - LIBUSB_ERROR_NOT_SUPPORTED if the driver does not support the policy
+	 * - LIBUSB_ERROR_NO_DEVICE if the device has been disconnected since it
+	 *   was opened
+	 * - another LIBUSB_ERROR code on other failure
+	 */
+	int (*set_endpoint_policy)(struct libusb_device_handle *handle,
+		unsigned char endpoint, enum libusb_endpoint_policy policy,
+		unsigned int value);
+
+	/* Read back a performance policy of an endpoint of a claimed interface.
+	 * Optional, returns the same codes as set_endpoint_policy.
+	 */
+	int (*get_endpoint_policy)(struct libusb_device_handle *handle,
+		unsigned char endpoint, enum libusb_endpoint_policy policy,
+		unsigned int *value);
+
 	/* Determine if a kernel driver is active on an interface. Optional.
 	 *
 	 * The presence of a kernel driver on an interface indicates that any
@@ -948,7 +1463,8 @@ struct usbi_os_backend {
 	 *
 	 * This function must not block.
 	 *
-	 * This function gets called with the flying_transfers_lock locked!
+	 * This function gets called with the flying_transfers_lock of the
+	 * device handle locked!
 	 *
 	 * Return:
 	 * - 0 on success
@@ -977,6 +1493,59 @@ struct usbi_os_backend {
 	 */
 	void (*clear_transfer_priv)(struct usbi_transfer *itransfer);
 
+	/* Free any private data that the backend keeps attached to a transfer
+	 * across submissions. Optional.
+	 *
+	 * This function is called from libusb_free_transfer() for a transfer
+	 * that is not in flight, just before its memory is released.
+	 */
+	void (*free_transfer_priv)(struct usbi_transfer *itransfer);
+
+	/* Perform a control transfer synchronously, blocking in the kernel
+	 * until it completes. Optional.
+	 *
+	 * This is a fast path for libusb_control_transfer() that avoids the
+	 * round trip through the event loop. It is only called for transfers
+	 * with a timeout, while there are no asynchronous transfers in flight
+	 * on the device handle and no events waiting for the event loop. The
+	 * wValue, wIndex and wLength values are given in host-endian byte order.
+	 *
+	 * Return:
+	 * - the number of bytes transferred on success
+	 * - LIBUSB_ERROR_NOT_SUPPORTED if the transfer cannot be done this way,
+	 *   in which case the library falls back to the asynchronous path
+	 * - LIBUSB_ERROR_TIMEOUT if the transfer timed out
+	 * - LIBUSB_ERROR_PIPE if the control request was not supported
+	 * - LIBUSB_ERROR_NO_DEVICE if the device has been disconnected
+	 * - another LIBUSB_ERROR code on other failure
+	 */
+	int (*sync_control_transfer)(struct libusb_device_handle *handle,
+		uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue,
+		uint16_t wIndex, unsigned char *data, uint16_t wLength,
+		unsigned int timeout);
+
+	/* Perform a bulk or interrupt transfer synchronously, blocking in the
+	 * kernel until it completes. Optional.
+	 *
+	 * Like sync_control_transfer(), this is only called for transfers with
+	 * a timeout while nothing else waits for the event loop. It is also
+	 * only called for transfers of at most one packet, as the kernel does
+	 * not report how much data was transferred before a timeout expired.
+	 *
+	 * Return:
+	 * - the number of bytes transferred on success
+	 * - LIBUSB_ERROR_NOT_SUPPORTED if the transfer cannot be done this way,
+	 *   in which case the library falls back to the asynchronous path
+	 * - LIBUSB_ERROR_TIMEOUT if the transfer timed out
+	 * - LIBUSB_ERROR_PIPE if the endpoint halted
+	 * - LIBUSB_ERROR_OVERFLOW if the device offered more data
+	 * - LIBUSB_ERROR_NO_DEVICE if the device has been disconnected
+	 * - another LIBUSB_ERROR code on other failure
+	 */
+	int (*sync_bulk_transfer)(struct libusb_device_handle *handle,
+		unsigned char endpoint, unsigned char *data, int length,
+		unsigned int timeout);
+
 	/* Handle any pending events. This involves monitoring any active
 	 * transfers and processing their completion or cancellation.
 	 *
@@ -1006,6 +1575,37 @@ struct usbi_os_backend {
 	int (*handle_events)(struct libusb_context *ctx,
 		struct pollfd *fds, POLL_NFDS_TYPE nfds, int num_ready);
 
+	/* Retrieve the file descriptor that the events of a device handle are
+	 * signalled on, and the events to poll for. Optional.
+	 *
+	 * This is used to move a device handle into an event domain, which
+	 * polls the descriptor separately from the rest of the context and
+	 * passes it to handle_events() from its own thread. Backends that
+	 * implement this must be able to cope with handle_events() being
+	 * called concurrently for the descriptors of different device handles.
+	 *
+	 * Return:
+	 * - 0 on success
+	 * - LIBUSB_ERROR_NOT_SUPPORTED if the events of this device handle are
+	 *   not signalled on a descriptor of its own
+	 */
+	int (*get_pollfd)(struct libusb_device_handle *handle,
+		struct libusb_pollfd *pollfd);
+
+	/* Complete the transfers of a device handle that are done, without
+	 * waiting for any. Optional, used for busy polling, see
+	 * libusb_set_busy_poll().
+	 *
+	 * Called by the event handler, with the same guarantees as
+	 * handle_events. This is called in a tight loop, so it should cost no
+	 * more than one non-blocking system call when nothing is done.
+	 *
+	 * Return the number of transfers completed, or a LIBUSB_ERROR code on
+	 * failure. A disconnected device should return 0 and be left to
+	 * handle_events.
+	 */
+	int (*busy_poll)(struct libusb_device_handle *handle);
+
 	/* Get time from specified clock. At least two clocks must be implemented
 	   by the backend: USBI_CLOCK_REALTIME, and USBI_CLOCK_MONOTONIC.
 
@@ -1054,6 +1654,7 @@ extern const struct usbi_os_backend netbsd_backend;
 extern const struct usbi_os_backend windows_backend;
 extern const struct usbi_os_backend wince_backend;
 extern const struct usbi_os_backend haiku_usb_raw_backend;
+extern const struct usbi_os_backend mock_backend;
 
 extern struct list_head active_contexts_list;
 extern usbi_mutex_static_t active_contexts_lock;
@@ -53,18 +53,41 @@ static CFRunLoopRef libusb_darwin_acfl = NULL; /* event cf loop */
 static volatile int32_t initCount = 0;
 
 static usbi_mutex_t darwin_cached_devices_lock = PTHREAD_MUTEX_INITIALIZER;
+/* protects the interfaces' lists of low latency transfers */
+static usbi_mutex_t darwin_ll_lock = PTHREAD_MUTEX_INITIALIZER;
 static struct list_head darwin_cached_devices = {&darwin_cached_devices, &darwin_cached_devices};
+/* the same devices, hashed by session ID. a bucket is initialized on first
+ * use. protected by darwin_cached_devices_lock */
+static struct list_head darwin_cached_devices_by_session[DARWIN_CACHED_DEVICE_BUCKETS];
 
 #define DARWIN_CACHED_DEVICE(a) ((struct darwin_cached_device *) (((struct darwin_device_priv *)((a)->os_priv))->dev))
 
 /* async event thread */
 static pthread_t libusb_darwin_at;
 
+/* Optional dedicated run loop threads for async I/O completions. By default
+ * all devices are serviced by the hotplug thread's run loop. Setting the
+ * LIBUSB_DARWIN_RUNLOOP_THREADS environment variable to N starts N threads
+ * instead, and each opened device is assigned to the least busy of them. */
+#define DARWIN_MAX_IO_THREADS 32
+
+struct darwin_io_thread {
+  pthread_t    thread;
+  CFRunLoopRef runloop;
+  int          num_devices;
+};
+
+static struct darwin_io_thread darwin_io_threads[DARWIN_MAX_IO_THREADS];
+static int darwin_num_io_threads = 0;
+static usbi_mutex_t darwin_io_threads_lock = PTHREAD_MUTEX_INITIALIZER;
+
 static int darwin_get_config_descriptor(struct libusb_device *dev, uint8_t config_index, unsigned char *buffer, size_t len, int *host_endian);
 static int darwin_claim_interface(struct libusb_device_handle *dev_handle, int iface);
 static int darwin_release_interface(struct libusb_device_handle *dev_handle, int iface);
 static int darwin_reset_device(struct libusb_device_handle *dev_handle);
 static void darwin_async_io_callback (void *refcon, IOReturn result, void *arg0);
+static void darwin_handle_callback (struct usbi_transfer *itransfer, kern_return_t result, UInt32 io_size);
+static void darwin_ll_release_interface (struct darwin_interface *cInterface);
 
 static int darwin_scan_devices(struct libusb_context *ctx);
 static int process_new_device (struct libusb_context *ctx, io_service_t service);
@@ -135,12 +158,25 @@ static int darwin_to_libusb (int result) {
   }
 }
 
+/* the bucket of darwin_cached_devices_by_session for a session ID. this
+   function must be called with the darwin_cached_devices_lock held */
+static struct list_head *darwin_cached_devices_for_session(UInt64 session) {
+  struct list_head *bucket =
+    &darwin_cached_devices_by_session[usbi_session_bucket(session, DARWIN_CACHED_DEVICE_BUCKETS)];
+
+  if (!bucket->next)
+    list_init(bucket);
+
+  return bucket;
+}
+
 /* this function must be called with the darwin_cached_devices_lock held */
 static void darwin_deref_cached_device(struct darwin_cached_device *cached_dev) {
   cached_dev->refcount--;
   /* free the device and remove it from the cache */
   if (0 == cached_dev->refcount) {
     list_del(&cached_dev->list);
+    list_del(&cached_dev->session_list);
 
     (*(cached_dev->device))->Release(cached_dev->device);
     free (cached_dev);
@@ -332,11 +368,7 @@ static void *darwin_event_thread_main (void *arg0) {
   struct libusb_context *ctx = (struct libusb_context *)arg0;
   CFRunLoopRef runloop;
 
-  /* Set this thread's name, so it can be seen in the debugger
-     and crash reports. */
 #if MAC_OS_X_VERSION_MIN_REQUIRED >= 1060
-  pthread_setname_np ("org.libusb.device-hotplug");
-
   /* Tell the Objective-C garbage collector about this thread.
      This is required because, unlike NSThreads, pthreads are
      not automatically registered. Although we don't use
@@ -418,6 +450,115 @@ static void *darwin_event_thread_main (void *arg0) {
   pthread_exit (NULL);
 }
 
+static void darwin_io_thread_perform (void *info) {
+  /* the source only exists to keep the run loop alive while no device uses it */
+  (void) info;
+}
+
+static void *darwin_io_thread_main (void *arg0) {
+  struct darwin_io_thread *io_thread = (struct darwin_io_thread *)arg0;
+  CFRunLoopSourceContext source_context = {.perform = darwin_io_thread_perform};
+  CFRunLoopSourceRef keepalive_source;
+  CFRunLoopRef runloop;
+
+#if MAC_OS_X_VERSION_MIN_REQUIRED >= 1060
+  objc_registerThreadWithCollector();
+#endif
+
+  runloop = CFRunLoopGetCurrent ();
+  CFRetain (runloop);
+
+  keepalive_source = CFRunLoopSourceCreate (NULL, 0, &source_context);
+  CFRunLoopAddSource (runloop, keepalive_source, kCFRunLoopCommonModes);
+
+  /* signal the main thread that the runloop has been created */
+  pthread_mutex_lock (&libusb_darwin_at_mutex);
+  io_thread->runloop = runloop;
+  pthread_cond_signal (&libusb_darwin_at_cond);
+  pthread_mutex_unlock (&libusb_darwin_at_mutex);
+
+  CFRunLoopRun ();
+
+  usbi_dbg ("darwin io thread exiting");
+
+  CFRunLoopRemoveSource (runloop, keepalive_source, kCFRunLoopCommonModes);
+  CFRelease (keepalive_source);
+  CFRelease (runloop);
+
+  pthread_exit (NULL);
+}
+
+static void darwin_start_io_threads (void) {
+  const char *env = getenv ("LIBUSB_DARWIN_RUNLOOP_THREADS");
+  int i, num_threads = env ? atoi (env) : 0;
+
+  if (num_threads > DARWIN_MAX_IO_THREADS)
+    num_threads = DARWIN_MAX_IO_THREADS;
+
+  for (i = 0 ; i < num_threads ; i++) {
+    darwin_io_threads[i].runloop = NULL;
+    darwin_io_threads[i].num_devices = 0;
+    if (usbi_thread_create (&darwin_io_threads[i].thread, "io", darwin_io_thread_main, &darwin_io_threads[i]))
+      break;
+
+    pthread_mutex_lock (&libusb_darwin_at_mutex);
+    while (!darwin_io_threads[i].runloop)
+      pthread_cond_wait (&libusb_darwin_at_cond, &libusb_darwin_at_mutex);
+    pthread_mutex_unlock (&libusb_darwin_at_mutex);
+  }
+
+  darwin_num_io_threads = i;
+  if (i)
+    usbi_dbg ("using %d run loop threads for device io", i);
+}
+
+static void darwin_stop_io_threads (void) {
+  int i;
+
+  for (i = 0 ; i < darwin_num_io_threads ; i++) {
+    CFRunLoopStop (darwin_io_threads[i].runloop);
+    usbi_thread_join (darwin_io_threads[i].thread, NULL);
+    darwin_io_threads[i].runloop = NULL;
+  }
+
+  darwin_num_io_threads = 0;
+}
+
+/* returns a retained run loop to service a newly opened device */
+static CFRunLoopRef darwin_assign_runloop (void) {
+  CFRunLoopRef runloop = libusb_darwin_acfl;
+  int i, best = -1;
+
+  usbi_mutex_lock (&darwin_io_threads_lock);
+  for (i = 0 ; i < darwin_num_io_threads ; i++)
+    if (best < 0 || darwin_io_threads[i].num_devices < darwin_io_threads[best].num_devices)
+      best = i;
+
+  if (best >= 0) {
+    darwin_io_threads[best].num_devices++;
+    runloop = darwin_io_threads[best].runloop;
+  }
+  usbi_mutex_unlock (&darwin_io_threads_lock);
+
+  CFRetain (runloop);
+
+  return runloop;
+}
+
+static void darwin_unassign_runloop (CFRunLoopRef runloop) {
+  int i;
+
+  usbi_mutex_lock (&darwin_io_threads_lock);
+  for (i = 0 ; i < darwin_num_io_threads ; i++)
+    if (darwin_io_threads[i].runloop == runloop) {
+      darwin_io_threads[i].num_devices--;
+      break;
+    }
+  usbi_mutex_unlock (&darwin_io_threads_lock);
+
+  CFRelease (runloop);
+}
+
 /* cleanup function to destroy cached devices */
 static void __attribute__((destructor)) _darwin_finalize(void) {
   struct darwin_cached_device *dev, *next;
@@ -446,25 +587,28 @@ static int darwin_init(struct libusb_context *ctx) {
     host_get_clock_service(host_self, SYSTEM_CLOCK, &clock_monotonic);
     mach_port_deallocate(mach_task_self(), host_self);
 
-    pthread_create (&libusb_darwin_at, NULL, darwin_event_thread_main, ctx);
+    usbi_thread_create (&libusb_darwin_at, "hotplug", darwin_event_thread_main, ctx);
 
     pthread_mutex_lock (&libusb_darwin_at_mutex);
     while (!libusb_darwin_acfl)
       pthread_cond_wait (&libusb_darwin_at_cond, &libusb_darwin_at_mutex);
     pthread_mutex_unlock (&libusb_darwin_at_mutex);
+
+    darwin_start_io_threads ();
   }
 
   return rc;
 }
 
-static void darwin_exit (void) {
+static void darwin_exit (struct libusb_context *ctx) {
   if (OSAtomicDecrement32Barrier(&initCount) == 0) {
     mach_port_deallocate(mach_task_self(), clock_realtime);
     mach_port_deallocate(mach_task_self(), clock_monotonic);
 
-    /* stop the event runloop and wait for the thread to terminate. */
+    /* stop the event runloops and wait for the threads to terminate. */
+    darwin_stop_io_threads ();
     CFRunLoopStop (libusb_darwin_acfl);
-    pthread_join (libusb_darwin_at, NULL);
+    usbi_thread_join (libusb_darwin_at, NULL);
   }
 }
 
@@ -775,8 +919,7 @@ static int darwin_get_cached_device(struct libusb_context *ctx, io_service_t ser
   do {
     *cached_out = NULL;
 
-    list_for_each_entry(new_device, &darwin_cached_devices, list, struct darwin_cached_device) {
-      usbi_dbg("matching sessionID 0x%" PRIx64 " against cached device with sessionID 0x%" PRIx64, sessionID, new_device->session);
+    list_for_each_entry(new_device, darwin_cached_devices_for_session(sessionID), session_list, struct darwin_cached_device) {
       if (new_device->session == sessionID) {
         usbi_dbg("using cached device for device");
         *cached_out = new_device;
@@ -801,8 +944,9 @@ static int darwin_get_cached_device(struct libusb_context *ctx, io_service_t ser
       break;
     }
 
-    /* add this device to the cached device list */
+    /* add this device to the cached device list and its index */
     list_add(&new_device->list, &darwin_cached_devices);
+    list_add(&new_device->session_list, darwin_cached_devices_for_session(sessionID));
 
     (*device)->GetDeviceAddress (device, (USBDeviceAddress *)&new_device->address);
 
@@ -964,10 +1108,10 @@ static int darwin_open (struct libusb_device_handle *dev_handle) {
       return darwin_to_libusb (kresult);
     }
 
-    CFRetain (libusb_darwin_acfl);
+    dpriv->runloop = darwin_assign_runloop ();
 
     /* add the cfSource to the aync run loop */
-    CFRunLoopAddSource(libusb_darwin_acfl, priv->cfSource, kCFRunLoopCommonModes);
+    CFRunLoopAddSource(dpriv->runloop, priv->cfSource, kCFRunLoopCommonModes);
   }
 
   /* device opened successfully */
@@ -1008,10 +1152,11 @@ static void darwin_close (struct libusb_device_handle *dev_handle) {
   if (0 == dpriv->open_count) {
     /* delete the device's async event source */
     if (priv->cfSource) {
-      CFRunLoopRemoveSource (libusb_darwin_acfl, priv->cfSource, kCFRunLoopDefaultMode);
+      CFRunLoopRemoveSource (dpriv->runloop, priv->cfSource, kCFRunLoopDefaultMode);
       CFRelease (priv->cfSource);
       priv->cfSource = NULL;
-      CFRelease (libusb_darwin_acfl);
+      darwin_unassign_runloop (dpriv->runloop);
+      dpriv->runloop = NULL;
     }
 
     if (priv->is_open) {
@@ -1213,6 +1358,8 @@ static int darwin_claim_interface(struct libusb_device_handle *dev_handle, int i
     return darwin_to_libusb (kresult);
   }
 
+  list_init (&cInterface->ll_transfers);
+
   /* claim the interface */
   kresult = (*(cInterface->interface))->USBInterfaceOpen(cInterface->interface);
   if (kresult) {
@@ -1243,7 +1390,7 @@ static int darwin_claim_interface(struct libusb_device_handle *dev_handle, int i
   }
 
   /* add the cfSource to the async thread's run loop */
-  CFRunLoopAddSource(libusb_darwin_acfl, cInterface->cfSource, kCFRunLoopDefaultMode);
+  CFRunLoopAddSource(DARWIN_CACHED_DEVICE(dev_handle->dev)->runloop, cInterface->cfSource, kCFRunLoopDefaultMode);
 
   usbi_dbg ("interface opened");
 
@@ -1264,9 +1411,12 @@ static int darwin_release_interface(struct libusb_device_handle *dev_handle, int
   /* clean up endpoint data */
   cInterface->num_endpoints = 0;
 
+  /* low latency buffers can not outlive the interface they were created on */
+  darwin_ll_release_interface (cInterface);
+
   /* delete the interface's async event source */
   if (cInterface->cfSource) {
-    CFRunLoopRemoveSource (libusb_darwin_acfl, cInterface->cfSource, kCFRunLoopDefaultMode);
+    CFRunLoopRemoveSource (DARWIN_CACHED_DEVICE(dev_handle->dev)->runloop, cInterface->cfSource, kCFRunLoopDefaultMode);
     CFRelease (cInterface->cfSource);
   }
 
@@ -1525,6 +1675,108 @@ static int submit_stream_transfer(struct usbi_transfer *itransfer) {
 }
 #endif
 
+/* must be called with darwin_ll_lock held */
+static void darwin_ll_free_buffers (struct darwin_transfer_priv *tpriv) {
+  struct darwin_interface *cInterface = tpriv->ll_interface;
+
+  if (!cInterface)
+    return;
+
+  if (tpriv->ll_buffer)
+    (*(cInterface->interface))->LowLatencyDestroyBuffer (cInterface->interface, tpriv->ll_buffer);
+  if (tpriv->ll_framelist)
+    (*(cInterface->interface))->LowLatencyDestroyBuffer (cInterface->interface, tpriv->ll_framelist);
+
+  list_del (&tpriv->ll_list);
+  tpriv->ll_interface = NULL;
+  tpriv->ll_buffer = NULL;
+  tpriv->ll_buffer_size = 0;
+  tpriv->ll_framelist = NULL;
+  tpriv->ll_num_iso_packets = 0;
+}
+
+static void darwin_ll_release_interface (struct darwin_interface *cInterface) {
+  struct darwin_transfer_priv *tpriv, *tmp;
+
+  usbi_mutex_lock (&darwin_ll_lock);
+  list_for_each_entry_safe (tpriv, tmp, &cInterface->ll_transfers, ll_list, struct darwin_transfer_priv)
+    darwin_ll_free_buffers (tpriv);
+  usbi_mutex_unlock (&darwin_ll_lock);
+}
+
+/* make sure the transfer has low latency buffers of the right sizes on cInterface */
+static IOReturn darwin_ll_prepare_buffers (struct darwin_interface *cInterface, struct libusb_transfer *transfer,
+                                           struct darwin_transfer_priv *tpriv) {
+  IOReturn kresult = kIOReturnSuccess;
+
+  usbi_mutex_lock (&darwin_ll_lock);
+
+  if (tpriv->ll_interface && (tpriv->ll_interface != cInterface ||
+                              tpriv->ll_buffer_size < transfer->length ||
+                              tpriv->ll_num_iso_packets != transfer->num_iso_packets))
+    darwin_ll_free_buffers (tpriv);
+
+  if (!tpriv->ll_interface) {
+    tpriv->ll_interface = cInterface;
+    list_add (&tpriv->ll_list, &cInterface->ll_transfers);
+
+    kresult = (*(cInterface->interface))->LowLatencyCreateBuffer (cInterface->interface, &tpriv->ll_buffer, transfer->length,
+                                                                  IS_XFERIN(transfer) ? kUSBLowLatencyReadBuffer :
+                                                                  kUSBLowLatencyWriteBuffer);
+    if (kresult == kIOReturnSuccess) {
+      tpriv->ll_buffer_size = transfer->length;
+      kresult = (*(cInterface->interface))->LowLatencyCreateBuffer (cInterface->interface, (void **) &tpriv->ll_framelist,
+                                                                    transfer->num_iso_packets * sizeof (IOUSBLowLatencyIsocFrame),
+                                                                    kUSBLowLatencyFrameListBuffer);
+    }
+    if (kresult == kIOReturnSuccess)
+      tpriv->ll_num_iso_packets = transfer->num_iso_packets;
+    else
+      darwin_ll_free_buffers (tpriv);
+  }
+
+  usbi_mutex_unlock (&darwin_ll_lock);
+
+  return kresult;
+}
+
+static IOReturn submit_ll_iso_transfer(struct darwin_interface *cInterface, uint8_t pipeRef, UInt64 frame,
+                                       struct usbi_transfer *itransfer) {
+  struct libusb_transfer *transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+  struct darwin_transfer_priv *tpriv = usbi_transfer_get_os_priv(itransfer);
+  IOReturn kresult;
+  int i;
+
+  kresult = darwin_ll_prepare_buffers (cInterface, transfer, tpriv);
+  if (kresult != kIOReturnSuccess) {
+    usbi_err (TRANSFER_CTX (transfer), "could not allocate low latency buffers: %s", darwin_error_str(kresult));
+    return kresult;
+  }
+
+  for (i = 0 ; i < transfer->num_iso_packets ; i++) {
+    tpriv->ll_framelist[i].frStatus = kIOReturnInvalid;
+    tpriv->ll_framelist[i].frReqCount = transfer->iso_packet_desc[i].length;
+    tpriv->ll_framelist[i].frActCount = 0;
+  }
+
+  if (IS_XFEROUT(transfer))
+    memcpy (tpriv->ll_buffer, transfer->buffer, transfer->length);
+
+  /* an update frequency of 0 only updates the frame list on completion */
+  if (IS_XFERIN(transfer))
+    kresult = (*(cInterface->interface))->LowLatencyReadIsochPipeAsync(cInterface->interface, pipeRef, tpriv->ll_buffer, frame,
+                                                                       transfer->num_iso_packets, 0, tpriv->ll_framelist,
+                                                                       darwin_async_io_callback, itransfer);
+  else
+    kresult = (*(cInterface->interface))->LowLatencyWriteIsochPipeAsync(cInterface->interface, pipeRef, tpriv->ll_buffer, frame,
+                                                                        transfer->num_iso_packets, 0, tpriv->ll_framelist,
+                                                                        darwin_async_io_callback, itransfer);
+
+  tpriv->ll_active = (kresult == kIOReturnSuccess);
+
+  return kresult;
+}
+
 static int submit_iso_transfer(struct usbi_transfer *itransfer) {
   struct libusb_transfer *transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
   struct darwin_transfer_priv *tpriv = usbi_transfer_get_os_priv(itransfer);
@@ -1538,22 +1790,27 @@ static int submit_iso_transfer(struct usbi_transfer *itransfer) {
 
   struct darwin_interface *cInterface;
 
-  /* construct an array of IOUSBIsocFrames, reuse the old one if possible */
-  if (tpriv->isoc_framelist && tpriv->num_iso_packets != transfer->num_iso_packets) {
-    free(tpriv->isoc_framelist);
-    tpriv->isoc_framelist = NULL;
-  }
+  tpriv->ll_active = 0;
 
-  if (!tpriv->isoc_framelist) {
-    tpriv->num_iso_packets = transfer->num_iso_packets;
-    tpriv->isoc_framelist = (IOUSBIsocFrame*) calloc (transfer->num_iso_packets, sizeof(IOUSBIsocFrame));
-    if (!tpriv->isoc_framelist)
-      return LIBUSB_ERROR_NO_MEM;
-  }
+  /* the low latency path uses its own frame list */
+  if (!(transfer->flags & LIBUSB_TRANSFER_LOW_LATENCY)) {
+    /* construct an array of IOUSBIsocFrames, reuse the old one if possible */
+    if (tpriv->isoc_framelist && tpriv->num_iso_packets != transfer->num_iso_packets) {
+      free(tpriv->isoc_framelist);
+      tpriv->isoc_framelist = NULL;
+    }
 
-  /* copy the frame list from the libusb descriptor (the structures differ only is member order) */
-  for (i = 0 ; i < transfer->num_iso_packets ; i++)
-    tpriv->isoc_framelist[i].frReqCount = transfer->iso_packet_desc[i].length;
+    if (!tpriv->isoc_framelist) {
+      tpriv->num_iso_packets = transfer->num_iso_packets;
+      tpriv->isoc_framelist = (IOUSBIsocFrame*) calloc (transfer->num_iso_packets, sizeof(IOUSBIsocFrame));
+      if (!tpriv->isoc_framelist)
+        return LIBUSB_ERROR_NO_MEM;
+    }
+
+    /* copy the frame list from the libusb descriptor (the structures differ only is member order) */
+    for (i = 0 ; i < transfer->num_iso_packets ; i++)
+      tpriv->isoc_framelist[i].frReqCount = transfer->iso_packet_desc[i].length;
+  }
 
   /* determine the interface/endpoint to use */
   if (ep_to_pipeRef (transfer->dev_handle, transfer->endpoint, &pipeRef, NULL, &cInterface) != 0) {
@@ -1586,7 +1843,9 @@ static int submit_iso_transfer(struct usbi_transfer *itransfer) {
     frame = cInterface->frames[transfer->endpoint];
 
   /* submit the request */
-  if (IS_XFERIN(transfer))
+  if (transfer->flags & LIBUSB_TRANSFER_LOW_LATENCY)
+    kresult = submit_ll_iso_transfer (cInterface, pipeRef, frame, itransfer);
+  else if (IS_XFERIN(transfer))
     kresult = (*(cInterface->interface))->ReadIsochPipeAsync(cInterface->interface, pipeRef, transfer->buffer, frame,
                                                              transfer->num_iso_packets, tpriv->isoc_framelist, darwin_async_io_callback,
                                                              itransfer);
@@ -1756,6 +2015,18 @@ static void darwin_clear_transfer_priv (struct usbi_transfer *itransfer) {
     free (tpriv->isoc_framelist);
     tpriv->isoc_framelist = NULL;
   }
+  tpriv->ll_active = 0;
+}
+
+static void darwin_free_transfer_priv (struct usbi_transfer *itransfer) {
+  struct darwin_transfer_priv *tpriv = usbi_transfer_get_os_priv(itransfer);
+
+  usbi_mutex_lock (&darwin_ll_lock);
+  darwin_ll_free_buffers (tpriv);
+  usbi_mutex_unlock (&darwin_ll_lock);
+
+  free (tpriv->isoc_framelist);
+  tpriv->isoc_framelist = NULL;
 }
 
 static void darwin_async_io_callback (void *refcon, IOReturn result, void *arg0) {
@@ -1777,6 +2048,13 @@ static void darwin_async_io_callback (void *refcon, IOReturn result, void *arg0)
     (*(cInterface->interface))->WritePipe (cInterface->interface, pipeRef, transfer->buffer, 0);
   }
 
+  if (transfer->flags & LIBUSB_TRANSFER_DIRECT_COMPLETION) {
+    /* complete the transfer on this thread, then post an empty message so
+     * that threads waiting for events notice the completion */
+    darwin_handle_callback (itransfer, result, message.size);
+    message.itransfer = NULL;
+  }
+
   /* send a completion message to the device's file descriptor */
   write (priv->fds[1], &message, sizeof (message));
 }
@@ -1825,7 +2103,17 @@ static void darwin_handle_callback (struct usbi_transfer *itransfer, kern_return
              isControl ? "control" : isBulk ? "bulk" : isIsoc ? "isoc" : "interrupt", result);
 
   if (kIOReturnSuccess == result || kIOReturnUnderrun == result) {
-    if (isIsoc && tpriv->isoc_framelist) {
+    if (isIsoc && tpriv->ll_active) {
+      /* copy low latency results back */
+      for (i = 0; i < transfer->num_iso_packets ; i++) {
+        struct libusb_iso_packet_descriptor *lib_desc = &transfer->iso_packet_desc[i];
+        lib_desc->status = darwin_to_libusb (tpriv->ll_framelist[i].frStatus);
+        lib_desc->actual_length = tpriv->ll_framelist[i].frActCount;
+      }
+
+      if (IS_XFERIN(transfer))
+        memcpy (transfer->buffer, tpriv->ll_buffer, transfer->length);
+    } else if (isIsoc && tpriv->isoc_framelist) {
       /* copy isochronous results back */
 
       for (i = 0; i < transfer->num_iso_packets ; i++) {
@@ -1870,7 +2158,9 @@ static int op_handle_events(struct libusb_context *ctx, struct pollfd *fds, POLL
       continue;
     }
 
-    darwin_handle_callback (message.itransfer, message.result, message.size);
+    /* transfers with LIBUSB_TRANSFER_DIRECT_COMPLETION have already been handled */
+    if (message.itransfer)
+      darwin_handle_callback (message.itransfer, message.result, message.size);
   }
 
   usbi_mutex_unlock(&ctx->open_devs_lock);
@@ -1997,6 +2287,7 @@ const struct usbi_os_backend darwin_backend = {
         .submit_transfer = darwin_submit_transfer,
         .cancel_transfer = darwin_cancel_transfer,
         .clear_transfer_priv = darwin_clear_transfer_priv,
+        .free_transfer_priv = darwin_free_transfer_priv,
 
         .handle_events = op_handle_events,
 
@@ -108,8 +108,14 @@ typedef IOCFPlugInInterface *io_cf_plugin_ref_t;
 typedef IONotificationPortRef io_notification_port_t;
 
 /* private structures */
+/* number of hash buckets for the cached devices by session ID. must be a
+ * power of 2 */
+#define DARWIN_CACHED_DEVICE_BUCKETS 256
+
 struct darwin_cached_device {
   struct list_head      list;
+  /* entry in the darwin_cached_devices_by_session bucket of the session */
+  struct list_head      session_list;
   IOUSBDeviceDescriptor dev_descriptor;
   UInt32                location;
   UInt64                parent_session;
@@ -121,6 +127,8 @@ struct darwin_cached_device {
   UInt8                 first_config, active_config, port;  
   int                   can_enumerate;
   int                   refcount;
+  /* run loop servicing the async event sources of the open device */
+  CFRunLoopRef          runloop;
 };
 
 struct darwin_device_priv {
@@ -138,6 +146,8 @@ struct darwin_device_handle_priv {
     CFRunLoopSourceRef   cfSource;
     uint64_t             frames[256];
     uint8_t              endpoint_addrs[USB_MAXENDPOINTS];
+    /* transfers holding low latency buffers of this interface */
+    struct list_head     ll_transfers;
   } interfaces[USB_MAXINTERFACES];
 };
 
@@ -146,6 +156,16 @@ struct darwin_transfer_priv {
   IOUSBIsocFrame *isoc_framelist;
   int num_iso_packets;
 
+  /* Low latency isoc, see LIBUSB_TRANSFER_LOW_LATENCY. The buffers belong to
+   * ll_interface and are kept across submissions. */
+  struct darwin_interface *ll_interface;
+  struct list_head ll_list;
+  void *ll_buffer;
+  int ll_buffer_size;
+  IOUSBLowLatencyIsocFrame *ll_framelist;
+  int ll_num_iso_packets;
+  int ll_active;
+
   /* Control */
   IOUSBDevRequestTO req;
 
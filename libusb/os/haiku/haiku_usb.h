@@ -17,7 +17,6 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
  */
 
-#include <List.h>
 #include <Locker.h>
 #include <Autolock.h>
 #include <USBKit.h>
@@ -31,6 +30,26 @@ class USBDevice;
 class USBDeviceHandle;
 class USBTransfer;
 
+// Link embedded in every transfer, so queueing one never allocates
+struct USBTransferLink {
+	USBTransferLink*			fNext;
+};
+
+// Lock-free queue of transfers for one endpoint. Push() is only called by
+// the submitting thread (libusb serialises submissions per handle) and
+// Pop() only by the endpoint's worker thread.
+class USBTransferQueue {
+public:
+						USBTransferQueue();
+	void					Push(USBTransfer*);
+	USBTransfer*				Pop();
+private:
+	void					Link(USBTransferLink*);
+	USBTransferLink*			fHead;	// last pushed, written by the producer
+	USBTransferLink*			fTail;	// next to pop, owned by the consumer
+	USBTransferLink				fStub;
+};
+
 class USBDevice {
 public:
 						USBDevice(const char *);
@@ -42,6 +61,7 @@ public:
 	const usb_configuration_descriptor* 	ActiveConfiguration() const;
 	uint8 					EndpointToIndex(uint8) const;
 	uint8 					EndpointToInterface(uint8) const;
+	static int				EndpointSlot(uint8);
 	int 					ClaimInterface(int);
 	int 					ReleaseInterface(int);
 	int 					CheckInterfacesFree(int);
@@ -56,8 +76,8 @@ private:
 	int					fActiveConfiguration;
 	char*					fPath;
 	map<uint8,uint8>			fConfigToIndex;
-	map<uint8,uint8>*			fEndpointToIndex;
-	map<uint8,uint8>*			fEndpointToInterface;
+	uint8					(*fEndpointToIndex)[32];	// per configuration, by EndpointSlot()
+	uint8					(*fEndpointToInterface)[32];
 	bool					fInitCheck;
 };
 
@@ -74,20 +94,26 @@ public:
 	status_t		CancelTransfer(USBTransfer*);
 	bool			InitCheck();
 private:
+	// One queue and worker thread per endpoint address, started on first use
+	struct EndpointWorker {
+		USBDeviceHandle*	fHandle;
+		USBTransferQueue	fQueue;
+		sem_id			fSem;		// counts queued transfers
+		thread_id		fThread;
+	};
+	static int		EndpointToWorker(struct libusb_transfer*);
+	EndpointWorker*		StartWorker(int);
 	int 			fRawFD;
 	static status_t		TransfersThread(void *);
-	void 			TransfersWorker();
+	void 			TransfersWorker(EndpointWorker*);
 	USBDevice*		fUSBDevice;
 	unsigned int		fClaimedInterfaces;
 	int 			fEventPipes[2];
-	BList 			fTransfers;
-	BLocker 		fTransfersLock;
-	sem_id 			fTransfersSem;
-	thread_id 		fTransfersThread;
+	EndpointWorker*		fWorkers[32];	// indexed by direction and endpoint number
 	bool			fInitCheck;
 };
 
-class USBTransfer {
+class USBTransfer : public USBTransferLink {
 public:
 					USBTransfer(struct usbi_transfer*,USBDevice*);
 	virtual				~USBTransfer();
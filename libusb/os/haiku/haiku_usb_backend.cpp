@@ -185,27 +185,122 @@ USBDeviceHandle::InitCheck()
 	return fInitCheck;
 }
 
+USBTransferQueue::USBTransferQueue()
+{
+	fStub.fNext=NULL;
+	fHead=&fStub;
+	fTail=&fStub;
+}
+
+void
+USBTransferQueue::Link(USBTransferLink* link)
+{
+	link->fNext=NULL;
+	USBTransferLink* previous=__atomic_exchange_n(&fHead,link,__ATOMIC_ACQ_REL);
+	__atomic_store_n(&previous->fNext,link,__ATOMIC_RELEASE);
+}
+
+void
+USBTransferQueue::Push(USBTransfer* transfer)
+{
+	Link(transfer);
+}
+
+USBTransfer*
+USBTransferQueue::Pop()
+{
+	USBTransferLink* tail=fTail;
+	USBTransferLink* next=__atomic_load_n(&tail->fNext,__ATOMIC_ACQUIRE);
+	if(tail==&fStub)
+	{
+		if(next==NULL)
+			return NULL;
+		fTail=next;
+		tail=next;
+		next=__atomic_load_n(&next->fNext,__ATOMIC_ACQUIRE);
+	}
+	if(next!=NULL)
+	{
+		fTail=next;
+		return static_cast<USBTransfer*>(tail);
+	}
+	if(tail!=__atomic_load_n(&fHead,__ATOMIC_ACQUIRE))
+		return NULL;
+	// tail is the last transfer; park the stub behind it so it can be unlinked
+	Link(&fStub);
+	next=__atomic_load_n(&tail->fNext,__ATOMIC_ACQUIRE);
+	if(next!=NULL)
+	{
+		fTail=next;
+		return static_cast<USBTransfer*>(tail);
+	}
+	return NULL;
+}
+
+int
+USBDeviceHandle::EndpointToWorker(struct libusb_transfer* transfer)
+{
+	if(transfer->type==LIBUSB_TRANSFER_TYPE_CONTROL)
+		return 0;
+	return USBDevice::EndpointSlot(transfer->endpoint);
+}
+
+USBDeviceHandle::EndpointWorker*
+USBDeviceHandle::StartWorker(int index)
+{
+	EndpointWorker* worker=new(std::nothrow) EndpointWorker;
+	if(worker==NULL)
+		return NULL;
+	worker->fHandle=this;
+	worker->fSem=create_sem(0, "Transfers Queue Sem");
+	if(worker->fSem<B_OK)
+	{
+		delete worker;
+		return NULL;
+	}
+	worker->fThread=spawn_thread(TransfersThread,"Transfer Worker",B_NORMAL_PRIORITY, worker);
+	if(worker->fThread<B_OK)
+	{
+		delete_sem(worker->fSem);
+		delete worker;
+		return NULL;
+	}
+	// The registry renames the thread and sets its priority from the thread options
+	if(usbi_haiku_thread_add(worker->fThread, "xfer")<0)
+	{
+		kill_thread(worker->fThread);
+		delete_sem(worker->fSem);
+		delete worker;
+		return NULL;
+	}
+	resume_thread(worker->fThread);
+	fWorkers[index]=worker;
+	return worker;
+}
+
 status_t
 USBDeviceHandle::TransfersThread(void* self)
 {
-	USBDeviceHandle* handle = (USBDeviceHandle*)self;
-	handle->TransfersWorker();
+	EndpointWorker* worker = (EndpointWorker*)self;
+	worker->fHandle->TransfersWorker(worker);
 	return B_OK;
 }
 
 void
-USBDeviceHandle::TransfersWorker()
+USBDeviceHandle::TransfersWorker(EndpointWorker* worker)
 {
 	while(true)
 	{
-		status_t status = acquire_sem(fTransfersSem);
+		status_t status = acquire_sem(worker->fSem);
 		if(status== B_BAD_SEM_ID)
 			break;
 		if(status == B_INTERRUPTED)
 			continue;
-		fTransfersLock.Lock();
-		USBTransfer* fPendingTransfer= (USBTransfer*) fTransfers.RemoveItem((int32)0);
-		fTransfersLock.Unlock();
+		// the semaphore is released after the push completes, but another
+		// push may still be linking in behind it
+		USBTransfer* fPendingTransfer;
+		while((fPendingTransfer=worker->fQueue.Pop())==NULL)
+			snooze(10);
 		fPendingTransfer->Do(fRawFD);
 		write(fEventPipes[1],&fPendingTransfer,sizeof(fPendingTransfer));
 	}
@@ -214,35 +309,40 @@ USBDeviceHandle::TransfersWorker()
 status_t
 USBDeviceHandle::SubmitTransfer(struct usbi_transfer* itransfer)
 {
-	USBTransfer* transfer = new USBTransfer(itransfer,fUSBDevice);
+	struct libusb_transfer* ltransfer=USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	int index=EndpointToWorker(ltransfer);
+	EndpointWorker* worker=fWorkers[index];
+	if(worker==NULL)
+	{
+		worker=StartWorker(index);
+		if(worker==NULL)
+			return LIBUSB_ERROR_NO_MEM;
+	}
+	USBTransfer* transfer = new(std::nothrow) USBTransfer(itransfer,fUSBDevice);
+	if(transfer==NULL)
+		return LIBUSB_ERROR_NO_MEM;
 	*((USBTransfer**)usbi_transfer_get_os_priv(itransfer))=transfer;
-	BAutolock locker(fTransfersLock);
-	fTransfers.AddItem(transfer);
-	release_sem(fTransfersSem);
+	worker->fQueue.Push(transfer);
+	release_sem(worker->fSem);
 	return LIBUSB_SUCCESS;
 }
 
 status_t
 USBDeviceHandle::CancelTransfer(USBTransfer* transfer)
 {
+	// the worker skips a cancelled transfer when it reaches the head of its
+	// endpoint's queue and reports it through the event pipe as usual
 	transfer->SetCancelled();
-	fTransfersLock.Lock();
-	bool removed = fTransfers.RemoveItem(transfer);
-	fTransfersLock.Unlock();
-	if(removed)
-	{
-		write(fEventPipes[1],&transfer,sizeof(transfer));
-	}
 	return LIBUSB_SUCCESS;
 }
 
 USBDeviceHandle::USBDeviceHandle(USBDevice* dev)
 	:
-	fTransfersThread(-1),
 	fUSBDevice(dev),
 	fClaimedInterfaces(0),
 	fInitCheck(false)
 {
+	memset(fWorkers, 0, sizeof(fWorkers));
 	fRawFD=open(dev->Location(), O_RDWR | O_CLOEXEC);
 	if(fRawFD < 0)
 	{
@@ -251,14 +351,20 @@ USBDeviceHandle::USBDeviceHandle(USBDevice* dev)
 	}
 	pipe(fEventPipes);
 	fcntl(fEventPipes[1], F_SETFD, O_NONBLOCK);
-	fTransfersSem = create_sem(0, "Transfers Queue Sem");
-	fTransfersThread = spawn_thread(TransfersThread,"Transfer Worker",B_NORMAL_PRIORITY, this);
-	resume_thread(fTransfersThread);
 	fInitCheck = true;
 }
 
 USBDeviceHandle::~USBDeviceHandle()
 {
+	for(int i=0; i<32; i++)
+	{
+		if(fWorkers[i]==NULL)
+			continue;
+		usbi_haiku_thread_remove(fWorkers[i]->fThread);
+		delete_sem(fWorkers[i]->fSem);
+		wait_for_thread(fWorkers[i]->fThread, NULL);
+		delete fWorkers[i];
+	}
 	if(fRawFD>0)
 		close(fRawFD);
 	for(int i=0; i<32; i++)
@@ -270,9 +376,6 @@ USBDeviceHandle::~USBDeviceHandle()
 		close(fEventPipes[1]);
 	if(fEventPipes[0]>0)
 		close(fEventPipes[0]);
-	delete_sem(fTransfersSem);
-	if(fTransfersThread>0)
-		wait_for_thread(fTransfersThread, NULL);
 }
 
 int
@@ -455,16 +558,22 @@ USBDevice::SetActiveConfiguration(int config_index)
 	return LIBUSB_SUCCESS;
 }
 
+int
+USBDevice::EndpointSlot(uint8 address)
+{
+	return (address & 0x0f) | ((address & LIBUSB_ENDPOINT_IN) ? 0x10 : 0);
+}
+
 uint8
 USBDevice::EndpointToIndex(uint8 address) const
 {
-	return fEndpointToIndex[fActiveConfiguration][address];
+	return fEndpointToIndex[fActiveConfiguration][EndpointSlot(address)];
 }
 
 uint8
 USBDevice::EndpointToInterface(uint8 address) const
 {
-	return fEndpointToInterface[fActiveConfiguration][address];
+	return fEndpointToInterface[fActiveConfiguration][EndpointSlot(address)];
 }
 
 int 
@@ -483,9 +592,14 @@ USBDevice::Initialise()		//Do we need more error checking, etc? How to report?
 	}
 	
 	size_t size;
-	fConfigurationDescriptors = new(std::nothrow) unsigned char*[fDeviceDescriptor.num_configurations];
-	fEndpointToIndex = new(std::nothrow) map<uint8,uint8> [fDeviceDescriptor.num_configurations];
-	fEndpointToInterface = new(std::nothrow) map<uint8,uint8> [fDeviceDescriptor.num_configurations];
+	fConfigurationDescriptors = new(std::nothrow) unsigned char*[fDeviceDescriptor.num_configurations]();
+	fEndpointToIndex = new(std::nothrow) uint8[fDeviceDescriptor.num_configurations][32]();
+	fEndpointToInterface = new(std::nothrow) uint8[fDeviceDescriptor.num_configurations][32]();
+	if(fConfigurationDescriptors==NULL || fEndpointToIndex==NULL || fEndpointToInterface==NULL)
+	{
+		close(fRawFD);
+		return B_NO_MEMORY;
+	}
 	for( int i=0; i<fDeviceDescriptor.num_configurations; i++)
 	{
 		size=0;
@@ -550,8 +664,9 @@ USBDevice::Initialise()		//Do we need more error checking, etc? How to report?
 						close(fRawFD);
 						return B_ERROR;
 					}
-					fEndpointToIndex[i][tmp_endpoint.endpoint_address]=l;
-					fEndpointToInterface[i][tmp_endpoint.endpoint_address]=j;
+					int slot=EndpointSlot(tmp_endpoint.endpoint_address);
+					fEndpointToIndex[i][slot]=l;
+					fEndpointToInterface[i][slot]=j;
 				}
 			}
 		}
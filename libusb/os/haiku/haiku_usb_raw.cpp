@@ -40,7 +40,7 @@ haiku_init(struct libusb_context* ctx)
 }
 
 static void
-haiku_exit(void)
+haiku_exit(struct libusb_context *ctx)
 {
 	if (atomic_add(&gInitCount, -1) == 1)
 		gUsbRoster.Stop();
@@ -224,11 +224,13 @@ const struct usbi_os_backend haiku_usb_raw_backend = {
 	/*.get_device_list =*/ NULL,
 	/*.hotplug_poll =*/ NULL,
 	/*.open =*/ haiku_open,
+	/*.wrap_sys_device =*/ NULL,
 	/*.close =*/ haiku_close,
 	/*.get_device_descriptor =*/ haiku_get_device_descriptor,
 	/*.get_active_config_descriptor =*/ haiku_get_active_config_descriptor,
 	/*.get_config_descriptor =*/ haiku_get_config_descriptor,
 	/*.get_config_descriptor_by_value =*/ NULL,
+	/*.get_device_string =*/ NULL,
 
 
 	/*.get_configuration =*/ NULL,
@@ -243,6 +245,11 @@ const struct usbi_os_backend haiku_usb_raw_backend = {
 	/*.alloc_streams =*/ NULL,
 	/*.free_streams =*/ NULL,
 
+	/*.dev_mem_alloc =*/ NULL,
+	/*.dev_mem_free =*/ NULL,
+	/*.set_endpoint_policy =*/ NULL,
+	/*.get_endpoint_policy =*/ NULL,
+
 	/*.kernel_driver_active =*/ NULL,
 	/*.detach_kernel_driver =*/ NULL,
 	/*.attach_kernel_driver =*/ NULL,
@@ -252,8 +259,13 @@ const struct usbi_os_backend haiku_usb_raw_backend = {
 	/*.submit_transfer =*/ haiku_submit_transfer,
 	/*.cancel_transfer =*/ haiku_cancel_transfer,
 	/*.clear_transfer_priv =*/ haiku_clear_transfer_priv,
+	/*.free_transfer_priv =*/ NULL,
+	/*.sync_control_transfer =*/ NULL,
+	/*.sync_bulk_transfer =*/ NULL,
 
 	/*.handle_events =*/ haiku_handle_events,
+	/*.get_pollfd =*/ NULL,
+	/*.busy_poll =*/ NULL,
 
 	/*.clock_gettime =*/ haiku_clock_gettime,
 
@@ -55,6 +55,12 @@
 
 #define KERNEL 1
 
+/* the kernel never sends uevents larger than this (UEVENT_BUFFER_SIZE) */
+#define NETLINK_MESSAGE_SIZE 2048
+
+/* number of uevents taken from the socket in one go */
+#define NETLINK_BATCH 16
+
 static int linux_netlink_socket = -1;
 static int netlink_control_pipe[2] = { -1, -1 };
 static pthread_t libusb_linux_event_thread;
@@ -90,6 +96,33 @@ static int set_fd_cloexec_nb (int fd)
 	return 0;
 }
 
+/* have the kernel drop all uevents but "add" and "remove" ones (bind,
+ * unbind, change, ...) before they wake up the event thread. the action is
+ * the only field at a fixed offset, in the "ACTION@DEVPATH" header. */
+static void set_socket_filter(void)
+{
+	struct sock_filter filter[] = {
+		/* "add@" */
+		BPF_STMT(BPF_LD | BPF_W | BPF_ABS, 0),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0x61646440, 3, 0),
+		/* "remove@" */
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0x72656d6f, 0, 3),
+		BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 4),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0x7665, 0, 1),
+		BPF_STMT(BPF_RET | BPF_K, 0xffffffff),
+		BPF_STMT(BPF_RET | BPF_K, 0),
+	};
+	struct sock_fprog program = {
+		.len = sizeof(filter) / sizeof(filter[0]),
+		.filter = filter,
+	};
+
+	/* not fatal, the messages are checked anyway */
+	if (setsockopt(linux_netlink_socket, SOL_SOCKET, SO_ATTACH_FILTER,
+			&program, sizeof(program)))
+		usbi_dbg("failed to attach netlink socket filter, errno=%d", errno);
+}
+
 int linux_netlink_start_event_monitor(void)
 {
 	int socktype = SOCK_RAW;
@@ -120,6 +153,8 @@ int linux_netlink_start_event_monitor(void)
 		return LIBUSB_ERROR_OTHER;
 	}
 
+	set_socket_filter();
+
 	ret = bind(linux_netlink_socket, (struct sockaddr *) &snl, sizeof(snl));
 	if (0 != ret) {
 	        close(linux_netlink_socket);
@@ -136,7 +171,8 @@ int linux_netlink_start_event_monitor(void)
 		return LIBUSB_ERROR_OTHER;
 	}
 
-	ret = pthread_create(&libusb_linux_event_thread, NULL, linux_netlink_event_thread_main, NULL);
+	ret = usbi_thread_create(&libusb_linux_event_thread, "hotplug",
+		linux_netlink_event_thread_main, NULL);
 	if (0 != ret) {
         	close(netlink_control_pipe[0]);
         	close(netlink_control_pipe[1]);
@@ -163,7 +199,7 @@ int linux_netlink_stop_event_monitor(void)
 	if (r <= 0) {
 		usbi_warn(NULL, "netlink control pipe signal failed");
 	}
-	pthread_join(libusb_linux_event_thread, NULL);
+	usbi_thread_join(libusb_linux_event_thread, NULL);
 
 	close(linux_netlink_socket);
 	linux_netlink_socket = -1;
@@ -177,26 +213,62 @@ int linux_netlink_stop_event_monitor(void)
 	return LIBUSB_SUCCESS;
 }
 
-static const char *netlink_message_parse (const char *buffer, size_t len, const char *key)
+/* the fields of a uevent that libusb looks at */
+struct netlink_uevent {
+	const char *action;
+	const char *subsystem;
+	const char *devtype;
+	const char *busnum;
+	const char *devnum;
+	const char *device;
+	const char *devpath;
+};
+
+/* picks the fields out of the KEY=value strings of a message, in a single
+ * pass. the message must be nul-terminated. */
+static void netlink_message_parse(const char *buffer, size_t len,
+	struct netlink_uevent *uevent)
 {
-	size_t keylen = strlen(key);
-	size_t offset;
-
-	for (offset = 0 ; offset < len && '\0' != buffer[offset] ; offset += strlen(buffer + offset) + 1) {
-		if (0 == strncmp(buffer + offset, key, keylen) &&
-		    '=' == buffer[offset + keylen]) {
-			return buffer + offset + keylen + 1;
+	const char *end = buffer + len;
+	const char *key, *value;
+
+	memset(uevent, 0, sizeof(*uevent));
+	for (key = buffer; key < end && '\0' != *key; key += strlen(key) + 1) {
+		value = strchr(key, '=');
+		if (NULL == value)
+			continue;
+
+		/* the key lengths tell the keys apart with one compare */
+		switch (value++ - key) {
+		case 6:
+			if (0 == memcmp(key, "ACTION", 6))
+				uevent->action = value;
+			else if (0 == memcmp(key, "BUSNUM", 6))
+				uevent->busnum = value;
+			else if (0 == memcmp(key, "DEVNUM", 6))
+				uevent->devnum = value;
+			else if (0 == memcmp(key, "DEVICE", 6))
+				uevent->device = value;
+			break;
+		case 7:
+			if (0 == memcmp(key, "DEVTYPE", 7))
+				uevent->devtype = value;
+			else if (0 == memcmp(key, "DEVPATH", 7))
+				uevent->devpath = value;
+			break;
+		case 9:
+			if (0 == memcmp(key, "SUBSYSTEM", 9))
+				uevent->subsystem = value;
+			break;
 		}
 	}
-
-	return NULL;
 }
 
 /* parse parts of netlink message common to both libudev and the kernel */
 static int linux_netlink_parse(char *buffer, size_t len, int *detached, const char **sys_name,
 			       uint8_t *busnum, uint8_t *devaddr) {
+	struct netlink_uevent uevent;
 	const char *tmp;
-	int i;
 
 	errno = 0;
 
@@ -205,7 +277,9 @@ static int linux_netlink_parse(char *buffer, size_t len, int *detached, const ch
 	*busnum   = 0;
 	*devaddr  = 0;
 
-	tmp = netlink_message_parse((const char *) buffer, len, "ACTION");
+	netlink_message_parse((const char *) buffer, len, &uevent);
+
+	tmp = uevent.action;
 	if (tmp == NULL)
 		return -1;
 	if (0 == strcmp(tmp, "remove")) {
@@ -216,16 +290,24 @@ static int linux_netlink_parse(char *buffer, size_t len, int *detached, const ch
 	}
 
 	/* check that this is a usb message */
-	tmp = netlink_message_parse(buffer, len, "SUBSYSTEM");
+	tmp = uevent.subsystem;
 	if (NULL == tmp || 0 != strcmp(tmp, "usb")) {
 		/* not usb. ignore */
 		return -1;
 	}
 
-	tmp = netlink_message_parse(buffer, len, "BUSNUM");
+	/* interfaces share the subsystem of their device. kernels too old to
+	 * report the type only have device messages with a bus number */
+	tmp = uevent.devtype;
+	if (NULL != tmp && 0 != strcmp(tmp, "usb_device")) {
+		/* not a device. ignore */
+		return -1;
+	}
+
+	tmp = uevent.busnum;
 	if (NULL == tmp) {
 		/* no bus number. try "DEVICE" */
-		tmp = netlink_message_parse(buffer, len, "DEVICE");
+		tmp = uevent.device;
 		if (NULL == tmp) {
 			/* not usb. ignore */
 			return -1;
@@ -258,7 +340,7 @@ static int linux_netlink_parse(char *buffer, size_t len, int *detached, const ch
 		return -1;
 	}
 
-	tmp = netlink_message_parse(buffer, len, "DEVNUM");
+	tmp = uevent.devnum;
 	if (NULL == tmp) {
 		return -1;
 	}
@@ -269,44 +351,34 @@ static int linux_netlink_parse(char *buffer, size_t len, int *detached, const ch
 		return -1;
 	}
 
-	tmp = netlink_message_parse(buffer, len, "DEVPATH");
+	tmp = uevent.devpath;
 	if (NULL == tmp) {
 		return -1;
 	}
 
-	for (i = strlen(tmp) - 1 ; i ; --i) {
-		if ('/' ==tmp[i]) {
-			*sys_name = tmp + i + 1;
-			break;
-		}
-	}
+	tmp = strrchr(tmp, '/');
+	if (NULL != tmp && tmp[1])
+		*sys_name = tmp + 1;
 
 	/* found a usb device */
 	return 0;
 }
 
-static int linux_netlink_read_message(void)
+static int linux_netlink_handle_message(char *buffer, size_t len)
 {
-	unsigned char buffer[1024];
-	struct iovec iov = {.iov_base = buffer, .iov_len = sizeof(buffer)};
-	struct msghdr meh = { .msg_iov=&iov, .msg_iovlen=1,
-			     .msg_name=&snl, .msg_namelen=sizeof(snl) };
 	const char *sys_name = NULL;
 	uint8_t busnum, devaddr;
 	int detached, r;
-	size_t len;
 
-	/* read netlink message */
-	memset(buffer, 0, sizeof(buffer));
-	len = recvmsg(linux_netlink_socket, &meh, 0);
 	if (len < 32) {
-		if (errno != EAGAIN)
-			usbi_dbg("error recieving message from netlink");
+		usbi_dbg("ignoring short netlink message");
 		return -1;
 	}
 
 	/* TODO -- authenticate this message is from the kernel or udevd */
 
+	/* messages end with a nul, but make sure of it */
+	buffer[len] = '\0';
 	r = linux_netlink_parse(buffer, len, &detached, &sys_name,
 				&busnum, &devaddr);
 	if (r)
@@ -324,6 +396,56 @@ static int linux_netlink_read_message(void)
 	return 0;
 }
 
+/* reads and handles up to NETLINK_BATCH messages. returns 0 if there were
+ * messages, or -1 if there were none (or reading failed). called with
+ * linux_hotplug_lock held, which also protects the buffers. */
+static int linux_netlink_read_messages(void)
+{
+	static char buffers[NETLINK_BATCH][NETLINK_MESSAGE_SIZE + 1];
+	struct iovec iov[NETLINK_BATCH];
+	ssize_t len;
+
+#ifdef HAVE_RECVMMSG
+	struct mmsghdr msgs[NETLINK_BATCH];
+	int i, count;
+
+	memset(msgs, 0, sizeof(msgs));
+	for (i = 0; i < NETLINK_BATCH; i++) {
+		iov[i].iov_base = buffers[i];
+		iov[i].iov_len = NETLINK_MESSAGE_SIZE;
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+	count = recvmmsg(linux_netlink_socket, msgs, NETLINK_BATCH, 0, NULL);
+	if (count > 0) {
+		for (i = 0; i < count; i++)
+			linux_netlink_handle_message(buffers[i], msgs[i].msg_len);
+		return 0;
+	}
+	if (errno != ENOSYS) {
+		if (errno != EAGAIN)
+			usbi_dbg("error recieving message from netlink");
+		return -1;
+	}
+#endif
+
+	/* one message at a time */
+	{
+		struct msghdr meh = { .msg_iov=&iov[0], .msg_iovlen=1 };
+
+		iov[0].iov_base = buffers[0];
+		iov[0].iov_len = NETLINK_MESSAGE_SIZE;
+		len = recvmsg(linux_netlink_socket, &meh, 0);
+		if (len < 0) {
+			if (errno != EAGAIN)
+				usbi_dbg("error recieving message from netlink");
+			return -1;
+		}
+		linux_netlink_handle_message(buffers[0], (size_t)len);
+	}
+	return 0;
+}
+
 static void *linux_netlink_event_thread_main(void *arg)
 {
 	char dummy;
@@ -349,7 +471,7 @@ static void *linux_netlink_event_thread_main(void *arg)
 		}
 		if (fds[1].revents & POLLIN) {
         		usbi_mutex_static_lock(&linux_hotplug_lock);
-	        	linux_netlink_read_message();
+	        	linux_netlink_read_messages();
 	        	usbi_mutex_static_unlock(&linux_hotplug_lock);
 		}
 	}
@@ -363,7 +485,7 @@ void linux_netlink_hotplug_poll(void)
 
 	usbi_mutex_static_lock(&linux_hotplug_lock);
 	do {
-		r = linux_netlink_read_message();
+		r = linux_netlink_read_messages();
 	} while (r == 0);
 	usbi_mutex_static_unlock(&linux_hotplug_lock);
 }
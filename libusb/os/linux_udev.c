@@ -101,7 +101,8 @@ int linux_udev_start_event_monitor(void)
 		goto err_free_monitor;
 	}
 
-	r = pthread_create(&linux_event_thread, NULL, linux_udev_event_thread_main, NULL);
+	r = usbi_thread_create(&linux_event_thread, "hotplug",
+		linux_udev_event_thread_main, NULL);
 	if (r) {
 		usbi_err(NULL, "creating hotplug event thread (%d)", r);
 		goto err_close_pipe;
@@ -138,7 +139,7 @@ int linux_udev_stop_event_monitor(void)
 	if (r <= 0) {
 		usbi_warn(NULL, "udev control pipe signal failed");
 	}
-	pthread_join(linux_event_thread, NULL);
+	usbi_thread_join(linux_event_thread, NULL);
 
 	/* Release the udev monitor */
 	udev_monitor_unref(udev_monitor);
@@ -214,6 +215,35 @@ static int udev_device_info(struct libusb_context *ctx, int detached,
 					dev_node, *sys_name);
 }
 
+/* read the bus and device number of a device from the BUSNUM and DEVNUM
+ * properties in the udev database, saving the sysfs reads of
+ * linux_get_device_address() */
+static int udev_device_address(struct udev_device *udev_dev, uint8_t *busnum,
+			       uint8_t *devaddr)
+{
+	const char *value;
+	char *end;
+	long bus, dev;
+
+	value = udev_device_get_property_value(udev_dev, "BUSNUM");
+	if (!value)
+		return LIBUSB_ERROR_NOT_FOUND;
+	bus = strtol(value, &end, 10);
+	if (end == value || *end || bus < 0 || bus > 255)
+		return LIBUSB_ERROR_NOT_FOUND;
+
+	value = udev_device_get_property_value(udev_dev, "DEVNUM");
+	if (!value)
+		return LIBUSB_ERROR_NOT_FOUND;
+	dev = strtol(value, &end, 10);
+	if (end == value || *end || dev < 0 || dev > 255)
+		return LIBUSB_ERROR_NOT_FOUND;
+
+	*busnum = (uint8_t) bus;
+	*devaddr = (uint8_t) dev;
+	return LIBUSB_SUCCESS;
+}
+
 static void udev_hotplug_event(struct udev_device* udev_dev)
 {
 	const char* udev_action;
@@ -254,8 +284,10 @@ int linux_udev_scan_devices(struct libusb_context *ctx)
 	struct udev_enumerate *enumerator;
 	struct udev_list_entry *devices, *entry;
 	struct udev_device *udev_dev;
+	struct linux_device_scan *scans = NULL, *tmp;
+	int num_scans = 0, scans_size = 0;
 	const char *sys_name;
-	int r;
+	int i, r;
 
 	assert(udev_ctx != NULL);
 
@@ -274,19 +306,51 @@ int linux_udev_scan_devices(struct libusb_context *ctx)
 		uint8_t busnum = 0, devaddr = 0;
 
 		udev_dev = udev_device_new_from_syspath(udev_ctx, path);
+		if (!udev_dev)
+			continue;
 
-		r = udev_device_info(ctx, 0, udev_dev, &busnum, &devaddr, &sys_name);
+		/* interfaces have no device node */
+		sys_name = udev_device_get_sysname(udev_dev);
+		if (!sys_name || !udev_device_get_devnode(udev_dev))
+			r = LIBUSB_ERROR_OTHER;
+		else if (udev_device_address(udev_dev, &busnum, &devaddr))
+			r = udev_device_info(ctx, 0, udev_dev, &busnum,
+					     &devaddr, &sys_name);
+		else
+			r = LIBUSB_SUCCESS;
 		if (r) {
 			udev_device_unref(udev_dev);
 			continue;
 		}
 
-		linux_enumerate_device(ctx, busnum, devaddr, sys_name);
+		if (num_scans == scans_size) {
+			scans_size = scans_size ? scans_size * 2 : 32;
+			tmp = realloc(scans, scans_size * sizeof(*scans));
+			if (!tmp) {
+				udev_device_unref(udev_dev);
+				break;
+			}
+			scans = tmp;
+		}
+		scans[num_scans].sysfs_dir = sys_name ? strdup(sys_name) : NULL;
+		if (sys_name && !scans[num_scans].sysfs_dir) {
+			udev_device_unref(udev_dev);
+			break;
+		}
+		scans[num_scans].have_address = 1;
+		scans[num_scans].busnum = busnum;
+		scans[num_scans].devaddr = devaddr;
+		num_scans++;
 		udev_device_unref(udev_dev);
 	}
 
 	udev_enumerate_unref(enumerator);
 
+	linux_enumerate_devices(ctx, scans, num_scans);
+	for (i = 0; i < num_scans; i++)
+		free(scans[i].sysfs_dir);
+	free(scans);
+
 	return LIBUSB_SUCCESS;
 }
 
@@ -28,12 +28,15 @@
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <sys/types.h>
 #include <sys/utsname.h>
 #include <unistd.h>
@@ -117,14 +120,82 @@ static int sysfs_can_relate_devices = -1;
  * descriptors file, so from then on we can use them. */
 static int sysfs_has_descriptors = -1;
 
+/* Set from the LIBUSB_LAZY_DESCRIPTORS environment variable. Enumeration then
+ * reads only the device descriptor of each device from sysfs, and leaves its
+ * config descriptors until they are first asked for. This saves most of the
+ * I/O of scanning hosts with many devices when only a few of them are ever
+ * looked at closely. It is off by default.
+ * lazy_descriptors_lock serializes the deferred reads. */
+static int lazy_descriptors = -1;
+static usbi_mutex_static_t lazy_descriptors_lock = USBI_MUTEX_INITIALIZER;
+
+/* Set from the LIBUSB_SHARED_DESCRIPTORS environment variable. The complete
+ * descriptors read for a device are then kept in a process-wide cache, and
+ * every other context that enumerates the same device references them
+ * instead of reading and storing its own copy. The descriptors never change
+ * while a device stays connected, so an entry is only dropped from the cache
+ * when its device disconnects, and freed once no device refers to it. */
+static int shared_descriptors = -1;
+
+struct shared_descriptors {
+	struct list_head list;
+	char *sysfs_dir;
+	unsigned long session_id;
+	unsigned char *descriptors;
+	int descriptors_len;
+	int refcnt;
+	int cached; /* still in shared_descriptors_list */
+};
+
+static struct list_head shared_descriptors_list =
+	{ &shared_descriptors_list, &shared_descriptors_list };
+static usbi_mutex_static_t shared_descriptors_lock = USBI_MUTEX_INITIALIZER;
+
+/* Set from the LIBUSB_ENUM_CACHE environment variable to the path of a file
+ * in which the initial scan of a context stores what it read about each
+ * device: its address, speed and descriptors. Later scans, typically by other
+ * short-lived processes, map the file and take a device from it instead of
+ * reading sysfs for as long as it holds the same device. See
+ * linux_enumerate_devices(). NULL if there is no such file. The variable is
+ * ignored in setuid and setgid programs, and the file unless it belongs to
+ * the effective user and only that user may write it. */
+static int enum_cache = -1;
+static char *enum_cache_path = NULL;
+
 /* how many times have we initted (and not exited) ? */
 static int init_count = 0;
+/* how many of those contexts discover devices, and so need the hotplug
+ * monitor. see libusb_set_device_discovery() */
+static int discovery_count = 0;
 
 /* Serialize hotplug start/stop */
 usbi_mutex_static_t linux_hotplug_startstop_lock = USBI_MUTEX_INITIALIZER;
 /* Serialize scan-devices, event-thread, and poll */
 usbi_mutex_static_t linux_hotplug_lock = USBI_MUTEX_INITIALIZER;
 
+/* Table of open device handles indexed by usbfs fd, so that
+ * op_handle_events() can map a ready pollfd to its handle in constant time.
+ * fds are process-wide, so one table serves every context. Only opening and
+ * closing a handle take fd_handles_lock, the event handler reads the table
+ * without it. An outgrown table may therefore still be read and is kept on
+ * the retired list of its successor until the last context exits. */
+struct fd_handle_table {
+	struct fd_handle_table *retired;
+	int len;
+	struct libusb_device_handle **handles;
+};
+
+static struct fd_handle_table *fd_handles = NULL;
+static usbi_mutex_static_t fd_handles_lock = USBI_MUTEX_INITIALIZER;
+
+#if defined(__ATOMIC_RELAXED)
+#define fd_handles_load(p)	__atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define fd_handles_store(p, v)	__atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#else
+#define fd_handles_load(p)	(__sync_synchronize(), *(p))
+#define fd_handles_store(p, v)	do { __sync_synchronize(); *(p) = (v); } while (0)
+#endif
+
 static int linux_start_event_monitor(void);
 static int linux_stop_event_monitor(void);
 static int linux_scan_devices(struct libusb_context *ctx);
@@ -137,14 +208,38 @@ static int linux_default_scan_devices (struct libusb_context *ctx);
 
 struct linux_device_priv {
 	char *sysfs_dir;
+	/* replaced while descriptors_partial is set, by load_descriptors()
+	 * under lazy_descriptors_lock. readers of the config descriptors call
+	 * load_descriptors() first */
 	unsigned char *descriptors;
 	int descriptors_len;
+	/* only the device descriptor has been read so far. cleared with
+	 * usbi_flags_store() once the descriptors are complete, so that
+	 * load_descriptors() can check it without the lock */
+	unsigned int descriptors_partial;
+	/* copy of the start of the first descriptors, which never moves, so
+	 * that the device descriptor can be read without the lock */
+	unsigned char device_descriptor[DEVICE_DESC_LENGTH];
+	/* descriptors belongs to this cache entry, see shared_descriptors */
+	struct shared_descriptors *shared;
 	int active_config; /* cache val for !sysfs_can_relate_devices  */
 };
 
 struct linux_device_handle_priv {
 	int fd;
+	/* fd belongs to the application, see op_wrap_sys_device() */
+	int fd_keep;
 	uint32_t caps;
+
+	/* buffers mapped from the usbfs fd by op_dev_mem_alloc() */
+	struct list_head dev_mem;
+	usbi_mutex_t dev_mem_lock;
+};
+
+struct linux_dev_mem {
+	struct list_head list;
+	unsigned char *buffer;
+	size_t len;
 };
 
 enum reap_action {
@@ -174,10 +269,23 @@ struct linux_transfer_priv {
 	int num_retired;
 	enum libusb_transfer_status reap_status;
 
-	/* next iso packet in user-supplied transfer to be populated */
-	int iso_packet_offset;
+	/* URBs kept from the previous submission, for reuse by the next one */
+	struct usbfs_urb *cached_urbs;
+	int num_cached_urbs;
+	struct usbfs_urb **cached_iso_urbs;
+	int num_cached_iso_urbs;
 };
 
+/* an iso URB along with its place in the transfer, so that its completion
+ * is handled without searching for it. only the URB is passed to usbfs. */
+struct linux_iso_urb {
+	int index;		/* slot in tpriv->iso_urbs */
+	int packet_offset;	/* first transfer packet carried by the URB */
+	struct usbfs_urb urb;	/* must be last, the packet descriptors follow */
+};
+
+#define ISO_URB(u)	container_of(u, struct linux_iso_urb, urb)
+
 static int _get_usbfs_fd(struct libusb_device *dev, mode_t mode, int silent)
 {
 	struct libusb_context *ctx = DEVICE_CTX(dev);
@@ -234,6 +342,60 @@ static struct linux_device_handle_priv *_device_handle_priv(
 	return (struct linux_device_handle_priv *) handle->os_priv;
 }
 
+static int fd_handles_add(int fd, struct libusb_device_handle *handle)
+{
+	struct fd_handle_table *table;
+	int r = 0;
+
+	usbi_mutex_static_lock(&fd_handles_lock);
+	table = fd_handles;
+	if (!table || fd >= table->len) {
+		struct fd_handle_table *new_table;
+		int new_len = table ? table->len : 64;
+
+		while (new_len <= fd)
+			new_len *= 2;
+		new_table = calloc(1, sizeof(*new_table) +
+			new_len * sizeof(*new_table->handles));
+		if (!new_table) {
+			r = LIBUSB_ERROR_NO_MEM;
+			goto out;
+		}
+		new_table->handles = (struct libusb_device_handle **)(new_table + 1);
+		new_table->len = new_len;
+		if (table)
+			memcpy(new_table->handles, table->handles,
+				table->len * sizeof(*table->handles));
+		new_table->retired = table;
+		fd_handles_store(&fd_handles, new_table);
+		table = new_table;
+	}
+	fd_handles_store(&table->handles[fd], handle);
+out:
+	usbi_mutex_static_unlock(&fd_handles_lock);
+	return r;
+}
+
+static void fd_handles_remove(int fd)
+{
+	struct fd_handle_table *table;
+
+	usbi_mutex_static_lock(&fd_handles_lock);
+	table = fd_handles;
+	if (table && fd >= 0 && fd < table->len)
+		fd_handles_store(&table->handles[fd], NULL);
+	usbi_mutex_static_unlock(&fd_handles_lock);
+}
+
+static struct libusb_device_handle *fd_handles_lookup(int fd)
+{
+	struct fd_handle_table *table = fd_handles_load(&fd_handles);
+
+	if (!table || fd < 0 || fd >= table->len)
+		return NULL;
+	return fd_handles_load(&table->handles[fd]);
+}
+
 /* check dirent for a /dev/usbdev%d.%d name
  * optionally return bus/device on success */
 static int _is_usbdev_entry(struct dirent *entry, int *bus_p, int *dev_p)
@@ -401,6 +563,38 @@ static int op_init(struct libusb_context *ctx)
 	if (supports_flag_zero_packet)
 		usbi_dbg("zero length packet flag supported");
 
+	if (-1 == lazy_descriptors) {
+		const char *lazy = getenv("LIBUSB_LAZY_DESCRIPTORS");
+		lazy_descriptors = lazy && *lazy && strcmp(lazy, "0");
+	}
+
+	if (lazy_descriptors)
+		usbi_dbg("config descriptors are read on demand");
+
+	if (-1 == shared_descriptors) {
+		const char *shared = getenv("LIBUSB_SHARED_DESCRIPTORS");
+		shared_descriptors = shared && *shared && strcmp(shared, "0");
+	}
+
+	if (shared_descriptors)
+		usbi_dbg("descriptors are shared between contexts");
+
+	if (-1 == enum_cache) {
+#ifdef HAVE_SECURE_GETENV
+		const char *path = secure_getenv("LIBUSB_ENUM_CACHE");
+#else
+		const char *path = NULL;
+		if (getuid() == geteuid() && getgid() == getegid())
+			path = getenv("LIBUSB_ENUM_CACHE");
+#endif
+		if (path && *path)
+			enum_cache_path = strdup(path);
+		enum_cache = enum_cache_path != NULL;
+	}
+
+	if (enum_cache)
+		usbi_dbg("enumeration cache in %s", enum_cache_path);
+
 	if (-1 == sysfs_has_descriptors) {
 		/* sysfs descriptors has all descriptors since Linux 2.6.26 */
 		sysfs_has_descriptors = kernel_version_ge(2,6,26);
@@ -436,15 +630,24 @@ static int op_init(struct libusb_context *ctx)
 
 	usbi_mutex_static_lock(&linux_hotplug_startstop_lock);
 	r = LIBUSB_SUCCESS;
-	if (init_count == 0) {
+	if (ctx->no_device_discovery) {
+		/* only devices from op_wrap_sys_device(), which need neither
+		 * the monitor nor a scan */
+		usbi_dbg("device discovery disabled");
+		init_count++;
+		usbi_mutex_static_unlock(&linux_hotplug_startstop_lock);
+		return r;
+	}
+	if (discovery_count == 0) {
 		/* start up hotplug event handler */
 		r = linux_start_event_monitor();
 	}
 	if (r == LIBUSB_SUCCESS) {
 		r = linux_scan_devices(ctx);
-		if (r == LIBUSB_SUCCESS)
+		if (r == LIBUSB_SUCCESS) {
+			discovery_count++;
 			init_count++;
-		else if (init_count == 0)
+		} else if (discovery_count == 0)
 			linux_stop_event_monitor();
 	} else
 		usbi_err(ctx, "error starting hotplug event monitor");
@@ -453,14 +656,26 @@ static int op_init(struct libusb_context *ctx)
 	return r;
 }
 
-static void op_exit(void)
+static void op_exit(struct libusb_context *ctx)
 {
 	usbi_mutex_static_lock(&linux_hotplug_startstop_lock);
 	assert(init_count != 0);
-	if (!--init_count) {
+	if (!ctx->no_device_discovery && !--discovery_count) {
 		/* tear down event handler */
 		(void)linux_stop_event_monitor();
 	}
+	if (!--init_count) {
+		struct fd_handle_table *table, *retired;
+
+		usbi_mutex_static_lock(&fd_handles_lock);
+		table = fd_handles;
+		fd_handles = NULL;
+		usbi_mutex_static_unlock(&fd_handles_lock);
+		for (; table; table = retired) {
+			retired = table->retired;
+			free(table);
+		}
+	}
 	usbi_mutex_static_unlock(&linux_hotplug_startstop_lock);
 }
 
@@ -561,13 +776,256 @@ static int __read_sysfs_attr(struct libusb_context *ctx,
 	return value;
 }
 
+/* let go of the descriptors of a device, dropping its reference to them if
+ * they are shared */
+static void release_descriptors(struct linux_device_priv *priv)
+{
+	struct shared_descriptors *shared = priv->shared;
+
+	if (!shared) {
+		free(priv->descriptors);
+	} else {
+		usbi_mutex_static_lock(&shared_descriptors_lock);
+		if (--shared->refcnt == 0) {
+			if (shared->cached)
+				list_del(&shared->list);
+		} else {
+			shared = NULL;
+		}
+		usbi_mutex_static_unlock(&shared_descriptors_lock);
+		if (shared) {
+			free(shared->descriptors);
+			free(shared->sysfs_dir);
+			free(shared);
+		}
+	}
+	priv->descriptors = NULL;
+	priv->descriptors_len = 0;
+	priv->shared = NULL;
+}
+
+/* make descriptors the descriptors of a device, letting go of those it had.
+ * the first ones also supply the device descriptor, which the later ones
+ * repeat */
+static void set_descriptors(struct linux_device_priv *priv,
+	unsigned char *descriptors, int descriptors_len,
+	struct shared_descriptors *shared)
+{
+	int first = !priv->descriptors;
+
+	release_descriptors(priv);
+	priv->descriptors = descriptors;
+	priv->descriptors_len = descriptors_len;
+	priv->shared = shared;
+	if (first)
+		memcpy(priv->device_descriptor, descriptors,
+			DEVICE_DESC_LENGTH);
+}
+
+static struct shared_descriptors *find_shared_descriptors(
+	const char *sysfs_dir, unsigned long session_id)
+{
+	struct shared_descriptors *shared;
+
+	list_for_each_entry(shared, &shared_descriptors_list, list,
+			struct shared_descriptors) {
+		if (shared->session_id == session_id &&
+				!strcmp(shared->sysfs_dir, sysfs_dir))
+			return shared;
+	}
+	return NULL;
+}
+
+/* point a device at the cached descriptors another context read for it.
+ * returns 1 if they were found and 0 if not. once the device is in use, this
+ * only happens from load_descriptors(), so the buffer it replaces is seen by
+ * nobody: the device descriptor is read from its own copy, and the config
+ * descriptor readers wait for load_descriptors() */
+static int get_shared_descriptors(struct libusb_device *dev)
+{
+	struct linux_device_priv *priv = _device_priv(dev);
+	struct shared_descriptors *shared;
+
+	if (!shared_descriptors || !priv->sysfs_dir)
+		return 0;
+
+	usbi_mutex_static_lock(&shared_descriptors_lock);
+	shared = find_shared_descriptors(priv->sysfs_dir, dev->session_data);
+	if (shared)
+		shared->refcnt++;
+	usbi_mutex_static_unlock(&shared_descriptors_lock);
+	if (!shared)
+		return 0;
+
+	set_descriptors(priv, shared->descriptors, shared->descriptors_len,
+		shared);
+	return 1;
+}
+
+/* hand the complete descriptors of a device over to the cache, so that
+ * other contexts can reference them. if another context got there first,
+ * its copy is used instead */
+static void put_shared_descriptors(struct libusb_device *dev)
+{
+	struct linux_device_priv *priv = _device_priv(dev);
+	struct shared_descriptors *shared, *found;
+
+	if (!shared_descriptors || !priv->sysfs_dir || priv->shared)
+		return;
+
+	shared = malloc(sizeof(*shared));
+	if (!shared)
+		return;
+	shared->sysfs_dir = strdup(priv->sysfs_dir);
+	if (!shared->sysfs_dir) {
+		free(shared);
+		return;
+	}
+	shared->session_id = dev->session_data;
+	shared->descriptors = priv->descriptors;
+	shared->descriptors_len = priv->descriptors_len;
+	shared->refcnt = 1;
+	shared->cached = 1;
+
+	usbi_mutex_static_lock(&shared_descriptors_lock);
+	found = find_shared_descriptors(shared->sysfs_dir, shared->session_id);
+	if (!found)
+		list_add(&shared->list, &shared_descriptors_list);
+	usbi_mutex_static_unlock(&shared_descriptors_lock);
+
+	if (found) {
+		free(shared->sysfs_dir);
+		free(shared);
+		get_shared_descriptors(dev);
+	} else {
+		priv->shared = shared;
+	}
+}
+
+/* drop the cached descriptors of a device that has gone away, so that a
+ * device enumerated later under the same name and address reads its own */
+static void forget_shared_descriptors(unsigned long session_id)
+{
+	struct shared_descriptors *shared, *next;
+
+	if (!shared_descriptors)
+		return;
+
+	usbi_mutex_static_lock(&shared_descriptors_lock);
+	list_for_each_entry_safe(shared, next, &shared_descriptors_list, list,
+			struct shared_descriptors) {
+		if (shared->session_id == session_id) {
+			list_del(&shared->list);
+			shared->cached = 0;
+		}
+	}
+	usbi_mutex_static_unlock(&shared_descriptors_lock);
+}
+
+/* read the descriptors of a device from fd into priv->descriptors, replacing
+ * any that were read before. reads the whole file if max_len is 0, and at
+ * most max_len bytes otherwise. usbfs is set if fd is a usbfs device node */
+static int read_descriptors_fd(struct libusb_device *dev, int fd, int usbfs,
+	int max_len)
+{
+	struct linux_device_priv *priv = _device_priv(dev);
+	struct libusb_context *ctx = DEVICE_CTX(dev);
+	int descriptors_size = 512; /* Begin with a 1024 byte alloc */
+	unsigned char *descriptors = NULL;
+	int descriptors_len = 0;
+	ssize_t r;
+
+	if (max_len)
+		descriptors_size = (max_len + 1) / 2;
+	do {
+		descriptors_size *= 2;
+		if (max_len && descriptors_size > max_len)
+			descriptors_size = max_len;
+		descriptors = usbi_reallocf(descriptors, descriptors_size);
+		if (!descriptors)
+			return LIBUSB_ERROR_NO_MEM;
+		/* usbfs has holes in the file */
+		if (usbfs) {
+			memset(descriptors + descriptors_len,
+			       0, descriptors_size - descriptors_len);
+		}
+		r = read(fd, descriptors + descriptors_len,
+			 descriptors_size - descriptors_len);
+		if (r < 0) {
+			usbi_err(ctx, "read descriptor failed ret=%d errno=%d",
+				 fd, errno);
+			free(descriptors);
+			return LIBUSB_ERROR_IO;
+		}
+		descriptors_len += r;
+	} while (descriptors_len == descriptors_size &&
+		 descriptors_size != max_len);
+
+	if (descriptors_len < DEVICE_DESC_LENGTH) {
+		usbi_err(ctx, "short descriptor read (%d)", descriptors_len);
+		free(descriptors);
+		return LIBUSB_ERROR_IO;
+	}
+
+	set_descriptors(priv, descriptors, descriptors_len, NULL);
+	return LIBUSB_SUCCESS;
+}
+
+/* read the descriptors of a device from sysfs, or from usbfs on kernels
+ * whose sysfs lacks them */
+static int read_descriptors(struct libusb_device *dev, int max_len)
+{
+	int fd, r;
+
+	if (sysfs_has_descriptors)
+		fd = _open_sysfs_attr(dev, "descriptors");
+	else
+		fd = _get_usbfs_fd(dev, O_RDONLY, 0);
+	if (fd < 0)
+		return fd;
+
+	r = read_descriptors_fd(dev, fd, !sysfs_has_descriptors, max_len);
+	close(fd);
+	return r;
+}
+
+/* make sure all the descriptors of a device are in memory, reading the
+ * config descriptors that lazy enumeration left out */
+static int load_descriptors(struct libusb_device *dev)
+{
+	struct linux_device_priv *priv = _device_priv(dev);
+	int r = LIBUSB_SUCCESS;
+
+	/* the descriptors are never replaced once complete, so devices already
+	 * loaded need not take the process wide lock */
+	if (!usbi_flags_load(&priv->descriptors_partial))
+		return LIBUSB_SUCCESS;
+
+	usbi_mutex_static_lock(&lazy_descriptors_lock);
+	if (priv->descriptors_partial) {
+		if (get_shared_descriptors(dev)) {
+			usbi_flags_store(&priv->descriptors_partial, 0);
+		} else {
+			usbi_dbg("loading descriptors of %s", priv->sysfs_dir);
+			r = read_descriptors(dev, 0);
+			if (r == 0) {
+				usbi_flags_store(&priv->descriptors_partial, 0);
+				put_shared_descriptors(dev);
+			}
+		}
+	}
+	usbi_mutex_static_unlock(&lazy_descriptors_lock);
+
+	return r;
+}
+
 static int op_get_device_descriptor(struct libusb_device *dev,
 	unsigned char *buffer, int *host_endian)
 {
 	struct linux_device_priv *priv = _device_priv(dev);
 
 	*host_endian = sysfs_has_descriptors ? 0 : 1;
-	memcpy(buffer, priv->descriptors, DEVICE_DESC_LENGTH);
+	memcpy(buffer, priv->device_descriptor, DEVICE_DESC_LENGTH);
 
 	return 0;
 }
@@ -615,6 +1073,53 @@ static int sysfs_get_active_config(struct libusb_device *dev, int *config)
 	return 0;
 }
 
+/* the kernel reads the manufacturer, product and serial number strings in
+ * the first language of the device at enumeration, and shows them in sysfs
+ * as UTF-8 with a trailing newline */
+static int op_get_device_string(struct libusb_device *dev, uint8_t desc_index,
+	char *buffer, size_t len)
+{
+	struct linux_device_priv *priv = _device_priv(dev);
+	struct libusb_device_descriptor *desc = &dev->device_descriptor;
+	char filename[PATH_MAX];
+	const char *attr;
+	ssize_t r;
+	int fd;
+
+	if (!priv->sysfs_dir || desc_index == 0 || len == 0)
+		return LIBUSB_ERROR_NOT_FOUND;
+
+	if (desc_index == desc->iManufacturer)
+		attr = "manufacturer";
+	else if (desc_index == desc->iProduct)
+		attr = "product";
+	else if (desc_index == desc->iSerialNumber)
+		attr = "serial";
+	else
+		return LIBUSB_ERROR_NOT_FOUND;
+
+	/* the attribute is missing if the kernel could not read the string */
+	snprintf(filename, PATH_MAX, "%s/%s/%s",
+		SYSFS_DEVICE_PATH, priv->sysfs_dir, attr);
+	fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		usbi_dbg("no %s, errno=%d", filename, errno);
+		return LIBUSB_ERROR_NOT_FOUND;
+	}
+
+	r = read(fd, buffer, len - 1);
+	close(fd);
+	if (r < 0) {
+		usbi_err(DEVICE_CTX(dev), "read %s failed errno=%d", filename, errno);
+		return LIBUSB_ERROR_IO;
+	}
+	if (r > 0 && buffer[r - 1] == '\n')
+		r--;
+	buffer[r] = 0;
+
+	return (int) r;
+}
+
 int linux_get_device_address (struct libusb_context *ctx, int detached,
 	uint8_t *busnum, uint8_t *devaddr,const char *dev_node,
 	const char *sys_name)
@@ -746,14 +1251,20 @@ static int op_get_config_descriptor_by_value(struct libusb_device *dev,
 {
 	struct libusb_context *ctx = DEVICE_CTX(dev);
 	struct linux_device_priv *priv = _device_priv(dev);
-	unsigned char *descriptors = priv->descriptors;
-	int size = priv->descriptors_len;
+	unsigned char *descriptors;
+	int r, size;
 	struct libusb_config_descriptor *config;
 
 	*buffer = NULL;
 	/* Unlike the device desc. config descs. are always in raw format */
 	*host_endian = 0;
 
+	r = load_descriptors(dev);
+	if (r < 0)
+		return r;
+	descriptors = priv->descriptors;
+	size = priv->descriptors_len;
+
 	/* Skip device header */
 	descriptors += DEVICE_DESC_LENGTH;
 	size -= DEVICE_DESC_LENGTH;
@@ -776,16 +1287,17 @@ static int op_get_config_descriptor_by_value(struct libusb_device *dev,
 static int op_get_active_config_descriptor(struct libusb_device *dev,
 	unsigned char *buffer, size_t len, int *host_endian)
 {
+	struct linux_device_priv *priv = _device_priv(dev);
 	int r, config;
 	unsigned char *config_desc;
 
-	if (sysfs_can_relate_devices) {
+	/* wrapped devices have no sysfs directory */
+	if (sysfs_can_relate_devices && priv->sysfs_dir) {
 		r = sysfs_get_active_config(dev, &config);
 		if (r < 0)
 			return r;
 	} else {
 		/* Use cached bConfigurationValue */
-		struct linux_device_priv *priv = _device_priv(dev);
 		config = priv->active_config;
 	}
 	if (config == -1)
@@ -805,12 +1317,18 @@ static int op_get_config_descriptor(struct libusb_device *dev,
 	uint8_t config_index, unsigned char *buffer, size_t len, int *host_endian)
 {
 	struct linux_device_priv *priv = _device_priv(dev);
-	unsigned char *descriptors = priv->descriptors;
-	int i, r, size = priv->descriptors_len;
+	unsigned char *descriptors;
+	int i, r, size;
 
 	/* Unlike the device desc. config descs. are always in raw format */
 	*host_endian = 0;
 
+	r = load_descriptors(dev);
+	if (r < 0)
+		return r;
+	descriptors = priv->descriptors;
+	size = priv->descriptors_len;
+
 	/* Skip device header */
 	descriptors += DEVICE_DESC_LENGTH;
 	size -= DEVICE_DESC_LENGTH;
@@ -861,12 +1379,43 @@ static int usbfs_get_active_config(struct libusb_device *dev, int fd)
 	return active_config;
 }
 
+/* read the active configuration through a usbfs fd into priv->active_config */
+static int usbfs_cache_active_config(struct libusb_device *dev, int fd)
+{
+	struct linux_device_priv *priv = _device_priv(dev);
+	struct libusb_context *ctx = DEVICE_CTX(dev);
+	int r;
+
+	r = usbfs_get_active_config(dev, fd);
+	if (r > 0) {
+		priv->active_config = r;
+		r = LIBUSB_SUCCESS;
+	} else if (r == 0) {
+		/* some buggy devices have a configuration 0, but we're
+		 * reaching into the corner of a corner case here, so let's
+		 * not support buggy devices in these circumstances.
+		 * stick to the specs: a configuration value of 0 means
+		 * unconfigured. */
+		usbi_dbg("active cfg 0? assuming unconfigured device");
+		priv->active_config = -1;
+		r = LIBUSB_SUCCESS;
+	} else if (r == LIBUSB_ERROR_IO) {
+		/* buggy devices sometimes fail to report their active config.
+		 * assume unconfigured and continue the probing */
+		usbi_warn(ctx, "couldn't query active configuration, assuming"
+			       " unconfigured");
+		priv->active_config = -1;
+		r = LIBUSB_SUCCESS;
+	} /* else r < 0, just return the error code */
+
+	return r;
+}
+
 static int initialize_device(struct libusb_device *dev, uint8_t busnum,
 	uint8_t devaddr, const char *sysfs_dir)
 {
 	struct linux_device_priv *priv = _device_priv(dev);
 	struct libusb_context *ctx = DEVICE_CTX(dev);
-	int descriptors_size = 512; /* Begin with a 1024 byte alloc */
 	int fd, speed;
 	ssize_t r;
 
@@ -894,45 +1443,22 @@ static int initialize_device(struct libusb_device *dev, uint8_t busnum,
 		}
 	}
 
-	/* cache descriptors in memory */
-	if (sysfs_has_descriptors)
-		fd = _open_sysfs_attr(dev, "descriptors");
-	else
-		fd = _get_usbfs_fd(dev, O_RDONLY, 0);
-	if (fd < 0)
-		return fd;
-
-	do {
-		descriptors_size *= 2;
-		priv->descriptors = usbi_reallocf(priv->descriptors,
-						  descriptors_size);
-		if (!priv->descriptors) {
-			close(fd);
-			return LIBUSB_ERROR_NO_MEM;
-		}
-		/* usbfs has holes in the file */
-		if (!sysfs_has_descriptors) {
-			memset(priv->descriptors + priv->descriptors_len,
-			       0, descriptors_size - priv->descriptors_len);
-		}
-		r = read(fd, priv->descriptors + priv->descriptors_len,
-			 descriptors_size - priv->descriptors_len);
-		if (r < 0) {
-			usbi_err(ctx, "read descriptor failed ret=%d errno=%d",
-				 fd, errno);
-			close(fd);
-			return LIBUSB_ERROR_IO;
-		}
-		priv->descriptors_len += r;
-	} while (priv->descriptors_len == descriptors_size);
-
-	close(fd);
-
-	if (priv->descriptors_len < DEVICE_DESC_LENGTH) {
-		usbi_err(ctx, "short descriptor read (%d)",
-			 priv->descriptors_len);
-		return LIBUSB_ERROR_IO;
+	/* cache descriptors in memory. in lazy mode only the device descriptor
+	 * is read now, and the rest once a config descriptor is asked for.
+	 * another context may have read them already */
+	if (sysfs_has_descriptors && get_shared_descriptors(dev)) {
+		r = LIBUSB_SUCCESS;
+	} else if (lazy_descriptors && sysfs_has_descriptors &&
+			sysfs_can_relate_devices && sysfs_dir) {
+		priv->descriptors_partial = 1;
+		r = read_descriptors(dev, DEVICE_DESC_LENGTH);
+	} else {
+		r = read_descriptors(dev, 0);
+		if (r == 0 && sysfs_has_descriptors)
+			put_shared_descriptors(dev);
 	}
+	if (r < 0)
+		return r;
 
 	if (sysfs_can_relate_devices)
 		return LIBUSB_SUCCESS;
@@ -957,32 +1483,29 @@ static int initialize_device(struct libusb_device *dev, uint8_t busnum,
 		return LIBUSB_SUCCESS;
 	}
 
-	r = usbfs_get_active_config(dev, fd);
-	if (r > 0) {
-		priv->active_config = r;
-		r = LIBUSB_SUCCESS;
-	} else if (r == 0) {
-		/* some buggy devices have a configuration 0, but we're
-		 * reaching into the corner of a corner case here, so let's
-		 * not support buggy devices in these circumstances.
-		 * stick to the specs: a configuration value of 0 means
-		 * unconfigured. */
-		usbi_dbg("active cfg 0? assuming unconfigured device");
-		priv->active_config = -1;
-		r = LIBUSB_SUCCESS;
-	} else if (r == LIBUSB_ERROR_IO) {
-		/* buggy devices sometimes fail to report their active config.
-		 * assume unconfigured and continue the probing */
-		usbi_warn(ctx, "couldn't query active configuration, assuming"
-			       " unconfigured");
-		priv->active_config = -1;
-		r = LIBUSB_SUCCESS;
-	} /* else r < 0, just return the error code */
-
+	r = usbfs_cache_active_config(dev, fd);
 	close(fd);
 	return r;
 }
 
+/* set up a device from the usbfs fd that the application handed to
+ * libusb_wrap_sys_device(). the fd is left open */
+static int initialize_wrapped_device(struct libusb_device *dev, int fd)
+{
+	int r;
+
+	/* the application may have read from the fd already */
+	if (lseek(fd, 0, SEEK_SET) < 0) {
+		usbi_err(DEVICE_CTX(dev), "seek failed errno=%d", errno);
+		return LIBUSB_ERROR_IO;
+	}
+	r = read_descriptors_fd(dev, fd, 1, 0);
+	if (r < 0)
+		return r;
+
+	return usbfs_cache_active_config(dev, fd);
+}
+
 static int linux_get_parent_info(struct libusb_device *dev, const char *sysfs_dir)
 {
 	struct libusb_context *ctx = DEVICE_CTX(dev);
@@ -1046,12 +1569,12 @@ retry:
 	return LIBUSB_SUCCESS;
 }
 
-int linux_enumerate_device(struct libusb_context *ctx,
-	uint8_t busnum, uint8_t devaddr, const char *sysfs_dir)
+/* allocate a device for the given address, leaving *dev NULL if the context
+ * already knows about it */
+static int alloc_enumerated_device(struct libusb_context *ctx,
+	uint8_t busnum, uint8_t devaddr, struct libusb_device **dev)
 {
 	unsigned long session_id;
-	struct libusb_device *dev;
-	int r = 0;
 
 	/* FIXME: session ID is not guaranteed unique as addresses can wrap and
 	 * will be reused. instead we should add a simple sysfs attribute with
@@ -1060,21 +1583,29 @@ int linux_enumerate_device(struct libusb_context *ctx,
 	usbi_dbg("busnum %d devaddr %d session_id %ld", busnum, devaddr,
 		session_id);
 
-	dev = usbi_get_device_by_session_id(ctx, session_id);
-	if (dev) {
+	*dev = usbi_get_device_by_session_id(ctx, session_id);
+	if (*dev) {
 		/* device already exists in the context */
 		usbi_dbg("session_id %ld already exists", session_id);
-		libusb_unref_device(dev);
+		libusb_unref_device(*dev);
+		*dev = NULL;
 		return LIBUSB_SUCCESS;
 	}
 
 	usbi_dbg("allocating new device for %d/%d (session %ld)",
 		 busnum, devaddr, session_id);
-	dev = usbi_alloc_device(ctx, session_id);
-	if (!dev)
+	*dev = usbi_alloc_device(ctx, session_id);
+	if (!*dev)
 		return LIBUSB_ERROR_NO_MEM;
 
-	r = initialize_device(dev, busnum, devaddr, sysfs_dir);
+	return LIBUSB_SUCCESS;
+}
+
+/* link an initialized device to its parent and add it to the context, or
+ * drop it if r reports that its initialization failed */
+static int connect_enumerated_device(struct libusb_device *dev,
+	const char *sysfs_dir, int r)
+{
 	if (r < 0)
 		goto out;
 	r = usbi_sanitize_device(dev);
@@ -1093,12 +1624,520 @@ out:
 	return r;
 }
 
+int linux_enumerate_device(struct libusb_context *ctx,
+	uint8_t busnum, uint8_t devaddr, const char *sysfs_dir)
+{
+	struct libusb_device *dev;
+	int r;
+
+	r = alloc_enumerated_device(ctx, busnum, devaddr, &dev);
+	if (r < 0 || !dev)
+		return r;
+
+	r = initialize_device(dev, busnum, devaddr, sysfs_dir);
+	return connect_enumerated_device(dev, sysfs_dir, r);
+}
+
+/* The file behind enum_cache_path holds a header, the entries sorted by sysfs
+ * name and then the descriptors they point to, in the byte order of the host.
+ * A sysfs directory gets a new inode number whenever a device is connected,
+ * so an entry holds as long as the directory of its device still has the
+ * inode number stored with it. Inode numbers repeat across reboots, so the
+ * file is only valid for the boot it names. The file is replaced and never
+ * written in place, so that processes which have it mapped keep seeing a
+ * consistent copy. */
+#define ENUM_CACHE_MAGIC	0x6d756e45	/* "Enum" */
+#define ENUM_CACHE_VERSION	1
+#define ENUM_CACHE_NAME_LEN	32
+#define ENUM_CACHE_BOOT_ID_LEN	40
+
+struct enum_cache_header {
+	uint32_t magic;
+	uint32_t version;
+	char boot_id[ENUM_CACHE_BOOT_ID_LEN];
+	uint32_t num_entries;
+	uint32_t size;
+};
+
+struct enum_cache_entry {
+	char sysfs_dir[ENUM_CACHE_NAME_LEN];
+	uint64_t ino;
+	uint32_t descriptors_offset;
+	uint32_t descriptors_len;
+	uint8_t busnum;
+	uint8_t devaddr;
+	uint8_t speed;
+	uint8_t partial;
+	uint32_t reserved;
+};
+
+/* the cache file as mapped for one scan */
+struct enum_cache_map {
+	/* empty if the cache is not used */
+	char boot_id[ENUM_CACHE_BOOT_ID_LEN];
+	unsigned char *map;
+	size_t size;
+	const struct enum_cache_header *header;
+	const struct enum_cache_entry *entries;
+};
+
+static int read_boot_id(char *boot_id)
+{
+	ssize_t r;
+	int fd;
+
+	fd = open("/proc/sys/kernel/random/boot_id", O_RDONLY);
+	if (fd < 0)
+		return LIBUSB_ERROR_IO;
+	r = read(fd, boot_id, ENUM_CACHE_BOOT_ID_LEN - 1);
+	close(fd);
+	if (r <= 0)
+		return LIBUSB_ERROR_IO;
+	boot_id[r] = '\0';
+	boot_id[strcspn(boot_id, "\n")] = '\0';
+	return LIBUSB_SUCCESS;
+}
+
+/* map the cache file for a scan. leaves the map NULL if the file is missing
+ * or stale, and the boot ID empty as well if it cannot be used at all */
+static void enum_cache_open(struct enum_cache_map *cache)
+{
+	const struct enum_cache_header *header;
+	struct stat statbuf;
+	void *map;
+	int fd;
+
+	memset(cache, 0, sizeof(*cache));
+	if (!enum_cache || !sysfs_can_relate_devices || !sysfs_has_descriptors)
+		return;
+	if (read_boot_id(cache->boot_id) < 0) {
+		usbi_dbg("no boot id, not using the enumeration cache");
+		cache->boot_id[0] = '\0';
+		return;
+	}
+
+	fd = open(enum_cache_path, O_RDONLY);
+	if (fd < 0)
+		return;
+	if (fstat(fd, &statbuf) < 0) {
+		close(fd);
+		return;
+	}
+	/* anybody else able to write the file could feed us descriptors */
+	if (!S_ISREG(statbuf.st_mode) || statbuf.st_uid != geteuid() ||
+	    (statbuf.st_mode & (S_IWGRP | S_IWOTH))) {
+		usbi_warn(NULL, "ignoring enumeration cache %s: not a regular "
+			"file owned by uid %d and writable only by it",
+			enum_cache_path, (int)geteuid());
+		close(fd);
+		return;
+	}
+	if (statbuf.st_size < (off_t)sizeof(*header) ||
+	    statbuf.st_size > UINT32_MAX) {
+		close(fd);
+		return;
+	}
+	map = mmap(NULL, statbuf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return;
+
+	header = map;
+	if (header->magic != ENUM_CACHE_MAGIC ||
+	    header->version != ENUM_CACHE_VERSION ||
+	    header->size != statbuf.st_size ||
+	    memcmp(header->boot_id, cache->boot_id, ENUM_CACHE_BOOT_ID_LEN) ||
+	    header->num_entries > (statbuf.st_size - sizeof(*header)) /
+			sizeof(struct enum_cache_entry)) {
+		usbi_dbg("enumeration cache %s is stale", enum_cache_path);
+		munmap(map, statbuf.st_size);
+		return;
+	}
+
+	cache->map = map;
+	cache->size = statbuf.st_size;
+	cache->header = header;
+	cache->entries = (const struct enum_cache_entry *)(header + 1);
+}
+
+static void enum_cache_close(struct enum_cache_map *cache)
+{
+	if (cache->map)
+		munmap(cache->map, cache->size);
+	cache->map = NULL;
+}
+
+static int compare_cache_entry(const void *key, const void *elem)
+{
+	const struct enum_cache_entry *entry = elem;
+
+	return strncmp(key, entry->sysfs_dir, ENUM_CACHE_NAME_LEN);
+}
+
+/* the entry for the device of a scan, if the cache still holds that very
+ * device. records the inode number of its sysfs directory in the scan */
+static const struct enum_cache_entry *enum_cache_lookup(
+	const struct enum_cache_map *cache, struct linux_device_scan *scan)
+{
+	const struct enum_cache_entry *entry;
+	char path[PATH_MAX];
+	struct stat statbuf;
+
+	if (!cache->boot_id[0] || !scan->sysfs_dir)
+		return NULL;
+	snprintf(path, sizeof(path), "%s/%s", SYSFS_DEVICE_PATH,
+		scan->sysfs_dir);
+	if (stat(path, &statbuf) < 0)
+		return NULL;
+	scan->ino = statbuf.st_ino;
+	if (!cache->map)
+		return NULL;
+
+	entry = bsearch(scan->sysfs_dir, cache->entries,
+		cache->header->num_entries, sizeof(*entry), compare_cache_entry);
+	if (!entry || entry->ino != scan->ino)
+		return NULL;
+	if (scan->have_address && (entry->busnum != scan->busnum ||
+			entry->devaddr != scan->devaddr))
+		return NULL;
+	if (entry->descriptors_len < DEVICE_DESC_LENGTH ||
+	    entry->descriptors_offset > cache->size ||
+	    entry->descriptors_len > cache->size - entry->descriptors_offset)
+		return NULL;
+	/* only lazy scans leave the config descriptors for later */
+	if (entry->partial && !lazy_descriptors)
+		return NULL;
+	return entry;
+}
+
+/* set up a device from its cache entry instead of from sysfs, as
+ * initialize_device() does */
+static int initialize_cached_device(struct libusb_device *dev,
+	const struct enum_cache_map *cache,
+	const struct enum_cache_entry *entry, const char *sysfs_dir)
+{
+	struct linux_device_priv *priv = _device_priv(dev);
+	unsigned char *descriptors;
+
+	dev->bus_number = entry->busnum;
+	dev->device_address = entry->devaddr;
+	dev->speed = (enum libusb_speed)entry->speed;
+	priv->sysfs_dir = strdup(sysfs_dir);
+	if (!priv->sysfs_dir)
+		return LIBUSB_ERROR_NO_MEM;
+
+	if (get_shared_descriptors(dev))
+		return LIBUSB_SUCCESS;
+
+	descriptors = malloc(entry->descriptors_len);
+	if (!descriptors)
+		return LIBUSB_ERROR_NO_MEM;
+	memcpy(descriptors, cache->map + entry->descriptors_offset,
+		entry->descriptors_len);
+	set_descriptors(priv, descriptors, entry->descriptors_len, NULL);
+	priv->descriptors_partial = entry->partial;
+	if (!entry->partial)
+		put_shared_descriptors(dev);
+
+	return LIBUSB_SUCCESS;
+}
+
+static int compare_scan_name(const void *a, const void *b)
+{
+	const struct linux_device_scan *const *scan_a = a, *const *scan_b = b;
+
+	return strcmp((*scan_a)->sysfs_dir, (*scan_b)->sysfs_dir);
+}
+
+static int write_enum_cache(const unsigned char *file, size_t size)
+{
+	char *tmp_path;
+	ssize_t r;
+	int fd;
+
+	if (asprintf(&tmp_path, "%s.XXXXXX", enum_cache_path) < 0)
+		return LIBUSB_ERROR_NO_MEM;
+	fd = mkstemp(tmp_path);
+	if (fd < 0) {
+		usbi_dbg("could not create %s errno=%d", tmp_path, errno);
+		free(tmp_path);
+		return LIBUSB_ERROR_IO;
+	}
+
+	r = write(fd, file, size);
+	if (r != (ssize_t)size || fchmod(fd, 0644) < 0) {
+		usbi_dbg("could not write %s errno=%d", tmp_path, errno);
+		r = -1;
+	}
+	close(fd);
+	if (r >= 0 && rename(tmp_path, enum_cache_path) < 0) {
+		usbi_dbg("could not replace %s errno=%d", enum_cache_path,
+			errno);
+		r = -1;
+	}
+	if (r < 0)
+		unlink(tmp_path);
+	free(tmp_path);
+
+	return r < 0 ? LIBUSB_ERROR_IO : LIBUSB_SUCCESS;
+}
+
+/* replace the cache file with the devices that the scans enumerated, unless
+ * it already holds exactly those */
+static void enum_cache_update(const struct enum_cache_map *cache,
+	struct linux_device_scan *scans, int num_scans)
+{
+	struct linux_device_scan **stored;
+	struct enum_cache_header *header;
+	struct enum_cache_entry *entry;
+	unsigned char *file;
+	size_t size, offset;
+	int i, num_stored = 0, num_cached = 0;
+
+	if (!cache->boot_id[0])
+		return;
+
+	stored = malloc((num_scans + 1) * sizeof(*stored));
+	if (!stored)
+		return;
+	size = sizeof(*header);
+	for (i = 0; i < num_scans; i++) {
+		struct linux_device_scan *scan = &scans[i];
+
+		if (!scan->dev || !scan->ino ||
+		    strlen(scan->sysfs_dir) >= ENUM_CACHE_NAME_LEN)
+			continue;
+		stored[num_stored++] = scan;
+		num_cached += scan->cached;
+		size += sizeof(*entry) + _device_priv(scan->dev)->descriptors_len;
+	}
+	if ((cache->map && num_cached == num_stored &&
+	     cache->header->num_entries == (uint32_t)num_stored) ||
+	    size > UINT32_MAX) {
+		free(stored);
+		return;
+	}
+
+	file = calloc(1, size);
+	if (!file) {
+		free(stored);
+		return;
+	}
+	qsort(stored, num_stored, sizeof(*stored), compare_scan_name);
+
+	header = (struct enum_cache_header *)file;
+	header->magic = ENUM_CACHE_MAGIC;
+	header->version = ENUM_CACHE_VERSION;
+	memcpy(header->boot_id, cache->boot_id, ENUM_CACHE_BOOT_ID_LEN);
+	header->num_entries = num_stored;
+	header->size = size;
+
+	entry = (struct enum_cache_entry *)(header + 1);
+	offset = sizeof(*header) + num_stored * sizeof(*entry);
+	usbi_mutex_static_lock(&lazy_descriptors_lock);
+	for (i = 0; i < num_stored; i++, entry++) {
+		struct libusb_device *dev = stored[i]->dev;
+		struct linux_device_priv *priv = _device_priv(dev);
+
+		strcpy(entry->sysfs_dir, stored[i]->sysfs_dir);
+		entry->ino = stored[i]->ino;
+		entry->descriptors_offset = offset;
+		entry->descriptors_len = priv->descriptors_len;
+		entry->busnum = dev->bus_number;
+		entry->devaddr = dev->device_address;
+		entry->speed = dev->speed;
+		entry->partial = priv->descriptors_partial;
+		memcpy(file + offset, priv->descriptors, priv->descriptors_len);
+		offset += priv->descriptors_len;
+	}
+	usbi_mutex_static_unlock(&lazy_descriptors_lock);
+
+	if (write_enum_cache(file, size) == 0)
+		usbi_dbg("stored %d devices in %s", num_stored, enum_cache_path);
+	free(file);
+	free(stored);
+}
+
+/* Reading the attributes and descriptors of a device from sysfs costs a
+ * handful of syscalls that may block, and initial scans of hosts with a lot
+ * of devices spend most of their time doing so one device after another.
+ * Scans of more than SCAN_DEVICES_PER_THREAD devices therefore read them
+ * from up to SCAN_MAX_THREADS threads at once. The devices are then linked
+ * to their parents and added to the context from the calling thread, in
+ * topological order. */
+#define SCAN_MAX_THREADS	4
+#define SCAN_DEVICES_PER_THREAD	16
+
+struct scan_pool {
+	struct libusb_context *ctx;
+	const struct enum_cache_map *cache;
+	struct linux_device_scan *scans;
+	int num_scans;
+	int next_scan;
+	usbi_mutex_t lock;
+};
+
+static void scan_one_device(struct libusb_context *ctx,
+	const struct enum_cache_map *cache, struct linux_device_scan *scan)
+{
+	const struct enum_cache_entry *entry;
+	int r;
+
+	entry = enum_cache_lookup(cache, scan);
+	if (entry) {
+		scan->busnum = entry->busnum;
+		scan->devaddr = entry->devaddr;
+	} else if (!scan->have_address) {
+		r = linux_get_device_address(ctx, 0, &scan->busnum,
+			&scan->devaddr, NULL, scan->sysfs_dir);
+		if (r < 0) {
+			scan->r = r;
+			return;
+		}
+	}
+
+	r = alloc_enumerated_device(ctx, scan->busnum, scan->devaddr,
+		&scan->dev);
+	if (r == 0 && scan->dev && entry) {
+		r = initialize_cached_device(scan->dev, cache, entry,
+			scan->sysfs_dir);
+		scan->cached = 1;
+	} else if (r == 0 && scan->dev) {
+		r = initialize_device(scan->dev, scan->busnum, scan->devaddr,
+			scan->sysfs_dir);
+	}
+	scan->r = r;
+}
+
+static void *scan_worker(void *arg)
+{
+	struct scan_pool *pool = arg;
+	struct linux_device_scan *scan;
+
+	for (;;) {
+		usbi_mutex_lock(&pool->lock);
+		if (pool->next_scan < pool->num_scans)
+			scan = &pool->scans[pool->next_scan++];
+		else
+			scan = NULL;
+		usbi_mutex_unlock(&pool->lock);
+		if (!scan)
+			break;
+		scan_one_device(pool->ctx, pool->cache, scan);
+	}
+
+	return NULL;
+}
+
+/* how far below a root hub a device sits, judging by its sysfs name:
+ * usb1 is 0, 1-2 is 1, 1-2.3 is 2 and so on */
+static int sysfs_dir_depth(const char *sysfs_dir)
+{
+	int depth = 1;
+
+	if (!sysfs_dir || !strncmp(sysfs_dir, "usb", 3))
+		return 0;
+	for (; *sysfs_dir; sysfs_dir++)
+		if (*sysfs_dir == '.')
+			depth++;
+	return depth;
+}
+
+static int compare_scan_depth(const void *a, const void *b)
+{
+	const struct linux_device_scan *scan_a = a, *scan_b = b;
+
+	return sysfs_dir_depth(scan_a->sysfs_dir) -
+		sysfs_dir_depth(scan_b->sysfs_dir);
+}
+
+/* Enumerate a batch of devices, as if by calling linux_enumerate_device() on
+ * each of them. Scans without have_address set get their address read from
+ * sysfs. Devices still in the enumeration cache are taken from it, and the
+ * cache is rewritten if it did not hold exactly the devices enumerated.
+ * Returns the number of scans that succeeded, with the result of each one
+ * stored in its r field. The scans may be reordered. */
+int linux_enumerate_devices(struct libusb_context *ctx,
+	struct linux_device_scan *scans, int num_scans)
+{
+	struct enum_cache_map cache;
+	struct scan_pool pool;
+	pthread_t threads[SCAN_MAX_THREADS - 1];
+	int num_threads, i, found = 0;
+
+	enum_cache_open(&cache);
+	pool.ctx = ctx;
+	pool.cache = &cache;
+	pool.scans = scans;
+	pool.num_scans = num_scans;
+	pool.next_scan = 0;
+	for (i = 0; i < num_scans; i++) {
+		scans[i].dev = NULL;
+		scans[i].r = 0;
+		scans[i].ino = 0;
+		scans[i].cached = 0;
+	}
+
+	num_threads = num_scans / SCAN_DEVICES_PER_THREAD;
+	if (num_threads > SCAN_MAX_THREADS - 1)
+		num_threads = SCAN_MAX_THREADS - 1;
+	if (num_threads > 0 && usbi_mutex_init(&pool.lock, NULL) != 0)
+		num_threads = 0;
+	for (i = 0; i < num_threads; i++) {
+		if (usbi_thread_create(&threads[i], "scan", scan_worker,
+				&pool) != 0)
+			break;
+	}
+	if (i < num_threads)
+		usbi_dbg("only started %d of %d scan threads", i, num_threads);
+
+	if (num_threads > 0) {
+		/* the calling thread takes its share of the work too */
+		scan_worker(&pool);
+		while (i-- > 0)
+			usbi_thread_join(threads[i], NULL);
+		usbi_mutex_destroy(&pool.lock);
+	} else {
+		for (i = 0; i < num_scans; i++)
+			scan_one_device(ctx, &cache, &scans[i]);
+	}
+
+	/* parents must be in the context before their children look them up */
+	qsort(scans, num_scans, sizeof(*scans), compare_scan_depth);
+	for (i = 0; i < num_scans; i++) {
+		if (scans[i].dev) {
+			/* held on to for the cache */
+			libusb_ref_device(scans[i].dev);
+			scans[i].r = connect_enumerated_device(scans[i].dev,
+				scans[i].sysfs_dir, scans[i].r);
+			if (scans[i].r < 0) {
+				libusb_unref_device(scans[i].dev);
+				scans[i].dev = NULL;
+			}
+		}
+		if (scans[i].r == 0)
+			found++;
+	}
+
+	enum_cache_update(&cache, scans, num_scans);
+	enum_cache_close(&cache);
+	for (i = 0; i < num_scans; i++) {
+		if (scans[i].dev)
+			libusb_unref_device(scans[i].dev);
+		scans[i].dev = NULL;
+	}
+
+	return found;
+}
+
 void linux_hotplug_enumerate(uint8_t busnum, uint8_t devaddr, const char *sys_name)
 {
 	struct libusb_context *ctx;
 
 	usbi_mutex_static_lock(&active_contexts_lock);
 	list_for_each_entry(ctx, &active_contexts_list, list, struct libusb_context) {
+		if (ctx->no_device_discovery)
+			continue;
 		linux_enumerate_device(ctx, busnum, devaddr, sys_name);
 	}
 	usbi_mutex_static_unlock(&active_contexts_lock);
@@ -1110,6 +2149,8 @@ void linux_device_disconnected(uint8_t busnum, uint8_t devaddr, const char *sys_
 	struct libusb_device *dev;
 	unsigned long session_id = busnum << 8 | devaddr;
 
+	forget_shared_descriptors(session_id);
+
 	usbi_mutex_static_lock(&active_contexts_lock);
 	list_for_each_entry(ctx, &active_contexts_list, list, struct libusb_context) {
 		dev = usbi_get_device_by_session_id (ctx, session_id);
@@ -1231,7 +2272,9 @@ static int sysfs_get_device_list(struct libusb_context *ctx)
 {
 	DIR *devices = opendir(SYSFS_DEVICE_PATH);
 	struct dirent *entry;
-	int r = LIBUSB_ERROR_IO;
+	struct linux_device_scan *scans = NULL, *tmp;
+	int num_scans = 0, scans_size = 0;
+	int i, r = LIBUSB_ERROR_IO;
 
 	if (!devices) {
 		usbi_err(ctx, "opendir devices failed errno=%d", errno);
@@ -1243,14 +2286,36 @@ static int sysfs_get_device_list(struct libusb_context *ctx)
 				|| strchr(entry->d_name, ':'))
 			continue;
 
-		if (sysfs_scan_device(ctx, entry->d_name)) {
-			usbi_dbg("failed to enumerate dir entry %s", entry->d_name);
-			continue;
+		if (num_scans == scans_size) {
+			scans_size = scans_size ? scans_size * 2 : 32;
+			tmp = realloc(scans, scans_size * sizeof(*scans));
+			if (!tmp) {
+				r = LIBUSB_ERROR_NO_MEM;
+				goto out;
+			}
+			scans = tmp;
+		}
+		scans[num_scans].sysfs_dir = strdup(entry->d_name);
+		if (!scans[num_scans].sysfs_dir) {
+			r = LIBUSB_ERROR_NO_MEM;
+			goto out;
 		}
+		scans[num_scans].have_address = 0;
+		num_scans++;
+	}
 
+	if (linux_enumerate_devices(ctx, scans, num_scans) > 0)
 		r = 0;
+	for (i = 0; i < num_scans; i++) {
+		if (scans[i].r)
+			usbi_dbg("failed to enumerate dir entry %s",
+				 scans[i].sysfs_dir);
 	}
 
+out:
+	for (i = 0; i < num_scans; i++)
+		free(scans[i].sysfs_dir);
+	free(scans);
 	closedir(devices);
 	return r;
 }
@@ -1274,48 +2339,193 @@ static int linux_default_scan_devices (struct libusb_context *ctx)
 }
 #endif
 
-static int op_open(struct libusb_device_handle *handle)
+/* set up an open handle around a usbfs fd. the caller closes fd on error */
+static int initialize_handle(struct libusb_device_handle *handle, int fd)
 {
 	struct linux_device_handle_priv *hpriv = _device_handle_priv(handle);
 	int r;
 
-	hpriv->fd = _get_usbfs_fd(handle->dev, O_RDWR, 0);
-	if (hpriv->fd < 0) {
-		if (hpriv->fd == LIBUSB_ERROR_NO_DEVICE) {
-			/* device will still be marked as attached if hotplug monitor thread
-			 * hasn't processed remove event yet */
-			usbi_mutex_static_lock(&linux_hotplug_lock);
-			if (handle->dev->attached) {
-				usbi_dbg("open failed with no device, but device still attached");
-				linux_device_disconnected(handle->dev->bus_number,
-						handle->dev->device_address, NULL);
-			}
-			usbi_mutex_static_unlock(&linux_hotplug_lock);
+	hpriv->fd = fd;
+	r = fd_handles_add(hpriv->fd, handle);
+	if (r < 0)
+		return r;
+
+	r = ioctl(hpriv->fd, IOCTL_USBFS_GET_CAPABILITIES, &hpriv->caps);
+	if (r < 0) {
+		if (errno == ENOTTY)
+			usbi_dbg("getcap not available");
+		else
+			usbi_err(HANDLE_CTX(handle), "getcap failed (%d)", errno);
+		hpriv->caps = 0;
+		if (supports_flag_zero_packet)
+			hpriv->caps |= USBFS_CAP_ZERO_PACKET;
+		if (supports_flag_bulk_continuation)
+			hpriv->caps |= USBFS_CAP_BULK_CONTINUATION;
+	}
+
+	r = usbi_add_pollfd(HANDLE_CTX(handle), hpriv->fd, POLLOUT);
+	if (r < 0) {
+		fd_handles_remove(hpriv->fd);
+		return r;
+	}
+
+	list_init(&hpriv->dev_mem);
+	usbi_mutex_init(&hpriv->dev_mem_lock, NULL);
+	return 0;
+}
+
+static int op_open(struct libusb_device_handle *handle)
+{
+	int fd, r;
+
+	fd = _get_usbfs_fd(handle->dev, O_RDWR, 0);
+	if (fd < 0) {
+		if (fd == LIBUSB_ERROR_NO_DEVICE) {
+			/* device will still be marked as attached if hotplug monitor thread
+			 * hasn't processed remove event yet */
+			usbi_mutex_static_lock(&linux_hotplug_lock);
+			if (handle->dev->attached) {
+				usbi_dbg("open failed with no device, but device still attached");
+				linux_device_disconnected(handle->dev->bus_number,
+						handle->dev->device_address, NULL);
+			}
+			usbi_mutex_static_unlock(&linux_hotplug_lock);
+		}
+		return fd;
+	}
+
+	r = initialize_handle(handle, fd);
+	if (r < 0)
+		close(fd);
+	return r;
+}
+
+/* find the bus and the address of the device behind a usbfs fd, and its
+ * speed and port numbers where the kernel tells them */
+static int usbfs_get_device_address(struct libusb_context *ctx, int fd,
+	uint8_t *busnum, uint8_t *devaddr, enum libusb_speed *speed,
+	uint8_t *port_number)
+{
+	struct usbfs_conninfo_ex ci_ex;
+	struct usbfs_connectinfo ci;
+	struct stat statbuf;
+
+	memset(&ci_ex, 0, sizeof(ci_ex));
+	if (ioctl(fd, IOCTL_USBFS_CONNINFO_EX(sizeof(ci_ex)), &ci_ex) == 0) {
+		*busnum = (uint8_t)ci_ex.busnum;
+		*devaddr = (uint8_t)ci_ex.devnum;
+		switch (ci_ex.speed) {
+		case USBFS_SPEED_LOW: *speed = LIBUSB_SPEED_LOW; break;
+		case USBFS_SPEED_FULL: *speed = LIBUSB_SPEED_FULL; break;
+		case USBFS_SPEED_HIGH: *speed = LIBUSB_SPEED_HIGH; break;
+		case USBFS_SPEED_SUPER:
+		case USBFS_SPEED_SUPER_PLUS: *speed = LIBUSB_SPEED_SUPER; break;
+		default: *speed = LIBUSB_SPEED_UNKNOWN;
+		}
+		if (ci_ex.num_ports > 0 && ci_ex.num_ports <= sizeof(ci_ex.ports))
+			*port_number = ci_ex.ports[ci_ex.num_ports - 1];
+		return LIBUSB_SUCCESS;
+	}
+
+	/* before Linux 5.0, only the address and a low speed flag */
+	if (ioctl(fd, IOCTL_USBFS_CONNECTINFO, &ci) < 0) {
+		if (errno == ENODEV)
+			return LIBUSB_ERROR_NO_DEVICE;
+		usbi_err(ctx, "connectinfo failed (%d), not a usbfs fd?", errno);
+		return LIBUSB_ERROR_INVALID_PARAM;
+	}
+	*devaddr = (uint8_t)ci.devnum;
+	*speed = ci.slow ? LIBUSB_SPEED_LOW : LIBUSB_SPEED_UNKNOWN;
+
+	/* the minor number of a /dev/bus/usb node encodes the bus. there is no
+	 * reliable way for the old /proc/bus/usb files */
+	*busnum = 0;
+	if (fstat(fd, &statbuf) == 0 && S_ISCHR(statbuf.st_mode) &&
+			major(statbuf.st_rdev) == USB_DEVICE_MAJOR)
+		*busnum = (uint8_t)(minor(statbuf.st_rdev) / 128 + 1);
+	return LIBUSB_SUCCESS;
+}
+
+static int op_wrap_sys_device(struct libusb_context *ctx,
+	struct libusb_device_handle *handle, intptr_t sys_dev)
+{
+	struct libusb_device *dev;
+	enum libusb_speed speed = LIBUSB_SPEED_UNKNOWN;
+	uint8_t busnum, devaddr, port_number = 0;
+	unsigned long session_id;
+	int fd = (int)sys_dev;
+	int r;
+
+	if (fd < 0)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	r = usbfs_get_device_address(ctx, fd, &busnum, &devaddr, &speed,
+		&port_number);
+	if (r < 0)
+		return r;
+
+	/* use the device the context already knows, if it was discovered */
+	session_id = busnum << 8 | devaddr;
+	dev = busnum ? usbi_get_device_by_session_id(ctx, session_id) : NULL;
+	if (dev) {
+		usbi_dbg("fd %d is device %d/%d", fd, busnum, devaddr);
+	} else {
+		usbi_dbg("allocating new device for fd %d (%d/%d)", fd, busnum,
+			devaddr);
+		dev = usbi_alloc_device(ctx, session_id);
+		if (!dev)
+			return LIBUSB_ERROR_NO_MEM;
+		dev->bus_number = busnum;
+		dev->device_address = devaddr;
+		dev->port_number = port_number;
+		dev->speed = speed;
+
+		r = initialize_wrapped_device(dev, fd);
+		if (r == 0)
+			r = usbi_sanitize_device(dev);
+		if (r < 0) {
+			libusb_unref_device(dev);
+			return r;
 		}
-		return hpriv->fd;
+		/* the device is usable but not in the device list, and no
+		 * hotplug event will disconnect it */
+		dev->attached = 1;
 	}
 
-	r = ioctl(hpriv->fd, IOCTL_USBFS_GET_CAPABILITIES, &hpriv->caps);
+	handle->dev = dev;
+	r = initialize_handle(handle, fd);
 	if (r < 0) {
-		if (errno == ENOTTY)
-			usbi_dbg("getcap not available");
-		else
-			usbi_err(HANDLE_CTX(handle), "getcap failed (%d)", errno);
-		hpriv->caps = 0;
-		if (supports_flag_zero_packet)
-			hpriv->caps |= USBFS_CAP_ZERO_PACKET;
-		if (supports_flag_bulk_continuation)
-			hpriv->caps |= USBFS_CAP_BULK_CONTINUATION;
+		handle->dev = NULL;
+		libusb_unref_device(dev);
+		return r;
 	}
-
-	return usbi_add_pollfd(HANDLE_CTX(handle), hpriv->fd, POLLOUT);
+	_device_handle_priv(handle)->fd_keep = 1;
+	return 0;
 }
 
 static void op_close(struct libusb_device_handle *dev_handle)
 {
-	int fd = _device_handle_priv(dev_handle)->fd;
+	struct linux_device_handle_priv *hpriv = _device_handle_priv(dev_handle);
+	struct linux_dev_mem *mem, *tmp;
+	int fd = hpriv->fd;
+
+	/* nothing can free the buffers left mapped once the handle is gone */
+	list_for_each_entry_safe(mem, tmp, &hpriv->dev_mem, list, struct linux_dev_mem) {
+		usbi_warn(HANDLE_CTX(dev_handle),
+			"closing device with %zu byte buffer still mapped, unmapping it",
+			mem->len);
+		if (munmap(mem->buffer, mem->len) < 0)
+			usbi_err(HANDLE_CTX(dev_handle), "free dev mem failed errno %d",
+				errno);
+		list_del(&mem->list);
+		free(mem);
+	}
+	usbi_mutex_destroy(&hpriv->dev_mem_lock);
+
 	usbi_remove_pollfd(HANDLE_CTX(dev_handle), fd);
-	close(fd);
+	fd_handles_remove(fd);
+	if (!hpriv->fd_keep)
+		close(fd);
 }
 
 static int op_get_configuration(struct libusb_device_handle *handle,
@@ -1323,11 +2533,15 @@ static int op_get_configuration(struct libusb_device_handle *handle,
 {
 	int r;
 
-	if (sysfs_can_relate_devices) {
+	if (sysfs_can_relate_devices && _device_priv(handle->dev)->sysfs_dir) {
 		r = sysfs_get_active_config(handle->dev, config);
 	} else {
 		r = usbfs_get_active_config(handle->dev,
 					    _device_handle_priv(handle)->fd);
+		if (r >= 0) {
+			*config = r;
+			r = 0;
+		}
 	}
 	if (r < 0)
 		return r;
@@ -1544,6 +2758,69 @@ static int op_free_streams(struct libusb_device_handle *handle,
 				endpoints, num_endpoints);
 }
 
+static unsigned char *op_dev_mem_alloc(struct libusb_device_handle *handle,
+	size_t len)
+{
+	struct linux_device_handle_priv *hpriv = _device_handle_priv(handle);
+	struct linux_dev_mem *mem;
+	unsigned char *buffer;
+
+	if (!(hpriv->caps & USBFS_CAP_MMAP))
+		return NULL;
+
+	mem = malloc(sizeof(*mem));
+	if (!mem)
+		return NULL;
+
+	buffer = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED,
+		hpriv->fd, 0);
+	if (buffer == MAP_FAILED) {
+		usbi_dbg("alloc dev mem failed errno %d", errno);
+		free(mem);
+		return NULL;
+	}
+
+	mem->buffer = buffer;
+	mem->len = len;
+	usbi_mutex_lock(&hpriv->dev_mem_lock);
+	list_add(&mem->list, &hpriv->dev_mem);
+	usbi_mutex_unlock(&hpriv->dev_mem_lock);
+	return buffer;
+}
+
+static int op_dev_mem_free(struct libusb_device_handle *handle,
+	unsigned char *buffer, size_t len)
+{
+	struct linux_device_handle_priv *hpriv = _device_handle_priv(handle);
+	struct linux_dev_mem *mem;
+	int found = 0;
+
+	usbi_mutex_lock(&hpriv->dev_mem_lock);
+	list_for_each_entry(mem, &hpriv->dev_mem, list, struct linux_dev_mem) {
+		if (mem->buffer == buffer) {
+			list_del(&mem->list);
+			found = 1;
+			break;
+		}
+	}
+	usbi_mutex_unlock(&hpriv->dev_mem_lock);
+
+	if (!found)
+		return LIBUSB_ERROR_NOT_FOUND;
+
+	if (mem->len != len)
+		usbi_warn(HANDLE_CTX(handle), "freeing dev mem of %zu bytes "
+			"with length %zu", mem->len, len);
+	if (munmap(buffer, mem->len) < 0) {
+		usbi_err(HANDLE_CTX(handle), "free dev mem failed errno %d", errno);
+		free(mem);
+		return LIBUSB_ERROR_OTHER;
+	}
+
+	free(mem);
+	return LIBUSB_SUCCESS;
+}
+
 static int op_kernel_driver_active(struct libusb_device_handle *handle,
 	int interface)
 {
@@ -1694,8 +2971,7 @@ static int op_release_interface(struct libusb_device_handle *handle, int iface)
 static void op_destroy_device(struct libusb_device *dev)
 {
 	struct linux_device_priv *priv = _device_priv(dev);
-	if (priv->descriptors)
-		free(priv->descriptors);
+	release_descriptors(priv);
 	if (priv->sysfs_dir)
 		free(priv->sysfs_dir);
 }
@@ -1737,20 +3013,136 @@ static int discard_urbs(struct usbi_transfer *itransfer, int first, int last_plu
 	return ret;
 }
 
-static void free_iso_urbs(struct linux_transfer_priv *tpriv)
+/* URB arrays are not freed when a transfer completes but kept attached to it,
+ * so that resubmitting a transfer of the same shape does not need to allocate
+ * them again. they are only freed by op_free_transfer_priv(). */
+
+/* get a zeroed array of num_urbs URBs for a control or bulk transfer */
+static struct usbfs_urb *alloc_urbs(struct linux_transfer_priv *tpriv,
+	int num_urbs)
+{
+	size_t alloc_size = num_urbs * sizeof(struct usbfs_urb);
+	struct usbfs_urb *urbs;
+
+	if (tpriv->cached_urbs) {
+		if (tpriv->num_cached_urbs == num_urbs) {
+			urbs = tpriv->cached_urbs;
+			tpriv->cached_urbs = NULL;
+			memset(urbs, 0, alloc_size);
+			return urbs;
+		}
+		free(tpriv->cached_urbs);
+		tpriv->cached_urbs = NULL;
+	}
+
+	return calloc(1, alloc_size);
+}
+
+/* release the URB array of a control or bulk transfer no longer in flight */
+static void free_urbs(struct linux_transfer_priv *tpriv)
+{
+	free(tpriv->cached_urbs);
+	tpriv->cached_urbs = tpriv->urbs;
+	tpriv->num_cached_urbs = tpriv->num_urbs;
+	tpriv->urbs = NULL;
+}
+
+static void free_cached_iso_urbs(struct linux_transfer_priv *tpriv)
 {
 	int i;
-	for (i = 0; i < tpriv->num_urbs; i++) {
-		struct usbfs_urb *urb = tpriv->iso_urbs[i];
-		if (!urb)
-			break;
-		free(urb);
+
+	if (!tpriv->cached_iso_urbs)
+		return;
+
+	for (i = 0; i < tpriv->num_cached_iso_urbs; i++)
+		if (tpriv->cached_iso_urbs[i])
+			free(ISO_URB(tpriv->cached_iso_urbs[i]));
+	free(tpriv->cached_iso_urbs);
+	tpriv->cached_iso_urbs = NULL;
+}
+
+/* get an array for num_urbs iso URB pointers. if the previous submission
+ * used the same number of URBs, its array is returned along with the URBs
+ * it still points to, which alloc_iso_urb() will then try to reuse. */
+static struct usbfs_urb **alloc_iso_urbs(struct linux_transfer_priv *tpriv,
+	int num_urbs)
+{
+	struct usbfs_urb **urbs;
+
+	if (tpriv->cached_iso_urbs) {
+		if (tpriv->num_cached_iso_urbs == num_urbs) {
+			urbs = tpriv->cached_iso_urbs;
+			tpriv->cached_iso_urbs = NULL;
+			return urbs;
+		}
+		free_cached_iso_urbs(tpriv);
+	}
+
+	return calloc(num_urbs, sizeof(*urbs));
+}
+
+/* get a zeroed iso URB with num_packets packet descriptors in slot i,
+ * carrying the transfer packets from packet_offset on */
+static struct usbfs_urb *alloc_iso_urb(struct usbfs_urb **urbs, int i,
+	int num_packets, int packet_offset)
+{
+	struct linux_iso_urb *iso_urb = NULL;
+	size_t alloc_size = sizeof(*iso_urb)
+		+ (num_packets * sizeof(struct usbfs_iso_packet_desc));
+
+	/* the kernel never changes number_of_packets, so it still holds the
+	 * value of the previous submission */
+	if (urbs[i]) {
+		iso_urb = ISO_URB(urbs[i]);
+		if (urbs[i]->number_of_packets == num_packets) {
+			memset(iso_urb, 0, alloc_size);
+		} else {
+			free(iso_urb);
+			iso_urb = NULL;
+		}
+	}
+	if (!iso_urb) {
+		iso_urb = calloc(1, alloc_size);
+		if (!iso_urb) {
+			urbs[i] = NULL;
+			return NULL;
+		}
 	}
 
-	free(tpriv->iso_urbs);
+	iso_urb->index = i;
+	iso_urb->packet_offset = packet_offset;
+	urbs[i] = &iso_urb->urb;
+	return urbs[i];
+}
+
+/* release the URBs of an iso transfer no longer in flight */
+static void free_iso_urbs(struct linux_transfer_priv *tpriv)
+{
+	free_cached_iso_urbs(tpriv);
+	tpriv->cached_iso_urbs = tpriv->iso_urbs;
+	tpriv->num_cached_iso_urbs = tpriv->num_urbs;
 	tpriv->iso_urbs = NULL;
 }
 
+/* get the fragments of the data of a bulk transfer. a transfer that is not
+ * vectored is described by the single fragment passed in. */
+static struct libusb_iovec *get_bulk_iov(struct usbi_transfer *itransfer,
+	struct libusb_iovec *single, int *num_iov)
+{
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+
+	if (USBI_TRANSFER_IS_IOV(itransfer)) {
+		*num_iov = itransfer->num_iov;
+		return itransfer->iov;
+	}
+
+	single->buffer = transfer->buffer;
+	single->length = transfer->length;
+	*num_iov = 1;
+	return single;
+}
+
 static int submit_bulk_transfer(struct usbi_transfer *itransfer)
 {
 	struct libusb_transfer *transfer =
@@ -1761,10 +3153,12 @@ static int submit_bulk_transfer(struct usbi_transfer *itransfer)
 	struct usbfs_urb *urbs;
 	int is_out = (transfer->endpoint & LIBUSB_ENDPOINT_DIR_MASK)
 		== LIBUSB_ENDPOINT_OUT;
+	struct libusb_iovec single, *iov;
 	int bulk_buffer_len, use_bulk_continuation;
+	int num_iov, iov_idx, iov_offset;
+	int num_urbs;
 	int r;
 	int i;
-	size_t alloc_size;
 
 	if (tpriv->urbs)
 		return LIBUSB_ERROR_BUSY;
@@ -1791,10 +3185,16 @@ static int submit_bulk_transfer(struct usbi_transfer *itransfer)
 	 * Last, there is the issue of short-transfers when splitting, for
 	 * short split-transfers to work reliable USBFS_CAP_BULK_CONTINUATION
 	 * is needed, but this is not always available.
+	 *
+	 * The fragments of a vectored transfer are mapped to URBs of their
+	 * own, which are split further in the same way. A vectored IN transfer
+	 * of more than one URB always needs bulk continuation: without it, a
+	 * short packet ends one URB and the next one goes on to read into the
+	 * following fragment, leaving the data at the wrong offsets.
 	 */
 	if (dpriv->caps & USBFS_CAP_BULK_SCATTER_GATHER) {
 		/* Good! Just submit everything in one go */
-		bulk_buffer_len = transfer->length ? transfer->length : 1;
+		bulk_buffer_len = INT_MAX;
 		use_bulk_continuation = 0;
 	} else if (dpriv->caps & USBFS_CAP_BULK_CONTINUATION) {
 		/* Split the transfers and use bulk-continuation to
@@ -1804,7 +3204,7 @@ static int submit_bulk_transfer(struct usbi_transfer *itransfer)
 	} else if (dpriv->caps & USBFS_CAP_NO_PACKET_SIZE_LIM) {
 		/* Don't split, assume the kernel can alloc the buffer
 		   (otherwise the submit will fail with -ENOMEM) */
-		bulk_buffer_len = transfer->length ? transfer->length : 1;
+		bulk_buffer_len = INT_MAX;
 		use_bulk_continuation = 0;
 	} else {
 		/* Bad, splitting without bulk-continuation, short transfers
@@ -1815,19 +3215,24 @@ static int submit_bulk_transfer(struct usbi_transfer *itransfer)
 		use_bulk_continuation = 0;
 	}
 
-	int num_urbs = transfer->length / bulk_buffer_len;
-	int last_urb_partial = 0;
-
-	if (transfer->length == 0) {
+	iov = get_bulk_iov(itransfer, &single, &num_iov);
+	num_urbs = 0;
+	for (i = 0; i < num_iov; i++) {
+		num_urbs += iov[i].length / bulk_buffer_len;
+		if (iov[i].length % bulk_buffer_len)
+			num_urbs++;
+	}
+	/* a zero length transfer still needs an URB */
+	if (num_urbs == 0)
 		num_urbs = 1;
-	} else if ((transfer->length % bulk_buffer_len) > 0) {
-		last_urb_partial = 1;
-		num_urbs++;
+	if (!is_out && num_urbs > 1 && USBI_TRANSFER_IS_IOV(itransfer)) {
+		if (!(dpriv->caps & USBFS_CAP_BULK_CONTINUATION))
+			return LIBUSB_ERROR_NOT_SUPPORTED;
+		use_bulk_continuation = 1;
 	}
 	usbi_dbg("need %d urbs for new transfer with length %d", num_urbs,
 		transfer->length);
-	alloc_size = num_urbs * sizeof(struct usbfs_urb);
-	urbs = calloc(1, alloc_size);
+	urbs = alloc_urbs(tpriv, num_urbs);
 	if (!urbs)
 		return LIBUSB_ERROR_NO_MEM;
 	tpriv->urbs = urbs;
@@ -1836,6 +3241,8 @@ static int submit_bulk_transfer(struct usbi_transfer *itransfer)
 	tpriv->reap_action = NORMAL;
 	tpriv->reap_status = LIBUSB_TRANSFER_COMPLETED;
 
+	iov_idx = 0;
+	iov_offset = 0;
 	for (i = 0; i < num_urbs; i++) {
 		struct usbfs_urb *urb = &urbs[i];
 		urb->usercontext = itransfer;
@@ -1853,16 +3260,19 @@ static int submit_bulk_transfer(struct usbi_transfer *itransfer)
 			break;
 		}
 		urb->endpoint = transfer->endpoint;
-		urb->buffer = transfer->buffer + (i * bulk_buffer_len);
+		/* move on to the next fragment with data left */
+		while (iov_idx < num_iov - 1 &&
+				iov_offset == iov[iov_idx].length) {
+			iov_idx++;
+			iov_offset = 0;
+		}
+		urb->buffer = iov[iov_idx].buffer + iov_offset;
+		urb->buffer_length = MIN(bulk_buffer_len,
+			iov[iov_idx].length - iov_offset);
+		iov_offset += urb->buffer_length;
 		/* don't set the short not ok flag for the last URB */
 		if (use_bulk_continuation && !is_out && (i < num_urbs - 1))
 			urb->flags = USBFS_URB_SHORT_NOT_OK;
-		if (i == num_urbs - 1 && last_urb_partial)
-			urb->buffer_length = transfer->length % bulk_buffer_len;
-		else if (transfer->length == 0)
-			urb->buffer_length = 0;
-		else
-			urb->buffer_length = bulk_buffer_len;
 
 		if (i > 0 && use_bulk_continuation)
 			urb->flags |= USBFS_URB_BULK_CONTINUATION;
@@ -1886,8 +3296,7 @@ static int submit_bulk_transfer(struct usbi_transfer *itransfer)
 			 * return failure immediately. */
 			if (i == 0) {
 				usbi_dbg("first URB failed, easy peasy");
-				free(urbs);
-				tpriv->urbs = NULL;
+				free_urbs(tpriv);
 				return r;
 			}
 
@@ -1936,7 +3345,6 @@ static int submit_iso_transfer(struct usbi_transfer *itransfer)
 	struct linux_device_handle_priv *dpriv =
 		_device_handle_priv(transfer->dev_handle);
 	struct usbfs_urb **urbs;
-	size_t alloc_size;
 	int num_packets = transfer->num_iso_packets;
 	int i;
 	int this_urb_len = 0;
@@ -1973,8 +3381,7 @@ static int submit_iso_transfer(struct usbi_transfer *itransfer)
 	}
 	usbi_dbg("need %d 32k URBs for transfer", num_urbs);
 
-	alloc_size = num_urbs * sizeof(*urbs);
-	urbs = calloc(1, alloc_size);
+	urbs = alloc_iso_urbs(tpriv, num_urbs);
 	if (!urbs)
 		return LIBUSB_ERROR_NO_MEM;
 
@@ -1982,7 +3389,6 @@ static int submit_iso_transfer(struct usbi_transfer *itransfer)
 	tpriv->num_urbs = num_urbs;
 	tpriv->num_retired = 0;
 	tpriv->reap_action = NORMAL;
-	tpriv->iso_packet_offset = 0;
 
 	/* allocate + initialize each URB with the correct number of packets */
 	for (i = 0; i < num_urbs; i++) {
@@ -2008,14 +3414,12 @@ static int submit_iso_transfer(struct usbi_transfer *itransfer)
 			}
 		}
 
-		alloc_size = sizeof(*urb)
-			+ (urb_packet_offset * sizeof(struct usbfs_iso_packet_desc));
-		urb = calloc(1, alloc_size);
+		urb = alloc_iso_urb(urbs, i, urb_packet_offset,
+			packet_offset - urb_packet_offset);
 		if (!urb) {
 			free_iso_urbs(tpriv);
 			return LIBUSB_ERROR_NO_MEM;
 		}
-		urbs[i] = urb;
 
 		/* populate packet lengths */
 		for (j = 0, k = packet_offset - urb_packet_offset;
@@ -2098,7 +3502,7 @@ static int submit_control_transfer(struct usbi_transfer *itransfer)
 	if (transfer->length - LIBUSB_CONTROL_SETUP_SIZE > MAX_CTRL_BUFFER_LENGTH)
 		return LIBUSB_ERROR_INVALID_PARAM;
 
-	urb = calloc(1, sizeof(struct usbfs_urb));
+	urb = alloc_urbs(tpriv, 1);
 	if (!urb)
 		return LIBUSB_ERROR_NO_MEM;
 	tpriv->urbs = urb;
@@ -2113,8 +3517,7 @@ static int submit_control_transfer(struct usbi_transfer *itransfer)
 
 	r = ioctl(dpriv->fd, IOCTL_USBFS_SUBMITURB, urb);
 	if (r < 0) {
-		free(urb);
-		tpriv->urbs = NULL;
+		free_urbs(tpriv);
 		if (errno == ENODEV)
 			return LIBUSB_ERROR_NO_DEVICE;
 
@@ -2129,22 +3532,33 @@ static int op_submit_transfer(struct usbi_transfer *itransfer)
 {
 	struct libusb_transfer *transfer =
 		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	struct linux_transfer_priv *tpriv = usbi_transfer_get_os_priv(itransfer);
+	int r;
 
 	switch (transfer->type) {
 	case LIBUSB_TRANSFER_TYPE_CONTROL:
-		return submit_control_transfer(itransfer);
+		r = submit_control_transfer(itransfer);
+		break;
 	case LIBUSB_TRANSFER_TYPE_BULK:
 	case LIBUSB_TRANSFER_TYPE_BULK_STREAM:
-		return submit_bulk_transfer(itransfer);
 	case LIBUSB_TRANSFER_TYPE_INTERRUPT:
-		return submit_bulk_transfer(itransfer);
+		r = submit_bulk_transfer(itransfer);
+		break;
 	case LIBUSB_TRANSFER_TYPE_ISOCHRONOUS:
-		return submit_iso_transfer(itransfer);
+		r = submit_iso_transfer(itransfer);
+		break;
 	default:
 		usbi_err(TRANSFER_CTX(transfer),
 			"unknown endpoint type %d", transfer->type);
 		return LIBUSB_ERROR_INVALID_PARAM;
 	}
+
+	if (r == 0) {
+		usbi_stats_requests(itransfer, tpriv->num_urbs);
+		usbi_trace4(backend__submit, transfer, transfer->endpoint,
+			transfer->length, tpriv->num_urbs);
+	}
+	return r;
 }
 
 static int op_cancel_transfer(struct usbi_transfer *itransfer)
@@ -2190,8 +3604,7 @@ static void op_clear_transfer_priv(struct usbi_transfer *itransfer)
 	case LIBUSB_TRANSFER_TYPE_INTERRUPT:
 		usbi_mutex_lock(&itransfer->lock);
 		if (tpriv->urbs)
-			free(tpriv->urbs);
-		tpriv->urbs = NULL;
+			free_urbs(tpriv);
 		usbi_mutex_unlock(&itransfer->lock);
 		break;
 	case LIBUSB_TRANSFER_TYPE_ISOCHRONOUS:
@@ -2206,11 +3619,88 @@ static void op_clear_transfer_priv(struct usbi_transfer *itransfer)
 	}
 }
 
+static void op_free_transfer_priv(struct usbi_transfer *itransfer)
+{
+	struct linux_transfer_priv *tpriv = usbi_transfer_get_os_priv(itransfer);
+
+	free(tpriv->cached_urbs);
+	tpriv->cached_urbs = NULL;
+	free_cached_iso_urbs(tpriv);
+}
+
+static int sync_transfer_error(void)
+{
+	switch (errno) {
+	case ETIMEDOUT:
+		return LIBUSB_ERROR_TIMEOUT;
+	case EPIPE:
+		return LIBUSB_ERROR_PIPE;
+	case EOVERFLOW:
+		return LIBUSB_ERROR_OVERFLOW;
+	case ENODEV:
+		return LIBUSB_ERROR_NO_DEVICE;
+	case ENOMEM:
+		return LIBUSB_ERROR_NO_MEM;
+	default:
+		usbi_dbg("synchronous transfer failed error %d", errno);
+		return LIBUSB_ERROR_IO;
+	}
+}
+
+static int op_sync_control_transfer(struct libusb_device_handle *handle,
+	uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue,
+	uint16_t wIndex, unsigned char *data, uint16_t wLength,
+	unsigned int timeout)
+{
+	int fd = _device_handle_priv(handle)->fd;
+	struct usbfs_ctrltransfer ctrl;
+	int r;
+
+	if (wLength > MAX_CTRL_BUFFER_LENGTH)
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+
+	ctrl.bmRequestType = bmRequestType;
+	ctrl.bRequest = bRequest;
+	ctrl.wValue = wValue;
+	ctrl.wIndex = wIndex;
+	ctrl.wLength = wLength;
+	ctrl.timeout = timeout;
+	ctrl.data = data;
+
+	r = ioctl(fd, IOCTL_USBFS_CONTROL, &ctrl);
+	if (r < 0)
+		return sync_transfer_error();
+	return r;
+}
+
+static int op_sync_bulk_transfer(struct libusb_device_handle *handle,
+	unsigned char endpoint, unsigned char *data, int length,
+	unsigned int timeout)
+{
+	int fd = _device_handle_priv(handle)->fd;
+	struct usbfs_bulktransfer bulk;
+	int r;
+
+	/* older kernels refuse larger buffers, and the async path splits them
+	 * into several URBs anyway */
+	if (length < 0 || length > MAX_BULK_BUFFER_LENGTH)
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+
+	bulk.ep = endpoint;
+	bulk.len = length;
+	bulk.timeout = timeout;
+	bulk.data = data;
+
+	r = ioctl(fd, IOCTL_USBFS_BULK, &bulk);
+	if (r < 0)
+		return sync_transfer_error();
+	return r;
+}
+
 static int handle_bulk_completion(struct usbi_transfer *itransfer,
 	struct usbfs_urb *urb)
 {
 	struct linux_transfer_priv *tpriv = usbi_transfer_get_os_priv(itransfer);
-	struct libusb_transfer *transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
 	int urb_idx = urb - tpriv->urbs;
 
 	usbi_mutex_lock(&itransfer->lock);
@@ -2240,13 +3730,37 @@ static int handle_bulk_completion(struct usbi_transfer *itransfer,
 		 * transferred data and presents it in a contiguous chunk.
 		 */
 		if (urb->actual_length > 0) {
-			unsigned char *target = transfer->buffer + itransfer->transferred;
+			struct libusb_iovec single, *iov;
+			unsigned char *source = urb->buffer;
+			int offset = itransfer->transferred;
+			int remaining = urb->actual_length;
+			int num_iov, iov_idx;
+
 			usbi_dbg("received %d bytes of surplus data", urb->actual_length);
-			if (urb->buffer != target) {
-				usbi_dbg("moving surplus data from offset %d to offset %d",
-					(unsigned char *) urb->buffer - transfer->buffer,
-					target - transfer->buffer);
-				memmove(target, urb->buffer, urb->actual_length);
+			/* the data of a vectored transfer is contiguous only within
+			 * each fragment, so move the surplus piece by piece. the
+			 * target always lies before the source, so moving from front
+			 * to back never overwrites data that is still to be moved. */
+			iov = get_bulk_iov(itransfer, &single, &num_iov);
+			for (iov_idx = 0; iov_idx < num_iov && remaining > 0;
+					iov_idx++) {
+				unsigned char *target;
+				int len;
+
+				if (offset >= iov[iov_idx].length) {
+					offset -= iov[iov_idx].length;
+					continue;
+				}
+				target = iov[iov_idx].buffer + offset;
+				len = MIN(remaining, iov[iov_idx].length - offset);
+				if (source != target) {
+					usbi_dbg("moving %d bytes of surplus data to offset "
+						"%d of fragment %d", len, offset, iov_idx);
+					memmove(target, source, len);
+				}
+				source += len;
+				remaining -= len;
+				offset = 0;
 			}
 			itransfer->transferred += urb->actual_length;
 		}
@@ -2334,33 +3848,62 @@ out_unlock:
 	return 0;
 
 completed:
-	free(tpriv->urbs);
-	tpriv->urbs = NULL;
+	free_urbs(tpriv);
 	usbi_mutex_unlock(&itransfer->lock);
 	return CANCELLED == tpriv->reap_action ?
 		usbi_handle_transfer_cancellation(itransfer) :
 		usbi_handle_transfer_completion(itransfer, tpriv->reap_status);
 }
 
+/* convert the usbfs status of an iso packet */
+static enum libusb_transfer_status iso_packet_status(
+	struct libusb_transfer *transfer, int status)
+{
+	switch (status) {
+	case 0:
+	case -ENOENT: /* cancelled */
+	case -ECONNRESET:
+		return LIBUSB_TRANSFER_COMPLETED;
+	case -ENODEV:
+	case -ESHUTDOWN:
+		usbi_dbg("device removed");
+		return LIBUSB_TRANSFER_NO_DEVICE;
+	case -EPIPE:
+		usbi_dbg("detected endpoint stall");
+		return LIBUSB_TRANSFER_STALL;
+	case -EOVERFLOW:
+		usbi_dbg("overflow error");
+		return LIBUSB_TRANSFER_OVERFLOW;
+	case -ETIME:
+	case -EPROTO:
+	case -EILSEQ:
+	case -ECOMM:
+	case -ENOSR:
+	case -EXDEV:
+		usbi_dbg("low-level USB error %d", status);
+		return LIBUSB_TRANSFER_ERROR;
+	default:
+		usbi_warn(TRANSFER_CTX(transfer),
+			"unrecognised urb status %d", status);
+		return LIBUSB_TRANSFER_ERROR;
+	}
+}
+
 static int handle_iso_completion(struct usbi_transfer *itransfer,
 	struct usbfs_urb *urb)
 {
 	struct libusb_transfer *transfer =
 		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
 	struct linux_transfer_priv *tpriv = usbi_transfer_get_os_priv(itransfer);
+	struct linux_iso_urb *iso_urb = ISO_URB(urb);
+	struct libusb_iso_packet_descriptor *lib_desc;
 	int num_urbs = tpriv->num_urbs;
-	int urb_idx = 0;
+	int urb_idx = iso_urb->index + 1;
 	int i;
 	enum libusb_transfer_status status = LIBUSB_TRANSFER_COMPLETED;
 
 	usbi_mutex_lock(&itransfer->lock);
-	for (i = 0; i < num_urbs; i++) {
-		if (urb == tpriv->iso_urbs[i]) {
-			urb_idx = i + 1;
-			break;
-		}
-	}
-	if (urb_idx == 0) {
+	if (iso_urb->index >= num_urbs || tpriv->iso_urbs[iso_urb->index] != urb) {
 		usbi_err(TRANSFER_CTX(transfer), "could not locate urb!");
 		usbi_mutex_unlock(&itransfer->lock);
 		return LIBUSB_ERROR_NOT_FOUND;
@@ -2369,48 +3912,17 @@ static int handle_iso_completion(struct usbi_transfer *itransfer,
 	usbi_dbg("handling completion status %d of iso urb %d/%d", urb->status,
 		urb_idx, num_urbs);
 
-	/* copy isochronous results back in */
-
+	/* copy isochronous results back in. packets nearly always succeed, so
+	 * only the ones that did not go through the status conversion */
+	lib_desc = &transfer->iso_packet_desc[iso_urb->packet_offset];
 	for (i = 0; i < urb->number_of_packets; i++) {
-		struct usbfs_iso_packet_desc *urb_desc = &urb->iso_frame_desc[i];
-		struct libusb_iso_packet_descriptor *lib_desc =
-			&transfer->iso_packet_desc[tpriv->iso_packet_offset++];
-		lib_desc->status = LIBUSB_TRANSFER_COMPLETED;
-		switch (urb_desc->status) {
-		case 0:
-			break;
-		case -ENOENT: /* cancelled */
-		case -ECONNRESET:
-			break;
-		case -ENODEV:
-		case -ESHUTDOWN:
-			usbi_dbg("device removed");
-			lib_desc->status = LIBUSB_TRANSFER_NO_DEVICE;
-			break;
-		case -EPIPE:
-			usbi_dbg("detected endpoint stall");
-			lib_desc->status = LIBUSB_TRANSFER_STALL;
-			break;
-		case -EOVERFLOW:
-			usbi_dbg("overflow error");
-			lib_desc->status = LIBUSB_TRANSFER_OVERFLOW;
-			break;
-		case -ETIME:
-		case -EPROTO:
-		case -EILSEQ:
-		case -ECOMM:
-		case -ENOSR:
-		case -EXDEV:
-			usbi_dbg("low-level USB error %d", urb_desc->status);
-			lib_desc->status = LIBUSB_TRANSFER_ERROR;
-			break;
-		default:
-			usbi_warn(TRANSFER_CTX(transfer),
-				"unrecognised urb status %d", urb_desc->status);
-			lib_desc->status = LIBUSB_TRANSFER_ERROR;
-			break;
-		}
-		lib_desc->actual_length = urb_desc->actual_length;
+		lib_desc[i].actual_length = urb->iso_frame_desc[i].actual_length;
+		lib_desc[i].status = LIBUSB_TRANSFER_COMPLETED;
+	}
+	for (i = 0; i < urb->number_of_packets; i++) {
+		if (urb->iso_frame_desc[i].status)
+			lib_desc[i].status = iso_packet_status(transfer,
+				urb->iso_frame_desc[i].status);
 	}
 
 	tpriv->num_retired++;
@@ -2478,8 +3990,7 @@ static int handle_control_completion(struct usbi_transfer *itransfer,
 		if (urb->status != 0 && urb->status != -ENOENT)
 			usbi_warn(ITRANSFER_CTX(itransfer),
 				"cancel: unrecognised urb status %d", urb->status);
-		free(tpriv->urbs);
-		tpriv->urbs = NULL;
+		free_urbs(tpriv);
 		usbi_mutex_unlock(&itransfer->lock);
 		return usbi_handle_transfer_cancellation(itransfer);
 	}
@@ -2519,34 +4030,21 @@ static int handle_control_completion(struct usbi_transfer *itransfer,
 		break;
 	}
 
-	free(tpriv->urbs);
-	tpriv->urbs = NULL;
+	free_urbs(tpriv);
 	usbi_mutex_unlock(&itransfer->lock);
 	return usbi_handle_transfer_completion(itransfer, status);
 }
 
-static int reap_for_handle(struct libusb_device_handle *handle)
-{
-	struct linux_device_handle_priv *hpriv = _device_handle_priv(handle);
-	int r;
-	struct usbfs_urb *urb;
-	struct usbi_transfer *itransfer;
-	struct libusb_transfer *transfer;
-
-	r = ioctl(hpriv->fd, IOCTL_USBFS_REAPURBNDELAY, &urb);
-	if (r == -1 && errno == EAGAIN)
-		return 1;
-	if (r < 0) {
-		if (errno == ENODEV)
-			return LIBUSB_ERROR_NO_DEVICE;
-
-		usbi_err(HANDLE_CTX(handle), "reap failed error %d errno=%d",
-			r, errno);
-		return LIBUSB_ERROR_IO;
-	}
+/* maximum number of URBs reaped from a handle before their completions are
+ * dispatched */
+#define REAP_BATCH_SIZE	64
 
-	itransfer = urb->usercontext;
-	transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+static int handle_urb_completion(struct libusb_device_handle *handle,
+	struct usbfs_urb *urb)
+{
+	struct usbi_transfer *itransfer = urb->usercontext;
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
 
 	usbi_dbg("urb type=%d status=%d transferred=%d", urb->type, urb->status,
 		urb->actual_length);
@@ -2567,33 +4065,81 @@ static int reap_for_handle(struct libusb_device_handle *handle)
 	}
 }
 
+/* reap up to REAP_BATCH_SIZE ready URBs from the handle and only then run
+ * their completions, so the ioctls are not interleaved with the locking done
+ * during completion. the number of URBs reaped is added to reaped, if given.
+ * returns 0 if the batch filled up and more URBs may be ready, 1 if there was
+ * nothing more to reap, or a LIBUSB_ERROR code. */
+static int reap_for_handle(struct libusb_device_handle *handle, int *reaped)
+{
+	struct linux_device_handle_priv *hpriv = _device_handle_priv(handle);
+	struct libusb_context *ctx = HANDLE_CTX(handle);
+	struct usbfs_urb *urbs[REAP_BATCH_SIZE];
+	int num_urbs = 0;
+	int ret = 0;
+	int i, r;
+
+	while (num_urbs < REAP_BATCH_SIZE) {
+		r = ioctl(hpriv->fd, IOCTL_USBFS_REAPURBNDELAY, &urbs[num_urbs]);
+		if (r == -1 && errno == EAGAIN) {
+			ret = 1;
+			break;
+		}
+		if (r < 0) {
+			if (errno == ENODEV) {
+				ret = LIBUSB_ERROR_NO_DEVICE;
+			} else {
+				usbi_err(ctx, "reap failed error %d errno=%d", r, errno);
+				ret = LIBUSB_ERROR_IO;
+			}
+			break;
+		}
+		num_urbs++;
+	}
+
+	if (reaped)
+		*reaped += num_urbs;
+	if (num_urbs) {
+		usbi_stats_reap(handle, num_urbs);
+		usbi_trace2(reap, handle, num_urbs);
+		usbi_dbg("reaped %d urbs", num_urbs);
+	}
+
+	/* the URBs have already been taken from the kernel, so every one of them
+	 * has to be completed even if one of the completions fails */
+	for (i = 0; i < num_urbs; i++) {
+		r = handle_urb_completion(handle, urbs[i]);
+		if (r < 0 && ret >= 0)
+			ret = r;
+	}
+
+	return ret;
+}
+
 static int op_handle_events(struct libusb_context *ctx,
 	struct pollfd *fds, POLL_NFDS_TYPE nfds, int num_ready)
 {
 	int r;
 	unsigned int i = 0;
 
-	usbi_mutex_lock(&ctx->open_devs_lock);
+	/* handles cannot be closed while we hold the event handling lock, so
+	 * the fd table lookup is enough to find a valid handle */
 	for (i = 0; i < nfds && num_ready > 0; i++) {
 		struct pollfd *pollfd = &fds[i];
 		struct libusb_device_handle *handle;
-		struct linux_device_handle_priv *hpriv = NULL;
+		struct linux_device_handle_priv *hpriv;
 
 		if (!pollfd->revents)
 			continue;
 
 		num_ready--;
-		list_for_each_entry(handle, &ctx->open_devs, list, struct libusb_device_handle) {
-			hpriv = _device_handle_priv(handle);
-			if (hpriv->fd == pollfd->fd)
-				break;
-		}
-
-		if (!hpriv || hpriv->fd != pollfd->fd) {
+		handle = fd_handles_lookup(pollfd->fd);
+		if (!handle || HANDLE_CTX(handle) != ctx) {
 			usbi_err(ctx, "cannot find handle for fd %d\n",
 				 pollfd->fd);
 			continue;
 		}
+		hpriv = _device_handle_priv(handle);
 
 		if (pollfd->revents & POLLERR) {
 			usbi_remove_pollfd(HANDLE_CTX(handle), hpriv->fd);
@@ -2609,18 +4155,39 @@ static int op_handle_events(struct libusb_context *ctx,
 		}
 
 		do {
-			r = reap_for_handle(handle);
+			r = reap_for_handle(handle, NULL);
 		} while (r == 0);
 		if (r == 1 || r == LIBUSB_ERROR_NO_DEVICE)
 			continue;
 		else if (r < 0)
-			goto out;
+			return r;
 	}
 
-	r = 0;
-out:
-	usbi_mutex_unlock(&ctx->open_devs_lock);
-	return r;
+	return 0;
+}
+
+static int op_get_pollfd(struct libusb_device_handle *handle,
+	struct libusb_pollfd *pollfd)
+{
+	pollfd->fd = _device_handle_priv(handle)->fd;
+	pollfd->events = POLLOUT;
+	return 0;
+}
+
+/* a REAPURBNDELAY that finds nothing is the whole cost of a spin */
+static int op_busy_poll(struct libusb_device_handle *handle)
+{
+	int reaped = 0;
+	int r;
+
+	do {
+		r = reap_for_handle(handle, &reaped);
+	} while (r == 0);
+
+	/* a disconnect is noticed by poll() once the spin is over */
+	if (r < 0 && r != LIBUSB_ERROR_NO_DEVICE)
+		return r;
+	return reaped;
 }
 
 static int op_clock_gettime(int clk_id, struct timespec *tp)
@@ -2645,7 +4212,7 @@ static clockid_t op_get_timerfd_clockid(void)
 
 const struct usbi_os_backend linux_usbfs_backend = {
 	.name = "Linux usbfs",
-	.caps = USBI_CAP_HAS_HID_ACCESS|USBI_CAP_SUPPORTS_DETACH_KERNEL_DRIVER|USBI_CAP_HAS_POLLABLE_DEVICE_FD,
+	.caps = USBI_CAP_HAS_HID_ACCESS|USBI_CAP_SUPPORTS_DETACH_KERNEL_DRIVER|USBI_CAP_HAS_POLLABLE_DEVICE_FD|USBI_CAP_SUPPORTS_BULK_IOV,
 	.init = op_init,
 	.exit = op_exit,
 	.get_device_list = NULL,
@@ -2654,8 +4221,10 @@ const struct usbi_os_backend linux_usbfs_backend = {
 	.get_active_config_descriptor = op_get_active_config_descriptor,
 	.get_config_descriptor = op_get_config_descriptor,
 	.get_config_descriptor_by_value = op_get_config_descriptor_by_value,
+	.get_device_string = op_get_device_string,
 
 	.open = op_open,
+	.wrap_sys_device = op_wrap_sys_device,
 	.close = op_close,
 	.get_configuration = op_get_configuration,
 	.set_configuration = op_set_configuration,
@@ -2669,6 +4238,9 @@ const struct usbi_os_backend linux_usbfs_backend = {
 	.alloc_streams = op_alloc_streams,
 	.free_streams = op_free_streams,
 
+	.dev_mem_alloc = op_dev_mem_alloc,
+	.dev_mem_free = op_dev_mem_free,
+
 	.kernel_driver_active = op_kernel_driver_active,
 	.detach_kernel_driver = op_detach_kernel_driver,
 	.attach_kernel_driver = op_attach_kernel_driver,
@@ -2678,8 +4250,13 @@ const struct usbi_os_backend linux_usbfs_backend = {
 	.submit_transfer = op_submit_transfer,
 	.cancel_transfer = op_cancel_transfer,
 	.clear_transfer_priv = op_clear_transfer_priv,
+	.free_transfer_priv = op_free_transfer_priv,
+	.sync_control_transfer = op_sync_control_transfer,
+	.sync_bulk_transfer = op_sync_bulk_transfer,
 
 	.handle_events = op_handle_events,
+	.get_pollfd = op_get_pollfd,
+	.busy_poll = op_busy_poll,
 
 	.clock_gettime = op_clock_gettime,
 
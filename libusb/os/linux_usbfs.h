@@ -109,6 +109,23 @@ struct usbfs_connectinfo {
 	unsigned char slow;
 };
 
+/* since Linux 5.0 */
+struct usbfs_conninfo_ex {
+	uint32_t size;		/* size of the structure filled in by the kernel */
+	uint32_t busnum;
+	uint32_t devnum;
+	uint32_t speed;		/* enum usb_device_speed of the kernel */
+	uint8_t num_ports;	/* number of entries in ports */
+	uint8_t ports[7];	/* port numbers from the root hub down */
+};
+
+#define USBFS_SPEED_LOW		1
+#define USBFS_SPEED_FULL	2
+#define USBFS_SPEED_HIGH	3
+#define USBFS_SPEED_WIRELESS	4
+#define USBFS_SPEED_SUPER	5
+#define USBFS_SPEED_SUPER_PLUS	6
+
 struct usbfs_ioctl {
 	int ifno;	/* interface 0..N ; negative numbers reserved */
 	int ioctl_code;	/* MUST encode size + direction of data so the
@@ -125,6 +142,8 @@ struct usbfs_hub_portinfo {
 #define USBFS_CAP_BULK_CONTINUATION	0x02
 #define USBFS_CAP_NO_PACKET_SIZE_LIM	0x04
 #define USBFS_CAP_BULK_SCATTER_GATHER	0x08
+#define USBFS_CAP_REAP_AFTER_DISCONNECT	0x10
+#define USBFS_CAP_MMAP			0x20
 
 #define USBFS_DISCONNECT_CLAIM_IF_DRIVER	0x01
 #define USBFS_DISCONNECT_CLAIM_EXCEPT_DRIVER	0x02
@@ -166,6 +185,10 @@ struct usbfs_streams {
 #define IOCTL_USBFS_DISCONNECT_CLAIM	_IOR('U', 27, struct usbfs_disconnect_claim)
 #define IOCTL_USBFS_ALLOC_STREAMS	_IOR('U', 28, struct usbfs_streams)
 #define IOCTL_USBFS_FREE_STREAMS	_IOR('U', 29, struct usbfs_streams)
+#define IOCTL_USBFS_CONNINFO_EX(len)	_IOC(_IOC_READ, 'U', 32, len)
+
+/* character device major of the /dev/bus/usb nodes */
+#define USB_DEVICE_MAJOR	189
 
 extern usbi_mutex_static_t linux_hotplug_lock;
 
@@ -189,4 +212,22 @@ int linux_get_device_address (struct libusb_context *ctx, int detached,
 int linux_enumerate_device(struct libusb_context *ctx,
 	uint8_t busnum, uint8_t devaddr, const char *sysfs_dir);
 
+struct linux_device_scan {
+	char *sysfs_dir;
+	int have_address;
+	uint8_t busnum;
+	uint8_t devaddr;
+
+	/* set by linux_enumerate_devices() */
+	struct libusb_device *dev;
+	int r;
+	/* inode number of the sysfs directory, if the enumeration cache is
+	 * used, and whether the device came from the cache */
+	uint64_t ino;
+	int cached;
+};
+
+int linux_enumerate_devices(struct libusb_context *ctx,
+	struct linux_device_scan *scans, int num_scans);
+
 #endif
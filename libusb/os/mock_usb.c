@@ -0,0 +1,845 @@
+/*
+ * libusb mock backend
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * A backend without any hardware behind it, selected with
+ * --enable-mock-backend. It exists so that the core (transfer bookkeeping,
+ * event handling, descriptor parsing, hotplug) can be measured and tested
+ * deterministically.
+ *
+ * Every context sees the same set of fake devices, each with one
+ * configuration: interface 0 has bulk endpoints 0x81 and 0x01 and interrupt
+ * endpoint 0x82, interface 1 altsetting 1 has isochronous endpoints 0x83
+ * and 0x03. Transfers of any type succeed with their full length, control
+ * transfers reading the manufacturer and product strings get them.
+ *
+ * The backend is configured from the environment when a context is created:
+ *  LIBUSB_MOCK_DEVICES  number of devices (default 4)
+ *  LIBUSB_MOCK_LATENCY  microseconds from submission to completion. 0, the
+ *                       default, completes transfers as they are submitted.
+ *  LIBUSB_MOCK_REPLUG   number of devices unplugged and plugged back in on
+ *                       each hotplug poll, i.e. each libusb_get_device_list()
+ *                       call (default 0)
+ */
+
+#include <config.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libusbi.h"
+
+#define MOCK_VENDOR_ID		0x1209
+#define MOCK_DEVICES_DEFAULT	4
+#define MOCK_DEVICES_MAX	(127 * 255)
+
+static const unsigned char mock_config_descriptor[] = {
+	/* configuration 1, 2 interfaces */
+	0x09, LIBUSB_DT_CONFIG, 0x47, 0x00, 0x02, 0x01, 0x00, 0x80, 0x32,
+	/* interface 0: bulk in/out, interrupt in */
+	0x09, LIBUSB_DT_INTERFACE, 0x00, 0x00, 0x03, 0xff, 0x00, 0x00, 0x00,
+	0x07, LIBUSB_DT_ENDPOINT, 0x81, 0x02, 0x00, 0x02, 0x00,
+	0x07, LIBUSB_DT_ENDPOINT, 0x01, 0x02, 0x00, 0x02, 0x00,
+	0x07, LIBUSB_DT_ENDPOINT, 0x82, 0x03, 0x40, 0x00, 0x01,
+	/* interface 1 altsetting 0: no endpoints */
+	0x09, LIBUSB_DT_INTERFACE, 0x01, 0x00, 0x00, 0xff, 0x00, 0x00, 0x00,
+	/* interface 1 altsetting 1: isochronous in/out */
+	0x09, LIBUSB_DT_INTERFACE, 0x01, 0x01, 0x02, 0xff, 0x00, 0x00, 0x00,
+	0x07, LIBUSB_DT_ENDPOINT, 0x83, 0x01, 0x00, 0x04, 0x01,
+	0x07, LIBUSB_DT_ENDPOINT, 0x03, 0x01, 0x00, 0x04, 0x01,
+};
+
+struct mock_device_priv {
+	unsigned char dev_descr[DEVICE_DESC_LENGTH];
+};
+
+struct mock_handle_priv {
+	struct libusb_device_handle *handle;
+	int pipe[2];				/* doorbell for the event loop */
+
+	pthread_mutex_t lock;			/* protects everything below */
+	pthread_cond_t cond;			/* signalled on new delayed work */
+	struct list_head pending;		/* waiting for their latency */
+	struct list_head done;			/* ready to be reported */
+	unsigned int num_done;
+	int rung;				/* doorbell has an unread byte */
+	int closing;
+	int thread_started;
+	pthread_t thread;
+};
+
+enum mock_transfer_state {
+	MOCK_TRANSFER_IDLE,
+	MOCK_TRANSFER_PENDING,
+	MOCK_TRANSFER_DONE,
+};
+
+struct mock_transfer_priv {
+	struct usbi_transfer *itransfer;
+	struct list_head list;
+	enum mock_transfer_state state;
+	int cancelled;
+	uint64_t due;				/* in microseconds */
+};
+
+static int mock_num_devices = MOCK_DEVICES_DEFAULT;
+static unsigned int mock_latency;
+static int mock_replug;
+static int mock_replug_next;
+
+/* the handle owning each open doorbell fd, indexed by fd */
+static usbi_mutex_static_t mock_fd_lock = USBI_MUTEX_INITIALIZER;
+static struct libusb_device_handle **mock_fd_handles;
+static int mock_fd_handles_len;
+
+static struct mock_device_priv *_device_priv(struct libusb_device *dev)
+{
+	return (struct mock_device_priv *)dev->os_priv;
+}
+
+static struct mock_handle_priv *_device_handle_priv(
+	struct libusb_device_handle *handle)
+{
+	return (struct mock_handle_priv *)handle->os_priv;
+}
+
+static uint64_t mock_now(void)
+{
+	struct timespec tp;
+
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return (uint64_t)tp.tv_sec * 1000000 + tp.tv_nsec / 1000;
+}
+
+static int env_int(const char *name, int def, int max)
+{
+	char *value = getenv(name);
+	int r;
+
+	if (!value)
+		return def;
+	r = atoi(value);
+	if (r < 0)
+		return def;
+	return r > max ? max : r;
+}
+
+static unsigned long mock_session_id(int index)
+{
+	return (unsigned long)index + 1;
+}
+
+static struct libusb_device *mock_alloc_device(struct libusb_context *ctx,
+	int index)
+{
+	struct libusb_device *dev;
+	struct mock_device_priv *dpriv;
+	uint16_t pid = (uint16_t)index;
+
+	dev = usbi_alloc_device(ctx, mock_session_id(index));
+	if (!dev)
+		return NULL;
+
+	dev->bus_number = (uint8_t)(1 + index / 127);
+	dev->device_address = (uint8_t)(1 + index % 127);
+	dev->speed = LIBUSB_SPEED_HIGH;
+
+	dpriv = _device_priv(dev);
+	dpriv->dev_descr[0] = LIBUSB_DT_DEVICE_SIZE;
+	dpriv->dev_descr[1] = LIBUSB_DT_DEVICE;
+	dpriv->dev_descr[2] = 0x00;		/* bcdUSB 2.00 */
+	dpriv->dev_descr[3] = 0x02;
+	dpriv->dev_descr[7] = 64;		/* bMaxPacketSize0 */
+	dpriv->dev_descr[8] = MOCK_VENDOR_ID & 0xff;
+	dpriv->dev_descr[9] = MOCK_VENDOR_ID >> 8;
+	dpriv->dev_descr[10] = pid & 0xff;
+	dpriv->dev_descr[11] = pid >> 8;
+	dpriv->dev_descr[13] = 0x01;		/* bcdDevice 1.00 */
+	dpriv->dev_descr[14] = 1;		/* iManufacturer */
+	dpriv->dev_descr[15] = 2;		/* iProduct */
+	dpriv->dev_descr[17] = 1;		/* bNumConfigurations */
+
+	if (usbi_sanitize_device(dev) < 0) {
+		libusb_unref_device(dev);
+		return NULL;
+	}
+	return dev;
+}
+
+static int mock_connect_device(struct libusb_context *ctx, int index)
+{
+	struct libusb_device *dev = mock_alloc_device(ctx, index);
+
+	if (!dev)
+		return LIBUSB_ERROR_NO_MEM;
+	usbi_connect_device(dev);
+	return 0;
+}
+
+static int op_init(struct libusb_context *ctx)
+{
+	int i, r;
+
+	mock_num_devices = env_int("LIBUSB_MOCK_DEVICES", MOCK_DEVICES_DEFAULT,
+		MOCK_DEVICES_MAX);
+	mock_latency = (unsigned int)env_int("LIBUSB_MOCK_LATENCY", 0, 60000000);
+	mock_replug = env_int("LIBUSB_MOCK_REPLUG", 0, mock_num_devices);
+	usbi_dbg("%d devices, latency %uus, replug %d", mock_num_devices,
+		mock_latency, mock_replug);
+
+	if (ctx->no_device_discovery)
+		return 0;
+	for (i = 0; i < mock_num_devices; i++) {
+		r = mock_connect_device(ctx, i);
+		if (r < 0)
+			return r;
+	}
+	return 0;
+}
+
+static void op_hotplug_poll(void)
+{
+	struct libusb_context *ctx;
+	struct libusb_device *dev;
+	int i, index;
+
+	if (!mock_replug || !mock_num_devices)
+		return;
+
+	usbi_mutex_static_lock(&active_contexts_lock);
+	for (i = 0; i < mock_replug; i++) {
+		index = mock_replug_next++ % mock_num_devices;
+		list_for_each_entry(ctx, &active_contexts_list, list,
+				struct libusb_context) {
+			if (ctx->no_device_discovery)
+				continue;
+			dev = usbi_get_device_by_session_id(ctx,
+				mock_session_id(index));
+			if (dev) {
+				usbi_disconnect_device(dev);
+				libusb_unref_device(dev);
+			}
+			mock_connect_device(ctx, index);
+		}
+	}
+	usbi_mutex_static_unlock(&active_contexts_lock);
+}
+
+static int op_get_device_descriptor(struct libusb_device *dev,
+	unsigned char *buffer, int *host_endian)
+{
+	*host_endian = 0;
+	memcpy(buffer, _device_priv(dev)->dev_descr, DEVICE_DESC_LENGTH);
+	return 0;
+}
+
+static int op_get_active_config_descriptor(struct libusb_device *dev,
+	unsigned char *buffer, size_t len, int *host_endian)
+{
+	UNUSED(dev);
+	*host_endian = 0;
+	len = MIN(len, sizeof(mock_config_descriptor));
+	memcpy(buffer, mock_config_descriptor, len);
+	return (int)len;
+}
+
+static int op_get_config_descriptor(struct libusb_device *dev,
+	uint8_t config_index, unsigned char *buffer, size_t len, int *host_endian)
+{
+	if (config_index != 0)
+		return LIBUSB_ERROR_NOT_FOUND;
+	return op_get_active_config_descriptor(dev, buffer, len, host_endian);
+}
+
+static int op_get_config_descriptor_by_value(struct libusb_device *dev,
+	uint8_t value, unsigned char **buffer, int *host_endian)
+{
+	UNUSED(dev);
+	if (value != mock_config_descriptor[5])
+		return LIBUSB_ERROR_NOT_FOUND;
+	*host_endian = 0;
+	*buffer = (unsigned char *)mock_config_descriptor;
+	return (int)sizeof(mock_config_descriptor);
+}
+
+/* must be called with hpriv->lock held */
+static void ring_doorbell(struct mock_handle_priv *hpriv)
+{
+	unsigned char dummy = 1;
+
+	if (hpriv->rung)
+		return;
+	if (write(hpriv->pipe[1], &dummy, sizeof(dummy)) == sizeof(dummy))
+		hpriv->rung = 1;
+	else
+		usbi_warn(HANDLE_CTX(hpriv->handle), "doorbell write failed");
+}
+
+/* must be called with hpriv->lock held */
+static void move_to_done(struct mock_handle_priv *hpriv,
+	struct mock_transfer_priv *tpriv)
+{
+	if (tpriv->state == MOCK_TRANSFER_PENDING)
+		list_del(&tpriv->list);
+	list_add_tail(&tpriv->list, &hpriv->done);
+	tpriv->state = MOCK_TRANSFER_DONE;
+	hpriv->num_done++;
+	ring_doorbell(hpriv);
+}
+
+/* completes delayed transfers once their latency has passed */
+static void *latency_thread(void *arg)
+{
+	struct mock_handle_priv *hpriv = arg;
+	struct mock_transfer_priv *tpriv;
+	struct timespec deadline;
+	uint64_t now, wait;
+
+	pthread_mutex_lock(&hpriv->lock);
+	while (!hpriv->closing) {
+		if (list_empty(&hpriv->pending)) {
+			pthread_cond_wait(&hpriv->cond, &hpriv->lock);
+			continue;
+		}
+
+		/* every transfer has the same latency, so the queue is sorted */
+		tpriv = list_first_entry(&hpriv->pending, struct mock_transfer_priv,
+			list);
+		now = mock_now();
+		if (tpriv->due <= now) {
+			move_to_done(hpriv, tpriv);
+			continue;
+		}
+
+		wait = tpriv->due - now;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += (time_t)(wait / 1000000);
+		deadline.tv_nsec += (long)(wait % 1000000) * 1000;
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+		pthread_cond_timedwait(&hpriv->cond, &hpriv->lock, &deadline);
+	}
+	pthread_mutex_unlock(&hpriv->lock);
+
+	return NULL;
+}
+
+static int fd_handles_set(int fd, struct libusb_device_handle *handle)
+{
+	struct libusb_device_handle **table;
+	int len;
+
+	usbi_mutex_static_lock(&mock_fd_lock);
+	if (fd >= mock_fd_handles_len) {
+		len = MAX(fd + 1, mock_fd_handles_len * 2);
+		table = realloc(mock_fd_handles, len * sizeof(*table));
+		if (!table) {
+			usbi_mutex_static_unlock(&mock_fd_lock);
+			return LIBUSB_ERROR_NO_MEM;
+		}
+		memset(table + mock_fd_handles_len, 0,
+			(len - mock_fd_handles_len) * sizeof(*table));
+		mock_fd_handles = table;
+		mock_fd_handles_len = len;
+	}
+	mock_fd_handles[fd] = handle;
+	usbi_mutex_static_unlock(&mock_fd_lock);
+	return 0;
+}
+
+static struct libusb_device_handle *fd_handles_lookup(int fd)
+{
+	struct libusb_device_handle *handle = NULL;
+
+	usbi_mutex_static_lock(&mock_fd_lock);
+	if (fd >= 0 && fd < mock_fd_handles_len)
+		handle = mock_fd_handles[fd];
+	usbi_mutex_static_unlock(&mock_fd_lock);
+	return handle;
+}
+
+static int op_open(struct libusb_device_handle *handle)
+{
+	struct mock_handle_priv *hpriv = _device_handle_priv(handle);
+	int r;
+
+	if (!handle->dev->attached)
+		return LIBUSB_ERROR_NO_DEVICE;
+
+	if (pipe(hpriv->pipe) < 0)
+		return LIBUSB_ERROR_OTHER;
+
+	hpriv->handle = handle;
+	pthread_mutex_init(&hpriv->lock, NULL);
+	pthread_cond_init(&hpriv->cond, NULL);
+	list_init(&hpriv->pending);
+	list_init(&hpriv->done);
+	hpriv->num_done = 0;
+	hpriv->rung = 0;
+	hpriv->closing = 0;
+	hpriv->thread_started = 0;
+
+	r = fd_handles_set(hpriv->pipe[0], handle);
+	if (r == 0) {
+		r = usbi_add_pollfd(HANDLE_CTX(handle), hpriv->pipe[0], POLLIN);
+		if (r < 0)
+			fd_handles_set(hpriv->pipe[0], NULL);
+	}
+	if (r < 0) {
+		pthread_cond_destroy(&hpriv->cond);
+		pthread_mutex_destroy(&hpriv->lock);
+		close(hpriv->pipe[0]);
+		close(hpriv->pipe[1]);
+	}
+	return r;
+}
+
+static void op_close(struct libusb_device_handle *handle)
+{
+	struct mock_handle_priv *hpriv = _device_handle_priv(handle);
+
+	pthread_mutex_lock(&hpriv->lock);
+	hpriv->closing = 1;
+	pthread_cond_signal(&hpriv->cond);
+	pthread_mutex_unlock(&hpriv->lock);
+	if (hpriv->thread_started)
+		usbi_thread_join(hpriv->thread, NULL);
+
+	usbi_remove_pollfd(HANDLE_CTX(handle), hpriv->pipe[0]);
+	fd_handles_set(hpriv->pipe[0], NULL);
+	close(hpriv->pipe[0]);
+	close(hpriv->pipe[1]);
+	pthread_cond_destroy(&hpriv->cond);
+	pthread_mutex_destroy(&hpriv->lock);
+}
+
+/* the "system handle" of a mock device is its index */
+static int op_wrap_sys_device(struct libusb_context *ctx,
+	struct libusb_device_handle *handle, intptr_t sys_dev)
+{
+	struct libusb_device *dev;
+	int r;
+
+	if (sys_dev < 0 || sys_dev >= mock_num_devices)
+		return LIBUSB_ERROR_NO_DEVICE;
+
+	dev = usbi_get_device_by_session_id(ctx, mock_session_id((int)sys_dev));
+	if (!dev) {
+		dev = mock_alloc_device(ctx, (int)sys_dev);
+		if (!dev)
+			return LIBUSB_ERROR_NO_MEM;
+		dev->attached = 1;
+	}
+
+	handle->dev = dev;
+	r = op_open(handle);
+	if (r < 0) {
+		handle->dev = NULL;
+		libusb_unref_device(dev);
+	}
+	return r;
+}
+
+static int op_get_configuration(struct libusb_device_handle *handle,
+	int *config)
+{
+	UNUSED(handle);
+	*config = mock_config_descriptor[5];
+	return 0;
+}
+
+static int op_set_configuration(struct libusb_device_handle *handle,
+	int config)
+{
+	UNUSED(handle);
+	if (config != -1 && config != mock_config_descriptor[5])
+		return LIBUSB_ERROR_NOT_FOUND;
+	return 0;
+}
+
+static int op_claim_interface(struct libusb_device_handle *handle, int iface)
+{
+	UNUSED(handle);
+	return iface < mock_config_descriptor[4] ? 0 : LIBUSB_ERROR_NOT_FOUND;
+}
+
+static int op_release_interface(struct libusb_device_handle *handle, int iface)
+{
+	UNUSED(handle);
+	UNUSED(iface);
+	return 0;
+}
+
+static int op_set_interface(struct libusb_device_handle *handle, int iface,
+	int altsetting)
+{
+	UNUSED(handle);
+	if (iface == 0 && altsetting != 0)
+		return LIBUSB_ERROR_NOT_FOUND;
+	if (iface == 1 && altsetting > 1)
+		return LIBUSB_ERROR_NOT_FOUND;
+	return 0;
+}
+
+static int op_clear_halt(struct libusb_device_handle *handle,
+	unsigned char endpoint)
+{
+	UNUSED(handle);
+	UNUSED(endpoint);
+	return 0;
+}
+
+static int op_reset_device(struct libusb_device_handle *handle)
+{
+	UNUSED(handle);
+	return 0;
+}
+
+static int op_submit_transfer(struct usbi_transfer *itransfer)
+{
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	struct mock_handle_priv *hpriv = _device_handle_priv(transfer->dev_handle);
+	struct mock_transfer_priv *tpriv = usbi_transfer_get_os_priv(itransfer);
+	int r = 0;
+
+	tpriv->itransfer = itransfer;
+	tpriv->cancelled = 0;
+
+	pthread_mutex_lock(&hpriv->lock);
+	if (!mock_latency) {
+		move_to_done(hpriv, tpriv);
+		goto out;
+	}
+
+	if (!hpriv->thread_started) {
+		if (usbi_thread_create(&hpriv->thread, "mock", latency_thread,
+				hpriv)) {
+			r = LIBUSB_ERROR_NO_MEM;
+			goto out;
+		}
+		hpriv->thread_started = 1;
+	}
+	tpriv->due = mock_now() + mock_latency;
+	if (list_empty(&hpriv->pending))
+		pthread_cond_signal(&hpriv->cond);
+	list_add_tail(&tpriv->list, &hpriv->pending);
+	tpriv->state = MOCK_TRANSFER_PENDING;
+out:
+	pthread_mutex_unlock(&hpriv->lock);
+	if (r == 0)
+		usbi_stats_requests(itransfer, 1);
+	return r;
+}
+
+static int op_cancel_transfer(struct usbi_transfer *itransfer)
+{
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	struct mock_handle_priv *hpriv = _device_handle_priv(transfer->dev_handle);
+	struct mock_transfer_priv *tpriv = usbi_transfer_get_os_priv(itransfer);
+	int r = LIBUSB_ERROR_NOT_FOUND;
+
+	/* only transfers still waiting for their latency can be cancelled */
+	pthread_mutex_lock(&hpriv->lock);
+	if (tpriv->state == MOCK_TRANSFER_PENDING) {
+		tpriv->cancelled = 1;
+		move_to_done(hpriv, tpriv);
+		r = 0;
+	}
+	pthread_mutex_unlock(&hpriv->lock);
+
+	return r;
+}
+
+static void op_clear_transfer_priv(struct usbi_transfer *itransfer)
+{
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	struct mock_handle_priv *hpriv = _device_handle_priv(transfer->dev_handle);
+	struct mock_transfer_priv *tpriv = usbi_transfer_get_os_priv(itransfer);
+
+	pthread_mutex_lock(&hpriv->lock);
+	if (tpriv->state != MOCK_TRANSFER_IDLE) {
+		list_del(&tpriv->list);
+		if (tpriv->state == MOCK_TRANSFER_DONE)
+			hpriv->num_done--;
+		tpriv->state = MOCK_TRANSFER_IDLE;
+	}
+	pthread_mutex_unlock(&hpriv->lock);
+}
+
+/* answers GET_DESCRIPTOR for the strings of the device descriptor, in US
+ * English; other requests read zeroes */
+static void fill_control_data(struct libusb_transfer *transfer)
+{
+	static const unsigned char langids[] = { 4, LIBUSB_DT_STRING, 0x09, 0x04 };
+	static const char *strings[] = { "libusb", "mock device" };
+	struct libusb_control_setup *setup =
+		libusb_control_transfer_get_setup(transfer);
+	unsigned char *data = libusb_control_transfer_get_data(transfer);
+	unsigned char desc[2 + 2 * 16];
+	int index = libusb_le16_to_cpu(setup->wValue) & 0xff;
+	int length = libusb_le16_to_cpu(setup->wLength);
+	int i;
+
+	if (setup->bmRequestType != LIBUSB_ENDPOINT_IN ||
+			setup->bRequest != LIBUSB_REQUEST_GET_DESCRIPTOR ||
+			(libusb_le16_to_cpu(setup->wValue) >> 8) != LIBUSB_DT_STRING)
+		return;
+
+	if (index == 0) {
+		memcpy(desc, langids, sizeof(langids));
+	} else if (index <= 2) {
+		const char *str = strings[index - 1];
+
+		desc[0] = (unsigned char)(2 + 2 * strlen(str));
+		desc[1] = LIBUSB_DT_STRING;
+		for (i = 0; str[i]; i++) {
+			desc[2 + 2 * i] = str[i];
+			desc[3 + 2 * i] = 0;
+		}
+	} else {
+		return;
+	}
+	memcpy(data, desc, desc[0] < length ? desc[0] : length);
+}
+
+static int complete_transfer(struct usbi_transfer *itransfer)
+{
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	struct mock_transfer_priv *tpriv = usbi_transfer_get_os_priv(itransfer);
+	int i;
+
+	if (tpriv->cancelled)
+		return usbi_handle_transfer_cancellation(itransfer);
+
+	switch (transfer->type) {
+	case LIBUSB_TRANSFER_TYPE_CONTROL:
+		fill_control_data(transfer);
+		itransfer->transferred = libusb_le16_to_cpu(
+			libusb_control_transfer_get_setup(transfer)->wLength);
+		break;
+	case LIBUSB_TRANSFER_TYPE_ISOCHRONOUS:
+		itransfer->transferred = 0;
+		for (i = 0; i < transfer->num_iso_packets; i++) {
+			struct libusb_iso_packet_descriptor *pkt =
+				&transfer->iso_packet_desc[i];
+			pkt->actual_length = pkt->length;
+			pkt->status = LIBUSB_TRANSFER_COMPLETED;
+			itransfer->transferred += pkt->length;
+		}
+		break;
+	default:
+		itransfer->transferred = transfer->length;
+		break;
+	}
+	return usbi_handle_transfer_completion(itransfer,
+		LIBUSB_TRANSFER_COMPLETED);
+}
+
+static int reap_for_handle(struct libusb_device_handle *handle)
+{
+	struct mock_handle_priv *hpriv = _device_handle_priv(handle);
+	struct mock_transfer_priv *tpriv;
+	struct usbi_transfer *itransfer;
+	unsigned char dummy;
+	struct list_head reaped_list;
+	unsigned int reaped = 0;
+	int ret = 0;
+	int r;
+
+	pthread_mutex_lock(&hpriv->lock);
+	if (hpriv->rung) {
+		if (read(hpriv->pipe[0], &dummy, sizeof(dummy)) != sizeof(dummy)) {
+			pthread_mutex_unlock(&hpriv->lock);
+			return LIBUSB_ERROR_IO;
+		}
+		hpriv->rung = 0;
+	}
+
+	/* take the whole batch before running any completion, as a callback may
+	 * close the handle and free hpriv. transfers resubmitted from the
+	 * callbacks ring the doorbell again and are left for the next call */
+	list_init(&reaped_list);
+	while (!list_empty(&hpriv->done)) {
+		tpriv = list_first_entry(&hpriv->done, struct mock_transfer_priv,
+			list);
+		list_del(&tpriv->list);
+		list_add_tail(&tpriv->list, &reaped_list);
+		tpriv->state = MOCK_TRANSFER_IDLE;
+		reaped++;
+	}
+	hpriv->num_done = 0;
+	pthread_mutex_unlock(&hpriv->lock);
+
+	if (reaped)
+		usbi_stats_reap(handle, reaped);
+
+	/* every reaped transfer has to be completed even if one of the
+	 * completions fails */
+	while (!list_empty(&reaped_list)) {
+		tpriv = list_first_entry(&reaped_list, struct mock_transfer_priv,
+			list);
+		list_del(&tpriv->list);
+		itransfer = tpriv->itransfer;
+		r = complete_transfer(itransfer);
+		if (r < 0 && ret >= 0)
+			ret = r;
+	}
+	return ret < 0 ? ret : (int)reaped;
+}
+
+static int op_handle_events(struct libusb_context *ctx,
+	struct pollfd *fds, POLL_NFDS_TYPE nfds, int num_ready)
+{
+	unsigned int i;
+	int r;
+
+	for (i = 0; i < nfds && num_ready > 0; i++) {
+		struct pollfd *pollfd = &fds[i];
+		struct libusb_device_handle *handle;
+
+		if (!pollfd->revents)
+			continue;
+
+		num_ready--;
+		handle = fd_handles_lookup(pollfd->fd);
+		if (!handle || HANDLE_CTX(handle) != ctx) {
+			usbi_err(ctx, "cannot find handle for fd %d", pollfd->fd);
+			continue;
+		}
+
+		if (pollfd->revents & POLLERR) {
+			usbi_remove_pollfd(ctx, pollfd->fd);
+			usbi_handle_disconnect(handle);
+			continue;
+		}
+
+		r = reap_for_handle(handle);
+		if (r < 0)
+			return r;
+	}
+
+	return 0;
+}
+
+/* stands in for a device whose completions can be found before the kernel
+ * wakes anyone up: the transfers that are due are taken straight from the
+ * pending queue */
+static int op_busy_poll(struct libusb_device_handle *handle)
+{
+	struct mock_handle_priv *hpriv = _device_handle_priv(handle);
+	struct mock_transfer_priv *tpriv;
+	uint64_t now = mock_now();
+
+	pthread_mutex_lock(&hpriv->lock);
+	while (!list_empty(&hpriv->pending)) {
+		tpriv = list_first_entry(&hpriv->pending,
+			struct mock_transfer_priv, list);
+		if (tpriv->due > now)
+			break;
+		move_to_done(hpriv, tpriv);
+	}
+	if (!hpriv->num_done) {
+		pthread_mutex_unlock(&hpriv->lock);
+		return 0;
+	}
+	pthread_mutex_unlock(&hpriv->lock);
+
+	return reap_for_handle(handle);
+}
+
+static int op_get_pollfd(struct libusb_device_handle *handle,
+	struct libusb_pollfd *pollfd)
+{
+	pollfd->fd = _device_handle_priv(handle)->pipe[0];
+	pollfd->events = POLLIN;
+	return 0;
+}
+
+static int op_clock_gettime(int clk_id, struct timespec *tp)
+{
+	switch (clk_id) {
+	case USBI_CLOCK_MONOTONIC:
+		return clock_gettime(CLOCK_MONOTONIC, tp);
+	case USBI_CLOCK_REALTIME:
+		return clock_gettime(CLOCK_REALTIME, tp);
+	default:
+		return LIBUSB_ERROR_INVALID_PARAM;
+	}
+}
+
+#ifdef USBI_TIMERFD_AVAILABLE
+static clockid_t op_get_timerfd_clockid(void)
+{
+	return CLOCK_MONOTONIC;
+}
+#endif
+
+const struct usbi_os_backend mock_backend = {
+	.name = "Mock",
+	.caps = USBI_CAP_HAS_POLLABLE_DEVICE_FD,
+	.init = op_init,
+	.exit = NULL,
+	.get_device_list = NULL,
+	.hotplug_poll = op_hotplug_poll,
+	.get_device_descriptor = op_get_device_descriptor,
+	.get_active_config_descriptor = op_get_active_config_descriptor,
+	.get_config_descriptor = op_get_config_descriptor,
+	.get_config_descriptor_by_value = op_get_config_descriptor_by_value,
+
+	.open = op_open,
+	.wrap_sys_device = op_wrap_sys_device,
+	.close = op_close,
+	.get_configuration = op_get_configuration,
+	.set_configuration = op_set_configuration,
+	.claim_interface = op_claim_interface,
+	.release_interface = op_release_interface,
+
+	.set_interface_altsetting = op_set_interface,
+	.clear_halt = op_clear_halt,
+	.reset_device = op_reset_device,
+
+	.submit_transfer = op_submit_transfer,
+	.cancel_transfer = op_cancel_transfer,
+	.clear_transfer_priv = op_clear_transfer_priv,
+
+	.handle_events = op_handle_events,
+	.get_pollfd = op_get_pollfd,
+	.busy_poll = op_busy_poll,
+
+	.clock_gettime = op_clock_gettime,
+
+#ifdef USBI_TIMERFD_AVAILABLE
+	.get_timerfd_clockid = op_get_timerfd_clockid,
+#endif
+
+	.device_priv_size = sizeof(struct mock_device_priv),
+	.device_handle_priv_size = sizeof(struct mock_handle_priv),
+	.transfer_priv_size = sizeof(struct mock_transfer_priv),
+	.add_iso_packet_size = 0,
+};
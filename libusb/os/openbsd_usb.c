@@ -23,6 +23,7 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -40,9 +41,36 @@ struct device_priv {
 	usb_device_descriptor_t ddesc;		/* usb device descriptor */
 };
 
+/*
+ * ugen(4) only performs blocking I/O, so transfers are run by one worker
+ * thread per endpoint, each serving a queue of submitted transfers.  This
+ * keeps submission asynchronous and lets different endpoints progress
+ * concurrently.
+ */
+struct endpoint_worker {
+	pthread_t thread;
+	int started;
+	pthread_cond_t cond;			/* signalled on new work */
+	struct list_head queue;			/* pending transfer_priv */
+	struct handle_priv *hpriv;
+};
+
 struct handle_priv {
 	int pipe[2];				/* for event notification */
 	int endpoints[USB_MAX_ENDPOINTS];
+
+	struct libusb_device_handle *handle;
+	pthread_mutex_t lock;			/* protects the workers */
+	int closing;
+	struct endpoint_worker workers[USB_MAX_ENDPOINTS];
+};
+
+struct transfer_priv {
+	struct usbi_transfer *itransfer;
+	struct list_head list;			/* in its worker's queue */
+	int queued;
+	int cancelled;
+	int err;				/* result of the request */
 };
 
 /*
@@ -86,6 +114,10 @@ static int _errno_to_libusb(int);
 static int _cache_active_config_descriptor(struct libusb_device *);
 static int _sync_control_transfer(struct usbi_transfer *);
 static int _sync_gen_transfer(struct usbi_transfer *);
+static int _queue_transfer(struct usbi_transfer *);
+static void *_endpoint_worker(void *);
+static void _stop_workers(struct handle_priv *);
+static enum libusb_transfer_status _err_to_transfer_status(int);
 static int _access_endpoint(struct libusb_transfer *);
 
 static int _bus_open(int);
@@ -99,12 +131,14 @@ const struct usbi_os_backend openbsd_backend = {
 	obsd_get_device_list,
 	NULL,				/* hotplug_poll */
 	obsd_open,
+	NULL,				/* wrap_sys_device */
 	obsd_close,
 
 	obsd_get_device_descriptor,
 	obsd_get_active_config_descriptor,
 	obsd_get_config_descriptor,
 	NULL,				/* get_config_descriptor_by_value() */
+	NULL,				/* get_device_string() */
 
 	obsd_get_configuration,
 	obsd_set_configuration,
@@ -119,6 +153,11 @@ const struct usbi_os_backend openbsd_backend = {
 	NULL,				/* alloc_streams */
 	NULL,				/* free_streams */
 
+	NULL,				/* dev_mem_alloc */
+	NULL,				/* dev_mem_free */
+	NULL,				/* set_endpoint_policy */
+	NULL,				/* get_endpoint_policy */
+
 	NULL,				/* kernel_driver_active() */
 	NULL,				/* detach_kernel_driver() */
 	NULL,				/* attach_kernel_driver() */
@@ -128,13 +167,18 @@ const struct usbi_os_backend openbsd_backend = {
 	obsd_submit_transfer,
 	obsd_cancel_transfer,
 	obsd_clear_transfer_priv,
+	NULL,				/* free_transfer_priv */
+	NULL,				/* sync_control_transfer */
+	NULL,				/* sync_bulk_transfer */
 
 	obsd_handle_events,
+	NULL,				/* get_pollfd */
+	NULL,				/* busy_poll */
 
 	obsd_clock_gettime,
 	sizeof(struct device_priv),
 	sizeof(struct handle_priv),
-	0,				/* transfer_priv_size */
+	sizeof(struct transfer_priv),
 	0,				/* add_iso_packet_size */
 };
 
@@ -248,6 +292,7 @@ obsd_open(struct libusb_device_handle *handle)
 	struct handle_priv *hpriv = (struct handle_priv *)handle->os_priv;
 	struct device_priv *dpriv = (struct device_priv *)handle->dev->os_priv;
 	char devnode[16];
+	int i;
 
 	if (dpriv->devname) {
 		/*
@@ -266,6 +311,16 @@ obsd_open(struct libusb_device_handle *handle)
 	if (pipe(hpriv->pipe) < 0)
 		return _errno_to_libusb(errno);
 
+	hpriv->handle = handle;
+	hpriv->closing = 0;
+	pthread_mutex_init(&hpriv->lock, NULL);
+	for (i = 0; i < USB_MAX_ENDPOINTS; i++) {
+		hpriv->workers[i].hpriv = hpriv;
+		hpriv->workers[i].started = 0;
+		pthread_cond_init(&hpriv->workers[i].cond, NULL);
+		list_init(&hpriv->workers[i].queue);
+	}
+
 	return usbi_add_pollfd(HANDLE_CTX(handle), hpriv->pipe[0], POLLIN);
 }
 
@@ -275,6 +330,8 @@ obsd_close(struct libusb_device_handle *handle)
 	struct handle_priv *hpriv = (struct handle_priv *)handle->os_priv;
 	struct device_priv *dpriv = (struct device_priv *)handle->dev->os_priv;
 
+	_stop_workers(hpriv);
+
 	if (dpriv->devname) {
 		usbi_dbg("close: fd %d", dpriv->fd);
 
@@ -479,17 +536,14 @@ int
 obsd_submit_transfer(struct usbi_transfer *itransfer)
 {
 	struct libusb_transfer *transfer;
-	struct handle_priv *hpriv;
 	int err = 0;
 
 	usbi_dbg("");
 
 	transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
-	hpriv = (struct handle_priv *)transfer->dev_handle->os_priv;
 
 	switch (transfer->type) {
 	case LIBUSB_TRANSFER_TYPE_CONTROL:
-		err = _sync_control_transfer(itransfer);
 		break;
 	case LIBUSB_TRANSFER_TYPE_ISOCHRONOUS:
 		if (IS_XFEROUT(transfer)) {
@@ -497,7 +551,6 @@ obsd_submit_transfer(struct usbi_transfer *itransfer)
 			err = LIBUSB_ERROR_NOT_SUPPORTED;
 			break;
 		}
-		err = _sync_gen_transfer(itransfer);
 		break;
 	case LIBUSB_TRANSFER_TYPE_BULK:
 	case LIBUSB_TRANSFER_TYPE_INTERRUPT:
@@ -506,7 +559,6 @@ obsd_submit_transfer(struct usbi_transfer *itransfer)
 			err = LIBUSB_ERROR_NOT_SUPPORTED;
 			break;
 		}
-		err = _sync_gen_transfer(itransfer);
 		break;
 	case LIBUSB_TRANSFER_TYPE_BULK_STREAM:
 		err = LIBUSB_ERROR_NOT_SUPPORTED;
@@ -516,18 +568,40 @@ obsd_submit_transfer(struct usbi_transfer *itransfer)
 	if (err)
 		return (err);
 
-	if (write(hpriv->pipe[1], &itransfer, sizeof(itransfer)) < 0)
-		return _errno_to_libusb(errno);
-
-	return (LIBUSB_SUCCESS);
+	return _queue_transfer(itransfer);
 }
 
 int
 obsd_cancel_transfer(struct usbi_transfer *itransfer)
 {
+	struct libusb_transfer *transfer;
+	struct handle_priv *hpriv;
+	struct transfer_priv *tpriv;
+	int err = LIBUSB_ERROR_NOT_SUPPORTED;
+
 	usbi_dbg("");
 
-	return (LIBUSB_ERROR_NOT_SUPPORTED);
+	transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	hpriv = (struct handle_priv *)transfer->dev_handle->os_priv;
+	tpriv = usbi_transfer_get_os_priv(itransfer);
+
+	/*
+	 * Only transfers still waiting in a queue can be cancelled, the
+	 * one being run by a worker completes on its own (or times out).
+	 */
+	pthread_mutex_lock(&hpriv->lock);
+	if (tpriv->queued) {
+		list_del(&tpriv->list);
+		tpriv->queued = 0;
+		tpriv->cancelled = 1;
+		if (write(hpriv->pipe[1], &itransfer, sizeof(itransfer)) < 0)
+			err = _errno_to_libusb(errno);
+		else
+			err = LIBUSB_SUCCESS;
+	}
+	pthread_mutex_unlock(&hpriv->lock);
+
+	return (err);
 }
 
 void
@@ -545,6 +619,7 @@ obsd_handle_events(struct libusb_context *ctx, struct pollfd *fds, nfds_t nfds,
 	struct libusb_device_handle *handle;
 	struct handle_priv *hpriv = NULL;
 	struct usbi_transfer *itransfer;
+	struct transfer_priv *tpriv;
 	struct pollfd *pollfd;
 	int i, err = 0;
 
@@ -586,8 +661,13 @@ obsd_handle_events(struct libusb_context *ctx, struct pollfd *fds, nfds_t nfds,
 			break;
 		}
 
-		if ((err = usbi_handle_transfer_completion(itransfer,
-		    LIBUSB_TRANSFER_COMPLETED)))
+		tpriv = usbi_transfer_get_os_priv(itransfer);
+		if (tpriv->cancelled)
+			err = usbi_handle_transfer_cancellation(itransfer);
+		else
+			err = usbi_handle_transfer_completion(itransfer,
+			    _err_to_transfer_status(tpriv->err));
+		if (err)
 			break;
 	}
 	pthread_mutex_unlock(&ctx->open_devs_lock);
@@ -831,3 +911,129 @@ _bus_open(int number)
 
 	return open(busnode, O_RDWR);
 }
+
+/*
+ * Give a transfer to the worker of its endpoint, starting the worker on
+ * first use.
+ */
+int
+_queue_transfer(struct usbi_transfer *itransfer)
+{
+	struct libusb_transfer *transfer;
+	struct handle_priv *hpriv;
+	struct transfer_priv *tpriv;
+	struct endpoint_worker *worker;
+	int err;
+
+	transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	hpriv = (struct handle_priv *)transfer->dev_handle->os_priv;
+	tpriv = usbi_transfer_get_os_priv(itransfer);
+	worker = &hpriv->workers[UE_GET_ADDR(transfer->endpoint)];
+
+	tpriv->itransfer = itransfer;
+	tpriv->cancelled = 0;
+	tpriv->err = 0;
+
+	pthread_mutex_lock(&hpriv->lock);
+	if (!worker->started) {
+		err = pthread_create(&worker->thread, NULL, _endpoint_worker,
+		    worker);
+		if (err) {
+			pthread_mutex_unlock(&hpriv->lock);
+			return _errno_to_libusb(err);
+		}
+		worker->started = 1;
+	}
+	list_add_tail(&tpriv->list, &worker->queue);
+	tpriv->queued = 1;
+	pthread_cond_signal(&worker->cond);
+	pthread_mutex_unlock(&hpriv->lock);
+
+	return (LIBUSB_SUCCESS);
+}
+
+void *
+_endpoint_worker(void *arg)
+{
+	struct endpoint_worker *worker = arg;
+	struct handle_priv *hpriv = worker->hpriv;
+	struct transfer_priv *tpriv;
+	struct usbi_transfer *itransfer;
+	struct libusb_transfer *transfer;
+
+	pthread_mutex_lock(&hpriv->lock);
+	for (;;) {
+		if (list_empty(&worker->queue)) {
+			if (hpriv->closing)
+				break;
+			pthread_cond_wait(&worker->cond, &hpriv->lock);
+			continue;
+		}
+
+		tpriv = list_first_entry(&worker->queue, struct transfer_priv,
+		    list);
+		list_del(&tpriv->list);
+		tpriv->queued = 0;
+		pthread_mutex_unlock(&hpriv->lock);
+
+		itransfer = tpriv->itransfer;
+		transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+
+		if (transfer->type == LIBUSB_TRANSFER_TYPE_CONTROL)
+			tpriv->err = _sync_control_transfer(itransfer);
+		else
+			tpriv->err = _sync_gen_transfer(itransfer);
+
+		/* hand the completed transfer over to the event handler */
+		if (write(hpriv->pipe[1], &itransfer, sizeof(itransfer)) < 0)
+			usbi_err(HANDLE_CTX(hpriv->handle),
+			    "could not signal transfer completion: %d", errno);
+
+		pthread_mutex_lock(&hpriv->lock);
+	}
+	pthread_mutex_unlock(&hpriv->lock);
+
+	return (NULL);
+}
+
+/*
+ * Let the workers run what is left in their queues, then wait for them.
+ */
+void
+_stop_workers(struct handle_priv *hpriv)
+{
+	int i;
+
+	pthread_mutex_lock(&hpriv->lock);
+	hpriv->closing = 1;
+	for (i = 0; i < USB_MAX_ENDPOINTS; i++)
+		pthread_cond_signal(&hpriv->workers[i].cond);
+	pthread_mutex_unlock(&hpriv->lock);
+
+	for (i = 0; i < USB_MAX_ENDPOINTS; i++) {
+		if (hpriv->workers[i].started)
+			pthread_join(hpriv->workers[i].thread, NULL);
+		hpriv->workers[i].started = 0;
+		pthread_cond_destroy(&hpriv->workers[i].cond);
+	}
+	pthread_mutex_destroy(&hpriv->lock);
+}
+
+enum libusb_transfer_status
+_err_to_transfer_status(int err)
+{
+	switch (err) {
+	case 0:
+		return (LIBUSB_TRANSFER_COMPLETED);
+	case LIBUSB_ERROR_TIMEOUT:
+		return (LIBUSB_TRANSFER_TIMED_OUT);
+	case LIBUSB_ERROR_PIPE:
+		return (LIBUSB_TRANSFER_STALL);
+	case LIBUSB_ERROR_NO_DEVICE:
+		return (LIBUSB_TRANSFER_NO_DEVICE);
+	case LIBUSB_ERROR_OVERFLOW:
+		return (LIBUSB_TRANSFER_OVERFLOW);
+	}
+
+	return (LIBUSB_TRANSFER_ERROR);
+}
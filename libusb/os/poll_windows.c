@@ -39,6 +39,17 @@
  * The pipe pollable synchronous I/O works using the overlapped event associated
  * with a fake pipe. The read/write functions are only meant to be used in that
  * context.
+ *
+ * WaitForMultipleObjects() can only wait on MAXIMUM_WAIT_OBJECTS (64) handles
+ * and scans them all on every call, so outside of WinCE each fake pipe also
+ * owns an I/O completion port. Every transfer fd created for a context has a
+ * registered wait on its OVERLAPPED event that posts the fd index to the
+ * completion port of the context's event pipe, and writes to the pipe post to
+ * it directly. Polling a set of fds that includes such a pipe then blocks on
+ * the completion port, which has no limit on the number of fds and hands out
+ * the ready fds directly. Packets are only hints: the OVERLAPPED of an fd is
+ * always checked before it is reported, so stale packets for fds that were
+ * freed and reused in the meantime are harmless.
  */
 #include <config.h>
 
@@ -68,16 +79,48 @@
 
 #define CHECK_INIT_POLLING do {if(!is_polling_set) init_polling();} while(0)
 
+static int _fd_to_index_and_lock(int fd);
+
 // public fd data
 const struct winfd INVALID_WINFD = {-1, INVALID_HANDLE_VALUE, NULL, NULL, NULL, RW_NONE};
-struct winfd poll_fd[MAX_FDS];
 // internal fd data
-struct {
+struct poll_fd_priv {
 	CRITICAL_SECTION mutex; // lock for fds
 	// Additional variables for XP CancelIoEx partial emulation
 	HANDLE original_handle;
 	DWORD thread_id;
-} _poll_fd[MAX_FDS];
+	// Completion port that readiness of this fd is posted to. Owned by the
+	// fd for fake pipes, borrowed from the context's event pipe otherwise
+	HANDLE port;
+	// Registered wait that posts to the port once the OVERLAPPED completes
+	HANDLE wait_handle;
+	// Next entry on the free list, or -1
+	int next_free;
+};
+
+// The fd table grows by FD_CHUNK_SIZE entries at a time, up to MAX_FDS. Chunks
+// are never moved or freed before exit_polling(), so that an entry can still
+// be used through its own mutex without holding fd_table_lock. The fd of an
+// entry is its index in the table. Unused entries are kept on a free list, so
+// allocating an fd doesn't need to search the table
+#define FD_CHUNK_SHIFT	6
+#define FD_CHUNK_SIZE	(1 << FD_CHUNK_SHIFT)
+#define MAX_FD_CHUNKS	(MAX_FDS / FD_CHUNK_SIZE)
+
+struct poll_fd_chunk {
+	struct winfd wfd[FD_CHUNK_SIZE];
+	struct poll_fd_priv priv[FD_CHUNK_SIZE];
+};
+
+static struct poll_fd_chunk *fd_chunks[MAX_FD_CHUNKS];
+// Number of entries in the table, a multiple of FD_CHUNK_SIZE
+static volatile LONG fd_count = 0;
+static int first_free_fd = -1;
+// Protects growing the table and the free list
+static CRITICAL_SECTION fd_table_lock;
+
+#define POLL_FD(i)	(fd_chunks[(i) >> FD_CHUNK_SHIFT]->wfd[(i) & (FD_CHUNK_SIZE - 1)])
+#define _POLL_FD(i)	(fd_chunks[(i) >> FD_CHUNK_SHIFT]->priv[(i) & (FD_CHUNK_SIZE - 1)])
 
 // globals
 BOOLEAN is_polling_set = FALSE;
@@ -104,24 +147,24 @@ static inline void setup_cancel_io(void)
 
 static inline BOOL cancel_io(int _index)
 {
-	if ((_index < 0) || (_index >= MAX_FDS)) {
+	if ((_index < 0) || (_index >= fd_count)) {
 		return FALSE;
 	}
 
-	if ( (poll_fd[_index].fd < 0) || (poll_fd[_index].handle == INVALID_HANDLE_VALUE)
-	  || (poll_fd[_index].handle == 0) || (poll_fd[_index].overlapped == NULL) ) {
+	if ( (POLL_FD(_index).fd < 0) || (POLL_FD(_index).handle == INVALID_HANDLE_VALUE)
+	  || (POLL_FD(_index).handle == 0) || (POLL_FD(_index).overlapped == NULL) ) {
 		return TRUE;
 	}
-	if (poll_fd[_index].itransfer && poll_fd[_index].cancel_fn) {
+	if (POLL_FD(_index).itransfer && POLL_FD(_index).cancel_fn) {
 		// Cancel outstanding transfer via the specific callback
-		(*poll_fd[_index].cancel_fn)(poll_fd[_index].itransfer);
+		(*POLL_FD(_index).cancel_fn)(POLL_FD(_index).itransfer);
 		return TRUE;
 	}
 	if (pCancelIoEx != NULL) {
-		return (*pCancelIoEx)(poll_fd[_index].handle, poll_fd[_index].overlapped);
+		return (*pCancelIoEx)(POLL_FD(_index).handle, POLL_FD(_index).overlapped);
 	}
-	if (_poll_fd[_index].thread_id == GetCurrentThreadId()) {
-		return CancelIo(poll_fd[_index].handle);
+	if (_POLL_FD(_index).thread_id == GetCurrentThreadId()) {
+		return CancelIo(POLL_FD(_index).handle);
 	}
 	usbi_warn(NULL, "Unable to cancel I/O that was started from another thread");
 	return FALSE;
@@ -136,21 +179,109 @@ static __inline void setup_cancel_io()
 
 static __inline BOOL cancel_io(int _index)
 {
-	if ((_index < 0) || (_index >= MAX_FDS)) {
+	if ((_index < 0) || (_index >= fd_count)) {
 		return FALSE;
 	}
-	if ( (poll_fd[_index].fd < 0) || (poll_fd[_index].handle == INVALID_HANDLE_VALUE)
-	  || (poll_fd[_index].handle == 0) || (poll_fd[_index].overlapped == NULL) ) {
+	if ( (POLL_FD(_index).fd < 0) || (POLL_FD(_index).handle == INVALID_HANDLE_VALUE)
+	  || (POLL_FD(_index).handle == 0) || (POLL_FD(_index).overlapped == NULL) ) {
 		return TRUE;
 	}
-	if (poll_fd[_index].itransfer && poll_fd[_index].cancel_fn) {
+	if (POLL_FD(_index).itransfer && POLL_FD(_index).cancel_fn) {
 		// Cancel outstanding transfer via the specific callback
-		(*poll_fd[_index].cancel_fn)(poll_fd[_index].itransfer);
+		(*POLL_FD(_index).cancel_fn)(POLL_FD(_index).itransfer);
 	}
 	return TRUE;
 }
 #endif
 
+#if !defined(_WIN32_WCE)
+static VOID CALLBACK post_fd_completion(PVOID context, BOOLEAN timed_out)
+{
+	int _index = (int)(INT_PTR)context;
+	UNUSED(timed_out);
+
+	PostQueuedCompletionStatus(_POLL_FD(_index).port, 0, (ULONG_PTR)_index, NULL);
+}
+
+// Create the completion port of a fake pipe
+static HANDLE create_port(void)
+{
+	HANDLE port = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 1);
+
+	if (port == NULL) {
+		usbi_dbg("could not create completion port: %d", (int)GetLastError());
+		return INVALID_HANDLE_VALUE;
+	}
+	return port;
+}
+
+// Ask for the OVERLAPPED of a transfer fd to be posted to the completion port
+// of its context. Must be called with the fd mutex held
+static void register_port_wait(int _index, struct usbi_transfer *itransfer)
+{
+	struct libusb_context *ctx = ITRANSFER_CTX(itransfer);
+	int pipe_index;
+
+	pipe_index = _fd_to_index_and_lock(ctx->event_pipe[0]);
+	if (pipe_index < 0)
+		return;
+	_POLL_FD(_index).port = _POLL_FD(pipe_index).port;
+	LeaveCriticalSection(&_POLL_FD(pipe_index).mutex);
+
+	if (_POLL_FD(_index).port == INVALID_HANDLE_VALUE)
+		return;
+	if (!RegisterWaitForSingleObject(&_POLL_FD(_index).wait_handle,
+		POLL_FD(_index).overlapped->hEvent, post_fd_completion,
+		(PVOID)(INT_PTR)_index, INFINITE, WT_EXECUTEINWAITTHREAD | WT_EXECUTEONLYONCE)) {
+		usbi_dbg("could not register wait for fd %d: %d", _index, (int)GetLastError());
+		_POLL_FD(_index).wait_handle = NULL;
+		_POLL_FD(_index).port = INVALID_HANDLE_VALUE;
+	}
+}
+
+// Undo whatever create_port()/register_port_wait() did for an fd. Must be
+// called with the fd mutex held
+static void release_port(int _index)
+{
+	if (_POLL_FD(_index).wait_handle != NULL) {
+		// Wait for a running callback, so that it can't post for a reused fd
+		UnregisterWaitEx(_POLL_FD(_index).wait_handle, INVALID_HANDLE_VALUE);
+		_POLL_FD(_index).wait_handle = NULL;
+	} else if ((POLL_FD(_index).handle == DUMMY_HANDLE)
+	  && (_POLL_FD(_index).port != INVALID_HANDLE_VALUE)) {
+		CloseHandle(_POLL_FD(_index).port);
+	}
+	_POLL_FD(_index).port = INVALID_HANDLE_VALUE;
+}
+
+static inline void signal_port(int _index)
+{
+	if (_POLL_FD(_index).port != INVALID_HANDLE_VALUE)
+		PostQueuedCompletionStatus(_POLL_FD(_index).port, 0, (ULONG_PTR)_index, NULL);
+}
+#else
+static __inline HANDLE create_port(void)
+{
+	return INVALID_HANDLE_VALUE;
+}
+
+static __inline void register_port_wait(int _index, struct usbi_transfer *itransfer)
+{
+	UNUSED(_index);
+	UNUSED(itransfer);
+}
+
+static __inline void release_port(int _index)
+{
+	UNUSED(_index);
+}
+
+static __inline void signal_port(int _index)
+{
+	UNUSED(_index);
+}
+#endif
+
 // Init
 void init_polling(void)
 {
@@ -161,37 +292,86 @@ void init_polling(void)
 	}
 	if (!is_polling_set) {
 		setup_cancel_io();
-		for (i=0; i<MAX_FDS; i++) {
-			poll_fd[i] = INVALID_WINFD;
-			_poll_fd[i].original_handle = INVALID_HANDLE_VALUE;
-			_poll_fd[i].thread_id = 0;
-			InitializeCriticalSection(&_poll_fd[i].mutex);
-		}
+		InitializeCriticalSection(&fd_table_lock);
+		fd_count = 0;
+		first_free_fd = -1;
 		is_polling_set = TRUE;
 	}
 	InterlockedExchange((LONG *)&compat_spinlock, 0);
 }
 
+// Add a chunk of entries to the fd table. Must be called with fd_table_lock held
+static BOOL _grow_fd_table(void)
+{
+	struct poll_fd_chunk *chunk;
+	int i, base = (int)fd_count;
+
+	if (base >= MAX_FDS) {
+		usbi_warn(NULL, "all %d fds are in use", MAX_FDS);
+		return FALSE;
+	}
+	chunk = (struct poll_fd_chunk *) calloc(1, sizeof(*chunk));
+	if (chunk == NULL) {
+		return FALSE;
+	}
+	for (i = 0; i < FD_CHUNK_SIZE; i++) {
+		chunk->wfd[i] = INVALID_WINFD;
+		chunk->priv[i].original_handle = INVALID_HANDLE_VALUE;
+		chunk->priv[i].thread_id = 0;
+		chunk->priv[i].port = INVALID_HANDLE_VALUE;
+		chunk->priv[i].wait_handle = NULL;
+		// keep the free list in ascending order
+		chunk->priv[i].next_free = (i + 1 < FD_CHUNK_SIZE) ? base + i + 1 : first_free_fd;
+		InitializeCriticalSection(&chunk->priv[i].mutex);
+	}
+	fd_chunks[base >> FD_CHUNK_SHIFT] = chunk;
+	first_free_fd = base;
+	// publish the chunk only once it is fully set up
+	InterlockedExchange(&fd_count, base + FD_CHUNK_SIZE);
+	return TRUE;
+}
+
+// Take an unused entry off the free list, and return it with its mutex
+// held, or -1 if the table is full
+static int _alloc_index_and_lock(void)
+{
+	int _index = -1;
+
+	EnterCriticalSection(&fd_table_lock);
+	if ((first_free_fd >= 0) || _grow_fd_table()) {
+		_index = first_free_fd;
+		first_free_fd = _POLL_FD(_index).next_free;
+	}
+	LeaveCriticalSection(&fd_table_lock);
+
+	if (_index >= 0) {
+		EnterCriticalSection(&_POLL_FD(_index).mutex);
+	}
+	return _index;
+}
+
+// Put an entry that has been reset to INVALID_WINFD back on the free list
+static void _release_index(int _index)
+{
+	EnterCriticalSection(&fd_table_lock);
+	_POLL_FD(_index).next_free = first_free_fd;
+	first_free_fd = _index;
+	LeaveCriticalSection(&fd_table_lock);
+}
+
 // Internal function to retrieve the table index (and lock the fd mutex)
 static int _fd_to_index_and_lock(int fd)
 {
-	int i;
-
-	if (fd < 0)
+	if ((fd < 0) || (fd >= fd_count))
 		return -1;
 
-	for (i=0; i<MAX_FDS; i++) {
-		if (poll_fd[i].fd == fd) {
-			EnterCriticalSection(&_poll_fd[i].mutex);
-			// fd might have changed before we got to critical
-			if (poll_fd[i].fd != fd) {
-				LeaveCriticalSection(&_poll_fd[i].mutex);
-				continue;
-			}
-			return i;
-		}
+	EnterCriticalSection(&_POLL_FD(fd).mutex);
+	// fd might have been freed in the meantime
+	if (POLL_FD(fd).fd != fd) {
+		LeaveCriticalSection(&_POLL_FD(fd).mutex);
+		return -1;
 	}
-	return -1;
+	return fd;
 }
 
 static OVERLAPPED *create_overlapped(void)
@@ -222,7 +402,7 @@ static void free_overlapped(OVERLAPPED *overlapped)
 
 void exit_polling(void)
 {
-	int i;
+	int i, count;
 
 	while (InterlockedExchange((LONG *)&compat_spinlock, 1) == 1) {
 		SleepEx(0, TRUE);
@@ -230,24 +410,33 @@ void exit_polling(void)
 	if (is_polling_set) {
 		is_polling_set = FALSE;
 
-		for (i=0; i<MAX_FDS; i++) {
+		count = (int)fd_count;
+		for (i=0; i<count; i++) {
 			// Cancel any async I/O (handle can be invalid)
 			cancel_io(i);
 			// If anything was pending on that I/O, it should be
 			// terminating, and we should be able to access the fd
 			// mutex lock before too long
-			EnterCriticalSection(&_poll_fd[i].mutex);
-			free_overlapped(poll_fd[i].overlapped);
+			EnterCriticalSection(&_POLL_FD(i).mutex);
+			release_port(i);
+			free_overlapped(POLL_FD(i).overlapped);
 			if (Use_Duplicate_Handles) {
 				// Close duplicate handle
-				if (_poll_fd[i].original_handle != INVALID_HANDLE_VALUE) {
-					CloseHandle(poll_fd[i].handle);
+				if (_POLL_FD(i).original_handle != INVALID_HANDLE_VALUE) {
+					CloseHandle(POLL_FD(i).handle);
 				}
 			}
-			poll_fd[i] = INVALID_WINFD;
-			LeaveCriticalSection(&_poll_fd[i].mutex);
-			DeleteCriticalSection(&_poll_fd[i].mutex);
+			POLL_FD(i) = INVALID_WINFD;
+			LeaveCriticalSection(&_POLL_FD(i).mutex);
+			DeleteCriticalSection(&_POLL_FD(i).mutex);
+		}
+		fd_count = 0;
+		first_free_fd = -1;
+		for (i=0; i<count/FD_CHUNK_SIZE; i++) {
+			free(fd_chunks[i]);
+			fd_chunks[i] = NULL;
 		}
+		DeleteCriticalSection(&fd_table_lock);
 	}
 	InterlockedExchange((LONG *)&compat_spinlock, 0);
 }
@@ -274,33 +463,27 @@ int usbi_pipe(int filedes[2])
 	overlapped->Internal = STATUS_PENDING;
 	overlapped->InternalHigh = 0;
 
-	for (i=0; i<MAX_FDS; i++) {
-		if (poll_fd[i].fd < 0) {
-			EnterCriticalSection(&_poll_fd[i].mutex);
-			// fd might have been allocated before we got to critical
-			if (poll_fd[i].fd >= 0) {
-				LeaveCriticalSection(&_poll_fd[i].mutex);
-				continue;
-			}
-
-			// Use index as the unique fd number
-			poll_fd[i].fd = i;
-			// Read end of the "pipe"
-			filedes[0] = poll_fd[i].fd;
-			// We can use the same handle for both ends
-			filedes[1] = filedes[0];
-
-			poll_fd[i].handle = DUMMY_HANDLE;
-			poll_fd[i].overlapped = overlapped;
-			// There's no polling on the write end, so we just use READ for our needs
-			poll_fd[i].rw = RW_READ;
-			_poll_fd[i].original_handle = INVALID_HANDLE_VALUE;
-			LeaveCriticalSection(&_poll_fd[i].mutex);
-			return 0;
-		}
+	i = _alloc_index_and_lock();
+	if (i < 0) {
+		free_overlapped(overlapped);
+		return -1;
 	}
-	free_overlapped(overlapped);
-	return -1;
+
+	// Use index as the unique fd number
+	POLL_FD(i).fd = i;
+	// Read end of the "pipe"
+	filedes[0] = POLL_FD(i).fd;
+	// We can use the same handle for both ends
+	filedes[1] = filedes[0];
+
+	POLL_FD(i).handle = DUMMY_HANDLE;
+	POLL_FD(i).overlapped = overlapped;
+	// There's no polling on the write end, so we just use READ for our needs
+	POLL_FD(i).rw = RW_READ;
+	_POLL_FD(i).original_handle = INVALID_HANDLE_VALUE;
+	_POLL_FD(i).port = create_port();
+	LeaveCriticalSection(&_POLL_FD(i).mutex);
+	return 0;
 }
 
 /*
@@ -348,56 +531,53 @@ struct winfd usbi_create_fd(HANDLE handle, int access_mode, struct usbi_transfer
 		return INVALID_WINFD;
 	}
 
-	for (i=0; i<MAX_FDS; i++) {
-		if (poll_fd[i].fd < 0) {
-			EnterCriticalSection(&_poll_fd[i].mutex);
-			// fd might have been removed before we got to critical
-			if (poll_fd[i].fd >= 0) {
-				LeaveCriticalSection(&_poll_fd[i].mutex);
-				continue;
-			}
-			// Use index as the unique fd number
-			wfd.fd = i;
-			// Attempt to emulate some of the CancelIoEx behaviour on platforms
-			// that don't have it
-			if (Use_Duplicate_Handles) {
-				_poll_fd[i].thread_id = GetCurrentThreadId();
-				if (!DuplicateHandle(GetCurrentProcess(), handle, GetCurrentProcess(),
-					&wfd.handle, 0, TRUE, DUPLICATE_SAME_ACCESS)) {
-					usbi_dbg("could not duplicate handle for CancelIo - using original one");
-					wfd.handle = handle;
-					// Make sure we won't close the original handle on fd deletion then
-					_poll_fd[i].original_handle = INVALID_HANDLE_VALUE;
-				} else {
-					_poll_fd[i].original_handle = handle;
-				}
-			} else {
-				wfd.handle = handle;
-			}
-			wfd.overlapped = overlapped;
-			memcpy(&poll_fd[i], &wfd, sizeof(struct winfd));
-			LeaveCriticalSection(&_poll_fd[i].mutex);
-			return wfd;
+	i = _alloc_index_and_lock();
+	if (i < 0) {
+		free_overlapped(overlapped);
+		return INVALID_WINFD;
+	}
+	// Use index as the unique fd number
+	wfd.fd = i;
+	// Attempt to emulate some of the CancelIoEx behaviour on platforms
+	// that don't have it
+	if (Use_Duplicate_Handles) {
+		_POLL_FD(i).thread_id = GetCurrentThreadId();
+		if (!DuplicateHandle(GetCurrentProcess(), handle, GetCurrentProcess(),
+			&wfd.handle, 0, TRUE, DUPLICATE_SAME_ACCESS)) {
+			usbi_dbg("could not duplicate handle for CancelIo - using original one");
+			wfd.handle = handle;
+			// Make sure we won't close the original handle on fd deletion then
+			_POLL_FD(i).original_handle = INVALID_HANDLE_VALUE;
+		} else {
+			_POLL_FD(i).original_handle = handle;
 		}
+	} else {
+		wfd.handle = handle;
 	}
-	free_overlapped(overlapped);
-	return INVALID_WINFD;
+	wfd.overlapped = overlapped;
+	memcpy(&POLL_FD(i), &wfd, sizeof(struct winfd));
+	if (itransfer != NULL) {
+		register_port_wait(i, itransfer);
+	}
+	LeaveCriticalSection(&_POLL_FD(i).mutex);
+	return wfd;
 }
 
 static void _free_index(int _index)
 {
 	// Cancel any async IO (Don't care about the validity of our handles for this)
 	cancel_io(_index);
+	release_port(_index);
 	// close the duplicate handle (if we have an actual duplicate)
 	if (Use_Duplicate_Handles) {
-		if (_poll_fd[_index].original_handle != INVALID_HANDLE_VALUE) {
-			CloseHandle(poll_fd[_index].handle);
+		if (_POLL_FD(_index).original_handle != INVALID_HANDLE_VALUE) {
+			CloseHandle(POLL_FD(_index).handle);
 		}
-		_poll_fd[_index].original_handle = INVALID_HANDLE_VALUE;
-		_poll_fd[_index].thread_id = 0;
+		_POLL_FD(_index).original_handle = INVALID_HANDLE_VALUE;
+		_POLL_FD(_index).thread_id = 0;
 	}
-	free_overlapped(poll_fd[_index].overlapped);
-	poll_fd[_index] = INVALID_WINFD;
+	free_overlapped(POLL_FD(_index).overlapped);
+	POLL_FD(_index) = INVALID_WINFD;
 }
 
 /*
@@ -417,7 +597,8 @@ void usbi_free_fd(struct winfd *wfd)
 	}
 	_free_index(_index);
 	*wfd = INVALID_WINFD;
-	LeaveCriticalSection(&_poll_fd[_index].mutex);
+	LeaveCriticalSection(&_POLL_FD(_index).mutex);
+	_release_index(_index);
 }
 
 /*
@@ -425,28 +606,18 @@ void usbi_free_fd(struct winfd *wfd)
  */
 struct winfd fd_to_winfd(int fd)
 {
-	int i;
+	int _index;
 	struct winfd wfd;
 
 	CHECK_INIT_POLLING;
 
-	if (fd < 0)
+	_index = _fd_to_index_and_lock(fd);
+	if (_index < 0)
 		return INVALID_WINFD;
 
-	for (i=0; i<MAX_FDS; i++) {
-		if (poll_fd[i].fd == fd) {
-			EnterCriticalSection(&_poll_fd[i].mutex);
-			// fd might have been deleted before we got to critical
-			if (poll_fd[i].fd != fd) {
-				LeaveCriticalSection(&_poll_fd[i].mutex);
-				continue;
-			}
-			memcpy(&wfd, &poll_fd[i], sizeof(struct winfd));
-			LeaveCriticalSection(&_poll_fd[i].mutex);
-			return wfd;
-		}
-	}
-	return INVALID_WINFD;
+	memcpy(&wfd, &POLL_FD(_index), sizeof(struct winfd));
+	LeaveCriticalSection(&_POLL_FD(_index).mutex);
+	return wfd;
 }
 
 struct winfd handle_to_winfd(HANDLE handle)
@@ -459,16 +630,16 @@ struct winfd handle_to_winfd(HANDLE handle)
 	if ((handle == 0) || (handle == INVALID_HANDLE_VALUE))
 		return INVALID_WINFD;
 
-	for (i=0; i<MAX_FDS; i++) {
-		if (poll_fd[i].handle == handle) {
-			EnterCriticalSection(&_poll_fd[i].mutex);
+	for (i=0; i<fd_count; i++) {
+		if (POLL_FD(i).handle == handle) {
+			EnterCriticalSection(&_POLL_FD(i).mutex);
 			// fd might have been deleted before we got to critical
-			if (poll_fd[i].handle != handle) {
-				LeaveCriticalSection(&_poll_fd[i].mutex);
+			if (POLL_FD(i).handle != handle) {
+				LeaveCriticalSection(&_POLL_FD(i).mutex);
 				continue;
 			}
-			memcpy(&wfd, &poll_fd[i], sizeof(struct winfd));
-			LeaveCriticalSection(&_poll_fd[i].mutex);
+			memcpy(&wfd, &POLL_FD(i), sizeof(struct winfd));
+			LeaveCriticalSection(&_POLL_FD(i).mutex);
 			return wfd;
 		}
 	}
@@ -485,22 +656,102 @@ struct winfd overlapped_to_winfd(OVERLAPPED* overlapped)
 	if (overlapped == NULL)
 		return INVALID_WINFD;
 
-	for (i=0; i<MAX_FDS; i++) {
-		if (poll_fd[i].overlapped == overlapped) {
-			EnterCriticalSection(&_poll_fd[i].mutex);
+	for (i=0; i<fd_count; i++) {
+		if (POLL_FD(i).overlapped == overlapped) {
+			EnterCriticalSection(&_POLL_FD(i).mutex);
 			// fd might have been deleted before we got to critical
-			if (poll_fd[i].overlapped != overlapped) {
-				LeaveCriticalSection(&_poll_fd[i].mutex);
+			if (POLL_FD(i).overlapped != overlapped) {
+				LeaveCriticalSection(&_POLL_FD(i).mutex);
 				continue;
 			}
-			memcpy(&wfd, &poll_fd[i], sizeof(struct winfd));
-			LeaveCriticalSection(&_poll_fd[i].mutex);
+			memcpy(&wfd, &POLL_FD(i), sizeof(struct winfd));
+			LeaveCriticalSection(&_POLL_FD(i).mutex);
 			return wfd;
 		}
 	}
 	return INVALID_WINFD;
 }
 
+#if !defined(_WIN32_WCE)
+// Check whether the fd a completion packet was posted for is one we wait on
+// and has really completed, and flag it if so. Returns 1 if it was flagged
+static int flag_posted_fd(int _index, struct pollfd *fds, int *handle_to_index,
+	DWORD nb_handles)
+{
+	DWORD j;
+	int i, r = 0;
+
+	if ((_index < 0) || (_index >= fd_count))
+		return 0;
+
+	EnterCriticalSection(&_POLL_FD(_index).mutex);
+	for (j = 0; j < nb_handles; j++) {
+		i = handle_to_index[j];
+		if ((fds[i].fd != POLL_FD(_index).fd) || (fds[i].revents != 0))
+			continue;
+		if ((POLL_FD(_index).overlapped != NULL)
+		  && ((HasOverlappedIoCompleted(POLL_FD(_index).overlapped))
+		   || (HasOverlappedIoCompletedSync(POLL_FD(_index).overlapped)))) {
+			fds[i].revents = fds[i].events;
+			r = 1;
+		}
+		break;
+	}
+	LeaveCriticalSection(&_POLL_FD(_index).mutex);
+	return r;
+}
+
+// Wait on a completion port for any of the fds in handle_to_index to complete.
+// Returns the number of fds flagged, 0 on timeout or -1 on error
+static int wait_on_port(HANDLE port, struct pollfd *fds, int *handle_to_index,
+	DWORD nb_handles, int timeout)
+{
+	DWORD start = GetTickCount(), elapsed, wait_ms, bytes;
+	ULONG_PTR key;
+	OVERLAPPED *overlapped;
+	int triggered = 0;
+
+	poll_dbg("waiting on completion port for %d handles...", (int)nb_handles);
+	wait_ms = (timeout < 0) ? INFINITE : (DWORD)timeout;
+	for (;;) {
+		if (!GetQueuedCompletionStatus(port, &bytes, &key, &overlapped, wait_ms)
+		  && (overlapped == NULL)) {
+			if (GetLastError() == WAIT_TIMEOUT)
+				break;
+			errno = EIO;
+			return -1;
+		}
+		triggered += flag_posted_fd((int)key, fds, handle_to_index, nb_handles);
+		if (triggered) {
+			// collect whatever else is ready without waiting
+			wait_ms = 0;
+			continue;
+		}
+		// stale packet, keep waiting for the remainder of the timeout
+		if (timeout >= 0) {
+			elapsed = GetTickCount() - start;
+			if (elapsed >= (DWORD)timeout)
+				break;
+			wait_ms = (DWORD)timeout - elapsed;
+		}
+	}
+	poll_dbg("  %d fds ready after wait", triggered);
+	return triggered;
+}
+#else
+static __inline int wait_on_port(HANDLE port, struct pollfd *fds,
+	int *handle_to_index, DWORD nb_handles, int timeout)
+{
+	UNUSED(port);
+	UNUSED(fds);
+	UNUSED(handle_to_index);
+	UNUSED(nb_handles);
+	UNUSED(timeout);
+	errno = EIO;
+	return -1;
+}
+#endif
+
 /*
  * POSIX poll equivalent, using Windows OVERLAPPED
  * Currently, this function only accepts one of POLLIN or POLLOUT per fd
@@ -514,6 +765,9 @@ int usbi_poll(struct pollfd *fds, unsigned int nfds, int timeout)
 	int *handle_to_index;
 	DWORD nb_handles_to_wait_on = 0;
 	DWORD ret;
+	// completion port shared by all the fds to wait on, if there is one
+	HANDLE port = INVALID_HANDLE_VALUE;
+	BOOL use_port = TRUE;
 
 	CHECK_INIT_POLLING;
 
@@ -539,52 +793,58 @@ int usbi_poll(struct pollfd *fds, unsigned int nfds, int timeout)
 		}
 
 		_index = _fd_to_index_and_lock(fds[i].fd);
-		poll_dbg("fd[%d]=%d: (overlapped=%p) got events %04X", i, poll_fd[_index].fd, poll_fd[_index].overlapped, fds[i].events);
-
-		if ( (_index < 0) || (poll_fd[_index].handle == INVALID_HANDLE_VALUE)
-		  || (poll_fd[_index].handle == 0) || (poll_fd[_index].overlapped == NULL)) {
+		if ( (_index < 0) || (POLL_FD(_index).handle == INVALID_HANDLE_VALUE)
+		  || (POLL_FD(_index).handle == 0) || (POLL_FD(_index).overlapped == NULL)) {
 			fds[i].revents |= POLLNVAL | POLLERR;
 			errno = EBADF;
 			if (_index >= 0) {
-				LeaveCriticalSection(&_poll_fd[_index].mutex);
+				LeaveCriticalSection(&_POLL_FD(_index).mutex);
 			}
-			usbi_warn(NULL, "invalid fd");
+			usbi_warn(NULL, "invalid fd %d", fds[i].fd);
 			triggered = -1;
 			goto poll_exit;
 		}
+		poll_dbg("fd[%d]=%d: (overlapped=%p) got events %04X", i, POLL_FD(_index).fd, POLL_FD(_index).overlapped, fds[i].events);
 
 		// IN or OUT must match our fd direction
-		if ((fds[i].events & POLLIN) && (poll_fd[_index].rw != RW_READ)) {
+		if ((fds[i].events & POLLIN) && (POLL_FD(_index).rw != RW_READ)) {
 			fds[i].revents |= POLLNVAL | POLLERR;
 			errno = EBADF;
 			usbi_warn(NULL, "attempted POLLIN on fd without READ access");
-			LeaveCriticalSection(&_poll_fd[_index].mutex);
+			LeaveCriticalSection(&_POLL_FD(_index).mutex);
 			triggered = -1;
 			goto poll_exit;
 		}
 
-		if ((fds[i].events & POLLOUT) && (poll_fd[_index].rw != RW_WRITE)) {
+		if ((fds[i].events & POLLOUT) && (POLL_FD(_index).rw != RW_WRITE)) {
 			fds[i].revents |= POLLNVAL | POLLERR;
 			errno = EBADF;
 			usbi_warn(NULL, "attempted POLLOUT on fd without WRITE access");
-			LeaveCriticalSection(&_poll_fd[_index].mutex);
+			LeaveCriticalSection(&_POLL_FD(_index).mutex);
 			triggered = -1;
 			goto poll_exit;
 		}
 
 		// The following macro only works if overlapped I/O was reported pending
-		if ( (HasOverlappedIoCompleted(poll_fd[_index].overlapped))
-		  || (HasOverlappedIoCompletedSync(poll_fd[_index].overlapped)) ) {
+		if ( (HasOverlappedIoCompleted(POLL_FD(_index).overlapped))
+		  || (HasOverlappedIoCompletedSync(POLL_FD(_index).overlapped)) ) {
 			poll_dbg("  completed");
 			// checks above should ensure this works:
 			fds[i].revents = fds[i].events;
 			triggered++;
 		} else {
-			handles_to_wait_on[nb_handles_to_wait_on] = poll_fd[_index].overlapped->hEvent;
+			handles_to_wait_on[nb_handles_to_wait_on] = POLL_FD(_index).overlapped->hEvent;
 			handle_to_index[nb_handles_to_wait_on] = i;
 			nb_handles_to_wait_on++;
+			if (_POLL_FD(_index).port == INVALID_HANDLE_VALUE) {
+				use_port = FALSE;
+			} else if (port == INVALID_HANDLE_VALUE) {
+				port = _POLL_FD(_index).port;
+			} else if (port != _POLL_FD(_index).port) {
+				use_port = FALSE;
+			}
 		}
-		LeaveCriticalSection(&_poll_fd[_index].mutex);
+		LeaveCriticalSection(&_POLL_FD(_index).mutex);
 	}
 
 	// If nothing was triggered, wait on all fds that require it
@@ -594,6 +854,11 @@ int usbi_poll(struct pollfd *fds, unsigned int nfds, int timeout)
 		} else {
 			poll_dbg("starting %d ms wait for %d handles...", timeout, (int)nb_handles_to_wait_on);
 		}
+		if (use_port && (port != INVALID_HANDLE_VALUE)) {
+			triggered = wait_on_port(port, fds, handle_to_index,
+				nb_handles_to_wait_on, timeout);
+			goto poll_exit;
+		}
 		ret = WaitForMultipleObjects(nb_handles_to_wait_on, handles_to_wait_on,
 			FALSE, (timeout<0)?INFINITE:(DWORD)timeout);
 		object_index = ret-WAIT_OBJECT_0;
@@ -604,7 +869,7 @@ int usbi_poll(struct pollfd *fds, unsigned int nfds, int timeout)
 			fds[i].revents = fds[i].events;
 			triggered++;
 			if (_index >= 0) {
-				LeaveCriticalSection(&_poll_fd[_index].mutex);
+				LeaveCriticalSection(&_POLL_FD(_index).mutex);
 			}
 		} else if (ret == WAIT_TIMEOUT) {
 			poll_dbg("  timed out");
@@ -640,9 +905,11 @@ int usbi_close(int fd)
 	if (_index < 0) {
 		errno = EBADF;
 	} else {
-		free_overlapped(poll_fd[_index].overlapped);
-		poll_fd[_index] = INVALID_WINFD;
-		LeaveCriticalSection(&_poll_fd[_index].mutex);
+		release_port(_index);
+		free_overlapped(POLL_FD(_index).overlapped);
+		POLL_FD(_index) = INVALID_WINFD;
+		LeaveCriticalSection(&_POLL_FD(_index).mutex);
+		_release_index(_index);
 	}
 	return r;
 }
@@ -664,22 +931,23 @@ ssize_t usbi_write(int fd, const void *buf, size_t count)
 
 	_index = _fd_to_index_and_lock(fd);
 
-	if ( (_index < 0) || (poll_fd[_index].overlapped == NULL) ) {
+	if ( (_index < 0) || (POLL_FD(_index).overlapped == NULL) ) {
 		errno = EBADF;
 		if (_index >= 0) {
-			LeaveCriticalSection(&_poll_fd[_index].mutex);
+			LeaveCriticalSection(&_POLL_FD(_index).mutex);
 		}
 		return -1;
 	}
 
 	poll_dbg("set pipe event (fd = %d, thread = %08X)", _index, GetCurrentThreadId());
-	SetEvent(poll_fd[_index].overlapped->hEvent);
-	poll_fd[_index].overlapped->Internal = STATUS_WAIT_0;
+	SetEvent(POLL_FD(_index).overlapped->hEvent);
+	POLL_FD(_index).overlapped->Internal = STATUS_WAIT_0;
 	// If two threads write on the pipe at the same time, we need to
 	// process two separate reads => use the overlapped as a counter
-	poll_fd[_index].overlapped->InternalHigh++;
+	POLL_FD(_index).overlapped->InternalHigh++;
+	signal_port(_index);
 
-	LeaveCriticalSection(&_poll_fd[_index].mutex);
+	LeaveCriticalSection(&_POLL_FD(_index).mutex);
 	return sizeof(unsigned char);
 }
 
@@ -706,23 +974,23 @@ ssize_t usbi_read(int fd, void *buf, size_t count)
 		return -1;
 	}
 
-	if (WaitForSingleObject(poll_fd[_index].overlapped->hEvent, INFINITE) != WAIT_OBJECT_0) {
+	if (WaitForSingleObject(POLL_FD(_index).overlapped->hEvent, INFINITE) != WAIT_OBJECT_0) {
 		usbi_warn(NULL, "waiting for event failed: %d", (int)GetLastError());
 		errno = EIO;
 		goto out;
 	}
 
 	poll_dbg("clr pipe event (fd = %d, thread = %08X)", _index, GetCurrentThreadId());
-	poll_fd[_index].overlapped->InternalHigh--;
+	POLL_FD(_index).overlapped->InternalHigh--;
 	// Don't reset unless we don't have any more events to process
-	if (poll_fd[_index].overlapped->InternalHigh <= 0) {
-		ResetEvent(poll_fd[_index].overlapped->hEvent);
-		poll_fd[_index].overlapped->Internal = STATUS_PENDING;
+	if (POLL_FD(_index).overlapped->InternalHigh <= 0) {
+		ResetEvent(POLL_FD(_index).overlapped->hEvent);
+		POLL_FD(_index).overlapped->Internal = STATUS_PENDING;
 	}
 
 	r = sizeof(unsigned char);
 
 out:
-	LeaveCriticalSection(&_poll_fd[_index].mutex);
+	LeaveCriticalSection(&_POLL_FD(_index).mutex);
 	return r;
 }
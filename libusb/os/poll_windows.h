@@ -55,7 +55,8 @@ enum windows_version {
 };
 extern int windows_version;
 
-#define MAX_FDS     256
+// Upper bound for the number of fds, the table only grows as far as needed
+#define MAX_FDS     65536
 
 #define POLLIN      0x0001    /* There is data to read */
 #define POLLPRI     0x0002    /* There is urgent data to read */
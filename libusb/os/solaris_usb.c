@@ -17,12 +17,18 @@
 
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
 #include <regex.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include <sys/types.h>
 
 #include <libdevinfo.h>
+#include <sys/usb/clients/ugen/usb_ugen.h>
 
 #include "libusb.h"
 #include "libusbi.h"
@@ -31,6 +37,70 @@ static const char dev_usb[] = "/dev/usb";
 static const char devices[] = "/devices";
 static const size_t devices_len = sizeof (devices) - 1;
 
+/* endpoints are indexed by direction and number */
+#define SOLARIS_MAX_ENDPOINTS   32
+#define SOLARIS_MAX_INTERFACES  32
+#define SOLARIS_EP_INDEX(ep) \
+  (((ep) & LIBUSB_ENDPOINT_ADDRESS_MASK) | (((ep) & LIBUSB_ENDPOINT_IN) ? 0x10 : 0))
+
+struct solaris_device_priv
+{
+  char ugen_path[PATH_MAX];     /* /dev/usb/<vid>.<pid>/<instance> */
+  unsigned char dev_descr[LIBUSB_DT_DEVICE_SIZE];
+  unsigned char *raw_cfgs;      /* all configuration descriptors */
+  size_t raw_cfgs_len;
+  int cfgvalue;                 /* active configuration */
+};
+
+/*
+ * ugen(7D) only performs blocking I/O, so transfers are run by one worker
+ * thread per endpoint, each serving a queue of submitted transfers.  The
+ * worker owns the endpoint's device nodes and reopens them when the
+ * configuration or an alternate setting changes.  Completed transfers are
+ * posted on the handle's event pipe.
+ */
+struct solaris_endpoint
+{
+  struct solaris_handle_priv *hpriv;
+  uint8_t address;
+  pthread_t thread;
+  int started;
+  pthread_cond_t cond;          /* signalled on new work */
+  struct list_head queue;       /* pending solaris_transfer_priv */
+  int fd;
+  int stat_fd;
+  unsigned int generation;      /* of the nodes open in fd and stat_fd */
+};
+
+struct solaris_handle_priv
+{
+  struct libusb_device_handle *handle;
+  int pipe[2];                  /* for event notification */
+  int cntrl_fd;
+  int cntrl_stat_fd;
+  pthread_mutex_t cntrl_lock;   /* serialises requests on cntrl0 */
+  int cfgvalue;
+  int altsetting[SOLARIS_MAX_INTERFACES];
+  pthread_mutex_t lock;         /* protects everything below */
+  unsigned int generation;      /* bumped on configuration changes */
+  int closing;
+  struct solaris_endpoint endpoints[SOLARIS_MAX_ENDPOINTS];
+};
+
+struct solaris_transfer_priv
+{
+  struct usbi_transfer *itransfer;
+  struct list_head list;        /* in its endpoint's queue */
+  int queued;
+  int cancelled;
+  int err;                      /* result of the request */
+};
+
+#define DEVICE_PRIV(dev) \
+  ((struct solaris_device_priv *) (dev)->os_priv)
+#define HANDLE_PRIV(handle) \
+  ((struct solaris_handle_priv *) (handle)->os_priv)
+
 
 /*
  * Backend functions
@@ -67,9 +137,25 @@ static int solaris_handle_events (struct libusb_context *ctx, struct pollfd *,
                                   nfds_t, int);
 static int solaris_clock_gettime (int, struct timespec *);
 
+/*
+ * Private functions
+ */
+static int solaris_errno_to_libusb (int);
+static int solaris_find_config (struct libusb_device *, int, int,
+                                unsigned char **);
+static int solaris_do_control (struct solaris_handle_priv *,
+                               unsigned char *, size_t);
+static int solaris_do_io (struct solaris_endpoint *,
+                          struct libusb_transfer *);
+static int solaris_open_endpoint (struct solaris_endpoint *, unsigned int);
+static void solaris_close_endpoint (struct solaris_endpoint *);
+static void *solaris_endpoint_worker (void *);
+static void solaris_stop_workers (struct solaris_handle_priv *);
+static enum libusb_transfer_status solaris_err_to_transfer_status (int);
+
 
 const struct usbi_os_backend solaris_backend = {
-  .name = "Synchronous Solaris backend",
+  .name = "Solaris ugen backend",
   .init = NULL,
   .exit = NULL,
   .get_device_list = solaris_get_device_list,
@@ -104,9 +190,9 @@ const struct usbi_os_backend solaris_backend = {
 
   .clock_gettime = solaris_clock_gettime,
 
-  .device_priv_size = 0,
-  .device_handle_priv_size = 0,
-  .transfer_priv_size = 0,
+  .device_priv_size = sizeof (struct solaris_device_priv),
+  .device_handle_priv_size = sizeof (struct solaris_handle_priv),
+  .transfer_priv_size = sizeof (struct solaris_transfer_priv),
   .add_iso_packet_size = 0,
 };
 
@@ -137,16 +223,22 @@ di_prop_get_int (di_node_t dn, const char *propname, int *out)
   return retval;
 }
 
-static void
+static int
 solaris_add_device (struct libusb_context *ctx,
                     struct discovered_devs **discdevs,
-                    const char *device_node_path)
+                    const char *device_node_path, const char *ugen_path)
 {
   int busnum = 0;
   int devaddr = 0;
   int numconf = 1;
+  int len;
+  int retval = LIBUSB_SUCCESS;
   unsigned long session_id;
   enum libusb_speed speed;
+  unsigned char *bytes;
+  struct libusb_device *dev;
+  struct solaris_device_priv *dpriv;
+  struct discovered_devs *ddd;
 
   usbi_info (ctx, "device node \"%s\"", device_node_path);
 
@@ -154,7 +246,7 @@ solaris_add_device (struct libusb_context *ctx,
   if (DI_NODE_NIL == devnode)
     {
       usbi_err (ctx, "di_init() failed: %s, skipping", strerror (errno));
-      return;
+      return LIBUSB_SUCCESS;
     }
 
   /* From now work with libdevinfo */
@@ -196,9 +288,75 @@ solaris_add_device (struct libusb_context *ctx,
   usbi_dbg ("busnum %d devaddr %d session_id %u", busnum, devaddr,
             session_id);
 
+  dev = usbi_get_device_by_session_id (ctx, session_id);
+  if (NULL == dev)
+    {
+      dev = usbi_alloc_device (ctx, session_id);
+      if (NULL == dev)
+        {
+          retval = LIBUSB_ERROR_NO_MEM;
+          goto cleanup;
+        }
+
+      dev->bus_number = busnum;
+      dev->device_address = devaddr;
+      dev->speed = speed;
+
+      dpriv = DEVICE_PRIV (dev);
+      snprintf (dpriv->ugen_path, sizeof (dpriv->ugen_path), "%s",
+                ugen_path);
+
+      /* the descriptors are read once by usba and kept as properties */
+      len = di_prop_lookup_bytes (DDI_DEV_T_ANY, devnode,
+                                  "usb-dev-descriptor", &bytes);
+      if (LIBUSB_DT_DEVICE_SIZE != len)
+        {
+          usbi_warn (ctx, "no device descriptor, skipping");
+          libusb_unref_device (dev);
+          goto cleanup;
+        }
+      memcpy (dpriv->dev_descr, bytes, LIBUSB_DT_DEVICE_SIZE);
+
+      len = di_prop_lookup_bytes (DDI_DEV_T_ANY, devnode,
+                                  "usb-raw-cfg-descriptors", &bytes);
+      if (len < LIBUSB_DT_CONFIG_SIZE)
+        {
+          usbi_warn (ctx, "no configuration descriptors, skipping");
+          libusb_unref_device (dev);
+          goto cleanup;
+        }
+      dpriv->raw_cfgs = malloc (len);
+      if (NULL == dpriv->raw_cfgs)
+        {
+          libusb_unref_device (dev);
+          retval = LIBUSB_ERROR_NO_MEM;
+          goto cleanup;
+        }
+      memcpy (dpriv->raw_cfgs, bytes, len);
+      dpriv->raw_cfgs_len = len;
+
+      /* ugen starts out in the first configuration */
+      dpriv->cfgvalue = dpriv->raw_cfgs[5];
+
+      if (usbi_sanitize_device (dev))
+        {
+          libusb_unref_device (dev);
+          goto cleanup;
+        }
+    }
+
+  ddd = discovered_devs_append (*discdevs, dev);
+  libusb_unref_device (dev);
+  if (NULL == ddd)
+    {
+      retval = LIBUSB_ERROR_NO_MEM;
+      goto cleanup;
+    }
+  *discdevs = ddd;
+
 cleanup:
   di_fini (devnode);
-  return;
+  return retval;
 }
 
 
@@ -207,15 +365,15 @@ solaris_get_device_list (struct libusb_context *ctx,
                          struct discovered_devs **discdevs)
 {
   char vidpid_path[sizeof ("/dev/usb/vvvv.pppp")];
+  char ugen_path[sizeof ("/dev/usb/vvvv.pppp/iiii")];
   char devstat_path[sizeof ("/dev/usb/vvvv.pppp/iiii/devstat")];        /* 9999 instances should be enough. */
 
   /* for realpath():  */
-  char
-    device_path[sizeof
-                ("/devices/pci@NNNN,MMMM/pciXXXX,YYYY@IIII/device@IIII:AAAA.BBBB.devstat")];
+  char device_path[PATH_MAX];
 
   regex_t regex;
   int retval;
+  int err = LIBUSB_SUCCESS;
   char *device_node_path;
 
   if (0 != regcomp (&regex, "[0-9a-f]+\\.[0-9a-f]+", REG_EXTENDED))
@@ -235,7 +393,7 @@ solaris_get_device_list (struct libusb_context *ctx,
 
   struct dirent *vidpid;
   usbi_dbg ("start browsing %s", dev_usb);
-  while ((vidpid = readdir (dev_usb_dir)) != NULL)
+  while (LIBUSB_SUCCESS == err && (vidpid = readdir (dev_usb_dir)) != NULL)
     {
       if (0 != regexec (&regex, vidpid->d_name, 0, NULL, 0))
         {
@@ -266,7 +424,7 @@ solaris_get_device_list (struct libusb_context *ctx,
 
       struct dirent *inst;
       usbi_dbg ("start browsing %s", vidpid_path);
-      while ((inst = readdir (vidpid_dir)) != NULL)
+      while (LIBUSB_SUCCESS == err && (inst = readdir (vidpid_dir)) != NULL)
         {
           if ('.' == inst->d_name[0])
             continue;
@@ -276,6 +434,15 @@ solaris_get_device_list (struct libusb_context *ctx,
           usbi_info (ctx, "found ugen device %s/%s", vidpid_path,
                      inst->d_name);
 
+          retval =
+            snprintf (ugen_path, sizeof (ugen_path), "%s/%s", vidpid_path,
+                      inst->d_name);
+          if (retval >= sizeof (ugen_path))
+            {
+              usbi_err (ctx, "ugen_path: snprintf() failed, skipping");
+              continue;
+            }
+
           /* We need *any* file in the instance subdir
            * only to get the real device path under /devices.
            * E. g. given /dev/usb/a12.1/0/devstat -> /devices/pci@0,0/pci106b,3f@6/device@2:a12.1.devstat
@@ -283,8 +450,8 @@ solaris_get_device_list (struct libusb_context *ctx,
            * devstat always exists, so use it.
            */
           retval =
-            snprintf (devstat_path, sizeof (devstat_path), "%s/%s/devstat",
-                      vidpid_path, inst->d_name);
+            snprintf (devstat_path, sizeof (devstat_path), "%s/devstat",
+                      ugen_path);
           if (retval >= sizeof (devstat_path))
             {
               usbi_err (ctx, "devstat_path: snprintf() failed, skipping");
@@ -329,33 +496,137 @@ solaris_get_device_list (struct libusb_context *ctx,
           else
             usbi_warn (ctx, "no colon in device node path");
 
-          solaris_add_device (ctx, discdevs, device_node_path);
+          err = solaris_add_device (ctx, discdevs, device_node_path,
+                                    ugen_path);
         }
       usbi_dbg ("stop browsing %s", vidpid_path);
+      (void) closedir (vidpid_dir);
     }
   usbi_dbg ("stop browsing %s", dev_usb);
 
   (void) closedir (dev_usb_dir);
+  regfree (&regex);
 
-  return (LIBUSB_ERROR_NO_DEVICE);
+  return (err);
 }
 
 int
 solaris_open (struct libusb_device_handle *handle)
 {
-  return (LIBUSB_ERROR_NO_DEVICE);
+  struct solaris_handle_priv *hpriv = HANDLE_PRIV (handle);
+  struct solaris_device_priv *dpriv = DEVICE_PRIV (handle->dev);
+  char path[PATH_MAX];
+  int err;
+  int i;
+
+  hpriv->handle = handle;
+  hpriv->cfgvalue = dpriv->cfgvalue;
+  for (i = 0; i < SOLARIS_MAX_INTERFACES; i++)
+    hpriv->altsetting[i] = 0;
+
+  snprintf (path, sizeof (path), "%s/cntrl0", dpriv->ugen_path);
+  hpriv->cntrl_fd = open (path, O_RDWR);
+  if (hpriv->cntrl_fd < 0)
+    {
+      err = errno;
+      usbi_dbg ("open(\"%s\") failed: %s", path, strerror (err));
+      return solaris_errno_to_libusb (err);
+    }
+
+  snprintf (path, sizeof (path), "%s/cntrl0stat", dpriv->ugen_path);
+  hpriv->cntrl_stat_fd = open (path, O_RDONLY);
+  if (hpriv->cntrl_stat_fd < 0)
+    usbi_dbg ("open(\"%s\") failed: %s", path, strerror (errno));
+
+  if (pipe (hpriv->pipe) < 0)
+    {
+      err = errno;
+      close (hpriv->cntrl_fd);
+      if (hpriv->cntrl_stat_fd >= 0)
+        close (hpriv->cntrl_stat_fd);
+      return solaris_errno_to_libusb (err);
+    }
+
+  pthread_mutex_init (&hpriv->cntrl_lock, NULL);
+  pthread_mutex_init (&hpriv->lock, NULL);
+  hpriv->generation = 0;
+  hpriv->closing = 0;
+  for (i = 0; i < SOLARIS_MAX_ENDPOINTS; i++)
+    {
+      struct solaris_endpoint *ep = &hpriv->endpoints[i];
+
+      ep->hpriv = hpriv;
+      ep->address = (i & LIBUSB_ENDPOINT_ADDRESS_MASK)
+        | ((i & 0x10) ? LIBUSB_ENDPOINT_IN : 0);
+      ep->started = 0;
+      pthread_cond_init (&ep->cond, NULL);
+      list_init (&ep->queue);
+      ep->fd = -1;
+      ep->stat_fd = -1;
+      ep->generation = 0;
+    }
+
+  return usbi_add_pollfd (HANDLE_CTX (handle), hpriv->pipe[0], POLLIN);
 }
 
 void
 solaris_close (struct libusb_device_handle *handle)
 {
+  struct solaris_handle_priv *hpriv = HANDLE_PRIV (handle);
+
+  solaris_stop_workers (hpriv);
+
+  close (hpriv->cntrl_fd);
+  if (hpriv->cntrl_stat_fd >= 0)
+    close (hpriv->cntrl_stat_fd);
+  pthread_mutex_destroy (&hpriv->cntrl_lock);
+
+  usbi_remove_pollfd (HANDLE_CTX (handle), hpriv->pipe[0]);
+  close (hpriv->pipe[0]);
+  close (hpriv->pipe[1]);
 }
 
 int
 solaris_get_device_descriptor (struct libusb_device *dev, unsigned char *buf,
                                int *host_endian)
 {
-  return (LIBUSB_ERROR_NO_DEVICE);
+  struct solaris_device_priv *dpriv = DEVICE_PRIV (dev);
+
+  memcpy (buf, dpriv->dev_descr, LIBUSB_DT_DEVICE_SIZE);
+  *host_endian = 0;
+
+  return (LIBUSB_SUCCESS);
+}
+
+/*
+ * Locate a configuration descriptor in the raw descriptors, either by index
+ * (value < 0) or by bConfigurationValue.  Returns its total length.
+ */
+int
+solaris_find_config (struct libusb_device *dev, int idx, int value,
+                     unsigned char **cfg)
+{
+  struct solaris_device_priv *dpriv = DEVICE_PRIV (dev);
+  size_t offset = 0;
+  size_t len;
+  int i;
+
+  for (i = 0; offset + LIBUSB_DT_CONFIG_SIZE <= dpriv->raw_cfgs_len; i++)
+    {
+      unsigned char *p = dpriv->raw_cfgs + offset;
+
+      len = p[2] | (p[3] << 8);
+      if (len < LIBUSB_DT_CONFIG_SIZE || offset + len > dpriv->raw_cfgs_len)
+        break;
+      if ((value < 0 && i == idx) || (value >= 0 && p[5] == value))
+        {
+          *cfg = p;
+          return (int) len;
+        }
+      offset += len;
+    }
+
+  return (LIBUSB_ERROR_NOT_FOUND);
 }
 
 int
@@ -363,7 +634,19 @@ solaris_get_active_config_descriptor (struct libusb_device *dev,
                                       unsigned char *buf, size_t len,
                                       int *host_endian)
 {
-  return (LIBUSB_ERROR_NO_DEVICE);
+  struct solaris_device_priv *dpriv = DEVICE_PRIV (dev);
+  unsigned char *cfg;
+  int r;
+
+  r = solaris_find_config (dev, -1, dpriv->cfgvalue, &cfg);
+  if (r < 0)
+    return (r);
+
+  len = MIN (len, (size_t) r);
+  memcpy (buf, cfg, len);
+  *host_endian = 0;
+
+  return (int) len;
 }
 
 int
@@ -371,70 +654,209 @@ solaris_get_config_descriptor (struct libusb_device *dev, uint8_t idx,
                                unsigned char *buf, size_t len,
                                int *host_endian)
 {
-  return (LIBUSB_ERROR_NO_DEVICE);
+  unsigned char *cfg;
+  int r;
+
+  r = solaris_find_config (dev, idx, -1, &cfg);
+  if (r < 0)
+    return (r);
+
+  len = MIN (len, (size_t) r);
+  memcpy (buf, cfg, len);
+  *host_endian = 0;
+
+  return (int) len;
 }
 
 int
 solaris_get_configuration (struct libusb_device_handle *handle, int *config)
 {
-  return (LIBUSB_ERROR_NO_DEVICE);
+  *config = HANDLE_PRIV (handle)->cfgvalue;
+
+  return (LIBUSB_SUCCESS);
 }
 
+/*
+ * ugen selects the configuration and alternate settings from the names of
+ * the endpoint nodes that are opened, so these only record the choice and
+ * let the workers reopen their nodes.
+ */
 int
 solaris_set_configuration (struct libusb_device_handle *handle, int config)
 {
-  return (LIBUSB_ERROR_NO_DEVICE);
+  struct solaris_handle_priv *hpriv = HANDLE_PRIV (handle);
+  unsigned char *cfg;
+  int i;
+
+  if (config < 0)
+    return (LIBUSB_ERROR_NOT_SUPPORTED);
+  if (solaris_find_config (handle->dev, -1, config, &cfg) < 0)
+    return (LIBUSB_ERROR_NOT_FOUND);
+
+  pthread_mutex_lock (&hpriv->lock);
+  hpriv->cfgvalue = config;
+  for (i = 0; i < SOLARIS_MAX_INTERFACES; i++)
+    hpriv->altsetting[i] = 0;
+  hpriv->generation++;
+  pthread_mutex_unlock (&hpriv->lock);
+
+  DEVICE_PRIV (handle->dev)->cfgvalue = config;
+
+  return (LIBUSB_SUCCESS);
 }
 
 int
 solaris_claim_interface (struct libusb_device_handle *handle, int iface)
 {
-  return (LIBUSB_ERROR_NO_DEVICE);
+  if (iface >= SOLARIS_MAX_INTERFACES)
+    return (LIBUSB_ERROR_NOT_FOUND);
+
+  /* ugen opens endpoint nodes exclusively, there is nothing to claim */
+  return (LIBUSB_SUCCESS);
 }
 
 int
 solaris_release_interface (struct libusb_device_handle *handle, int iface)
 {
-  return (LIBUSB_ERROR_NO_DEVICE);
+  struct solaris_handle_priv *hpriv = HANDLE_PRIV (handle);
+
+  pthread_mutex_lock (&hpriv->lock);
+  if (hpriv->altsetting[iface])
+    {
+      hpriv->altsetting[iface] = 0;
+      hpriv->generation++;
+    }
+  pthread_mutex_unlock (&hpriv->lock);
+
+  return (LIBUSB_SUCCESS);
 }
 
 int
 solaris_set_interface_altsetting (struct libusb_device_handle *handle,
                                   int iface, int altsetting)
 {
-  return (LIBUSB_ERROR_NO_DEVICE);
+  struct solaris_handle_priv *hpriv = HANDLE_PRIV (handle);
+
+  pthread_mutex_lock (&hpriv->lock);
+  hpriv->altsetting[iface] = altsetting;
+  hpriv->generation++;
+  pthread_mutex_unlock (&hpriv->lock);
+
+  return (LIBUSB_SUCCESS);
 }
 
 int
 solaris_clear_halt (struct libusb_device_handle *handle,
                     unsigned char endpoint)
 {
-  return (LIBUSB_ERROR_NO_DEVICE);
+  unsigned char setup[LIBUSB_CONTROL_SETUP_SIZE];
+  int r;
+
+  libusb_fill_control_setup (setup, LIBUSB_RECIPIENT_ENDPOINT,
+                             LIBUSB_REQUEST_CLEAR_FEATURE, 0, endpoint, 0);
+  r = solaris_do_control (HANDLE_PRIV (handle), setup, sizeof (setup));
+
+  return (r < 0) ? r : LIBUSB_SUCCESS;
 }
 
 int
 solaris_reset_device (struct libusb_device_handle *handle)
 {
-  return (LIBUSB_ERROR_NO_DEVICE);
+  return (LIBUSB_ERROR_NOT_SUPPORTED);
 }
 
 void
 solaris_destroy_device (struct libusb_device *dev)
 {
+  free (DEVICE_PRIV (dev)->raw_cfgs);
 }
 
 int
 solaris_submit_transfer (struct usbi_transfer *itransfer)
 {
-  return (LIBUSB_ERROR_NO_DEVICE);
+  struct libusb_transfer *transfer;
+  struct solaris_handle_priv *hpriv;
+  struct solaris_transfer_priv *tpriv;
+  struct solaris_endpoint *ep;
+  int err;
+
+  usbi_dbg ("");
+
+  transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER (itransfer);
+  hpriv = HANDLE_PRIV (transfer->dev_handle);
+  tpriv = usbi_transfer_get_os_priv (itransfer);
+
+  switch (transfer->type)
+    {
+    case LIBUSB_TRANSFER_TYPE_CONTROL:
+      if (transfer->length < LIBUSB_CONTROL_SETUP_SIZE)
+        return (LIBUSB_ERROR_INVALID_PARAM);
+      ep = &hpriv->endpoints[0];
+      break;
+    case LIBUSB_TRANSFER_TYPE_BULK:
+    case LIBUSB_TRANSFER_TYPE_INTERRUPT:
+      ep = &hpriv->endpoints[SOLARIS_EP_INDEX (transfer->endpoint)];
+      break;
+    default:
+      /* isochronous ugen nodes use a request protocol of their own */
+      return (LIBUSB_ERROR_NOT_SUPPORTED);
+    }
+
+  tpriv->itransfer = itransfer;
+  tpriv->cancelled = 0;
+  tpriv->err = 0;
+
+  pthread_mutex_lock (&hpriv->lock);
+  if (!ep->started)
+    {
+      err = pthread_create (&ep->thread, NULL, solaris_endpoint_worker, ep);
+      if (err)
+        {
+          pthread_mutex_unlock (&hpriv->lock);
+          return solaris_errno_to_libusb (err);
+        }
+      ep->started = 1;
+    }
+  list_add_tail (&tpriv->list, &ep->queue);
+  tpriv->queued = 1;
+  pthread_cond_signal (&ep->cond);
+  pthread_mutex_unlock (&hpriv->lock);
+
+  return (LIBUSB_SUCCESS);
 }
 
 int
 solaris_cancel_transfer (struct usbi_transfer *itransfer)
 {
+  struct libusb_transfer *transfer;
+  struct solaris_handle_priv *hpriv;
+  struct solaris_transfer_priv *tpriv;
+  int err = LIBUSB_ERROR_NOT_SUPPORTED;
+
   usbi_dbg ("");
 
-  return (LIBUSB_ERROR_NOT_SUPPORTED);
+  transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER (itransfer);
+  hpriv = HANDLE_PRIV (transfer->dev_handle);
+  tpriv = usbi_transfer_get_os_priv (itransfer);
+
+  /*
+   * Only transfers still waiting in a queue can be cancelled, ugen gives no
+   * way to abort the read or write a worker is blocked in.
+   */
+  pthread_mutex_lock (&hpriv->lock);
+  if (tpriv->queued)
+    {
+      list_del (&tpriv->list);
+      tpriv->queued = 0;
+      tpriv->cancelled = 1;
+      if (write (hpriv->pipe[1], &itransfer, sizeof (itransfer)) < 0)
+        err = solaris_errno_to_libusb (errno);
+      else
+        err = LIBUSB_SUCCESS;
+    }
+  pthread_mutex_unlock (&hpriv->lock);
+
+  return (err);
 }
 
 void
@@ -446,7 +868,400 @@ int
 solaris_handle_events (struct libusb_context *ctx, struct pollfd *fds,
                        nfds_t nfds, int num_ready)
 {
-  return (LIBUSB_ERROR_NO_DEVICE);
+  struct libusb_device_handle *handle;
+  struct solaris_handle_priv *hpriv = NULL;
+  struct solaris_transfer_priv *tpriv;
+  struct usbi_transfer *itransfer;
+  struct pollfd *pollfd;
+  int i, err = 0;
+
+  usbi_dbg ("");
+
+  pthread_mutex_lock (&ctx->open_devs_lock);
+  for (i = 0; i < nfds && num_ready > 0; i++)
+    {
+      pollfd = &fds[i];
+
+      if (!pollfd->revents)
+        continue;
+
+      hpriv = NULL;
+      num_ready--;
+      list_for_each_entry (handle, &ctx->open_devs, list,
+                           struct libusb_device_handle)
+      {
+        hpriv = HANDLE_PRIV (handle);
+
+        if (hpriv->pipe[0] == pollfd->fd)
+          break;
+
+        hpriv = NULL;
+      }
+
+      if (NULL == hpriv)
+        {
+          usbi_dbg ("fd %d is not an event pipe!", pollfd->fd);
+          err = ENOENT;
+          break;
+        }
+
+      if (pollfd->revents & POLLERR)
+        {
+          usbi_remove_pollfd (HANDLE_CTX (handle), hpriv->pipe[0]);
+          usbi_handle_disconnect (handle);
+          continue;
+        }
+
+      if (read (hpriv->pipe[0], &itransfer, sizeof (itransfer)) < 0)
+        {
+          err = errno;
+          break;
+        }
+
+      tpriv = usbi_transfer_get_os_priv (itransfer);
+      if (tpriv->cancelled)
+        err = usbi_handle_transfer_cancellation (itransfer);
+      else
+        err = usbi_handle_transfer_completion (itransfer,
+                                               solaris_err_to_transfer_status
+                                               (tpriv->err));
+      if (err)
+        break;
+    }
+  pthread_mutex_unlock (&ctx->open_devs_lock);
+
+  if (err)
+    return solaris_errno_to_libusb (err);
+
+  return (LIBUSB_SUCCESS);
+}
+
+int
+solaris_errno_to_libusb (int err)
+{
+  usbi_dbg ("error: %s (%d)", strerror (err), err);
+
+  switch (err)
+    {
+    case EIO:
+      return (LIBUSB_ERROR_IO);
+    case EACCES:
+    case EPERM:
+      return (LIBUSB_ERROR_ACCESS);
+    case ENOENT:
+    case ENODEV:
+    case ENXIO:
+      return (LIBUSB_ERROR_NO_DEVICE);
+    case EBUSY:
+      return (LIBUSB_ERROR_BUSY);
+    case ETIMEDOUT:
+      return (LIBUSB_ERROR_TIMEOUT);
+    case ENOMEM:
+    case EAGAIN:
+      return (LIBUSB_ERROR_NO_MEM);
+    case EINTR:
+      return (LIBUSB_ERROR_INTERRUPTED);
+    }
+
+  return (LIBUSB_ERROR_OTHER);
+}
+
+/*
+ * Turn a failed request into a libusb error, asking the status node of the
+ * endpoint what went wrong.
+ */
+static int
+solaris_stat_to_libusb (int stat_fd, int err)
+{
+  int status;
+
+  if (stat_fd < 0 || read (stat_fd, &status, sizeof (status)) !=
+      sizeof (status))
+    return solaris_errno_to_libusb (err);
+
+  usbi_dbg ("ugen status %d", status);
+
+  switch (status)
+    {
+    case USB_LC_STAT_NOERROR:
+      return solaris_errno_to_libusb (err);
+    case USB_LC_STAT_STALL:
+      return (LIBUSB_ERROR_PIPE);
+    case USB_LC_STAT_TIMEOUT:
+      return (LIBUSB_ERROR_TIMEOUT);
+    case USB_LC_STAT_DATA_OVERRUN:
+    case USB_LC_STAT_BUFFER_OVERRUN:
+      return (LIBUSB_ERROR_OVERFLOW);
+    case USB_LC_STAT_DISCONNECTED:
+      return (LIBUSB_ERROR_NO_DEVICE);
+    }
+
+  return (LIBUSB_ERROR_IO);
+}
+
+/*
+ * Run a control request on cntrl0.  OUT requests are written in one piece,
+ * setup packet and data, IN requests write the setup packet and read the
+ * data back.  Returns the number of data bytes moved.
+ */
+int
+solaris_do_control (struct solaris_handle_priv *hpriv, unsigned char *buf,
+                    size_t len)
+{
+  struct libusb_control_setup *setup = (struct libusb_control_setup *) buf;
+  size_t wLength = libusb_le16_to_cpu (setup->wLength);
+  ssize_t ret;
+  int err = 0;
+
+  if (len < LIBUSB_CONTROL_SETUP_SIZE + wLength)
+    return (LIBUSB_ERROR_INVALID_PARAM);
+
+  pthread_mutex_lock (&hpriv->cntrl_lock);
+  if (setup->bmRequestType & LIBUSB_ENDPOINT_IN)
+    {
+      ret = write (hpriv->cntrl_fd, buf, LIBUSB_CONTROL_SETUP_SIZE);
+      if (ret == LIBUSB_CONTROL_SETUP_SIZE)
+        ret = read (hpriv->cntrl_fd, buf + LIBUSB_CONTROL_SETUP_SIZE,
+                    wLength);
+      else if (ret >= 0)
+        ret = -1;
+    }
+  else
+    {
+      ret = write (hpriv->cntrl_fd, buf, LIBUSB_CONTROL_SETUP_SIZE + wLength);
+      if (ret >= LIBUSB_CONTROL_SETUP_SIZE)
+        ret -= LIBUSB_CONTROL_SETUP_SIZE;
+      else if (ret >= 0)
+        ret = -1;
+    }
+  if (ret < 0)
+    {
+      err = errno;
+      ret = solaris_stat_to_libusb (hpriv->cntrl_stat_fd, err);
+    }
+  pthread_mutex_unlock (&hpriv->cntrl_lock);
+
+  return (int) ret;
+}
+
+/*
+ * Open the data and status nodes of an endpoint for the configuration and
+ * alternate setting its interface is currently in, e.g.
+ * /dev/usb/<vid>.<pid>/<instance>/[cfg<N>]if<I>[.<alt>]<in|out><ep>
+ */
+int
+solaris_open_endpoint (struct solaris_endpoint *ep, unsigned int generation)
+{
+  struct solaris_handle_priv *hpriv = ep->hpriv;
+  struct libusb_device *dev = hpriv->handle->dev;
+  struct solaris_device_priv *dpriv = DEVICE_PRIV (dev);
+  char path[PATH_MAX];
+  char cfg_prefix[16] = "";
+  char alt_suffix[16] = "";
+  unsigned char *cfg, *p, *end;
+  int cfgvalue, iface = -1, cur_iface = -1, cur_alt = 0, alt = 0;
+  int len, err;
+
+  pthread_mutex_lock (&hpriv->lock);
+  cfgvalue = hpriv->cfgvalue;
+  len = solaris_find_config (dev, -1, cfgvalue, &cfg);
+
+  /* find the interface the endpoint belongs to in its current setting */
+  for (p = cfg, end = cfg + (len > 0 ? len : 0); p + 2 <= end && p[0];
+       p += p[0])
+    {
+      if (LIBUSB_DT_INTERFACE == p[1] && p[0] >= LIBUSB_DT_INTERFACE_SIZE)
+        {
+          cur_iface = p[2];
+          cur_alt = p[3];
+        }
+      else if (LIBUSB_DT_ENDPOINT == p[1] && p[0] >= LIBUSB_DT_ENDPOINT_SIZE
+               && p[2] == ep->address && cur_iface >= 0
+               && cur_iface < SOLARIS_MAX_INTERFACES
+               && cur_alt == hpriv->altsetting[cur_iface])
+        {
+          iface = cur_iface;
+          alt = cur_alt;
+          break;
+        }
+    }
+  pthread_mutex_unlock (&hpriv->lock);
+
+  if (iface < 0)
+    return (LIBUSB_ERROR_NOT_FOUND);
+
+  /* the configuration ugen started out in has no prefix */
+  if (cfgvalue != dpriv->raw_cfgs[5])
+    snprintf (cfg_prefix, sizeof (cfg_prefix), "cfg%d", cfgvalue);
+  if (alt)
+    snprintf (alt_suffix, sizeof (alt_suffix), ".%d", alt);
+
+  snprintf (path, sizeof (path), "%s/%sif%d%s%s%d", dpriv->ugen_path,
+            cfg_prefix, iface, alt_suffix,
+            (ep->address & LIBUSB_ENDPOINT_IN) ? "in" : "out",
+            ep->address & LIBUSB_ENDPOINT_ADDRESS_MASK);
+  ep->fd = open (path, (ep->address & LIBUSB_ENDPOINT_IN) ?
+                 O_RDONLY : O_WRONLY);
+  if (ep->fd < 0)
+    {
+      err = errno;
+      usbi_dbg ("open(\"%s\") failed: %s", path, strerror (err));
+      return solaris_errno_to_libusb (err);
+    }
+
+  strncat (path, "stat", sizeof (path) - strlen (path) - 1);
+  ep->stat_fd = open (path, O_RDONLY);
+  if (ep->stat_fd < 0)
+    usbi_dbg ("open(\"%s\") failed: %s", path, strerror (errno));
+
+  ep->generation = generation;
+  usbi_dbg ("opened endpoint %02x, fd %d", ep->address, ep->fd);
+
+  return (LIBUSB_SUCCESS);
+}
+
+void
+solaris_close_endpoint (struct solaris_endpoint *ep)
+{
+  if (ep->fd >= 0)
+    close (ep->fd);
+  if (ep->stat_fd >= 0)
+    close (ep->stat_fd);
+  ep->fd = -1;
+  ep->stat_fd = -1;
+}
+
+/*
+ * Run a bulk or interrupt transfer on the endpoint's data node.
+ */
+int
+solaris_do_io (struct solaris_endpoint *ep, struct libusb_transfer *transfer)
+{
+  unsigned int generation;
+  ssize_t ret;
+  int r;
+
+  pthread_mutex_lock (&ep->hpriv->lock);
+  generation = ep->hpriv->generation;
+  pthread_mutex_unlock (&ep->hpriv->lock);
+
+  if (ep->fd >= 0 && ep->generation != generation)
+    solaris_close_endpoint (ep);
+  if (ep->fd < 0)
+    {
+      r = solaris_open_endpoint (ep, generation);
+      if (r < 0)
+        return (r);
+    }
+
+  if (transfer->endpoint & LIBUSB_ENDPOINT_IN)
+    ret = read (ep->fd, transfer->buffer, transfer->length);
+  else
+    ret = write (ep->fd, transfer->buffer, transfer->length);
+  if (ret < 0)
+    return solaris_stat_to_libusb (ep->stat_fd, errno);
+
+  return (int) ret;
+}
+
+void *
+solaris_endpoint_worker (void *arg)
+{
+  struct solaris_endpoint *ep = arg;
+  struct solaris_handle_priv *hpriv = ep->hpriv;
+  struct solaris_transfer_priv *tpriv;
+  struct usbi_transfer *itransfer;
+  struct libusb_transfer *transfer;
+  int r;
+
+  pthread_mutex_lock (&hpriv->lock);
+  for (;;)
+    {
+      if (list_empty (&ep->queue))
+        {
+          if (hpriv->closing)
+            break;
+          pthread_cond_wait (&ep->cond, &hpriv->lock);
+          continue;
+        }
+
+      tpriv = list_first_entry (&ep->queue, struct solaris_transfer_priv,
+                                list);
+      list_del (&tpriv->list);
+      tpriv->queued = 0;
+      pthread_mutex_unlock (&hpriv->lock);
+
+      itransfer = tpriv->itransfer;
+      transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER (itransfer);
+
+      if (LIBUSB_TRANSFER_TYPE_CONTROL == transfer->type)
+        r = solaris_do_control (hpriv, transfer->buffer, transfer->length);
+      else
+        r = solaris_do_io (ep, transfer);
+      if (r >= 0)
+        {
+          itransfer->transferred = r;
+          tpriv->err = 0;
+        }
+      else
+        tpriv->err = r;
+
+      /* hand the completed transfer over to the event handler */
+      if (write (hpriv->pipe[1], &itransfer, sizeof (itransfer)) < 0)
+        usbi_err (HANDLE_CTX (hpriv->handle),
+                  "could not signal transfer completion: %d", errno);
+
+      pthread_mutex_lock (&hpriv->lock);
+    }
+  pthread_mutex_unlock (&hpriv->lock);
+
+  solaris_close_endpoint (ep);
+
+  return (NULL);
+}
+
+/*
+ * Let the workers run what is left in their queues, then wait for them.
+ */
+void
+solaris_stop_workers (struct solaris_handle_priv *hpriv)
+{
+  int i;
+
+  pthread_mutex_lock (&hpriv->lock);
+  hpriv->closing = 1;
+  for (i = 0; i < SOLARIS_MAX_ENDPOINTS; i++)
+    pthread_cond_signal (&hpriv->endpoints[i].cond);
+  pthread_mutex_unlock (&hpriv->lock);
+
+  for (i = 0; i < SOLARIS_MAX_ENDPOINTS; i++)
+    {
+      if (hpriv->endpoints[i].started)
+        pthread_join (hpriv->endpoints[i].thread, NULL);
+      hpriv->endpoints[i].started = 0;
+      pthread_cond_destroy (&hpriv->endpoints[i].cond);
+    }
+  pthread_mutex_destroy (&hpriv->lock);
+}
+
+enum libusb_transfer_status
+solaris_err_to_transfer_status (int err)
+{
+  switch (err)
+    {
+    case 0:
+      return (LIBUSB_TRANSFER_COMPLETED);
+    case LIBUSB_ERROR_TIMEOUT:
+      return (LIBUSB_TRANSFER_TIMED_OUT);
+    case LIBUSB_ERROR_PIPE:
+      return (LIBUSB_TRANSFER_STALL);
+    case LIBUSB_ERROR_NO_DEVICE:
+      return (LIBUSB_TRANSFER_NO_DEVICE);
+    case LIBUSB_ERROR_OVERFLOW:
+      return (LIBUSB_TRANSFER_OVERFLOW);
+    }
+
+  return (LIBUSB_TRANSFER_ERROR);
 }
 
 int
@@ -33,7 +33,13 @@
 # include <windows.h>
 #endif
 
-#include "threads_posix.h"
+#include <errno.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libusbi.h"
 
 int usbi_mutex_init_recursive(pthread_mutex_t *mutex, pthread_mutexattr_t *attr)
 {
@@ -80,3 +86,314 @@ int usbi_get_tid(void)
 /* TODO: NetBSD thread ID support */
 	return ret;
 }
+
+/* The internal threads of libusb, so that libusb_set_thread_options() can
+ * reach the ones already running. threads_lock protects the table and the
+ * options. On Haiku, the table also holds the native threads of the backend,
+ * which are not pthreads. */
+struct usbi_thread_entry {
+	pthread_t thread;
+	const char *role;
+#if defined(__HAIKU__)
+	/* the thread of spawn_thread(), or -1 for a pthread */
+	thread_id haiku_thread;
+#endif
+};
+
+struct usbi_thread_start {
+	void *(*start)(void *);
+	void *arg;
+	const char *role;
+};
+
+static usbi_mutex_static_t threads_lock = USBI_MUTEX_INITIALIZER;
+static struct usbi_thread_entry *threads = NULL;
+static int num_threads = 0;
+static int threads_size = 0;
+
+static int thread_options_set = 0;
+static int *thread_cpus = NULL;
+static int thread_num_cpus = 0;
+static int thread_policy = LIBUSB_THREAD_SCHED_DEFAULT;
+static int thread_priority = 0;
+static char thread_prefix[8] = "libusb";
+
+/* apply the options to a thread. self is set when called from the thread
+ * itself, as some systems can only name the calling thread. returns a
+ * LIBUSB_ERROR code if the thread could not be given the options. must be
+ * called with threads_lock held */
+static int apply_thread_options(pthread_t thread, const char *role, int self)
+{
+	char name[16];
+	int r = 0, err;
+
+	snprintf(name, sizeof(name), "%s-%s", thread_prefix, role);
+#if defined(HAVE_PTHREAD_SETNAME_NP)
+#if defined(__APPLE__)
+	if (self)
+		pthread_setname_np(name);
+#elif defined(__NetBSD__)
+	pthread_setname_np(thread, "%s", (void *)name);
+#else
+	pthread_setname_np(thread, name);
+#endif
+#else
+	UNUSED(self);
+#endif
+
+	if (!thread_options_set)
+		return 0;
+
+#if defined(HAVE_PTHREAD_SETAFFINITY_NP) && defined(CPU_SET)
+	if (thread_num_cpus) {
+		cpu_set_t cpus;
+		int i;
+
+		CPU_ZERO(&cpus);
+		for (i = 0; i < thread_num_cpus; i++)
+			CPU_SET(thread_cpus[i], &cpus);
+		err = pthread_setaffinity_np(thread, sizeof(cpus), &cpus);
+		if (err) {
+			usbi_warn(NULL, "cannot set the cpus of thread %s: %s",
+				name, strerror(err));
+			r = err == EPERM ? LIBUSB_ERROR_ACCESS :
+				LIBUSB_ERROR_INVALID_PARAM;
+		}
+	}
+#endif
+
+	{
+		struct sched_param param;
+		int policy;
+
+		memset(&param, 0, sizeof(param));
+		switch (thread_policy) {
+		case LIBUSB_THREAD_SCHED_FIFO:
+			policy = SCHED_FIFO;
+			param.sched_priority = thread_priority;
+			break;
+		case LIBUSB_THREAD_SCHED_RR:
+			policy = SCHED_RR;
+			param.sched_priority = thread_priority;
+			break;
+		default:
+			policy = SCHED_OTHER;
+			break;
+		}
+		err = pthread_setschedparam(thread, policy, &param);
+		if (err) {
+			usbi_warn(NULL, "cannot set the scheduling of thread %s: %s",
+				name, strerror(err));
+			if (!r)
+				r = err == EPERM ? LIBUSB_ERROR_ACCESS :
+					LIBUSB_ERROR_INVALID_PARAM;
+		}
+	}
+
+	return r;
+}
+
+#if defined(__HAIKU__)
+/* Haiku has no call to set the CPUs of a thread, and maps the policies to
+ * its priorities, the real time policies to the real time ones. must be
+ * called with threads_lock held */
+static int apply_haiku_thread_options(thread_id thread, const char *role)
+{
+	char name[B_OS_NAME_LENGTH];
+	int32 priority;
+
+	snprintf(name, sizeof(name), "%s-%s", thread_prefix, role);
+	rename_thread(thread, name);
+
+	if (!thread_options_set)
+		return 0;
+
+	switch (thread_policy) {
+	case LIBUSB_THREAD_SCHED_FIFO:
+		priority = B_REAL_TIME_PRIORITY;
+		break;
+	case LIBUSB_THREAD_SCHED_RR:
+		priority = B_URGENT_PRIORITY;
+		break;
+	default:
+		priority = B_NORMAL_PRIORITY;
+		break;
+	}
+	if (set_thread_priority(thread, priority) < B_OK) {
+		usbi_warn(NULL, "cannot set the priority of thread %s", name);
+		return LIBUSB_ERROR_ACCESS;
+	}
+	return 0;
+}
+#endif
+
+/* make room for one more thread. must be called with threads_lock held */
+static int reserve_thread_entry(void)
+{
+	struct usbi_thread_entry *tmp;
+	int size;
+
+	if (num_threads < threads_size)
+		return 0;
+
+	size = threads_size ? threads_size * 2 : 8;
+	tmp = realloc(threads, size * sizeof(*threads));
+	if (!tmp)
+		return ENOMEM;
+	threads = tmp;
+	threads_size = size;
+	return 0;
+}
+
+static void *thread_start(void *arg)
+{
+	struct usbi_thread_start start = *(struct usbi_thread_start *)arg;
+
+	free(arg);
+
+	/* the creator registers the thread before it lets go of the lock */
+	usbi_mutex_static_lock(&threads_lock);
+	apply_thread_options(pthread_self(), start.role, 1);
+	usbi_mutex_static_unlock(&threads_lock);
+
+	return start.start(start.arg);
+}
+
+/* Start an internal thread, as pthread_create() would. role names it, and
+ * should be a string constant of at most 7 characters. The options of
+ * libusb_set_thread_options() are applied to it. It must be ended with
+ * usbi_thread_join(). */
+int usbi_thread_create(pthread_t *thread, const char *role,
+	void *(*start)(void *), void *arg)
+{
+	struct usbi_thread_start *thread_arg;
+	int err;
+
+	thread_arg = malloc(sizeof(*thread_arg));
+	if (!thread_arg)
+		return ENOMEM;
+	thread_arg->start = start;
+	thread_arg->arg = arg;
+	thread_arg->role = role;
+
+	usbi_mutex_static_lock(&threads_lock);
+	err = reserve_thread_entry();
+	if (err) {
+		usbi_mutex_static_unlock(&threads_lock);
+		free(thread_arg);
+		return err;
+	}
+
+	err = pthread_create(thread, NULL, thread_start, thread_arg);
+	if (err == 0) {
+		threads[num_threads].thread = *thread;
+		threads[num_threads].role = role;
+#if defined(__HAIKU__)
+		threads[num_threads].haiku_thread = -1;
+#endif
+		num_threads++;
+	} else {
+		free(thread_arg);
+	}
+	usbi_mutex_static_unlock(&threads_lock);
+
+	return err;
+}
+
+/* Wait for an internal thread to end, as pthread_join() would */
+int usbi_thread_join(pthread_t thread, void **retval)
+{
+	int i;
+
+	usbi_mutex_static_lock(&threads_lock);
+	for (i = 0; i < num_threads; i++) {
+#if defined(__HAIKU__)
+		if (threads[i].haiku_thread >= 0)
+			continue;
+#endif
+		if (pthread_equal(threads[i].thread, thread)) {
+			threads[i] = threads[--num_threads];
+			break;
+		}
+	}
+	usbi_mutex_static_unlock(&threads_lock);
+
+	return pthread_join(thread, retval);
+}
+
+#if defined(__HAIKU__)
+/* Register a thread of spawn_thread(), before it is resumed, so that it is
+ * named after role and given the options of libusb_set_thread_options().
+ * Returns LIBUSB_ERROR_NO_MEM if it cannot be registered. */
+int usbi_haiku_thread_add(thread_id thread, const char *role)
+{
+	usbi_mutex_static_lock(&threads_lock);
+	if (reserve_thread_entry()) {
+		usbi_mutex_static_unlock(&threads_lock);
+		return LIBUSB_ERROR_NO_MEM;
+	}
+	memset(&threads[num_threads].thread, 0, sizeof(pthread_t));
+	threads[num_threads].role = role;
+	threads[num_threads].haiku_thread = thread;
+	num_threads++;
+	apply_haiku_thread_options(thread, role);
+	usbi_mutex_static_unlock(&threads_lock);
+	return 0;
+}
+
+/* Unregister a thread of spawn_thread(), before waiting for it to end */
+void usbi_haiku_thread_remove(thread_id thread)
+{
+	int i;
+
+	usbi_mutex_static_lock(&threads_lock);
+	for (i = 0; i < num_threads; i++) {
+		if (threads[i].haiku_thread == thread) {
+			threads[i] = threads[--num_threads];
+			break;
+		}
+	}
+	usbi_mutex_static_unlock(&threads_lock);
+}
+#endif
+
+int usbi_set_thread_options(const struct libusb_thread_options *options)
+{
+	int *cpus = NULL;
+	int i, r = 0, err;
+
+	if (options->num_cpus) {
+		cpus = malloc(options->num_cpus * sizeof(*cpus));
+		if (!cpus)
+			return LIBUSB_ERROR_NO_MEM;
+		memcpy(cpus, options->cpus, options->num_cpus * sizeof(*cpus));
+	}
+
+	usbi_mutex_static_lock(&threads_lock);
+	free(thread_cpus);
+	thread_cpus = cpus;
+	thread_num_cpus = options->num_cpus;
+	thread_policy = options->sched_policy;
+	thread_priority = options->sched_priority;
+	snprintf(thread_prefix, sizeof(thread_prefix), "%s",
+		options->name_prefix ? options->name_prefix : "libusb");
+	thread_options_set = 1;
+
+	for (i = 0; i < num_threads; i++) {
+#if defined(__HAIKU__)
+		if (threads[i].haiku_thread >= 0) {
+			err = apply_haiku_thread_options(threads[i].haiku_thread,
+				threads[i].role);
+			if (err && !r)
+				r = err;
+			continue;
+		}
+#endif
+		err = apply_thread_options(threads[i].thread, threads[i].role, 0);
+		if (err && !r)
+			r = err;
+	}
+	usbi_mutex_static_unlock(&threads_lock);
+
+	return r;
+}
@@ -47,4 +47,15 @@ extern int usbi_mutex_init_recursive(pthread_mutex_t *mutex, pthread_mutexattr_t
 
 int usbi_get_tid(void);
 
+int usbi_thread_create(pthread_t *thread, const char *role,
+	void *(*start)(void *), void *arg);
+int usbi_thread_join(pthread_t thread, void **retval);
+
+#if defined(__HAIKU__)
+#include <OS.h>
+
+int usbi_haiku_thread_add(thread_id thread, const char *role);
+void usbi_haiku_thread_remove(thread_id thread);
+#endif
+
 #endif /* LIBUSB_THREADS_POSIX_H */
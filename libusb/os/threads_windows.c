@@ -212,3 +212,108 @@ int usbi_cond_timedwait(usbi_cond_t *cond,
 int usbi_get_tid(void) {
 	return GetCurrentThreadId();
 }
+
+/* The internal threads of libusb, so that libusb_set_thread_options() can
+ * reach the ones already running. threads_lock protects the table and the
+ * options. Thread names need a newer Windows than is supported, so they are
+ * not set, and Windows CE threads keep their CPUs. */
+#define USBI_MAX_THREADS	8
+
+static usbi_mutex_static_t threads_lock = USBI_MUTEX_INITIALIZER;
+static HANDLE threads[USBI_MAX_THREADS];
+static int num_threads = 0;
+
+static int thread_options_set = 0;
+static DWORD_PTR thread_mask = 0;
+static int thread_priority = THREAD_PRIORITY_NORMAL;
+
+/* must be called with threads_lock held */
+static int apply_thread_options(HANDLE thread)
+{
+	int r = 0;
+
+	if (!thread_options_set)
+		return 0;
+
+#if !defined(OS_WINCE)
+	if (thread_mask && !SetThreadAffinityMask(thread, thread_mask)) {
+		usbi_warn(NULL, "cannot set the cpus of thread %p", thread);
+		r = LIBUSB_ERROR_INVALID_PARAM;
+	}
+#endif
+	if (!SetThreadPriority(thread, thread_priority)) {
+		usbi_warn(NULL, "cannot set the priority of thread %p", thread);
+		if (!r)
+			r = LIBUSB_ERROR_ACCESS;
+	}
+	return r;
+}
+
+/* register an internal thread, and apply the options of
+ * libusb_set_thread_options() to it. returns LIBUSB_ERROR_NO_MEM if the
+ * table is full, as the thread could not be given later options */
+int usbi_thread_add(HANDLE thread)
+{
+	usbi_mutex_static_lock(&threads_lock);
+	if (num_threads == USBI_MAX_THREADS) {
+		usbi_mutex_static_unlock(&threads_lock);
+		usbi_err(NULL, "too many internal threads to register thread %p",
+			thread);
+		return LIBUSB_ERROR_NO_MEM;
+	}
+	threads[num_threads++] = thread;
+	apply_thread_options(thread);
+	usbi_mutex_static_unlock(&threads_lock);
+	return 0;
+}
+
+/* unregister an internal thread, before its handle is closed */
+void usbi_thread_remove(HANDLE thread)
+{
+	int i;
+
+	usbi_mutex_static_lock(&threads_lock);
+	for (i = 0; i < num_threads; i++) {
+		if (threads[i] == thread) {
+			threads[i] = threads[--num_threads];
+			break;
+		}
+	}
+	usbi_mutex_static_unlock(&threads_lock);
+}
+
+int usbi_set_thread_options(const struct libusb_thread_options *options)
+{
+	DWORD_PTR mask = 0;
+	int i, r = 0, err;
+
+	for (i = 0; i < options->num_cpus; i++) {
+		if (options->cpus[i] >= (int)(8 * sizeof(mask)))
+			return LIBUSB_ERROR_INVALID_PARAM;
+		mask |= (DWORD_PTR)1 << options->cpus[i];
+	}
+
+	usbi_mutex_static_lock(&threads_lock);
+	thread_mask = mask;
+	switch (options->sched_policy) {
+	case LIBUSB_THREAD_SCHED_FIFO:
+		thread_priority = THREAD_PRIORITY_TIME_CRITICAL;
+		break;
+	case LIBUSB_THREAD_SCHED_RR:
+		thread_priority = THREAD_PRIORITY_HIGHEST;
+		break;
+	default:
+		thread_priority = THREAD_PRIORITY_NORMAL;
+		break;
+	}
+	thread_options_set = 1;
+
+	for (i = 0; i < num_threads; i++) {
+		err = apply_thread_options(threads[i]);
+		if (err && !r)
+			r = err;
+	}
+	usbi_mutex_static_unlock(&threads_lock);
+
+	return r;
+}
@@ -84,4 +84,7 @@ int usbi_cond_signal(usbi_cond_t *cond);
 
 int usbi_get_tid(void);
 
+int usbi_thread_add(HANDLE thread);
+void usbi_thread_remove(HANDLE thread);
+
 #endif /* LIBUSB_THREADS_WINDOWS_H */
@@ -235,6 +235,10 @@ static int wince_init(struct libusb_context *ctx)
 			usbi_err(ctx, "Unable to create timer thread - aborting");
 			goto init_exit;
 		}
+		if (usbi_thread_add(timer_thread) < 0) {
+			usbi_err(ctx, "could not register timer thread - aborting");
+			goto init_exit;
+		}
 
 		// Wait for timer thread to init before continuing.
 		if (WaitForSingleObject(timer_response, INFINITE) != WAIT_OBJECT_0) {
@@ -258,6 +262,7 @@ init_exit: // Holds semaphore here.
 				TerminateThread(timer_thread, 1); // shouldn't happen, but we're destroying
 												  // all objects it might have held anyway.
 			}
+			usbi_thread_remove(timer_thread);
 			CloseHandle(timer_thread);
 			timer_thread = NULL;
 		}
@@ -285,7 +290,7 @@ init_exit: // Holds semaphore here.
 	return r;
 }
 
-static void wince_exit(void)
+static void wince_exit(struct libusb_context *ctx)
 {
 	int i;
 	HANDLE semaphore;
@@ -314,6 +319,7 @@ static void wince_exit(void)
 				usbi_dbg("could not wait for timer thread to quit");
 				TerminateThread(timer_thread, 1);
 			}
+			usbi_thread_remove(timer_thread);
 			CloseHandle(timer_thread);
 			timer_thread = NULL;
 		}
@@ -818,6 +824,7 @@ static int wince_handle_events(
 	struct wince_transfer_priv* transfer_priv = NULL;
 	POLL_NFDS_TYPE i = 0;
 	BOOL found = FALSE;
+	struct libusb_device_handle *dev_handle;
 	struct usbi_transfer *transfer;
 	DWORD io_size, io_result;
 
@@ -834,15 +841,20 @@ static int wince_handle_events(
 
 		// Because a Windows OVERLAPPED is used for poll emulation,
 		// a pollable fd is created and stored with each transfer
-		usbi_mutex_lock(&ctx->flying_transfers_lock);
-		list_for_each_entry(transfer, &ctx->flying_transfers, list, struct usbi_transfer) {
-			transfer_priv = usbi_transfer_get_os_priv(transfer);
-			if (transfer_priv->pollable_fd.fd == fds[i].fd) {
-				found = TRUE;
-				break;
+		found = FALSE;
+		list_for_each_entry(dev_handle, &ctx->open_devs, list, struct libusb_device_handle) {
+			usbi_mutex_lock(&dev_handle->flying_transfers_lock);
+			list_for_each_entry(transfer, &dev_handle->flying_transfers, list, struct usbi_transfer) {
+				transfer_priv = usbi_transfer_get_os_priv(transfer);
+				if (transfer_priv->pollable_fd.fd == fds[i].fd) {
+					found = TRUE;
+					break;
+				}
 			}
+			usbi_mutex_unlock(&dev_handle->flying_transfers_lock);
+			if (found)
+				break;
 		}
-		usbi_mutex_unlock(&ctx->flying_transfers_lock);
 
 		if (found && HasOverlappedIoCompleted(transfer_priv->pollable_fd.overlapped)) {
 			io_result = (DWORD)transfer_priv->pollable_fd.overlapped->Internal;
@@ -994,12 +1006,14 @@ const struct usbi_os_backend wince_backend = {
         wince_get_device_list,
 	NULL,				/* hotplug_poll */
         wince_open,
+	NULL,				/* wrap_sys_device */
         wince_close,
 
         wince_get_device_descriptor,
         wince_get_active_config_descriptor,
         wince_get_config_descriptor,
 	NULL,				/* get_config_descriptor_by_value() */
+	NULL,				/* get_device_string() */
 
         wince_get_configuration,
         wince_set_configuration,
@@ -1013,6 +1027,11 @@ const struct usbi_os_backend wince_backend = {
 	NULL,				/* alloc_streams */
 	NULL,				/* free_streams */
 
+	NULL,				/* dev_mem_alloc */
+	NULL,				/* dev_mem_free */
+	NULL,				/* set_endpoint_policy */
+	NULL,				/* get_endpoint_policy */
+
         wince_kernel_driver_active,
         wince_detach_kernel_driver,
         wince_attach_kernel_driver,
@@ -1022,8 +1041,13 @@ const struct usbi_os_backend wince_backend = {
         wince_submit_transfer,
         wince_cancel_transfer,
         wince_clear_transfer_priv,
+        NULL,				/* free_transfer_priv */
+        NULL,				/* sync_control_transfer */
+        NULL,				/* sync_bulk_transfer */
 
         wince_handle_events,
+        NULL,				/* get_pollfd */
+        NULL,				/* busy_poll */
 
         wince_clock_gettime,
         sizeof(struct wince_device_priv),
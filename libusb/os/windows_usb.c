@@ -66,6 +66,8 @@ static int winusbx_abort_transfers(int sub_api, struct usbi_transfer *itransfer)
 static int winusbx_abort_control(int sub_api, struct usbi_transfer *itransfer);
 static int winusbx_reset_device(int sub_api, struct libusb_device_handle *dev_handle);
 static int winusbx_copy_transfer_data(int sub_api, struct usbi_transfer *itransfer, uint32_t io_size);
+static int winusbx_set_endpoint_policy(int sub_api, struct libusb_device_handle *dev_handle, unsigned char endpoint, enum libusb_endpoint_policy policy, unsigned int value);
+static int winusbx_get_endpoint_policy(int sub_api, struct libusb_device_handle *dev_handle, unsigned char endpoint, enum libusb_endpoint_policy policy, unsigned int *value);
 // HID API prototypes
 static int hid_init(int sub_api, struct libusb_context *ctx);
 static int hid_exit(int sub_api);
@@ -96,6 +98,8 @@ static int composite_abort_transfers(int sub_api, struct usbi_transfer *itransfe
 static int composite_abort_control(int sub_api, struct usbi_transfer *itransfer);
 static int composite_reset_device(int sub_api, struct libusb_device_handle *dev_handle);
 static int composite_copy_transfer_data(int sub_api, struct usbi_transfer *itransfer, uint32_t io_size);
+static int composite_set_endpoint_policy(int sub_api, struct libusb_device_handle *dev_handle, unsigned char endpoint, enum libusb_endpoint_policy policy, unsigned int value);
+static int composite_get_endpoint_policy(int sub_api, struct libusb_device_handle *dev_handle, unsigned char endpoint, enum libusb_endpoint_policy policy, unsigned int *value);
 
 
 // Global variables
@@ -631,35 +635,121 @@ static unsigned long htab_hash(char* str)
 }
 
 /*
- * Returns the session ID of a device's nth level ancestor
- * If there's no device at the nth level, return 0
+ * Index of the devices met during a single enumeration, keyed either by session
+ * ID or by devinst. This avoids walking the context's device list (and hashing
+ * the device ID path of every ancestor) for each lookup, which made enumeration
+ * quadratic in the number of devices.
+ * The index holds a reference on each of its devices, released by
+ * enum_index_destroy().
  */
-static unsigned long get_ancestor_session_id(DWORD devinst, unsigned level)
+struct enum_index_entry {
+	unsigned long key;
+	struct libusb_device *dev;
+};
+
+struct enum_index {
+	struct enum_index_entry *entry;
+	unsigned long size;	// always a power of two
+	unsigned long filled;
+};
+
+static unsigned long enum_index_slot(struct enum_index *index, unsigned long key)
+{
+	unsigned long idx = (key * 2654435761UL) & (index->size - 1);
+
+	while ((index->entry[idx].dev != NULL) && (index->entry[idx].key != key)) {
+		idx = (idx + 1) & (index->size - 1);
+	}
+	return idx;
+}
+
+static int enum_index_resize(struct enum_index *index, unsigned long size)
+{
+	struct enum_index_entry *old_entry = index->entry;
+	unsigned long i, idx, old_size = index->size;
+
+	index->entry = (struct enum_index_entry*) calloc(size, sizeof(struct enum_index_entry));
+	if (index->entry == NULL) {
+		index->entry = old_entry;
+		return LIBUSB_ERROR_NO_MEM;
+	}
+	index->size = size;
+	for (i=0; i<old_size; i++) {
+		if (old_entry[i].dev != NULL) {
+			idx = enum_index_slot(index, old_entry[i].key);
+			index->entry[idx] = old_entry[i];
+		}
+	}
+	safe_free(old_entry);
+	return LIBUSB_SUCCESS;
+}
+
+static int enum_index_init(struct enum_index *index)
+{
+	index->entry = NULL;
+	index->size = 0;
+	index->filled = 0;
+	return enum_index_resize(index, 64);
+}
+
+static void enum_index_destroy(struct enum_index *index)
+{
+	unsigned long i;
+
+	for (i=0; i<index->size; i++) {
+		safe_unref_device(index->entry[i].dev);
+	}
+	safe_free(index->entry);
+	index->size = index->filled = 0;
+}
+
+static int enum_index_add(struct enum_index *index, unsigned long key, struct libusb_device *dev)
+{
+	unsigned long idx;
+
+	// Keep the table at most half full, so that probe sequences stay short
+	if (2 * (index->filled + 1) > index->size) {
+		if (enum_index_resize(index, 2 * index->size) != LIBUSB_SUCCESS) {
+			return LIBUSB_ERROR_NO_MEM;
+		}
+	}
+	idx = enum_index_slot(index, key);
+	if (index->entry[idx].dev == NULL) {
+		index->filled++;
+	} else {
+		libusb_unref_device(index->entry[idx].dev);
+	}
+	index->entry[idx].key = key;
+	index->entry[idx].dev = libusb_ref_device(dev);
+	return LIBUSB_SUCCESS;
+}
+
+// Returns a new reference to the device, or NULL if not found
+static struct libusb_device *enum_index_find(struct enum_index *index, unsigned long key)
+{
+	struct libusb_device *dev = index->entry[enum_index_slot(index, key)].dev;
+
+	return (dev == NULL) ? NULL : libusb_ref_device(dev);
+}
+
+/*
+ * Returns the device of a devinst's nth level ancestor, with a new reference,
+ * or NULL if there's no (known) device at the nth level
+ */
+static struct libusb_device *get_ancestor_device(struct enum_index *devinst_index,
+	DWORD devinst, unsigned level)
 {
 	DWORD parent_devinst;
-	unsigned long session_id = 0;
-	char* sanitized_path = NULL;
-	char path[MAX_PATH_LENGTH];
 	unsigned i;
 
-	if (level < 1) return 0;
+	if (level < 1) return NULL;
 	for (i = 0; i<level; i++) {
 		if (CM_Get_Parent(&parent_devinst, devinst, 0) != CR_SUCCESS) {
-			return 0;
+			return NULL;
 		}
 		devinst = parent_devinst;
 	}
-	if (CM_Get_Device_IDA(devinst, path, MAX_PATH_LENGTH, 0) != CR_SUCCESS) {
-		return 0;
-	}
-	// TODO: (post hotplug): try without sanitizing
-	sanitized_path = sanitize_path(path);
-	if (sanitized_path == NULL) {
-		return 0;
-	}
-	session_id = htab_hash(sanitized_path);
-	safe_free(sanitized_path);
-	return session_id;
+	return enum_index_find(devinst_index, (unsigned long)devinst);
 }
 
 /*
@@ -1001,6 +1091,10 @@ static int windows_init(struct libusb_context *ctx)
 			goto init_exit;
 		}
 		SetThreadAffinityMask(timer_thread, 0);
+		if (usbi_thread_add(timer_thread) < 0) {
+			usbi_err(ctx, "could not register timer thread - aborting");
+			goto init_exit;
+		}
 
 		// Wait for timer thread to init before continuing.
 		if (WaitForSingleObject(timer_response, INFINITE) != WAIT_OBJECT_0) {
@@ -1023,6 +1117,7 @@ init_exit: // Holds semaphore here.
 				TerminateThread(timer_thread, 1); // shouldn't happen, but we're destroying
 												  // all objects it might have held anyway.
 			}
+			usbi_thread_remove(timer_thread);
 			CloseHandle(timer_thread);
 			timer_thread = NULL;
 		}
@@ -1191,7 +1286,8 @@ static int cache_config_descriptors(struct libusb_device *dev, HANDLE hub_handle
  * Populate a libusb device structure
  */
 static int init_device(struct libusb_device* dev, struct libusb_device* parent_dev,
-					   uint8_t port_number, char* device_id, DWORD devinst)
+					   uint8_t port_number, char* device_id, DWORD devinst,
+					   struct enum_index *devinst_index)
 {
 	HANDLE handle;
 	DWORD size;
@@ -1217,7 +1313,7 @@ static int init_device(struct libusb_device* dev, struct libusb_device* parent_d
 	// If that's the case, lookup the ancestors to set the bus number
 	if (parent_dev->bus_number == 0) {
 		for (i=2; ; i++) {
-			tmp_dev = usbi_get_device_by_session_id(ctx, get_ancestor_session_id(devinst, i));
+			tmp_dev = get_ancestor_device(devinst_index, devinst, i);
 			if (tmp_dev == NULL) break;
 			if (tmp_dev->bus_number != 0) {
 				usbi_dbg("got bus number from ancestor #%d", i);
@@ -1490,7 +1586,7 @@ static int windows_get_device_list(struct libusb_context *ctx, struct discovered
 	char* dev_interface_path = NULL;
 	char* dev_id_path = NULL;
 	unsigned long session_id;
-	DWORD size, reg_type, port_nr, install_state;
+	DWORD size, reg_type, port_nr, install_state, parent_devinst;
 	HKEY key;
 	WCHAR guid_string_w[MAX_GUID_STRING_LENGTH];
 	GUID* if_guid;
@@ -1499,6 +1595,9 @@ static int windows_get_device_list(struct libusb_context *ctx, struct discovered
 	libusb_device** unref_list;
 	unsigned int unref_size = 64;
 	unsigned int unref_cur = 0;
+	// Devices already known to the context, by session ID, and devices met
+	// during this enumeration, by devinst
+	struct enum_index session_index, devinst_index;
 
 	// PASS 1 : (re)enumerate HCDs (allows for HCD hotplug)
 	// PASS 2 : (re)enumerate HUBS
@@ -1521,6 +1620,23 @@ static int windows_get_device_list(struct libusb_context *ctx, struct discovered
 	if (unref_list == NULL) {
 		return LIBUSB_ERROR_NO_MEM;
 	}
+	if (enum_index_init(&session_index) != LIBUSB_SUCCESS) {
+		free(unref_list);
+		return LIBUSB_ERROR_NO_MEM;
+	}
+	if (enum_index_init(&devinst_index) != LIBUSB_SUCCESS) {
+		enum_index_destroy(&session_index);
+		free(unref_list);
+		return LIBUSB_ERROR_NO_MEM;
+	}
+	usbi_mutex_lock(&ctx->usb_devs_lock);
+	list_for_each_entry(dev, &ctx->usb_devs, list, struct libusb_device) {
+		if (enum_index_add(&session_index, dev->session_data, dev) != LIBUSB_SUCCESS) {
+			r = LIBUSB_ERROR_NO_MEM;
+			break;
+		}
+	}
+	usbi_mutex_unlock(&ctx->usb_devs_lock);
 
 	for (pass = 0; ((pass < nb_guids) && (r == LIBUSB_SUCCESS)); pass++) {
 //#define ENUM_DEBUG
@@ -1663,11 +1779,10 @@ static int windows_get_device_list(struct libusb_context *ctx, struct discovered
 				// Go through the ancestors until we see a face we recognize
 				parent_dev = NULL;
 				for (ancestor = 1; parent_dev == NULL; ancestor++) {
-					session_id = get_ancestor_session_id(dev_info_data.DevInst, ancestor);
-					if (session_id == 0) {
+					if (CM_Get_Parent(&parent_devinst, (ancestor == 1) ? dev_info_data.DevInst : parent_devinst, 0) != CR_SUCCESS) {
 						break;
 					}
-					parent_dev = usbi_get_device_by_session_id(ctx, session_id);
+					parent_dev = enum_index_find(&devinst_index, (unsigned long)parent_devinst);
 				}
 				if (parent_dev == NULL) {
 					usbi_dbg("unlisted ancestor for '%s' (non USB HID, newly connected, etc.) - ignoring", dev_id_path);
@@ -1686,7 +1801,7 @@ static int windows_get_device_list(struct libusb_context *ctx, struct discovered
 			if (pass <= DEV_PASS) {	// For subsequent passes, we'll lookup the parent
 				// These are the passes that create "new" devices
 				session_id = htab_hash(dev_id_path);
-				dev = usbi_get_device_by_session_id(ctx, session_id);
+				dev = enum_index_find(&session_index, session_id);
 				if (dev == NULL) {
 					if (pass == DEV_PASS) {
 						// This can occur if the OS only reports a newly plugged device after we started enum
@@ -1699,10 +1814,18 @@ static int windows_get_device_list(struct libusb_context *ctx, struct discovered
 						LOOP_BREAK(LIBUSB_ERROR_NO_MEM);
 					}
 					windows_device_priv_init(dev);
+					if (enum_index_add(&session_index, session_id, dev) != LIBUSB_SUCCESS) {
+						libusb_unref_device(dev);
+						LOOP_BREAK(LIBUSB_ERROR_NO_MEM);
+					}
 				} else {
 					usbi_dbg("found existing device for session [%X] (%d.%d)",
 						session_id, dev->bus_number, dev->device_address);
 				}
+				if (enum_index_add(&devinst_index, (unsigned long)dev_info_data.DevInst, dev) != LIBUSB_SUCCESS) {
+					libusb_unref_device(dev);
+					LOOP_BREAK(LIBUSB_ERROR_NO_MEM);
+				}
 				// Keep track of devices that need unref
 				unref_list[unref_cur++] = dev;
 				if (unref_cur >= unref_size) {
@@ -1764,7 +1887,7 @@ static int windows_get_device_list(struct libusb_context *ctx, struct discovered
 				}
 				break;
 			case GEN_PASS:
-				r = init_device(dev, parent_dev, (uint8_t)port_nr, dev_id_path, dev_info_data.DevInst);
+				r = init_device(dev, parent_dev, (uint8_t)port_nr, dev_id_path, dev_info_data.DevInst, &devinst_index);
 				if (r == LIBUSB_SUCCESS) {
 					// Append device to the list of discovered devices
 					discdevs = discovered_devs_append(*_discdevs, dev);
@@ -1809,6 +1932,9 @@ static int windows_get_device_list(struct libusb_context *ctx, struct discovered
 		safe_free(guid[pass]);
 	}
 
+	enum_index_destroy(&devinst_index);
+	enum_index_destroy(&session_index);
+
 	// Unref newly allocated devs
 	if (unref_list != NULL) {
 		for (i=0; i<unref_cur; i++) {
@@ -1823,7 +1949,7 @@ static int windows_get_device_list(struct libusb_context *ctx, struct discovered
 /*
  * exit: libusb backend deinitialization function
  */
-static void windows_exit(void)
+static void windows_exit(struct libusb_context *ctx)
 {
 	int i;
 	HANDLE semaphore;
@@ -1855,6 +1981,7 @@ static void windows_exit(void)
 				usbi_dbg("could not wait for timer thread to quit");
 				TerminateThread(timer_thread, 1);
 			}
+			usbi_thread_remove(timer_thread);
 			CloseHandle(timer_thread);
 			timer_thread = NULL;
 		}
@@ -2038,6 +2165,20 @@ static int windows_reset_device(struct libusb_device_handle *dev_handle)
 	return priv->apib->reset_device(SUB_API_NOTSET, dev_handle);
 }
 
+static int windows_set_endpoint_policy(struct libusb_device_handle *dev_handle,
+	unsigned char endpoint, enum libusb_endpoint_policy policy, unsigned int value)
+{
+	struct windows_device_priv *priv = _device_priv(dev_handle->dev);
+	return priv->apib->set_endpoint_policy(SUB_API_NOTSET, dev_handle, endpoint, policy, value);
+}
+
+static int windows_get_endpoint_policy(struct libusb_device_handle *dev_handle,
+	unsigned char endpoint, enum libusb_endpoint_policy policy, unsigned int *value)
+{
+	struct windows_device_priv *priv = _device_priv(dev_handle->dev);
+	return priv->apib->get_endpoint_policy(SUB_API_NOTSET, dev_handle, endpoint, policy, value);
+}
+
 // The 3 functions below are unlikely to ever get supported on Windows
 static int windows_kernel_driver_active(struct libusb_device_handle *dev_handle, int iface)
 {
@@ -2064,11 +2205,18 @@ static void windows_clear_transfer_priv(struct usbi_transfer *itransfer)
 	struct windows_transfer_priv *transfer_priv = (struct windows_transfer_priv*)usbi_transfer_get_os_priv(itransfer);
 
 	usbi_free_fd(&transfer_priv->pollable_fd);
-	safe_free(transfer_priv->hid_buffer);
 	// When auto claim is in use, attempt to release the auto-claimed interface
 	auto_release(itransfer);
 }
 
+static void windows_free_transfer_priv(struct usbi_transfer *itransfer)
+{
+	struct windows_transfer_priv *transfer_priv = (struct windows_transfer_priv*)usbi_transfer_get_os_priv(itransfer);
+
+	safe_free(transfer_priv->hid_buffer);
+	transfer_priv->hid_buffer_size = 0;
+}
+
 static int submit_bulk_transfer(struct usbi_transfer *itransfer)
 {
 	struct libusb_transfer *transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
@@ -2252,8 +2400,8 @@ static int windows_handle_events(struct libusb_context *ctx, struct pollfd *fds,
 {
 	struct windows_transfer_priv* transfer_priv = NULL;
 	POLL_NFDS_TYPE i = 0;
-	bool found;
 	struct usbi_transfer *transfer;
+	struct winfd wfd;
 	DWORD io_size, io_result;
 
 	usbi_mutex_lock(&ctx->open_devs_lock);
@@ -2268,19 +2416,15 @@ static int windows_handle_events(struct libusb_context *ctx, struct pollfd *fds,
 		num_ready--;
 
 		// Because a Windows OVERLAPPED is used for poll emulation,
-		// a pollable fd is created and stored with each transfer
-		usbi_mutex_lock(&ctx->flying_transfers_lock);
-		found = false;
-		list_for_each_entry(transfer, &ctx->flying_transfers, list, struct usbi_transfer) {
+		// a pollable fd is created and stored with each transfer, and
+		// the fd keeps track of the transfer it was created for
+		wfd = fd_to_winfd(fds[i].fd);
+		transfer = wfd.itransfer;
+		if (transfer != NULL) {
 			transfer_priv = usbi_transfer_get_os_priv(transfer);
-			if (transfer_priv->pollable_fd.fd == fds[i].fd) {
-				found = true;
-				break;
-			}
 		}
-		usbi_mutex_unlock(&ctx->flying_transfers_lock);
 
-		if (found) {
+		if ((transfer != NULL) && (transfer_priv->pollable_fd.fd == fds[i].fd)) {
 			// Handle async requests that completed synchronously first
 			if (HasOverlappedIoCompletedSync(transfer_priv->pollable_fd.overlapped)) {
 				io_result = NO_ERROR;
@@ -2435,12 +2579,14 @@ const struct usbi_os_backend windows_backend = {
 	windows_get_device_list,
 	NULL,				/* hotplug_poll */
 	windows_open,
+	NULL,				/* wrap_sys_device */
 	windows_close,
 
 	windows_get_device_descriptor,
 	windows_get_active_config_descriptor,
 	windows_get_config_descriptor,
 	NULL,				/* get_config_descriptor_by_value() */
+	NULL,				/* get_device_string() */
 
 	windows_get_configuration,
 	windows_set_configuration,
@@ -2454,6 +2600,12 @@ const struct usbi_os_backend windows_backend = {
 	NULL,				/* alloc_streams */
 	NULL,				/* free_streams */
 
+	NULL,				/* dev_mem_alloc */
+	NULL,				/* dev_mem_free */
+
+	windows_set_endpoint_policy,
+	windows_get_endpoint_policy,
+
 	windows_kernel_driver_active,
 	windows_detach_kernel_driver,
 	windows_attach_kernel_driver,
@@ -2463,8 +2615,13 @@ const struct usbi_os_backend windows_backend = {
 	windows_submit_transfer,
 	windows_cancel_transfer,
 	windows_clear_transfer_priv,
+	windows_free_transfer_priv,
+	NULL,				/* sync_control_transfer */
+	NULL,				/* sync_bulk_transfer */
 
 	windows_handle_events,
+	NULL,				/* get_pollfd */
+	NULL,				/* busy_poll */
 
 	windows_clock_gettime,
 #if defined(USBI_TIMERFD_AVAILABLE)
@@ -2528,6 +2685,12 @@ static int unsupported_abort_transfers(int sub_api, struct usbi_transfer *itrans
 static int unsupported_copy_transfer_data(int sub_api, struct usbi_transfer *itransfer, uint32_t io_size) {
 	PRINT_UNSUPPORTED_API(copy_transfer_data);
 }
+static int unsupported_set_endpoint_policy(int sub_api, struct libusb_device_handle *dev_handle, unsigned char endpoint, enum libusb_endpoint_policy policy, unsigned int value) {
+	PRINT_UNSUPPORTED_API(set_endpoint_policy);
+}
+static int unsupported_get_endpoint_policy(int sub_api, struct libusb_device_handle *dev_handle, unsigned char endpoint, enum libusb_endpoint_policy policy, unsigned int *value) {
+	PRINT_UNSUPPORTED_API(get_endpoint_policy);
+}
 static int common_configure_endpoints(int sub_api, struct libusb_device_handle *dev_handle, int iface) {
 	return LIBUSB_SUCCESS;
 }
@@ -2558,6 +2721,8 @@ const struct windows_usb_api_backend usb_api_backend[USB_API_MAX] = {
 		unsupported_abort_control,
 		unsupported_abort_transfers,
 		unsupported_copy_transfer_data,
+		unsupported_set_endpoint_policy,
+		unsupported_get_endpoint_policy,
 	}, {
 		USB_API_HUB,
 		"HUB API",
@@ -2579,6 +2744,8 @@ const struct windows_usb_api_backend usb_api_backend[USB_API_MAX] = {
 		unsupported_abort_control,
 		unsupported_abort_transfers,
 		unsupported_copy_transfer_data,
+		unsupported_set_endpoint_policy,
+		unsupported_get_endpoint_policy,
 	}, {
 		USB_API_COMPOSITE,
 		"Composite API",
@@ -2600,6 +2767,8 @@ const struct windows_usb_api_backend usb_api_backend[USB_API_MAX] = {
 		composite_abort_control,
 		composite_abort_transfers,
 		composite_copy_transfer_data,
+		composite_set_endpoint_policy,
+		composite_get_endpoint_policy,
 	}, {
 		USB_API_WINUSBX,
 		"WinUSB-like APIs",
@@ -2621,6 +2790,8 @@ const struct windows_usb_api_backend usb_api_backend[USB_API_MAX] = {
 		winusbx_abort_control,
 		winusbx_abort_transfers,
 		winusbx_copy_transfer_data,
+		winusbx_set_endpoint_policy,
+		winusbx_get_endpoint_policy,
 	}, {
 		USB_API_HID,
 		"HID API",
@@ -2642,6 +2813,8 @@ const struct windows_usb_api_backend usb_api_backend[USB_API_MAX] = {
 		hid_abort_transfers,
 		hid_abort_transfers,
 		hid_copy_transfer_data,
+		unsupported_set_endpoint_policy,
+		unsupported_get_endpoint_policy,
 	},
 };
 
@@ -3043,7 +3216,7 @@ static int winusbx_submit_control_transfer(int sub_api, struct usbi_transfer *it
 	usbi_dbg("will use interface %d", current_interface);
 	winusb_handle = handle_priv->interface_handle[current_interface].api_handle;
 
-	wfd = usbi_create_fd(winusb_handle, RW_READ, NULL, NULL);
+	wfd = usbi_create_fd(winusb_handle, RW_READ, itransfer, NULL);
 	// Always use the handle returned from usbi_create_fd (wfd.handle)
 	if (wfd.fd < 0) {
 		return LIBUSB_ERROR_NO_MEM;
@@ -3132,7 +3305,7 @@ static int winusbx_submit_bulk_transfer(int sub_api, struct usbi_transfer *itran
 
 	winusb_handle = handle_priv->interface_handle[current_interface].api_handle;
 
-	wfd = usbi_create_fd(winusb_handle, IS_XFERIN(transfer) ? RW_READ : RW_WRITE, NULL, NULL);
+	wfd = usbi_create_fd(winusb_handle, IS_XFERIN(transfer) ? RW_READ : RW_WRITE, itransfer, NULL);
 	// Always use the handle returned from usbi_create_fd (wfd.handle)
 	if (wfd.fd < 0) {
 		return LIBUSB_ERROR_NO_MEM;
@@ -3189,6 +3362,132 @@ static int winusbx_clear_halt(int sub_api, struct libusb_device_handle *dev_hand
 	return LIBUSB_SUCCESS;
 }
 
+/*
+ * Translate a libusb endpoint policy to the WinUSB pipe policy type and the
+ * size of its value. The boolean policies are UCHARs, the others ULONGs.
+ */
+static int winusbx_pipe_policy(enum libusb_endpoint_policy policy, ULONG *type, ULONG *size)
+{
+	switch (policy) {
+	case LIBUSB_ENDPOINT_POLICY_RAW_IO:
+		*type = RAW_IO;
+		*size = sizeof(UCHAR);
+		return LIBUSB_SUCCESS;
+	case LIBUSB_ENDPOINT_POLICY_AUTO_FLUSH:
+		*type = AUTO_FLUSH;
+		*size = sizeof(UCHAR);
+		return LIBUSB_SUCCESS;
+	case LIBUSB_ENDPOINT_POLICY_MAX_TRANSFER_SIZE:
+		*type = MAXIMUM_TRANSFER_SIZE;
+		*size = sizeof(ULONG);
+		return LIBUSB_SUCCESS;
+	default:
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+	}
+}
+
+static int winusbx_set_endpoint_policy(int sub_api, struct libusb_device_handle *dev_handle,
+	unsigned char endpoint, enum libusb_endpoint_policy policy, unsigned int value)
+{
+	struct libusb_context *ctx = DEVICE_CTX(dev_handle->dev);
+	struct windows_device_handle_priv *handle_priv = _device_handle_priv(dev_handle);
+	struct windows_device_priv *priv = _device_priv(dev_handle->dev);
+	HANDLE winusb_handle;
+	int current_interface, r;
+	DWORD err;
+	ULONG type, size, ulong_value = (ULONG)value;
+	UCHAR uchar_value = (value != 0);
+
+	CHECK_WINUSBX_AVAILABLE(sub_api);
+
+	// The libusb0 driver only understands PIPE_TRANSFER_TIMEOUT
+	if (sub_api == SUB_API_LIBUSB0) {
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+	}
+
+	r = winusbx_pipe_policy(policy, &type, &size);
+	if (r != LIBUSB_SUCCESS) {
+		return r;
+	}
+
+	current_interface = interface_by_endpoint(priv, handle_priv, endpoint);
+	if (current_interface < 0) {
+		usbi_err(ctx, "unable to match endpoint to an open interface - cannot set policy");
+		return LIBUSB_ERROR_NOT_FOUND;
+	}
+
+	usbi_dbg("matched endpoint %02X with interface %d", endpoint, current_interface);
+	winusb_handle = handle_priv->interface_handle[current_interface].api_handle;
+
+	if (!WinUSBX[sub_api].SetPipePolicy(winusb_handle, endpoint, type, size,
+		(size == sizeof(UCHAR)) ? (PVOID)&uchar_value : (PVOID)&ulong_value)) {
+		err = GetLastError();
+		usbi_err(ctx, "SetPipePolicy failed: %s", windows_error_str(err));
+		switch (err) {
+		case ERROR_INVALID_PARAMETER:
+		case ERROR_NOT_SUPPORTED:
+			return LIBUSB_ERROR_NOT_SUPPORTED;
+		case ERROR_DEVICE_NOT_CONNECTED:
+			return LIBUSB_ERROR_NO_DEVICE;
+		default:
+			return LIBUSB_ERROR_IO;
+		}
+	}
+
+	return LIBUSB_SUCCESS;
+}
+
+static int winusbx_get_endpoint_policy(int sub_api, struct libusb_device_handle *dev_handle,
+	unsigned char endpoint, enum libusb_endpoint_policy policy, unsigned int *value)
+{
+	struct libusb_context *ctx = DEVICE_CTX(dev_handle->dev);
+	struct windows_device_handle_priv *handle_priv = _device_handle_priv(dev_handle);
+	struct windows_device_priv *priv = _device_priv(dev_handle->dev);
+	HANDLE winusb_handle;
+	int current_interface, r;
+	DWORD err;
+	ULONG type, size, ulong_value = 0;
+	UCHAR uchar_value = 0;
+
+	CHECK_WINUSBX_AVAILABLE(sub_api);
+
+	if (sub_api == SUB_API_LIBUSB0) {
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+	}
+
+	r = winusbx_pipe_policy(policy, &type, &size);
+	if (r != LIBUSB_SUCCESS) {
+		return r;
+	}
+
+	current_interface = interface_by_endpoint(priv, handle_priv, endpoint);
+	if (current_interface < 0) {
+		usbi_err(ctx, "unable to match endpoint to an open interface - cannot get policy");
+		return LIBUSB_ERROR_NOT_FOUND;
+	}
+
+	usbi_dbg("matched endpoint %02X with interface %d", endpoint, current_interface);
+	winusb_handle = handle_priv->interface_handle[current_interface].api_handle;
+
+	if (!WinUSBX[sub_api].GetPipePolicy(winusb_handle, endpoint, type, &size,
+		(size == sizeof(UCHAR)) ? (PVOID)&uchar_value : (PVOID)&ulong_value)) {
+		err = GetLastError();
+		usbi_err(ctx, "GetPipePolicy failed: %s", windows_error_str(err));
+		switch (err) {
+		case ERROR_INVALID_PARAMETER:
+		case ERROR_NOT_SUPPORTED:
+			return LIBUSB_ERROR_NOT_SUPPORTED;
+		case ERROR_DEVICE_NOT_CONNECTED:
+			return LIBUSB_ERROR_NO_DEVICE;
+		default:
+			return LIBUSB_ERROR_IO;
+		}
+	}
+
+	*value = (size == sizeof(UCHAR)) ? (unsigned int)uchar_value : (unsigned int)ulong_value;
+	return LIBUSB_SUCCESS;
+}
+
 /*
  * from http://www.winvistatips.com/winusb-bugchecks-t335323.html (confirmed
  * through testing as well):
@@ -3635,6 +3934,7 @@ static int _hid_get_report(struct hid_device_priv* dev, HANDLE hid_handle, int i
 		}
 		// Asynchronous wait
 		tp->hid_buffer = buf;
+		tp->hid_buffer_size = expected_size+1;
 		tp->hid_dest = (uint8_t*)data; // copy dest, as not necessarily the start of the transfer buffer
 		return LIBUSB_SUCCESS;
 	}
@@ -3725,6 +4025,7 @@ static int _hid_set_report(struct hid_device_priv* dev, HANDLE hid_handle, int i
 			return LIBUSB_ERROR_IO;
 		}
 		tp->hid_buffer = buf;
+		tp->hid_buffer_size = write_size;
 		tp->hid_dest = NULL;
 		return LIBUSB_SUCCESS;
 	}
@@ -4047,6 +4348,7 @@ static int hid_submit_control_transfer(int sub_api, struct usbi_transfer *itrans
 
 	transfer_priv->pollable_fd = INVALID_WINFD;
 	safe_free(transfer_priv->hid_buffer);
+	transfer_priv->hid_buffer_size = 0;
 	transfer_priv->hid_dest = NULL;
 	size = transfer->length - LIBUSB_CONTROL_SETUP_SIZE;
 
@@ -4064,7 +4366,7 @@ static int hid_submit_control_transfer(int sub_api, struct usbi_transfer *itrans
 	usbi_dbg("will use interface %d", current_interface);
 	hid_handle = handle_priv->interface_handle[current_interface].api_handle;
 	// Always use the handle returned from usbi_create_fd (wfd.handle)
-	wfd = usbi_create_fd(hid_handle, RW_READ, NULL, NULL);
+	wfd = usbi_create_fd(hid_handle, RW_READ, itransfer, NULL);
 	if (wfd.fd < 0) {
 		return LIBUSB_ERROR_NOT_FOUND;
 	}
@@ -4140,6 +4442,20 @@ static int hid_submit_control_transfer(int sub_api, struct usbi_transfer *itrans
 	return r;
 }
 
+// Make sure the staging buffer, which is kept across submissions, holds at least size bytes
+static int hid_reserve_buffer(struct windows_transfer_priv *transfer_priv, size_t size) {
+	if (transfer_priv->hid_buffer_size < size) {
+		safe_free(transfer_priv->hid_buffer);
+		transfer_priv->hid_buffer_size = 0;
+		transfer_priv->hid_buffer = (uint8_t*)malloc(size);
+		if (transfer_priv->hid_buffer == NULL) {
+			return LIBUSB_ERROR_NO_MEM;
+		}
+		transfer_priv->hid_buffer_size = size;
+	}
+	return LIBUSB_SUCCESS;
+}
+
 static int hid_submit_bulk_transfer(int sub_api, struct usbi_transfer *itransfer) {
 	struct libusb_transfer *transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
 	struct windows_transfer_priv *transfer_priv = (struct windows_transfer_priv*)usbi_transfer_get_os_priv(itransfer);
@@ -4157,7 +4473,6 @@ static int hid_submit_bulk_transfer(int sub_api, struct usbi_transfer *itransfer
 
 	transfer_priv->pollable_fd = INVALID_WINFD;
 	transfer_priv->hid_dest = NULL;
-	safe_free(transfer_priv->hid_buffer);
 
 	current_interface = interface_by_endpoint(priv, handle_priv, transfer->endpoint);
 	if (current_interface < 0) {
@@ -4170,53 +4485,74 @@ static int hid_submit_bulk_transfer(int sub_api, struct usbi_transfer *itransfer
 	hid_handle = handle_priv->interface_handle[current_interface].api_handle;
 	direction_in = transfer->endpoint & LIBUSB_ENDPOINT_IN;
 
-	wfd = usbi_create_fd(hid_handle, direction_in?RW_READ:RW_WRITE, NULL, NULL);
+	wfd = usbi_create_fd(hid_handle, direction_in?RW_READ:RW_WRITE, itransfer, NULL);
 	// Always use the handle returned from usbi_create_fd (wfd.handle)
 	if (wfd.fd < 0) {
 		return LIBUSB_ERROR_NO_MEM;
 	}
 
-	// If report IDs are not in use, an extra prefix byte must be added
-	if ( ((direction_in) && (!priv->hid->uses_report_ids[0]))
-	  || ((!direction_in) && (!priv->hid->uses_report_ids[1])) ) {
-		length = transfer->length+1;
-	} else {
+	if (transfer->flags & LIBUSB_TRANSFER_HID_REPORT_ID) {
+		// The report ID byte is already reserved: use the transfer buffer as is
 		length = transfer->length;
-	}
-	// Add a trailing byte to detect overflows on input
-	transfer_priv->hid_buffer = (uint8_t*)calloc(length+1, 1);
-	if (transfer_priv->hid_buffer == NULL) {
-		return LIBUSB_ERROR_NO_MEM;
-	}
-	transfer_priv->hid_expected_size = length;
-
-	if (direction_in) {
-		transfer_priv->hid_dest = transfer->buffer;
-		usbi_dbg("reading %d bytes (report ID: 0x00)", length);
-		ret = ReadFile(wfd.handle, transfer_priv->hid_buffer, length+1, &size, wfd.overlapped);
+		transfer_priv->hid_expected_size = length;
+		if ((direction_in) && (length < priv->hid->input_report_size)) {
+			// The report would not fit: read it through the staging buffer, with a
+			// trailing byte, so that copy_transfer_data() can detect the overflow
+			if (hid_reserve_buffer(transfer_priv, priv->hid->input_report_size+1) != LIBUSB_SUCCESS) {
+				usbi_free_fd(&wfd);
+				return LIBUSB_ERROR_NO_MEM;
+			}
+			transfer_priv->hid_dest = transfer->buffer;
+			usbi_dbg("reading %d bytes (report size: %d)", length, priv->hid->input_report_size);
+			ret = ReadFile(wfd.handle, transfer_priv->hid_buffer, priv->hid->input_report_size+1, &size, wfd.overlapped);
+		} else if (direction_in) {
+			usbi_dbg("reading %d bytes directly", length);
+			ret = ReadFile(wfd.handle, transfer->buffer, length, &size, wfd.overlapped);
+		} else {
+			usbi_dbg("writing %d bytes directly (report ID: 0x%02X)", length, transfer->buffer[0]);
+			ret = WriteFile(wfd.handle, transfer->buffer, length, &size, wfd.overlapped);
+		}
 	} else {
-		if (!priv->hid->uses_report_ids[1]) {
-			memcpy(transfer_priv->hid_buffer+1, transfer->buffer, transfer->length);
+		// If report IDs are not in use, an extra prefix byte must be added
+		if ( ((direction_in) && (!priv->hid->uses_report_ids[0]))
+		  || ((!direction_in) && (!priv->hid->uses_report_ids[1])) ) {
+			length = transfer->length+1;
+		} else {
+			length = transfer->length;
+		}
+		// Add a trailing byte to detect overflows on input. The staging buffer
+		// is kept for the next submission of this transfer.
+		if (hid_reserve_buffer(transfer_priv, length+1) != LIBUSB_SUCCESS) {
+			usbi_free_fd(&wfd);
+			return LIBUSB_ERROR_NO_MEM;
+		}
+		transfer_priv->hid_expected_size = length;
+
+		if (direction_in) {
+			transfer_priv->hid_dest = transfer->buffer;
+			usbi_dbg("reading %d bytes (report ID: 0x00)", length);
+			ret = ReadFile(wfd.handle, transfer_priv->hid_buffer, length+1, &size, wfd.overlapped);
 		} else {
-			// We could actually do without the calloc and memcpy in this case
-			memcpy(transfer_priv->hid_buffer, transfer->buffer, transfer->length);
+			if (!priv->hid->uses_report_ids[1]) {
+				transfer_priv->hid_buffer[0] = 0;
+				memcpy(transfer_priv->hid_buffer+1, transfer->buffer, transfer->length);
+			} else {
+				// Callers can avoid this copy with LIBUSB_TRANSFER_HID_REPORT_ID
+				memcpy(transfer_priv->hid_buffer, transfer->buffer, transfer->length);
+			}
+			usbi_dbg("writing %d bytes (report ID: 0x%02X)", length, transfer_priv->hid_buffer[0]);
+			ret = WriteFile(wfd.handle, transfer_priv->hid_buffer, length, &size, wfd.overlapped);
 		}
-		usbi_dbg("writing %d bytes (report ID: 0x%02X)", length, transfer_priv->hid_buffer[0]);
-		ret = WriteFile(wfd.handle, transfer_priv->hid_buffer, length, &size, wfd.overlapped);
 	}
 	if (!ret) {
 		if (GetLastError() != ERROR_IO_PENDING) {
 			usbi_err(ctx, "HID transfer failed: %s", windows_error_str(0));
 			usbi_free_fd(&wfd);
-			safe_free(transfer_priv->hid_buffer);
+			transfer_priv->hid_dest = NULL;
 			return LIBUSB_ERROR_IO;
 		}
 	} else {
-		// Only write operations that completed synchronously need to free up
-		// hid_buffer. For reads, copy_transfer_data() handles that process.
-		if (!direction_in) {
-			safe_free(transfer_priv->hid_buffer);
-		}
+		// For staged reads, copy_transfer_data() copies the data out
 		if (size == 0) {
 			usbi_err(ctx, "program assertion failed - no data was transferred");
 			size = 1;
@@ -4308,8 +4644,10 @@ static int hid_copy_transfer_data(int sub_api, struct usbi_transfer *itransfer,
 	int r = LIBUSB_TRANSFER_COMPLETED;
 	uint32_t corrected_size = io_size;
 
+	// hid_dest is only set for reads through hid_buffer. Writes and reads made
+	// directly in the transfer buffer (LIBUSB_TRANSFER_HID_REPORT_ID) have
+	// nothing to copy. With that flag, the report ID byte is part of the data.
 	if (transfer_priv->hid_buffer != NULL) {
-		// If we have a valid hid_buffer, it means the transfer was async
 		if (transfer_priv->hid_dest != NULL) {	// Data readout
 			if (corrected_size > 0) {
 				// First, check for overflow
@@ -4319,7 +4657,8 @@ static int hid_copy_transfer_data(int sub_api, struct usbi_transfer *itransfer,
 					r = LIBUSB_TRANSFER_OVERFLOW;
 				}
 
-				if (transfer_priv->hid_buffer[0] == 0) {
+				if ((transfer_priv->hid_buffer[0] == 0)
+				  && !(transfer->flags & LIBUSB_TRANSFER_HID_REPORT_ID)) {
 					// Discard the 1 byte report ID prefix
 					corrected_size--;
 					memcpy(transfer_priv->hid_dest, transfer_priv->hid_buffer+1, corrected_size);
@@ -4329,8 +4668,6 @@ static int hid_copy_transfer_data(int sub_api, struct usbi_transfer *itransfer,
 			}
 			transfer_priv->hid_dest = NULL;
 		}
-		// For write, we just need to free the hid buffer
-		safe_free(transfer_priv->hid_buffer);
 	}
 	itransfer->transferred += corrected_size;
 	return r;
@@ -4505,6 +4842,42 @@ static int composite_clear_halt(int sub_api, struct libusb_device_handle *dev_ha
 	return priv->usb_interface[current_interface].apib->
 		clear_halt(priv->usb_interface[current_interface].sub_api, dev_handle, endpoint);}
 
+static int composite_set_endpoint_policy(int sub_api, struct libusb_device_handle *dev_handle,
+	unsigned char endpoint, enum libusb_endpoint_policy policy, unsigned int value)
+{
+	struct libusb_context *ctx = DEVICE_CTX(dev_handle->dev);
+	struct windows_device_handle_priv *handle_priv = _device_handle_priv(dev_handle);
+	struct windows_device_priv *priv = _device_priv(dev_handle->dev);
+	int current_interface;
+
+	current_interface = interface_by_endpoint(priv, handle_priv, endpoint);
+	if (current_interface < 0) {
+		usbi_err(ctx, "unable to match endpoint to an open interface - cannot set policy");
+		return LIBUSB_ERROR_NOT_FOUND;
+	}
+
+	return priv->usb_interface[current_interface].apib->
+		set_endpoint_policy(priv->usb_interface[current_interface].sub_api, dev_handle, endpoint, policy, value);
+}
+
+static int composite_get_endpoint_policy(int sub_api, struct libusb_device_handle *dev_handle,
+	unsigned char endpoint, enum libusb_endpoint_policy policy, unsigned int *value)
+{
+	struct libusb_context *ctx = DEVICE_CTX(dev_handle->dev);
+	struct windows_device_handle_priv *handle_priv = _device_handle_priv(dev_handle);
+	struct windows_device_priv *priv = _device_priv(dev_handle->dev);
+	int current_interface;
+
+	current_interface = interface_by_endpoint(priv, handle_priv, endpoint);
+	if (current_interface < 0) {
+		usbi_err(ctx, "unable to match endpoint to an open interface - cannot get policy");
+		return LIBUSB_ERROR_NOT_FOUND;
+	}
+
+	return priv->usb_interface[current_interface].apib->
+		get_endpoint_policy(priv->usb_interface[current_interface].sub_api, dev_handle, endpoint, policy, value);
+}
+
 static int composite_abort_control(int sub_api, struct usbi_transfer *itransfer)
 {
 	struct libusb_transfer *transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
@@ -131,6 +131,8 @@ struct windows_usb_api_backend {
 	int (*abort_control)(int sub_api, struct usbi_transfer *itransfer);
 	int (*abort_transfers)(int sub_api, struct usbi_transfer *itransfer);
 	int (*copy_transfer_data)(int sub_api, struct usbi_transfer *itransfer, uint32_t io_size);
+	int (*set_endpoint_policy)(int sub_api, struct libusb_device_handle *dev_handle, unsigned char endpoint, enum libusb_endpoint_policy policy, unsigned int value);
+	int (*get_endpoint_policy)(int sub_api, struct libusb_device_handle *dev_handle, unsigned char endpoint, enum libusb_endpoint_policy policy, unsigned int *value);
 };
 
 extern const struct windows_usb_api_backend usb_api_backend[USB_API_MAX];
@@ -297,6 +299,7 @@ struct windows_transfer_priv {
 	struct winfd pollable_fd;
 	uint8_t interface_number;
 	uint8_t *hid_buffer; // 1 byte extended data buffer, required for HID
+	size_t hid_buffer_size; // allocated size, kept across resubmissions
 	uint8_t *hid_dest;   // transfer buffer destination, required for HID
 	size_t hid_expected_size;
 };
@@ -32,8 +32,118 @@
  * This page documents libusb's synchronous (blocking) API for USB device I/O.
  * This interface is easy to use but has some limitations. More advanced users
  * may wish to consider using the \ref asyncio "asynchronous I/O API" instead.
+ *
+ * On some platforms, a synchronous transfer that is issued while there are
+ * no asynchronous transfers in flight on the same device handle is performed
+ * directly by the operating system, without a round trip through the event
+ * handling loop. This lowers the latency of each transfer and requires nothing
+ * from the application.
  */
 
+/* The number of idle synchronous transfers kept per device handle. This
+ * bounds the memory held by the cache, while still covering a few threads
+ * doing synchronous I/O on the same handle at once. */
+#define SYNC_CACHE_SIZE		4
+
+/* A transfer used by the synchronous API, together with the buffer it uses
+ * for control transfers. Both are kept around in the device handle's cache
+ * between calls, so that repeated synchronous I/O is done without going
+ * through the allocator. */
+struct usbi_sync_transfer {
+	struct usbi_sync_transfer *next;
+	struct libusb_transfer *transfer;
+	unsigned char *buffer;
+	int buffer_size;
+	int completed;
+};
+
+int usbi_sync_handle_init(struct libusb_device_handle *handle)
+{
+	int r;
+
+	r = usbi_mutex_init(&handle->sync_cache_lock, NULL);
+	if (r)
+		return LIBUSB_ERROR_OTHER;
+	handle->sync_cache = NULL;
+	handle->sync_cache_len = 0;
+	return 0;
+}
+
+static void free_sync_transfer(struct usbi_sync_transfer *stransfer)
+{
+	libusb_free_transfer(stransfer->transfer);
+	free(stransfer->buffer);
+	free(stransfer);
+}
+
+void usbi_sync_handle_exit(struct libusb_device_handle *handle)
+{
+	struct usbi_sync_transfer *stransfer;
+
+	while ((stransfer = handle->sync_cache) != NULL) {
+		handle->sync_cache = stransfer->next;
+		free_sync_transfer(stransfer);
+	}
+	usbi_mutex_destroy(&handle->sync_cache_lock);
+}
+
+/* take a transfer with a buffer of at least buffer_size bytes from the cache
+ * of the handle, or allocate a new one if the cache is empty */
+static struct usbi_sync_transfer *get_sync_transfer(
+	struct libusb_device_handle *handle, int buffer_size)
+{
+	struct usbi_sync_transfer *stransfer;
+
+	usbi_mutex_lock(&handle->sync_cache_lock);
+	stransfer = handle->sync_cache;
+	if (stransfer) {
+		handle->sync_cache = stransfer->next;
+		handle->sync_cache_len--;
+	}
+	usbi_mutex_unlock(&handle->sync_cache_lock);
+
+	if (!stransfer) {
+		stransfer = calloc(1, sizeof(*stransfer));
+		if (!stransfer)
+			return NULL;
+		stransfer->transfer = libusb_alloc_transfer(0);
+		if (!stransfer->transfer) {
+			free(stransfer);
+			return NULL;
+		}
+	}
+
+	if (stransfer->buffer_size < buffer_size) {
+		unsigned char *buffer = realloc(stransfer->buffer, buffer_size);
+		if (!buffer) {
+			free_sync_transfer(stransfer);
+			return NULL;
+		}
+		stransfer->buffer = buffer;
+		stransfer->buffer_size = buffer_size;
+	}
+
+	stransfer->completed = 0;
+	return stransfer;
+}
+
+/* return a transfer that has completed to the cache of the handle */
+static void put_sync_transfer(struct libusb_device_handle *handle,
+	struct usbi_sync_transfer *stransfer)
+{
+	usbi_mutex_lock(&handle->sync_cache_lock);
+	if (handle->sync_cache_len < SYNC_CACHE_SIZE) {
+		stransfer->next = handle->sync_cache;
+		handle->sync_cache = stransfer;
+		handle->sync_cache_len++;
+		stransfer = NULL;
+	}
+	usbi_mutex_unlock(&handle->sync_cache_lock);
+
+	if (stransfer)
+		free_sync_transfer(stransfer);
+}
+
 static void LIBUSB_CALL sync_transfer_cb(struct libusb_transfer *transfer)
 {
 	int *completed = transfer->user_data;
@@ -46,9 +156,14 @@ static void sync_transfer_wait_for_completion(struct libusb_transfer *transfer)
 {
 	int r, *completed = transfer->user_data;
 	struct libusb_context *ctx = HANDLE_CTX(transfer->dev_handle);
+	struct libusb_event_domain *domain = transfer->dev_handle->event_domain;
 
 	while (!*completed) {
-		r = libusb_handle_events_completed(ctx, completed);
+		if (domain)
+			r = libusb_handle_domain_events_timeout_completed(domain,
+				NULL, completed);
+		else
+			r = libusb_handle_events_completed(ctx, completed);
 		if (r < 0) {
 			if (r == LIBUSB_ERROR_INTERRUPTED)
 				continue;
@@ -60,6 +175,41 @@ static void sync_transfer_wait_for_completion(struct libusb_transfer *transfer)
 	}
 }
 
+/* translate the status of a completed transfer to 0 or a LIBUSB_ERROR code */
+static int sync_transfer_result(struct libusb_transfer *transfer)
+{
+	switch (transfer->status) {
+	case LIBUSB_TRANSFER_COMPLETED:
+		return 0;
+	case LIBUSB_TRANSFER_TIMED_OUT:
+		return LIBUSB_ERROR_TIMEOUT;
+	case LIBUSB_TRANSFER_STALL:
+		return LIBUSB_ERROR_PIPE;
+	case LIBUSB_TRANSFER_OVERFLOW:
+		return LIBUSB_ERROR_OVERFLOW;
+	case LIBUSB_TRANSFER_NO_DEVICE:
+		return LIBUSB_ERROR_NO_DEVICE;
+	case LIBUSB_TRANSFER_ERROR:
+	case LIBUSB_TRANSFER_CANCELLED:
+		return LIBUSB_ERROR_IO;
+	default:
+		usbi_warn(HANDLE_CTX(transfer->dev_handle),
+			"unrecognised status code %d", transfer->status);
+		return LIBUSB_ERROR_OTHER;
+	}
+}
+
+/* The backend may perform synchronous transfers by blocking in the kernel
+ * instead of going through the event loop, as long as that cannot hold up
+ * anything the event loop would do in the meantime. A transfer without a
+ * timeout could block for good, out of reach of libusb_close() and of the
+ * other events of the context, so it always goes through the event loop. */
+static int sync_fast_path_possible(struct libusb_device_handle *dev_handle,
+	unsigned int timeout)
+{
+	return timeout != 0 && usbi_io_handle_idle(dev_handle);
+}
+
 /** \ingroup syncio
  * Perform a USB control transfer.
  *
@@ -92,19 +242,25 @@ int API_EXPORTED libusb_control_transfer(libusb_device_handle *dev_handle,
 	uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex,
 	unsigned char *data, uint16_t wLength, unsigned int timeout)
 {
-	struct libusb_transfer *transfer = libusb_alloc_transfer(0);
+	struct usbi_sync_transfer *stransfer;
+	struct libusb_transfer *transfer;
 	unsigned char *buffer;
-	int completed = 0;
 	int r;
 
-	if (!transfer)
-		return LIBUSB_ERROR_NO_MEM;
+	if (usbi_backend->sync_control_transfer &&
+			sync_fast_path_possible(dev_handle, timeout)) {
+		r = usbi_backend->sync_control_transfer(dev_handle, bmRequestType,
+			bRequest, wValue, wIndex, data, wLength, timeout);
+		if (r != LIBUSB_ERROR_NOT_SUPPORTED)
+			return r;
+	}
 
-	buffer = (unsigned char*) malloc(LIBUSB_CONTROL_SETUP_SIZE + wLength);
-	if (!buffer) {
-		libusb_free_transfer(transfer);
+	stransfer = get_sync_transfer(dev_handle,
+		LIBUSB_CONTROL_SETUP_SIZE + wLength);
+	if (!stransfer)
 		return LIBUSB_ERROR_NO_MEM;
-	}
+	transfer = stransfer->transfer;
+	buffer = stransfer->buffer;
 
 	libusb_fill_control_setup(buffer, bmRequestType, bRequest, wValue, wIndex,
 		wLength);
@@ -112,11 +268,10 @@ int API_EXPORTED libusb_control_transfer(libusb_device_handle *dev_handle,
 		memcpy(buffer + LIBUSB_CONTROL_SETUP_SIZE, data, wLength);
 
 	libusb_fill_control_transfer(transfer, dev_handle, buffer,
-		sync_transfer_cb, &completed, timeout);
-	transfer->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+		sync_transfer_cb, &stransfer->completed, timeout);
 	r = libusb_submit_transfer(transfer);
 	if (r < 0) {
-		libusb_free_transfer(transfer);
+		put_sync_transfer(dev_handle, stransfer);
 		return r;
 	}
 
@@ -126,87 +281,293 @@ int API_EXPORTED libusb_control_transfer(libusb_device_handle *dev_handle,
 		memcpy(data, libusb_control_transfer_get_data(transfer),
 			transfer->actual_length);
 
-	switch (transfer->status) {
-	case LIBUSB_TRANSFER_COMPLETED:
+	r = sync_transfer_result(transfer);
+	if (r == 0)
 		r = transfer->actual_length;
-		break;
-	case LIBUSB_TRANSFER_TIMED_OUT:
-		r = LIBUSB_ERROR_TIMEOUT;
-		break;
-	case LIBUSB_TRANSFER_STALL:
-		r = LIBUSB_ERROR_PIPE;
-		break;
-	case LIBUSB_TRANSFER_NO_DEVICE:
-		r = LIBUSB_ERROR_NO_DEVICE;
-		break;
-	case LIBUSB_TRANSFER_OVERFLOW:
-		r = LIBUSB_ERROR_OVERFLOW;
-		break;
-	case LIBUSB_TRANSFER_ERROR:
-	case LIBUSB_TRANSFER_CANCELLED:
-		r = LIBUSB_ERROR_IO;
-		break;
-	default:
-		usbi_warn(HANDLE_CTX(dev_handle),
-			"unrecognised status code %d", transfer->status);
-		r = LIBUSB_ERROR_OTHER;
-	}
 
-	libusb_free_transfer(transfer);
+	put_sync_transfer(dev_handle, stransfer);
 	return r;
 }
 
+/* the state of a call to libusb_control_transfer_batch(). the completions
+ * update it from whichever thread handles the events */
+struct control_batch {
+	struct libusb_device_handle *dev_handle;
+	struct libusb_control_request *requests;
+	int num_requests;
+	unsigned int timeout;
+	int next;		/* the next request to submit */
+	int in_flight;
+	int failed;
+	int stopped;		/* submit nothing more */
+	int completed;		/* set by every completion */
+};
+
+/* a transfer of the batch, reused for request after request */
+struct control_batch_slot {
+	struct control_batch *batch;
+	struct usbi_sync_transfer *stransfer;
+	int index;		/* the request in flight */
+};
+
+static void LIBUSB_CALL control_batch_cb(struct libusb_transfer *transfer);
+
+/* submit the next request of the batch on a slot. a request that cannot be
+ * submitted gets its error and the one after it is tried. returns 1 if a
+ * request is in flight on the slot, 0 if none were left */
+static int control_batch_submit(struct control_batch_slot *slot)
+{
+	struct control_batch *batch = slot->batch;
+	struct usbi_sync_transfer *stransfer = slot->stransfer;
+	struct libusb_control_request *request;
+	int size, r;
+
+	while (!batch->stopped && batch->next < batch->num_requests) {
+		slot->index = batch->next++;
+		request = &batch->requests[slot->index];
+
+		size = LIBUSB_CONTROL_SETUP_SIZE + request->wLength;
+		if (stransfer->buffer_size < size) {
+			unsigned char *buffer = realloc(stransfer->buffer, size);
+
+			if (!buffer) {
+				request->result = LIBUSB_ERROR_NO_MEM;
+				batch->failed++;
+				continue;
+			}
+			stransfer->buffer = buffer;
+			stransfer->buffer_size = size;
+		}
+
+		libusb_fill_control_setup(stransfer->buffer, request->bmRequestType,
+			request->bRequest, request->wValue, request->wIndex,
+			request->wLength);
+		if ((request->bmRequestType & LIBUSB_ENDPOINT_DIR_MASK) ==
+				LIBUSB_ENDPOINT_OUT)
+			memcpy(stransfer->buffer + LIBUSB_CONTROL_SETUP_SIZE,
+				request->data, request->wLength);
+		libusb_fill_control_transfer(stransfer->transfer, batch->dev_handle,
+			stransfer->buffer, control_batch_cb, slot, batch->timeout);
+
+		r = libusb_submit_transfer(stransfer->transfer);
+		if (r == 0) {
+			batch->in_flight++;
+			return 1;
+		}
+		request->result = r;
+		batch->failed++;
+	}
+	return 0;
+}
+
+static void LIBUSB_CALL control_batch_cb(struct libusb_transfer *transfer)
+{
+	struct control_batch_slot *slot = transfer->user_data;
+	struct control_batch *batch = slot->batch;
+	struct libusb_control_request *request = &batch->requests[slot->index];
+	int r;
+
+	if ((request->bmRequestType & LIBUSB_ENDPOINT_DIR_MASK) ==
+			LIBUSB_ENDPOINT_IN)
+		memcpy(request->data, libusb_control_transfer_get_data(transfer),
+			transfer->actual_length);
+
+	r = sync_transfer_result(transfer);
+	if (r == 0)
+		r = transfer->actual_length;
+	else
+		batch->failed++;
+	request->result = r;
+
+	batch->in_flight--;
+	batch->completed = 1;
+
+	/* the next request goes out right away, so the queue of the operating
+	 * system does not run dry while the event loop comes around */
+	control_batch_submit(slot);
+}
+
+/** \ingroup syncio
+ * Perform a batch of control transfers on the default endpoint, keeping
+ * up to depth of them in flight at once.
+ *
+ * Compared to calling libusb_control_transfer() for each request, this saves
+ * a round trip through the application per request: the requests are
+ * submitted in order, and as each completes the next one is submitted from
+ * the event handler, so the queue of the operating system stays full where
+ * it queues control transfers (Linux usbfs queues them on the endpoint, and
+ * the device sees them back to back). Where the operating system runs
+ * control transfers one at a time, the requests are still queued ahead.
+ *
+ * The requests are independent: one that fails does not stop the others,
+ * and its result tells what went wrong. Requests complete in order on the
+ * default endpoint, but their results are only known once this function
+ * returns.
+ *
+ * This is a blocking function.
+ *
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
+ *
+ * \param dev_handle a handle for the device to communicate with
+ * \param requests the requests, whose result fields are filled in
+ * \param num_requests the number of requests
+ * \param depth the number of requests to keep in flight. With 1, the requests
+ * are made through libusb_control_transfer().
+ * \param timeout timeout (in millseconds) of each request. For an unlimited
+ * timeout, use value 0.
+ * \returns the number of requests that failed, 0 if all succeeded
+ * \returns LIBUSB_ERROR_INVALID_PARAM if num_requests or depth is out of
+ * range
+ * \returns LIBUSB_ERROR_NO_MEM on memory allocation failure, before any
+ * request was made
+ */
+int API_EXPORTED libusb_control_transfer_batch(libusb_device_handle *dev_handle,
+	struct libusb_control_request *requests, int num_requests, int depth,
+	unsigned int timeout)
+{
+	struct libusb_context *ctx = HANDLE_CTX(dev_handle);
+	struct libusb_event_domain *domain = dev_handle->event_domain;
+	struct control_batch_slot *slots;
+	struct control_batch batch;
+	int num_slots, i, r;
+
+	if (num_requests < 0 || depth <= 0)
+		return LIBUSB_ERROR_INVALID_PARAM;
+	if (depth > num_requests)
+		depth = num_requests;
+
+	memset(&batch, 0, sizeof(batch));
+	if (depth <= 1) {
+		for (i = 0; i < num_requests; i++) {
+			struct libusb_control_request *request = &requests[i];
+
+			request->result = libusb_control_transfer(dev_handle,
+				request->bmRequestType, request->bRequest,
+				request->wValue, request->wIndex, request->data,
+				request->wLength, timeout);
+			if (request->result < 0)
+				batch.failed++;
+		}
+		return batch.failed;
+	}
+
+	slots = calloc(depth, sizeof(*slots));
+	if (!slots)
+		return LIBUSB_ERROR_NO_MEM;
+
+	batch.dev_handle = dev_handle;
+	batch.requests = requests;
+	batch.num_requests = num_requests;
+	batch.timeout = timeout;
+
+	for (num_slots = 0; num_slots < depth; num_slots++) {
+		struct control_batch_slot *slot = &slots[num_slots];
+
+		slot->batch = &batch;
+		slot->stransfer = get_sync_transfer(dev_handle, 0);
+		if (!slot->stransfer)
+			break;
+		if (!control_batch_submit(slot)) {
+			num_slots++;
+			break;
+		}
+	}
+	if (num_slots == 0) {
+		free(slots);
+		return LIBUSB_ERROR_NO_MEM;
+	}
+
+	for (;;) {
+		batch.completed = 0;
+		if (!batch.in_flight)
+			break;
+
+		if (domain)
+			r = libusb_handle_domain_events_timeout_completed(domain,
+				NULL, &batch.completed);
+		else
+			r = libusb_handle_events_completed(ctx, &batch.completed);
+		if (r < 0 && r != LIBUSB_ERROR_INTERRUPTED && !batch.stopped) {
+			usbi_err(ctx, "libusb_handle_events failed: %s, cancelling batch",
+				 libusb_error_name(r));
+			batch.stopped = 1;
+			for (i = 0; i < num_slots; i++) {
+				if (slots[i].stransfer)
+					libusb_cancel_transfer(slots[i].stransfer->transfer);
+			}
+		}
+	}
+
+	/* the requests never submitted after the batch was stopped */
+	for (i = batch.next; i < num_requests; i++) {
+		requests[i].result = LIBUSB_ERROR_IO;
+		batch.failed++;
+	}
+
+	for (i = 0; i < num_slots; i++) {
+		if (slots[i].stransfer)
+			put_sync_transfer(dev_handle, slots[i].stransfer);
+	}
+	free(slots);
+	return batch.failed;
+}
+
+static int sync_bulk_single_packet(struct libusb_device_handle *dev_handle,
+	unsigned char endpoint, int length)
+{
+	struct usbi_endpoint_info info;
+
+	if (usbi_device_get_endpoint_info(dev_handle->dev, endpoint, &info) < 0)
+		return 0;
+	return length <= (info.max_packet & 0x7ff);
+}
+
 static int do_sync_bulk_transfer(struct libusb_device_handle *dev_handle,
 	unsigned char endpoint, unsigned char *buffer, int length,
 	int *transferred, unsigned int timeout, unsigned char type)
 {
-	struct libusb_transfer *transfer = libusb_alloc_transfer(0);
-	int completed = 0;
+	struct usbi_sync_transfer *stransfer;
+	struct libusb_transfer *transfer;
 	int r;
 
-	if (!transfer)
+	/* we would not learn how much data made it across before the timeout
+	 * expired, so only transfers of a single packet, which either make it
+	 * or not, can take the fast path */
+	if (usbi_backend->sync_bulk_transfer &&
+			sync_bulk_single_packet(dev_handle, endpoint, length) &&
+			sync_fast_path_possible(dev_handle, timeout)) {
+		r = usbi_backend->sync_bulk_transfer(dev_handle, endpoint, buffer,
+			length, timeout);
+		if (r >= 0) {
+			*transferred = r;
+			return 0;
+		} else if (r != LIBUSB_ERROR_NOT_SUPPORTED) {
+			*transferred = 0;
+			return r;
+		}
+	}
+
+	stransfer = get_sync_transfer(dev_handle, 0);
+	if (!stransfer)
 		return LIBUSB_ERROR_NO_MEM;
+	transfer = stransfer->transfer;
 
 	libusb_fill_bulk_transfer(transfer, dev_handle, endpoint, buffer, length,
-		sync_transfer_cb, &completed, timeout);
+		sync_transfer_cb, &stransfer->completed, timeout);
 	transfer->type = type;
 
 	r = libusb_submit_transfer(transfer);
 	if (r < 0) {
-		libusb_free_transfer(transfer);
+		put_sync_transfer(dev_handle, stransfer);
 		return r;
 	}
 
 	sync_transfer_wait_for_completion(transfer);
 
 	*transferred = transfer->actual_length;
-	switch (transfer->status) {
-	case LIBUSB_TRANSFER_COMPLETED:
-		r = 0;
-		break;
-	case LIBUSB_TRANSFER_TIMED_OUT:
-		r = LIBUSB_ERROR_TIMEOUT;
-		break;
-	case LIBUSB_TRANSFER_STALL:
-		r = LIBUSB_ERROR_PIPE;
-		break;
-	case LIBUSB_TRANSFER_OVERFLOW:
-		r = LIBUSB_ERROR_OVERFLOW;
-		break;
-	case LIBUSB_TRANSFER_NO_DEVICE:
-		r = LIBUSB_ERROR_NO_DEVICE;
-		break;
-	case LIBUSB_TRANSFER_ERROR:
-	case LIBUSB_TRANSFER_CANCELLED:
-		r = LIBUSB_ERROR_IO;
-		break;
-	default:
-		usbi_warn(HANDLE_CTX(dev_handle),
-			"unrecognised status code %d", transfer->status);
-		r = LIBUSB_ERROR_OTHER;
-	}
+	r = sync_transfer_result(transfer);
 
-	libusb_free_transfer(transfer);
+	put_sync_transfer(dev_handle, stransfer);
 	return r;
 }
 
@@ -0,0 +1,265 @@
+/*
+ * libusb descriptor parsing benchmark and fuzzer
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * Times parsing and freeing of the configuration and BOS descriptors in the
+ * given corpus files, as done for every device at enumeration. Files ending
+ * in ".bos" hold a BOS descriptor, all others a configuration descriptor.
+ * The files contain hexadecimal bytes; '#' starts a comment that runs to the
+ * end of the line. A corpus is in tests/descriptors.
+ *
+ * With -f, the descriptors are instead randomly corrupted before each parse,
+ * to be run under a memory checker. The seed given with -s makes runs
+ * reproducible.
+ *
+ * This program calls the parsers directly, so it links against the static
+ * library.
+ *
+ * Usage: desc_bench [-n iterations] [-f] [-s seed] file...
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "libusbi.h"
+
+struct corpus_entry {
+	const char *name;
+	int is_bos;
+	unsigned char *data;
+	int size;
+};
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int load_entry(const char *name, struct corpus_entry *entry)
+{
+	FILE *f = fopen(name, "r");
+	unsigned char *data = NULL;
+	int size = 0, capacity = 0;
+	unsigned int byte;
+	int c;
+
+	if (!f) {
+		perror(name);
+		return -1;
+	}
+
+	for (;;) {
+		c = fgetc(f);
+		if (c == EOF)
+			break;
+		if (c == '#') {
+			while (c != EOF && c != '\n')
+				c = fgetc(f);
+			continue;
+		}
+		if (c == ' ' || c == '\t' || c == '\r' || c == '\n')
+			continue;
+		ungetc(c, f);
+		if (fscanf(f, "%2x", &byte) != 1) {
+			fprintf(stderr, "%s: bad data at byte %d\n", name, size);
+			goto err;
+		}
+		if (size == capacity) {
+			capacity = capacity ? capacity * 2 : 256;
+			data = usbi_reallocf(data, capacity);
+			if (!data)
+				goto err;
+		}
+		data[size++] = (unsigned char)byte;
+	}
+	fclose(f);
+	if (size == 0) {
+		fprintf(stderr, "%s: no data\n", name);
+		return -1;
+	}
+
+	entry->name = name;
+	entry->is_bos = strlen(name) > 4 &&
+		!strcmp(name + strlen(name) - 4, ".bos");
+	entry->data = data;
+	entry->size = size;
+	return 0;
+
+err:
+	fclose(f);
+	free(data);
+	return -1;
+}
+
+/* parses one descriptor and frees the result. returns the number of
+ * interfaces or capabilities found, or a LIBUSB_ERROR code */
+static int parse_entry(const struct corpus_entry *entry, unsigned char *buf,
+	int size)
+{
+	struct libusb_config_descriptor *config;
+	struct libusb_bos_descriptor *bos;
+	int r;
+
+	if (entry->is_bos) {
+		r = usbi_parse_raw_bos_descriptor(NULL, buf, size, &bos);
+		if (r < 0)
+			return r;
+		r = bos->bNumDeviceCaps;
+		libusb_free_bos_descriptor(bos);
+	} else {
+		r = usbi_parse_raw_config_descriptor(NULL, buf, size, &config);
+		if (r < 0)
+			return r;
+		r = config->bNumInterfaces;
+		libusb_free_config_descriptor(config);
+	}
+	return r;
+}
+
+static int bench_entry(const struct corpus_entry *entry, int iterations)
+{
+	unsigned char *buf = malloc(entry->size);
+	double start, elapsed;
+	int i, r = 0;
+
+	if (!buf)
+		return LIBUSB_ERROR_NO_MEM;
+
+	start = now_ns();
+	for (i = 0; i < iterations; i++) {
+		/* the parsers may convert the buffer in place */
+		memcpy(buf, entry->data, entry->size);
+		r = parse_entry(entry, buf, entry->size);
+		if (r < 0)
+			break;
+	}
+	elapsed = now_ns() - start;
+	free(buf);
+
+	if (r < 0) {
+		fprintf(stderr, "%s: parse failed: %s\n", entry->name,
+			libusb_error_name(r));
+		return r;
+	}
+	printf("%-40s %5d bytes %3d %s %9.1f ns/parse\n", entry->name,
+		entry->size, r, entry->is_bos ? "caps  " : "ifaces",
+		elapsed / iterations);
+	return 0;
+}
+
+static unsigned int next_random(unsigned int *state)
+{
+	*state = *state * 1103515245 + 12345;
+	return (*state >> 16) & 0x7fff;
+}
+
+static int fuzz_entry(const struct corpus_entry *entry, int iterations,
+	unsigned int *seed)
+{
+	unsigned char *buf = malloc(entry->size);
+	int accepted = 0;
+	int i, j, flips, size;
+
+	if (!buf)
+		return LIBUSB_ERROR_NO_MEM;
+
+	for (i = 0; i < iterations; i++) {
+		memcpy(buf, entry->data, entry->size);
+		size = entry->size;
+		flips = 1 + next_random(seed) % 4;
+		for (j = 0; j < flips; j++)
+			buf[next_random(seed) % size] = (unsigned char)next_random(seed);
+		if (next_random(seed) % 4 == 0)
+			size = next_random(seed) % (size + 1);
+
+		/* a copy of exactly the corrupted size, so that a memory
+		 * checker catches reads past its end */
+		{
+			unsigned char *copy = malloc(size ? size : 1);
+
+			if (!copy) {
+				free(buf);
+				return LIBUSB_ERROR_NO_MEM;
+			}
+			memcpy(copy, buf, size);
+			if (parse_entry(entry, copy, size) >= 0)
+				accepted++;
+			free(copy);
+		}
+	}
+	free(buf);
+
+	printf("%-40s %9d mutations, %9d parsed\n", entry->name, iterations,
+		accepted);
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	struct corpus_entry *entries;
+	unsigned int seed = 1;
+	int iterations = 100000;
+	int fuzz = 0;
+	int num_entries = 0;
+	int i, r = 0;
+
+	entries = calloc(argc, sizeof(*entries));
+	if (!entries)
+		return 1;
+
+	for (i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-n") && i + 1 < argc) {
+			iterations = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "-s") && i + 1 < argc) {
+			seed = (unsigned int)strtoul(argv[++i], NULL, 0);
+		} else if (!strcmp(argv[i], "-f")) {
+			fuzz = 1;
+		} else if (argv[i][0] == '-') {
+			num_entries = 0;
+			break;
+		} else {
+			if (load_entry(argv[i], &entries[num_entries]) < 0)
+				return 1;
+			num_entries++;
+		}
+	}
+	if (num_entries == 0 || iterations <= 0) {
+		fprintf(stderr, "usage: %s [-n iterations] [-f] [-s seed] "
+			"file...\n", argv[0]);
+		return 1;
+	}
+
+	for (i = 0; i < num_entries && r == 0; i++) {
+		if (fuzz)
+			r = fuzz_entry(&entries[i], iterations, &seed);
+		else
+			r = bench_entry(&entries[i], iterations);
+	}
+
+	for (i = 0; i < num_entries; i++)
+		free(entries[i].data);
+	free(entries);
+	return r < 0;
+}
@@ -0,0 +1,712 @@
+/*
+ * libusb core microbenchmarks
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * Times the hardware independent paths of the library against the mock
+ * backend (configure --enable-mock-backend): transfer allocation, the
+ * submission and completion bookkeeping with many transfers in flight,
+ * control requests one by one and batched,
+ * event handling across many open handles, bulk and isochronous streams
+ * handled by the context and by an event domain, configuration descriptor
+ * parsing, endpoint and string lookups, hotplug callback matching, and
+ * opening a device with and without device discovery.
+ *
+ * -g sets the timeout granularity of the transfer benchmarks in milliseconds,
+ * -b makes them busy poll the handles for that many microseconds.
+ *
+ * Usage: mock_bench [-n iterations] [-d devices] [-q depth] [-c callbacks]
+ *                   [-g granularity] [-b budget]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "libusb.h"
+
+struct bench_options {
+	int iterations;
+	int devices;
+	int depth;
+	int callbacks;
+	int granularity;
+	int busy_poll;
+};
+
+struct transfer_state {
+	int remaining;
+	int in_flight;
+	int completed;
+	int error;
+};
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void report(const char *name, int ops, double start)
+{
+	double elapsed = now_ns() - start;
+
+	printf("%-24s %9d ops %10.1f ns/op\n", name, ops,
+		ops ? elapsed / ops : 0);
+}
+
+static void setenv_int(const char *name, int value)
+{
+	char buf[16];
+
+	snprintf(buf, sizeof(buf), "%d", value);
+	setenv(name, buf, 1);
+}
+
+static int bench_alloc(const struct bench_options *opts)
+{
+	struct libusb_transfer *transfer;
+	double start;
+	int i;
+
+	start = now_ns();
+	for (i = 0; i < opts->iterations; i++) {
+		transfer = libusb_alloc_transfer(0);
+		if (!transfer)
+			return LIBUSB_ERROR_NO_MEM;
+		libusb_free_transfer(transfer);
+	}
+	report("alloc_transfer", opts->iterations, start);
+
+	start = now_ns();
+	for (i = 0; i < opts->iterations; i++) {
+		transfer = libusb_alloc_transfer(32);
+		if (!transfer)
+			return LIBUSB_ERROR_NO_MEM;
+		libusb_free_transfer(transfer);
+	}
+	report("alloc_transfer(32 iso)", opts->iterations, start);
+	return 0;
+}
+
+static void LIBUSB_CALL transfer_cb(struct libusb_transfer *transfer)
+{
+	struct transfer_state *state = transfer->user_data;
+
+	state->in_flight--;
+	if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+		state->error = LIBUSB_ERROR_IO;
+		return;
+	}
+	state->completed++;
+	if (state->remaining > 0 && !state->error) {
+		if (libusb_submit_transfer(transfer) < 0) {
+			state->error = LIBUSB_ERROR_IO;
+			return;
+		}
+		state->remaining--;
+		state->in_flight++;
+	}
+}
+
+/* keeps up to depth transfers in flight, spread over the handles, until
+ * total transfers have completed */
+static int run_transfers(libusb_context *ctx, libusb_device_handle **handles,
+	int num_handles, int depth, int total, const char *name)
+{
+	struct libusb_transfer **transfers;
+	struct transfer_state state;
+	unsigned char *buffers;
+	double start;
+	int i, r = 0;
+
+	memset(&state, 0, sizeof(state));
+	state.remaining = total;
+
+	transfers = calloc(depth, sizeof(*transfers));
+	buffers = calloc(depth, 64);
+	if (!transfers || !buffers) {
+		free(transfers);
+		free(buffers);
+		return LIBUSB_ERROR_NO_MEM;
+	}
+	for (i = 0; i < depth; i++) {
+		transfers[i] = libusb_alloc_transfer(0);
+		if (!transfers[i]) {
+			r = LIBUSB_ERROR_NO_MEM;
+			goto out;
+		}
+		/* different timeouts keep the timeout ordering busy */
+		libusb_fill_bulk_transfer(transfers[i], handles[i % num_handles],
+			0x81, buffers + i * 64, 64, transfer_cb, &state,
+			1000 + (i * 7919) % 5000);
+	}
+
+	start = now_ns();
+	for (i = 0; i < depth && state.remaining > 0; i++) {
+		r = libusb_submit_transfer(transfers[i]);
+		if (r < 0)
+			break;
+		state.remaining--;
+		state.in_flight++;
+	}
+	while (state.in_flight > 0) {
+		r = libusb_handle_events(ctx);
+		if (r < 0 && r != LIBUSB_ERROR_INTERRUPTED)
+			break;
+		r = 0;
+	}
+	report(name, state.completed, start);
+	if (!r)
+		r = state.error;
+
+out:
+	for (i = 0; i < depth; i++)
+		libusb_free_transfer(transfers[i]);
+	free(transfers);
+	free(buffers);
+	return r;
+}
+
+/* small vendor requests, made one by one and then as batches */
+static int run_control(libusb_device_handle *handle, int total, int depth)
+{
+	struct libusb_control_request *requests;
+	unsigned char data[8];
+	char name[32];
+	double start;
+	int i, r = 0;
+
+	memset(data, 0, sizeof(data));
+	start = now_ns();
+	for (i = 0; i < total; i++) {
+		r = libusb_control_transfer(handle, LIBUSB_REQUEST_TYPE_VENDOR |
+			LIBUSB_RECIPIENT_DEVICE | LIBUSB_ENDPOINT_OUT, 0x01,
+			(uint16_t)i, 0, data, sizeof(data), 1000);
+		if (r < 0)
+			return r;
+	}
+	report("control", total, start);
+
+	requests = calloc(total, sizeof(*requests));
+	if (!requests)
+		return LIBUSB_ERROR_NO_MEM;
+	for (i = 0; i < total; i++) {
+		requests[i].bmRequestType = LIBUSB_REQUEST_TYPE_VENDOR |
+			LIBUSB_RECIPIENT_DEVICE | LIBUSB_ENDPOINT_OUT;
+		requests[i].bRequest = 0x01;
+		requests[i].wValue = (uint16_t)i;
+		requests[i].wLength = sizeof(data);
+		requests[i].data = data;
+	}
+	snprintf(name, sizeof(name), "control batch depth %d", depth);
+	start = now_ns();
+	r = libusb_control_transfer_batch(handle, requests, total, depth, 1000);
+	if (r > 0)
+		r = requests[0].result < 0 ? requests[0].result : LIBUSB_ERROR_IO;
+	else
+		report(name, total, start);
+	free(requests);
+	return r;
+}
+
+static int bench_transfers(const struct bench_options *opts)
+{
+	libusb_context *ctx;
+	libusb_device **list;
+	libusb_device_handle **handles;
+	char name[32];
+	ssize_t count;
+	int i, num_handles = 0, r;
+
+	setenv_int("LIBUSB_MOCK_DEVICES", opts->devices);
+	setenv_int("LIBUSB_MOCK_REPLUG", 0);
+	r = libusb_init(&ctx);
+	if (r < 0)
+		return r;
+	r = libusb_set_timeout_granularity(ctx, opts->granularity);
+	if (r < 0) {
+		libusb_exit(ctx);
+		return r;
+	}
+
+	count = libusb_get_device_list(ctx, &list);
+	if (count <= 0) {
+		libusb_exit(ctx);
+		return count < 0 ? (int)count : LIBUSB_ERROR_NOT_FOUND;
+	}
+	handles = calloc(count, sizeof(*handles));
+	if (!handles) {
+		r = LIBUSB_ERROR_NO_MEM;
+		goto out;
+	}
+
+	r = libusb_open(list[0], &handles[0]);
+	if (r < 0)
+		goto out;
+	num_handles = 1;
+	if (opts->busy_poll) {
+		r = libusb_set_busy_poll(handles[0], opts->busy_poll);
+		if (r < 0)
+			goto out;
+	}
+	snprintf(name, sizeof(name), "bulk depth %d", opts->depth);
+	r = run_transfers(ctx, handles, 1, opts->depth, opts->iterations, name);
+	if (r < 0)
+		goto out;
+	r = run_transfers(ctx, handles, 1, 1, opts->iterations, "bulk depth 1");
+	if (r < 0)
+		goto out;
+	r = run_control(handles[0], opts->iterations,
+		opts->depth < 32 ? opts->depth : 32);
+	if (r < 0)
+		goto out;
+
+	for (; num_handles < count; num_handles++) {
+		r = libusb_open(list[num_handles], &handles[num_handles]);
+		if (r < 0)
+			goto out;
+	}
+	snprintf(name, sizeof(name), "bulk over %d handles", num_handles);
+	r = run_transfers(ctx, handles, num_handles, num_handles,
+		opts->iterations, name);
+	if (r < 0)
+		goto out;
+
+	/* opening and closing a handle changes the set of polled fds */
+	{
+		struct timeval tv = { 0, 0 };
+		libusb_device_handle *handle;
+		double start = now_ns();
+
+		for (i = 0; i < opts->iterations / 10; i++) {
+			r = libusb_open(list[0], &handle);
+			if (r < 0)
+				goto out;
+			libusb_handle_events_timeout(ctx, &tv);
+			libusb_close(handle);
+			libusb_handle_events_timeout(ctx, &tv);
+		}
+		report("open/close + events", i, start);
+	}
+
+out:
+	for (i = 0; i < num_handles; i++)
+		libusb_close(handles[i]);
+	free(handles);
+	libusb_free_device_list(list, 1);
+	libusb_exit(ctx);
+	return r;
+}
+
+struct stream_state {
+	int remaining;
+	int done;
+};
+
+static int LIBUSB_CALL bulk_stream_cb(unsigned char *buffer, int length,
+	void *user_data)
+{
+	struct stream_state *state = user_data;
+
+	if (state->remaining > 0 && --state->remaining == 0)
+		state->done = 1;
+	return 0;
+}
+
+/* handles the events of the domain, or of the context without one */
+static int handle_stream_events(libusb_context *ctx,
+	struct libusb_event_domain *domain, int *completed)
+{
+	int r;
+
+	if (domain)
+		r = libusb_handle_domain_events_timeout_completed(domain, NULL,
+			completed);
+	else
+		r = libusb_handle_events_completed(ctx, completed);
+	return r == LIBUSB_ERROR_INTERRUPTED ? 0 : r;
+}
+
+/* a bulk stream taking total transfers, with its events handled by the
+ * context or by the event domain of the handle, and then stopped */
+static int run_bulk_stream(libusb_context *ctx, libusb_device_handle *handle,
+	struct libusb_event_domain *domain, int total, const char *name)
+{
+	struct libusb_bulk_stream *stream;
+	struct stream_state state;
+	double start;
+	int r;
+
+	state.remaining = total;
+	state.done = 0;
+	stream = libusb_alloc_bulk_stream(handle, 0x81, 64, 4, 32,
+		bulk_stream_cb, &state);
+	if (!stream)
+		return LIBUSB_ERROR_NO_MEM;
+
+	start = now_ns();
+	r = libusb_bulk_stream_start(stream);
+	while (r == 0 && !state.done)
+		r = handle_stream_events(ctx, domain, &state.done);
+	if (r == 0)
+		r = libusb_bulk_stream_stop(stream);
+	if (r == 0)
+		report(name, total, start);
+	libusb_free_bulk_stream(stream);
+	return r;
+}
+
+/* an isochronous stream on endpoint 0x83 until total packets have been
+ * read from its ring, and then stopped */
+static int run_iso_stream(libusb_context *ctx, libusb_device_handle *handle,
+	struct libusb_event_domain *domain, int total, const char *name)
+{
+	struct libusb_iso_stream_packet packets[32];
+	struct libusb_iso_stream *stream;
+	double start;
+	int n, received = 0, r;
+
+	stream = libusb_alloc_iso_stream(handle, 0x83, 1024, 8, 4, 256, NULL);
+	if (!stream)
+		return LIBUSB_ERROR_NO_MEM;
+
+	start = now_ns();
+	r = libusb_iso_stream_start(stream);
+	while (r == 0 && received < total) {
+		n = libusb_iso_stream_read(stream, packets, 32);
+		if (n > 0) {
+			libusb_iso_stream_release(stream, n);
+			received += n;
+		} else {
+			r = handle_stream_events(ctx, domain, NULL);
+		}
+	}
+	if (r == 0)
+		r = libusb_iso_stream_stop(stream);
+	if (r == 0)
+		report(name, received, start);
+	libusb_free_iso_stream(stream);
+	return r;
+}
+
+static int bench_streams(const struct bench_options *opts)
+{
+	struct libusb_event_domain *domain;
+	libusb_context *ctx;
+	libusb_device **list;
+	libusb_device_handle *handle;
+	ssize_t count;
+	int r;
+
+	setenv_int("LIBUSB_MOCK_DEVICES", opts->devices);
+	setenv_int("LIBUSB_MOCK_REPLUG", 0);
+	r = libusb_init(&ctx);
+	if (r < 0)
+		return r;
+
+	count = libusb_get_device_list(ctx, &list);
+	if (count <= 0) {
+		libusb_exit(ctx);
+		return count < 0 ? (int)count : LIBUSB_ERROR_NOT_FOUND;
+	}
+	r = libusb_open(list[0], &handle);
+	libusb_free_device_list(list, 1);
+	if (r < 0) {
+		libusb_exit(ctx);
+		return r;
+	}
+
+	r = run_bulk_stream(ctx, handle, NULL, opts->iterations, "bulk stream");
+	if (r == 0)
+		r = run_iso_stream(ctx, handle, NULL, opts->iterations,
+			"iso stream");
+	if (r < 0)
+		goto out;
+
+	domain = libusb_alloc_event_domain(ctx);
+	if (!domain) {
+		r = LIBUSB_ERROR_NO_MEM;
+		goto out;
+	}
+	r = libusb_set_event_domain(handle, domain);
+	if (r == 0)
+		r = run_bulk_stream(ctx, handle, domain, opts->iterations,
+			"bulk stream in domain");
+	if (r == 0)
+		r = run_iso_stream(ctx, handle, domain, opts->iterations,
+			"iso stream in domain");
+	libusb_set_event_domain(handle, NULL);
+	libusb_free_event_domain(domain);
+
+out:
+	libusb_close(handle);
+	libusb_exit(ctx);
+	return r;
+}
+
+static int bench_descriptors(const struct bench_options *opts)
+{
+	struct libusb_config_descriptor *config;
+	libusb_context *ctx;
+	libusb_device **list;
+	ssize_t count;
+	double start;
+	int i, r;
+
+	setenv_int("LIBUSB_MOCK_DEVICES", opts->devices);
+	setenv_int("LIBUSB_MOCK_REPLUG", 0);
+	r = libusb_init(&ctx);
+	if (r < 0)
+		return r;
+
+	start = now_ns();
+	for (i = 0; i < opts->iterations / 10; i++) {
+		count = libusb_get_device_list(ctx, &list);
+		if (count < 0) {
+			r = (int)count;
+			goto out;
+		}
+		libusb_free_device_list(list, 1);
+	}
+	report("get_device_list", i, start);
+
+	count = libusb_get_device_list(ctx, &list);
+	if (count <= 0) {
+		r = count < 0 ? (int)count : LIBUSB_ERROR_NOT_FOUND;
+		goto out;
+	}
+	start = now_ns();
+	for (i = 0; i < opts->iterations; i++) {
+		r = libusb_get_config_descriptor(list[i % count], 0, &config);
+		if (r < 0)
+			break;
+		libusb_free_config_descriptor(config);
+	}
+	report("get_config_descriptor", i, start);
+
+	start = now_ns();
+	for (i = 0; i < opts->iterations; i++) {
+		r = libusb_get_max_iso_packet_size(list[i % count], 0x83);
+		if (r < 0)
+			break;
+	}
+	report("get_max_iso_packet_size", i, start);
+
+	/* reads the language list and the string, unless LIBUSB_CACHE_STRINGS
+	 * is set */
+	{
+		libusb_device_handle *handle;
+		unsigned char str[64];
+
+		r = libusb_open(list[0], &handle);
+		if (r < 0)
+			goto free_list;
+		start = now_ns();
+		for (i = 0; i < opts->iterations / 10; i++) {
+			r = libusb_get_string_descriptor_ascii(handle, 2, str,
+				sizeof(str));
+			if (r < 0)
+				break;
+		}
+		report("get_string_descriptor", i, start);
+		libusb_close(handle);
+	}
+
+free_list:
+	libusb_free_device_list(list, 1);
+
+out:
+	libusb_exit(ctx);
+	return r < 0 ? r : 0;
+}
+
+static int LIBUSB_CALL hotplug_cb(libusb_context *ctx, libusb_device *dev,
+	libusb_hotplug_event event, void *user_data)
+{
+	int *calls = user_data;
+
+	(*calls)++;
+	return 0;
+}
+
+static int bench_hotplug(const struct bench_options *opts)
+{
+	struct timeval tv = { 0, 0 };
+	libusb_context *ctx;
+	libusb_device **list;
+	ssize_t count;
+	double start;
+	int calls = 0;
+	int replug = opts->devices < 16 ? opts->devices : 16;
+	int i, r;
+
+	setenv_int("LIBUSB_MOCK_DEVICES", opts->devices);
+	setenv_int("LIBUSB_MOCK_REPLUG", replug);
+	r = libusb_init(&ctx);
+	if (r < 0)
+		return r;
+
+	/* a mix of callbacks for one product, for the vendor and for all
+	 * devices */
+	for (i = 0; i < opts->callbacks; i++) {
+		int vendor_id = LIBUSB_HOTPLUG_MATCH_ANY;
+		int product_id = LIBUSB_HOTPLUG_MATCH_ANY;
+
+		if (i % 4 != 3)
+			vendor_id = 0x1209;
+		if (i % 2 == 0)
+			product_id = i % (opts->devices ? opts->devices : 1);
+		r = libusb_hotplug_register_callback(ctx,
+			LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED |
+			LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT, 0, vendor_id,
+			product_id, LIBUSB_HOTPLUG_MATCH_ANY, hotplug_cb, &calls,
+			NULL);
+		if (r < 0)
+			goto out;
+	}
+
+	start = now_ns();
+	for (i = 0; i < opts->iterations / 100; i++) {
+		count = libusb_get_device_list(ctx, &list);
+		if (count < 0) {
+			r = (int)count;
+			goto out;
+		}
+		libusb_free_device_list(list, 1);
+		libusb_handle_events_timeout(ctx, &tv);
+	}
+	report("hotplug events", i * replug * 2, start);
+	printf("%-24s %9d\n", "hotplug callbacks", calls);
+
+out:
+	libusb_exit(ctx);
+	return r < 0 ? r : 0;
+}
+
+/* from libusb_init() to an open handle on the last device: by discovering
+ * the devices and looking it up in the device list, or by wrapping the
+ * handle of the system without discovery */
+static int open_last_device(int wrap, int devices)
+{
+	libusb_context *ctx;
+	libusb_device_handle *handle;
+	libusb_device **list;
+	ssize_t count;
+	int r;
+
+	libusb_set_device_discovery(!wrap);
+	r = libusb_init(&ctx);
+	libusb_set_device_discovery(1);
+	if (r < 0)
+		return r;
+
+	if (wrap) {
+		r = libusb_wrap_sys_device(ctx, devices - 1, &handle);
+	} else {
+		count = libusb_get_device_list(ctx, &list);
+		if (count < devices) {
+			if (count >= 0)
+				libusb_free_device_list(list, 1);
+			libusb_exit(ctx);
+			return count < 0 ? (int)count : LIBUSB_ERROR_NOT_FOUND;
+		}
+		r = libusb_open(list[devices - 1], &handle);
+		libusb_free_device_list(list, 1);
+	}
+	if (r == 0)
+		libusb_close(handle);
+	libusb_exit(ctx);
+	return r;
+}
+
+static int bench_startup(const struct bench_options *opts)
+{
+	double start;
+	int i, r = 0;
+
+	setenv_int("LIBUSB_MOCK_DEVICES", opts->devices);
+	setenv_int("LIBUSB_MOCK_REPLUG", 0);
+
+	start = now_ns();
+	for (i = 0; i < opts->iterations / 100 && r == 0; i++)
+		r = open_last_device(0, opts->devices);
+	if (r < 0)
+		return r;
+	report("init+list+open", i, start);
+
+	start = now_ns();
+	for (i = 0; i < opts->iterations / 100 && r == 0; i++)
+		r = open_last_device(1, opts->devices);
+	if (r < 0)
+		return r;
+	report("init+wrap", i, start);
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	struct bench_options opts = { 100000, 100, 1000, 200, 0, 0 };
+	int i, r;
+
+	for (i = 1; i + 1 < argc; i += 2) {
+		int value = atoi(argv[i + 1]);
+
+		if (!strcmp(argv[i], "-n"))
+			opts.iterations = value;
+		else if (!strcmp(argv[i], "-d"))
+			opts.devices = value;
+		else if (!strcmp(argv[i], "-q"))
+			opts.depth = value;
+		else if (!strcmp(argv[i], "-c"))
+			opts.callbacks = value;
+		else if (!strcmp(argv[i], "-g"))
+			opts.granularity = value;
+		else if (!strcmp(argv[i], "-b"))
+			opts.busy_poll = value;
+		else
+			break;
+	}
+	if (i < argc || opts.iterations < 100 || opts.devices <= 0 ||
+			opts.depth <= 0 || opts.callbacks < 0 ||
+			opts.granularity < 0 || opts.busy_poll < 0) {
+		fprintf(stderr, "usage: %s [-n iterations] [-d devices] "
+			"[-q depth] [-c callbacks] [-g granularity] "
+			"[-b budget]\n", argv[0]);
+		return 1;
+	}
+
+	r = bench_alloc(&opts);
+	if (r == 0)
+		r = bench_transfers(&opts);
+	if (r == 0)
+		r = bench_streams(&opts);
+	if (r == 0)
+		r = bench_descriptors(&opts);
+	if (r == 0)
+		r = bench_hotplug(&opts);
+	if (r == 0)
+		r = bench_startup(&opts);
+	if (r < 0) {
+		fprintf(stderr, "benchmark failed: %s\n", libusb_error_name(r));
+		return 1;
+	}
+	return 0;
+}
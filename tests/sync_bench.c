@@ -0,0 +1,144 @@
+/*
+ * libusb synchronous transfer latency benchmark
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * Measures the round trip time of GET_STATUS control requests issued with
+ * libusb_control_transfer(), which may use the backend's synchronous fast
+ * path, against the same requests issued through the asynchronous API and
+ * the event loop.
+ *
+ * Usage: sync_bench VID:PID [iterations]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "libusb.h"
+
+static void LIBUSB_CALL bench_cb(struct libusb_transfer *transfer)
+{
+	int *completed = transfer->user_data;
+	*completed = 1;
+}
+
+static int async_get_status(libusb_device_handle *handle,
+	struct libusb_transfer *transfer, unsigned char *buffer)
+{
+	int completed = 0;
+	int r;
+
+	libusb_fill_control_setup(buffer, LIBUSB_ENDPOINT_IN,
+		LIBUSB_REQUEST_GET_STATUS, 0, 0, 2);
+	libusb_fill_control_transfer(transfer, handle, buffer, bench_cb,
+		&completed, 1000);
+	r = libusb_submit_transfer(transfer);
+	if (r < 0)
+		return r;
+	while (!completed) {
+		r = libusb_handle_events_completed(NULL, &completed);
+		if (r < 0 && r != LIBUSB_ERROR_INTERRUPTED)
+			return r;
+	}
+	if (transfer->status != LIBUSB_TRANSFER_COMPLETED)
+		return LIBUSB_ERROR_IO;
+	return transfer->actual_length;
+}
+
+static double elapsed_us(const struct timeval *start, const struct timeval *end)
+{
+	return (end->tv_sec - start->tv_sec) * 1e6 +
+		(end->tv_usec - start->tv_usec);
+}
+
+int main(int argc, char *argv[])
+{
+	libusb_device_handle *handle;
+	struct libusb_transfer *transfer;
+	unsigned char buffer[LIBUSB_CONTROL_SETUP_SIZE + 2];
+	struct timeval start, end;
+	unsigned int vid, pid;
+	int iterations = 10000;
+	int i, r;
+
+	if (argc < 2 || sscanf(argv[1], "%x:%x", &vid, &pid) != 2) {
+		fprintf(stderr, "usage: %s VID:PID [iterations]\n", argv[0]);
+		return 1;
+	}
+	if (argc > 2)
+		iterations = atoi(argv[2]);
+	if (iterations <= 0)
+		iterations = 1;
+
+	r = libusb_init(NULL);
+	if (r < 0) {
+		fprintf(stderr, "failed to initialise libusb: %s\n",
+			libusb_error_name(r));
+		return 1;
+	}
+
+	handle = libusb_open_device_with_vid_pid(NULL, (uint16_t)vid,
+		(uint16_t)pid);
+	if (!handle) {
+		fprintf(stderr, "could not open device %04x:%04x\n", vid, pid);
+		libusb_exit(NULL);
+		return 1;
+	}
+
+	transfer = libusb_alloc_transfer(0);
+	if (!transfer) {
+		libusb_close(handle);
+		libusb_exit(NULL);
+		return 1;
+	}
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < iterations; i++) {
+		r = libusb_control_transfer(handle, LIBUSB_ENDPOINT_IN,
+			LIBUSB_REQUEST_GET_STATUS, 0, 0, buffer, 2, 1000);
+		if (r < 0)
+			break;
+	}
+	gettimeofday(&end, NULL);
+	if (r < 0)
+		fprintf(stderr, "synchronous transfer failed: %s\n",
+			libusb_error_name(r));
+	else
+		printf("synchronous:  %d transfers, %.2f us per transfer\n",
+			iterations, elapsed_us(&start, &end) / iterations);
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < iterations; i++) {
+		r = async_get_status(handle, transfer, buffer);
+		if (r < 0)
+			break;
+	}
+	gettimeofday(&end, NULL);
+	if (r < 0)
+		fprintf(stderr, "asynchronous transfer failed: %s\n",
+			libusb_error_name(r));
+	else
+		printf("asynchronous: %d transfers, %.2f us per transfer\n",
+			iterations, elapsed_us(&start, &end) / iterations);
+
+	libusb_free_transfer(transfer);
+	libusb_close(handle);
+	libusb_exit(NULL);
+	return r < 0;
+}
@@ -0,0 +1,528 @@
+/*
+ * libusb transfer throughput and latency benchmark
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * Keeps a number of asynchronous transfers in flight on one endpoint and
+ * reports the throughput and the distribution of completion latencies.
+ * A transfer's latency is the time from its submission to the start of its
+ * callback. Each thread owns its own set of transfers and runs the event
+ * loop itself, so with more than one thread the threads also compete for
+ * the event handling lock.
+ *
+ * The transfer type is taken from the endpoint descriptor. Without a device
+ * argument, the Linux gadget zero device (0525:a4a0) is used. It sources
+ * data on endpoint 0x81 and sinks data on endpoint 0x01, and can be created
+ * without any hardware by loading the dummy_hcd and g_zero modules.
+ *
+ * Each thread keeps -q transfers of -s bytes in flight until it has
+ * completed -n transfers. Isochronous transfers are split into -p packets.
+ *
+ * With -c, a single comma separated line is printed, headed by the options
+ * that produced it, so runs from two builds can be compared directly.
+ *
+ * Usage: xfer_bench [-e endpoint] [-i interface] [-a altsetting]
+ *        [-s size] [-q depth] [-j threads] [-n transfers] [-p packets] [-c]
+ *        [VID:PID]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "libusb.h"
+
+struct bench_options {
+	unsigned int vid;
+	unsigned int pid;
+	unsigned char endpoint;
+	int interface;
+	int altsetting;
+	int size;
+	int depth;
+	int threads;
+	int count;
+	int packets;
+	int csv;
+};
+
+struct bench_thread {
+	pthread_t thread;
+	/* callbacks for this thread's transfers may run on any thread that
+	 * is handling events */
+	pthread_mutex_t lock;
+	libusb_device_handle *handle;
+	const struct bench_options *opts;
+	unsigned char type;
+	struct libusb_transfer **transfers;
+	double *submit_times;
+	double *latencies;
+	int submitted;
+	int completed;
+	int in_flight;
+	int done;
+	long long bytes;
+	int error;
+};
+
+static double now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int submit_next(struct bench_thread *bt, struct libusb_transfer *transfer,
+	int slot)
+{
+	int r;
+
+	if (bt->submitted >= bt->opts->count)
+		return 0;
+	bt->submit_times[slot] = now_us();
+	r = libusb_submit_transfer(transfer);
+	if (r < 0) {
+		bt->error = r;
+		return r;
+	}
+	bt->submitted++;
+	bt->in_flight++;
+	return 0;
+}
+
+static void LIBUSB_CALL bench_cb(struct libusb_transfer *transfer)
+{
+	struct bench_thread *bt = transfer->user_data;
+	double end = now_us();
+	int slot, i;
+
+	for (slot = 0; bt->transfers[slot] != transfer; slot++)
+		;
+
+	pthread_mutex_lock(&bt->lock);
+	bt->in_flight--;
+	if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+		if (!bt->error)
+			bt->error = LIBUSB_ERROR_IO;
+	} else {
+		if (bt->type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS) {
+			for (i = 0; i < transfer->num_iso_packets; i++)
+				bt->bytes += transfer->iso_packet_desc[i].actual_length;
+		} else {
+			bt->bytes += transfer->actual_length;
+		}
+		bt->latencies[bt->completed++] = end - bt->submit_times[slot];
+		if (!bt->error)
+			submit_next(bt, transfer, slot);
+	}
+	if (bt->in_flight == 0)
+		bt->done = 1;
+	pthread_mutex_unlock(&bt->lock);
+}
+
+static void *bench_thread_main(void *arg)
+{
+	struct bench_thread *bt = arg;
+	int i, r;
+
+	pthread_mutex_lock(&bt->lock);
+	for (i = 0; i < bt->opts->depth; i++) {
+		if (submit_next(bt, bt->transfers[i], i) < 0)
+			break;
+	}
+	if (bt->in_flight == 0)
+		bt->done = 1;
+	pthread_mutex_unlock(&bt->lock);
+
+	while (!bt->done) {
+		r = libusb_handle_events_completed(NULL, &bt->done);
+		if (r < 0 && r != LIBUSB_ERROR_INTERRUPTED) {
+			pthread_mutex_lock(&bt->lock);
+			bt->error = r;
+			pthread_mutex_unlock(&bt->lock);
+			break;
+		}
+	}
+	return NULL;
+}
+
+static int find_endpoint_type(libusb_device_handle *handle,
+	const struct bench_options *opts, unsigned char *type, int *packet_size)
+{
+	struct libusb_config_descriptor *config;
+	const struct libusb_interface_descriptor *altsetting;
+	int i, r;
+
+	r = libusb_get_active_config_descriptor(libusb_get_device(handle),
+		&config);
+	if (r < 0)
+		return r;
+
+	r = LIBUSB_ERROR_NOT_FOUND;
+	if (opts->interface < config->bNumInterfaces &&
+			opts->altsetting <
+			config->interface[opts->interface].num_altsetting) {
+		altsetting = &config->interface[opts->interface]
+			.altsetting[opts->altsetting];
+		for (i = 0; i < altsetting->bNumEndpoints; i++) {
+			const struct libusb_endpoint_descriptor *ep =
+				&altsetting->endpoint[i];
+			if (ep->bEndpointAddress != opts->endpoint)
+				continue;
+			*type = ep->bmAttributes & LIBUSB_TRANSFER_TYPE_MASK;
+			*packet_size = libusb_get_max_iso_packet_size(
+				libusb_get_device(handle), opts->endpoint);
+			r = 0;
+			break;
+		}
+	}
+
+	libusb_free_config_descriptor(config);
+	return r;
+}
+
+static int alloc_transfers(struct bench_thread *bt, int packet_size)
+{
+	const struct bench_options *opts = bt->opts;
+	int packets = 0;
+	int i;
+
+	bt->transfers = calloc(opts->depth, sizeof(*bt->transfers));
+	bt->submit_times = calloc(opts->depth, sizeof(*bt->submit_times));
+	bt->latencies = calloc(opts->count, sizeof(*bt->latencies));
+	if (!bt->transfers || !bt->submit_times || !bt->latencies)
+		return LIBUSB_ERROR_NO_MEM;
+
+	if (bt->type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS)
+		packets = opts->packets;
+
+	for (i = 0; i < opts->depth; i++) {
+		struct libusb_transfer *transfer = libusb_alloc_transfer(packets);
+		unsigned char *buffer = calloc(1, opts->size);
+
+		if (!transfer || !buffer) {
+			libusb_free_transfer(transfer);
+			free(buffer);
+			return LIBUSB_ERROR_NO_MEM;
+		}
+		switch (bt->type) {
+		case LIBUSB_TRANSFER_TYPE_ISOCHRONOUS:
+			libusb_fill_iso_transfer(transfer, bt->handle,
+				opts->endpoint, buffer, opts->size, packets,
+				bench_cb, bt, 1000);
+			libusb_set_iso_packet_lengths(transfer,
+				opts->size / packets < packet_size ?
+				opts->size / packets : packet_size);
+			break;
+		case LIBUSB_TRANSFER_TYPE_INTERRUPT:
+			libusb_fill_interrupt_transfer(transfer, bt->handle,
+				opts->endpoint, buffer, opts->size, bench_cb, bt, 1000);
+			break;
+		default:
+			libusb_fill_bulk_transfer(transfer, bt->handle,
+				opts->endpoint, buffer, opts->size, bench_cb, bt, 1000);
+			break;
+		}
+		transfer->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+		bt->transfers[i] = transfer;
+	}
+	return 0;
+}
+
+static void free_transfers(struct bench_thread *bt)
+{
+	int i;
+
+	if (bt->transfers) {
+		for (i = 0; i < bt->opts->depth; i++)
+			libusb_free_transfer(bt->transfers[i]);
+	}
+	free(bt->transfers);
+	free(bt->submit_times);
+	free(bt->latencies);
+}
+
+static int compare_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+static double percentile(const double *sorted, int n, double p)
+{
+	int i;
+
+	if (n == 0)
+		return 0;
+	i = (int)(p / 100 * n);
+	if (i >= n)
+		i = n - 1;
+	return sorted[i];
+}
+
+static const char *type_name(unsigned char type)
+{
+	switch (type) {
+	case LIBUSB_TRANSFER_TYPE_ISOCHRONOUS:
+		return "iso";
+	case LIBUSB_TRANSFER_TYPE_INTERRUPT:
+		return "interrupt";
+	case LIBUSB_TRANSFER_TYPE_BULK:
+		return "bulk";
+	default:
+		return "control";
+	}
+}
+
+static void report(const struct bench_options *opts, unsigned char type,
+	struct bench_thread *threads, double elapsed_us)
+{
+	static const double points[] = { 50, 90, 99, 99.9 };
+	double *all, result[4];
+	long long bytes = 0;
+	int total = 0, n = 0, i;
+
+	for (i = 0; i < opts->threads; i++) {
+		total += threads[i].completed;
+		bytes += threads[i].bytes;
+	}
+	all = malloc((total ? total : 1) * sizeof(*all));
+	if (!all)
+		return;
+	for (i = 0; i < opts->threads; i++) {
+		memcpy(all + n, threads[i].latencies,
+			threads[i].completed * sizeof(*all));
+		n += threads[i].completed;
+	}
+	qsort(all, n, sizeof(*all), compare_double);
+	for (i = 0; i < 4; i++)
+		result[i] = percentile(all, n, points[i]);
+
+	if (opts->csv) {
+		printf("type,endpoint,size,depth,threads,transfers,bytes,seconds,"
+			"MBps,p50_us,p90_us,p99_us,p999_us,max_us\n");
+		printf("%s,0x%02x,%d,%d,%d,%d,%lld,%.6f,%.3f,%.1f,%.1f,%.1f,"
+			"%.1f,%.1f\n", type_name(type), opts->endpoint, opts->size,
+			opts->depth, opts->threads, n, bytes, elapsed_us / 1e6,
+			bytes / elapsed_us, result[0], result[1], result[2],
+			result[3], n ? all[n - 1] : 0);
+	} else {
+		printf("%s endpoint 0x%02x, %d bytes, depth %d, %d thread(s)\n",
+			type_name(type), opts->endpoint, opts->size, opts->depth,
+			opts->threads);
+		printf("  %d transfers, %lld bytes in %.3f s: %.3f MB/s, "
+			"%.0f transfers/s\n", n, bytes, elapsed_us / 1e6,
+			bytes / elapsed_us, n / (elapsed_us / 1e6));
+		printf("  latency us: p50 %.1f  p90 %.1f  p99 %.1f  p99.9 %.1f  "
+			"max %.1f\n", result[0], result[1], result[2], result[3],
+			n ? all[n - 1] : 0);
+	}
+	free(all);
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "usage: %s [-e endpoint] [-i interface] [-a altsetting]"
+		" [-s size] [-q depth]\n"
+		"       [-j threads] [-n transfers] [-p packets] [-c] [VID:PID]\n",
+		name);
+}
+
+static int parse_options(int argc, char *argv[], struct bench_options *opts)
+{
+	int i;
+
+	opts->vid = 0x0525;
+	opts->pid = 0xa4a0;
+	opts->endpoint = 0x81;
+	opts->interface = 0;
+	opts->altsetting = 0;
+	opts->size = 16384;
+	opts->depth = 4;
+	opts->threads = 1;
+	opts->count = 10000;
+	opts->packets = 8;
+	opts->csv = 0;
+
+	for (i = 1; i < argc; i++) {
+		const char *arg = argv[i];
+
+		if (arg[0] != '-') {
+			if (sscanf(arg, "%x:%x", &opts->vid, &opts->pid) != 2)
+				return -1;
+			continue;
+		}
+		if (arg[1] == 'c' && arg[2] == '\0') {
+			opts->csv = 1;
+			continue;
+		}
+		if (arg[1] == '\0' || arg[2] != '\0' || ++i >= argc)
+			return -1;
+		switch (arg[1]) {
+		case 'e':
+			opts->endpoint = (unsigned char)strtoul(argv[i], NULL, 0);
+			break;
+		case 'i':
+			opts->interface = atoi(argv[i]);
+			break;
+		case 'a':
+			opts->altsetting = atoi(argv[i]);
+			break;
+		case 's':
+			opts->size = atoi(argv[i]);
+			break;
+		case 'q':
+			opts->depth = atoi(argv[i]);
+			break;
+		case 'j':
+			opts->threads = atoi(argv[i]);
+			break;
+		case 'n':
+			opts->count = atoi(argv[i]);
+			break;
+		case 'p':
+			opts->packets = atoi(argv[i]);
+			break;
+		default:
+			return -1;
+		}
+	}
+
+	if (opts->size <= 0 || opts->depth <= 0 || opts->threads <= 0 ||
+			opts->count <= 0 || opts->packets <= 0 ||
+			opts->interface < 0 || opts->altsetting < 0)
+		return -1;
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	struct bench_options opts;
+	struct bench_thread *threads;
+	libusb_device_handle *handle;
+	unsigned char type;
+	int packet_size = 0;
+	double start, end;
+	int i, r, started, ret = 1;
+
+	if (parse_options(argc, argv, &opts) < 0) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	r = libusb_init(NULL);
+	if (r < 0) {
+		fprintf(stderr, "failed to initialise libusb: %s\n",
+			libusb_error_name(r));
+		return 1;
+	}
+
+	handle = libusb_open_device_with_vid_pid(NULL, (uint16_t)opts.vid,
+		(uint16_t)opts.pid);
+	if (!handle) {
+		fprintf(stderr, "could not open device %04x:%04x\n", opts.vid,
+			opts.pid);
+		goto out_exit;
+	}
+	libusb_set_auto_detach_kernel_driver(handle, 1);
+
+	r = libusb_claim_interface(handle, opts.interface);
+	if (r < 0) {
+		fprintf(stderr, "could not claim interface %d: %s\n",
+			opts.interface, libusb_error_name(r));
+		goto out_close;
+	}
+	if (opts.altsetting) {
+		r = libusb_set_interface_alt_setting(handle, opts.interface,
+			opts.altsetting);
+		if (r < 0) {
+			fprintf(stderr, "could not select altsetting %d: %s\n",
+				opts.altsetting, libusb_error_name(r));
+			goto out_release;
+		}
+	}
+
+	r = find_endpoint_type(handle, &opts, &type, &packet_size);
+	if (r < 0) {
+		fprintf(stderr, "endpoint 0x%02x not found on interface %d "
+			"altsetting %d\n", opts.endpoint, opts.interface,
+			opts.altsetting);
+		goto out_release;
+	}
+	if (type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS && packet_size <= 0) {
+		fprintf(stderr, "could not get the iso packet size: %s\n",
+			libusb_error_name(packet_size));
+		goto out_release;
+	}
+
+	threads = calloc(opts.threads, sizeof(*threads));
+	if (!threads)
+		goto out_release;
+	for (i = 0; i < opts.threads; i++)
+		pthread_mutex_init(&threads[i].lock, NULL);
+	for (i = 0; i < opts.threads; i++) {
+		threads[i].handle = handle;
+		threads[i].opts = &opts;
+		threads[i].type = type;
+		r = alloc_transfers(&threads[i], packet_size);
+		if (r < 0) {
+			fprintf(stderr, "could not allocate transfers\n");
+			goto out_free;
+		}
+	}
+
+	start = now_us();
+	for (started = 0; started < opts.threads; started++) {
+		if (pthread_create(&threads[started].thread, NULL,
+				bench_thread_main, &threads[started]) != 0) {
+			fprintf(stderr, "could not start thread %d\n", started);
+			break;
+		}
+	}
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i].thread, NULL);
+	end = now_us();
+
+	ret = started < opts.threads;
+	for (i = 0; i < started; i++) {
+		if (threads[i].error) {
+			fprintf(stderr, "thread %d: %s\n", i,
+				libusb_error_name(threads[i].error));
+			ret = 1;
+		}
+	}
+	if (started > 0)
+		report(&opts, type, threads, end - start);
+
+out_free:
+	for (i = 0; i < opts.threads; i++) {
+		free_transfers(&threads[i]);
+		pthread_mutex_destroy(&threads[i].lock);
+	}
+	free(threads);
+out_release:
+	libusb_release_interface(handle, opts.interface);
+out_close:
+	libusb_close(handle);
+out_exit:
+	libusb_exit(NULL);
+	return ret;
+}